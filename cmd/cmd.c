@@ -53,6 +53,7 @@ void usage(char *app)
 
   printf("environment variables:\n");
   printf("  KATCP_SERVER     default server (overridden by -s option)\n");
+  printf("  KATCP_MUX        socket directory of a kcpmux daemon to attach through\n");
 
   printf("notes:\n");
   printf("  command and parameters have to be given as separate arguments\n");
@@ -413,7 +414,7 @@ int main(int argc, char **argv)
     }
   }
 
-  fd = net_connect(server, 0, flags);
+  fd = net_connect_mux(server, 0, flags);
   if(fd < 0){
     if(k){
       sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to connect to %s", server);
@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <time.h>
 #include <stdarg.h>
+#include <ctype.h>
 
 #include <sys/time.h>
 
@@ -26,6 +27,35 @@
 
 #define NAME   "k7-delay"
 
+#define DEFAULT_SERVER   "localhost:1235"
+#define DEFAULT_TIMEOUT  20
+#define RECORD_LINE      1024
+
+#define FIELD_ANTPOL        0
+#define FIELD_LOADTIME      1
+#define FIELD_DELAY         2
+#define FIELD_DELAYRATE     3
+#define FIELD_FRINGE        4
+#define FIELD_FRINGERATE    5
+#define RECORD_FIELDS       6
+
+#define RECORD_INVALID      0
+#define RECORD_LATE         1
+#define RECORD_SENT         2
+#define RECORD_OK           3
+#define RECORD_FAIL         4
+
+#define DELAY_RESULT_INFORM "#delay-result"
+
+static char *record_states[] = { "invalid", "late", "sent", "ok", "fail" };
+
+struct delay_record{
+  char *r_antpol;
+  char *r_fields;
+  int r_state;
+  char *r_reason;
+};
+
 int complete_with_log(struct katcl_line *l, struct timeval *until, struct katcl_line *k)
 {
   struct katcl_parse *px;
@@ -47,13 +77,362 @@ int complete_with_log(struct katcl_line *l, struct timeval *until, struct katcl_
   return result;
 }
 
+static int parse_value(char *string, long double *value)
+{
+  char *end;
+
+  if(string == NULL){
+    return -1;
+  }
+
+  *value = strtold(string, &end);
+  if((end == string) || (*end != '\0') || !isfinite(*value)){
+    return -1;
+  }
+
+  return 0;
+}
+
+/* checks and converts one set of fields (in command line order), queues the request, returns the field at fault or -1 */
+
+int append_delay(struct katcl_line *l, struct katcl_line *k, char **fields, struct timeval *request)
+{
+  long double values[RECORD_FIELDS], fringe, rate, value, tmp;
+  int i;
+
+  for(i = FIELD_LOADTIME; i < RECORD_FIELDS; i++){
+    if(parse_value(fields[i], &(values[i])) < 0){
+      return i;
+    }
+  }
+
+  fringe = values[FIELD_FRINGE] * 180.0 * OVERPI;
+#ifdef FORGIVE_LARGE
+  fringe = fmodl(fringe, 360.0);
+#endif
+  rate = values[FIELD_FRINGERATE] * 500.0 * OVERPI;
+  value = values[FIELD_LOADTIME] / 1000.0;
+
+  append_string_katcl(l, KATCP_FLAG_STRING | KATCP_FLAG_FIRST, "?fr-delay-set");
+
+  append_string_katcl(l, KATCP_FLAG_STRING, fields[FIELD_ANTPOL]); /* antenna */
+
+  append_args_katcl(l, KATCP_FLAG_STRING , "%.16Lf", fringe);
+  log_message_katcl(k, KATCP_LEVEL_DEBUG, NAME, "fringe offset %srad mapped to %.16Lfdeg", fields[FIELD_FRINGE], fringe);
+
+  append_args_katcl(l, KATCP_FLAG_STRING, "%.16Lf", rate);
+  log_message_katcl(k, KATCP_LEVEL_DEBUG, NAME, "fringe rate %srads/ms mapped to %.16Lfrotations/s", fields[FIELD_FRINGERATE], rate);
+
+  append_args_katcl(l, KATCP_FLAG_STRING , "%.16Lf", values[FIELD_DELAY] / 1000.0);
+  log_message_katcl(k, KATCP_LEVEL_DEBUG, NAME, "delay %sms mapped to %.16Lfs", fields[FIELD_DELAY], values[FIELD_DELAY] / 1000.0);
+
+  append_args_katcl(l, KATCP_FLAG_STRING , "%.16Lf", values[FIELD_DELAYRATE]);
+  log_message_katcl(k, KATCP_LEVEL_DEBUG, NAME, "delay rate is %.16Lfs/s or ms/ms", values[FIELD_DELAYRATE]);
+
+  append_args_katcl(l, KATCP_FLAG_STRING , "%Lf", value);
+  log_message_katcl(k, KATCP_LEVEL_DEBUG, NAME, "%s load time %sms mapped to %Lfs", fields[FIELD_ANTPOL], fields[FIELD_LOADTIME], value);
+
+  tmp = truncl(value);
+  request->tv_sec = tmp;
+  request->tv_usec = (value - tmp) * 1000000;
+
+  append_string_katcl(l, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "now");
+
+  return -1;
+}
+
+/* checks the load time before anything is queued, so that late records never go out */
+
+int late_delay(char *loadtime, struct timeval *request)
+{
+  struct timeval now;
+  long double value, tmp;
+
+  if(parse_value(loadtime, &value) < 0){
+    return 0; /* caught later */
+  }
+
+  value = value / 1000.0;
+  tmp = truncl(value);
+  request->tv_sec = tmp;
+  request->tv_usec = (value - tmp) * 1000000;
+
+  gettimeofday(&now, NULL);
+
+  return (cmp_time_katcp(request, &now) <= 0) ? 1 : 0;
+}
+
+int flush_logs(struct katcl_line *l, struct timeval *until, struct katcl_line *k)
+{
+  append_string_katcl(l, KATCP_FLAG_STRING | KATCP_FLAG_FIRST | KATCP_FLAG_LAST, "?get-log");
+  complete_with_log(l, until, k);
+
+  append_string_katcl(l, KATCP_FLAG_STRING | KATCP_FLAG_FIRST | KATCP_FLAG_LAST, "?clr-log");
+  return complete_with_log(l, until, k);
+}
+
+/* batch mode ********************************************************/
+
+static void clear_records(struct delay_record *vector, unsigned int count)
+{
+  unsigned int i;
+
+  for(i = 0; i < count; i++){
+    if(vector[i].r_antpol){
+      free(vector[i].r_antpol);
+      vector[i].r_antpol = NULL;
+    }
+    if(vector[i].r_fields){
+      free(vector[i].r_fields);
+      vector[i].r_fields = NULL;
+    }
+    if(vector[i].r_reason){
+      free(vector[i].r_reason);
+      vector[i].r_reason = NULL;
+    }
+  }
+}
+
+static void report_record(struct katcl_line *k, struct delay_record *r)
+{
+  append_string_katcl(k, KATCP_FLAG_STRING | KATCP_FLAG_FIRST, DELAY_RESULT_INFORM);
+  append_string_katcl(k, KATCP_FLAG_STRING, r->r_antpol ? r->r_antpol : "unknown");
+  if(r->r_reason){
+    append_string_katcl(k, KATCP_FLAG_STRING, record_states[r->r_state]);
+    append_string_katcl(k, KATCP_FLAG_STRING | KATCP_FLAG_LAST, r->r_reason);
+  } else {
+    append_string_katcl(k, KATCP_FLAG_STRING | KATCP_FLAG_LAST, record_states[r->r_state]);
+  }
+}
+
+/* reads records up to a blank line or the end of input, returns how many, -1 once input is exhausted */
+
+static int read_burst(FILE *fp, struct delay_record **vector, unsigned int *size, unsigned int *line)
+{
+  char buffer[RECORD_LINE], *fields[RECORD_FIELDS + 1], *ptr;
+  struct delay_record *tmp, *r;
+  unsigned int count, i, len;
+  int seen;
+
+  count = 0;
+  seen = 0;
+
+  while(fgets(buffer, RECORD_LINE, fp)){
+    (*line)++;
+    seen = 1;
+
+    for(ptr = buffer; isspace(*ptr); ptr++);
+    if(*ptr == '\0'){
+      if(count > 0){
+        return count;
+      }
+      continue;
+    }
+    if(*ptr == '#'){ /* comment */
+      continue;
+    }
+
+    if(count >= *size){
+      tmp = realloc(*vector, sizeof(struct delay_record) * (*size + 64));
+      if(tmp == NULL){
+        return count;
+      }
+      *vector = tmp;
+      *size += 64;
+    }
+
+    r = &((*vector)[count++]);
+
+    for(i = 0; i <= RECORD_FIELDS; i++){
+      fields[i] = strtok(i ? NULL : ptr, " \t\r\n");
+    }
+
+    r->r_antpol = strdup(fields[FIELD_ANTPOL]);
+    r->r_fields = NULL;
+    r->r_state = RECORD_INVALID;
+    r->r_reason = NULL;
+
+    if(fields[RECORD_FIELDS - 1] == NULL){
+      r->r_reason = strdup("too few fields");
+      continue;
+    }
+    if(fields[RECORD_FIELDS]){
+      r->r_reason = strdup("too many fields");
+      continue;
+    }
+
+    /* keep the fields, single space separated, until the burst goes out */
+    r->r_fields = malloc(RECORD_LINE);
+    if(r->r_fields == NULL){
+      r->r_reason = strdup("out of memory");
+      continue;
+    }
+    for(i = 0, len = 0; i < RECORD_FIELDS; i++){
+      len += snprintf(r->r_fields + len, RECORD_LINE - len, "%s%s", i ? " " : "", fields[i]);
+    }
+    r->r_state = RECORD_SENT;
+  }
+
+  if((count == 0) && (seen == 0)){
+    return -1;
+  }
+
+  return count;
+}
+
+int run_batch(FILE *fp, char *server, unsigned int timeout, struct katcl_line *k)
+{
+  struct delay_record *vector;
+  struct katcl_line *l;
+  struct timeval start, until, delta, request, done;
+  char *fields[RECORD_FIELDS], *ptr;
+  unsigned int size, line, i, j, sent, good;
+  int count, code, result, bad;
+
+  vector = NULL;
+  size = 0;
+  line = 0;
+  code = 0;
+  l = NULL;
+
+  delta.tv_sec = timeout;
+  delta.tv_usec = 0;
+
+  while((count = read_burst(fp, &vector, &size, &line)) >= 0){
+    if(count == 0){
+      continue;
+    }
+
+    gettimeofday(&start, NULL);
+
+    if(l == NULL){
+      l = create_name_rpc_katcl(server);
+      if(l == NULL){
+        sync_message_katcl(k, KATCP_LEVEL_ERROR, NAME, "unable to connect to %s", server);
+        for(i = 0; i < count; i++){
+          report_record(k, &(vector[i]));
+        }
+        clear_records(vector, count);
+        code = 2;
+        break;
+      }
+    }
+
+    /* validate and queue the entire burst, nothing goes out until we wait for replies */
+
+    sent = 0;
+    for(i = 0; i < count; i++){
+      if(vector[i].r_state != RECORD_SENT){
+        continue;
+      }
+
+      ptr = vector[i].r_fields;
+
+      for(j = 0; j < RECORD_FIELDS; j++){
+        fields[j] = strtok(j ? NULL : ptr, " ");
+      }
+
+      if(late_delay(fields[FIELD_LOADTIME], &request)){
+        vector[i].r_state = RECORD_LATE;
+        vector[i].r_reason = strdup("load time in the past");
+      } else if((bad = append_delay(l, k, fields, &request)) >= 0){
+        vector[i].r_state = RECORD_INVALID;
+        vector[i].r_reason = malloc(RECORD_LINE);
+        if(vector[i].r_reason){
+          snprintf(vector[i].r_reason, RECORD_LINE, "unreasonable value %s in field %d", fields[bad], bad + 1);
+        }
+      } else {
+        sent++;
+      }
+    }
+
+    /* now collect the replies, which arrive in order */
+
+    gettimeofday(&done, NULL);
+    add_time_katcp(&until, &done, &delta);
+
+    good = 0;
+    result = 0;
+
+    for(i = 0; i < count; i++){
+      if(vector[i].r_state != RECORD_SENT){
+        continue;
+      }
+
+      if(result >= 0){
+        result = complete_with_log(l, &until, k);
+      }
+
+      if(result < 0){
+        vector[i].r_state = RECORD_FAIL;
+        vector[i].r_reason = strdup("no reply");
+        continue;
+      }
+
+      ptr = arg_string_katcl(l, 1);
+      if(ptr && !strcmp(ptr, KATCP_OK)){
+        vector[i].r_state = RECORD_OK;
+        good++;
+      } else {
+        vector[i].r_state = RECORD_FAIL;
+        ptr = arg_string_katcl(l, 2);
+        if(ptr){
+          vector[i].r_reason = strdup(ptr);
+        }
+      }
+    }
+
+    if(result < 0){
+      sync_message_katcl(k, KATCP_LEVEL_ERROR, NAME, "unable to complete requests to %s", server);
+      destroy_rpc_katcl(l);
+      l = NULL;
+      code = 2;
+    } else if(sent > 0){
+      flush_logs(l, &until, k);
+    }
+
+    for(i = 0; i < count; i++){
+      report_record(k, &(vector[i]));
+      if((vector[i].r_state != RECORD_OK) && (code == 0)){
+        code = 1;
+      }
+    }
+
+    gettimeofday(&done, NULL);
+    sub_time_katcp(&done, &done, &start);
+
+    log_message_katcl(k, KATCP_LEVEL_DEBUG, NAME, "burst ending at line %u: %d records, %u sent, %u accepted in %lu.%06lus", line, count, sent, good, done.tv_sec, done.tv_usec);
+
+    clear_records(vector, count);
+
+    while(write_katcl(k) == 0);
+  }
+
+  if(vector){
+    free(vector);
+  }
+
+  if(l){
+    destroy_rpc_katcl(l);
+  }
+
+  return code;
+}
+
+void usage(struct katcl_line *k)
+{
+  sync_message_katcl(k, KATCP_LEVEL_INFO, NAME, "usage: [-s server] [-t timeout] antpol loadtime delay delayrate fringe fringerate");
+  sync_message_katcl(k, KATCP_LEVEL_INFO, NAME, "usage: [-s server] [-t timeout] -b file (use - for standard input)");
+  sync_message_katcl(k, KATCP_LEVEL_INFO, NAME, "batch files hold one record per line with the same fields, blank lines separate bursts");
+}
+
 int main(int argc, char **argv)
 {
   struct katcl_line *l, *k;
   struct timeval start, ready, done, until, delta, request, elapsed, lead, local;
-  int result, code;
-  char *server, *end, *ptr;
-  long double value, tmp;
+  int result, code, i, j, c, timeout;
+  char *server, *batch, *ptr;
+  FILE *fp;
 
   gettimeofday(&start, NULL);
 
@@ -65,60 +444,101 @@ int main(int argc, char **argv)
     return 2;
   }
 
-  if(argc <= 6){
-    sync_message_katcl(k, KATCP_LEVEL_ERROR, NAME, "expect parameters: antpol loadtime delay delayrate fringe fringerate");
-    return 1;
-  }
-
 #if 0
   server = getenv("KATCP_SERVER");
 #endif
-  server = "localhost:1235";
-
-  l = create_name_rpc_katcl(server ? server : "localhost:7147");
-  if(l == NULL){
-    sync_message_katcl(k, KATCP_LEVEL_ERROR, NAME, "unable to connect to %s", server ? server : "localhost:7147");
-    return 1;
+  server = DEFAULT_SERVER;
+  batch = NULL;
+  timeout = DEFAULT_TIMEOUT;
+
+  i = j = 1;
+  while((i < argc) && (argv[i][0] == '-') && argv[i][1]){
+    c = argv[i][j];
+    switch(c){
+      case 'h' :
+        usage(k);
+        return 0;
+
+      case 'b' :
+      case 's' :
+      case 't' :
+        j++;
+        if(argv[i][j] == '\0'){
+          j = 0;
+          i++;
+        }
+        if(i >= argc){
+          sync_message_katcl(k, KATCP_LEVEL_ERROR, NAME, "option -%c needs a parameter", c);
+          return 1;
+        }
+        switch(c){
+          case 'b' :
+            batch = argv[i] + j;
+            break;
+          case 's' :
+            server = argv[i] + j;
+            break;
+          case 't' :
+            timeout = atoi(argv[i] + j);
+            break;
+        }
+        i++;
+        j = 1;
+        break;
+
+      case '\0' :
+        j = 1;
+        i++;
+        break;
+
+      default :
+        sync_message_katcl(k, KATCP_LEVEL_ERROR, NAME, "unknown option -%c", c);
+        return 1;
+    }
   }
 
-  append_string_katcl(l, KATCP_FLAG_STRING | KATCP_FLAG_FIRST, "?fr-delay-set");
-
-  append_string_katcl(l, KATCP_FLAG_STRING, argv[1]); /* antenna */
-
-  value = strtold(argv[5], &end); /* fringe */
-  tmp = value * 180.0 * OVERPI;
-#ifdef FORGIVE_LARGE
-  tmp = fmodl(tmp, 360.0);
-#endif
-
-  append_args_katcl(l, KATCP_FLAG_STRING , "%.16Lf", tmp);
-  log_message_katcl(k, KATCP_LEVEL_DEBUG, NAME, "fringe offset %srad mapped to %.16Lfdeg", argv[5], tmp);
-
-  value = strtold(argv[6], &end); /* fringe rate */
-  tmp = value * 500.0 * OVERPI;
-  append_args_katcl(l, KATCP_FLAG_STRING, "%.16Lf", tmp);
-  log_message_katcl(k, KATCP_LEVEL_DEBUG, NAME, "fringe rate %srads/ms mapped to %.16Lfrotations/s", argv[6], tmp);
+  if(timeout <= 0){
+    timeout = DEFAULT_TIMEOUT;
+  }
 
-  value = strtold(argv[3], &end); /* delay */
-  append_args_katcl(l, KATCP_FLAG_STRING , "%.16Lf", value / 1000.0);
+  if(batch){
+    if(strcmp(batch, "-")){
+      fp = fopen(batch, "r");
+      if(fp == NULL){
+        sync_message_katcl(k, KATCP_LEVEL_ERROR, NAME, "unable to open %s: %s", batch, strerror(errno));
+        return 1;
+      }
+    } else {
+      fp = stdin;
+    }
 
-  log_message_katcl(k, KATCP_LEVEL_DEBUG, NAME, "delay %sms mapped to %.16Lfs", argv[3], value / 1000.0);
+    code = run_batch(fp, server, timeout, k);
 
-  value = strtold(argv[4], &end); /* delay rate */
-  append_args_katcl(l, KATCP_FLAG_STRING , "%.16Lf", value);
+    if(fp != stdin){
+      fclose(fp);
+    }
 
-  log_message_katcl(k, KATCP_LEVEL_DEBUG, NAME, "delay rate is %.16Lfs/s or ms/ms", value);
+    while(write_katcl(k) == 0);
+    destroy_rpc_katcl(k);
 
-  value = strtold(argv[2], &end) / 1000.0; /* time */
-  append_args_katcl(l, KATCP_FLAG_STRING , "%Lf", value);
+    return code;
+  }
 
-  log_message_katcl(k, KATCP_LEVEL_DEBUG, NAME, "%s load time %sms mapped to %Lfs", argv[1], argv[2], value);
+  if((argc - i) < RECORD_FIELDS){
+    sync_message_katcl(k, KATCP_LEVEL_ERROR, NAME, "expect parameters: antpol loadtime delay delayrate fringe fringerate");
+    return 1;
+  }
 
-  tmp = truncl(value);
-  request.tv_sec = tmp;
-  request.tv_usec = (value - tmp) * 1000000;
+  l = create_name_rpc_katcl(server ? server : "localhost:7147");
+  if(l == NULL){
+    sync_message_katcl(k, KATCP_LEVEL_ERROR, NAME, "unable to connect to %s", server ? server : "localhost:7147");
+    return 1;
+  }
 
-  append_string_katcl(l, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "now");
+  if((result = append_delay(l, k, argv + i, &request)) >= 0){
+    sync_message_katcl(k, KATCP_LEVEL_ERROR, NAME, "unreasonable value %s for parameter %d", argv[i + result], result + 1);
+    return 1;
+  }
 
   gettimeofday(&ready, NULL);
 
@@ -136,7 +556,7 @@ int main(int argc, char **argv)
 
     /* the send part */
 
-    delta.tv_sec = 20;
+    delta.tv_sec = timeout;
     delta.tv_usec = 0;
 
     add_time_katcp(&until, &ready, &delta);
@@ -154,11 +574,7 @@ int main(int argc, char **argv)
         } else {
           code = 0;
         }
-        append_string_katcl(l, KATCP_FLAG_STRING | KATCP_FLAG_FIRST | KATCP_FLAG_LAST, "?get-log");
-        complete_with_log(l, &until, k);
-
-        append_string_katcl(l, KATCP_FLAG_STRING | KATCP_FLAG_FIRST | KATCP_FLAG_LAST, "?clr-log");
-        complete_with_log(l, &until, k);
+        flush_logs(l, &until, k);
       } else {
         code = 2;
       }
@@ -181,4 +597,3 @@ int main(int argc, char **argv)
 
   return code;
 }
-
@@ -0,0 +1,353 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* runs k7-delay in batch mode against a local server which records
+ * the ?fr-delay-set requests it receives. The server holds back its
+ * replies for a moment after the first request of a burst, so that a
+ * client waiting for each reply would only get one request in. Checks
+ * that each burst arrives whole over a single connection, that the
+ * values are converted as for a single invocation, and that every
+ * input gets its own outcome
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <math.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <netc.h>
+#include <katcp.h>
+#include <katpriv.h>
+#include <katcl.h>
+#include <fixture.h>
+
+#define LINE        1024
+#define BUFFER     16384
+#define HOLD         200   /* ms the server sits on replies */
+#define PENDING       64
+
+static void reply_all(struct katcl_line *l, char **pending, unsigned int count)
+{
+  unsigned int i;
+
+  for(i = 0; i < count; i++){
+    if(!strncmp(pending[i], "bad", 3)){
+      send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!fr-delay-set", KATCP_FLAG_STRING, KATCP_FAIL, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "no such input", NULL);
+    } else {
+      send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!fr-delay-set", KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCP_OK, NULL);
+    }
+    free(pending[i]);
+  }
+}
+
+static void serve(int lfd, int report)
+{
+  struct katcl_line *l;
+  struct timeval tv, now, hold, release;
+  char *pending[PENDING], *name, line[LINE];
+  unsigned int count, accepts, i, len;
+  fd_set fsr, fsw;
+  int fd, max, result;
+
+  l = NULL;
+  count = 0;
+  accepts = 0;
+
+  hold.tv_sec = 0;
+  hold.tv_usec = HOLD * 1000;
+
+  for(;;){
+    FD_ZERO(&fsr);
+    FD_ZERO(&fsw);
+
+    FD_SET(lfd, &fsr);
+    max = lfd;
+
+    if(l){
+      fd = fileno_katcl(l);
+      FD_SET(fd, &fsr);
+      if(flushing_katcl(l)){
+        FD_SET(fd, &fsw);
+      }
+      if(fd > max){
+        max = fd;
+      }
+    }
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 10000;
+
+    select(max + 1, &fsr, &fsw, NULL, &tv);
+
+    if(FD_ISSET(lfd, &fsr)){
+      fd = accept(lfd, NULL, NULL);
+      if(fd >= 0){
+        if(l){
+          destroy_katcl(l, 1);
+        }
+        l = create_katcl(fd);
+        accepts++;
+        len = snprintf(line, LINE, "accept %u\n", accepts);
+        write(report, line, len);
+      }
+      continue;
+    }
+
+    if(l == NULL){
+      continue;
+    }
+
+    fd = fileno_katcl(l);
+
+    if(FD_ISSET(fd, &fsr)){
+      result = read_katcl(l);
+      while(have_katcl(l) > 0){
+        name = arg_string_katcl(l, 0);
+        if(name == NULL){
+          continue;
+        }
+        if(!strcmp(name, "?fr-delay-set")){
+          len = snprintf(line, LINE, "request");
+          for(i = 1; i < arg_count_katcl(l); i++){
+            len += snprintf(line + len, LINE - len, " %s", arg_string_katcl(l, i));
+          }
+          line[len++] = '\n';
+          write(report, line, len);
+          if(count == 0){
+            gettimeofday(&now, NULL);
+            add_time_katcp(&release, &now, &hold);
+          }
+          if(count < PENDING){
+            pending[count++] = strdup(arg_string_katcl(l, 1));
+          }
+        } else if(!strcmp(name, "?get-log")){
+          log_message_katcl(l, KATCP_LEVEL_INFO, "fake", "delays loaded");
+          send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!get-log", KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCP_OK, NULL);
+        } else if(!strcmp(name, "?clr-log")){
+          send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!clr-log", KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCP_OK, NULL);
+        }
+      }
+      if(result){
+        destroy_katcl(l, 1);
+        l = NULL;
+        continue;
+      }
+    }
+
+    gettimeofday(&now, NULL);
+    if((count > 0) && (cmp_time_katcp(&now, &release) >= 0)){
+      len = snprintf(line, LINE, "burst %u\n", count);
+      write(report, line, len);
+      reply_all(l, pending, count);
+      count = 0;
+    }
+
+    if(flushing_katcl(l)){
+      write_katcl(l);
+    }
+  }
+}
+
+static int count_lines(char *text, char *prefix)
+{
+  char *ptr;
+  int count;
+
+  count = 0;
+  for(ptr = text; (ptr = strstr(ptr, prefix)) != NULL; ptr++){
+    if((ptr == text) || (ptr[-1] == '\n')){
+      count++;
+    }
+  }
+
+  return count;
+}
+
+int main(int argc, char **argv)
+{
+  struct timeval now;
+  char bind[64], input[BUFFER], *output, events[BUFFER], line[LINE], *ptr;
+  unsigned long long future;
+  double fringe, rate, delay, drate, load;
+  int lfd, report[2], failures, code, port, have, rr;
+  unsigned int bursts[4], nbursts;
+  pid_t server;
+  char *batch[] = { "./k7-delay", "-s", bind, "-b", "-", NULL };
+  char *single[] = { "./k7-delay", "-s", bind, "4x", line, "1", "0", "0", "0", NULL };
+
+  signal(SIGPIPE, SIG_IGN);
+
+  port = 20000 + (getpid() % 20000);
+  snprintf(bind, sizeof(bind), "127.0.0.1:%d", port);
+
+  lfd = net_listen(bind, 0, 0);
+  if(lfd < 0){
+    fprintf(stderr, "test: unable to listen on %s\n", bind);
+    return 2;
+  }
+
+  if(pipe(report) < 0){
+    return 2;
+  }
+
+  server = fork();
+  if(server < 0){
+    return 2;
+  }
+  if(server == 0){
+    close(report[0]);
+    freopen("/dev/null", "w", stderr);
+    serve(lfd, report[1]);
+    exit(1);
+  }
+  close(report[1]);
+  close(lfd);
+
+  gettimeofday(&now, NULL);
+  future = ((unsigned long long)now.tv_sec * 1000) + (now.tv_usec / 1000) + 10000;
+
+  snprintf(input, sizeof(input),
+    "# antpol loadtime delay delayrate fringe fringerate\n"
+    "0x %llu 1.5 0.001 3.14159265358979 0.5\n"
+    "0y\t%llu   2.5 0 0 0\n"
+    "bad0x %llu 1 0 0 0\n"
+    "1x %llu abc 0 0 0\n"
+    "1y 1000 0 0 0 0\n"
+    "2x 1 2 3\n"
+    "\n"
+    "3x %llu 0 0 0 0\n"
+    "3y %llu 0 0 0 0\n",
+    future, future, future, future, future, future);
+
+  failures = 0;
+
+  code = run_fixture(batch, input, &output);
+  if(output == NULL){
+    fprintf(stderr, "test: unable to run k7-delay\n");
+    return 2;
+  }
+
+  printf("test: batch exited with %d\n", code);
+
+  if(code != 1){
+    fprintf(stderr, "test: batch did not report failed inputs in its exit code\n");
+    failures++;
+  }
+  if((strstr(output, "#delay-result 0x ok\n") == NULL) || (strstr(output, "#delay-result 0y ok\n") == NULL)){
+    fprintf(stderr, "test: accepted inputs not reported\n");
+    failures++;
+  }
+  if(strstr(output, "#delay-result bad0x fail no\\_such\\_input\n") == NULL){
+    fprintf(stderr, "test: server failure not reported for its input\n");
+    failures++;
+  }
+  if(strstr(output, "#delay-result 1x invalid unreasonable\\_value\\_abc\\_in\\_field\\_3\n") == NULL){
+    fprintf(stderr, "test: invalid value not caught before sending\n");
+    failures++;
+  }
+  if(strstr(output, "#delay-result 1y late") == NULL){
+    fprintf(stderr, "test: late input not caught before sending\n");
+    failures++;
+  }
+  if(strstr(output, "#delay-result 2x invalid too\\_few\\_fields\n") == NULL){
+    fprintf(stderr, "test: short record not caught\n");
+    failures++;
+  }
+  if((strstr(output, "#delay-result 3x ok\n") == NULL) || (strstr(output, "#delay-result 3y ok\n") == NULL)){
+    fprintf(stderr, "test: second burst not processed\n");
+    failures++;
+  }
+  if(count_lines(output, "#delay-result ") != 8){
+    fprintf(stderr, "test: expected one outcome per input\n");
+    failures++;
+  }
+  if(strstr(output, "delays\\_loaded") == NULL){
+    fprintf(stderr, "test: server logs not relayed\n");
+    failures++;
+  }
+
+  free(output);
+
+  /* a single invocation still works as before */
+  snprintf(line, sizeof(line), "%llu", future);
+  code = run_fixture(single, "", NULL);
+  printf("test: single exited with %d\n", code);
+  if(code != 0){
+    fprintf(stderr, "test: single request failed\n");
+    failures++;
+  }
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+
+  have = 0;
+  while((have < sizeof(events) - 1) && ((rr = read(report[0], events + have, sizeof(events) - 1 - have)) > 0)){
+    have += rr;
+  }
+  events[have] = '\0';
+  close(report[0]);
+
+  printf("test: server saw\n%s", events);
+
+  nbursts = 0;
+  for(ptr = events; (ptr = strstr(ptr, "burst ")) != NULL; ptr++){
+    if((ptr == events) || (ptr[-1] == '\n')){
+      if(nbursts < 4){
+        bursts[nbursts] = atoi(ptr + 6);
+      }
+      nbursts++;
+    }
+  }
+
+  if(count_lines(events, "accept ") != 2){
+    fprintf(stderr, "test: expected one connection per invocation\n");
+    failures++;
+  }
+  if((nbursts != 3) || (bursts[0] != 3) || (bursts[1] != 2) || (bursts[2] != 1)){
+    fprintf(stderr, "test: bursts did not arrive pipelined\n");
+    failures++;
+  }
+  if(count_lines(events, "request ") != 6){
+    fprintf(stderr, "test: expected only valid inputs to be sent\n");
+    failures++;
+  }
+
+  ptr = strstr(events, "request 0x ");
+  if(ptr && (sscanf(ptr, "request 0x %lf %lf %lf %lf %lf", &fringe, &rate, &delay, &drate, &load) == 5)){
+    printf("test: 0x sent as fringe=%f rate=%f delay=%f rate=%f load=%f\n", fringe, rate, delay, drate, load);
+    if((fabs(fringe - 180.0) >= 0.0001) || (fabs(rate - (0.5 * 500.0 / M_PI)) >= 0.0001)){
+      fprintf(stderr, "test: fringe or fringe rate not converted\n");
+      failures++;
+    }
+    if((fabs(delay - 0.0015) >= 0.0000001) || (fabs(drate - 0.001) >= 0.0000001)){
+      fprintf(stderr, "test: delay or delay rate not converted\n");
+      failures++;
+    }
+    if(fabs(load - (future / 1000.0)) >= 0.002){
+      fprintf(stderr, "test: load time not converted to seconds\n");
+      failures++;
+    }
+  } else {
+    fprintf(stderr, "test: no request for 0x recorded\n");
+    failures++;
+  }
+
+  if(failures){
+    printf("test: %d failures\n", failures);
+    return 1;
+  }
+
+  printf("test: ok\n");
+
+  return 0;
+}
@@ -27,6 +27,9 @@
 #define UDP_MAX_PACKET 		9728
 
 #define UDP_MAGIC                   0xDEADBEEF
+
+#define UDP_MAX_RECORDS           (UDP_MAX_PACKET / sizeof(struct udp_message))
+#define UDP_MAX_TARGETS            256
 /************************************************************/
 
 
@@ -212,6 +215,166 @@ int rcv_udp(struct katcp_dispatch *d, struct udp_state *ud)
 	return 0;
 }
 
+
+/*****************************************************************************/
+/* batch mode: many addresses per datagram, many boards on one socket */
+
+struct udp_target
+{
+  char *t_ip;
+  struct sockaddr_in t_sa;
+  unsigned int t_sequence;
+  int t_done;
+};
+
+int send_batch_udp(struct katcp_dispatch *d, struct udp_state *ud, struct udp_target *ut, uint32_t *addresses, uint32_t *values, unsigned int count)
+{
+  struct udp_message buffer[UDP_MAX_RECORDS];
+  unsigned int i;
+  int wr;
+
+  for(i = 0; i < count; i++){
+    buffer[i].u_sequence     = htons(0xffff & (ut->t_sequence + i));
+    buffer[i].u_addr_errcode = htonl((addresses[i] & 0x7FFFFFFF) | (ud->u_rw << 31));
+    buffer[i].u_data_length  = htonl(values[i]);
+  }
+
+  wr = sendto(ud->u_fd, buffer, count * sizeof(struct udp_message), 0, (struct sockaddr *)&(ut->t_sa), sizeof(struct sockaddr_in));
+  if(wr < 0){
+    switch(errno){
+      case EAGAIN :
+      case EINTR  :
+        return 0;
+      default :
+        log_message_katcp(d, KATCP_LEVEL_ERROR, DMON_MODULE_NAME, "unable to send request to %s: %s", ut->t_ip, strerror(errno));
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+int rcv_batch_udp(struct katcp_dispatch *d, struct udp_state *ud, struct udp_target *targets, unsigned int total, unsigned int count)
+{
+  struct udp_message buffer[UDP_MAX_RECORDS];
+  struct sockaddr_in sa;
+  socklen_t len;
+  struct udp_target *ut;
+  unsigned int i, j, code, address, sequence;
+  int rr;
+
+  len = sizeof(struct sockaddr_in);
+  rr = recvfrom(ud->u_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&sa, &len);
+  if(rr < 0){
+    switch(errno){
+      case EAGAIN :
+      case EINTR  :
+        return 0;
+      default :
+        log_message_katcp(d, KATCP_LEVEL_ERROR, DMON_MODULE_NAME, "udp receive failed with %s", strerror(errno));
+        return -1;
+    }
+  }
+
+  ut = NULL;
+  for(j = 0; j < total; j++){
+    if((targets[j].t_sa.sin_addr.s_addr == sa.sin_addr.s_addr) && (targets[j].t_sa.sin_port == sa.sin_port)){
+      ut = &(targets[j]);
+      break;
+    }
+  }
+
+  if((ut == NULL) || ut->t_done){
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, DMON_MODULE_NAME, "ignoring unexpected reply from %s", inet_ntoa(sa.sin_addr));
+    return 0;
+  }
+
+  if(rr != (count * sizeof(struct udp_message))){
+    log_message_katcp(d, KATCP_LEVEL_WARN, DMON_MODULE_NAME, "reply from %s has %d bytes, expected %u", ut->t_ip, rr, (unsigned int)(count * sizeof(struct udp_message)));
+    return 0;
+  }
+
+  if(ntohs(buffer[0].u_sequence) != (0xffff & ut->t_sequence)){
+    log_message_katcp(d, KATCP_LEVEL_WARN, DMON_MODULE_NAME, "stale reply from %s with sequence number %d not %d", ut->t_ip, ntohs(buffer[0].u_sequence), 0xffff & ut->t_sequence);
+    return 0;
+  }
+
+  for(i = 0; i < count; i++){
+    sequence = ntohs(buffer[i].u_sequence);
+    address  = ntohl(buffer[i].u_addr_errcode);
+    code     = (0xFF000000 & address) >> 24;
+    address  = 0x00FFFFFF & address;
+
+    if(sequence != (0xffff & (ut->t_sequence + i))){
+      printf("%s 0x%06x error sequence\n", ut->t_ip, address);
+    } else if(code){
+      printf("%s 0x%06x error %u\n", ut->t_ip, address, code);
+    } else {
+      printf("%s 0x%06x 0x%08x\n", ut->t_ip, address, ntohl(buffer[i].u_data_length));
+    }
+  }
+
+  ut->t_done = 1;
+
+  return 1;
+}
+
+int run_batch_udp(struct katcp_dispatch *d, struct udp_state *ud, char **ips, unsigned int total, int port, uint32_t *addresses, uint32_t *values, unsigned int count, int tries)
+{
+  struct udp_target targets[UDP_MAX_TARGETS];
+  struct timeval delta;
+  unsigned int i, pending;
+  fd_set fsr;
+  int result;
+
+  for(i = 0; i < total; i++){
+    targets[i].t_ip = ips[i];
+    memset(&(targets[i].t_sa), 0, sizeof(struct sockaddr_in));
+    targets[i].t_sa.sin_family = AF_INET;
+    targets[i].t_sa.sin_addr.s_addr = inet_addr(ips[i]);
+    targets[i].t_sa.sin_port = htons(port);
+    ud->u_sequence = 0xffff & (ud->u_sequence + count);
+    targets[i].t_sequence = ud->u_sequence;
+    targets[i].t_done = 0;
+  }
+
+  pending = total;
+
+  while((pending > 0) && (tries > 0)){
+    for(i = 0; i < total; i++){
+      if(!targets[i].t_done){
+        send_batch_udp(d, ud, &(targets[i]), addresses, values, count);
+      }
+    }
+    tries--;
+
+    delta.tv_sec = 1;
+    delta.tv_usec = 0;
+
+    while(pending > 0){
+      FD_ZERO(&fsr);
+      FD_SET(ud->u_fd, &fsr);
+
+      result = select(ud->u_fd + 1, &fsr, NULL, NULL, &delta);
+      if(result <= 0){
+        break; /* timeout, resend to the boards which have not answered */
+      }
+
+      if(rcv_batch_udp(d, ud, targets, total, count) > 0){
+        pending--;
+      }
+    }
+  }
+
+  for(i = 0; i < total; i++){
+    if(!targets[i].t_done){
+      printf("%s timeout\n", targets[i].t_ip);
+    }
+  }
+
+  return pending ? -1 : 0;
+}
+
 /*****************************************************************************/
 
 int main(int argc, char **argv)
@@ -227,11 +390,16 @@ int main(int argc, char **argv)
   int wait, nooftries;
   int port = 0;
 int rw_flag = 0;
+  char *ips[UDP_MAX_TARGETS];
+  unsigned int total;
+  uint32_t addresses[UDP_MAX_RECORDS], values[UDP_MAX_RECORDS];
+  unsigned int count;
 
   i = j = 1;
   pos = 0;
   wait = 0;
   nooftries = 10;
+  total = 0;
 
   while (i < argc) {
     if (argv[i][0] == '-') {
@@ -246,6 +414,8 @@ int rw_flag = 0;
           break;
         case 'h' :
           fprintf(stderr, "usage: %s -R [-i ipaddress] [-p port] address length\n", argv[0]);
+          fprintf(stderr, "       %s [-R] -i ipaddress [-i ipaddress ...] [-p port] address length|value [address length|value ...]\n", argv[0]);
+          fprintf(stderr, "       several addresses are sent in one datagram, several boards are queried from one socket\n");
           return 0;
           break;
         case 'i' : 
@@ -258,6 +428,9 @@ int rw_flag = 0;
             fprintf(stderr, "%s: option -%c requires a parameter\n", argv[0], c);
           }
           ip_addr = argv[i] + j;	
+          if(total < UDP_MAX_TARGETS){
+            ips[total++] = ip_addr;
+          }
           i++;
           j = 1;
           break;
@@ -318,6 +491,32 @@ int rw_flag = 0;
   }
   ud->u_rw = rw_flag;
 
+  if((pos <= 0) || ((argc - pos) < 2)){
+    fprintf(stderr, "%s: need an address and a length\n", argv[0]);
+    return EX_USAGE;
+  }
+
+  if((total > 1) || ((argc - pos) > 2)){
+    count = 0;
+    for(i = pos; (i + 1) < argc; i += 2){
+      if(count >= UDP_MAX_RECORDS){
+        fprintf(stderr, "%s: too many addresses for one datagram\n", argv[0]);
+        return EX_USAGE;
+      }
+      addresses[count] = strtoul(argv[i], NULL, 16);
+      values[count]    = strtoul(argv[i + 1], NULL, 16);
+      count++;
+    }
+
+    result = run_batch_udp(d, ud, ips, total, port, addresses, values, count, nooftries);
+    fflush(stdout); /* shutdown closes the katcp descriptor, which is stdout */
+
+    destroy_udp(d, ud);
+    shutdown_katcp(d);
+
+    return result ? EX_UNAVAILABLE : EX_OK;
+  }
+
   for(;;){
 
     FD_ZERO(&fsr);
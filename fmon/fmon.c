@@ -14,16 +14,19 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <poll.h>
 
 #include <arpa/inet.h>
 
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 
 #include <katcp.h>
 #include <katcl.h>
 #include <katpriv.h>
+#include <netc.h>
 
 /* largest board id */
 
@@ -115,6 +118,14 @@
 #define FMON_MODE_WBC             0
 #define FMON_MODE_NBC             1
 
+/* multi board operation, register io pipelined per board */
+
+#define FMON_MAX_REGISTERS       64
+#define FMON_REGISTER_NAME       32
+
+#define FMON_REQUEST_READ         0
+#define FMON_REQUEST_WRITE        1
+
 volatile int run;
 
 static char inputs_fmon[FMON_MAX_INPUTS] = { 'x', 'y' };
@@ -179,19 +190,19 @@ struct fmon_sensor_template input_template[FMON_INPUT_SENSORS] = {
 };
 
 struct fmon_sensor{
-  int s_type;
+  struct fmon_sensor_template *s_template; /* type, description and limits, shared by all boards */
   char *s_name;
-  char *s_description;
   int s_value;
   double s_fvalue;
   int s_status;
   int s_new;
-  int s_min;
-  int s_max;
-  double s_fmin;
-  double s_fmax;
+};
 
-  int s_logging;
+struct fmon_register{
+  char r_name[FMON_REGISTER_NAME];
+  int r_kind;
+  int r_result;
+  uint32_t r_value;
 };
 
 struct fmon_input{
@@ -247,6 +258,21 @@ struct fmon_state
   unsigned long f_xp_errors[FMON_MAX_CROSSES];
 
   int f_x_threshold;
+
+  /* below only used when monitoring several boards */
+
+  struct fmon_state *f_next;
+  char *f_prefix;
+  int f_shared;
+
+  int f_batch;
+  int f_fresh;
+  int f_connecting;
+  int f_settled;
+
+  struct fmon_register f_registers[FMON_MAX_REGISTERS];
+  unsigned int f_count;
+  unsigned int f_answered;
 };
 
 /*************************************************************************/
@@ -306,24 +332,24 @@ void destroy_fmon(struct fmon_state *f)
     f->f_line = NULL;
   }
 
+  if(f->f_connecting >= 0){
+    close(f->f_connecting);
+    f->f_connecting = (-1);
+  }
+
   for(i = 0; i < FMON_MAX_INPUTS; i++){
     n = &(f->f_inputs[i]);
 
     for(j = 0; j < FMON_INPUT_SENSORS; j++){
       s = &(n->n_sensors[j]);
 
-      s->s_type = (-1);
+      s->s_template = NULL;
 
-      if(s->s_name == NULL){
+      if(s->s_name){
         free(s->s_name);
         s->s_name = NULL;
       }
 
-      if(s->s_description == NULL){
-        free(s->s_description);
-        s->s_description = NULL;
-      }
-
       s->s_new = 1;
     }
 
@@ -338,26 +364,33 @@ void destroy_fmon(struct fmon_state *f)
   for(i = 0; i < FMON_BOARD_SENSORS; i++){
     s = &(f->f_sensors[i]);
 
-    s->s_type = (-1);
+    s->s_template = NULL;
 
-    if(s->s_name == NULL){
+    if(s->s_name){
       free(s->s_name);
       s->s_name = NULL;
     }
 
-    if(s->s_description == NULL){
-      free(s->s_description);
-      s->s_description = NULL;
-    }
-
     s->s_new = 1;
   }
 
   if(f->f_report){
-    destroy_katcl(f->f_report, 0);
+    if(f->f_shared == 0){
+      destroy_katcl(f->f_report, 0);
+    }
     f->f_report = NULL;
   }
 
+  if(f->f_symbolic){
+    free(f->f_symbolic);
+    f->f_symbolic = NULL;
+  }
+
+  if(f->f_prefix){
+    free(f->f_prefix);
+    f->f_prefix = NULL;
+  }
+
   if(f->f_server){
     free(f->f_server);
     f->f_server = NULL;
@@ -366,9 +399,9 @@ void destroy_fmon(struct fmon_state *f)
   free(f);
 }
 
-int populate_sensor_fmon(struct fmon_sensor *s, struct fmon_sensor_template *t, char *instance)
+int populate_sensor_fmon(struct fmon_sensor *s, struct fmon_sensor_template *t, char *instance, char *prefix)
 {
-  int len;
+  int len, used;
 
   if((s == NULL) || (t == NULL)){
     return -1;
@@ -378,52 +411,75 @@ int populate_sensor_fmon(struct fmon_sensor *s, struct fmon_sensor_template *t,
     free(s->s_name);
     s->s_name = NULL;
   }
-  if(s->s_description){
-    free(s->s_description);
-    s->s_description = NULL;
+
+  s->s_template = t;
+
+  len = strlen(t->t_name) + 2;
+  if(instance){
+    len += strlen(instance);
+  }
+  if(prefix){
+    len += strlen(prefix) + 1;
   }
 
-  s->s_type = t->t_type;
+  s->s_name = malloc(len);
+  if(s->s_name == NULL){
+    return -1;
+  }
+
+  used = 0;
+  if(prefix){
+    used = snprintf(s->s_name, len, "%s.", prefix);
+  }
 
   if(instance){
-    len = strlen(instance) + strlen(t->t_name) + 1;
-    s->s_name = malloc(len);
-    if(s->s_name){
-      snprintf(s->s_name, len - 1, t->t_name, instance);
-      s->s_name[len - 1] = '\0';
-    } else {
-      return -1;
-    }
+    snprintf(s->s_name + used, len - used, t->t_name, instance);
   } else {
-    s->s_name = strdup(t->t_name);
-    if(s->s_name == NULL){
-      return -1;
-    }
+    snprintf(s->s_name + used, len - used, "%s", t->t_name);
   }
 
-  s->s_description = strdup(t->t_description);
-  if(s->s_description == NULL){
-    return -1;
+  return 0;
+}
+
+struct katcl_line *create_report_fmon()
+{
+  int flags;
+
+  flags = fcntl(STDOUT_FILENO, F_GETFL, NULL);
+  if(flags >= 0){
+    flags = fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK);
   }
 
-  s->s_min = t->t_min;
-  s->s_max = t->t_max;
+  return create_katcl(STDOUT_FILENO);
+}
+
+char *make_prefix_fmon(char *server)
+{
+  char *prefix;
+  int i;
 
-  s->s_fmin = t->t_fmin;
-  s->s_fmax = t->t_fmax;
+  /* boards sharing one report stream need to qualify their sensor names */
 
-  s->s_logging = t->t_logging;
+  prefix = strdup(server);
+  if(prefix == NULL){
+    return NULL;
+  }
 
-  return 0;
+  for(i = 0; prefix[i] != '\0'; i++){
+    if(!isalnum(prefix[i]) && (prefix[i] != '.') && (prefix[i] != '-')){
+      prefix[i] = '-';
+    }
+  }
+
+  return prefix;
 }
 
-struct fmon_state *create_fmon(char *server, int verbose, unsigned int timeout, int reprobe, int fixed)
+struct fmon_state *create_fmon(char *server, int verbose, unsigned int timeout, int reprobe, int fixed, struct katcl_line *report)
 {
   struct fmon_state *f;
   struct fmon_sensor *s;
   struct fmon_input *n;
   int i, j;
-  int flags;
 
   f = malloc(sizeof(struct fmon_state));
   if(f == NULL){
@@ -450,6 +506,7 @@ struct fmon_state *create_fmon(char *server, int verbose, unsigned int timeout,
 
   f->f_reprobe = reprobe;
   f->f_cycle = 0;
+  f->f_something = 0;
   f->f_grace = 0;
 
   f->f_mode = FMON_MODE_WBC; /* assume a mode */
@@ -463,13 +520,26 @@ struct fmon_state *create_fmon(char *server, int verbose, unsigned int timeout,
   }
 
   f->f_xp_count = 0;
+  f->f_x_threshold = 0;
 
   f->f_fs = 0;
   f->f_xs = 0;
 
+  f->f_next = NULL;
+  f->f_prefix = NULL;
+  f->f_shared = 0;
+
+  f->f_batch = 0;
+  f->f_fresh = 0;
+  f->f_connecting = (-1);
+  f->f_settled = 0;
+
+  f->f_count = 0;
+  f->f_answered = 0;
+
   for(i = 0; i < FMON_BOARD_SENSORS; i++){
     s = &(f->f_sensors[i]);
-    s->s_type = (-1);
+    s->s_template = NULL;
     s->s_name = NULL;
     s->s_value = 0;
     s->s_fvalue = 0.0;
@@ -483,7 +553,7 @@ struct fmon_state *create_fmon(char *server, int verbose, unsigned int timeout,
     for(j = 0; j < FMON_INPUT_SENSORS; j++){
       s = &(n->n_sensors[j]);
 
-      s->s_type = (-1);
+      s->s_template = NULL;
       s->s_name = NULL;
       s->s_value = 0;
       s->s_fvalue = 0.0;
@@ -501,24 +571,32 @@ struct fmon_state *create_fmon(char *server, int verbose, unsigned int timeout,
     return NULL;
   }
 
+  if(report){
+    f->f_prefix = make_prefix_fmon(server);
+    if(f->f_prefix == NULL){
+      destroy_fmon(f);
+      return NULL;
+    }
+  }
+
   for(i = 0; i < FMON_BOARD_SENSORS; i++){
     s = &(f->f_sensors[i]);
 
-    if(populate_sensor_fmon(s, &(board_template[i]), NULL) < 0){
+    if(populate_sensor_fmon(s, &(board_template[i]), NULL, f->f_prefix) < 0){
       destroy_fmon(f);
       return NULL;
     }
   }
 
-  flags = fcntl(STDOUT_FILENO, F_GETFL, NULL);
-  if(flags >= 0){
-    flags = fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK);
-  }
-
-  f->f_report = create_katcl(STDOUT_FILENO);
-  if(f->f_report == NULL){
-    destroy_fmon(f);
-    return NULL;
+  if(report){
+    f->f_report = report;
+    f->f_shared = 1;
+  } else {
+    f->f_report = create_report_fmon();
+    if(f->f_report == NULL){
+      destroy_fmon(f);
+      return NULL;
+    }
   }
 
   return f;
@@ -568,7 +646,7 @@ struct fmon_sensor *find_sensor_fmon(struct fmon_state *f, char *name)
     }
   }
 
-  for(i = 0; FMON_MAX_INPUTS; i++){
+  for(i = 0; i < FMON_MAX_INPUTS; i++){
     n = &(f->f_inputs[i]);
     for(j = 0; j < FMON_INPUT_SENSORS; j++){
       s = &(n->n_sensors[j]);
@@ -592,12 +670,48 @@ int check_parent(struct fmon_state *f)
   return 0;
 }
 
+int serve_requests_fmon(struct fmon_state *f)
+{
+  struct fmon_state *b;
+  char *request, *label, *strategy;
+  int result;
+
+  /* sensors might belong to any board sharing this report line */
+
+  if(read_katcl(f->f_report)){
+    return -1;
+  }
+
+  while(have_katcl(f->f_report) > 0){
+    if(arg_request_katcl(f->f_report)){
+      request = arg_string_katcl(f->f_report, 0);
+      if(request){
+        log_message_katcl(f->f_report, KATCP_LEVEL_INFO, f->f_server, "got %s request", request);
+        if(!strcmp(request, "?sensor-sampling")){
+          result = 0;
+          label = arg_string_katcl(f->f_report, 1);
+          strategy = arg_string_katcl(f->f_report, 2);
+          if(label && strategy && !strcmp(strategy, "event")){
+            for(b = f; b && (find_sensor_fmon(b, label) == NULL); b = b->f_next);
+            if(b){
+              result = 1;
+            }
+          }
+          append_string_katcl(f->f_report, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!sensor-sampling");
+          append_string_katcl(f->f_report, KATCP_FLAG_LAST  | KATCP_FLAG_STRING, result ? KATCP_OK : KATCP_FAIL);
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
 int catchup_fmon(struct fmon_state *f, unsigned int interval)
 {
   struct timeval delta, target;
   fd_set fsr, fsw;
   int fd, result;
-  char *request, *label, *strategy;
 
   delta.tv_sec = interval / 1000;
   delta.tv_usec = (interval % 1000) * 1000;
@@ -636,32 +750,9 @@ int catchup_fmon(struct fmon_state *f, unsigned int interval)
 
     if(result > 0){
       if(FD_ISSET(fd, &fsr)){
-        result = read_katcl(f->f_report);
-        if(result){
+        if(serve_requests_fmon(f) < 0){
           return -1;
         }
-
-        while(have_katcl(f->f_report) > 0){
-          if(arg_request_katcl(f->f_report)){
-            request = arg_string_katcl(f->f_report, 0);
-            if(request){
-              log_message_katcl(f->f_report, KATCP_LEVEL_INFO, f->f_server, "got %s request", request);
-              if(!strcmp(request, "?sensor-sampling")){
-                result = 0;
-                label = arg_string_katcl(f->f_report, 1);
-                strategy = arg_string_katcl(f->f_report, 2);
-                if(label && strategy){
-                  if(!strcmp(strategy, "event") && (find_sensor_fmon(f, label) != NULL)){
-                    result = 1;
-                  }
-                }
-                append_string_katcl(f->f_report, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!sensor-sampling");
-                append_string_katcl(f->f_report, KATCP_FLAG_LAST  | KATCP_FLAG_STRING, result ? KATCP_OK : KATCP_FAIL);
-              }
-            }
-          }
-        }
-
       }
 
       if(FD_ISSET(fd, &fsw)){
@@ -728,6 +819,10 @@ void drop_connection_fmon(struct fmon_state *f)
     f->f_symbolic = NULL;
   }
 
+  f->f_count = 0;
+  f->f_answered = 0;
+  f->f_fresh = 0;
+
   destroy_rpc_katcl(f->f_line);
   f->f_line = NULL;
 }
@@ -813,7 +908,7 @@ int maintain_fmon(struct fmon_state *f)
 
   f->f_maintaining = 1;
 
-  if(f->f_line == NULL){
+  if((f->f_line == NULL) || f->f_fresh){
     state = STATE_CONNECT;
   } else {
     state = STATE_DONE;
@@ -832,18 +927,33 @@ int maintain_fmon(struct fmon_state *f)
   for(;;){
     switch(state){
       case STATE_CONNECT : 
-        f->f_line = create_name_rpc_katcl(f->f_server);
-        if(f->f_line == NULL){
-          log_message_katcl(f->f_report, KATCP_LEVEL_TRACE, f->f_server, "connect to %s failed: %s", f->f_server, strerror(errno));
-          /* state = STATE_CONNECT */
-          break;
-        } /* fall */
+        if(f->f_fresh){ /* batch loop has connected us already */
+          f->f_fresh = 0;
+        } else {
+          if(f->f_batch){ /* connections only made by batch loop, which has given up for this cycle */
+            set_lru_fmon(f, 0, KATCP_STATUS_ERROR);
+            f->f_grace = 0;
+            f->f_maintaining = 0;
+            return -1;
+          }
+          f->f_line = create_name_rpc_katcl(f->f_server);
+          if(f->f_line == NULL){
+            log_message_katcl(f->f_report, KATCP_LEVEL_TRACE, f->f_server, "connect to %s failed: %s", f->f_server, strerror(errno));
+            /* state = STATE_CONNECT */
+            break;
+          } /* fall */
+        }
         state = STATE_PROBE;
       case STATE_PROBE : 
         if(probe_fmon(f) < 0){
           destroy_rpc_katcl(f->f_line);
           f->f_line = NULL;
+          f->f_count = 0;
+          f->f_answered = 0;
           state = STATE_CONNECT; /* try again */
+          if(f->f_batch){
+            continue; /* no point in waiting */
+          }
           break;
         } /* fall */
         state = STATE_DONE; /* superfluous, but symmetrical */
@@ -954,17 +1064,219 @@ int collect_io_fmon(struct fmon_state *f)
   return 0;
 }
 
+struct fmon_register *find_register_fmon(struct fmon_state *f, char *name)
+{
+  struct fmon_register *r;
+  unsigned int i;
+
+  for(i = 0; i < f->f_answered; i++){
+    r = &(f->f_registers[i]);
+    if((r->r_kind == FMON_REQUEST_READ) && !strcmp(r->r_name, name)){
+      return r;
+    }
+  }
+
+  return NULL;
+}
+
+int queue_register_fmon(struct fmon_state *f, int kind, char *name, uint32_t value)
+{
+  struct fmon_register *r;
+  int result[4], i;
+  uint32_t tmp;
+
+  if((f->f_line == NULL) || (f->f_count >= FMON_MAX_REGISTERS) || (strlen(name) >= FMON_REGISTER_NAME)){
+    return -1;
+  }
+
+  if(kind == FMON_REQUEST_WRITE){
+    tmp = htonl(value);
+    result[0] = append_string_katcl(f->f_line,        KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?write");
+    result[1] = append_string_katcl(f->f_line,                           KATCP_FLAG_STRING, name);
+    result[2] = append_unsigned_long_katcl(f->f_line,                    KATCP_FLAG_ULONG,  0);
+    result[3] = append_buffer_katcl(f->f_line,         KATCP_FLAG_LAST | KATCP_FLAG_BUFFER, &tmp, 4);
+  } else {
+    result[0] = append_string_katcl(f->f_line,        KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?read");
+    result[1] = append_string_katcl(f->f_line,                           KATCP_FLAG_STRING, name);
+    result[2] = append_unsigned_long_katcl(f->f_line,                    KATCP_FLAG_ULONG,  0);
+    result[3] = append_unsigned_long_katcl(f->f_line,  KATCP_FLAG_LAST | KATCP_FLAG_ULONG,  4);
+  }
+
+  for(i = 0; i < 4; i++){
+    if(result[i] <= 0){ /* partial request on the line, unusable */
+      drop_connection_fmon(f);
+      return -1;
+    }
+  }
+
+  r = &(f->f_registers[f->f_count]);
+
+  strcpy(r->r_name, name);
+  r->r_kind = kind;
+  r->r_result = (-1);
+  r->r_value = value;
+
+  f->f_count++;
+
+  return 0;
+}
+
+int queue_cycle_fmon(struct fmon_state *f)
+{
+#define BUFFER FMON_REGISTER_NAME
+  char buffer[BUFFER];
+  unsigned int i, j;
+  int fs, xs, xp, result;
+
+  /* retain requests still in flight, usually writes issued by the previous checks */
+
+  for(i = f->f_answered, j = 0; i < f->f_count; i++, j++){
+    if(i != j){
+      f->f_registers[j] = f->f_registers[i];
+    }
+  }
+  f->f_count = j;
+  f->f_answered = 0;
+
+  result = 0;
+
+  if(((f->f_board >= 0) && (f->f_fs > 0)) || (f->f_xs > 0)){
+    fs = f->f_fs;
+    xs = f->f_xs;
+    xp = f->f_xp_count;
+  } else {
+    /* not probed: ask for everything detect_fmon and query_versions_fmon might want, absent registers just fail */
+    result += queue_register_fmon(f, FMON_REQUEST_READ, "board_id", 0);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, "fine_ctrl", 0);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, "ctrl", 0);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, "rcs_app", 0);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, "rcs_user", 0);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, "rcs_lib", 0);
+
+    for(i = 0; i < FMON_MAX_CROSSES; i++){
+      snprintf(buffer, BUFFER, "xstatus%u", i);
+      result += queue_register_fmon(f, FMON_REQUEST_READ, buffer, 0);
+      snprintf(buffer, BUFFER, "gbe_tx_cnt%u", i);
+      result += queue_register_fmon(f, FMON_REQUEST_READ, buffer, 0);
+    }
+
+    /* and what the checks run straight after the probe would want */
+    fs = FMON_MAX_INPUTS;
+    xs = FMON_MAX_CROSSES;
+    xp = FMON_MAX_CROSSES;
+  }
+
+  if(fs > 0){
+    result += queue_register_fmon(f, FMON_REQUEST_READ, "clk_frequency", 0);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, "control", 0);
+  }
+
+  for(i = 0; i < fs; i++){
+    snprintf(buffer, BUFFER, "fstatus%u", i);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, buffer, 0);
+    snprintf(buffer, BUFFER, "adc_sum_sq%u", i);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, buffer, 0);
+    snprintf(buffer, BUFFER, "adc_ctrl%u", i);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, buffer, 0);
+  }
+
+  for(i = 0; i < xs; i++){
+    snprintf(buffer, BUFFER, "vacc_err_cnt%u", i);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, buffer, 0);
+    snprintf(buffer, BUFFER, "pkt_reord_err%u", i);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, buffer, 0);
+  }
+
+  for(i = 0; i < xp; i++){
+    snprintf(buffer, BUFFER, "gbe_tx_err_cnt%u", i);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, buffer, 0);
+    snprintf(buffer, BUFFER, "gbe_rx_err_cnt%u", i);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, buffer, 0);
+    snprintf(buffer, BUFFER, "rx_err_cnt%u", i);
+    result += queue_register_fmon(f, FMON_REQUEST_READ, buffer, 0);
+  }
+
+  return (result < 0) ? (-1) : 0;
+#undef BUFFER
+}
+
+int collect_batch_fmon(struct fmon_state *f)
+{
+  struct fmon_register *r;
+  char *name, *code;
+  uint32_t tmp;
+
+  while(have_katcl(f->f_line) > 0){
+    name = arg_string_katcl(f->f_line, 0);
+    if(name == NULL){
+      continue;
+    }
+
+    if(!arg_reply_katcl(f->f_line)){
+      if(!strcmp("#build-state", name)){
+        relay_build_state_fmon(f);
+      }
+      continue;
+    }
+
+    if(f->f_answered >= f->f_count){
+      log_message_katcl(f->f_report, KATCP_LEVEL_WARN, f->f_server, "unexpected reply %s", name);
+      return -1;
+    }
+
+    r = &(f->f_registers[f->f_answered]);
+    if(strcmp(name, (r->r_kind == FMON_REQUEST_WRITE) ? "!write" : "!read")){
+      log_message_katcl(f->f_report, KATCP_LEVEL_WARN, f->f_server, "reply %s out of sequence while accessing %s", name, r->r_name);
+      return -1;
+    }
+
+    code = arg_string_katcl(f->f_line, 1);
+    if((code == NULL) || strcmp(code, KATCP_OK)){
+      r->r_result = 1;
+    } else if(r->r_kind == FMON_REQUEST_WRITE){
+      r->r_result = 0;
+    } else if(arg_buffer_katcl(f->f_line, 2, &tmp, 4) == 4){
+      r->r_value = ntohl(tmp);
+      r->r_result = 0;
+    } else {
+      r->r_result = (-1);
+    }
+
+    f->f_answered++;
+  }
+
+  gettimeofday(&(f->f_io), NULL);
+
+  return 0;
+}
+
 int read_word_fmon(struct fmon_state *f, char *name, uint32_t *value)
 {
   int result[4], r, status, i;
   int expect[4] = { 6, 0, 2, 2 };
   uint32_t tmp;
   char *code;
+  struct fmon_register *pr;
 
   if(maintain_fmon(f) < 0){
     return -1;
   }
 
+  if(f->f_batch){
+    pr = find_register_fmon(f, name);
+    if(pr){
+      if(pr->r_result == 0){
+        *value = pr->r_value;
+        f->f_something++;
+      }
+      return pr->r_result;
+    }
+    if(f->f_answered < f->f_count){ /* a round trip now would collect somebody else's reply */
+      return -1;
+    }
+    /* not in pipelined set, fall back to a plain round trip */
+  }
+
   result[0] = append_string_katcl(f->f_line,                           KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?read");
   result[1] = append_string_katcl(f->f_line,                           KATCP_FLAG_STRING, name);
   result[2] = append_unsigned_long_katcl(f->f_line,                    KATCP_FLAG_ULONG,  0);
@@ -1020,6 +1332,19 @@ int write_word_fmon(struct fmon_state *f, char *name, uint32_t value)
     return -1;
   }
 
+  if(f->f_batch){ /* reply collected in the next cycle, later reads see the value written */
+    if(queue_register_fmon(f, FMON_REQUEST_WRITE, name, value) < 0){
+      return -1;
+    }
+    for(i = 0; i < f->f_answered; i++){
+      if((f->f_registers[i].r_kind == FMON_REQUEST_READ) && !strcmp(f->f_registers[i].r_name, name)){
+        f->f_registers[i].r_value = value;
+      }
+    }
+    f->f_something++;
+    return 0;
+  }
+
   tmp = htonl(value);
 
   result[0] = append_string_katcl(f->f_line,       KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?write");
@@ -1123,23 +1448,27 @@ int list_input_sensors_fmon(struct fmon_state *f)
 
 int print_sensor_list_fmon(struct fmon_state *f, struct fmon_sensor *s)
 {
+  struct fmon_sensor_template *t;
+
+  t = s->s_template;
+
   append_string_katcl(f->f_report, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#sensor-list");
   append_string_katcl(f->f_report,                    KATCP_FLAG_STRING, s->s_name);
-  append_string_katcl(f->f_report,                    KATCP_FLAG_STRING, s->s_description);
+  append_string_katcl(f->f_report,                    KATCP_FLAG_STRING, t->t_description);
   append_string_katcl(f->f_report,                    KATCP_FLAG_STRING, "none");
 
-  switch(s->s_type){
+  switch(t->t_type){
     case KATCP_SENSOR_FLOAT : 
       append_string_katcl(f->f_report,         KATCP_FLAG_STRING, "float");
 
-      append_double_katcl(f->f_report,         KATCP_FLAG_DOUBLE, s->s_fmin);
-      append_double_katcl(f->f_report,    KATCP_FLAG_DOUBLE | KATCP_FLAG_LAST, s->s_fmax);
+      append_double_katcl(f->f_report,         KATCP_FLAG_DOUBLE, t->t_fmin);
+      append_double_katcl(f->f_report,    KATCP_FLAG_DOUBLE | KATCP_FLAG_LAST, t->t_fmax);
       break;
     case KATCP_SENSOR_INTEGER : 
       append_string_katcl(f->f_report,         KATCP_FLAG_STRING, "integer");
 
-      append_unsigned_long_katcl(f->f_report,  KATCP_FLAG_ULONG, s->s_max);
-      append_unsigned_long_katcl(f->f_report,  KATCP_FLAG_ULONG | KATCP_FLAG_LAST, s->s_max);
+      append_unsigned_long_katcl(f->f_report,  KATCP_FLAG_ULONG, t->t_min);
+      append_unsigned_long_katcl(f->f_report,  KATCP_FLAG_ULONG | KATCP_FLAG_LAST, t->t_max);
       break;
     case KATCP_SENSOR_BOOLEAN : 
       append_string_katcl(f->f_report,  KATCP_FLAG_LAST | KATCP_FLAG_STRING, "boolean");
@@ -1163,7 +1492,7 @@ int print_sensor_status_fmon(struct fmon_state *f, struct fmon_sensor *s)
   append_string_katcl(f->f_report, KATCP_FLAG_STRING, s->s_name);
   append_string_katcl(f->f_report, KATCP_FLAG_STRING, name_status_sensor_katcl(s->s_status));
 
-  switch(s->s_type){
+  switch(s->s_template->t_type){
     case KATCP_SENSOR_INTEGER : 
     case KATCP_SENSOR_BOOLEAN : 
       append_unsigned_long_katcl(f->f_report, KATCP_FLAG_LAST | KATCP_FLAG_ULONG, s->s_value);
@@ -1222,7 +1551,7 @@ int make_labels_fmon(struct fmon_state *f)
     for(j = 0; j < FMON_INPUT_SENSORS; j++){
       s = &(n->n_sensors[j]);
 
-      if(populate_sensor_fmon(s, &(input_template[j]), n->n_label) < 0){
+      if(populate_sensor_fmon(s, &(input_template[j]), n->n_label, f->f_prefix) < 0){
         return -1;
       }
 
@@ -1489,9 +1818,13 @@ int update_sensor_status_fmon(struct fmon_state *f, struct fmon_sensor *s, unsig
 {
   char *str;
 
+  if(s->s_template == NULL){
+    return -1;
+  }
+
   if(status != s->s_status){
 
-    if(s->s_logging){
+    if(s->s_template->t_logging){
       str = name_status_sensor_katcl(status);
       if(str == NULL){
         str = "broken";
@@ -1518,12 +1851,16 @@ int update_sensor_fmon(struct fmon_state *f, struct fmon_sensor *s, int value, u
 
   change = 0;
 
-  switch(s->s_type){
+  if(s->s_template == NULL){
+    return -1;
+  }
+
+  switch(s->s_template->t_type){
     case KATCP_SENSOR_BOOLEAN :
     case KATCP_SENSOR_INTEGER :
       break;
     default :
-      log_message_katcl(f->f_report, KATCP_LEVEL_WARN, f->f_server, "logic problem, updating integer for sensor type %d", s->s_type);
+      log_message_katcl(f->f_report, KATCP_LEVEL_WARN, f->f_server, "logic problem, updating integer for sensor type %d", s->s_template->t_type);
       return -1;
   }
 
@@ -1534,7 +1871,7 @@ int update_sensor_fmon(struct fmon_state *f, struct fmon_sensor *s, int value, u
 
   if(status != s->s_status){
 
-    if(s->s_logging){
+    if(s->s_template->t_logging){
       str = name_status_sensor_katcl(status);
       if(str == NULL){
         str = "broken";
@@ -1564,8 +1901,12 @@ int update_sensor_double_fmon(struct fmon_state *f, struct fmon_sensor *s, doubl
 
   change = 0;
 
-  if(s->s_type != KATCP_SENSOR_FLOAT){
-    log_message_katcl(f->f_report, KATCP_LEVEL_WARN, f->f_server, "logic problem, updating float for sensor type %d", s->s_type);
+  if(s->s_template == NULL){
+    return -1;
+  }
+
+  if(s->s_template->t_type != KATCP_SENSOR_FLOAT){
+    log_message_katcl(f->f_report, KATCP_LEVEL_WARN, f->f_server, "logic problem, updating float for sensor type %d", s->s_template->t_type);
     return -1;
   }
 
@@ -1852,6 +2193,10 @@ int check_watchdog_fmon(struct fmon_state *f)
     return 0;
   }
 
+  if(f->f_batch){ /* pipelined reads have exercised the link already */
+    return f->f_line ? 0 : (-1);
+  }
+
   if(maintain_fmon(f) < 0){
     return -1;
   }
@@ -2051,11 +2396,251 @@ int check_basic_xengine_fmon(struct fmon_state *f)
 #undef BUFFER
 }
 
+void check_all_fmon(struct fmon_state *f)
+{
+  maintain_fmon(f); /* might have to check return code, but if we do we skip checks which set sensors to unknown on failure ?  */
+
+  check_clock_fengine_fmon(f);
+  check_inputs_fengine_fmon(f);
+
+  check_basic_xengine_fmon(f);
+
+  check_watchdog_fmon(f); /* only gets done if nothing else happened */
+}
+
+/* multiple boards **********************************************************/
+
+void settle_board_fmon(struct fmon_state *f, unsigned int interval)
+{
+  /* the checks run unchanged, but are served from the registers collected */
+
+  f->f_settled = 1;
+
+  f->f_batch = 1;
+  check_all_fmon(f);
+  f->f_batch = 0;
+
+  if(f->f_grace <= FMON_INIT_PERIOD){
+    f->f_grace += interval;
+  }
+}
+
+void start_board_fmon(struct fmon_state *f, unsigned int timeout, unsigned int interval)
+{
+  set_timeout_fmon(f, timeout);
+  f->f_settled = 0;
+
+  if(f->f_line){
+    if(queue_cycle_fmon(f) < 0){
+      drop_connection_fmon(f);
+      settle_board_fmon(f, interval);
+    }
+    return;
+  }
+
+  f->f_connecting = net_connect(f->f_server, 0, NETC_ASYNC);
+  if(f->f_connecting < 0){
+    log_message_katcl(f->f_report, KATCP_LEVEL_TRACE, f->f_server, "connect to %s failed: %s", f->f_server, strerror(errno));
+    settle_board_fmon(f, interval);
+  }
+}
+
+void connected_board_fmon(struct fmon_state *f, unsigned int interval)
+{
+  socklen_t len;
+  int code, fd;
+
+  fd = f->f_connecting;
+  f->f_connecting = (-1);
+
+  len = sizeof(int);
+  if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &code, &len) < 0){
+    code = errno;
+  }
+
+  if(code){
+    log_message_katcl(f->f_report, KATCP_LEVEL_TRACE, f->f_server, "connect to %s failed: %s", f->f_server, strerror(code));
+    close(fd);
+    settle_board_fmon(f, interval);
+    return;
+  }
+
+  f->f_line = create_katcl(fd);
+  if(f->f_line == NULL){
+    close(fd);
+    settle_board_fmon(f, interval);
+    return;
+  }
+
+  f->f_count = 0;
+  f->f_answered = 0;
+  f->f_fresh = 1; /* maintain_fmon still needs to probe */
+
+  if(queue_cycle_fmon(f) < 0){
+    drop_connection_fmon(f);
+    settle_board_fmon(f, interval);
+  }
+}
+
+int run_boards_fmon(struct fmon_state *set, unsigned int count, struct pollfd *pfds, struct fmon_state **polled, unsigned int timeout, unsigned int interval)
+{
+  struct fmon_state *f;
+  struct timeval now, delta, period, next;
+  unsigned int i, n;
+  int wait, ms, result;
+
+  /* every board runs its own cycle, with its own deadline, so a slow board holds up nobody else */
+
+  period.tv_sec = interval / 1000;
+  period.tv_usec = (interval % 1000) * 1000;
+
+  for(f = set; f; f = f->f_next){
+    start_board_fmon(f, timeout, interval);
+  }
+
+  while(run > 0){
+    gettimeofday(&now, NULL);
+
+    n = 0;
+    wait = (-1);
+
+    for(f = set; f; f = f->f_next){
+      if(f->f_settled){
+        add_time_katcp(&next, &(f->f_start), &period);
+        if(cmp_time_katcp(&next, &now) <= 0){
+          start_board_fmon(f, timeout, interval);
+        }
+      } else if(cmp_time_katcp(&(f->f_when), &now) <= 0){
+        if(f->f_connecting >= 0){
+          log_message_katcl(f->f_report, KATCP_LEVEL_TRACE, f->f_server, "connect to %s timed out", f->f_server);
+          close(f->f_connecting);
+          f->f_connecting = (-1);
+        } else if(f->f_line){
+          log_message_katcl(f->f_report, KATCP_LEVEL_WARN, f->f_server, "roach %s answered %u of %u requests in time", f->f_server, f->f_answered, f->f_count);
+          drop_connection_fmon(f);
+        }
+        settle_board_fmon(f, interval);
+      }
+
+      if(f->f_settled){
+        add_time_katcp(&next, &(f->f_start), &period);
+      } else {
+        next = f->f_when;
+      }
+
+      if(cmp_time_katcp(&next, &now) > 0){
+        sub_time_katcp(&delta, &next, &now);
+        ms = (delta.tv_sec * 1000) + ((delta.tv_usec + 999) / 1000);
+      } else {
+        ms = 0;
+      }
+      if((wait < 0) || (ms < wait)){
+        wait = ms;
+      }
+
+      if(f->f_connecting >= 0){
+        pfds[n].fd = f->f_connecting;
+        pfds[n].events = POLLOUT;
+      } else if(f->f_line == NULL){
+        continue;
+      } else if(f->f_settled){
+        if(!flushing_katcl(f->f_line)){
+          continue;
+        }
+        pfds[n].fd = fileno_katcl(f->f_line);
+        pfds[n].events = POLLOUT;
+      } else {
+        pfds[n].fd = fileno_katcl(f->f_line);
+        pfds[n].events = POLLIN | (flushing_katcl(f->f_line) ? POLLOUT : 0);
+      }
+
+      pfds[n].revents = 0;
+      polled[n] = f;
+      n++;
+    }
+
+    /* last slot is our own report line, on which requests arrive too */
+
+    pfds[n].fd = fileno_katcl(set->f_report);
+    pfds[n].events = POLLIN | (flushing_katcl(set->f_report) ? POLLOUT : 0);
+    pfds[n].revents = 0;
+
+    result = poll(pfds, n + 1, wait);
+    if(result < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          continue;
+        default :
+          return -1;
+      }
+    }
+
+    if(pfds[n].revents & POLLOUT){
+      if(write_katcl(set->f_report) < 0){
+        return -1;
+      }
+    }
+
+    if(pfds[n].revents & (POLLIN | POLLHUP | POLLERR)){
+      if(serve_requests_fmon(set) < 0){
+        return -1;
+      }
+    }
+
+    for(i = 0; i < n; i++){
+      f = polled[i];
+
+      if(pfds[i].revents == 0){
+        continue;
+      }
+
+      if(f->f_connecting >= 0){
+        connected_board_fmon(f, interval);
+        continue;
+      }
+
+      if(pfds[i].revents & POLLOUT){
+        if(write_katcl(f->f_line) < 0){
+          drop_connection_fmon(f);
+          if(f->f_settled == 0){
+            settle_board_fmon(f, interval);
+          }
+          continue;
+        }
+      }
+
+      if(f->f_settled){
+        continue;
+      }
+
+      if(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)){
+        if(read_katcl(f->f_line) || (collect_batch_fmon(f) < 0)){
+          drop_connection_fmon(f);
+          settle_board_fmon(f, interval);
+          continue;
+        }
+      }
+
+      if(f->f_answered >= f->f_count){
+        settle_board_fmon(f, interval);
+      }
+    }
+
+    if(check_parent(set) < 0){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
 /* main related **********************************************************/
 
 void usage(char *app)
 {
   printf("usage: %s [-t timeout] [-s server] [-h] [-r] [-l] [-v] [-q] [-b id] [server [id]]\n", app);
+  printf("       %s [options] -m server [server ...]\n", app);
   printf("\n");
 
   printf("-h                this help\n");
@@ -2067,6 +2652,7 @@ void usage(char *app)
   printf("-t milliseconds   command timeout in ms\n");
   printf("-i milliseconds   interval between polls in ms\n");
   printf("-r count          reprobe count in poll intervals\n");
+  printf("-m                monitor all boards given as further parameters\n");
 
   printf("\n");
   printf("return codes:\n");
@@ -2077,6 +2663,64 @@ void usage(char *app)
   printf("3                 other permanent failures\n");
 }
 
+int main_boards_fmon(char **argv, char **servers, unsigned int count, int verbose, unsigned int timeout, unsigned int interval, int reprobe, int fixed)
+{
+  struct fmon_state *set, *f, **tail, **polled;
+  struct katcl_line *report;
+  struct pollfd *pfds;
+  unsigned int i;
+
+  report = create_report_fmon();
+  pfds = malloc(sizeof(struct pollfd) * (count + 1));
+  polled = malloc(sizeof(struct fmon_state *) * count);
+
+  if((report == NULL) || (pfds == NULL) || (polled == NULL)){
+    fprintf(stderr, "fmon: unable to allocate state for %u boards\n", count);
+    return 2;
+  }
+
+  set = NULL;
+  tail = &set;
+
+  for(i = 0; i < count; i++){
+    f = create_fmon(servers[i], verbose, timeout, (reprobe < 0) ? (strncmp(servers[i], "roach", 5) ? 0 : 1) : reprobe, fixed, report);
+    if(f == NULL){
+      fprintf(stderr, "fmon: unable to allocate monitoring state for %s\n", servers[i]);
+      return 2;
+    }
+    *tail = f;
+    tail = &(f->f_next);
+  }
+
+  sync_message_katcl(report, KATCP_LEVEL_INFO, "fmon", "starting monitoring routines for %u boards", count);
+
+  run = 1;
+  if(run_boards_fmon(set, count, pfds, polled, timeout, interval) < 0){
+    run = 0;
+  }
+
+  sync_message_katcl(report, KATCP_LEVEL_INFO, "fmon", "%s sensor monitoring logic for %u boards", (run < 0) ? "restarting" : "stopping", count);
+
+  if(run < 0){
+    execvp(argv[0], argv);
+
+    sync_message_katcl(report, KATCP_LEVEL_WARN, "fmon", "unable to restart %s: %s", argv[0], strerror(errno));
+    return 2;
+  }
+
+  while(set){
+    f = set;
+    set = f->f_next;
+    destroy_fmon(f);
+  }
+
+  destroy_katcl(report, 0);
+  free(pfds);
+  free(polled);
+
+  return 0;
+}
+
 int main(int argc, char **argv)
 {
   int i, j, c, g;
@@ -2086,6 +2730,9 @@ int main(int argc, char **argv)
   unsigned int timeout;
   struct sigaction sag;
   unsigned int fixed;
+  char **servers;
+  unsigned int count;
+  int multi;
 
   verbose = 1;
   i = j = 1;
@@ -2095,6 +2742,13 @@ int main(int argc, char **argv)
   interval = 0;
   reprobe = (-1);
   fixed = (-1);
+  multi = 0;
+  count = 0;
+
+  servers = malloc(sizeof(char *) * argc);
+  if(servers == NULL){
+    return 2;
+  }
 
   if(strncmp(argv[0], "roach", 5) == 0){
     server = argv[0];
@@ -2138,10 +2792,16 @@ int main(int argc, char **argv)
           j++;
           break;
 
+        case 'm' : 
+          multi = 1;
+          j++;
+          break;
+
         case 't' :
         case 's' :
         case 'i' :
         case 'r' :
+        case 'b' :
 #if 0        
         case 'e' :
 #endif
@@ -2196,6 +2856,9 @@ int main(int argc, char **argv)
           fprintf(stderr, "%s: unknown option -%c\n", app, argv[i][j]);
           return 2;
       }
+    } else if(multi){
+      servers[count++] = argv[i];
+      i++;
     } else {
       switch(g){
         case 0 :
@@ -2213,7 +2876,7 @@ int main(int argc, char **argv)
     }
   }
 
-  if(reprobe < 0){
+  if((reprobe < 0) && (multi == 0)){
     if(strncmp(server, "roach", 5)){
       reprobe = 0;
     } else {
@@ -2236,7 +2899,15 @@ int main(int argc, char **argv)
     timeout = FMON_DEFAULT_TIMEOUT;
   }
 
-  f = create_fmon(server, verbose, timeout, reprobe, fixed);
+  if(multi){
+    if(count == 0){
+      fprintf(stderr, "%s: need at least one board to monitor\n", app);
+      return 2;
+    }
+    return main_boards_fmon(argv, servers, count, verbose, timeout, interval, reprobe, fixed);
+  }
+
+  f = create_fmon(server, verbose, timeout, reprobe, fixed, NULL);
   if(f == NULL){
     fprintf(stderr, "%s: unable to allocate monitoring state\n", app);
     return 2;
@@ -2253,14 +2924,7 @@ int main(int argc, char **argv)
   for(run = 1; run > 0; ){
     set_timeout_fmon(f, timeout);
 
-    maintain_fmon(f); /* might have to check return code, but if we do we skip checks which set sensors to unknown on failure ?  */
-
-    check_clock_fengine_fmon(f);
-    check_inputs_fengine_fmon(f);
-
-    check_basic_xengine_fmon(f);
-
-    check_watchdog_fmon(f); /* only gets done if nothing else happened */
+    check_all_fmon(f);
 
     if(catchup_fmon(f, interval) < 0){
       run = 0;
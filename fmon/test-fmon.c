@@ -0,0 +1,432 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* runs kcpfmon -m against a set of fake boards served from one
+ * process: most boards answer register reads, every fourth one is an
+ * xengine, the second last stalls and the last refuses connections.
+ * The first board raises an adc overrange once, which kcpfmon has to
+ * clear by writing the control register. Checks that the healthy
+ * boards get reported long before the stalled one times out
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <netc.h>
+#include <katcp.h>
+#include <katpriv.h>
+#include <katcl.h>
+#include <fixture.h>
+
+#define BOARDS        64
+#define BASE       23000
+#define LINE        1024
+
+#define TIMEOUT     1500
+#define INTERVAL     300
+#define DURATION    4000
+
+#define ROLE_FENGINE   0
+#define ROLE_XENGINE   1
+#define ROLE_STALL     2
+#define ROLE_REFUSE    3
+
+#define ADC_OVERRANGE  0x0004
+
+struct board{
+  int b_index;
+  int b_role;
+  unsigned int b_reads;
+  int b_raised;
+  int b_overrange;
+};
+
+static int lookup(struct board *b, char *name, uint32_t *value)
+{
+  if(!strcmp(name, "board_id")){
+    *value = b->b_index + 1;
+    return 0;
+  }
+  if(!strcmp(name, "rcs_app") || !strcmp(name, "rcs_lib")){
+    *value = 0x40000000 | 42;
+    return 0;
+  }
+  if(!strcmp(name, "rcs_user")){
+    *value = 7;
+    return 0;
+  }
+
+  if(b->b_role == ROLE_XENGINE){
+    if(!strcmp(name, "xstatus0") || !strcmp(name, "gbe_tx_cnt0") || !strcmp(name, "ctrl") ||
+       !strcmp(name, "vacc_err_cnt0") || !strcmp(name, "pkt_reord_err0") ||
+       !strcmp(name, "gbe_tx_err_cnt0") || !strcmp(name, "gbe_rx_err_cnt0") || !strcmp(name, "rx_err_cnt0")){
+      *value = 0;
+      return 0;
+    }
+    return -1;
+  }
+
+  if(!strcmp(name, "fstatus0")){
+    b->b_reads++;
+    if((b->b_index == 0) && (b->b_raised == 0) && (b->b_reads >= 4)){
+      b->b_raised = 1;
+      b->b_overrange = 1;
+    }
+    *value = b->b_overrange ? ADC_OVERRANGE : 0;
+    return 0;
+  }
+  if(!strcmp(name, "fstatus1") || !strcmp(name, "control")){
+    *value = 0;
+    return 0;
+  }
+  if(!strcmp(name, "clk_frequency")){
+    *value = 200000000;
+    return 0;
+  }
+  if(!strcmp(name, "adc_sum_sq0") || !strcmp(name, "adc_sum_sq1")){
+    *value = 0x10000 * 100;
+    return 0;
+  }
+  if(!strcmp(name, "adc_ctrl0") || !strcmp(name, "adc_ctrl1")){
+    *value = 0x80000000 | 10;
+    return 0;
+  }
+
+  return -1;
+}
+
+static int serve_request(struct katcl_line *l, unsigned int index, void *data)
+{
+  struct board *b;
+  unsigned char raw[4];
+  uint32_t value;
+  char *name, *reg;
+
+  b = &(((struct board *)data)[index]);
+
+  if(b->b_role == ROLE_STALL){
+    return 0; /* swallow everything, answer nothing */
+  }
+
+  name = arg_string_katcl(l, 0);
+  reg = arg_string_katcl(l, 1);
+  if(name == NULL){
+    return 0;
+  }
+
+  if(!strcmp(name, "?read") && reg){
+    if(lookup(b, reg, &value) < 0){
+      send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!read", KATCP_FLAG_STRING, KATCP_FAIL, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "register not found", NULL);
+    } else {
+      raw[0] = (value >> 24) & 0xff;
+      raw[1] = (value >> 16) & 0xff;
+      raw[2] = (value >>  8) & 0xff;
+      raw[3] = value & 0xff;
+      send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!read", KATCP_FLAG_STRING, KATCP_OK, KATCP_FLAG_LAST | KATCP_FLAG_BUFFER, raw, 4, NULL);
+    }
+  } else if(!strcmp(name, "?write") && reg){
+    if(!strcmp(reg, "control")){
+      b->b_overrange = 0; /* any write toggling the clear bit resets the status latch */
+    }
+    send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!write", KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCP_OK, NULL);
+  } else if(!strcmp(name, "?watchdog")){
+    send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!watchdog", KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCP_OK, NULL);
+  }
+
+  return 0;
+}
+
+static int board_of(char *name, unsigned int base, unsigned int boards, char **rest)
+{
+  unsigned int port;
+  char *end;
+
+  if(strncmp(name, "127.0.0.1-", 10)){
+    return -1;
+  }
+
+  port = strtoul(name + 10, &end, 10);
+  if((*end != '.') || (port < base) || (port >= base + boards)){
+    return -1;
+  }
+
+  *rest = end + 1;
+
+  return port - base;
+}
+
+int main(int argc, char **argv)
+{
+  int *fds, *status, *raised, *cleared, sv[2];
+  long *first, last_good, stalled, refused, ms;
+  unsigned int boards, base, i, arg;
+  char **args, *list, *ptr, *name, *rest, *state, *text, query[LINE], timeout[16], interval[16];
+  int failures, index, result, sampling, sequence;
+  struct timeval start, now, delta, tv;
+  struct katcl_line *l;
+  struct board *set;
+  pid_t server, fmon;
+  fd_set fsr;
+
+  boards = BOARDS;
+  if(argc > 1){
+    boards = atoi(argv[1]);
+  }
+  if(boards < 4){
+    fprintf(stderr, "test: need at least 4 boards\n");
+    return 2;
+  }
+
+  fds = malloc(sizeof(int) * boards);
+  set = malloc(sizeof(struct board) * boards);
+  status = malloc(sizeof(int) * boards);
+  raised = malloc(sizeof(int) * boards);
+  cleared = malloc(sizeof(int) * boards);
+  first = malloc(sizeof(long) * boards);
+  args = malloc(sizeof(char *) * (boards + 8));
+  list = malloc(boards * 32);
+  if((fds == NULL) || (set == NULL) || (status == NULL) || (raised == NULL) || (cleared == NULL) || (first == NULL) || (args == NULL) || (list == NULL)){
+    return 2;
+  }
+
+  base = BASE + ((getpid() % 64) * boards);
+  if(base + boards >= 65000){
+    fprintf(stderr, "test: too many boards\n");
+    return 2;
+  }
+
+  /* every fourth board is an xengine, the second last stalls, the last refuses */
+  for(i = 0; i < boards; i++){
+    set[i].b_index = i;
+    set[i].b_role = ((i % 4) == 3) ? ROLE_XENGINE : ROLE_FENGINE;
+    set[i].b_reads = 0;
+    set[i].b_raised = 0;
+    set[i].b_overrange = 0;
+  }
+  set[boards - 2].b_role = ROLE_STALL;
+  set[boards - 1].b_role = ROLE_REFUSE;
+
+  for(i = 0; i < boards; i++){
+    fds[i] = (-1);
+    if(set[i].b_role == ROLE_REFUSE){
+      continue;
+    }
+    fds[i] = net_listen("127.0.0.1", base + i, 0);
+    if(fds[i] < 0){
+      fprintf(stderr, "test: unable to listen on port %u: %s\n", base + i, strerror(errno));
+      return 2;
+    }
+  }
+
+  server = fork();
+  if(server < 0){
+    return 2;
+  }
+  if(server == 0){
+    freopen("/dev/null", "w", stderr);
+    serve_fixture(fds, boards, &serve_request, set);
+    exit(1);
+  }
+
+  for(i = 0; i < boards; i++){
+    if(fds[i] >= 0){
+      close(fds[i]);
+    }
+    status[i] = (-1);
+    raised[i] = 0;
+    cleared[i] = 0;
+    first[i] = (-1);
+  }
+
+  arg = 0;
+  args[arg++] = "./kcpfmon";
+  snprintf(timeout, sizeof(timeout), "%d", TIMEOUT);
+  snprintf(interval, sizeof(interval), "%d", INTERVAL);
+
+  args[arg++] = "-t";
+  args[arg++] = timeout;
+  args[arg++] = "-i";
+  args[arg++] = interval;
+  args[arg++] = "-m";
+
+  ptr = list;
+  for(i = 0; i < boards; i++){
+    args[arg++] = ptr;
+    ptr += sprintf(ptr, "127.0.0.1:%u", base + i) + 1;
+  }
+  args[arg] = NULL;
+
+  /* fmon answers requests on its stdout, so it wants a socket there */
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0){
+    return 2;
+  }
+
+  gettimeofday(&start, NULL);
+
+  fmon = fork();
+  if(fmon < 0){
+    return 2;
+  }
+  if(fmon == 0){
+    close(sv[0]);
+    dup2(sv[1], STDOUT_FILENO);
+    close(sv[1]);
+    freopen("/dev/null", "w", stderr); /* the library may be built with debug output */
+    execv(args[0], args);
+    exit(4);
+  }
+  close(sv[1]);
+
+  l = create_katcl(sv[0]);
+  if(l == NULL){
+    return 2;
+  }
+
+  stalled = (-1);
+  refused = (-1);
+  sampling = 0;
+  sequence = 0;
+  ms = 0;
+
+  snprintf(query, LINE, "127.0.0.1-%u.1x.adc.overrange", base);
+
+  while(ms < DURATION){
+    if((sampling == 0) && (ms > TIMEOUT + INTERVAL)){
+      send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?sensor-sampling", KATCP_FLAG_STRING, query, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "event", NULL);
+      if(write_katcl(l) <= 0){
+        fprintf(stderr, "test: unable to send sensor sampling request\n");
+      }
+      sampling = (-1);
+    }
+
+    FD_ZERO(&fsr);
+    FD_SET(sv[0], &fsr);
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+
+    result = select(sv[0] + 1, &fsr, NULL, NULL, &tv);
+
+    gettimeofday(&now, NULL);
+    sub_time_katcp(&delta, &now, &start);
+    ms = (delta.tv_sec * 1000) + (delta.tv_usec / 1000);
+
+    if(result <= 0){
+      continue;
+    }
+
+    result = read_katcl(l);
+
+    while(have_katcl(l) > 0){
+      name = arg_string_katcl(l, 0);
+      if(name == NULL){
+        continue;
+      }
+
+      if(!strcmp(name, "!sensor-sampling") && (text = arg_string_katcl(l, 1)) && !strcmp(text, KATCP_OK)){
+        sampling = 1;
+      }
+
+      if(!strcmp(name, "#log") && (text = arg_string_katcl(l, 4)) && strstr(text, "sequence")){
+        fprintf(stderr, "test: %s\n", text);
+        sequence++;
+      }
+
+      if(!strcmp(name, "#sensor-status") && (arg_count_katcl(l) >= 5)){
+        name = arg_string_katcl(l, 3);
+        state = arg_string_katcl(l, 4);
+        index = (name && state) ? board_of(name, base, boards, &rest) : (-1);
+
+        if(index >= 0){
+          if(!strcmp(rest, "lru.available")){
+            status[index] = strcmp(state, "nominal") ? 0 : 1;
+            if(status[index] && (first[index] < 0)){
+              first[index] = ms;
+            }
+            if((status[index] == 0) && !strcmp(state, "error")){
+              if((index + 2 == boards) && (stalled < 0)){
+                stalled = ms;
+              }
+              if((index + 1 == boards) && (refused < 0)){
+                refused = ms;
+              }
+            }
+          } else if(strstr(rest, "x.adc.overrange")){
+            if(!strcmp(state, "error")){
+              raised[index]++;
+            } else if(raised[index] && !strcmp(state, "nominal")){
+              cleared[index]++;
+            }
+          }
+        }
+      }
+    }
+
+    if(result){
+      break;
+    }
+  }
+
+  destroy_katcl(l, 1);
+
+  kill(fmon, SIGKILL);
+  waitpid(fmon, NULL, 0);
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+
+  failures = 0;
+  last_good = 0;
+
+  for(i = 0; i + 2 < boards; i++){
+    if(status[i] != 1){
+      fprintf(stderr, "test: board %u not reported as available\n", i);
+      failures++;
+    }
+    if(first[i] > last_good){
+      last_good = first[i];
+    }
+  }
+
+  if(status[boards - 2] != 0){
+    fprintf(stderr, "test: stalled board not reported as failed\n");
+    failures++;
+  }
+  if(status[boards - 1] != 0){
+    fprintf(stderr, "test: refusing board not reported as failed\n");
+    failures++;
+  }
+
+  if((stalled < 0) || (last_good >= stalled) || (last_good >= TIMEOUT)){
+    fprintf(stderr, "test: healthy boards took %ldms, stalled one failed after %ldms\n", last_good, stalled);
+    failures++;
+  }
+
+  if((raised[0] == 0) || (cleared[0] == 0)){
+    fprintf(stderr, "test: overrange of first board raised %d and cleared %d times\n", raised[0], cleared[0]);
+    failures++;
+  }
+
+  if(sequence){
+    fprintf(stderr, "test: %d replies out of sequence\n", sequence);
+    failures++;
+  }
+
+  if(sampling != 1){
+    fprintf(stderr, "test: sensor sampling request not accepted\n");
+    failures++;
+  }
+
+  printf("test: %u boards, healthy ones reported after %ldms, refusing one after %ldms, stalled one after %ldms: %s\n", boards, last_good, refused, stalled, failures ? "FAILED" : "ok");
+
+  return failures ? 1 : 0;
+}
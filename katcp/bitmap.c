@@ -0,0 +1,602 @@
+/* a compressed bitmap over dense integer ids: only nonzero 64 bit
+ * words are kept, sorted by their block number. Used to hold the
+ * members of a tag, so that tag queries become word wise and/or/not
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <katpriv.h>
+#include <katcp.h>
+
+#define BITMAP_WIDTH   64
+#define BITMAP_SHIFT    6
+#define BITMAP_INITIAL  4
+
+#define BITMAP_BLOCK(id) ((id) >> BITMAP_SHIFT)
+#define BITMAP_BIT(id)   (((unsigned long long)1) << ((id) & (BITMAP_WIDTH - 1)))
+
+struct katcp_bitmap *create_bitmap_katcp(void)
+{
+  struct katcp_bitmap *b;
+
+  b = malloc(sizeof(struct katcp_bitmap));
+  if(b == NULL){
+    return NULL;
+  }
+
+  b->b_key = NULL;
+  b->b_word = NULL;
+  b->b_count = 0;
+  b->b_size = 0;
+  b->b_bits = 0;
+
+  return b;
+}
+
+void destroy_bitmap_katcp(struct katcp_bitmap *b)
+{
+  if(b == NULL){
+    return;
+  }
+
+  if(b->b_key){
+    free(b->b_key);
+    b->b_key = NULL;
+  }
+
+  if(b->b_word){
+    free(b->b_word);
+    b->b_word = NULL;
+  }
+
+  b->b_count = 0;
+  b->b_size = 0;
+  b->b_bits = 0;
+
+  free(b);
+}
+
+void clear_bitmap_katcp(struct katcp_bitmap *b)
+{
+  if(b == NULL){
+    return;
+  }
+
+  b->b_count = 0;
+  b->b_bits = 0;
+}
+
+static int reserve_bitmap_katcp(struct katcp_bitmap *b, unsigned int size)
+{
+  unsigned int *key;
+  unsigned long long *word;
+  unsigned int want;
+
+  if(size <= b->b_size){
+    return 0;
+  }
+
+  want = (b->b_size > 0) ? b->b_size : BITMAP_INITIAL;
+  while(want < size){
+    want *= 2;
+  }
+
+  key = realloc(b->b_key, sizeof(unsigned int) * want);
+  if(key == NULL){
+    return -1;
+  }
+  b->b_key = key;
+
+  word = realloc(b->b_word, sizeof(unsigned long long) * want);
+  if(word == NULL){
+    return -1;
+  }
+  b->b_word = word;
+
+  b->b_size = want;
+
+  return 0;
+}
+
+/* position of block, or where it would be inserted */
+static unsigned int locate_bitmap_katcp(struct katcp_bitmap *b, unsigned int start, unsigned int block)
+{
+  unsigned int low, high, mid;
+
+  low = start;
+  high = b->b_count;
+
+  /* common case of appending ids in ascending order */
+  if((high > low) && (b->b_key[high - 1] < block)){
+    return high;
+  }
+
+  while(low < high){
+    mid = low + (high - low) / 2;
+    if(b->b_key[mid] < block){
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  return low;
+}
+
+int set_bitmap_katcp(struct katcp_bitmap *b, unsigned int id)
+{
+  unsigned int block, i;
+  unsigned long long bit;
+
+  if(b == NULL){
+    return -1;
+  }
+
+  block = BITMAP_BLOCK(id);
+  bit = BITMAP_BIT(id);
+
+  i = locate_bitmap_katcp(b, 0, block);
+
+  if((i < b->b_count) && (b->b_key[i] == block)){
+    if(b->b_word[i] & bit){
+      return 0;
+    }
+    b->b_word[i] |= bit;
+    b->b_bits++;
+    return 1;
+  }
+
+  if(reserve_bitmap_katcp(b, b->b_count + 1) < 0){
+    return -1;
+  }
+
+  if(i < b->b_count){
+    memmove(&(b->b_key[i + 1]), &(b->b_key[i]), sizeof(unsigned int) * (b->b_count - i));
+    memmove(&(b->b_word[i + 1]), &(b->b_word[i]), sizeof(unsigned long long) * (b->b_count - i));
+  }
+
+  b->b_key[i] = block;
+  b->b_word[i] = bit;
+  b->b_count++;
+  b->b_bits++;
+
+  return 1;
+}
+
+int unset_bitmap_katcp(struct katcp_bitmap *b, unsigned int id)
+{
+  unsigned int block, i;
+  unsigned long long bit;
+
+  if(b == NULL){
+    return -1;
+  }
+
+  block = BITMAP_BLOCK(id);
+  bit = BITMAP_BIT(id);
+
+  i = locate_bitmap_katcp(b, 0, block);
+
+  if((i >= b->b_count) || (b->b_key[i] != block) || ((b->b_word[i] & bit) == 0)){
+    return 0;
+  }
+
+  b->b_word[i] &= ~bit;
+  b->b_bits--;
+
+  if(b->b_word[i] == 0){
+    b->b_count--;
+    if(i < b->b_count){
+      memmove(&(b->b_key[i]), &(b->b_key[i + 1]), sizeof(unsigned int) * (b->b_count - i));
+      memmove(&(b->b_word[i]), &(b->b_word[i + 1]), sizeof(unsigned long long) * (b->b_count - i));
+    }
+  }
+
+  return 1;
+}
+
+int test_bitmap_katcp(struct katcp_bitmap *b, unsigned int id)
+{
+  unsigned int block, i;
+
+  if(b == NULL){
+    return 0;
+  }
+
+  block = BITMAP_BLOCK(id);
+
+  i = locate_bitmap_katcp(b, 0, block);
+  if((i >= b->b_count) || (b->b_key[i] != block)){
+    return 0;
+  }
+
+  return (b->b_word[i] & BITMAP_BIT(id)) ? 1 : 0;
+}
+
+unsigned int count_bitmap_katcp(struct katcp_bitmap *b)
+{
+  return (b == NULL) ? 0 : b->b_bits;
+}
+
+int copy_bitmap_katcp(struct katcp_bitmap *dst, struct katcp_bitmap *src)
+{
+  if((dst == NULL) || (src == NULL)){
+    return -1;
+  }
+
+  if(reserve_bitmap_katcp(dst, src->b_count) < 0){
+    return -1;
+  }
+
+  if(src->b_count > 0){
+    memcpy(dst->b_key, src->b_key, sizeof(unsigned int) * src->b_count);
+    memcpy(dst->b_word, src->b_word, sizeof(unsigned long long) * src->b_count);
+  }
+
+  dst->b_count = src->b_count;
+  dst->b_bits = src->b_bits;
+
+  return 0;
+}
+
+/* the in place operations below only ever shrink dst, so they
+ * can write behind the point they are reading from */
+
+int and_bitmap_katcp(struct katcp_bitmap *dst, struct katcp_bitmap *src)
+{
+  unsigned int i, j, k, bits;
+  unsigned long long word;
+  int skip;
+
+  if((dst == NULL) || (src == NULL)){
+    return -1;
+  }
+
+  /* much smaller dst, search rather than step through src */
+  skip = ((dst->b_count * 8) < src->b_count) ? 1 : 0;
+
+  i = 0;
+  j = 0;
+  k = 0;
+  bits = 0;
+
+  while((i < dst->b_count) && (j < src->b_count)){
+    if(skip){
+      j = locate_bitmap_katcp(src, j, dst->b_key[i]);
+      if(j >= src->b_count){
+        break;
+      }
+    }
+
+    if(dst->b_key[i] < src->b_key[j]){
+      i++;
+    } else if(dst->b_key[i] > src->b_key[j]){
+      j++;
+    } else {
+      word = dst->b_word[i] & src->b_word[j];
+      if(word){
+        dst->b_key[k] = dst->b_key[i];
+        dst->b_word[k] = word;
+        bits += __builtin_popcountll(word);
+        k++;
+      }
+      i++;
+      j++;
+    }
+  }
+
+  dst->b_count = k;
+  dst->b_bits = bits;
+
+  return 0;
+}
+
+int andnot_bitmap_katcp(struct katcp_bitmap *dst, struct katcp_bitmap *src)
+{
+  unsigned int i, j, k, bits;
+  unsigned long long word;
+
+  if((dst == NULL) || (src == NULL)){
+    return -1;
+  }
+
+  i = 0;
+  j = 0;
+  k = 0;
+  bits = 0;
+
+  while(i < dst->b_count){
+    word = dst->b_word[i];
+
+    while((j < src->b_count) && (src->b_key[j] < dst->b_key[i])){
+      j++;
+    }
+
+    if((j < src->b_count) && (src->b_key[j] == dst->b_key[i])){
+      word &= ~(src->b_word[j]);
+    }
+
+    if(word){
+      dst->b_key[k] = dst->b_key[i];
+      dst->b_word[k] = word;
+      bits += __builtin_popcountll(word);
+      k++;
+    }
+
+    i++;
+  }
+
+  dst->b_count = k;
+  dst->b_bits = bits;
+
+  return 0;
+}
+
+int or_bitmap_katcp(struct katcp_bitmap *dst, struct katcp_bitmap *src)
+{
+  unsigned int *key;
+  unsigned long long *word;
+  unsigned int i, j, k, size, bits;
+
+  if((dst == NULL) || (src == NULL)){
+    return -1;
+  }
+
+  if(src->b_count == 0){
+    return 0;
+  }
+
+  size = dst->b_count + src->b_count;
+
+  key = malloc(sizeof(unsigned int) * size);
+  word = malloc(sizeof(unsigned long long) * size);
+  if((key == NULL) || (word == NULL)){
+    if(key){
+      free(key);
+    }
+    if(word){
+      free(word);
+    }
+    return -1;
+  }
+
+  i = 0;
+  j = 0;
+  k = 0;
+  bits = 0;
+
+  while((i < dst->b_count) || (j < src->b_count)){
+    if((j >= src->b_count) || ((i < dst->b_count) && (dst->b_key[i] < src->b_key[j]))){
+      key[k] = dst->b_key[i];
+      word[k] = dst->b_word[i];
+      i++;
+    } else if((i >= dst->b_count) || (src->b_key[j] < dst->b_key[i])){
+      key[k] = src->b_key[j];
+      word[k] = src->b_word[j];
+      j++;
+    } else {
+      key[k] = dst->b_key[i];
+      word[k] = dst->b_word[i] | src->b_word[j];
+      i++;
+      j++;
+    }
+    bits += __builtin_popcountll(word[k]);
+    k++;
+  }
+
+  if(dst->b_key){
+    free(dst->b_key);
+  }
+  if(dst->b_word){
+    free(dst->b_word);
+  }
+
+  dst->b_key = key;
+  dst->b_word = word;
+  dst->b_size = size;
+  dst->b_count = k;
+  dst->b_bits = bits;
+
+  return 0;
+}
+
+/* calls back for each set id in ascending order, stops early if call returns < 0 */
+int walk_bitmap_katcp(struct katcp_bitmap *b, int (*call)(unsigned int id, void *data), void *data)
+{
+  unsigned int i, base, count;
+  unsigned long long word;
+
+  if((b == NULL) || (call == NULL)){
+    return -1;
+  }
+
+  count = 0;
+
+  for(i = 0; i < b->b_count; i++){
+    base = b->b_key[i] << BITMAP_SHIFT;
+    word = b->b_word[i];
+    while(word){
+      if((*call)(base + __builtin_ctzll(word), data) < 0){
+        return count;
+      }
+      count++;
+      word &= word - 1;
+    }
+  }
+
+  return count;
+}
+
+/* copies up to size set ids into vector, returns the number copied */
+int fetch_bitmap_katcp(struct katcp_bitmap *b, unsigned int *vector, unsigned int size)
+{
+  unsigned int i, base, count;
+  unsigned long long word;
+
+  if(b == NULL){
+    return -1;
+  }
+
+  count = 0;
+
+  for(i = 0; (i < b->b_count) && (count < size); i++){
+    base = b->b_key[i] << BITMAP_SHIFT;
+    word = b->b_word[i];
+    while(word && (count < size)){
+      vector[count++] = base + __builtin_ctzll(word);
+      word &= word - 1;
+    }
+  }
+
+  return count;
+}
+
+#ifdef UNIT_TEST_BITMAP
+
+#define TEST_RANGE  20000
+#define TEST_ROUNDS 8
+
+static int check_bitmap(struct katcp_bitmap *b, unsigned char *ref, char *label)
+{
+  unsigned int i, bits;
+
+  bits = 0;
+
+  for(i = 0; i < TEST_RANGE; i++){
+    if(test_bitmap_katcp(b, i) != ref[i]){
+      fprintf(stderr, "%s: mismatch at %u: bitmap %d, reference %d\n", label, i, test_bitmap_katcp(b, i), ref[i]);
+      return -1;
+    }
+    bits += ref[i];
+  }
+
+  if(count_bitmap_katcp(b) != bits){
+    fprintf(stderr, "%s: count %u, reference %u\n", label, count_bitmap_katcp(b), bits);
+    return -1;
+  }
+
+  for(i = 0; i < b->b_count; i++){
+    if(b->b_word[i] == 0){
+      fprintf(stderr, "%s: empty word retained at %u\n", label, i);
+      return -1;
+    }
+    if((i > 0) && (b->b_key[i - 1] >= b->b_key[i])){
+      fprintf(stderr, "%s: keys out of order at %u\n", label, i);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void fill_bitmap(struct katcp_bitmap *b, unsigned char *ref, int density)
+{
+  unsigned int i, id;
+
+  clear_bitmap_katcp(b);
+  memset(ref, 0, TEST_RANGE);
+
+  for(i = 0; i < (TEST_RANGE / density); i++){
+    id = rand() % TEST_RANGE;
+    set_bitmap_katcp(b, id);
+    ref[id] = 1;
+  }
+
+  for(i = 0; i < (TEST_RANGE / (density * 4)); i++){
+    id = rand() % TEST_RANGE;
+    unset_bitmap_katcp(b, id);
+    ref[id] = 0;
+  }
+}
+
+static int sum_ids(unsigned int id, void *data)
+{
+  unsigned long *sum;
+
+  sum = data;
+  *sum += id;
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct katcp_bitmap *a, *b;
+  unsigned char ra[TEST_RANGE], rb[TEST_RANGE];
+  unsigned int i, round;
+  unsigned long sum, expect;
+  int densities[] = { 2, 5, 50, 1000 };
+
+  srand(1);
+
+  a = create_bitmap_katcp();
+  b = create_bitmap_katcp();
+  if((a == NULL) || (b == NULL)){
+    fprintf(stderr, "bitmap: unable to allocate\n");
+    return 1;
+  }
+
+  for(round = 0; round < TEST_ROUNDS; round++){
+
+    fill_bitmap(a, ra, densities[round % 4]);
+    fill_bitmap(b, rb, densities[(round / 2) % 4]);
+
+    if(check_bitmap(a, ra, "fill") < 0){
+      return 1;
+    }
+
+    sum = 0;
+    expect = 0;
+    for(i = 0; i < TEST_RANGE; i++){
+      if(ra[i]){
+        expect += i;
+      }
+    }
+    if(walk_bitmap_katcp(a, &sum_ids, &sum) != count_bitmap_katcp(a) || (sum != expect)){
+      fprintf(stderr, "walk: sum %lu, expected %lu\n", sum, expect);
+      return 1;
+    }
+
+    switch(round % 3){
+      case 0 :
+        and_bitmap_katcp(a, b);
+        for(i = 0; i < TEST_RANGE; i++){
+          ra[i] = ra[i] & rb[i];
+        }
+        break;
+      case 1 :
+        or_bitmap_katcp(a, b);
+        for(i = 0; i < TEST_RANGE; i++){
+          ra[i] = ra[i] | rb[i];
+        }
+        break;
+      case 2 :
+        andnot_bitmap_katcp(a, b);
+        for(i = 0; i < TEST_RANGE; i++){
+          ra[i] = ra[i] & (!rb[i]);
+        }
+        break;
+    }
+
+    if(check_bitmap(a, ra, "operation") < 0){
+      fprintf(stderr, "bitmap: failed operation %u in round %u\n", round % 3, round);
+      return 1;
+    }
+
+    if(copy_bitmap_katcp(b, a) < 0 || check_bitmap(b, ra, "copy") < 0){
+      return 1;
+    }
+
+    fprintf(stderr, "bitmap: round %u ok, %u ids in %u words\n", round, count_bitmap_katcp(a), a->b_count);
+  }
+
+  destroy_bitmap_katcp(a);
+  destroy_bitmap_katcp(b);
+
+  printf("bitmap: all tests passed\n");
+
+  return 0;
+}
+#endif
@@ -0,0 +1,1431 @@
+/***
+  A B+ Tree Implementation
+  with inline key prefixes and
+  slab allocated pages and entries
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "katcp.h"
+#include "bptree.h"
+
+#define BPT_FILL        (BPT_FANOUT - (BPT_FANOUT / 8))
+#define BPT_MERGE       (BPT_FANOUT / 4)
+#define BPT_SLAB_BYTES  16384
+
+struct bpt_probe {
+  char *b_key;
+  unsigned long long b_prefix;
+  int b_long;
+};
+
+/* slabs ********************************************************************/
+
+static void init_arena_bptree(struct bpt_arena *a, unsigned int item)
+{
+  a->a_free = NULL;
+  a->a_slabs = NULL;
+  a->a_count = 0;
+  a->a_size = 0;
+  a->a_item = item;
+  a->a_spare = 0;
+}
+
+static int grow_arena_bptree(struct bpt_arena *a)
+{
+  void **slabs;
+  char *slab, *item;
+  unsigned int per, i, size;
+
+  if(a->a_count >= a->a_size){
+    size = (a->a_size > 0) ? (a->a_size * 2) : 8;
+    slabs = realloc(a->a_slabs, sizeof(void *) * size);
+    if(slabs == NULL){
+      return -1;
+    }
+    a->a_slabs = slabs;
+    a->a_size = size;
+  }
+
+  per = BPT_SLAB_BYTES / a->a_item;
+  if(per < 4){
+    per = 4;
+  }
+
+  slab = malloc(per * a->a_item);
+  if(slab == NULL){
+    return -1;
+  }
+
+  a->a_slabs[a->a_count++] = slab;
+
+  /* hand items out in address order */
+  for(i = per; i > 0; i--){
+    item = slab + ((i - 1) * a->a_item);
+    *((void **)item) = a->a_free;
+    a->a_free = item;
+  }
+
+  a->a_spare += per;
+
+  return 0;
+}
+
+static int reserve_arena_bptree(struct bpt_arena *a, unsigned int count)
+{
+  while(a->a_spare < count){
+    if(grow_arena_bptree(a) < 0){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void *alloc_arena_bptree(struct bpt_arena *a)
+{
+  void *item;
+
+  if(a->a_free == NULL){
+    if(grow_arena_bptree(a) < 0){
+      return NULL;
+    }
+  }
+
+  item = a->a_free;
+  a->a_free = *((void **)item);
+  a->a_spare--;
+
+  return item;
+}
+
+static void release_arena_bptree(struct bpt_arena *a, void *item)
+{
+  *((void **)item) = a->a_free;
+  a->a_free = item;
+  a->a_spare++;
+}
+
+static void destroy_arena_bptree(struct bpt_arena *a)
+{
+  unsigned int i;
+
+  for(i = 0; i < a->a_count; i++){
+    free(a->a_slabs[i]);
+  }
+
+  if(a->a_slabs){
+    free(a->a_slabs);
+  }
+
+  init_arena_bptree(a, a->a_item);
+}
+
+/* keys *********************************************************************/
+
+/* first 8 bytes big endian, zero padded, so integer order is strcmp order */
+static unsigned long long prefix_bptree(char *key, int *more)
+{
+  unsigned long long v;
+  unsigned int i;
+
+  v = 0;
+
+  for(i = 0; (i < 8) && (key[i] != '\0'); i++){
+    v = (v << 8) | ((unsigned char)key[i]);
+  }
+
+  if(more){
+    *more = (i >= 8);
+  }
+
+  if(i == 0){
+    return 0;
+  }
+
+  return (i < 8) ? (v << (8 * (8 - i))) : v;
+}
+
+static void make_probe_bptree(struct bpt_probe *b, char *key)
+{
+  b->b_key = key;
+  b->b_prefix = prefix_bptree(key, &(b->b_long));
+}
+
+static int compare_bptree(struct bpt_probe *b, struct bpt_page *p, unsigned int i)
+{
+  if(b->b_prefix != p->p_prefix[i]){
+    return (b->b_prefix < p->p_prefix[i]) ? -1 : 1;
+  }
+
+  /* equal prefixes with a terminator inside them mean equal keys */
+  if(b->b_long == 0){
+    return 0;
+  }
+
+  return strcmp(b->b_key + 8, p->p_key[i]->n_key + 8);
+}
+
+static unsigned int lower_bptree(struct bpt_page *p, struct bpt_probe *b, int *exact)
+{
+  unsigned int lo, hi, mid;
+  int cmp;
+
+  lo = 0;
+  hi = p->p_count;
+
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    cmp = compare_bptree(b, p, mid);
+    if(cmp == 0){
+      *exact = 1;
+      return mid;
+    }
+    if(cmp > 0){
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  *exact = 0;
+
+  return lo;
+}
+
+static unsigned int child_bptree(struct bpt_page *p, struct bpt_probe *b)
+{
+  unsigned int i;
+  int exact;
+
+  i = lower_bptree(p, b, &exact);
+  if(exact){
+    return i;
+  }
+
+  return (i > 0) ? (i - 1) : 0;
+}
+
+/* pages and entries ********************************************************/
+
+static struct bpt_page *alloc_page_bptree(struct bpt_tree *t, unsigned int leaf)
+{
+  struct bpt_page *p;
+
+  p = alloc_arena_bptree(&(t->t_pages));
+  if(p == NULL){
+    return NULL;
+  }
+
+  p->p_count = 0;
+  p->p_leaf = leaf;
+  p->p_next = NULL;
+  p->p_prev = NULL;
+
+  return p;
+}
+
+static struct bpt_node *create_node_bptree(struct bpt_tree *t, char *key, void *data)
+{
+  struct bpt_node *n;
+  unsigned int len;
+
+  n = alloc_arena_bptree(&(t->t_nodes));
+  if(n == NULL){
+    return NULL;
+  }
+
+  len = strlen(key);
+  if(len < BPT_INLINE){
+    memcpy(n->n_inline, key, len + 1);
+    n->n_key = n->n_inline;
+  } else {
+    n->n_key = strdup(key);
+    if(n->n_key == NULL){
+      release_arena_bptree(&(t->t_nodes), n);
+      return NULL;
+    }
+  }
+
+  n->n_data = data;
+
+  return n;
+}
+
+static void free_node_bptree(struct bpt_node *n, void (*d_free)(void *))
+{
+  if(n->n_data && d_free){
+    (*d_free)(n->n_data);
+  }
+  n->n_data = NULL;
+
+  if(n->n_key != n->n_inline){
+    free(n->n_key);
+  }
+  n->n_key = NULL;
+}
+
+static void release_node_bptree(struct bpt_tree *t, struct bpt_node *n, void (*d_free)(void *))
+{
+  free_node_bptree(n, d_free);
+  release_arena_bptree(&(t->t_nodes), n);
+}
+
+static void set_child_bptree(struct bpt_page *p, unsigned int i, struct bpt_page *c)
+{
+  p->p_child[i] = c;
+  p->p_key[i] = c->p_key[0];
+  p->p_prefix[i] = c->p_prefix[0];
+}
+
+static void open_bptree(struct bpt_page *p, unsigned int i)
+{
+  unsigned int move;
+
+  move = p->p_count - i;
+  if(move == 0){
+    return;
+  }
+
+  memmove(p->p_prefix + i + 1, p->p_prefix + i, move * sizeof(unsigned long long));
+  memmove(p->p_key + i + 1, p->p_key + i, move * sizeof(struct bpt_node *));
+  if(!(p->p_leaf)){
+    memmove(p->p_child + i + 1, p->p_child + i, move * sizeof(struct bpt_page *));
+  }
+}
+
+static void close_bptree(struct bpt_page *p, unsigned int i)
+{
+  unsigned int move;
+
+  move = p->p_count - i - 1;
+
+  if(move > 0){
+    memmove(p->p_prefix + i, p->p_prefix + i + 1, move * sizeof(unsigned long long));
+    memmove(p->p_key + i, p->p_key + i + 1, move * sizeof(struct bpt_node *));
+    if(!(p->p_leaf)){
+      memmove(p->p_child + i, p->p_child + i + 1, move * sizeof(struct bpt_page *));
+    }
+  }
+
+  p->p_count--;
+}
+
+static void append_bptree(struct bpt_page *l, struct bpt_page *r, unsigned int from, unsigned int count)
+{
+  memcpy(l->p_prefix + l->p_count, r->p_prefix + from, count * sizeof(unsigned long long));
+  memcpy(l->p_key + l->p_count, r->p_key + from, count * sizeof(struct bpt_node *));
+  if(!(l->p_leaf)){
+    memcpy(l->p_child + l->p_count, r->p_child + from, count * sizeof(struct bpt_page *));
+  }
+
+  l->p_count += count;
+}
+
+static void unlink_leaf_bptree(struct bpt_page *p)
+{
+  if(p->p_prev){
+    p->p_prev->p_next = p->p_next;
+  }
+  if(p->p_next){
+    p->p_next->p_prev = p->p_prev;
+  }
+
+  p->p_next = NULL;
+  p->p_prev = NULL;
+}
+
+/* pages are reserved before an insert starts, so this can not fail */
+static struct bpt_page *split_bptree(struct bpt_tree *t, struct bpt_page *p)
+{
+  struct bpt_page *r;
+  unsigned int half;
+
+  r = alloc_page_bptree(t, p->p_leaf);
+
+  half = p->p_count / 2;
+  append_bptree(r, p, half, p->p_count - half);
+  p->p_count = half;
+
+  if(p->p_leaf){
+    r->p_next = p->p_next;
+    if(r->p_next){
+      r->p_next->p_prev = r;
+    }
+    r->p_prev = p;
+    p->p_next = r;
+  }
+
+  return r;
+}
+
+/* tree *********************************************************************/
+
+struct bpt_tree *create_bptree()
+{
+  struct bpt_tree *t;
+
+  t = malloc(sizeof(struct bpt_tree));
+  if (t == NULL)
+    return NULL;
+
+  t->t_root = NULL;
+  t->t_count = 0;
+  t->t_depth = 0;
+
+  init_arena_bptree(&(t->t_pages), sizeof(struct bpt_page));
+  init_arena_bptree(&(t->t_nodes), sizeof(struct bpt_node));
+
+  return t;
+}
+
+static struct bpt_page *first_leaf_bptree(struct bpt_tree *t)
+{
+  struct bpt_page *p;
+
+  p = t->t_root;
+  if(p == NULL){
+    return NULL;
+  }
+
+  while(!(p->p_leaf)){
+    p = p->p_child[0];
+  }
+
+  return p;
+}
+
+void destroy_bptree(struct bpt_tree *t, void (*d_free)(void *))
+{
+  struct bpt_page *p;
+  unsigned int i;
+
+  if (t == NULL)
+    return;
+
+  for(p = first_leaf_bptree(t); p != NULL; p = p->p_next){
+    for(i = 0; i < p->p_count; i++){
+      free_node_bptree(p->p_key[i], d_free);
+    }
+  }
+
+  t->t_root = NULL;
+  t->t_count = 0;
+  t->t_depth = 0;
+
+  destroy_arena_bptree(&(t->t_pages));
+  destroy_arena_bptree(&(t->t_nodes));
+
+  free(t);
+}
+
+static struct bpt_page *insert_bptree(struct bpt_tree *t, struct bpt_page *p, struct bpt_probe *b, struct bpt_node *n, int *result)
+{
+  struct bpt_page *r, *s;
+  unsigned int i;
+  int exact;
+
+  r = NULL;
+
+  if(p->p_leaf){
+    i = lower_bptree(p, b, &exact);
+    if(exact){
+      *result = -1;
+      return NULL;
+    }
+
+    if(p->p_count >= BPT_FANOUT){
+      r = split_bptree(t, p);
+      if(i > p->p_count){
+        i -= p->p_count;
+        p = r;
+      }
+    }
+
+    open_bptree(p, i);
+    p->p_key[i] = n;
+    p->p_prefix[i] = b->b_prefix;
+    p->p_count++;
+
+    *result = 0;
+
+    return r;
+  }
+
+  i = child_bptree(p, b);
+
+  s = insert_bptree(t, p->p_child[i], b, n, result);
+  if(*result < 0){
+    return NULL;
+  }
+
+  /* the new entry may be the smallest below this child */
+  set_child_bptree(p, i, p->p_child[i]);
+
+  if(s == NULL){
+    return NULL;
+  }
+
+  i++;
+
+  if(p->p_count >= BPT_FANOUT){
+    r = split_bptree(t, p);
+    if(i > p->p_count){
+      i -= p->p_count;
+      p = r;
+    }
+  }
+
+  open_bptree(p, i);
+  set_child_bptree(p, i, s);
+  p->p_count++;
+
+  return r;
+}
+
+int store_named_node_bptree(struct bpt_tree *t, char *key, void *data)
+{
+  struct bpt_probe b;
+  struct bpt_node *n;
+  struct bpt_page *s, *root;
+  int result;
+
+  if ((t == NULL) || (key == NULL))
+    return -1;
+
+  /* at worst every level splits and a new root appears */
+  if(reserve_arena_bptree(&(t->t_pages), t->t_depth + 2) < 0){
+    return -1;
+  }
+
+  n = create_node_bptree(t, key, data);
+  if(n == NULL){
+    return -1;
+  }
+
+  make_probe_bptree(&b, n->n_key);
+
+  if(t->t_root == NULL){
+    t->t_root = alloc_page_bptree(t, 1);
+    t->t_depth = 1;
+  }
+
+  s = insert_bptree(t, t->t_root, &b, n, &result);
+  if(result < 0){
+    release_node_bptree(t, n, NULL);
+    return -1;
+  }
+
+  if(s){
+    root = alloc_page_bptree(t, 0);
+    set_child_bptree(root, 0, t->t_root);
+    set_child_bptree(root, 1, s);
+    root->p_count = 2;
+
+    t->t_root = root;
+    t->t_depth++;
+  }
+
+  t->t_count++;
+
+  return 0;
+}
+
+static void merge_bptree(struct bpt_tree *t, struct bpt_page *p, unsigned int i)
+{
+  struct bpt_page *l, *r;
+  unsigned int left;
+
+  if(p->p_child[i]->p_count >= BPT_MERGE){
+    return;
+  }
+
+  left = (i > 0) ? (i - 1) : i;
+  if((left + 1) >= p->p_count){
+    return;
+  }
+
+  l = p->p_child[left];
+  r = p->p_child[left + 1];
+
+  if((l->p_count + r->p_count) > BPT_FANOUT){
+    return;
+  }
+
+  append_bptree(l, r, 0, r->p_count);
+  if(r->p_leaf){
+    unlink_leaf_bptree(r);
+  }
+
+  release_arena_bptree(&(t->t_pages), r);
+  close_bptree(p, left + 1);
+}
+
+static struct bpt_node *remove_bptree(struct bpt_tree *t, struct bpt_page *p, struct bpt_probe *b)
+{
+  struct bpt_node *n;
+  struct bpt_page *c;
+  unsigned int i;
+  int exact;
+
+  if(p->p_leaf){
+    i = lower_bptree(p, b, &exact);
+    if(!exact){
+      return NULL;
+    }
+
+    n = p->p_key[i];
+    close_bptree(p, i);
+
+    return n;
+  }
+
+  i = child_bptree(p, b);
+  c = p->p_child[i];
+
+  n = remove_bptree(t, c, b);
+  if(n == NULL){
+    return NULL;
+  }
+
+  if(c->p_count == 0){
+    if(c->p_leaf){
+      unlink_leaf_bptree(c);
+    }
+    release_arena_bptree(&(t->t_pages), c);
+    close_bptree(p, i);
+    return n;
+  }
+
+  /* the removed entry may have been the smallest below this child */
+  set_child_bptree(p, i, c);
+  merge_bptree(t, p, i);
+
+  return n;
+}
+
+static struct bpt_node *take_bptree(struct bpt_tree *t, char *key)
+{
+  struct bpt_probe b;
+  struct bpt_node *n;
+  struct bpt_page *root;
+
+  if(t->t_root == NULL){
+    return NULL;
+  }
+
+  make_probe_bptree(&b, key);
+
+  n = remove_bptree(t, t->t_root, &b);
+  if(n == NULL){
+    return NULL;
+  }
+
+  t->t_count--;
+
+  root = t->t_root;
+  while(!(root->p_leaf) && (root->p_count == 1)){
+    t->t_root = root->p_child[0];
+    t->t_depth--;
+    release_arena_bptree(&(t->t_pages), root);
+    root = t->t_root;
+  }
+
+  if(root->p_count == 0){
+    release_arena_bptree(&(t->t_pages), root);
+    t->t_root = NULL;
+    t->t_depth = 0;
+  }
+
+  return n;
+}
+
+int del_name_node_bptree(struct bpt_tree *t, char *key, void (*d_free)(void *))
+{
+  struct bpt_node *n;
+
+  if ((t == NULL) || (key == NULL))
+    return -1;
+
+  n = take_bptree(t, key);
+  if(n == NULL){
+    return -1;
+  }
+
+  release_node_bptree(t, n, d_free);
+
+  return 0;
+}
+
+int del_node_bptree(struct bpt_tree *t, struct bpt_node *n, void (*d_free)(void *))
+{
+  if ((t == NULL) || (n == NULL))
+    return -1;
+
+  if(find_name_node_bptree(t, n->n_key) != n){
+    return -1;
+  }
+
+  take_bptree(t, n->n_key);
+  release_node_bptree(t, n, d_free);
+
+  return 0;
+}
+
+struct bpt_node *find_name_node_bptree(struct bpt_tree *t, char *key)
+{
+  struct bpt_probe b;
+  struct bpt_page *p;
+  unsigned int i;
+  int exact;
+
+  if ((t == NULL) || (key == NULL))
+    return NULL;
+
+  p = t->t_root;
+  if(p == NULL){
+    return NULL;
+  }
+
+  make_probe_bptree(&b, key);
+
+  while(!(p->p_leaf)){
+    p = p->p_child[child_bptree(p, &b)];
+  }
+
+  i = lower_bptree(p, &b, &exact);
+
+  return exact ? p->p_key[i] : NULL;
+}
+
+void *find_data_bptree(struct bpt_tree *t, char *key)
+{
+  struct bpt_node *n;
+
+  n = find_name_node_bptree(t, key);
+  if (n == NULL)
+    return NULL;
+
+  return n->n_data;
+}
+
+unsigned int count_bptree(struct bpt_tree *t)
+{
+  return (t != NULL) ? t->t_count : 0;
+}
+
+/* bulk load ****************************************************************/
+
+static void discard_leaves_bptree(struct bpt_tree *t, struct bpt_page *p)
+{
+  struct bpt_page *next;
+  unsigned int i;
+
+  while(p){
+    next = p->p_next;
+    for(i = 0; i < p->p_count; i++){
+      release_node_bptree(t, p->p_key[i], NULL);
+    }
+    release_arena_bptree(&(t->t_pages), p);
+    p = next;
+  }
+}
+
+/* builds the tree bottom up from strictly ascending keys, pages filled to
+ * BPT_FILL so that the first inserts afterwards do not split everything */
+int load_sorted_bptree(struct bpt_tree *t, char **keys, void **data, unsigned int count)
+{
+  struct bpt_page *p, *c, *head, *tail, *next;
+  struct bpt_node *n;
+  unsigned int i, j, k, pages, width, parents, want, depth;
+
+  if ((t == NULL) || (keys == NULL) || (t->t_root != NULL))
+    return -1;
+
+  if(count == 0){
+    return 0;
+  }
+
+  for(k = 1; k < count; k++){
+    if(strcmp(keys[k - 1], keys[k]) >= 0){
+#ifdef DEBUG
+      fprintf(stderr, "bptree: load input not sorted at %u (%s, %s)\n", k, keys[k - 1], keys[k]);
+#endif
+      return -1;
+    }
+  }
+
+  pages = (count + BPT_FILL - 1) / BPT_FILL;
+
+  /* every upper level is less than a quarter of the one below */
+  if(reserve_arena_bptree(&(t->t_pages), pages + (pages / 2) + 2) < 0){
+    return -1;
+  }
+  if(reserve_arena_bptree(&(t->t_nodes), count) < 0){
+    return -1;
+  }
+
+  head = NULL;
+  tail = NULL;
+  k = 0;
+
+  for(i = 0; i < pages; i++){
+    p = alloc_page_bptree(t, 1);
+
+    p->p_prev = tail;
+    if(tail){
+      tail->p_next = p;
+    } else {
+      head = p;
+    }
+    tail = p;
+
+    want = (count - k) / (pages - i);
+    for(j = 0; j < want; j++, k++){
+      n = create_node_bptree(t, keys[k], data ? data[k] : NULL);
+      if(n == NULL){
+        discard_leaves_bptree(t, head);
+        return -1;
+      }
+      p->p_key[j] = n;
+      p->p_prefix[j] = prefix_bptree(n->n_key, NULL);
+      p->p_count++;
+    }
+  }
+
+  width = pages;
+  depth = 1;
+
+  /* upper levels are chained through p_next only while being built */
+  while(width > 1){
+    parents = (width + BPT_FILL - 1) / BPT_FILL;
+    c = head;
+    head = NULL;
+    tail = NULL;
+    k = 0;
+
+    for(i = 0; i < parents; i++){
+      p = alloc_page_bptree(t, 0);
+      if(tail){
+        tail->p_next = p;
+      } else {
+        head = p;
+      }
+      tail = p;
+
+      want = (width - k) / (parents - i);
+      for(j = 0; j < want; j++, k++){
+        next = c->p_next;
+        if(!(c->p_leaf)){
+          c->p_next = NULL;
+        }
+        set_child_bptree(p, j, c);
+        c = next;
+      }
+      p->p_count = want;
+    }
+
+    width = parents;
+    depth++;
+  }
+
+  t->t_root = head;
+  t->t_depth = depth;
+  t->t_count = count;
+
+  return 0;
+}
+
+/* iteration ****************************************************************/
+
+struct bpt_node *first_bptree(struct bpt_tree *t, struct bpt_cursor *c)
+{
+  c->c_index = 0;
+  c->c_page = (t != NULL) ? first_leaf_bptree(t) : NULL;
+
+  if(c->c_page == NULL){
+    return NULL;
+  }
+
+  return c->c_page->p_key[0];
+}
+
+struct bpt_node *seek_bptree(struct bpt_tree *t, struct bpt_cursor *c, char *key)
+{
+  struct bpt_probe b;
+  struct bpt_page *p;
+  int exact;
+
+  c->c_page = NULL;
+  c->c_index = 0;
+
+  if((t == NULL) || (t->t_root == NULL) || (key == NULL)){
+    return NULL;
+  }
+
+  make_probe_bptree(&b, key);
+
+  p = t->t_root;
+  while(!(p->p_leaf)){
+    p = p->p_child[child_bptree(p, &b)];
+  }
+
+  c->c_index = lower_bptree(p, &b, &exact);
+  c->c_page = p;
+
+  if(c->c_index >= p->p_count){
+    c->c_page = p->p_next;
+    c->c_index = 0;
+    if(c->c_page == NULL){
+      return NULL;
+    }
+  }
+
+  return c->c_page->p_key[c->c_index];
+}
+
+struct bpt_node *next_bptree(struct bpt_cursor *c)
+{
+  if(c->c_page == NULL){
+    return NULL;
+  }
+
+  c->c_index++;
+
+  if(c->c_index >= c->c_page->p_count){
+    c->c_page = c->c_page->p_next;
+    c->c_index = 0;
+    if(c->c_page == NULL){
+      return NULL;
+    }
+  }
+
+  return c->c_page->p_key[c->c_index];
+}
+
+/* node api *****************************************************************/
+
+char *get_node_name_bptree(struct bpt_node *n)
+{
+  return (n != NULL) ? n->n_key : NULL;
+}
+
+void *get_node_data_bptree(struct bpt_node *n)
+{
+  return (n != NULL) ? n->n_data : NULL;
+}
+
+int update_node_data_bptree(struct bpt_node *n, void *data)
+{
+  if (n == NULL)
+    return -1;
+
+  if (n->n_data != NULL)
+    free(n->n_data);
+
+  n->n_data = data;
+
+  return 0;
+}
+
+/* testing api **************************************************************/
+
+void print_inorder_bptree(struct katcp_dispatch *d, struct bpt_tree *t, void (*fn_print)(struct katcp_dispatch *, char *key, void *), int flags)
+{
+  struct bpt_cursor c;
+  struct bpt_node *n;
+
+  for(n = first_bptree(t, &c); n != NULL; n = next_bptree(&c)){
+    if (flags){
+      append_args_katcp(d, KATCP_FLAG_FIRST, "#%s", n->n_key);
+      append_args_katcp(d, KATCP_FLAG_LAST, "with data %p", n->n_data);
+    }
+
+    if (fn_print != NULL)
+      (*fn_print)(d, n->n_key, n->n_data);
+  }
+}
+
+static int check_page_bptree(struct bpt_page *p, unsigned int depth, unsigned int *leaves)
+{
+  unsigned int i;
+
+  if((p->p_count == 0) || (p->p_count > BPT_FANOUT)){
+#ifdef DEBUG
+    fprintf(stderr, "bptree: page %p holds %u\n", p, p->p_count);
+#endif
+    return -1;
+  }
+
+  for(i = 0; i < p->p_count; i++){
+    if(p->p_prefix[i] != prefix_bptree(p->p_key[i]->n_key, NULL)){
+#ifdef DEBUG
+      fprintf(stderr, "bptree: stale prefix for %s\n", p->p_key[i]->n_key);
+#endif
+      return -1;
+    }
+    if((i > 0) && (strcmp(p->p_key[i - 1]->n_key, p->p_key[i]->n_key) >= 0)){
+#ifdef DEBUG
+      fprintf(stderr, "bptree: %s not before %s\n", p->p_key[i - 1]->n_key, p->p_key[i]->n_key);
+#endif
+      return -1;
+    }
+  }
+
+  if(p->p_leaf){
+    if(depth != 1){
+#ifdef DEBUG
+      fprintf(stderr, "bptree: leaf %p at depth %u\n", p, depth);
+#endif
+      return -1;
+    }
+    (*leaves) += p->p_count;
+    return 0;
+  }
+
+  for(i = 0; i < p->p_count; i++){
+    if(p->p_key[i] != p->p_child[i]->p_key[0]){
+#ifdef DEBUG
+      fprintf(stderr, "bptree: separator %s is not %s\n", p->p_key[i]->n_key, p->p_child[i]->p_key[0]->n_key);
+#endif
+      return -1;
+    }
+    if(check_page_bptree(p->p_child[i], depth - 1, leaves) < 0){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int check_bptree(struct bpt_tree *t)
+{
+  struct bpt_cursor c;
+  struct bpt_node *n, *prev;
+  unsigned int leaves, walked;
+
+  if(t == NULL){
+    return -1;
+  }
+
+  if(t->t_root == NULL){
+    return (t->t_count == 0) ? 0 : -1;
+  }
+
+  leaves = 0;
+  if(check_page_bptree(t->t_root, t->t_depth, &leaves) < 0){
+    return -1;
+  }
+
+  walked = 0;
+  prev = NULL;
+  for(n = first_bptree(t, &c); n != NULL; n = next_bptree(&c)){
+    if(prev && (strcmp(prev->n_key, n->n_key) >= 0)){
+#ifdef DEBUG
+      fprintf(stderr, "bptree: leaf chain out of order at %s\n", n->n_key);
+#endif
+      return -1;
+    }
+    if((c.c_index == 0) && c.c_page->p_prev && (c.c_page->p_prev->p_next != c.c_page)){
+#ifdef DEBUG
+      fprintf(stderr, "bptree: broken back link at %s\n", n->n_key);
+#endif
+      return -1;
+    }
+    prev = n;
+    walked++;
+  }
+
+  if((leaves != t->t_count) || (walked != t->t_count)){
+#ifdef DEBUG
+    fprintf(stderr, "bptree: count %u, leaves hold %u, chain holds %u\n", t->t_count, leaves, walked);
+#endif
+    return -1;
+  }
+
+  return 0;
+}
+
+#ifdef UNIT_TEST_BPTREE
+
+#define TEST_RANGE  6000
+#define TEST_ROUNDS 10
+
+static char test_keys[TEST_RANGE][80];
+
+static int compare_strings(const void *a, const void *b)
+{
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+static void make_keys(void)
+{
+  unsigned int i;
+
+  /* short keys, keys sharing more than a prefix, and keys too long to inline */
+  for(i = 0; i < TEST_RANGE; i++){
+    switch(i % 3){
+      case 0 :
+        snprintf(test_keys[i], 80, "k%u", i);
+        break;
+      case 1 :
+        snprintf(test_keys[i], 80, "adc_snapshot_%u_bram", i);
+        break;
+      default :
+        snprintf(test_keys[i], 80, "a_register_name_long_enough_not_to_fit_inline_%06u", i);
+        break;
+    }
+  }
+}
+
+static int check_tree(struct bpt_tree *t, unsigned char *ref, char *label)
+{
+  struct bpt_cursor c;
+  struct bpt_node *n;
+  char *sorted[TEST_RANGE];
+  unsigned int i, count;
+
+  if(check_bptree(t) < 0){
+    fprintf(stderr, "%s: tree structure broken\n", label);
+    return -1;
+  }
+
+  count = 0;
+  for(i = 0; i < TEST_RANGE; i++){
+    n = find_name_node_bptree(t, test_keys[i]);
+    if((n != NULL) != ref[i]){
+      fprintf(stderr, "%s: lookup of %s gives %p, expected %d\n", label, test_keys[i], n, ref[i]);
+      return -1;
+    }
+    if(n){
+      if(n->n_data != test_keys[i]){
+        fprintf(stderr, "%s: %s has wrong data\n", label, test_keys[i]);
+        return -1;
+      }
+      sorted[count++] = test_keys[i];
+    }
+  }
+
+  if(count != count_bptree(t)){
+    fprintf(stderr, "%s: count %u, expected %u\n", label, count_bptree(t), count);
+    return -1;
+  }
+
+  qsort(sorted, count, sizeof(char *), &compare_strings);
+
+  i = 0;
+  for(n = first_bptree(t, &c); n != NULL; n = next_bptree(&c)){
+    if((i >= count) || strcmp(n->n_key, sorted[i])){
+      fprintf(stderr, "%s: iteration gives %s at %u\n", label, n->n_key, i);
+      return -1;
+    }
+    i++;
+  }
+
+  if(i != count){
+    fprintf(stderr, "%s: iteration stopped at %u of %u\n", label, i, count);
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct bpt_tree *t;
+  struct bpt_cursor c;
+  struct bpt_node *n;
+  unsigned char ref[TEST_RANGE];
+  char *sorted[TEST_RANGE], *swap[2];
+  void *data[TEST_RANGE];
+  unsigned int i, j, round, count;
+  char label[32];
+
+  srandom(12);
+  make_keys();
+
+  t = create_bptree();
+  if(t == NULL){
+    fprintf(stderr, "unable to create tree\n");
+    return 1;
+  }
+
+  memset(ref, 0, TEST_RANGE);
+
+  for(round = 0; round < TEST_ROUNDS; round++){
+    /* grow in early rounds, shrink in later ones */
+    for(j = 0; j < TEST_RANGE; j++){
+      i = random() % TEST_RANGE;
+      if((random() % TEST_ROUNDS) >= round){
+        if(store_named_node_bptree(t, test_keys[i], test_keys[i]) == 0){
+          if(ref[i]){
+            fprintf(stderr, "round %u: duplicate %s accepted\n", round, test_keys[i]);
+            return 1;
+          }
+          ref[i] = 1;
+        } else if(ref[i] == 0){
+          fprintf(stderr, "round %u: insert of %s failed\n", round, test_keys[i]);
+          return 1;
+        }
+      } else {
+        if(random() % 2){
+          n = find_name_node_bptree(t, test_keys[i]);
+          if((del_node_bptree(t, n, NULL) == 0) != ref[i]){
+            fprintf(stderr, "round %u: node delete of %s disagrees\n", round, test_keys[i]);
+            return 1;
+          }
+        } else if((del_name_node_bptree(t, test_keys[i], NULL) == 0) != ref[i]){
+          fprintf(stderr, "round %u: delete of %s disagrees\n", round, test_keys[i]);
+          return 1;
+        }
+        ref[i] = 0;
+      }
+    }
+
+    snprintf(label, 32, "round %u", round);
+    if(check_tree(t, ref, label) < 0){
+      return 1;
+    }
+    fprintf(stderr, "%s: %u keys, depth %u\n", label, count_bptree(t), t->t_depth);
+  }
+
+  for(i = 0; i < TEST_RANGE; i++){
+    del_name_node_bptree(t, test_keys[i], NULL);
+    ref[i] = 0;
+  }
+  if((t->t_root != NULL) || check_tree(t, ref, "emptied")){
+    fprintf(stderr, "tree not empty after deleting everything\n");
+    return 1;
+  }
+
+  destroy_bptree(t, NULL);
+
+  /* bulk load every other key, then mix in the rest */
+  count = 0;
+  for(i = 0; i < TEST_RANGE; i += 2){
+    sorted[count++] = test_keys[i];
+    ref[i] = 1;
+  }
+  qsort(sorted, count, sizeof(char *), &compare_strings);
+  for(i = 0; i < count; i++){
+    data[i] = sorted[i];
+  }
+
+  t = create_bptree();
+
+  swap[0] = sorted[1];
+  swap[1] = sorted[0];
+  if(load_sorted_bptree(t, swap, data, 2) == 0){
+    fprintf(stderr, "load accepted unsorted input\n");
+    return 1;
+  }
+
+  if(load_sorted_bptree(t, sorted, data, count) < 0){
+    fprintf(stderr, "load of %u keys failed\n", count);
+    return 1;
+  }
+  if(check_tree(t, ref, "loaded") < 0){
+    return 1;
+  }
+  fprintf(stderr, "loaded: %u keys, depth %u\n", count_bptree(t), t->t_depth);
+
+  for(i = 1; i < TEST_RANGE; i += 2){
+    store_named_node_bptree(t, test_keys[i], test_keys[i]);
+    ref[i] = 1;
+  }
+  for(i = 0; i < TEST_RANGE; i += 3){
+    del_name_node_bptree(t, test_keys[i], NULL);
+    ref[i] = 0;
+  }
+  if(check_tree(t, ref, "after load") < 0){
+    return 1;
+  }
+
+  /* seek lands on the next key up */
+  n = seek_bptree(t, &c, "adc_snapshot_1");
+  if((n == NULL) || strcmp(n->n_key, "adc_snapshot_1000_bram")){
+    fprintf(stderr, "seek to adc_snapshot_1 gives %s\n", n ? n->n_key : "nothing");
+    return 1;
+  }
+  n = next_bptree(&c);
+  if((n == NULL) || strcmp(n->n_key, "adc_snapshot_1003_bram")){
+    fprintf(stderr, "after adc_snapshot_1000_bram comes %s\n", n ? n->n_key : "nothing");
+    return 1;
+  }
+  if(seek_bptree(t, &c, "zz") != NULL){
+    fprintf(stderr, "seek past the end gives a key\n");
+    return 1;
+  }
+
+  destroy_bptree(t, NULL);
+
+  fprintf(stderr, "bptree: all tests passed\n");
+
+  return 0;
+}
+
+#endif
+
+#ifdef KATCP_BENCHMARK_BPTREE
+
+/* compare against the avltree, the keys are either spread out in their
+ * first bytes or share a long prefix, which defeats the inline prefix */
+
+#include <sys/time.h>
+
+#include "avltree.h"
+
+static unsigned int bench_state = 1;
+
+static unsigned int bench_random(void)
+{
+  bench_state ^= bench_state << 13;
+  bench_state ^= bench_state >> 17;
+  bench_state ^= bench_state << 5;
+  return bench_state;
+}
+
+static double bench_elapsed(struct timeval *then)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+
+  return ((now.tv_sec - then->tv_sec) * 1000000.0) + (now.tv_usec - then->tv_usec);
+}
+
+static unsigned int bench_visited;
+
+static void bench_visit(struct katcp_dispatch *d, char *key, void *data)
+{
+  bench_visited++;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+static void bench_run(unsigned int count, int shared)
+{
+  struct avl_tree *at;
+  struct bpt_tree *bt;
+  struct bpt_cursor c;
+  struct bpt_node *n;
+  struct timeval then;
+  char **keys, **order, *buffer;
+  unsigned int i, j, found;
+  double avl_add, bpt_add, bpt_load, avl_find, bpt_find, avl_walk, bpt_walk;
+  char *swap;
+
+  buffer = malloc(count * 32);
+  keys = malloc(count * sizeof(char *));
+  order = malloc(count * sizeof(char *));
+  if((buffer == NULL) || (keys == NULL) || (order == NULL)){
+    fprintf(stderr, "bench: out of memory at %u\n", count);
+    exit(1);
+  }
+
+  for(i = 0; i < count; i++){
+    keys[i] = buffer + (i * 32);
+    snprintf(keys[i], 32, shared ? "xeng_register_%08x" : "%08x_register", (i * 2654435761U));
+    order[i] = keys[i];
+  }
+
+  for(i = count - 1; i > 0; i--){
+    j = bench_random() % (i + 1);
+    swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+
+  at = create_avltree();
+  gettimeofday(&then, NULL);
+  for(i = 0; i < count; i++){
+    store_named_node_avltree(at, order[i], order[i]);
+  }
+  avl_add = bench_elapsed(&then);
+
+  bt = create_bptree();
+  gettimeofday(&then, NULL);
+  for(i = 0; i < count; i++){
+    store_named_node_bptree(bt, order[i], order[i]);
+  }
+  bpt_add = bench_elapsed(&then);
+
+  found = 0;
+  gettimeofday(&then, NULL);
+  for(i = 0; i < count; i++){
+    if(find_data_avltree(at, keys[i])){
+      found++;
+    }
+  }
+  avl_find = bench_elapsed(&then);
+
+  gettimeofday(&then, NULL);
+  for(i = 0; i < count; i++){
+    if(find_data_bptree(bt, keys[i])){
+      found++;
+    }
+  }
+  bpt_find = bench_elapsed(&then);
+
+  bench_visited = 0;
+  gettimeofday(&then, NULL);
+  print_inorder_avltree(NULL, at->t_root, &bench_visit, 0);
+  avl_walk = bench_elapsed(&then);
+
+  gettimeofday(&then, NULL);
+  for(n = first_bptree(bt, &c); n != NULL; n = next_bptree(&c)){
+    bench_visited++;
+  }
+  bpt_walk = bench_elapsed(&then);
+
+  if((found != (2 * count)) || (bench_visited != (2 * count))){
+    fprintf(stderr, "bench: found %u, visited %u, expected %u\n", found, bench_visited, 2 * count);
+    exit(1);
+  }
+
+  destroy_avltree(at, NULL);
+  destroy_bptree(bt, NULL);
+
+  qsort(keys, count, sizeof(char *), &bench_compare);
+
+  bt = create_bptree();
+  gettimeofday(&then, NULL);
+  if(load_sorted_bptree(bt, keys, NULL, count) < 0){
+    fprintf(stderr, "bench: load failed\n");
+    exit(1);
+  }
+  bpt_load = bench_elapsed(&then);
+  destroy_bptree(bt, NULL);
+
+  printf("%8u %-6s %9.1f %9.1f %9.1f %9.1f %9.1f %9.2f %9.2f\n",
+    count, shared ? "shared" : "spread",
+    avl_add * 1000.0 / count, bpt_add * 1000.0 / count, bpt_load * 1000.0 / count,
+    avl_find * 1000.0 / count, bpt_find * 1000.0 / count,
+    avl_walk * 1000.0 / count, bpt_walk * 1000.0 / count);
+
+  free(order);
+  free(keys);
+  free(buffer);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned int count;
+
+  printf("nanoseconds per key\n");
+  printf("%8s %-6s %9s %9s %9s %9s %9s %9s %9s\n", "keys", "names", "avl add", "bpt add", "bpt load", "avl find", "bpt find", "avl walk", "bpt walk");
+
+  for(count = 1000; count <= 1000000; count *= 10){
+    bench_run(count, 0);
+    bench_run(count, 1);
+  }
+
+  return 0;
+}
+
+#endif
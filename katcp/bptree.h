@@ -0,0 +1,90 @@
+#ifndef _BPTREE_H_
+#define _BPTREE_H_
+
+#include "katcp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* an ordered string map with the same calls as the avltree: a b+ tree
+ * with wide pages which keep the first 8 key bytes inline, so that most
+ * comparisons during a descent are integer compares on one cache line.
+ * Pages and entries come out of per tree slabs, entries keep short
+ * keys inline. Entries never move, so node pointers stay valid until
+ * deleted, but a cursor is invalidated by any insert or delete
+ */
+
+#define BPT_FANOUT      32
+#define BPT_INLINE      48
+
+struct bpt_node {
+  char *n_key;
+  void *n_data;
+  char n_inline[BPT_INLINE];
+};
+
+struct bpt_page {
+  unsigned int p_count;
+  unsigned int p_leaf;
+  struct bpt_page *p_next;
+  struct bpt_page *p_prev;
+  unsigned long long p_prefix[BPT_FANOUT];
+  struct bpt_node *p_key[BPT_FANOUT];     /* leaf entries, or the smallest entry below each child */
+  struct bpt_page *p_child[BPT_FANOUT];
+};
+
+struct bpt_arena {
+  void *a_free;
+  void **a_slabs;
+  unsigned int a_count;
+  unsigned int a_size;
+  unsigned int a_item;
+  unsigned int a_spare;
+};
+
+struct bpt_tree {
+  struct bpt_page *t_root;
+  unsigned int t_count;
+  unsigned int t_depth;
+  struct bpt_arena t_pages;
+  struct bpt_arena t_nodes;
+};
+
+struct bpt_cursor {
+  struct bpt_page *c_page;
+  unsigned int c_index;
+};
+
+struct bpt_tree *create_bptree();
+void destroy_bptree(struct bpt_tree *t, void (*d_free)(void *));
+
+int store_named_node_bptree(struct bpt_tree *t, char *key, void *data);
+int load_sorted_bptree(struct bpt_tree *t, char **keys, void **data, unsigned int count);
+struct bpt_node *find_name_node_bptree(struct bpt_tree *t, char *key);
+void *find_data_bptree(struct bpt_tree *t, char *key);
+int del_node_bptree(struct bpt_tree *t, struct bpt_node *n, void (*d_free)(void *));
+int del_name_node_bptree(struct bpt_tree *t, char *key, void (*d_free)(void *));
+unsigned int count_bptree(struct bpt_tree *t);
+
+/* iteration, no allocation: for(n = first_bptree(t, &c); n; n = next_bptree(&c)) */
+
+struct bpt_node *first_bptree(struct bpt_tree *t, struct bpt_cursor *c);
+struct bpt_node *seek_bptree(struct bpt_tree *t, struct bpt_cursor *c, char *key);
+struct bpt_node *next_bptree(struct bpt_cursor *c);
+
+/*node api*/
+
+char *get_node_name_bptree(struct bpt_node *n);
+void *get_node_data_bptree(struct bpt_node *n);
+int update_node_data_bptree(struct bpt_node *n, void *data);
+
+/*testing api*/
+void print_inorder_bptree(struct katcp_dispatch *d, struct bpt_tree *t, void (*fn_print)(struct katcp_dispatch *, char *key, void *), int flags);
+int check_bptree(struct bpt_tree *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,6 +23,7 @@
 #include "katpriv.h"
 #include "netc.h"
 #include "avltree.h"
+#include "bptree.h"
 
 
 void print_string_type_katcp(struct katcp_dispatch *d, char *key, void *data)
@@ -93,8 +94,8 @@ struct katcp_dict *create_dict_katcp(char *key)
   if (dt->d_key == NULL)
     return NULL;
 
-  dt->d_avl = create_avltree();
-  if (dt->d_avl == NULL)
+  dt->d_tree = create_bptree();
+  if (dt->d_tree == NULL)
     return NULL;
 
   return dt;
@@ -102,9 +103,9 @@ struct katcp_dict *create_dict_katcp(char *key)
 
 int update_dict_katcp(struct katcp_dict *dt, char *key, struct katcp_tobject *to)
 {
-  struct avl_node *n;
+  struct bpt_node *n;
 
-  n = find_name_node_avltree(dt->d_avl, key);
+  n = find_name_node_bptree(dt->d_tree, key);
   if (n == NULL)
     return -1;
 
@@ -120,7 +121,7 @@ int add_dict_katcp(struct katcp_dict *dt, char *key, struct katcp_tobject *to)
   if (dt == NULL)
     return -1;
 
-  return store_named_node_avltree(dt->d_avl, key, to);
+  return store_named_node_bptree(dt->d_tree, key, to);
 }
 
 int add_type_dict_katcp(struct katcp_dict *dt, char *key, struct katcp_type *t, void *data)
@@ -148,7 +149,7 @@ void *get_value_data_dict_katcp(struct katcp_dict *dt, char *key)
   if (dt == NULL)
     return NULL;
     
-  to = find_data_avltree(dt->d_avl, key);
+  to = find_data_bptree(dt->d_tree, key);
   if (to == NULL)
     return NULL;
 
@@ -171,7 +172,8 @@ void print_dict_type_katcp(struct katcp_dispatch *d, char *key, void *data)
 {
   struct katcp_dict *dt;
   struct katcp_tobject *to;
-  struct avl_node *n;
+  struct bpt_cursor c;
+  struct bpt_node *n;
 
   dt = data;
   if (dt == NULL)
@@ -181,25 +183,22 @@ void print_dict_type_katcp(struct katcp_dispatch *d, char *key, void *data)
   append_args_katcp(d, KATCP_FLAG_STRING, "<%s>", dt->d_key);
   append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "item tree:");
   
-  if (dt->d_avl == NULL)
+  if (dt->d_tree == NULL)
     return;
   
 #ifdef DEBUG
   fprintf(stderr, "dict: <%s>\n", dt->d_key);
 #endif
   
-  while ((n = walk_inorder_avltree(dt->d_avl->t_root)) != NULL){
-    
-    if (n != NULL){
-      
-      to = n->n_data;
-      if (to != NULL && to->o_type != NULL && to->o_type->t_print != NULL){
-        append_string_katcp(d, KATCP_FLAG_FIRST  | KATCP_FLAG_STRING, "#key:");
-        append_args_katcp  (d, KATCP_FLAG_STRING | KATCP_FLAG_LAST , "%s", n->n_key);
+  for (n = first_bptree(dt->d_tree, &c); n != NULL; n = next_bptree(&c)){
       
-        (*(to->o_type->t_print))(d, n->n_key, to->o_data);
+    to = n->n_data;
+    if (to != NULL && to->o_type != NULL && to->o_type->t_print != NULL){
+      append_string_katcp(d, KATCP_FLAG_FIRST  | KATCP_FLAG_STRING, "#key:");
+      append_args_katcp  (d, KATCP_FLAG_STRING | KATCP_FLAG_LAST , "%s", n->n_key);
+    
+      (*(to->o_type->t_print))(d, n->n_key, to->o_data);
 
-      }
     }
   }
 
@@ -213,7 +212,7 @@ void destroy_dict_type_katcp(void *data)
   if (dt != NULL){
     if (dt->d_key != NULL) 
       free(dt->d_key);
-    destroy_avltree(dt->d_avl, &destroy_tobject_katcp);
+    destroy_bptree(dt->d_tree, &destroy_tobject_katcp);
     free(dt);
   }
 }
@@ -422,6 +421,10 @@ int dict_katcp(struct katcp_dispatch *d, struct katcl_parse *p)
   }
 
   free(data);
+
+  /* the dict is in place by now, a journal failure only costs persistence */
+  if (record_journal_katcp(d, p) < 0)
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "dict %s updated but not journaled", get_string_parse_katcl(p, 1));
  
   return 0;
 } 
@@ -508,6 +511,8 @@ struct katcp_dbase *create_dbase_type_katcp(char *key, char *schema_key, struct
   else
     db->d_schema = NULL;
 
+  db->d_id = (-1);
+
   stamp_dbase_type_katcp(db);
   
   return db;
@@ -595,9 +600,15 @@ int tag_dbase_katcp(struct katcp_dispatch *d, struct katcp_dbase *db, struct kat
   if (tagtype == NULL || dbtype == NULL)
     return -1;
 
+  if (db->d_id < 0){
+    db->d_id = acquire_index_katcp(d, db, dbtype);
+    if (db->d_id < 0)
+      return -1;
+  }
+
   while ((t = pop_data_type_stack_katcp(tags, tagtype)) != NULL){
     
-    if (tag_data_katcp(d, t, db, dbtype) < 0){
+    if (tag_member_katcp(d, t, db->d_id) < 0){
 #if DEBUG > 1
       fprintf(stderr, "dbase: cannot tag db:<%s> with <%s>\n", db->d_key, t->t_name);
 #endif
@@ -749,6 +760,10 @@ int set_dbase_katcp(struct katcp_dispatch *d, struct katcl_parse *p)
 
   destroy_stack_katcp(tags);
 
+  /* the value is in place by now, a journal failure only costs persistence */
+  if (record_journal_katcp(d, p) < 0)
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "set of %s applied but not journaled", key);
+
   return 0;
 #undef STATE_PRE
 #undef STATE_SCHEMA
@@ -892,7 +907,7 @@ int set_dbase_cmd_katcp(struct katcp_dispatch *d, int argc)
   if (set_dbase_katcp(d, p) < 0)
     return KATCP_RESULT_FAIL;
   
-  return KATCP_RESULT_OK;
+  return wait_journal_katcp(d);
 }
 
 int dict_cmd_katcp(struct katcp_dispatch *d, int argc)
@@ -911,7 +926,165 @@ int dict_cmd_katcp(struct katcp_dispatch *d, int argc)
   if (dict_katcp(d, p) < 0)
     return KATCP_RESULT_FAIL;
 
-  return KATCP_RESULT_OK;
+  return wait_journal_katcp(d);
+}
+
+
+
+
+/***************************[index]*******************************/
+
+/* every tagged object gets a small dense id, so that tag membership
+ * can be held as a bitmap rather than a tree of tobjects */
+
+static struct katcp_index *get_index_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_shared *s;
+  struct katcp_index *ix;
+
+  sane_shared_katcp(d);
+
+  s = d->d_shared;
+  if (s == NULL)
+    return NULL;
+
+  if (s->s_index != NULL)
+    return s->s_index;
+
+  ix = malloc(sizeof(struct katcp_index));
+  if (ix == NULL)
+    return NULL;
+
+  ix->i_members = NULL;
+  ix->i_size    = 0;
+  ix->i_count   = 0;
+  ix->i_free    = NULL;
+  ix->i_spare   = 0;
+
+  ix->i_live = create_bitmap_katcp();
+  if (ix->i_live == NULL){
+    free(ix);
+    return NULL;
+  }
+
+  s->s_index = ix;
+
+  return ix;
+}
+
+int acquire_index_katcp(struct katcp_dispatch *d, void *data, struct katcp_type *type)
+{
+  struct katcp_index *ix;
+  struct katcp_tobject **members, *to;
+  unsigned int *spare;
+  unsigned int id, size;
+
+  ix = get_index_katcp(d);
+  if (ix == NULL)
+    return -1;
+
+  to = create_tobject_katcp(data, type, 0);
+  if (to == NULL)
+    return -1;
+
+  if (ix->i_spare > 0){
+    id = ix->i_free[--(ix->i_spare)];
+  } else {
+    if (ix->i_count >= ix->i_size){
+      size = (ix->i_size > 0) ? (ix->i_size * 2) : 64;
+
+      members = realloc(ix->i_members, sizeof(struct katcp_tobject *) * size);
+      if (members == NULL){
+        destroy_tobject_katcp(to);
+        return -1;
+      }
+      ix->i_members = members;
+
+      spare = realloc(ix->i_free, sizeof(unsigned int) * size);
+      if (spare == NULL){
+        destroy_tobject_katcp(to);
+        return -1;
+      }
+      ix->i_free = spare;
+
+      ix->i_size = size;
+    }
+    id = ix->i_count++;
+  }
+
+  if (set_bitmap_katcp(ix->i_live, id) < 0){
+    ix->i_free[ix->i_spare++] = id;
+    destroy_tobject_katcp(to);
+    return -1;
+  }
+
+  ix->i_members[id] = to;
+
+  return id;
+}
+
+/* caller has to have untagged the id everywhere first */
+int release_index_katcp(struct katcp_dispatch *d, int id)
+{
+  struct katcp_index *ix;
+
+  ix = get_index_katcp(d);
+  if (ix == NULL)
+    return -1;
+
+  if (id < 0 || id >= ix->i_count || ix->i_members[id] == NULL)
+    return -1;
+
+  destroy_tobject_katcp(ix->i_members[id]);
+  ix->i_members[id] = NULL;
+
+  unset_bitmap_katcp(ix->i_live, id);
+  ix->i_free[ix->i_spare++] = id;
+
+  return 0;
+}
+
+struct katcp_tobject *member_index_katcp(struct katcp_dispatch *d, int id)
+{
+  struct katcp_index *ix;
+
+  ix = d->d_shared ? d->d_shared->s_index : NULL;
+  if (ix == NULL)
+    return NULL;
+
+  if (id < 0 || id >= ix->i_count)
+    return NULL;
+
+  return ix->i_members[id];
+}
+
+void destroy_index_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_shared *s;
+  struct katcp_index *ix;
+  int i;
+
+  s = d->d_shared;
+  if (s == NULL || s->s_index == NULL)
+    return;
+
+  ix = s->s_index;
+
+  for (i=0; i<ix->i_count; i++){
+    if (ix->i_members[i] != NULL)
+      destroy_tobject_katcp(ix->i_members[i]);
+  }
+
+  if (ix->i_members)
+    free(ix->i_members);
+  if (ix->i_free)
+    free(ix->i_free);
+
+  destroy_bitmap_katcp(ix->i_live);
+
+  free(ix);
+
+  s->s_index = NULL;
 }
 
 
@@ -931,20 +1104,14 @@ struct katcp_tag *create_tag_katcp(char *name, int level)
     return NULL;
   }
 
-#if 0 
-  for (i=0; t->t_name[i] != '\0'; i++){
-    t->t_name[i] = tolower(t->t_name[i]);
-  }
-#endif
-  
   t->t_level = level;
-  t->t_tobject_root = NULL;
-  t->t_tobject_count = 0;
 
-#if 0
-  t->t_memb = NULL;
-  t->t_memb_count = 0;
-#endif
+  t->t_members = create_bitmap_katcp();
+  if (t->t_members == NULL){
+    free(t->t_name);
+    free(t);
+    return NULL;
+  }
 
   return t;
 }
@@ -958,11 +1125,7 @@ void destroy_tag_katcp(void *data)
     return;
   
   if (t->t_name != NULL) free(t->t_name);
-#if 0
-  if (t->t_memb != NULL) free(t->t_memb);
-#endif
-  if (t->t_tobject_root != NULL) 
-    tdestroy(t->t_tobject_root, &destroy_tobject_katcp);
+  if (t->t_members != NULL) destroy_bitmap_katcp(t->t_members);
 
   free(t);
 }
@@ -971,7 +1134,7 @@ int get_count_tag_katcp(struct katcp_tag *t)
 {
   if (t == NULL)
     return 0;
-  return t->t_tobject_count;
+  return count_bitmap_katcp(t->t_members);
 }
 
 void print_tag_katcp(struct katcp_dispatch *d, char *key, void *data)
@@ -983,15 +1146,7 @@ void print_tag_katcp(struct katcp_dispatch *d, char *key, void *data)
 
   append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_FIRST, "#tag:");
   append_string_katcp(d, KATCP_FLAG_STRING, t->t_name);
-  append_args_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "%d", t->t_tobject_count);
-  
-#if 0 
-  def DEBUG
-  fprintf(stderr, "tag: %s has %d tobjects:\n", t->t_name, t->t_tobject_count);
-  if (t->t_tobject_root)
-    twalk(t->t_tobject_root, &walk_tag_tobjects);
-  fprintf(stderr, "tag: end\n");
-#endif
+  append_args_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "%d", get_count_tag_katcp(t));
 }
 
 void *parse_tag_katcp(struct katcp_dispatch *d, char **str)
@@ -1042,8 +1197,8 @@ int register_tag_katcp(struct katcp_dispatch *d, char *name, int level)
   if (t == NULL)
     return -1;
 
-  if (store_data_type_katcp(d, KATCP_TYPE_TAG, KATCP_DEP_BASE, name, t, &print_tag_katcp, &destroy_tag_katcp, NULL, NULL, &parse_tag_katcp, &getkey_tag_katcp) < 0){
-    destroy_tag_katcp(d);
+  if (store_data_type_katcp(d, KATCP_TYPE_TAG, KATCP_DEP_BASE, name, t, &print_tag_katcp, &destroy_tag_katcp, NULL, &compare_tag_katcp, &parse_tag_katcp, &getkey_tag_katcp) < 0){
+    destroy_tag_katcp(t);
     return -1;
   }
 
@@ -1053,296 +1208,228 @@ int register_tag_katcp(struct katcp_dispatch *d, char *name, int level)
   return 0;
 }
 
-int tag_tobject_katcp(struct katcp_dispatch *d, struct katcp_tag *t, struct katcp_tobject *to)
+/* returns -1 on error or if the member already carries the tag */
+int tag_member_katcp(struct katcp_dispatch *d, struct katcp_tag *t, int id)
 {
-  void *val;
-
-  val = tsearch((void *) to, &(t->t_tobject_root), &compare_tobject_katcp);
-  if (val == NULL || (*(struct katcp_tobject **) val != to)){
-#if 0
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "tag: error with tsearch for tag:<%s>", t->t_name);
-#ifdef DEBUG
-    fprintf(stderr, "tag: error with tsearch for tag:<%s>\n", t->t_name);
-#endif
-#endif
+  if (t == NULL || id < 0)
     return -1;
-  }
 
-  t->t_tobject_count++;
+  if (set_bitmap_katcp(t->t_members, id) <= 0)
+    return -1;
   
   return 0;
 }
 
-int tag_named_tobject_katcp(struct katcp_dispatch *d, char *tag, struct katcp_tobject *to)
+int untag_member_katcp(struct katcp_dispatch *d, struct katcp_tag *t, int id)
 {
-  struct katcp_tag *t;
+  if (t == NULL || id < 0)
+    return -1;
 
-  t = get_key_data_type_katcp(d, KATCP_TYPE_TAG, tag);
-  if (t == NULL)
+  if (unset_bitmap_katcp(t->t_members, id) <= 0)
     return -1;
 
-  return tag_tobject_katcp(d, t, to);
+  return 0;
 }
 
-int tag_data_katcp(struct katcp_dispatch *d, struct katcp_tag *t, void *data, struct katcp_type *type)
+/* copies up to size members of t into vector, no shared state so callers can nest */
+int members_tag_katcp(struct katcp_dispatch *d, struct katcp_tag *t, struct katcp_tobject **vector, int size)
 {
-  struct katcp_tobject * to;
+  unsigned int *ids;
+  int i, count, have;
 
-  to = create_tobject_katcp(data, type, 0);
-  if (to == NULL)
-    return -1;
+  if (t == NULL || vector == NULL || size <= 0)
+    return 0;
 
-  if (tag_tobject_katcp(d, t, to) < 0){
-    destroy_tobject_katcp(to);
+  ids = malloc(sizeof(unsigned int) * size);
+  if (ids == NULL)
     return -1;
+
+  count = fetch_bitmap_katcp(t->t_members, ids, size);
+
+  have = 0;
+  for (i=0; i<count; i++){
+    vector[have] = member_index_katcp(d, ids[i]);
+    if (vector[have] != NULL)
+      have++;
   }
-  
-  return 0;
-}
 
-static struct katcp_tobject **__tobjs;
-static int __tcount;
+  free(ids);
 
-static void __collect_from_tag(const void *nodep, const VISIT which, const int depth)
+  return have;
+}
+
+static int compare_tag_count_katcp(const void *m1, const void *m2)
 {
-  struct katcp_tobject *to;
+  struct katcp_tag *a, *b;
 
-  to = *(struct katcp_tobject **) nodep;
-  if (to == NULL)
-    return;
+  a = *(struct katcp_tag **) m1;
+  b = *(struct katcp_tag **) m2;
 
-  switch (which){
-    case leaf:
-    case postorder:
-      if (__tobjs == NULL)
-        return;
-      __tobjs[__tcount] = to;
-      __tcount++;
-      break;
-    case preorder:
-    case endorder:
-      break;
-  }
+  return get_count_tag_katcp(a) - get_count_tag_katcp(b);
 }
 
-int search_katcp(struct katcp_dispatch *d, struct katcl_parse *p)
+static int select_conjunction_katcp(struct katcp_dispatch *d, struct katcp_bitmap *result, struct katcp_tag **vector, int count)
 {
-  struct katcp_stack *tags, *ans; 
-  struct katcp_type *tagtype;
-  char *tag;
-  int i, j, count, *dsize, *di, run, seen;
-  struct katcp_tobject ***data, *to;
-  struct katcp_tag *t;
-  struct timeval ts, te, delta;
-  void *min;
-  
-  t = NULL;
+  int i;
 
-  gettimeofday(&ts, NULL);
-  
-  count = get_count_parse_katcl(p);
-  tagtype = find_name_type_katcp(d, KATCP_TYPE_TAG);
+  /* smallest first, so the running set shrinks as early as possible */
+  qsort(vector, count, sizeof(struct katcp_tag *), &compare_tag_count_katcp);
 
-  if (tagtype == NULL)
-    return -1;
-  
-  tags = create_stack_katcp();
-  if (tags == NULL)
+  if (copy_bitmap_katcp(result, vector[0]->t_members) < 0)
     return -1;
 
-  for (i=1; i<count; i++){
-   
-    tag = get_string_parse_katcl(p, i);
-    if (push_stack_katcp(tags, search_type_katcp(d, tagtype, tag, NULL), tagtype) < 0){
-#ifdef DEBUG
-      fprintf(stderr, "search: cannot find tag <%s>\n", tag);
-#endif
-      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "search tag %s doesn't exist", tag);
-    }
-
+  for (i=1; (i<count) && (count_bitmap_katcp(result) > 0); i++){
+    if (and_bitmap_katcp(result, vector[i]->t_members) < 0)
+      return -1;
   }
 
-#if 0
-  print_stack_katcp(d, tags); 
-#endif
+  return 0;
+}
 
-  count = sizeof_stack_katcp(tags);
+/* evaluates tag names from field base onwards of p into result.
+ * A plain name intersects, +name adds and !name removes. Terms are
+ * applied left to right, a leading !name starts from all members */
+int select_tags_katcp(struct katcp_dispatch *d, struct katcp_bitmap *result, struct katcl_parse *p, int base)
+{
+  struct katcp_type *tagtype;
+  struct katcp_index *ix;
+  struct katcp_tag *t, **vector;
+  char *name;
+  int i, count, plain, have, rtn;
 
-  if (count == 0){
-    destroy_stack_katcp(tags);
+  count = get_count_parse_katcl(p);
+  if (count <= base)
     return -1;
-  }
 
-  ans = create_stack_katcp();
-
-  dsize = malloc(sizeof(int) * count);
-  if (dsize == NULL){
-    destroy_stack_katcp(tags);
-    destroy_stack_katcp(ans);
+  tagtype = find_name_type_katcp(d, KATCP_TYPE_TAG);
+  if (tagtype == NULL)
     return -1;
-  }
 
-  di = malloc(sizeof(int) * count);
-  if (di == NULL){
-    if (dsize)
-      free(dsize);
-    destroy_stack_katcp(tags);
-    destroy_stack_katcp(ans);
+  ix = get_index_katcp(d);
+  if (ix == NULL)
     return -1;
-  }
 
-  data = malloc(sizeof(struct katcp_tobject **) * count);
-  if (data == NULL){
-    if (dsize)
-      free(dsize);
-    if (di)
-      free(di);
-    destroy_stack_katcp(tags);
-    destroy_stack_katcp(ans);
+  vector = malloc(sizeof(struct katcp_tag *) * (count - base));
+  if (vector == NULL)
     return -1;
-  }
 
-  for (i=0; i<count; i++){
-    t = index_data_stack_katcp(tags, i);
-    if (t){
-      dsize[i] = get_count_tag_katcp(t);
-      data[i] = malloc(sizeof(struct katcp_tobject *) * dsize[i]);
-      if (data[i]){
-        
-        __tobjs   = data[i];  
-        __tcount  = 0;
-        
-        if (t->t_tobject_root != NULL)
-          twalk(t->t_tobject_root, &__collect_from_tag);
-        
-#if DEBUG >1
-        fprintf(stderr,"i:%d t:(%p) [ ", i, t);
-        for (j=0; j<dsize[i]; j++)
-          fprintf(stderr,"(%p) ", (data[i][j])->o_data);
-        fprintf(stderr,"]\n");
+  plain = 1;
+  have  = 0;
+
+  for (i=base; i<count; i++){
+    name = get_string_parse_katcl(p, i);
+    if (name == NULL){
+      vector[have++] = NULL;
+      continue;
+    }
+    if (name[0] == '+' || name[0] == '!'){
+      plain = 0;
+      name++;
+    }
+    t = search_type_katcp(d, tagtype, name, NULL);
+    if (t == NULL){
+#ifdef DEBUG
+      fprintf(stderr, "search: cannot find tag <%s>\n", name);
 #endif
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "search tag %s doesn't exist", name);
+    }
+    vector[have++] = t;
+  }
+
+  rtn = 0;
+  clear_bitmap_katcp(result);
 
+  if (plain){
+    for (i=0; i<have; i++){
+      if (vector[i] == NULL){
+        /* an unknown tag has no members, so neither has the intersection */
+        free(vector);
+        return 0;
       }
     }
+    rtn = select_conjunction_katcp(d, result, vector, have);
+    free(vector);
+    return rtn;
   }
-  
 
-  bzero(di, sizeof(int) * count);
+  for (i=0; (i<have) && (rtn == 0); i++){
+    name = get_string_parse_katcl(p, base + i);
+    t = vector[i];
 
-  run  = 1;
-  min  = NULL;
-  seen = 0;
-  to = NULL;
+    switch (name ? name[0] : '\0'){
+      case '+' :
+        if (t != NULL)
+          rtn = or_bitmap_katcp(result, t->t_members);
+        break;
+      case '!' :
+        if (i == 0)
+          rtn = copy_bitmap_katcp(result, ix->i_live);
+        if (t != NULL && rtn == 0)
+          rtn = andnot_bitmap_katcp(result, t->t_members);
+        break;
+      default :
+        if (t == NULL)
+          clear_bitmap_katcp(result);
+        else if (i == 0)
+          rtn = copy_bitmap_katcp(result, t->t_members);
+        else
+          rtn = and_bitmap_katcp(result, t->t_members);
+        break;
+    }
+  }
 
-  while (run) {
-    
-    for(i=0; i<count; i++){
-      
-#if DEBUG>1
-      fprintf(stderr, "i:%d ", i);
-#endif
+  free(vector);
 
-      if (di[i] < dsize[i] && data[i][di[i]] != NULL){
-       
-        if(min == NULL){
-          t = index_data_stack_katcp(tags, i);
-          min = (data[i][di[i]])->o_data;
-          to = data[i][di[i]];
-          seen = 1;
-#if DEBUG >1
-          fprintf(stderr, "NULL setting t:(%p) min:(%p) ", t, min);
-#endif
-        } else if (min == (data[i][di[i]])->o_data && t != index_data_stack_katcp(tags, i)) {
-          seen++;
-#if DEBUG >1
-          fprintf(stderr, "seen: %d ", seen);
-#endif
-        } else if (min < (data[i][di[i]])->o_data) {
-          t = index_data_stack_katcp(tags, i);
-          min = (data[i][di[i]])->o_data;
-          to = data[i][di[i]];
-          seen = 1;
-#if DEBUG >1
-          fprintf(stderr, "NEW MIN setting t:(%p) min:(%p) ", t, min);
-#endif
-        } else if (min > (data[i][di[i]])->o_data){
-          (di[i])++;
-#if DEBUG >1
-          fprintf(stderr, "di[%d] %d ", i, di[i]);
-#endif
-        } else if (t == index_data_stack_katcp(tags, i)){
-#if DEBUG >1
-          fprintf(stderr, "original ");
-#endif
-          if (seen >= count){
-#if DEBUG >1
-            fprintf(stderr, "FOUND match\n");
-#endif
-            if (push_tobject_katcp(ans, copy_tobject_katcp(to)) < 0){
-#if DEBUG >1  
-              fprintf(stderr, "search: error could not push an answer onto stack\n");
-#endif
-            }
-
-            to  = NULL;
-            min = NULL;
-            seen = 0;
-            (di[i])++;
-#if DEBUG >1
-            fprintf(stderr, "reset all and di[%d] %d ", i, di[i]);
-#endif
-          }
+  return rtn;
+}
 
-        }
+struct search_print_katcp {
+  struct katcp_dispatch *s_dispatch;
+  struct katcp_index *s_index;
+};
+
+static int print_member_katcp(unsigned int id, void *data)
+{
+  struct search_print_katcp *sp;
 
+  sp = data;
 
-      
-      } else {
-        run = 0;
-#if DEBUG >1
-        fprintf(stderr, "the end");
-#endif
-      }
+  if (id < sp->s_index->i_count)
+    print_tobject_katcp(sp->s_dispatch, sp->s_index->i_members[id]);
 
-#if DEBUG >1
-      fprintf(stderr, "\n");
-#endif
+  return 0;
+}
 
-    }
-#if 0
-    if (seen >= count){
-      run = 0;
+int search_katcp(struct katcp_dispatch *d, struct katcl_parse *p)
+{
+  struct katcp_bitmap *ans;
+  struct search_print_katcp sp;
+  struct timeval ts, te, delta;
+  
+  gettimeofday(&ts, NULL);
 
-    }
-#endif
+  ans = create_bitmap_katcp();
+  if (ans == NULL)
+    return -1;
+
+  if (select_tags_katcp(d, ans, p, 1) < 0){
+    destroy_bitmap_katcp(ans);
+    return -1;
   }
   
   gettimeofday(&te, NULL);
 
   sub_time_katcp(&delta, &te, &ts); 
 
-  print_stack_katcp(d, ans);
+  sp.s_dispatch = d;
+  sp.s_index    = get_index_katcp(d);
 
-  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "search took %lu%06lu\xC2\xB5s", delta.tv_sec, delta.tv_usec);
-  
-  if (dsize)
-    free(dsize);
+  if (sp.s_index != NULL)
+    walk_bitmap_katcp(ans, &print_member_katcp, &sp);
 
-  if (di)
-    free(di);
-
-  for (i=0; i<count; i++){
-    if (data[i])
-      free(data[i]);
-  }
-  if (data)
-    free(data);
-  
-  destroy_stack_katcp(tags);
-  destroy_stack_katcp(ans);
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "search matched %u in %lu%06lu\xC2\xB5s", count_bitmap_katcp(ans), delta.tv_sec, delta.tv_usec);
 
-  __tobjs  = NULL;
-  __tcount = 0;
+  destroy_bitmap_katcp(ans);
   
   return 0;
 }
@@ -1366,4 +1453,170 @@ int search_cmd_katcp(struct katcp_dispatch *d, int argc)
   return KATCP_RESULT_OK;
 }
 
+#ifdef KATCP_BENCHMARK_SEARCH
+
+#define BENCH_ENTRIES   100000
+#define BENCH_TAGS        1000
+#define BENCH_COMMON        16
+#define BENCH_PER_ENTRY      8
+#define BENCH_QUERIES     2000
+
+static unsigned short bench_tags[BENCH_ENTRIES][BENCH_PER_ENTRY];
+
+static int bench_has_tag(int entry, int tag)
+{
+  int i;
+
+  for (i=0; i<BENCH_PER_ENTRY; i++){
+    if (bench_tags[entry][i] == tag)
+      return 1;
+  }
+
+  return 0;
+}
 
+static double bench_elapsed(struct timeval *ts)
+{
+  struct timeval te, delta;
+
+  gettimeofday(&te, NULL);
+  sub_time_katcp(&delta, &te, ts);
+
+  return (delta.tv_sec * 1000000.0) + delta.tv_usec;
+}
+
+int main(int argc, char **argv)
+{
+  struct katcp_dispatch *d;
+  struct katcp_type *tagtype;
+  struct katcp_tag **tags;
+  struct katcp_stack *values, *set;
+  struct katcp_bitmap *result;
+  struct katcl_parse *p;
+  struct timeval ts;
+  char name[32];
+  int i, j, k, op, terms, want[3], expect, match, words;
+  unsigned long total, found;
+  double bitmap_us, scan_us;
+
+  d = startup_katcp();
+  if (d == NULL){
+    fprintf(stderr, "bench: unable to start\n");
+    return 1;
+  }
+
+  tagtype = find_name_type_katcp(d, KATCP_TYPE_TAG);
+  tags = malloc(sizeof(struct katcp_tag *) * BENCH_TAGS);
+  if (tagtype == NULL || tags == NULL)
+    return 1;
+
+  for (i=0; i<BENCH_TAGS; i++){
+    snprintf(name, sizeof(name), "t%d", i);
+    register_tag_katcp(d, name, 0);
+    tags[i] = search_type_katcp(d, tagtype, name, NULL);
+    if (tags[i] == NULL){
+      fprintf(stderr, "bench: unable to register %s\n", name);
+      return 1;
+    }
+  }
+
+  srand(7);
+
+  gettimeofday(&ts, NULL);
+
+  /* half the tags of an entry from a few popular ones, the rest spread wide */
+  for (i=0; i<BENCH_ENTRIES; i++){
+    values = create_stack_katcp();
+    set    = create_stack_katcp();
+    for (j=0; j<BENCH_PER_ENTRY; j++){
+      do {
+        k = (j < BENCH_PER_ENTRY / 2) ? (rand() % BENCH_COMMON) : (rand() % BENCH_TAGS);
+      } while (bench_has_tag(i, k) && j > 0);
+      bench_tags[i][j] = k;
+      push_stack_katcp(set, tags[k], tagtype);
+    }
+    snprintf(name, sizeof(name), "e%d", i);
+    if (store_kv_dbase_katcp(d, name, NULL, values, set) < 0){
+      fprintf(stderr, "bench: unable to store %s\n", name);
+      return 1;
+    }
+    destroy_stack_katcp(set);
+  }
+
+  words = 0;
+  for (i=0; i<BENCH_TAGS; i++){
+    words += tags[i]->t_members->b_count;
+  }
+
+  printf("bench: stored %d entries under %d tags in %.0fms, %d bitmap words (%zu bytes)\n", BENCH_ENTRIES, BENCH_TAGS, bench_elapsed(&ts) / 1000.0, words, words * (sizeof(unsigned int) + sizeof(unsigned long long)));
+
+  result = create_bitmap_katcp();
+
+  total = 0;
+  found = 0;
+  bitmap_us = 0.0;
+  scan_us = 0.0;
+
+  for (i=0; i<BENCH_QUERIES; i++){
+    op = i % 4;
+
+    p = create_parse_katcl();
+    add_string_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?search");
+
+    /* op 0: common rare, 1: common common common, 2: common !rare, 3: rare +rare */
+    terms = (op == 1) ? 3 : 2;
+    for (j=0; j<terms; j++){
+      want[j] = ((op == 1) || (op != 3 && j == 0)) ? (rand() % BENCH_COMMON) : (rand() % BENCH_TAGS);
+      snprintf(name, sizeof(name), "%st%d", (op == 2 && j == 1) ? "!" : ((op == 3 && j == 1) ? "+" : ""), want[j]);
+      add_string_parse_katcl(p, KATCP_FLAG_STRING | ((j + 1 == terms) ? KATCP_FLAG_LAST : 0), name);
+    }
+
+    gettimeofday(&ts, NULL);
+    if (select_tags_katcp(d, result, p, 1) < 0){
+      fprintf(stderr, "bench: query %d failed\n", i);
+      return 1;
+    }
+    bitmap_us += bench_elapsed(&ts);
+
+    gettimeofday(&ts, NULL);
+    expect = 0;
+    for (k=0; k<BENCH_ENTRIES; k++){
+      switch (op){
+        case 0 :
+          match = bench_has_tag(k, want[0]) && bench_has_tag(k, want[1]);
+          break;
+        case 1 :
+          match = bench_has_tag(k, want[0]) && bench_has_tag(k, want[1]) && bench_has_tag(k, want[2]);
+          break;
+        case 2 :
+          match = bench_has_tag(k, want[0]) && !bench_has_tag(k, want[1]);
+          break;
+        default :
+          match = bench_has_tag(k, want[0]) || bench_has_tag(k, want[1]);
+          break;
+      }
+      expect += match;
+    }
+    scan_us += bench_elapsed(&ts);
+
+    if (count_bitmap_katcp(result) != expect){
+      fprintf(stderr, "bench: query %d (kind %d) matched %u, expected %d\n", i, op, count_bitmap_katcp(result), expect);
+      return 1;
+    }
+
+    total++;
+    found += expect;
+
+    destroy_parse_katcl(p);
+  }
+
+  printf("bench: %lu queries, %lu matches, bitmap %.2fus/query, linear scan %.2fus/query\n", total, found, bitmap_us / total, scan_us / total);
+
+  destroy_bitmap_katcp(result);
+  free(tags);
+
+  shutdown_katcp(d);
+
+  return 0;
+}
+#endif
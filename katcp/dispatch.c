@@ -1944,7 +1944,7 @@ static int prepend_generic_katcp(struct katcp_dispatch *d, int reply)
   char *message, *string;
   int result;
 
-  message = arg_string_katcl(d->d_line, 0);
+  message = arg_string_katcp(d, 0);
   if((message == NULL) || (message[0] != KATCP_REQUEST)){
 #ifdef KATCP_STDERR_ERRORS
     fprintf(stderr, "prepend: arg0 is unavailable (%p)\n", message);
@@ -2077,6 +2077,10 @@ int append_vargs_katcp(struct katcp_dispatch *d, int flags, char *fmt, va_list a
   /* not copying vargs at works on my platform, but not on */
   /* all of them, so not sure how much copying is really needed */
 
+  if(this_flat_katcp(d)){
+    return append_vargs_flat_katcp(d, flags, fmt, args);
+  }
+
   va_copy(copy, args);
   result = append_vargs_katcl(d->d_line, flags, fmt, copy);
   va_end(copy);
@@ -2092,7 +2096,11 @@ int append_args_katcp(struct katcp_dispatch *d, int flags, char *fmt, ...)
   sane_katcp(d);
 
   va_start(args, fmt);
-  result = append_vargs_katcl(d->d_line, flags, fmt, args);
+  if(this_flat_katcp(d)){
+    result = append_vargs_flat_katcp(d, flags, fmt, args);
+  } else {
+    result = append_vargs_katcl(d->d_line, flags, fmt, args);
+  }
   va_end(args);
 
   return result;
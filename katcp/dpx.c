@@ -7,6 +7,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <sysexits.h>
 
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -54,22 +56,28 @@ struct katcp_cmd_item{
   unsigned int i_flags; 
   char *i_data;
   void (*i_clear)(void *data);
+  unsigned int i_hash;
 };
 
-#include <avltree.h>
-
 struct katcp_cmd_map{
   /* "table" of commands */
   char *m_name;
   unsigned int m_refs;
-  struct avl_tree *m_tree;
+  struct katcp_cmd_item **m_items;  /* sorted by name, for help */
+  unsigned int m_count;
+  unsigned int m_size;
+  struct katcp_cmd_item **m_slots;  /* open addressed, rebuilt on every addition */
+  unsigned int m_mask;
   struct katcp_cmd_item *m_fallback;
 };
 
+#define KATCP_CHAIN_MAP 3   /* flat, group, fallback group */
+
 /********************************************************************/
 
 void destroy_cmd_map(struct katcp_cmd_map *m);
 struct katcp_cmd_map *map_of_flat_katcp(struct katcp_flat *fx);
+int setup_default_group(struct katcp_dispatch *d, char *name);
 
 static void clear_current_flat(struct katcp_dispatch *d);
 static void set_current_flat(struct katcp_dispatch *d, struct katcp_flat *fx);
@@ -367,11 +375,27 @@ struct katcp_cmd_item *create_cmd_item(char *name, char *help, unsigned int flag
   i->i_data = data;
   i->i_clear = clear;
 
+  i->i_hash = 0;
+
   return i;
 }
 
+static unsigned int hash_cmd_name(char *name)
+{
+  unsigned int h;
+
+  /* fnv-1a */
+  for(h = 2166136261U; *name != '\0'; name++){
+    h = (h ^ ((unsigned char)(*name))) * 16777619U;
+  }
+
+  return h;
+}
+
 void destroy_cmd_map(struct katcp_cmd_map *m)
 {
+  unsigned int i;
+
   if(m == NULL){
     return;
   }
@@ -387,11 +411,24 @@ void destroy_cmd_map(struct katcp_cmd_map *m)
     return;
   }
 
-  if(m->m_tree){
-    destroy_avltree(m->m_tree, &destroy_cmd_item_void);
-    m->m_tree = NULL;
+  if(m->m_items){
+    for(i = 0; i < m->m_count; i++){
+      destroy_cmd_item(m->m_items[i]);
+    }
+    free(m->m_items);
+    m->m_items = NULL;
+  }
+
+  m->m_count = 0;
+  m->m_size = 0;
+
+  if(m->m_slots){
+    free(m->m_slots);
+    m->m_slots = NULL;
   }
 
+  m->m_mask = 0;
+
   if(m->m_fallback){
     destroy_cmd_item(m->m_fallback);
     m->m_fallback = NULL;
@@ -428,15 +465,13 @@ struct katcp_cmd_map *create_cmd_map(char *name)
 
   m->m_name = NULL;
   m->m_refs = 0;
-  m->m_tree = NULL;
+  m->m_items = NULL;
+  m->m_count = 0;
+  m->m_size = 0;
+  m->m_slots = NULL;
+  m->m_mask = 0;
   m->m_fallback = NULL;
 
-  m->m_tree = create_avltree();
-  if(m->m_tree == NULL){
-    destroy_cmd_map(m);
-    return NULL;
-  }
-
   if(name){
     m->m_name = strdup(name);
     if(m->m_name == NULL){
@@ -448,10 +483,57 @@ struct katcp_cmd_map *create_cmd_map(char *name)
   return m;
 }
 
-int add_full_cmd_map(struct katcp_cmd_map *m, char *name, char *help, unsigned int flags, int (*call)(struct katcp_dispatch *d, int argc), void *data, void (*clear)(void *data))
+static struct katcp_cmd_item *find_cmd_map(struct katcp_cmd_map *m, char *name, unsigned int hash)
 {
   struct katcp_cmd_item *i;
-  struct avl_node *n;
+  unsigned int k;
+
+  if(m->m_slots == NULL){
+    return NULL;
+  }
+
+  for(k = hash & m->m_mask; (i = m->m_slots[k]) != NULL; k = (k + 1) & m->m_mask){
+    if((i->i_hash == hash) && (strcmp(i->i_name, name) == 0)){
+      return i;
+    }
+  }
+
+  return NULL;
+}
+
+static int rehash_cmd_map(struct katcp_cmd_map *m, unsigned int count)
+{
+  struct katcp_cmd_item **slots;
+  unsigned int size, j, k;
+
+  /* keep the table at most half full */
+  for(size = 8; size < (count * 2); size *= 2);
+
+  slots = calloc(size, sizeof(struct katcp_cmd_item *));
+  if(slots == NULL){
+    return -1;
+  }
+
+  for(j = 0; j < m->m_count; j++){
+    for(k = m->m_items[j]->i_hash & (size - 1); slots[k] != NULL; k = (k + 1) & (size - 1));
+    slots[k] = m->m_items[j];
+  }
+
+  if(m->m_slots){
+    free(m->m_slots);
+  }
+
+  m->m_slots = slots;
+  m->m_mask = size - 1;
+
+  return 0;
+}
+
+int add_full_cmd_map(struct katcp_cmd_map *m, char *name, char *help, unsigned int flags, int (*call)(struct katcp_dispatch *d, int argc), void *data, void (*clear)(void *data))
+{
+  struct katcp_cmd_item *i, **tmp;
+  unsigned int lo, hi, mid;
+  int cmp;
   char *ptr;
 
   if(name == NULL){
@@ -473,21 +555,47 @@ int add_full_cmd_map(struct katcp_cmd_map *m, char *name, char *help, unsigned i
     return -1;
   }
 
+  lo = 0;
+  hi = m->m_count;
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    cmp = strcmp(ptr, m->m_items[mid]->i_name);
+    if(cmp == 0){
+      return -1;
+    }
+    if(cmp > 0){
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if(m->m_count >= m->m_size){
+    tmp = realloc(m->m_items, sizeof(struct katcp_cmd_item *) * (m->m_size + 16));
+    if(tmp == NULL){
+      return -1;
+    }
+    m->m_items = tmp;
+    m->m_size += 16;
+  }
+
   i = create_cmd_item(ptr, help, flags, call, data, clear);
   if(i == NULL){
     return -1;
   }
 
-  n = create_node_avltree(ptr, i);
-  if(n == NULL){
+  i->i_hash = hash_cmd_name(i->i_name);
+
+  memmove(m->m_items + lo + 1, m->m_items + lo, sizeof(struct katcp_cmd_item *) * (m->m_count - lo));
+  m->m_items[lo] = i;
+  m->m_count++;
+
+  if(rehash_cmd_map(m, m->m_count) < 0){
+    m->m_count--;
+    memmove(m->m_items + lo, m->m_items + lo + 1, sizeof(struct katcp_cmd_item *) * (m->m_count - lo));
     destroy_cmd_item(i);
     return -1;
   }
-  
-  if(add_node_avltree(m->m_tree, n) < 0){
-    free_node_avltree(n, &destroy_cmd_item_void);
-    return -1;
-  }
 
   return 0;
 }
@@ -497,10 +605,65 @@ int add_cmd_map(struct katcp_cmd_map *m, char *name, char *help, int (*call)(str
   return add_full_cmd_map(m, name, help, 0, call, NULL, NULL);
 }
 
+static unsigned int chain_cmd_map(struct katcp_flat *f, struct katcp_cmd_map **chain)
+{
+  struct katcp_cmd_map *mx;
+  struct katcp_group *gx;
+  unsigned int i, count;
+
+  if((f->f_current_map < 0) || (f->f_current_map >= KATCP_SIZE_MAP)){
+    return 0;
+  }
+
+  count = 0;
+
+  /* commands of the flat itself shadow those of its group, which shadow the default group */
+  for(i = 0; i < KATCP_CHAIN_MAP; i++){
+    switch(i){
+      case 0 :
+        mx = f->f_maps[f->f_current_map];
+        break;
+      case 1 :
+        gx = f->f_group;
+        mx = gx ? gx->g_maps[f->f_current_map] : NULL;
+        break;
+      default :
+        gx = f->f_shared ? f->f_shared->s_fallback : NULL;
+        mx = gx ? gx->g_maps[f->f_current_map] : NULL;
+        break;
+    }
+    if(mx && ((count == 0) || (chain[count - 1] != mx))){
+      chain[count++] = mx;
+    }
+  }
+
+  return count;
+}
+
+static struct katcp_cmd_item *resolve_cmd_item(struct katcp_cmd_map **chain, unsigned int count, char *name, unsigned int hash)
+{
+  struct katcp_cmd_item *i, *fallback;
+  unsigned int j;
+
+  fallback = NULL;
+
+  for(j = 0; j < count; j++){
+    i = find_cmd_map(chain[j], name, hash);
+    if(i){
+      return i;
+    }
+    if(fallback == NULL){
+      fallback = chain[j]->m_fallback;
+    }
+  }
+
+  return fallback;
+}
+
 struct katcp_cmd_item *locate_cmd_item(struct katcp_flat *f, struct katcl_parse *p)
 {
-  struct katcp_cmd_item *i;
-  struct katcp_cmd_map *m;
+  struct katcp_cmd_map *chain[KATCP_CHAIN_MAP];
+  unsigned int count;
   char *str;
 
   str = get_string_parse_katcl(p, 0);
@@ -508,21 +671,13 @@ struct katcp_cmd_item *locate_cmd_item(struct katcp_flat *f, struct katcl_parse
     return NULL;
   }
 
-  if(str[0] == '\0'){
+  if((str[0] == '\0') || (str[1] == '\0')){
     return NULL;
   }
 
-#if 1
-  /* map not initialised */
-  return NULL;
-#endif
-
-  i = find_data_avltree(m->m_tree, str + 1);
-  if(i){
-    return i;
-  }
+  count = chain_cmd_map(f, chain);
 
-  return m->m_fallback;
+  return resolve_cmd_item(chain, count, str + 1, hash_cmd_name(str + 1));
 }
 
 /* duplex setup *****************************************************/
@@ -740,7 +895,7 @@ int process_parse_flat_katcp(struct katcp_dispatch *d, struct katcp_flat *fx)
 
   int result, type, overridden, argc;
   struct katcp_response_handler *rh;
-  struct katcp_cmd_map *mx;
+  struct katcp_cmd_map *chain[KATCP_CHAIN_MAP];
   struct katcp_cmd_item *ix;
   char *str;
 
@@ -778,14 +933,19 @@ int process_parse_flat_katcp(struct katcp_dispatch *d, struct katcp_flat *fx)
           case KATCP_RESULT_FAIL :
           case KATCP_RESULT_INVALID :
           case KATCP_RESULT_OK :
-            result = KATCP_RESULT_OWN;
+            /* handler is done, answer the request which paused to wait for it */
+            if(fx->f_current_direction == KATCP_DIRECTION_INNER){
+              resume_endpoint_katcp(d, fx->f_peer, result);
+            }
             break;
           case KATCP_RESULT_PAUSE :
           case KATCP_RESULT_YIELD :
           case KATCP_RESULT_OWN :
+            /* still waiting for more, or handler answered things itself */
             break;
         }
-        /* WARNING: unclear if the return code makes sense here */
+        /* the reply or inform itself is consumed here, returning pause would requeue it */
+        result = KATCP_RESULT_OWN;
         overridden = 1;
         if(type == KATCP_REPLY){
           /* forget reply handler once we see a response */
@@ -800,12 +960,11 @@ int process_parse_flat_katcp(struct katcp_dispatch *d, struct katcp_flat *fx)
   }
 
   if((type == KATCP_REQUEST) || (type == KATCP_INFORM)){
-    mx = map_of_flat_katcp(fx);
-    if(mx){
+    ix = locate_cmd_item(fx, fx->f_rx);
+    if(ix || chain_cmd_map(fx, chain)){
 
-      log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "attempting to match %s to %s tree", str + 1, (fx->f_current_direction == KATCP_DIRECTION_INNER) ? "internal" : "remote");
+      log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "matched %s to %s handler %p", str + 1, (fx->f_current_direction == KATCP_DIRECTION_INNER) ? "internal" : "remote", ix);
 
-      ix = find_data_avltree(mx->m_tree, str + 1);
       if(ix && ix->i_call){
         if((overridden == 0) || (ix->i_flags & KATCP_MAP_FLAG_GREEDY)){
 
@@ -909,6 +1068,7 @@ int wake_endpoint_peer_flat_katcp(struct katcp_dispatch *d, struct katcp_endpoin
   str = get_string_parse_katcl(fx->f_rx, 0);
   if(str == NULL){
     log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "unable to acquire message name sent to %s", fx->f_name);
+    fx->f_rx = NULL;
     /* how bad an error is this ? */
     return KATCP_RESULT_OWN;
   }
@@ -963,6 +1123,9 @@ int wake_endpoint_peer_flat_katcp(struct katcp_dispatch *d, struct katcp_endpoin
 
   result = process_parse_flat_katcp(d, fx);
 
+  /* the parse belongs to the message, which the endpoint logic now disposes of */
+  fx->f_rx = NULL;
+
   return result;
 }
 
@@ -1758,10 +1921,41 @@ int append_parse_flat_katcp(struct katcp_dispatch *d, struct katcl_parse *p)
   return finish_append_flat_katcp(d, KATCP_FLAG_LAST, 0);
 }
 
-#if 0
 int append_vargs_flat_katcp(struct katcp_dispatch *d, int flags, char *fmt, va_list args)
+{
+  struct katcl_parse *px;
+  struct katcp_flat *fx;
+  int result;
+  va_list copy;
+
+  fx = require_flat_katcp(d);
+  if(fx == NULL){
+    return -1;
+  }
+
+  px = prepare_append_flat_katcp(fx, flags);
+  if(px == NULL){
+    return -1;
+  }
+
+  va_copy(copy, args);
+  result = add_vargs_parse_katcl(px, flags, fmt, copy);
+  va_end(copy);
+
+  return finish_append_flat_katcp(d, flags, result);
+}
+
 int append_args_flat_katcp(struct katcp_dispatch *d, int flags, char *fmt, ...)
-#endif
+{
+  va_list args;
+  int result;
+
+  va_start(args, fmt);
+  result = append_vargs_flat_katcp(d, flags, fmt, args);
+  va_end(args);
+
+  return result;
+}
 
 /**************************************************************************/
 /* mainloop related logic *************************************************/
@@ -2011,12 +2205,31 @@ int accept_flat_katcp(struct katcp_dispatch *d, struct katcp_arb *a, unsigned in
 #undef LABEL_BUFFER
 }
 
+static struct katcp_arb *arb_listen_flat_katcp(struct katcp_dispatch *d, char *name, int fd, struct katcp_group *gx)
+{
+  struct katcp_arb *a;
+  long opts;
+
+  opts = fcntl(fd, F_GETFL, NULL);
+  if(opts >= 0){
+    opts = fcntl(fd, F_SETFL, opts | O_NONBLOCK);
+  }
+
+  a = create_arb_katcp(d, name, fd, KATCP_ARB_READ, &accept_flat_katcp, gx);
+  if(a == NULL){
+    close(fd);
+    return NULL;
+  }
+
+  hold_group_katcp(gx);
+
+  return a;
+}
+
 struct katcp_arb *listen_flat_katcp(struct katcp_dispatch *d, char *name, struct katcp_group *g)
 {
   int fd;
-  struct katcp_arb *a;
   struct katcp_group *gx;
-  long opts;
   struct katcp_shared *s;
 
   s = d->d_shared;
@@ -2034,22 +2247,200 @@ struct katcp_arb *listen_flat_katcp(struct katcp_dispatch *d, char *name, struct
     return NULL;
   }
 
-  opts = fcntl(fd, F_GETFL, NULL);
-  if(opts >= 0){
-    opts = fcntl(fd, F_SETFL, opts | O_NONBLOCK);
-  }
+  return arb_listen_flat_katcp(d, name, fd, gx);
+}
 
-  a = create_arb_katcp(d, name, fd, KATCP_ARB_READ, &accept_flat_katcp, gx);
-  if(a == NULL){
-    close(fd);
+#ifdef KATCP_SUBPROCESS
+
+/* reactors: the connections of a group are served by several worker
+ * processes, each with its own dispatch, flats, endpoints and timers, so
+ * that a busy group can not add latency to the rest of the server. The
+ * workers accept on a shared port (SO_REUSEPORT) and each is linked to
+ * its parent by a socketpair which the parent tracks as a job. The link
+ * only lets the parent stop a worker, no messages are relayed over it:
+ *
+ * LIMITATION: a reactor is isolated. Its clients only see each other,
+ * so requests, informs and broadcasts do not cross to other reactors or
+ * the parent (?relay only finds sessions within the same reactor), and
+ * they do not see the sensors or dbase of the parent, as a worker starts
+ * from a fresh dispatch with only the command maps of its group
+ */
+
+static struct katcp_group *inherit_group_katcp(struct katcp_dispatch *d, struct katcp_group *gp)
+{
+  struct katcp_group *gx;
+  unsigned int i;
+
+  /* the command maps of the parent were copied by fork, share them instead of building new ones */
+
+  gx = create_group_katcp(d, gp->g_name);
+  if(gx == NULL){
     return NULL;
   }
 
-  hold_group_katcp(gx);
+  for(i = 0; i < KATCP_SIZE_MAP; i++){
+    if(gp->g_maps[i]){
+      gx->g_maps[i] = gp->g_maps[i];
+      hold_cmd_map(gx->g_maps[i]);
+    }
+  }
 
-  return a;
+  return gx;
+}
+
+static int run_reactor_flat_katcp(char *name, struct katcp_group *fallback, struct katcp_group *group, int lfd, int link)
+{
+  struct katcp_dispatch *dw;
+  struct katcp_shared *s;
+  struct katcp_group *gx;
+
+  /* WARNING: the dispatch of the parent is abandoned, not destroyed, as that would write to its clients */
+
+  dw = startup_katcp();
+  if(dw == NULL){
+    return -1;
+  }
+
+  s = dw->d_shared;
+
+  if(fallback){
+    gx = inherit_group_katcp(dw, fallback);
+    if(gx == NULL){
+      return -1;
+    }
+    hold_group_katcp(gx);
+    s->s_fallback = gx;
+  } else {
+    if(setup_default_group(dw, "default") < 0){
+      return -1;
+    }
+  }
+
+  if((group == fallback) || (group == NULL)){
+    gx = s->s_fallback;
+  } else {
+    gx = inherit_group_katcp(dw, group);
+    if(gx == NULL){
+      return -1;
+    }
+  }
+
+  if(lfd < 0){
+    lfd = net_listen(name, 0, NETC_REUSE_PORT);
+    if(lfd < 0){
+      return -1;
+    }
+  }
+
+  fcntl(lfd, F_SETFD, FD_CLOEXEC);
+
+  if(arb_listen_flat_katcp(dw, name, lfd, gx) == NULL){
+    return -1;
+  }
+
+  /* the link to the parent is our only conventional client, once it goes away we shut down */
+  /* TODO: nothing gets relayed over it, see the limitation above */
+  return run_pipe_server_katcp(dw, NULL, link);
 }
 
+int reactor_flat_katcp(struct katcp_dispatch *d, char *name, struct katcp_group *gx, unsigned int count)
+{
+  int lfd, fds[2], i, max;
+  unsigned int started;
+  struct katcp_url *url;
+  struct katcp_job *j, **jobs;
+  struct katcp_shared *s;
+  char *group;
+  pid_t pid;
+
+  s = d->d_shared;
+
+  group = gx->g_name ? gx->g_name : "default";
+
+  jobs = malloc(sizeof(struct katcp_job *) * count);
+  if(jobs == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate space for %u reactors", count);
+    return -1;
+  }
+
+  /* bind once up front so that a bad address is reported to the requestor, the first worker inherits this socket */
+  lfd = net_listen(name, 0, NETC_REUSE_PORT);
+  if(lfd < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to listen on %s: %s", name, strerror(errno));
+    free(jobs);
+    return -1;
+  }
+
+  for(started = 0; started < count; started++){
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create link to reactor: %s", strerror(errno));
+      break;
+    }
+
+    pid = fork();
+    if(pid < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to fork reactor: %s", strerror(errno));
+      close(fds[0]);
+      close(fds[1]);
+      break;
+    }
+
+    if(pid == 0){
+      /* WARNING: now in child, do not call return, use exit */
+
+      max = sysconf(_SC_OPEN_MAX);
+      for(i = STDERR_FILENO + 1; i < max; i++){
+        if((i != fds[0]) && ((i != lfd) || (started > 0))){
+          close(i);
+        }
+      }
+
+      exit((run_reactor_flat_katcp(name, s->s_fallback, gx, (started > 0) ? (-1) : lfd, fds[0]) < 0) ? EX_OSERR : EX_OK);
+    }
+
+    close(fds[0]);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    /* name reactors by group and index, the job list shows them as reactor://group:index */
+    url = create_kurl_katcp("reactor", group, started, NULL);
+    j = (url != NULL) ? create_job_katcp(d, url, pid, fds[1], 0, NULL) : NULL;
+    if(j == NULL){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate job logic so terminating reactor %u", started);
+      if(url){
+        destroy_kurl_katcp(url);
+      }
+      kill(pid, SIGTERM);
+      close(fds[1]);
+      break;
+    }
+
+    jobs[started] = j;
+
+    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "reactor %u for group %s on %s is process %u", started, group, name, pid);
+  }
+
+  close(lfd);
+
+  if(started < count){
+    /* all or nothing, otherwise the port is served while the requestor is told that it failed */
+    for(i = 0; i < started; i++){
+      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "terminating reactor %d for group %s as only %u of %u started", i, group, started, count);
+      kill(jobs[i]->j_pid, SIGTERM);
+      /* closes the link, the child is collected by the usual job logic */
+      zap_job_katcp(d, jobs[i]);
+    }
+    free(jobs);
+    return -1;
+  }
+
+  free(jobs);
+
+  return started;
+}
+
+#endif
+
 /* commands, both old and new ***************************************/
 
 int listen_duplex_cmd_katcp(struct katcp_dispatch *d, int argc)
@@ -2057,6 +2448,7 @@ int listen_duplex_cmd_katcp(struct katcp_dispatch *d, int argc)
   char *name, *group;
   struct katcp_group *gx;
   struct katcp_shared *s;
+  unsigned int count;
 
   s = d->d_shared;
 
@@ -2083,6 +2475,18 @@ int listen_duplex_cmd_katcp(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
+#ifdef KATCP_SUBPROCESS
+  if(argc > 3){
+    count = arg_unsigned_long_katcp(d, 3);
+    if(count > 0){
+      if(reactor_flat_katcp(d, name, gx, count) < 0){
+        return extra_response_katcp(d, KATCP_RESULT_FAIL, "reactors");
+      }
+      return KATCP_RESULT_OK;
+    }
+  }
+#endif
+
   if(listen_flat_katcp(d, name, gx) == NULL){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to listen on %s: %s", name, strerror(errno));
     return KATCP_RESULT_FAIL;
@@ -2129,7 +2533,9 @@ int help_group_cmd_katcp(struct katcp_dispatch *d, int argc)
 {
   struct katcp_flat *fx;
   struct katcp_cmd_item *i;
-  struct katcp_cmd_map *mx;
+  struct katcp_cmd_map *chain[KATCP_CHAIN_MAP];
+  unsigned int pos[KATCP_CHAIN_MAP];
+  unsigned int count, j, best;
   char *name, *match;
 
   fx = require_flat_katcp(d);
@@ -2139,8 +2545,8 @@ int help_group_cmd_katcp(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
-  mx = map_of_flat_katcp(fx);
-  if(mx == NULL){
+  count = chain_cmd_map(fx, chain);
+  if(count == 0){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no map to be found for client %s", fx->f_name);
     return KATCP_RESULT_FAIL;
   }
@@ -2148,8 +2554,34 @@ int help_group_cmd_katcp(struct katcp_dispatch *d, int argc)
   name = arg_string_katcp(d, 1);
   if(name == NULL){
     log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "should generate list of commands");
-    if(mx->m_tree){
-      print_inorder_avltree(d, mx->m_tree->t_root, &print_help_cmd_item, 0);
+
+    /* merge the sorted maps, a name is only listed for the map which would run it */
+    for(j = 0; j < count; j++){
+      pos[j] = 0;
+    }
+
+    for(;;){
+      best = count;
+      for(j = 0; j < count; j++){
+        if(pos[j] < chain[j]->m_count){
+          if((best == count) || (strcmp(chain[j]->m_items[pos[j]]->i_name, chain[best]->m_items[pos[best]]->i_name) < 0)){
+            best = j;
+          }
+        }
+      }
+
+      if(best == count){
+        break;
+      }
+
+      i = chain[best]->m_items[pos[best]];
+      for(j = 0; j < count; j++){
+        if((pos[j] < chain[j]->m_count) && (strcmp(chain[j]->m_items[pos[j]]->i_name, i->i_name) == 0)){
+          pos[j]++;
+        }
+      }
+
+      print_help_cmd_item(d, NULL, (void *)i);
     }
   } else {
     log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "should provide help for %s", name);
@@ -2166,8 +2598,8 @@ int help_group_cmd_katcp(struct katcp_dispatch *d, int argc)
       log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to provide help on a null command");
       return KATCP_RESULT_FAIL;
     } else {
-      i = find_data_avltree(mx->m_tree, match);
-      if(i == NULL){
+      i = resolve_cmd_item(chain, count, match, hash_cmd_name(match));
+      if((i == NULL) || strcmp(i->i_name, match)){
         log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no match for %s found", name);
       } else {
         print_help_cmd_item(d, NULL, (void *)i);
@@ -2250,6 +2682,12 @@ int relay_watchdog_group_cmd_katcp(struct katcp_dispatch *d, int argc)
   }
   target = peer_of_flat_katcp(d, fx);
 
+  if(target == source){
+    /* a paused endpoint only sees replies and informs, so it would never field its own request */
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to relay to %s as it is the requesting session", name);
+    return extra_response_katcp(d, KATCP_RESULT_FAIL, "self");
+  }
+
   log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "sending ping from endpoint %p to endpoint %p", source, target);
 
   px = create_parse_katcl();
@@ -2268,13 +2706,9 @@ int relay_watchdog_group_cmd_katcp(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
-  /* WARNING: broken - will currently not resume, despite returning an ok ... */
+  /* held back until the reply arrives, its completion callback then answers this request */
 
-#if 1
   return KATCP_RESULT_PAUSE;
-#else
-  return KATCP_RESULT_OK;
-#endif
 }
 
 /*********************************************************************************/
@@ -2283,7 +2717,7 @@ int complete_relay_generic_group_cmd_katcp(struct katcp_dispatch *d, int argc)
 {
   struct katcp_flat *fx;
   struct katcl_parse *px;
-  char *cmd;
+  char *cmd, *code;
 
 #ifdef KATCP_CONSISTENCY_CHECKS
   fx = require_flat_katcp(d);
@@ -2306,12 +2740,17 @@ int complete_relay_generic_group_cmd_katcp(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
-  append_parse_katcp(d, px);
-
   if(is_reply_parse_katcl(px)){
-    return KATCP_RESULT_OWN;
+    /* the relay request gets answered with the outcome, not the reply of the other party */
+    code = arg_string_katcp(d, 1);
+    if((code == NULL) || strcmp(code, KATCP_OK)){
+      return KATCP_RESULT_FAIL;
+    }
+    return KATCP_RESULT_OK;
   }
 
+  append_parse_katcp(d, px);
+
   return KATCP_RESULT_PAUSE;
 }
 
@@ -2352,6 +2791,12 @@ int relay_generic_group_cmd_katcp(struct katcp_dispatch *d, int argc)
   }
   target = peer_of_flat_katcp(d, fx);
 
+  if(target == source){
+    /* a paused endpoint only sees replies and informs, so it would never field its own request */
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to relay to %s as it is the requesting session", name);
+    return extra_response_katcp(d, KATCP_RESULT_FAIL, "self");
+  }
+
   log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "sending ping from endpoint %p to endpoint %p", source, target);
 
   px = create_parse_katcl();
@@ -2390,13 +2835,9 @@ int relay_generic_group_cmd_katcp(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
-  /* WARNING: broken - will currently not resume, despite returning an ok ... */
+  /* held back until the reply arrives, its completion callback then answers this request */
 
-#if 1
   return KATCP_RESULT_PAUSE;
-#else
-  return KATCP_RESULT_OK;
-#endif
 }
 
 /* uses previously defined commands *********************************/
@@ -2448,4 +2889,296 @@ int setup_default_group(struct katcp_dispatch *d, char *name)
   return 0;
 }
 
+#ifdef KATCP_BENCHMARK_DPX
+
+#include <sys/time.h>
+#include <avltree.h>
+
+#define BENCH_COMMANDS    64
+#define BENCH_LOOKUPS  4000000
+
+static int bench_call(struct katcp_dispatch *d, int argc)
+{
+  return KATCP_RESULT_OK;
+}
+
+static double bench_elapsed(struct timeval *ts)
+{
+  struct timeval te, delta;
+
+  gettimeofday(&te, NULL);
+  sub_time_katcp(&delta, &te, ts);
+
+  return (delta.tv_sec * 1000000.0) + delta.tv_usec;
+}
+
+int main(int argc, char **argv)
+{
+  struct katcp_cmd_map *flat, *group, *fallback;
+  struct katcp_group gl, gx;
+  struct katcp_shared sx;
+  struct katcp_flat fx;
+  struct katcp_cmd_item *ix;
+  struct katcl_parse *px[BENCH_COMMANDS];
+  struct avl_tree *tree;
+  struct timeval ts;
+  char name[32];
+  unsigned int i, j, miss;
+  double hashed, tree_us;
+
+  flat = create_cmd_map("flat");
+  group = create_cmd_map("group");
+  fallback = create_cmd_map("fallback");
+  tree = create_avltree();
+  if((flat == NULL) || (group == NULL) || (fallback == NULL) || (tree == NULL)){
+    fprintf(stderr, "bench: unable to allocate maps\n");
+    return 1;
+  }
+
+  /* most commands live in the default group, a few are shadowed further up */
+  for(i = 0; i < BENCH_COMMANDS; i++){
+    snprintf(name, sizeof(name), "bench-%02u", i);
+    if(add_full_cmd_map(fallback, name, "benchmark", 0, &bench_call, NULL, NULL) < 0){
+      fprintf(stderr, "bench: unable to add %s\n", name);
+      return 1;
+    }
+    if((i % 8) == 0){
+      add_full_cmd_map(group, name, "benchmark", 0, &bench_call, NULL, NULL);
+    }
+    store_named_node_avltree(tree, name, fallback);
+
+    px[i] = create_parse_katcl();
+    snprintf(name, sizeof(name), "?bench-%02u", i);
+    add_string_parse_katcl(px[i], KATCP_FLAG_FIRST | KATCP_FLAG_LAST | KATCP_FLAG_STRING, name);
+  }
+  add_full_cmd_map(flat, "bench-only", "benchmark", 0, &bench_call, NULL, NULL);
+
+  memset(&gl, 0, sizeof(struct katcp_group));
+  memset(&gx, 0, sizeof(struct katcp_group));
+  memset(&sx, 0, sizeof(struct katcp_shared));
+  memset(&fx, 0, sizeof(struct katcp_flat));
+
+  gl.g_maps[KATCP_MAP_REMOTE_REQUEST] = fallback;
+  gx.g_maps[KATCP_MAP_REMOTE_REQUEST] = group;
+  sx.s_fallback = &gl;
+
+  fx.f_shared = &sx;
+  fx.f_group = &gx;
+  fx.f_maps[KATCP_MAP_REMOTE_REQUEST] = flat;
+  fx.f_current_map = KATCP_MAP_REMOTE_REQUEST;
+
+  miss = 0;
+
+  gettimeofday(&ts, NULL);
+  for(j = 0; j < BENCH_LOOKUPS; j++){
+    ix = locate_cmd_item(&fx, px[j % BENCH_COMMANDS]);
+    if(ix == NULL){
+      miss++;
+    }
+  }
+  hashed = bench_elapsed(&ts);
+
+  /* previous layout: a single avltree per map, without any chaining */
+  gettimeofday(&ts, NULL);
+  for(j = 0; j < BENCH_LOOKUPS; j++){
+    if(find_data_avltree(tree, get_string_parse_katcl(px[j % BENCH_COMMANDS], 0) + 1) == NULL){
+      miss++;
+    }
+  }
+  tree_us = bench_elapsed(&ts);
+
+  if(miss){
+    fprintf(stderr, "bench: %u lookups failed\n", miss);
+    return 1;
+  }
+
+  printf("bench: %u lookups over %d commands, chained hash %.1fns, single avltree %.1fns\n", BENCH_LOOKUPS, BENCH_COMMANDS, hashed * 1000.0 / BENCH_LOOKUPS, tree_us * 1000.0 / BENCH_LOOKUPS);
+
+  for(i = 0; i < BENCH_COMMANDS; i++){
+    destroy_parse_katcl(px[i]);
+  }
+
+  destroy_avltree(tree, NULL);
+  destroy_cmd_map(flat);
+  destroy_cmd_map(group);
+  destroy_cmd_map(fallback);
+
+  return 0;
+}
+
+#endif
+
+#ifdef KATCP_BENCHMARK_REACTOR
+
+/* loopback load test: clients pipeline ?watchdog requests against a
+ * single loop, then against an increasing number of reactors
+ */
+
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define BENCH_PORT       17300
+#define BENCH_CLIENTS       16
+#define BENCH_WINDOW        32
+#define BENCH_SECONDS        2
+
+static int bench_server(int pfd, char *name, unsigned int reactors)
+{
+  struct katcp_dispatch *d;
+  struct katcp_shared *s;
+
+  d = startup_katcp();
+  if(d == NULL){
+    return -1;
+  }
+
+  if(setup_default_group(d, "default") < 0){
+    return -1;
+  }
+
+  s = d->d_shared;
+
+  if(reactors > 0){
+    if(reactor_flat_katcp(d, name, s->s_fallback, reactors) < 0){
+      return -1;
+    }
+  } else {
+    if(listen_flat_katcp(d, name, NULL) == NULL){
+      return -1;
+    }
+  }
+
+  return run_pipe_server_katcp(d, NULL, pfd);
+}
+
+static unsigned long bench_client(int port)
+{
+  struct katcl_line *l;
+  struct timeval start, now;
+  unsigned long done;
+  unsigned int pending, i;
+  int fd;
+
+  for(i = 0; ((fd = net_connect("localhost", port, 0)) < 0) && (i < 200); i++){
+    usleep(10000);
+  }
+  if(fd < 0){
+    return 0;
+  }
+
+  l = create_katcl(fd);
+  if(l == NULL){
+    return 0;
+  }
+
+  done = 0;
+  pending = 0;
+
+  gettimeofday(&start, NULL);
+
+  do{
+    while(pending < BENCH_WINDOW){
+      append_string_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_LAST, "?watchdog");
+      pending++;
+    }
+
+    while(flushing_katcl(l)){
+      if(write_katcl(l) < 0){
+        return done;
+      }
+    }
+
+    if(read_katcl(l)){
+      return done;
+    }
+
+    while(have_katcl(l) > 0){
+      if(arg_reply_katcl(l)){
+        done++;
+        pending--;
+      }
+    }
+
+    gettimeofday(&now, NULL);
+  } while(now.tv_sec < start.tv_sec + BENCH_SECONDS);
+
+  destroy_katcl(l, 1);
+
+  return done;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned int reactors[] = { 0, 1, 2, 4 };
+  unsigned int i, j;
+  unsigned long count, total;
+  int sp[2], rp[2], port;
+  pid_t server;
+  char name[32];
+
+  signal(SIGPIPE, SIG_IGN);
+
+  for(i = 0; i < sizeof(reactors) / sizeof(unsigned int); i++){
+    port = BENCH_PORT + i;
+    snprintf(name, sizeof(name), "localhost:%d", port);
+
+    if((socketpair(AF_UNIX, SOCK_STREAM, 0, sp) < 0) || (pipe(rp) < 0)){
+      fprintf(stderr, "bench: unable to create pipes\n");
+      return 1;
+    }
+
+    server = fork();
+    if(server < 0){
+      return 1;
+    }
+    if(server == 0){
+      close(sp[1]);
+      close(rp[0]);
+      close(rp[1]);
+      exit((bench_server(sp[0], name, reactors[i]) < 0) ? EX_OSERR : EX_OK);
+    }
+    close(sp[0]);
+
+    for(j = 0; j < BENCH_CLIENTS; j++){
+      if(fork() == 0){
+        close(sp[1]);
+        close(rp[0]);
+        count = bench_client(port);
+        if(write(rp[1], &count, sizeof(unsigned long)) != sizeof(unsigned long)){
+          exit(EX_OSERR);
+        }
+        exit(EX_OK);
+      }
+    }
+    close(rp[1]);
+
+    total = 0;
+    for(j = 0; j < BENCH_CLIENTS; j++){
+      if(read(rp[0], &count, sizeof(unsigned long)) != sizeof(unsigned long)){
+        break;
+      }
+      total += count;
+    }
+    close(rp[0]);
+
+    while(waitpid(-1, NULL, WNOHANG) > 0);
+
+    /* dropping the link stops the server, which takes its reactors with it */
+    close(sp[1]);
+    waitpid(server, NULL, 0);
+
+    if(reactors[i] > 0){
+      printf("bench: %u reactors, %d clients, %.0f requests/s\n", reactors[i], BENCH_CLIENTS, (double)total / BENCH_SECONDS);
+    } else {
+      printf("bench: single loop, %d clients, %.0f requests/s\n", BENCH_CLIENTS, (double)total / BENCH_SECONDS);
+    }
+
+    fflush(stdout);
+  }
+
+  return 0;
+}
+
+#endif
+
 #endif
@@ -15,7 +15,7 @@
 #include <katcl.h>
 
 #define ENDPOINT_PRECEDENCE_LOW    0
-#define ENDPOINT_PRECEDENCE_HIGH   0
+#define ENDPOINT_PRECEDENCE_HIGH   1
 
 #define KATCP_MESSAGE_WACK    0x1 /* wants a reply, even if other side has gone away */
 
@@ -120,6 +120,9 @@ static int queue_message_katcp(struct katcp_dispatch *d, struct katcp_message *m
     return -1;
   }
 
+  /* receiver may come before us in the endpoint list, don't wait for io to run it */
+  mark_busy_katcp(d);
+
   return 0;
 }
 
@@ -437,7 +440,7 @@ int vturnaround_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *
     destroy_message_katcp(d, msg);
   }
 
-  return -1;
+  return result;
 }
 
 int turnaround_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep, struct katcp_message *msg, int code, char *fmt, ...)
@@ -486,6 +489,47 @@ int answer_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep, s
   return send_message_endpoint_katcp(d, msg->m_to, msg->m_from, px, 0);
 }
 
+int resume_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep, int code)
+{
+  /* completes a request previously paused by the wake callback */
+  struct katcp_message *msg;
+
+  if(ep == NULL){
+    return -1;
+  }
+
+  sane_endpoint_katcp(ep);
+
+  if(ep->e_precedence == ENDPOINT_PRECEDENCE_LOW){
+    /* nothing held back, possibly a reply to a request we did not wait for */
+    return -1;
+  }
+
+  /* paused request was the oldest message when woken, only newer replies and informs have been seen since */
+  msg = get_head_gueue_katcl(ep->e_queue);
+  if((msg == NULL) || (msg->m_parse == NULL) || !is_request_parse_katcl(msg->m_parse)){
+#ifdef KATCP_CONSISTENCY_CHECKS
+    fprintf(stderr, "endpoint: logic problem: paused endpoint %p not holding a request\n", ep);
+    abort();
+#endif
+    return -1;
+  }
+
+  if(remove_datum_gueue_katcl(ep->e_queue, msg) == NULL){
+#ifdef KATCP_CONSISTENCY_CHECKS
+    fprintf(stderr, "endpoint: major corruption in queue: unable to remove %p\n", msg);
+    abort();
+#endif
+    return -1;
+  }
+
+  precedence_endpoint_katcp(d, ep, ENDPOINT_PRECEDENCE_LOW);
+  /* requests held back behind this one are visible again */
+  mark_busy_katcp(d);
+
+  return turnaround_endpoint_katcp(d, ep, msg, code, NULL);
+}
+
 struct katcp_endpoint *source_endpoint_katcp(struct katcp_dispatch *d, struct katcp_message *msg)
 {
   if(msg == NULL){
@@ -638,7 +682,7 @@ void run_endpoints_katcp(struct katcp_dispatch *d)
 #endif
             precedence_endpoint_katcp(d, ep, ENDPOINT_PRECEDENCE_HIGH);
 
-            /* WARNING: do we do a remove and destroy on the message, else how does one get it out of the queue */
+            /* request stays queued, held back until resume_endpoint_katcp answers it */
 
             break;
 
@@ -690,8 +734,14 @@ void run_endpoints_katcp(struct katcp_dispatch *d)
 
 void show_endpoint_katcp(struct katcp_dispatch *d, char *prefix, int level, struct katcp_endpoint *ep)
 {
+  unsigned int high;
+  unsigned long added;
+
+  stats_gueue_katcl(ep->e_queue, &high, &added, NULL, NULL);
+
   log_message_katcp(d, level, NULL, "%s endpoint %p current precedence %u", prefix, ep, ep->e_precedence);
   log_message_katcp(d, level, NULL, "%s endpoint %p size %u", prefix, ep, size_gueue_katcl(ep->e_queue));
+  log_message_katcp(d, level, NULL, "%s endpoint %p peak %u of %lu messages", prefix, ep, high, added);
   log_message_katcp(d, level, NULL, "%s endpoint %p references %u", prefix, ep, ep->e_refcount);
   log_message_katcp(d, level, NULL, "%s endpoint %p flags 0x%04x", prefix, ep, ep->e_flags);
 }
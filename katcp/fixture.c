@@ -0,0 +1,279 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* test fixtures shared by the tools, built into their tests only */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+
+#include "katcl.h"
+#include "fixture.h"
+
+#define FIXTURE_EVENTS 64
+#define FIXTURE_CHUNK  4096
+
+struct fixture_conn{
+  int f_fd;
+  unsigned int f_index;
+  struct katcl_line *f_line; /* NULL for a listener */
+};
+
+int serve_fixture(int *fds, unsigned int count, int (*call)(struct katcl_line *l, unsigned int index, void *data), void *data)
+{
+  struct epoll_event ev, events[FIXTURE_EVENTS];
+  struct fixture_conn *listeners, *c;
+  unsigned int i;
+  int efd, ready, n, fd, result;
+
+  efd = epoll_create(FIXTURE_EVENTS);
+  if(efd < 0){
+    return -1;
+  }
+
+  listeners = malloc(sizeof(struct fixture_conn) * count);
+  if(listeners == NULL){
+    close(efd);
+    return -1;
+  }
+
+  for(i = 0; i < count; i++){
+    listeners[i].f_fd = fds[i];
+    listeners[i].f_index = i;
+    listeners[i].f_line = NULL;
+    if(fds[i] < 0){
+      continue;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &(listeners[i]);
+    if(epoll_ctl(efd, EPOLL_CTL_ADD, fds[i], &ev) < 0){
+      close(efd);
+      free(listeners);
+      return -1;
+    }
+  }
+
+  for(;;){
+    ready = epoll_wait(efd, events, FIXTURE_EVENTS, -1);
+    if(ready < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      break;
+    }
+
+    for(n = 0; n < ready; n++){
+      c = events[n].data.ptr;
+
+      if(c->f_line == NULL){
+        fd = accept(c->f_fd, NULL, NULL);
+        if(fd < 0){
+          continue;
+        }
+        i = c->f_index;
+        c = malloc(sizeof(struct fixture_conn));
+        if(c == NULL){
+          close(fd);
+          continue;
+        }
+        c->f_fd = fd;
+        c->f_index = i;
+        c->f_line = create_katcl(fd);
+        if(c->f_line == NULL){
+          close(fd);
+          free(c);
+          continue;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+        continue;
+      }
+
+      result = read_katcl(c->f_line) ? (-1) : 0;
+      while((result >= 0) && (have_katcl(c->f_line) > 0)){
+        result = (*call)(c->f_line, c->f_index, data);
+      }
+
+      if(result < 0){
+        destroy_katcl(c->f_line, 1);
+        free(c);
+        continue;
+      }
+
+      write_katcl(c->f_line);
+    }
+  }
+
+  close(efd);
+  free(listeners);
+
+  return -1;
+}
+
+int run_fixture(char **argv, char *input, char **output)
+{
+  struct pollfd pf[2];
+  char *buffer, *tmp, scratch[FIXTURE_CHUNK];
+  unsigned int size, have, length, sent;
+  int out[2], in[2], status, rr, wr, result;
+  pid_t pid;
+
+  if(output){
+    *output = NULL;
+  }
+
+  /* sockets at both ends, so that writing to a child which has gone is an error, not a SIGPIPE */
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, out) < 0){
+    return -1;
+  }
+
+  in[0] = (-1);
+  in[1] = (-1);
+  if(input && (socketpair(AF_UNIX, SOCK_STREAM, 0, in) < 0)){
+    close(out[0]);
+    close(out[1]);
+    return -1;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+
+  pid = fork();
+  if(pid < 0){
+    close(out[0]);
+    close(out[1]);
+    if(input){
+      close(in[0]);
+      close(in[1]);
+    }
+    return -1;
+  }
+
+  if(pid == 0){
+    close(out[0]);
+    dup2(out[1], STDOUT_FILENO);
+    close(out[1]);
+    if(input){
+      close(in[1]);
+      dup2(in[0], STDIN_FILENO);
+      close(in[0]);
+    }
+    freopen("/dev/null", "w", stderr);
+    execv(argv[0], argv);
+    exit(4);
+  }
+
+  close(out[1]);
+  if(input){
+    close(in[0]);
+  }
+
+  length = input ? strlen(input) : 0;
+  sent = 0;
+  if(input && (length == 0)){
+    close(in[1]);
+    in[1] = (-1);
+  }
+
+  result = 0;
+  have = 0;
+  size = FIXTURE_CHUNK * 4;
+  buffer = output ? malloc(size) : NULL;
+  if(output && (buffer == NULL)){
+    result = (-1); /* still drain and reap the child */
+  }
+
+  for(;;){
+    pf[0].fd = out[0];
+    pf[0].events = POLLIN;
+    pf[1].fd = in[1]; /* ignored by poll once negative */
+    pf[1].events = POLLOUT;
+
+    if(poll(pf, 2, -1) < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      result = (-1);
+      break;
+    }
+
+    if(pf[1].revents){
+      wr = send(in[1], input + sent, length - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if(wr > 0){
+        sent += wr;
+      }
+      if(((wr < 0) && (errno != EAGAIN) && (errno != EINTR)) || (sent >= length)){
+        close(in[1]);
+        in[1] = (-1);
+      }
+    }
+
+    if(pf[0].revents == 0){
+      continue;
+    }
+
+    if(output && (result == 0) && (have + FIXTURE_CHUNK >= size)){
+      tmp = realloc(buffer, size + FIXTURE_CHUNK * 4);
+      if(tmp){
+        buffer = tmp;
+        size += FIXTURE_CHUNK * 4;
+      } else {
+        result = (-1); /* keep draining, but give up on collecting */
+      }
+    }
+
+    if(output && (result == 0)){
+      rr = read(out[0], buffer + have, size - have - 1);
+    } else {
+      rr = read(out[0], scratch, FIXTURE_CHUNK);
+    }
+
+    if(rr < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      break;
+    }
+    if(rr == 0){
+      break;
+    }
+
+    if(output && (result == 0)){
+      have += rr;
+    }
+  }
+
+  close(out[0]);
+  if(in[1] >= 0){
+    close(in[1]);
+  }
+
+  if(waitpid(pid, &status, 0) != pid){
+    result = (-1);
+  }
+
+  if(output){
+    if(result == 0){
+      buffer[have] = '\0';
+      *output = buffer;
+    } else {
+      free(buffer);
+      *output = NULL;
+    }
+  }
+
+  if(result < 0){
+    return -1;
+  }
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : (-1);
+}
@@ -0,0 +1,30 @@
+#ifndef FIXTURE_H_
+#define FIXTURE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* helpers shared by the tests of the tools, not part of the library -
+ * a test links fixture.c next to libkatcp */
+
+struct katcl_line;
+
+/* serves katcl connections accepted on count listeners until killed,
+ * negative entries in fds are skipped. call is run for every complete
+ * message with the index of the listener the connection came in on, its
+ * replies are flushed afterwards. A negative return closes the connection */
+int serve_fixture(int *fds, unsigned int count, int (*call)(struct katcl_line *l, unsigned int index, void *data), void *data);
+
+/* runs argv with stderr discarded and a socket as stdout, writing input
+ * (if not NULL) to its stdin. All output is drained until the child closes
+ * it, so a chatty child never blocks. If output is not NULL it gets a
+ * malloced, nul terminated copy, to be freed by the caller. Returns the
+ * exit code, 4 if the child could not be started, -1 on other failures */
+int run_fixture(char **argv, char *input, char **output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
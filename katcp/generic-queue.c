@@ -21,21 +21,49 @@
 #include "katpriv.h"
 #include "netc.h"
 
-/* Pathetic attempt at a generic queue */
+/* Pathetic attempt at a generic queue, now a little less so: every
+ * precedence level has its own power of two ring (a lane), entries are
+ * stamped with an insertion order so that the lanes can be merged back
+ * into a single fifo. Adding and removing at the head of a lane is O(1),
+ * finding the oldest entry of at least a given precedence only looks at
+ * the heads of the lanes */
+
+#define KATCL_GUEUE_LANES     4
+#define KATCL_GUEUE_INITIAL   8
+
+struct katcl_gueue_slot
+{
+  void *s_datum;
+  unsigned long s_order;
+};
+
+struct katcl_gueue_lane
+{
+  struct katcl_gueue_slot *l_slots;
+  unsigned int l_mask;  /* size - 1, size is zero or a power of two */
+  unsigned int l_head;
+  unsigned int l_count;
+};
 
 struct katcl_gueue
 {
-  void       **g_queue; /* elements */
-  unsigned int g_size;  /* size of queue */
-  unsigned int g_head;  /* current position */
-  unsigned int g_count; /* No of entries */
+  struct katcl_gueue_lane g_lanes[KATCL_GUEUE_LANES];
+  unsigned int g_count; /* No of entries, across all lanes */
+  unsigned long g_order;
+
+  unsigned int g_capacity; /* zero if unbounded */
+  int g_policy;
+
+  unsigned int g_high;      /* high water mark */
+  unsigned long g_added;
+  unsigned long g_refused;
+  unsigned long g_evicted;
 
   void (*g_release)(void *datum);  /* the cleanup function */
 
-  /* this may actually one day be a proper priority queue, here just the 
-   * feeble attempts: g_precedence is a user function which computes a metric
-   * of the stored item, can be used to retrieve an which is at the head of the
-   * queue but also has a precendence of greater or equal the given value */
+  /* g_precedence is a user function which computes a metric of the stored
+   * item, it is evaluated once as the item is added to select its lane.
+   * Values beyond the last lane share that lane */
 
   unsigned int (*g_precedence)(void *datum); 
 };
@@ -43,17 +71,31 @@ struct katcl_gueue
 struct katcl_gueue *create_precedence_gueue_katcl(void (*release)(void *datum), unsigned int (*precedence)(void *datum))
 {
   struct katcl_gueue *g;
+  unsigned int i;
 
   g = malloc(sizeof(struct katcl_gueue));
   if(g == NULL){
     fprintf(stderr, "generic queue: unable to allocate state\n");
     return NULL;
   }
-  g->g_queue = NULL;
 
-  g->g_head = 0;
+  for(i = 0; i < KATCL_GUEUE_LANES; i++){
+    g->g_lanes[i].l_slots = NULL;
+    g->g_lanes[i].l_mask = 0;
+    g->g_lanes[i].l_head = 0;
+    g->g_lanes[i].l_count = 0;
+  }
+
   g->g_count = 0;
-  g->g_size = 0;
+  g->g_order = 0;
+
+  g->g_capacity = 0;
+  g->g_policy = KATCL_GUEUE_REFUSE;
+
+  g->g_high = 0;
+  g->g_added = 0;
+  g->g_refused = 0;
+  g->g_evicted = 0;
 
   g->g_release = release;
   g->g_precedence = precedence;
@@ -66,321 +108,397 @@ struct katcl_gueue *create_gueue_katcl(void (*release)(void *datum))
   return create_precedence_gueue_katcl(release, NULL);
 }
 
-void destroy_gueue_katcl(struct katcl_gueue *g)
+void clear_gueue_katcl(struct katcl_gueue *g)
 {
+  struct katcl_gueue_lane *l;
   unsigned int i, j;
 
-  for(j = 0; j < g->g_count; j++){
-    i = (g->g_head + j) % g->g_size;
-    if(g->g_release){
-      (*(g->g_release))(g->g_queue[i]);
-    }
-    g->g_queue[i] = NULL;
+#ifdef KATCP_CONSISTENCY_CHECKS
+  if(g == NULL){
+    fprintf(stderr, "generic queue: given null queue to clear\n");
+    abort();
   }
+#endif
 
-  if(g->g_queue){
-    free(g->g_queue);
-    g->g_queue = NULL;
+  for(i = 0; i < KATCL_GUEUE_LANES; i++){
+    l = &(g->g_lanes[i]);
+    for(j = 0; j < l->l_count; j++){
+      if(g->g_release){
+        (*(g->g_release))(l->l_slots[(l->l_head + j) & l->l_mask].s_datum);
+      }
+      l->l_slots[(l->l_head + j) & l->l_mask].s_datum = NULL;
+    }
+    l->l_head = 0;
+    l->l_count = 0;
   }
 
   g->g_count = 0;
-  g->g_size = 0;
-  g->g_head = 0;
-
-  g->g_release = NULL;
-
-  free(g);
 }
 
-void clear_gueue_katcl(struct katcl_gueue *g)
+void destroy_gueue_katcl(struct katcl_gueue *g)
 {
-  unsigned int i, j;
+  unsigned int i;
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if(g == NULL){
-    fprintf(stderr, "generic queue: given null queue to clear\n");
-    abort();
-  }
-#endif
+  clear_gueue_katcl(g);
 
-  for(j = 0; j < g->g_count; j++){
-    i = (g->g_head + j) % g->g_size;
-    if(g->g_release){
-      (*(g->g_release))(g->g_queue[i]);
+  for(i = 0; i < KATCL_GUEUE_LANES; i++){
+    if(g->g_lanes[i].l_slots){
+      free(g->g_lanes[i].l_slots);
+      g->g_lanes[i].l_slots = NULL;
     }
-    g->g_queue[i] = NULL;
+    g->g_lanes[i].l_mask = 0;
   }
 
-  g->g_count = 0;
+  g->g_release = NULL;
+
+  free(g);
 }
 
-/* logic to manage the queue ****************************************************/
+/* bounds and statistics ********************************************************/
 
-int add_tail_gueue_katcl(struct katcl_gueue *g, void *datum)
+int limit_gueue_katcl(struct katcl_gueue *g, unsigned int capacity, int policy)
 {
-  void **tmp;
-  unsigned int index;
-
-  if(datum == NULL){
+  if((policy != KATCL_GUEUE_REFUSE) && (policy != KATCL_GUEUE_EVICT)){
     return -1;
   }
 
-#if DEBUG > 1
-  fprintf(stderr, "generic queue: adding %p with queue %p of size %d\n", datum, g, g->g_count);
-#endif
+  g->g_capacity = capacity;
+  g->g_policy = policy;
 
-  if(g->g_count >= g->g_size){
+  return 0;
+}
 
-#if DEBUG > 1
-    fprintf(stderr, "generic queue: size=%d, count=%d - increasing queue\n", g->g_size, g->g_count);
-#endif
+int full_gueue_katcl(struct katcl_gueue *g)
+{
+  return (g->g_capacity > 0) && (g->g_count >= g->g_capacity);
+}
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-    if(g->g_size < g->g_count){
-      fprintf(stderr, "generic queue: warning: detected rapid size increase of queue, probably a corruption\n");
-      abort();
-    }
-#endif
-    tmp = realloc(g->g_queue, sizeof(void *) * (g->g_size + 1));
+void stats_gueue_katcl(struct katcl_gueue *g, unsigned int *high, unsigned long *added, unsigned long *refused, unsigned long *evicted)
+{
+  if(high){
+    *high = g->g_high;
+  }
+  if(added){
+    *added = g->g_added;
+  }
+  if(refused){
+    *refused = g->g_refused;
+  }
+  if(evicted){
+    *evicted = g->g_evicted;
+  }
+}
 
-    if(tmp == NULL){
-      return -1;
-    }
-    g->g_queue = tmp;
+/* logic to manage a lane *******************************************************/
 
-    if(g->g_head > 0){
-      g->g_queue[g->g_size] = g->g_queue[0];
-      if(g->g_head > 1){
-        memmove(&(g->g_queue[0]), &(g->g_queue[1]), sizeof(void *) * (g->g_head - 1));
-      }
-      g->g_queue[g->g_head - 1] = NULL;
-    }
+static int grow_lane_gueue_katcl(struct katcl_gueue_lane *l)
+{
+  struct katcl_gueue_slot *tmp;
+  unsigned int size, first;
 
-    g->g_size = g->g_size + 1;
-  } 
-  index = (g->g_head + g->g_count) % g->g_size;
+  size = l->l_mask ? ((l->l_mask + 1) * 2) : KATCL_GUEUE_INITIAL;
 
 #if DEBUG > 1
-  fprintf(stderr, "generic queue: %p add[%d]=%p\n", g, index, datum);
+  fprintf(stderr, "generic queue: increasing lane to %u slots\n", size);
 #endif
 
-  g->g_queue[index] = datum;
-  g->g_count++;
+  tmp = realloc(l->l_slots, sizeof(struct katcl_gueue_slot) * size);
+  if(tmp == NULL){
+    return -1;
+  }
+  l->l_slots = tmp;
+
+  first = l->l_mask ? (l->l_mask + 1) : 0;
+  memset(&(l->l_slots[first]), 0, sizeof(struct katcl_gueue_slot) * (size - first));
+
+  if(l->l_count > 0){
+    /* the part which wrapped around moves to the newly allocated upper half */
+    first = (l->l_mask + 1) - l->l_head;
+    if(first < l->l_count){
+      memcpy(&(l->l_slots[l->l_mask + 1]), &(l->l_slots[0]), sizeof(struct katcl_gueue_slot) * (l->l_count - first));
+      memset(&(l->l_slots[0]), 0, sizeof(struct katcl_gueue_slot) * (l->l_count - first));
+    }
+  }
+
+  l->l_mask = size - 1;
 
   return 0;
 }
 
-/*************************************************************************/
-
-void *get_from_head_gueue_katcl(struct katcl_gueue *g, unsigned int position)
+static void *remove_index_lane_gueue_katcl(struct katcl_gueue *g, struct katcl_gueue_lane *l, unsigned int position)
 {
-  unsigned int wrap;
-
-  if((g->g_count == 0) || (g->g_size == 0) || (g->g_count > g->g_size)){
-    return NULL;
-  }
+  unsigned int i, from, to;
+  void *datum;
 
 #ifdef KATCP_CONSISTENCY_CHECKS
-  if(g->g_size < g->g_count){
-    fprintf(stderr, "generic queue: more elements %u than slots %u\n", g->g_count, g->g_size);
+  if(position >= l->l_count){
+    fprintf(stderr, "generic queue: position %u out of range %u\n", position, l->l_count);
     abort();
   }
 #endif
 
-  if(position < g->g_count){
-    wrap = ((g->g_head + position) % g->g_size);
-    return g->g_queue[wrap];
+  datum = l->l_slots[(l->l_head + position) & l->l_mask].s_datum;
+
+  if(position == 0){
+    /* the common, simple case - remove from head */
+    l->l_slots[l->l_head].s_datum = NULL;
+    l->l_head = (l->l_head + 1) & l->l_mask;
   } else {
-    return NULL;
+    /* close the gap by moving the later entries of this lane forward */
+    for(i = position + 1; i < l->l_count; i++){
+      from = (l->l_head + i) & l->l_mask;
+      to = (l->l_head + i - 1) & l->l_mask;
+      l->l_slots[to] = l->l_slots[from];
+    }
+    l->l_slots[(l->l_head + l->l_count - 1) & l->l_mask].s_datum = NULL;
   }
-}
 
-void *get_head_gueue_katcl(struct katcl_gueue *g)
-{
-  return (g->g_count > 0) ? g->g_queue[g->g_head] : NULL;
+  l->l_count--;
+  g->g_count--;
+
+#if DEBUG > 1
+  fprintf(stderr, "generic queue: removed %p from %p\n", datum, g);
+#endif
+
+  return datum;
 }
 
-void *get_precedence_head_gueue_katcl(struct katcl_gueue *g, unsigned int precedence)
+/* the lane holding the oldest entry with at least the given precedence, NULL if none */
+static struct katcl_gueue_lane *oldest_lane_gueue_katcl(struct katcl_gueue *g, unsigned int precedence)
 {
-  unsigned int value, i, j;
+  struct katcl_gueue_lane *l, *best;
+  unsigned int i;
 
   if(g->g_precedence == NULL){
-#ifdef DEBUG
-    fprintf(stderr, "generic queue: get request with no precedence calculation\n");
-#endif
-    return get_head_gueue_katcl(g);
+    /* without a precedence everything lives in the first lane */
+    return g->g_lanes[0].l_count ? &(g->g_lanes[0]) : NULL;
   }
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if((g->g_count == 0) || (g->g_size == 0) || (g->g_count > g->g_size)){
-#ifdef DEBUG
-    fprintf(stderr, "generic queue: reasonability test on get failed (count=%u, size=%u)\n", g->g_count, g->g_size);
-#endif
-    return NULL;
-  }
-#endif
+  best = NULL;
 
-  for(j = 0; j < g->g_count; j++){
-    i = (g->g_head + j) % g->g_size;
-    value =  (*(g->g_precedence))(g->g_queue[i]);
-#ifdef DEBUG
-    fprintf(stderr, "generic queue: %p->%u, looking for at least %u\n", g->g_queue[i], value, precedence);
-#endif
-    if(value >= precedence){
-      return g->g_queue[i];
+  for(i = precedence; i < KATCL_GUEUE_LANES; i++){
+    l = &(g->g_lanes[i]);
+    if(l->l_count > 0){
+      if((best == NULL) || (l->l_slots[l->l_head].s_order < best->l_slots[best->l_head].s_order)){
+        best = l;
+      }
     }
   }
 
-#ifdef DEBUG
-  fprintf(stderr, "generic queue: no match found, need precedence %u, searched %u\n", precedence, g->g_count);
-#endif
-
-  return NULL;
+  return best;
 }
 
-/*************************************************************************/
-
-static void *remove_index_gueue_katcl(struct katcl_gueue *g, unsigned int index)
+/* merge the lanes in insertion order to find the entry at a position */
+static struct katcl_gueue_lane *position_lane_gueue_katcl(struct katcl_gueue *g, unsigned int position, unsigned int *offset)
 {
-  unsigned int end;
-  void *datum;
+  unsigned int cursor[KATCL_GUEUE_LANES];
+  struct katcl_gueue_lane *l, *best;
+  unsigned int i, j, pick;
 
-  if(g->g_count <= 0){
-#ifdef DEBUG
-    fprintf(stderr, "generic queue: nothing to remove\n");
-#endif
+  if(position >= g->g_count){
     return NULL;
   }
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if(index >= g->g_size){
-    fprintf(stderr, "generic queue: index %u out of range %u\n", index, g->g_size);
-    abort();
+  for(i = 0; i < KATCL_GUEUE_LANES; i++){
+    cursor[i] = 0;
   }
-  if(g->g_queue[index] == NULL){
-    fprintf(stderr, "generic queue: index %u (head=%u,count=%u) already null\n", index, g->g_head, g->g_count);
-    abort();
-  }
-#endif
 
-#if DEBUG
-  fprintf(stderr, "generic queue: del[%u]=%p\n", index, g->g_queue[index]);
-#endif
+  for(j = 0; ; j++){
+    best = NULL;
+    pick = 0;
+    for(i = 0; i < KATCL_GUEUE_LANES; i++){
+      l = &(g->g_lanes[i]);
+      if(cursor[i] < l->l_count){
+        if((best == NULL) || (l->l_slots[(l->l_head + cursor[i]) & l->l_mask].s_order < best->l_slots[(best->l_head + cursor[pick]) & best->l_mask].s_order)){
+          best = l;
+          pick = i;
+        }
+      }
+    }
+    if(j == position){
+      *offset = cursor[pick];
+      return best;
+    }
+    cursor[pick]++;
+  }
 
-  datum = g->g_queue[index];
-  g->g_queue[index] = NULL;
+  /* NOT REACHED */
+  return NULL;
+}
 
-  if(index == g->g_head){
-    /* hopefully the common, simple case - remove from head */
-    g->g_head = (g->g_head + 1) % g->g_size;
-    g->g_count--;
+/* logic to manage the queue ****************************************************/
 
-#if DEBUG 
-    fprintf(stderr, "generic gueue: removed %p from %p\n", datum, g);
-#endif
+int add_tail_gueue_katcl(struct katcl_gueue *g, void *datum)
+{
+  struct katcl_gueue_lane *l;
+  unsigned int lane;
+  void *victim;
 
-    return datum;
+  if(datum == NULL){
+    return -1;
   }
 
-  if(index > g->g_head){ /* index ahead of head, move head toward index */
-    memmove(&(g->g_queue[g->g_head + 1]), &(g->g_queue[g->g_head]), (index - g->g_head) * sizeof(void *));
-    g->g_queue[g->g_head] = NULL;
-    g->g_head = (g->g_head + 1) % g->g_size;
-    g->g_count--;
-#if DEBUG 
-    fprintf(stderr, "generic queue: removed %p from %p, head advanced to %u\n", datum, g, g->g_head);
+#if DEBUG > 1
+  fprintf(stderr, "generic queue: adding %p with queue %p of size %d\n", datum, g, g->g_count);
 #endif
-    return datum; /* WARNING: done here */
-  }
 
-  /* else index < g->g_head, move tail back */
+  if(full_gueue_katcl(g)){
+    if(g->g_policy != KATCL_GUEUE_EVICT){
+      /* backpressure: the caller retains the datum */
+      g->g_refused++;
+      return -1;
+    }
 
-  /* now move back end by one, to overwrite position at index */
-  end = (g->g_head + g->g_count - 1) % g->g_size; /* WARNING: relies on count+head never being zero, hence earlier test */
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if(index > end){
-    fprintf(stderr, "generic queue: logic problem: attempting to remove %u, queue only valid from head=%u to head+count=%u+%u-1=%u", index, g->g_head, g->g_head, g->g_count, end);
-    abort();
+    /* make space by discarding the oldest entry of the lowest precedence */
+    for(lane = 0; g->g_lanes[lane].l_count == 0; lane++);
+    victim = remove_index_lane_gueue_katcl(g, &(g->g_lanes[lane]), 0);
+    if(g->g_release){
+      (*(g->g_release))(victim);
+    }
+    g->g_evicted++;
   }
-#endif
 
-  if(index < end){
-    memmove(&(g->g_queue[index]), &(g->g_queue[index + 1]), (end - index) * sizeof(void *));
-  } /* else index is end, no copy needed  */
+  lane = g->g_precedence ? (*(g->g_precedence))(datum) : 0;
+  if(lane >= KATCL_GUEUE_LANES){
+    lane = KATCL_GUEUE_LANES - 1;
+  }
 
-  fprintf(stderr, "generic queue: removed %p from %p, tail reduced from %u\n", datum, g, end);
+  l = &(g->g_lanes[lane]);
 
-  g->g_queue[end] = NULL;
-  g->g_count--;
+  if((l->l_mask == 0) || (l->l_count > l->l_mask)){
+    if(grow_lane_gueue_katcl(l) < 0){
+      return -1;
+    }
+  }
 
-#if DEBUG > 1
-  fprintf(stderr, "generic queue: removed %p from %p\n", datum, g);
-#endif
+  l->l_slots[(l->l_head + l->l_count) & l->l_mask].s_datum = datum;
+  l->l_slots[(l->l_head + l->l_count) & l->l_mask].s_order = g->g_order++;
+  l->l_count++;
 
-  return datum;
+  g->g_count++;
+  g->g_added++;
+  if(g->g_count > g->g_high){
+    g->g_high = g->g_count;
+  }
+
+  return 0;
 }
 
-void *remove_from_head_gueue_katcl(struct katcl_gueue *g, unsigned int position)
+/*************************************************************************/
+
+void *get_from_head_gueue_katcl(struct katcl_gueue *g, unsigned int position)
 {
-  unsigned int index;
+  struct katcl_gueue_lane *l;
+  unsigned int offset;
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if((g->g_count == 0) || (g->g_size == 0) || (g->g_count > g->g_size)){
+  l = position_lane_gueue_katcl(g, position, &offset);
+  if(l == NULL){
     return NULL;
   }
+
+  return l->l_slots[(l->l_head + offset) & l->l_mask].s_datum;
+}
+
+void *get_head_gueue_katcl(struct katcl_gueue *g)
+{
+  struct katcl_gueue_lane *l;
+
+  l = oldest_lane_gueue_katcl(g, 0);
+
+  return l ? l->l_slots[l->l_head].s_datum : NULL;
+}
+
+void *get_precedence_head_gueue_katcl(struct katcl_gueue *g, unsigned int precedence)
+{
+  struct katcl_gueue_lane *l;
+  unsigned int j;
+  void *datum;
+
+  if(g->g_precedence == NULL){
+#ifdef DEBUG
+    fprintf(stderr, "generic queue: get request with no precedence calculation\n");
 #endif
+    return get_head_gueue_katcl(g);
+  }
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if(g->g_size < g->g_count){
-    fprintf(stderr, "generic queue: more elements %u than slots %u\n", g->g_count, g->g_size);
-    abort();
+  if(precedence < (KATCL_GUEUE_LANES - 1)){
+    l = oldest_lane_gueue_katcl(g, precedence);
+    return l ? l->l_slots[l->l_head].s_datum : NULL;
   }
-#endif
 
-  if(position >= g->g_count){
-    return NULL;
+  /* the last lane is shared by all larger values, so check each entry */
+  l = &(g->g_lanes[KATCL_GUEUE_LANES - 1]);
+  for(j = 0; j < l->l_count; j++){
+    datum = l->l_slots[(l->l_head + j) & l->l_mask].s_datum;
+    if((*(g->g_precedence))(datum) >= precedence){
+      return datum;
+    }
   }
 
 #ifdef DEBUG
-  fprintf(stderr, "generic queue: removing position %u from head (used=%u/size=%u)\n", position, g->g_count, g->g_size);
+  fprintf(stderr, "generic queue: no match found, need precedence %u, searched %u\n", precedence, l->l_count);
 #endif
 
-  index = (g->g_head + position) % g->g_size;
-
-  return remove_index_gueue_katcl(g, index);
+  return NULL;
 }
 
-void *remove_datum_gueue_katcl(struct katcl_gueue *g, void *datum)
+/*************************************************************************/
+
+void *remove_from_head_gueue_katcl(struct katcl_gueue *g, unsigned int position)
 {
-  unsigned int i, j;
+  struct katcl_gueue_lane *l;
+  unsigned int offset;
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if((g->g_count == 0) || (g->g_size == 0) || (g->g_count > g->g_size)){
+  l = position_lane_gueue_katcl(g, position, &offset);
+  if(l == NULL){
     return NULL;
   }
+
+#ifdef DEBUG
+  fprintf(stderr, "generic queue: removing position %u from head (used=%u)\n", position, g->g_count);
 #endif
 
-  for(j = 0; j < g->g_count; j++){
-    i = (g->g_head + j) % g->g_size;
-    if(g->g_queue[i] == datum){
-      break;
+  return remove_index_lane_gueue_katcl(g, l, offset);
+}
+
+void *remove_datum_gueue_katcl(struct katcl_gueue *g, void *datum)
+{
+  struct katcl_gueue_lane *l;
+  unsigned int i, j;
+
+  /* usually the datum was just found at the head of a lane */
+  for(i = 0; i < KATCL_GUEUE_LANES; i++){
+    l = &(g->g_lanes[i]);
+    if((l->l_count > 0) && (l->l_slots[l->l_head].s_datum == datum)){
+      return remove_index_lane_gueue_katcl(g, l, 0);
     }
   }
 
-  if(j >= g->g_count){
-    return NULL;
+  for(i = 0; i < KATCL_GUEUE_LANES; i++){
+    l = &(g->g_lanes[i]);
+    for(j = 1; j < l->l_count; j++){
+      if(l->l_slots[(l->l_head + j) & l->l_mask].s_datum == datum){
+        return remove_index_lane_gueue_katcl(g, l, j);
+      }
+    }
   }
 
-#ifdef DEBUG
-  fprintf(stderr, "generic queue: removing position %u from head (used=%u/size=%u)\n", i, g->g_count, g->g_size);
-#endif
-
-  return remove_index_gueue_katcl(g, i);
+  return NULL;
 }
 
 void *remove_head_gueue_katcl(struct katcl_gueue *g)
 {
-  return remove_index_gueue_katcl(g, g->g_head);
+  struct katcl_gueue_lane *l;
+
+  l = oldest_lane_gueue_katcl(g, 0);
+  if(l == NULL){
+#ifdef DEBUG
+    fprintf(stderr, "generic queue: nothing to remove\n");
+#endif
+    return NULL;
+  }
+
+  return remove_index_lane_gueue_katcl(g, l, 0);
 }
 
 /**************************************************************************************/
@@ -395,34 +513,52 @@ unsigned int size_gueue_katcl(struct katcl_gueue *g)
 #if defined(DEBUG) || defined(UNIT_TEST_GENERIC_QUEUE)
 void dump_gueue(struct katcl_gueue *g, FILE *fp)
 {
-  unsigned int i, k;
+  struct katcl_gueue_lane *l;
+  unsigned int i, j, k, total;
 
-  fprintf(fp, "generic queue %p (%d):", g, g->g_size);
-  for(i = 0; i < g->g_size; i++){
-    if(g->g_queue[i]){
-      fprintf(fp, " <%p>", g->g_queue[i]);
-    } else {
-      fprintf(fp, " [%d]", i);
-    }
-  }
-  fprintf(fp, "\n");
+  total = 0;
 
-  for(k = g->g_head, i = 0; i < g->g_count; i++, k = (k + 1) % g->g_size){
-    if(g->g_queue[k] == NULL){
-      fprintf(stderr, "generic gueue: error: null field at %d\n", k);
-      abort();
+  for(i = 0; i < KATCL_GUEUE_LANES; i++){
+    l = &(g->g_lanes[i]);
+    if(l->l_mask == 0){
+      continue;
     }
-  }
 
-  while(i < g->g_size){
+    fprintf(fp, "generic queue %p lane %u (%u/%u):", g, i, l->l_count, l->l_mask + 1);
+    for(j = 0; j <= l->l_mask; j++){
+      if(l->l_slots[j].s_datum){
+        fprintf(fp, " <%p>", l->l_slots[j].s_datum);
+      } else {
+        fprintf(fp, " [%u]", j);
+      }
+    }
+    fprintf(fp, "\n");
 
-    if(g->g_queue[k] != NULL){
-      fprintf(stderr, "generic gueue: error: used field at %d\n", k);
-      abort();
+    for(j = 0; j <= l->l_mask; j++){
+      k = (l->l_head + j) & l->l_mask;
+      if(j < l->l_count){
+        if(l->l_slots[k].s_datum == NULL){
+          fprintf(stderr, "generic gueue: error: null field at %u in lane %u\n", k, i);
+          abort();
+        }
+        if((j > 0) && (l->l_slots[(k - 1) & l->l_mask].s_order >= l->l_slots[k].s_order)){
+          fprintf(stderr, "generic gueue: error: order not increasing at %u in lane %u\n", k, i);
+          abort();
+        }
+      } else {
+        if(l->l_slots[k].s_datum != NULL){
+          fprintf(stderr, "generic gueue: error: used field at %u in lane %u\n", k, i);
+          abort();
+        }
+      }
     }
 
-    k = (k + 1) % g->g_size;
-    i++;
+    total += l->l_count;
+  }
+
+  if(total != g->g_count){
+    fprintf(stderr, "generic gueue: error: lanes hold %u entries, expected %u\n", total, g->g_count);
+    abort();
   }
 }
 
@@ -440,11 +576,17 @@ void dump_gueue(struct katcl_gueue *g, FILE *fp)
 #define CHANCE_HEAD_REMOVE    3
 #define CHANCE_POS_REMOVE     7
 
+static unsigned int test_precedence(void *datum)
+{
+  return (*((unsigned int *)datum)) & 0x1;
+}
+
 int main(int argc, char **argv)
 {
   struct katcl_gueue *g;
   unsigned int *a, *b;
-  unsigned int insert, remove, margin, arb, distance, seed;
+  unsigned int insert, remove, margin, arb, distance, seed, high;
+  unsigned long added, refused, evicted;
   int i, k, r;
 
   g = create_gueue_katcl(free);
@@ -530,6 +672,90 @@ int main(int argc, char **argv)
     dump_gueue(g, stderr);
   }
 
+  destroy_gueue_katcl(g);
+
+  /* lanes: odd entries are urgent, but a plain removal still sees insertion order */
+
+  g = create_precedence_gueue_katcl(free, &test_precedence);
+  if(g == NULL){
+    return 1;
+  }
+
+  for(i = 0; i < 100; i++){
+    a = malloc(sizeof(unsigned int));
+    if(a == NULL){
+      return 1;
+    }
+    *a = i;
+    add_tail_gueue_katcl(g, a);
+  }
+  dump_gueue(g, stderr);
+
+  b = get_precedence_head_gueue_katcl(g, 1);
+  if((b == NULL) || (*b != 1)){
+    fprintf(stderr, "test: implementation problem: expected first urgent entry\n");
+    abort();
+  }
+  free(remove_datum_gueue_katcl(g, b));
+
+  b = get_from_head_gueue_katcl(g, 1);
+  if((b == NULL) || (*b != 2)){
+    fprintf(stderr, "test: implementation problem: expected 2 at position 1 of merged lanes\n");
+    abort();
+  }
+
+  for(k = 0; k < 100; k++){
+    if(k == 1){
+      continue;
+    }
+    b = remove_head_gueue_katcl(g);
+    if((b == NULL) || (*b != k)){
+      fprintf(stderr, "test: implementation problem: expected %d from merged lanes\n", k);
+      abort();
+    }
+    free(b);
+  }
+  dump_gueue(g, stderr);
+
+  /* bounded: refuse, then evict the oldest of the lowest lane */
+
+  limit_gueue_katcl(g, 4, KATCL_GUEUE_REFUSE);
+  for(i = 0; i < 5; i++){
+    a = malloc(sizeof(unsigned int));
+    if(a == NULL){
+      return 1;
+    }
+    *a = i;
+    if(add_tail_gueue_katcl(g, a)){
+      if(i < 4){
+        fprintf(stderr, "test: implementation problem: refused entry %d below capacity\n", i);
+        abort();
+      }
+      free(a);
+    }
+  }
+
+  limit_gueue_katcl(g, 4, KATCL_GUEUE_EVICT);
+  a = malloc(sizeof(unsigned int));
+  if(a == NULL){
+    return 1;
+  }
+  *a = 5;
+  add_tail_gueue_katcl(g, a);
+
+  b = get_head_gueue_katcl(g);
+  if((size_gueue_katcl(g) != 4) || (b == NULL) || (*b != 1)){
+    fprintf(stderr, "test: implementation problem: eviction should have removed entry 0\n");
+    abort();
+  }
+  dump_gueue(g, stderr);
+
+  stats_gueue_katcl(g, &high, &added, &refused, &evicted);
+  if((high != 100) || (added != 105) || (refused != 1) || (evicted != 1)){
+    fprintf(stderr, "test: implementation problem: statistics high=%u added=%lu refused=%lu evicted=%lu\n", high, added, refused, evicted);
+    abort();
+  }
+
   destroy_gueue_katcl(g);
   
   fprintf(stderr, "test: done\n");
@@ -537,3 +763,103 @@ int main(int argc, char **argv)
   return 0;
 }
 #endif
+
+#ifdef KATCP_BENCHMARK_GUEUE
+
+#include <sys/time.h>
+
+#define BENCH_OPS        4000000
+#define BENCH_DEPTH           64
+#define BENCH_BURST        20000
+#define BENCH_BACKLOG       1000
+#define BENCH_URGENT      200000
+
+static unsigned int bench_precedence(void *datum)
+{
+  return (*((unsigned int *)datum)) & 0x1;
+}
+
+static double bench_elapsed(struct timeval *ts)
+{
+  struct timeval te;
+
+  gettimeofday(&te, NULL);
+
+  return ((te.tv_sec - ts->tv_sec) * 1000000.0) + (te.tv_usec - ts->tv_usec);
+}
+
+int main(int argc, char **argv)
+{
+  struct katcl_gueue *g;
+  struct timeval ts;
+  unsigned int *items, i, j;
+  void *datum;
+  double us;
+
+  items = malloc(sizeof(unsigned int) * BENCH_BURST);
+  if(items == NULL){
+    return 1;
+  }
+  for(i = 0; i < BENCH_BURST; i++){
+    items[i] = i;
+  }
+
+  /* steady state: a shallow queue which is filled and drained continuously */
+
+  g = create_gueue_katcl(NULL);
+  for(i = 0; i < BENCH_DEPTH; i++){
+    add_tail_gueue_katcl(g, &(items[i]));
+  }
+  gettimeofday(&ts, NULL);
+  for(i = 0; i < BENCH_OPS; i++){
+    datum = remove_head_gueue_katcl(g);
+    if(add_tail_gueue_katcl(g, datum)){
+      fprintf(stderr, "bench: add failed\n");
+      return 1;
+    }
+  }
+  us = bench_elapsed(&ts);
+  printf("bench: steady fifo depth %d, %.1fns per add+remove\n", BENCH_DEPTH, us * 1000.0 / BENCH_OPS);
+  destroy_gueue_katcl(g);
+
+  /* bursts: grow from empty to a deep queue, then drain it */
+
+  g = create_gueue_katcl(NULL);
+  gettimeofday(&ts, NULL);
+  for(j = 0; j < (BENCH_OPS / BENCH_BURST); j++){
+    for(i = 0; i < BENCH_BURST; i++){
+      add_tail_gueue_katcl(g, &(items[i]));
+    }
+    for(i = 0; i < BENCH_BURST; i++){
+      remove_head_gueue_katcl(g);
+    }
+  }
+  us = bench_elapsed(&ts);
+  printf("bench: bursts of %d, %.1fns per add+remove\n", BENCH_BURST, us * 1000.0 / ((BENCH_OPS / BENCH_BURST) * BENCH_BURST));
+  destroy_gueue_katcl(g);
+
+  /* urgent entries overtaking a backlog, as endpoints do with replies while a request is paused */
+
+  g = create_precedence_gueue_katcl(NULL, &bench_precedence);
+  for(i = 0; i < BENCH_BACKLOG; i++){
+    add_tail_gueue_katcl(g, &(items[i * 2]));
+  }
+  gettimeofday(&ts, NULL);
+  for(i = 0; i < BENCH_URGENT; i++){
+    add_tail_gueue_katcl(g, &(items[1]));
+    datum = get_precedence_head_gueue_katcl(g, 1);
+    if((datum == NULL) || (remove_datum_gueue_katcl(g, datum) == NULL)){
+      fprintf(stderr, "bench: unable to find urgent entry\n");
+      return 1;
+    }
+  }
+  us = bench_elapsed(&ts);
+  printf("bench: urgent past backlog of %d, %.1fns per add+find+remove\n", BENCH_BACKLOG, us * 1000.0 / BENCH_URGENT);
+  destroy_gueue_katcl(g);
+
+  free(items);
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,1292 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* persistence for the dbase: every ?set and ?dict is appended to a
+ * binary journal, which gets folded into a snapshot once it grows.
+ * Writes are buffered and committed as a group from the notice pass
+ * of the main loop, requests wait for the commit before replying.
+ * The change is already applied by then, so a failed commit is logged
+ * and costs persistence, it does not fail the request
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "katcp.h"
+#include "katcl.h"
+#include "katpriv.h"
+#include "avltree.h"
+#include "bptree.h"
+
+#define JOURNAL_FILE_MAGIC    0x4b4a4e4c
+#define JOURNAL_FILE_VERSION  1
+#define JOURNAL_RECORD_MAGIC  0x4b4a5231
+
+#define JOURNAL_HEADER        8
+#define JOURNAL_RECORD       12
+
+#define JOURNAL_BUFFER     4096
+#define JOURNAL_LIMIT     10000
+
+#define JOURNAL_NAME      "journal"
+#define JOURNAL_SNAPSHOT  "snapshot"
+#define JOURNAL_TEMPORARY "snapshot.tmp"
+
+#define JOURNAL_TAG_RECORD "#tag"
+
+/* encoding helpers *************************************************/
+
+static unsigned int journal_crc_table[256];
+static int journal_crc_ready = 0;
+
+static unsigned int crc_journal_katcp(unsigned char *buffer, unsigned int len)
+{
+  unsigned int i, j, c;
+
+  if(journal_crc_ready == 0){
+    for(i = 0; i < 256; i++){
+      c = i;
+      for(j = 0; j < 8; j++){
+        c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+      }
+      journal_crc_table[i] = c;
+    }
+    journal_crc_ready = 1;
+  }
+
+  c = 0xffffffff;
+  for(i = 0; i < len; i++){
+    c = journal_crc_table[(c ^ buffer[i]) & 0xff] ^ (c >> 8);
+  }
+
+  return c ^ 0xffffffff;
+}
+
+static void put_journal_katcp(unsigned char *buffer, unsigned int value)
+{
+  buffer[0] = value & 0xff;
+  buffer[1] = (value >> 8) & 0xff;
+  buffer[2] = (value >> 16) & 0xff;
+  buffer[3] = (value >> 24) & 0xff;
+}
+
+static unsigned int get_journal_katcp(unsigned char *buffer)
+{
+  return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((unsigned int)buffer[3] << 24);
+}
+
+static int reserve_journal_katcp(struct katcp_journal *j, unsigned int extra)
+{
+  unsigned char *ptr;
+  unsigned int size;
+
+  if((j->j_used + extra) <= j->j_size){
+    return 0;
+  }
+
+  size = (j->j_size > 0) ? j->j_size : JOURNAL_BUFFER;
+  while(size < (j->j_used + extra)){
+    size *= 2;
+  }
+
+  ptr = realloc(j->j_buffer, size);
+  if(ptr == NULL){
+    return -1;
+  }
+
+  j->j_buffer = ptr;
+  j->j_size = size;
+
+  return 0;
+}
+
+/* appends all fields of p to the pending buffer as one record */
+static int encode_journal_katcp(struct katcp_journal *j, struct katcl_parse *p)
+{
+  unsigned int i, count, len, total, start;
+  unsigned char *ptr;
+
+  count = get_count_parse_katcl(p);
+  if(count == 0){
+    return -1;
+  }
+
+  total = 4;
+  for(i = 0; i < count; i++){
+    total += 4 + get_buffer_parse_katcl(p, i, NULL, 0);
+  }
+
+  if(reserve_journal_katcp(j, JOURNAL_RECORD + total) < 0){
+    return -1;
+  }
+
+  start = j->j_used;
+  ptr = j->j_buffer + start + JOURNAL_RECORD;
+
+  put_journal_katcp(ptr, count);
+  ptr += 4;
+
+  for(i = 0; i < count; i++){
+    len = get_buffer_parse_katcl(p, i, NULL, 0);
+    put_journal_katcp(ptr, len);
+    ptr += 4;
+    if(len > 0){
+      get_buffer_parse_katcl(p, i, ptr, len);
+      ptr += len;
+    }
+  }
+
+  ptr = j->j_buffer + start;
+  put_journal_katcp(ptr, JOURNAL_RECORD_MAGIC);
+  put_journal_katcp(ptr + 4, total);
+  put_journal_katcp(ptr + 8, crc_journal_katcp(ptr + JOURNAL_RECORD, total));
+
+  j->j_used += JOURNAL_RECORD + total;
+
+  return 0;
+}
+
+static int write_all_journal_katcp(int fd, unsigned char *buffer, unsigned int len)
+{
+  unsigned int done;
+  int wr;
+
+  done = 0;
+  while(done < len){
+    wr = write(fd, buffer + done, len - done);
+    if(wr < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      return -1;
+    }
+    done += wr;
+  }
+
+  return 0;
+}
+
+static int write_header_journal_katcp(int fd)
+{
+  unsigned char header[JOURNAL_HEADER];
+
+  put_journal_katcp(header, JOURNAL_FILE_MAGIC);
+  put_journal_katcp(header + 4, JOURNAL_FILE_VERSION);
+
+  return write_all_journal_katcp(fd, header, JOURNAL_HEADER);
+}
+
+/* replay ***********************************************************/
+
+static int apply_tag_journal_katcp(struct katcp_dispatch *d, struct katcl_parse *p)
+{
+  struct katcp_type *tagtype, *dbtype;
+  struct katcp_tag *t;
+  struct katcp_dbase *db;
+  char *name, *key;
+  unsigned int i, count;
+
+  tagtype = find_name_type_katcp(d, KATCP_TYPE_TAG);
+  dbtype  = find_name_type_katcp(d, KATCP_TYPE_DBASE);
+  if((tagtype == NULL) || (dbtype == NULL)){
+    return -1;
+  }
+
+  name = get_string_parse_katcl(p, 1);
+  if(name == NULL){
+    return -1;
+  }
+
+  t = search_type_katcp(d, tagtype, name, NULL);
+  if(t == NULL){
+    t = search_type_katcp(d, tagtype, name, create_tag_katcp(name, 0));
+    if(t == NULL){
+      return -1;
+    }
+  }
+
+  count = get_count_parse_katcl(p);
+  for(i = 2; i < count; i++){
+    key = get_string_parse_katcl(p, i);
+    if(key == NULL){
+      continue;
+    }
+    db = search_type_katcp(d, dbtype, key, NULL);
+    if(db == NULL){
+      continue;
+    }
+    if(db->d_id < 0){
+      db->d_id = acquire_index_katcp(d, db, dbtype);
+    }
+    tag_member_katcp(d, t, db->d_id);
+  }
+
+  return 0;
+}
+
+static int apply_journal_katcp(struct katcp_dispatch *d, unsigned char *buffer, unsigned int len)
+{
+  struct katcl_parse *p;
+  unsigned int i, count, field, done;
+  char *name;
+  int result;
+
+  if(len < 4){
+    return -1;
+  }
+
+  count = get_journal_katcp(buffer);
+  done = 4;
+
+  p = create_parse_katcl();
+  if(p == NULL){
+    return -1;
+  }
+
+  for(i = 0; i < count; i++){
+    if((done + 4) > len){
+      destroy_parse_katcl(p);
+      return -1;
+    }
+    field = get_journal_katcp(buffer + done);
+    done += 4;
+    if((done + field) > len){
+      destroy_parse_katcl(p);
+      return -1;
+    }
+    if(add_buffer_parse_katcl(p, ((i == 0) ? KATCP_FLAG_FIRST : 0) | ((i + 1 == count) ? KATCP_FLAG_LAST : 0), buffer + done, field) < 0){
+      destroy_parse_katcl(p);
+      return -1;
+    }
+    done += field;
+  }
+
+  name = get_string_parse_katcl(p, 0);
+
+  if(name == NULL){
+    result = -1;
+  } else if(!strcmp(name, KATCP_SET_REQUEST)){
+    result = set_dbase_katcp(d, p);
+  } else if(!strcmp(name, KATCP_DICT_REQUEST)){
+    result = dict_katcp(d, p);
+  } else if(!strcmp(name, JOURNAL_TAG_RECORD)){
+    result = apply_tag_journal_katcp(d, p);
+  } else {
+    result = -1;
+  }
+
+  destroy_parse_katcl(p);
+
+  return result;
+}
+
+/* replays all intact records of a file, returns the offset just past the last one */
+static long load_journal_katcp(struct katcp_dispatch *d, struct katcp_journal *j, char *path)
+{
+  struct stat st;
+  unsigned char *buffer, *ptr;
+  unsigned int len, have;
+  long offset;
+  int fd, rr;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0){
+    if(errno == ENOENT){
+      return 0;
+    }
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to open %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  if(fstat(fd, &st) < 0){
+    close(fd);
+    return -1;
+  }
+
+  if(st.st_size < JOURNAL_HEADER){
+    close(fd);
+    return 0;
+  }
+
+  buffer = malloc(st.st_size);
+  if(buffer == NULL){
+    close(fd);
+    return -1;
+  }
+
+  /* one sequential read of the whole file */
+  have = 0;
+  while(have < st.st_size){
+    rr = read(fd, buffer + have, st.st_size - have);
+    if(rr <= 0){
+      if((rr < 0) && (errno == EINTR)){
+        continue;
+      }
+      break;
+    }
+    have += rr;
+  }
+
+  close(fd);
+
+  if((have < JOURNAL_HEADER) || (get_journal_katcp(buffer) != JOURNAL_FILE_MAGIC) || (get_journal_katcp(buffer + 4) != JOURNAL_FILE_VERSION)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "%s is not a journal of version %d", path, JOURNAL_FILE_VERSION);
+    free(buffer);
+    return -1;
+  }
+
+  offset = JOURNAL_HEADER;
+
+  while((offset + JOURNAL_RECORD) <= have){
+    ptr = buffer + offset;
+
+    if(get_journal_katcp(ptr) != JOURNAL_RECORD_MAGIC){
+      break;
+    }
+
+    len = get_journal_katcp(ptr + 4);
+    if((len > (have - offset - JOURNAL_RECORD)) || (crc_journal_katcp(ptr + JOURNAL_RECORD, len) != get_journal_katcp(ptr + 8))){
+      break;
+    }
+
+    if(apply_journal_katcp(d, ptr + JOURNAL_RECORD, len) < 0){
+      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to apply record at offset %ld of %s", offset, path);
+    } else {
+      j->j_loaded++;
+    }
+
+    offset += JOURNAL_RECORD + len;
+  }
+
+  if(offset < have){
+    j->j_torn += have - offset;
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "discarding %ld bytes of incomplete records at the end of %s", have - offset, path);
+  }
+
+  free(buffer);
+
+  return offset;
+}
+
+/* snapshot *********************************************************/
+
+static char *path_journal_katcp(struct katcp_journal *j, char *name)
+{
+  char *path;
+  int len;
+
+  len = strlen(j->j_path) + strlen(name) + 2;
+
+  path = malloc(len);
+  if(path == NULL){
+    return NULL;
+  }
+
+  snprintf(path, len, "%s/%s", j->j_path, name);
+
+  return path;
+}
+
+static void snapshot_dbase_journal_katcp(struct katcp_dispatch *d, char *key, void *data)
+{
+  struct katcp_journal *j;
+  struct katcp_dbase *db;
+  struct katcp_type *stringtype;
+  struct katcp_tobject *o;
+  struct katcl_parse *p;
+  int i, count;
+
+  j = d->d_shared->s_journal;
+  db = data;
+  if((j == NULL) || (db == NULL)){
+    return;
+  }
+
+  stringtype = find_name_type_katcp(d, KATCP_TYPE_STRING);
+
+  p = create_parse_katcl();
+  if(p == NULL){
+    j->j_error = -1;
+    return;
+  }
+
+  /* only string values can be written back as a ?set */
+  count = 0;
+  for(i = 0; i < sizeof_stack_katcp(db->d_values); i++){
+    o = index_stack_katcp(db->d_values, i);
+    if((o != NULL) && (o->o_type == stringtype)){
+      count++;
+    }
+  }
+
+  add_string_parse_katcl(p, KATCP_FLAG_FIRST, KATCP_SET_REQUEST);
+  add_string_parse_katcl(p, (count > 0 || db->d_schema) ? 0 : KATCP_FLAG_LAST, db->d_key);
+  if(db->d_schema){
+    add_string_parse_katcl(p, 0, "schema");
+    add_string_parse_katcl(p, (count > 0) ? 0 : KATCP_FLAG_LAST, db->d_schema);
+  }
+
+  for(i = 0; count > 0; i++){
+    o = index_stack_katcp(db->d_values, i);
+    if((o == NULL) || (o->o_type != stringtype)){
+      continue;
+    }
+    count--;
+    add_string_parse_katcl(p, (count == 0) ? KATCP_FLAG_LAST : 0, o->o_data);
+  }
+
+  if(encode_journal_katcp(j, p) < 0){
+    j->j_error = -1;
+  }
+
+  destroy_parse_katcl(p);
+}
+
+static void snapshot_dict_journal_katcp(struct katcp_dispatch *d, char *key, void *data)
+{
+  struct katcp_journal *j;
+  struct katcp_dict *dt;
+  struct katcl_parse *p;
+  struct katcp_tobject *o;
+  struct bpt_cursor c;
+  struct bpt_node *n;
+  char *buffer, *ptr;
+  int len, have, used;
+
+  j = d->d_shared->s_journal;
+  dt = data;
+  if((j == NULL) || (dt == NULL) || (dt->d_tree == NULL)){
+    return;
+  }
+
+  /* rebuild the {key:value,...} form understood by the dict parser */
+  have = 64;
+  used = 0;
+  buffer = malloc(have);
+
+  for(n = first_bptree(dt->d_tree, &c); (buffer != NULL) && (n != NULL); n = next_bptree(&c)){
+    o = n->n_data;
+
+    if((o != NULL) && (o->o_data != NULL)){
+      len = strlen(n->n_key) + strlen(o->o_data) + 3;
+      if((used + len) >= have){
+        have = (have + len) * 2;
+        ptr = realloc(buffer, have);
+        if(ptr == NULL){
+          free(buffer);
+          buffer = NULL;
+          break;
+        }
+        buffer = ptr;
+      }
+      used += snprintf(buffer + used, have - used, "%c%s:%s", used ? ',' : '{', n->n_key, (char *)(o->o_data));
+    }
+  }
+
+  if(buffer == NULL){
+    j->j_error = -1;
+    return;
+  }
+
+  if(used == 0){
+    free(buffer);
+    return;
+  }
+
+  buffer[used++] = '}';
+
+  p = create_parse_katcl();
+  if(p){
+    add_string_parse_katcl(p, KATCP_FLAG_FIRST, KATCP_DICT_REQUEST);
+    add_string_parse_katcl(p, 0, dt->d_key);
+    add_buffer_parse_katcl(p, KATCP_FLAG_LAST, buffer, used);
+    if(encode_journal_katcp(j, p) < 0){
+      j->j_error = -1;
+    }
+    destroy_parse_katcl(p);
+  } else {
+    j->j_error = -1;
+  }
+
+  free(buffer);
+}
+
+struct journal_tag_walk {
+  struct katcp_dispatch *w_dispatch;
+  struct katcp_type *w_type;
+  struct katcl_parse *w_parse;
+  unsigned int w_count;
+};
+
+static int member_tag_journal_katcp(unsigned int id, void *data)
+{
+  struct journal_tag_walk *w;
+  struct katcp_tobject *o;
+  struct katcp_dbase *db;
+
+  w = data;
+
+  o = member_index_katcp(w->w_dispatch, id);
+  if((o == NULL) || (o->o_type != w->w_type)){
+    return 0;
+  }
+
+  db = o->o_data;
+  add_string_parse_katcl(w->w_parse, 0, db->d_key);
+  w->w_count++;
+
+  return 0;
+}
+
+static void snapshot_tag_journal_katcp(struct katcp_dispatch *d, char *key, void *data)
+{
+  struct katcp_journal *j;
+  struct katcp_tag *t;
+  struct journal_tag_walk w;
+
+  j = d->d_shared->s_journal;
+  t = data;
+  if((j == NULL) || (t == NULL)){
+    return;
+  }
+
+  w.w_dispatch = d;
+  w.w_type = find_name_type_katcp(d, KATCP_TYPE_DBASE);
+  w.w_count = 0;
+  w.w_parse = create_parse_katcl();
+  if(w.w_parse == NULL){
+    j->j_error = -1;
+    return;
+  }
+
+  add_string_parse_katcl(w.w_parse, KATCP_FLAG_FIRST, JOURNAL_TAG_RECORD);
+  add_string_parse_katcl(w.w_parse, 0, t->t_name);
+
+  walk_bitmap_katcp(t->t_members, &member_tag_journal_katcp, &w);
+  /* an empty field terminates the parse, the walk can not tell which member is last */
+  add_buffer_parse_katcl(w.w_parse, KATCP_FLAG_LAST, NULL, 0);
+
+  /* only dbase members survive a restart, actors are runtime state */
+  if(w.w_count > 0){
+    if(encode_journal_katcp(j, w.w_parse) < 0){
+      j->j_error = -1;
+    }
+  }
+
+  destroy_parse_katcl(w.w_parse);
+}
+
+static void snapshot_type_journal_katcp(struct katcp_dispatch *d, char *name, void (*call)(struct katcp_dispatch *d, char *key, void *data))
+{
+  struct katcp_type *t;
+
+  t = find_name_type_katcp(d, name);
+  if((t == NULL) || (t->t_tree == NULL)){
+    return;
+  }
+
+  print_inorder_avltree(d, t->t_tree->t_root, call, 0);
+}
+
+static int flush_journal_katcp(struct katcp_dispatch *d, struct katcp_journal *j);
+
+int snapshot_journal_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_journal *j;
+  char *tmp, *final;
+  int fd, result;
+
+  j = d->d_shared ? d->d_shared->s_journal : NULL;
+  if(j == NULL){
+    return -1;
+  }
+
+  /* anything still buffered belongs to the old journal */
+  if(flush_journal_katcp(d, j) < 0){
+    return -1;
+  }
+
+  tmp = path_journal_katcp(j, JOURNAL_TEMPORARY);
+  final = path_journal_katcp(j, JOURNAL_SNAPSHOT);
+  if((tmp == NULL) || (final == NULL)){
+    if(tmp) free(tmp);
+    if(final) free(final);
+    return -1;
+  }
+
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+  if(fd < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create %s: %s", tmp, strerror(errno));
+    free(tmp);
+    free(final);
+    return -1;
+  }
+
+  /* build the whole snapshot in the (empty) pending buffer */
+  j->j_error = 0;
+  j->j_used = 0;
+
+  snapshot_type_journal_katcp(d, KATCP_TYPE_DICT, &snapshot_dict_journal_katcp);
+  snapshot_type_journal_katcp(d, KATCP_TYPE_DBASE, &snapshot_dbase_journal_katcp);
+  snapshot_type_journal_katcp(d, KATCP_TYPE_TAG, &snapshot_tag_journal_katcp);
+
+  /* j_error only collects failures while building this snapshot */
+  result = j->j_error;
+  j->j_error = 0;
+
+  if(result == 0){
+    if((write_header_journal_katcp(fd) < 0) || (write_all_journal_katcp(fd, j->j_buffer, j->j_used) < 0) || (fsync(fd) < 0)){
+      result = -1;
+    }
+  }
+
+  close(fd);
+  j->j_used = 0;
+
+  if(result == 0){
+    if(rename(tmp, final) < 0){
+      result = -1;
+    }
+  }
+
+  if(result < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to write snapshot %s: %s", final, strerror(errno));
+    unlink(tmp);
+    free(tmp);
+    free(final);
+    return -1;
+  }
+
+  /* the snapshot now holds everything, so start the journal over, appends follow the new end */
+  if((ftruncate(j->j_fd, JOURNAL_HEADER) < 0) || (fdatasync(j->j_fd) < 0)){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to truncate journal: %s", strerror(errno));
+  } else {
+    j->j_bytes = JOURNAL_HEADER;
+    j->j_records = 0;
+  }
+
+  j->j_snapshots++;
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "wrote snapshot %s", final);
+
+  free(tmp);
+  free(final);
+
+  return 0;
+}
+
+/* group commit *****************************************************/
+
+/* a failed commit may have left part of its records in the file, which would hide everything appended after them on reload */
+static int rewind_journal_katcp(struct katcp_dispatch *d, struct katcp_journal *j)
+{
+  if((ftruncate(j->j_fd, j->j_bytes) < 0) || (lseek(j->j_fd, j->j_bytes, SEEK_SET) < 0)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to cut journal back to %lu bytes: %s", j->j_bytes, strerror(errno));
+    j->j_dirty = 1;
+    return -1;
+  }
+
+  j->j_dirty = 0;
+
+  return 0;
+}
+
+static int flush_journal_katcp(struct katcp_dispatch *d, struct katcp_journal *j)
+{
+  int result;
+
+  if(j->j_used == 0){
+    return 0;
+  }
+
+  result = 0;
+
+  if(j->j_dirty && (rewind_journal_katcp(d, j) < 0)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "not committing %u journal records after a damaged tail", j->j_pending);
+    result = (-1);
+  } else if((write_all_journal_katcp(j->j_fd, j->j_buffer, j->j_used) < 0) || (fdatasync(j->j_fd) < 0)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to commit %u journal records: %s", j->j_pending, strerror(errno));
+    result = (-1);
+    rewind_journal_katcp(d, j);
+  } else {
+    j->j_bytes += j->j_used;
+    j->j_records += j->j_pending;
+    j->j_committed += j->j_pending;
+    j->j_commits++;
+    if(j->j_pending > j->j_batch){
+      j->j_batch = j->j_pending;
+    }
+  }
+
+  j->j_used = 0;
+  j->j_pending = 0;
+
+  return result;
+}
+
+static int commit_journal_katcp(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct katcp_journal *j;
+  int result;
+
+  j = data;
+
+  if(j->j_commit == n){
+    j->j_commit = NULL;
+  }
+
+  result = flush_journal_katcp(d, j);
+
+  if((result == 0) && (j->j_limit > 0) && (j->j_records >= j->j_limit)){
+    snapshot_journal_katcp(d);
+  }
+
+  return 0;
+}
+
+static int resume_journal_katcp(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct katcp_journal *j;
+
+  j = d->d_shared->s_journal;
+
+  /* whoever runs first in this notice pass does the write for everybody, a failure has been logged there */
+  if(j){
+    flush_journal_katcp(d, j);
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCP_OK);
+
+  resume_katcp(d);
+
+  return 0;
+}
+
+int record_journal_katcp(struct katcp_dispatch *d, struct katcl_parse *p)
+{
+  struct katcp_journal *j;
+  struct katcp_shared *s;
+  struct katcp_notice *n;
+
+  s = d->d_shared;
+  j = s ? s->s_journal : NULL;
+
+  if((j == NULL) || j->j_replay){
+    return 0;
+  }
+
+  if(encode_journal_katcp(j, p) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to journal %s request", get_string_parse_katcl(p, 0));
+    return -1;
+  }
+
+  j->j_pending++;
+
+  if(j->j_commit == NULL){
+    n = create_notice_katcp(d, NULL, 0);
+    if(n == NULL){
+      return flush_journal_katcp(d, j);
+    }
+    if(add_notice_katcp(s->s_template, n, &commit_journal_katcp, j) < 0){
+      return flush_journal_katcp(d, j);
+    }
+    j->j_commit = n;
+    wake_notice_katcp(d, n, NULL);
+  }
+
+  return 0;
+}
+
+int wait_journal_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_journal *j;
+
+  j = d->d_shared ? d->d_shared->s_journal : NULL;
+
+  if((j == NULL) || (j->j_commit == NULL)){
+    return KATCP_RESULT_OK;
+  }
+
+  if(add_notice_katcp(d, j->j_commit, &resume_journal_katcp, d) < 0){
+    flush_journal_katcp(d, j);
+    return KATCP_RESULT_OK;
+  }
+
+  return KATCP_RESULT_PAUSE;
+}
+
+/* setup ************************************************************/
+
+int open_journal_katcp(struct katcp_dispatch *d, char *path, unsigned int limit)
+{
+  struct katcp_shared *s;
+  struct katcp_journal *j;
+  char *name;
+  long offset;
+  unsigned int loaded;
+
+  sane_shared_katcp(d);
+
+  s = d->d_shared;
+  if(s == NULL){
+    return -1;
+  }
+
+  if(s->s_journal != NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "journal already open at %s", s->s_journal->j_path);
+    return -1;
+  }
+
+  if((mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP) < 0) && (errno != EEXIST)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create journal directory %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  j = malloc(sizeof(struct katcp_journal));
+  if(j == NULL){
+    return -1;
+  }
+
+  j->j_path = strdup(path);
+  j->j_fd = (-1);
+  j->j_buffer = NULL;
+  j->j_used = 0;
+  j->j_size = 0;
+  j->j_pending = 0;
+  j->j_bytes = 0;
+  j->j_records = 0;
+  j->j_limit = limit ? limit : JOURNAL_LIMIT;
+  j->j_replay = 1;
+  j->j_error = 0;
+  j->j_dirty = 0;
+  j->j_commit = NULL;
+  j->j_commits = 0;
+  j->j_committed = 0;
+  j->j_batch = 0;
+  j->j_snapshots = 0;
+  j->j_loaded = 0;
+  j->j_torn = 0;
+
+  if(j->j_path == NULL){
+    free(j);
+    return -1;
+  }
+
+  s->s_journal = j;
+
+  name = path_journal_katcp(j, JOURNAL_SNAPSHOT);
+  if((name == NULL) || (load_journal_katcp(d, j, name) < 0)){
+    if(name) free(name);
+    close_journal_katcp(d);
+    return -1;
+  }
+  free(name);
+
+  name = path_journal_katcp(j, JOURNAL_NAME);
+  if(name == NULL){
+    close_journal_katcp(d);
+    return -1;
+  }
+
+  loaded = j->j_loaded;
+  offset = load_journal_katcp(d, j, name);
+  if(offset < 0){
+    free(name);
+    close_journal_katcp(d);
+    return -1;
+  }
+
+  j->j_fd = open(name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+  if(j->j_fd < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to open journal %s: %s", name, strerror(errno));
+    free(name);
+    close_journal_katcp(d);
+    return -1;
+  }
+
+  free(name);
+
+  /* cut off a torn tail, so new records follow the last good one */
+  if(offset < JOURNAL_HEADER){
+    if((ftruncate(j->j_fd, 0) < 0) || (write_header_journal_katcp(j->j_fd) < 0)){
+      close_journal_katcp(d);
+      return -1;
+    }
+    offset = JOURNAL_HEADER;
+  } else if(ftruncate(j->j_fd, offset) < 0){
+    close_journal_katcp(d);
+    return -1;
+  }
+
+  j->j_bytes = offset;
+  j->j_records = j->j_loaded - loaded;
+  j->j_replay = 0;
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "journal %s loaded %u records", path, j->j_loaded);
+
+  return 0;
+}
+
+void close_journal_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_shared *s;
+  struct katcp_journal *j;
+
+  s = d->d_shared;
+  if((s == NULL) || (s->s_journal == NULL)){
+    return;
+  }
+
+  j = s->s_journal;
+
+  if((j->j_fd >= 0) && (j->j_replay == 0)){
+    flush_journal_katcp(d, j);
+  }
+
+  if(j->j_commit){
+    /* the notice outlives us, make sure it doesn't call back into freed memory */
+    remove_notice_katcp(s->s_template, j->j_commit, &commit_journal_katcp, j);
+    j->j_commit = NULL;
+  }
+
+  if(j->j_fd >= 0){
+    close(j->j_fd);
+    j->j_fd = (-1);
+  }
+
+  if(j->j_buffer){
+    free(j->j_buffer);
+  }
+
+  if(j->j_path){
+    free(j->j_path);
+  }
+
+  free(j);
+
+  s->s_journal = NULL;
+}
+
+int journal_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_journal *j;
+  char *name;
+
+  j = d->d_shared->s_journal;
+
+  if(argc <= 1){
+    if(j == NULL){
+      log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "no journal open");
+      return KATCP_RESULT_OK;
+    }
+
+    prepend_inform_katcp(d);
+    append_string_katcp(d, KATCP_FLAG_STRING, j->j_path);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, j->j_records);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, j->j_bytes);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, j->j_limit);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, j->j_commits);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, j->j_committed);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, j->j_batch);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, j->j_snapshots);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, j->j_loaded);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, j->j_torn);
+
+    return KATCP_RESULT_OK;
+  }
+
+  name = arg_string_katcp(d, 1);
+  if(name == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(!strcmp(name, "snapshot")){
+    if(j == NULL){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no journal open");
+      return KATCP_RESULT_FAIL;
+    }
+    return (snapshot_journal_katcp(d) < 0) ? KATCP_RESULT_FAIL : KATCP_RESULT_OK;
+  }
+
+  if(open_journal_katcp(d, name, (argc > 2) ? arg_unsigned_long_katcp(d, 2) : 0) < 0){
+    return KATCP_RESULT_FAIL;
+  }
+
+  return KATCP_RESULT_OK;
+}
+
+#ifdef UNIT_TEST_JOURNAL
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <limits.h>
+
+#define TEST_KEYS 10
+
+static int set_test_journal(struct katcp_dispatch *d, char *key, char *value)
+{
+  struct katcl_parse *p;
+  int result;
+
+  p = create_parse_katcl();
+  if(p == NULL){
+    return -1;
+  }
+
+  add_string_parse_katcl(p, KATCP_FLAG_FIRST, KATCP_SET_REQUEST);
+  add_string_parse_katcl(p, 0, key);
+  add_string_parse_katcl(p, KATCP_FLAG_LAST, value);
+
+  result = set_dbase_katcp(d, p);
+
+  destroy_parse_katcl(p);
+
+  return result;
+}
+
+static char *get_test_journal(struct katcp_dispatch *d, char *key)
+{
+  struct katcp_dbase *db;
+  struct katcp_tobject *o;
+
+  db = search_named_type_katcp(d, KATCP_TYPE_DBASE, key, NULL);
+  if(db == NULL){
+    return NULL;
+  }
+
+  o = index_stack_katcp(db->d_values, 0);
+
+  return o ? o->o_data : NULL;
+}
+
+static struct katcp_dispatch *open_test_journal(char *dir)
+{
+  struct katcp_dispatch *d;
+
+  d = startup_katcp();
+  if(d == NULL){
+    return NULL;
+  }
+
+  if(open_journal_katcp(d, dir, 0) < 0){
+    fprintf(stderr, "journal: unable to open %s\n", dir);
+    shutdown_katcp(d);
+    return NULL;
+  }
+
+  return d;
+}
+
+static long size_test_journal(char *dir)
+{
+  struct stat st;
+  char path[PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s/%s", dir, JOURNAL_NAME);
+
+  return (stat(path, &st) < 0) ? (-1) : st.st_size;
+}
+
+/* runs in a child which gets killed once part of its work is committed */
+static void crash_test_journal(char *dir)
+{
+  struct katcp_dispatch *d;
+  char key[32], value[32];
+  int i;
+
+  d = open_test_journal(dir);
+  if(d == NULL){
+    exit(1);
+  }
+
+  for(i = 0; i < TEST_KEYS; i++){
+    snprintf(key, sizeof(key), "k%d", i);
+    snprintf(value, sizeof(value), "v%d", i);
+    if(set_test_journal(d, key, value) < 0){
+      exit(1);
+    }
+  }
+
+  if(flush_journal_katcp(d, d->d_shared->s_journal) < 0){
+    exit(1);
+  }
+
+  /* buffered, but never committed */
+  set_test_journal(d, "lost", "never");
+
+  kill(getpid(), SIGKILL);
+
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  struct katcp_dispatch *d;
+  struct katcp_journal *j;
+  struct rlimit limit, saved;
+  unsigned char torn[JOURNAL_RECORD + 8];
+  char dir[] = "/tmp/test-journal-XXXXXX", path[PATH_MAX], key[32], value[32], big[256], *ptr;
+  int i, fd, status;
+  pid_t pid;
+
+  if(mkdtemp(dir) == NULL){
+    fprintf(stderr, "journal: unable to create temporary directory\n");
+    return 1;
+  }
+
+  pid = fork();
+  if(pid < 0){
+    return 1;
+  }
+  if(pid == 0){
+    crash_test_journal(dir);
+  }
+
+  if((waitpid(pid, &status, 0) != pid) || !WIFSIGNALED(status)){
+    fprintf(stderr, "journal: writer was not killed as planned\n");
+    return 1;
+  }
+
+  /* the start of a record which never made it out completely */
+  snprintf(path, sizeof(path), "%s/%s", dir, JOURNAL_NAME);
+  fd = open(path, O_WRONLY | O_APPEND);
+  if(fd < 0){
+    fprintf(stderr, "journal: no journal written to %s\n", path);
+    return 1;
+  }
+  put_journal_katcp(torn, JOURNAL_RECORD_MAGIC);
+  put_journal_katcp(torn + 4, 64);
+  put_journal_katcp(torn + 8, 0);
+  memset(torn + JOURNAL_RECORD, 0, 8);
+  write_all_journal_katcp(fd, torn, sizeof(torn));
+  close(fd);
+
+  /* reload: committed records back, the uncommitted one and the torn tail gone */
+  d = open_test_journal(dir);
+  if(d == NULL){
+    return 1;
+  }
+  j = d->d_shared->s_journal;
+
+  for(i = 0; i < TEST_KEYS; i++){
+    snprintf(key, sizeof(key), "k%d", i);
+    snprintf(value, sizeof(value), "v%d", i);
+    ptr = get_test_journal(d, key);
+    if((ptr == NULL) || strcmp(ptr, value)){
+      fprintf(stderr, "journal: %s is %s after reload, expected %s\n", key, ptr ? ptr : "missing", value);
+      return 1;
+    }
+  }
+
+  if(get_test_journal(d, "lost")){
+    fprintf(stderr, "journal: uncommitted record survived the crash\n");
+    return 1;
+  }
+
+  if((j->j_torn != sizeof(torn)) || (size_test_journal(dir) != j->j_bytes)){
+    fprintf(stderr, "journal: torn tail of %lu bytes not cut off (file %ld, journal %lu)\n", j->j_torn, size_test_journal(dir), j->j_bytes);
+    return 1;
+  }
+
+  fprintf(stderr, "journal: reload ok, %u records, %lu torn bytes dropped\n", j->j_loaded, j->j_torn);
+
+  if((set_test_journal(d, "after", "crash") < 0) || (flush_journal_katcp(d, j) < 0)){
+    fprintf(stderr, "journal: unable to append after reload\n");
+    return 1;
+  }
+
+  /* a commit which only gets partly written must not leave its fragment behind */
+  signal(SIGXFSZ, SIG_IGN);
+  getrlimit(RLIMIT_FSIZE, &saved);
+  limit = saved;
+  limit.rlim_cur = j->j_bytes + JOURNAL_RECORD + 16;
+  setrlimit(RLIMIT_FSIZE, &limit);
+
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  set_test_journal(d, "big", big);
+  if(flush_journal_katcp(d, j) == 0){
+    fprintf(stderr, "journal: commit beyond the file size limit succeeded\n");
+    return 1;
+  }
+
+  setrlimit(RLIMIT_FSIZE, &saved);
+
+  if(size_test_journal(dir) != j->j_bytes){
+    fprintf(stderr, "journal: failed commit left %ld bytes, expected %lu\n", size_test_journal(dir), j->j_bytes);
+    return 1;
+  }
+
+  /* the failure belongs to that batch, it must not stick to later commits */
+  if(flush_journal_katcp(d, j) < 0){
+    fprintf(stderr, "journal: failed commit still reported with nothing pending\n");
+    return 1;
+  }
+
+  if((set_test_journal(d, "final", "record") < 0) || (flush_journal_katcp(d, j) < 0)){
+    fprintf(stderr, "journal: unable to commit after a failed commit\n");
+    return 1;
+  }
+
+  shutdown_katcp(d);
+
+  /* everything committed after the failure has to come back */
+  d = open_test_journal(dir);
+  if(d == NULL){
+    return 1;
+  }
+  j = d->d_shared->s_journal;
+
+  ptr = get_test_journal(d, "final");
+  if((ptr == NULL) || strcmp(ptr, "record") || (get_test_journal(d, "after") == NULL) || (j->j_torn != 0)){
+    fprintf(stderr, "journal: records after a failed commit lost (%lu torn bytes)\n", j->j_torn);
+    return 1;
+  }
+
+  if(get_test_journal(d, "big")){
+    fprintf(stderr, "journal: failed commit replayed\n");
+    return 1;
+  }
+
+  /* and the same again through a snapshot */
+  if(snapshot_journal_katcp(d) < 0){
+    fprintf(stderr, "journal: unable to write snapshot\n");
+    return 1;
+  }
+
+  shutdown_katcp(d);
+
+  d = open_test_journal(dir);
+  if(d == NULL){
+    return 1;
+  }
+
+  ptr = get_test_journal(d, "k3");
+  if((ptr == NULL) || strcmp(ptr, "v3") || (get_test_journal(d, "final") == NULL)){
+    fprintf(stderr, "journal: snapshot lost records\n");
+    return 1;
+  }
+
+  shutdown_katcp(d);
+
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/%s", dir, JOURNAL_SNAPSHOT);
+  unlink(path);
+  rmdir(dir);
+
+  printf("journal: all tests passed\n");
+
+  return 0;
+}
+#endif
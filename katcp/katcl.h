@@ -122,11 +122,17 @@ int exceeds_bb_katcl(struct katcl_byte_bit *bb, struct katcl_byte_bit *limit);
 int add_bb_katcl(struct katcl_byte_bit *sigma, struct katcl_byte_bit *alpha, struct katcl_byte_bit *beta);
 
 /* generic queue logic */
+#define KATCL_GUEUE_REFUSE  0  /* when full, refuse new entries */
+#define KATCL_GUEUE_EVICT   1  /* when full, drop the oldest entry of the lowest precedence */
+
 struct katcl_gueue *create_precedence_gueue_katcl(void (*release)(void *datum), unsigned int (*precedence)(void *datum));
 struct katcl_gueue *create_gueue_katcl(void (*release)(void *datum));
 void destroy_gueue_katcl(struct katcl_gueue *g);
 
 unsigned int size_gueue_katcl(struct katcl_gueue *g);
+int limit_gueue_katcl(struct katcl_gueue *g, unsigned int capacity, int policy);
+int full_gueue_katcl(struct katcl_gueue *g);
+void stats_gueue_katcl(struct katcl_gueue *g, unsigned int *high, unsigned long *added, unsigned long *refused, unsigned long *evicted);
 int add_tail_gueue_katcl(struct katcl_gueue *g, void *datum);
 
 void *get_from_head_gueue_katcl(struct katcl_gueue *g, unsigned int position);
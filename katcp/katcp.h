@@ -96,6 +96,7 @@ struct katcp_message;
 #define KATCP_SET_REQUEST     "?set"
 #define KATCP_GET_REQUEST     "?get"
 #define KATCP_SEARCH_REQUEST  "?search"
+#define KATCP_JOURNAL_REQUEST "?journal"
 
 #define KATCP_LOG_INFORM               "#log"
 #if KATCP_PROTOCOL_MAJOR_VERSION >= 5   
@@ -599,6 +600,7 @@ void sane_shared_katcp(struct katcp_dispatch *d);
 
 /*katcp_stack functions*/
 struct katcp_stack *create_stack_katcp();
+struct katcp_stack *create_sized_stack_katcp(int size);
 struct katcp_tobject *create_tobject_katcp(void *data, struct katcp_type *type, int flagman);
 struct katcp_tobject *create_named_tobject_katcp(struct katcp_dispatch *d, void *data, char *type, int flagman);
 struct katcp_tobject *copy_tobject_katcp(struct katcp_tobject *o);
@@ -642,11 +644,16 @@ struct katcp_stack *get_value_stack_dbase_katcp(struct katcp_dbase *db);
 int dict_katcp(struct katcp_dispatch *d, struct katcl_parse *p);
 int dict_cmd_katcp(struct katcp_dispatch *d, int argc);
 
+int open_journal_katcp(struct katcp_dispatch *d, char *path, unsigned int limit);
+void close_journal_katcp(struct katcp_dispatch *d);
+int snapshot_journal_katcp(struct katcp_dispatch *d);
+int journal_cmd_katcp(struct katcp_dispatch *d, int argc);
+
 
 /*katcp_tag*/
 struct katcp_tag;
 
-int tag_data_katcp(struct katcp_dispatch *d, struct katcp_tag *t, void *data, struct katcp_type *type);
+int search_katcp(struct katcp_dispatch *d, struct katcl_parse *p);
 
 int search_cmd_katcp(struct katcp_dispatch *d, int argc);
 
@@ -669,6 +676,8 @@ int append_double_flat_katcp(struct katcp_dispatch *d, int flags, double v);
 int append_buffer_flat_katcp(struct katcp_dispatch *d, int flags, void *buffer, int len);
 int append_parameter_flat_katcp(struct katcp_dispatch *d, int flags, struct katcl_parse *p, unsigned int index);
 int append_parse_flat_katcp(struct katcp_dispatch *d, struct katcl_parse *p);
+int append_vargs_flat_katcp(struct katcp_dispatch *d, int flags, char *fmt, va_list args);
+int append_args_flat_katcp(struct katcp_dispatch *d, int flags, char *fmt, ...);
 
 /* endpoints */
 
@@ -606,6 +606,9 @@ struct katcp_shared{
   struct katcp_type **s_type;
   unsigned int s_type_count;
 
+  struct katcp_index *s_index;
+  struct katcp_journal *s_journal;
+
   time_t s_start;
 };
 
@@ -669,6 +672,11 @@ struct katcp_tobject {
 struct katcp_stack {
   struct katcp_tobject **s_objs;
   int s_count;
+  int s_size;
+  int s_limit;
+
+  struct katcp_tobject **s_spare;
+  int s_spare_count;
 };
 
 #ifdef KATCP_SUBPROCESS
@@ -805,6 +813,9 @@ int run_flat_katcp(struct katcp_dispatch *d);
 int load_flat_katcp(struct katcp_dispatch *d);
 
 int init_flats_katcp(struct katcp_dispatch *d, unsigned int stories);
+#ifdef KATCP_SUBPROCESS
+int reactor_flat_katcp(struct katcp_dispatch *d, char *name, struct katcp_group *gx, unsigned int count);
+#endif
 void destroy_flats_katcp(struct katcp_dispatch *d);
 void destroy_groups_katcp(struct katcp_dispatch *d);
 
@@ -912,7 +923,7 @@ int startup_services_katcp(struct katcp_dispatch *d);
 
 struct katcp_dict {
   char *d_key;
-  struct avl_tree *d_avl; 
+  struct bpt_tree *d_tree;
 };
 
 struct katcp_dbase {
@@ -920,14 +931,59 @@ struct katcp_dbase {
   char *d_schema;
   struct timeval d_stamped;
   struct katcp_stack *d_values;
+  int d_id; /* position in the member index, -1 until tagged */
+};
+
+struct katcp_bitmap {
+  unsigned int *b_key;        /* block number of each word, ascending */
+  unsigned long long *b_word; /* only nonzero words are kept */
+  unsigned int b_count;
+  unsigned int b_size;
+  unsigned int b_bits;
+};
+
+struct katcp_index {
+  struct katcp_tobject **i_members; /* id to tagged object */
+  unsigned int i_size;
+  unsigned int i_count;             /* highest id handed out + 1 */
+
+  unsigned int *i_free;             /* released ids, reused first */
+  unsigned int i_spare;
+
+  struct katcp_bitmap *i_live;      /* all ids in use, the universe for negation */
+};
+
+struct katcp_journal {
+  char *j_path;                /* directory holding journal and snapshot */
+  int j_fd;
+
+  unsigned char *j_buffer;     /* records not yet written */
+  unsigned int j_used;
+  unsigned int j_size;
+  unsigned int j_pending;
+
+  unsigned long j_bytes;       /* size of journal file */
+  unsigned int j_records;      /* records in journal since last snapshot */
+  unsigned int j_limit;        /* records before compacting into a snapshot */
+
+  int j_replay;
+  int j_error;
+  int j_dirty;                 /* file may extend past j_bytes */
+  struct katcp_notice *j_commit;
+
+  unsigned long j_commits;
+  unsigned long j_committed;
+  unsigned int j_batch;
+  unsigned int j_snapshots;
+  unsigned int j_loaded;
+  unsigned long j_torn;
 };
 
 struct katcp_tag {
   char *t_name;
   int t_level;
 
-  void *t_tobject_root;
-  int t_tobject_count;
+  struct katcp_bitmap *t_members;
 };
 
 void print_string_type_katcp(struct katcp_dispatch *d, char *key, void *data);
@@ -950,6 +1006,35 @@ void *parse_tag_katcp(struct katcp_dispatch *d, char **str);
 int compare_tag_katcp(const void *m1, const void *m2);
 char *getkey_tag_katcp(void *data);
 int register_tag_katcp(struct katcp_dispatch *d, char *name, int level);
+int get_count_tag_katcp(struct katcp_tag *t);
+
+int acquire_index_katcp(struct katcp_dispatch *d, void *data, struct katcp_type *type);
+int release_index_katcp(struct katcp_dispatch *d, int id);
+struct katcp_tobject *member_index_katcp(struct katcp_dispatch *d, int id);
+void destroy_index_katcp(struct katcp_dispatch *d);
+
+int tag_member_katcp(struct katcp_dispatch *d, struct katcp_tag *t, int id);
+int untag_member_katcp(struct katcp_dispatch *d, struct katcp_tag *t, int id);
+int members_tag_katcp(struct katcp_dispatch *d, struct katcp_tag *t, struct katcp_tobject **vector, int size);
+int select_tags_katcp(struct katcp_dispatch *d, struct katcp_bitmap *result, struct katcl_parse *p, int base);
+
+int record_journal_katcp(struct katcp_dispatch *d, struct katcl_parse *p);
+int wait_journal_katcp(struct katcp_dispatch *d);
+
+/* compressed bitmaps over member ids */
+struct katcp_bitmap *create_bitmap_katcp(void);
+void destroy_bitmap_katcp(struct katcp_bitmap *b);
+void clear_bitmap_katcp(struct katcp_bitmap *b);
+int set_bitmap_katcp(struct katcp_bitmap *b, unsigned int id);
+int unset_bitmap_katcp(struct katcp_bitmap *b, unsigned int id);
+int test_bitmap_katcp(struct katcp_bitmap *b, unsigned int id);
+unsigned int count_bitmap_katcp(struct katcp_bitmap *b);
+int copy_bitmap_katcp(struct katcp_bitmap *dst, struct katcp_bitmap *src);
+int and_bitmap_katcp(struct katcp_bitmap *dst, struct katcp_bitmap *src);
+int andnot_bitmap_katcp(struct katcp_bitmap *dst, struct katcp_bitmap *src);
+int or_bitmap_katcp(struct katcp_bitmap *dst, struct katcp_bitmap *src);
+int walk_bitmap_katcp(struct katcp_bitmap *b, int (*call)(unsigned int id, void *data), void *data);
+int fetch_bitmap_katcp(struct katcp_bitmap *b, unsigned int *vector, unsigned int size);
 
 
 /* endpoints: internal ********************/
@@ -958,6 +1043,7 @@ void run_endpoints_katcp(struct katcp_dispatch *d);
 void release_endpoints_katcp(struct katcp_dispatch *d);
 
 int answer_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep, struct katcl_parse *px);
+int resume_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep, int code);
 
 struct katcp_endpoint *create_endpoint_katcp(struct katcp_dispatch *d, int (*wake)(struct katcp_dispatch *d, struct katcp_endpoint *ep, struct katcp_message *msg, void *data), void (*release)(struct katcp_dispatch *d, void *data), void *data);
 void release_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep);
@@ -12,6 +12,7 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -239,6 +240,25 @@ int net_listen(char *name, int port, int flags)
   /* slightly risky behaviour in order to gain some convenience */
   value = 1;
   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+
+  if(flags & NETC_REUSE_PORT){
+#ifdef SO_REUSEPORT
+    /* several processes listen on the same port, the kernel spreads connections across them */
+    value = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value))){
+      se = errno;
+      close(fd);
+      if(flags & NETC_VERBOSE_ERRORS) fprintf(stderr, "listen: unable to share port %u: %s\n", p, strerror(errno));
+      errno = se;
+      return -1;
+    }
+#else
+    close(fd);
+    if(flags & NETC_VERBOSE_ERRORS) fprintf(stderr, "listen: no support for sharing port %u\n", p);
+    errno = ENOSYS;
+    return -1;
+#endif
+  }
    
 #ifndef MSG_NOSIGNAL
 #ifdef SO_NOSIGPIPE
@@ -275,6 +295,96 @@ int net_listen(char *name, int port, int flags)
   return fd;
 }
 
+/* a kcpmux daemon keeps one unix domain socket per upstream server,
+ * named host:port inside its directory. The name is built from the
+ * name as given, without resolving it, so daemon and tools agree
+ */
+
+int net_mux_path(char *buffer, unsigned int size, char *directory, char *name, int port)
+{
+  int p, len, hl;
+  char *ptr;
+
+  p = NETC_DEFAULT_PORT;
+
+  ptr = strchr(name, ':');
+  if(ptr){
+    hl = ptr - name;
+    p = atoi(ptr + 1);
+  } else {
+    hl = strlen(name);
+  }
+
+  if(port){
+    p = port;
+  }
+
+  if(p == 0){
+    errno = EINVAL;
+    return -1;
+  }
+
+  if(hl > 0){
+    len = snprintf(buffer, size, "%s/%.*s:%d", directory, hl, name, p);
+  } else {
+    len = snprintf(buffer, size, "%s/localhost:%d", directory, p);
+  }
+
+  if((len < 0) || (len >= size)){
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  return len;
+}
+
+int net_connect_mux(char *name, int port, int flags)
+{
+  /* attach to a kcpmux daemon if one is configured and serves this server, otherwise connect directly */
+
+  struct sockaddr_un su;
+  char *directory;
+  int fd;
+  long opts;
+
+  directory = getenv(NETC_MUX_VARIABLE);
+  if((directory == NULL) || (directory[0] == '\0')){
+    return net_connect(name, port, flags);
+  }
+
+  if(net_mux_path(su.sun_path, sizeof(su.sun_path), directory, name, port) < 0){
+    return net_connect(name, port, flags);
+  }
+
+  su.sun_family = AF_UNIX;
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0){
+    return net_connect(name, port, flags);
+  }
+
+  if(connect(fd, (struct sockaddr *)(&su), sizeof(struct sockaddr_un))){
+    if(flags & NETC_VERBOSE_STATS){
+      fprintf(stderr, "connect: unable to attach to %s (%s), connecting directly\n", su.sun_path, strerror(errno));
+    }
+    close(fd);
+    return net_connect(name, port, flags);
+  }
+
+  if(flags & NETC_ASYNC){
+    opts = fcntl(fd, F_GETFL, NULL);
+    if(opts >= 0){
+      fcntl(fd, F_SETFL, opts | O_NONBLOCK);
+    }
+  }
+
+  if(flags & NETC_VERBOSE_STATS){
+    fprintf(stderr, "connect: attached to %s\n", su.sun_path);
+  }
+
+  return fd;
+}
+
 #ifdef UNIT_TEST_NETC
 
 int main(int argc, char **argv)
@@ -9,12 +9,19 @@ extern "C" {
 #define NETC_VERBOSE_STATS   0x2
 #define NETC_ASYNC           0x4
 #define NETC_TCP_KEEP_ALIVE  0x8
+#define NETC_REUSE_PORT     0x10
 
 #define NETC_DEFAULT_PORT   7147
 
+/* directory holding the sockets of a kcpmux daemon, see net_connect_mux */
+#define NETC_MUX_VARIABLE   "KATCP_MUX"
+
 int net_connect(char *name, int port, int flags);
 int net_listen(char *name, int port, int flags);
 
+int net_mux_path(char *buffer, unsigned int size, char *directory, char *name, int port);
+int net_connect_mux(char *name, int port, int flags);
+
 #ifdef __cplusplus
 }
 #endif
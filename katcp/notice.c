@@ -922,11 +922,11 @@ static int configure_notice_katcp(struct katcp_dispatch *d, struct katcp_notice
           fprintf(stderr, "notice: attempted to wake single item (%p) which can not be found\n", data);
         }
 #endif
-
-        mark_busy_katcp(d);
-
       }
 
+      /* triggers from timers happen after notices have been run, don't let select sleep on them */
+      mark_busy_katcp(d);
+
       return 0;
   }
 
@@ -0,0 +1,713 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* shared memory register directory: lets local programs resolve and
+ * read fpga registers directly, instead of asking the server over tcp
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "regmap.h"
+
+#define KATCL_REGMAP_RETRIES   64
+
+struct katcl_regmap
+{
+  char *m_name;
+  int m_export;
+
+  struct katcl_regmap_header *m_header;
+  unsigned int m_size;
+
+  void *m_device_map;
+  unsigned int m_device_size;
+  uint32_t m_device_generation;
+};
+
+static unsigned int size_regmap_katcl(unsigned int capacity)
+{
+  return sizeof(struct katcl_regmap_header) + (capacity * sizeof(struct katcl_regmap_entry));
+}
+
+static struct katcl_regmap *alloc_regmap_katcl(char *name)
+{
+  struct katcl_regmap *rm;
+
+  rm = malloc(sizeof(struct katcl_regmap));
+  if(rm == NULL){
+    return NULL;
+  }
+
+  rm->m_name = strdup(name);
+  if(rm->m_name == NULL){
+    free(rm);
+    return NULL;
+  }
+
+  rm->m_export = 0;
+
+  rm->m_header = NULL;
+  rm->m_size = 0;
+
+  rm->m_device_map = NULL;
+  rm->m_device_size = 0;
+  rm->m_device_generation = 0;
+
+  return rm;
+}
+
+static void release_device_regmap_katcl(struct katcl_regmap *rm)
+{
+  if(rm->m_device_map){
+    munmap(rm->m_device_map, rm->m_device_size);
+    rm->m_device_map = NULL;
+  }
+
+  rm->m_device_size = 0;
+}
+
+static void free_regmap_katcl(struct katcl_regmap *rm)
+{
+  if(rm == NULL){
+    return;
+  }
+
+  release_device_regmap_katcl(rm);
+
+  if(rm->m_header){
+    munmap(rm->m_header, rm->m_size);
+    rm->m_header = NULL;
+  }
+
+  if(rm->m_name){
+    free(rm->m_name);
+    rm->m_name = NULL;
+  }
+
+  free(rm);
+}
+
+/* exporting side ***************************************************/
+
+struct katcl_regmap *create_regmap_katcl(char *name, unsigned int capacity)
+{
+  struct katcl_regmap *rm;
+  struct katcl_regmap_header *h;
+  int fd;
+
+  if(name == NULL){
+    name = KATCL_REGMAP_DEFAULT;
+  }
+
+  if(capacity <= 0){
+    capacity = KATCL_REGMAP_CAPACITY;
+  }
+
+  rm = alloc_regmap_katcl(name);
+  if(rm == NULL){
+    return NULL;
+  }
+
+  rm->m_size = size_regmap_katcl(capacity);
+
+  fd = shm_open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(fd < 0){
+#ifdef KATCP_STDERR_ERRORS
+    fprintf(stderr, "regmap: unable to create shared memory %s: %s\n", name, strerror(errno));
+#endif
+    free_regmap_katcl(rm);
+    return NULL;
+  }
+
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  if(ftruncate(fd, rm->m_size) < 0){
+#ifdef KATCP_STDERR_ERRORS
+    fprintf(stderr, "regmap: unable to size shared memory %s to %u: %s\n", name, rm->m_size, strerror(errno));
+#endif
+    close(fd);
+    shm_unlink(name);
+    free_regmap_katcl(rm);
+    return NULL;
+  }
+
+  h = mmap(NULL, rm->m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(h == MAP_FAILED){
+#ifdef KATCP_STDERR_ERRORS
+    fprintf(stderr, "regmap: unable to map shared memory %s: %s\n", name, strerror(errno));
+#endif
+    shm_unlink(name);
+    free_regmap_katcl(rm);
+    return NULL;
+  }
+
+  rm->m_header = h;
+  rm->m_export = 1;
+
+  /* a previous instance may have left a generation count, continue from it so readers notice */
+  if((h->h_magic != KATCL_REGMAP_MAGIC) || (h->h_version != KATCL_REGMAP_VERSION)){
+    h->h_generation = 0;
+  } else if(h->h_generation & 1){
+    h->h_generation++;
+  }
+
+  h->h_generation++;
+  __sync_synchronize();
+
+  h->h_magic = KATCL_REGMAP_MAGIC;
+  h->h_version = KATCL_REGMAP_VERSION;
+  h->h_capacity = capacity;
+  h->h_count = 0;
+  h->h_map_size = 0;
+  h->h_device[0] = '\0';
+
+  __sync_synchronize();
+  h->h_generation++;
+
+  return rm;
+}
+
+void destroy_regmap_katcl(struct katcl_regmap *rm)
+{
+  if(rm == NULL){
+    return;
+  }
+
+  if(rm->m_export && rm->m_header){
+    /* tell anybody still attached that things have gone away */
+    if(!(rm->m_header->h_generation & 1)){
+      rm->m_header->h_generation++;
+    }
+    rm->m_header->h_count = 0;
+    rm->m_header->h_map_size = 0;
+    __sync_synchronize();
+    rm->m_header->h_generation++;
+
+    shm_unlink(rm->m_name);
+  }
+
+  free_regmap_katcl(rm);
+}
+
+int begin_regmap_katcl(struct katcl_regmap *rm)
+{
+  struct katcl_regmap_header *h;
+
+  if((rm == NULL) || (rm->m_export == 0)){
+    return -1;
+  }
+
+  h = rm->m_header;
+
+  if(!(h->h_generation & 1)){
+    h->h_generation++;
+    __sync_synchronize();
+  }
+
+  h->h_count = 0;
+  h->h_map_size = 0;
+
+  return 0;
+}
+
+int add_regmap_katcl(struct katcl_regmap *rm, char *name, unsigned int pos_base, unsigned int pos_offset, unsigned int len_base, unsigned int len_offset, unsigned int mode)
+{
+  struct katcl_regmap_header *h;
+  struct katcl_regmap_entry *e;
+  int len;
+
+  if((rm == NULL) || (rm->m_export == 0) || (name == NULL)){
+    return -1;
+  }
+
+  h = rm->m_header;
+
+#ifdef KATCP_CONSISTENCY_CHECKS
+  if(!(h->h_generation & 1)){
+    fprintf(stderr, "regmap: adding %s outside of an update\n", name);
+    abort();
+  }
+#endif
+
+  if(h->h_count >= h->h_capacity){
+    return -1;
+  }
+
+  len = strlen(name);
+  if(len >= KATCL_REGMAP_NAME){
+    return -1;
+  }
+
+  e = &(h->h_entries[h->h_count]);
+
+  memcpy(e->e_name, name, len + 1);
+  e->e_pos_base = pos_base;
+  e->e_pos_offset = pos_offset;
+  e->e_len_base = len_base;
+  e->e_len_offset = len_offset;
+  e->e_mode = mode;
+  e->e_pad = 0;
+
+  h->h_count++;
+
+  return 0;
+}
+
+static int compare_entry_regmap_katcl(const void *a, const void *b)
+{
+  const struct katcl_regmap_entry *alpha, *beta;
+
+  alpha = a;
+  beta = b;
+
+  return strcmp(alpha->e_name, beta->e_name);
+}
+
+int commit_regmap_katcl(struct katcl_regmap *rm, char *device, unsigned int map_size)
+{
+  struct katcl_regmap_header *h;
+
+  if((rm == NULL) || (rm->m_export == 0)){
+    return -1;
+  }
+
+  h = rm->m_header;
+
+  if(!(h->h_generation & 1)){
+    return -1;
+  }
+
+  /* sorted, so readers can do a binary search */
+  qsort(h->h_entries, h->h_count, sizeof(struct katcl_regmap_entry), &compare_entry_regmap_katcl);
+
+  if(device){
+    strncpy(h->h_device, device, KATCL_REGMAP_PATH - 1);
+    h->h_device[KATCL_REGMAP_PATH - 1] = '\0';
+    h->h_map_size = map_size;
+  } else {
+    h->h_device[0] = '\0';
+    h->h_map_size = 0;
+  }
+
+  __sync_synchronize();
+  h->h_generation++;
+
+  return 0;
+}
+
+/* reading side *****************************************************/
+
+struct katcl_regmap *open_regmap_katcl(char *name)
+{
+  struct katcl_regmap *rm;
+  struct katcl_regmap_header *h;
+  struct stat st;
+  int fd;
+
+  if(name == NULL){
+    name = KATCL_REGMAP_DEFAULT;
+  }
+
+  rm = alloc_regmap_katcl(name);
+  if(rm == NULL){
+    return NULL;
+  }
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if(fd < 0){
+    free_regmap_katcl(rm);
+    return NULL;
+  }
+
+  if(fstat(fd, &st) < 0){
+    close(fd);
+    free_regmap_katcl(rm);
+    return NULL;
+  }
+
+  if(st.st_size < sizeof(struct katcl_regmap_header)){
+    close(fd);
+    free_regmap_katcl(rm);
+    errno = EPROTO;
+    return NULL;
+  }
+
+  rm->m_size = st.st_size;
+
+  h = mmap(NULL, rm->m_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(h == MAP_FAILED){
+    free_regmap_katcl(rm);
+    return NULL;
+  }
+
+  rm->m_header = h;
+
+  if((h->h_magic != KATCL_REGMAP_MAGIC) || (h->h_version != KATCL_REGMAP_VERSION) || (size_regmap_katcl(h->h_capacity) > rm->m_size)){
+    free_regmap_katcl(rm);
+    errno = EPROTO;
+    return NULL;
+  }
+
+  return rm;
+}
+
+void close_regmap_katcl(struct katcl_regmap *rm)
+{
+  free_regmap_katcl(rm);
+}
+
+unsigned int generation_regmap_katcl(struct katcl_regmap *rm)
+{
+  if(rm == NULL){
+    return 0;
+  }
+
+  return rm->m_header->h_generation;
+}
+
+static uint32_t stable_regmap_katcl(struct katcl_regmap_header *h)
+{
+  uint32_t gen;
+  unsigned int i;
+
+  for(i = 0; i < KATCL_REGMAP_RETRIES; i++){
+    gen = h->h_generation;
+    if(!(gen & 1)){
+      __sync_synchronize();
+      return gen;
+    }
+    usleep(1);
+  }
+
+  return gen;
+}
+
+static int lookup_regmap_katcl(struct katcl_regmap_header *h, char *name, struct katcl_regmap_entry *entry)
+{
+  struct katcl_regmap_entry *e;
+  unsigned int count;
+  int low, high, mid, cmp;
+
+  count = h->h_count;
+  if(count > h->h_capacity){
+    return -1; /* torn read, caller will retry */
+  }
+
+  low = 0;
+  high = count - 1;
+
+  while(low <= high){
+    mid = (low + high) / 2;
+    e = &(h->h_entries[mid]);
+
+    cmp = strncmp(name, e->e_name, KATCL_REGMAP_NAME);
+    if(cmp == 0){
+      memcpy(entry, e, sizeof(struct katcl_regmap_entry));
+      entry->e_name[KATCL_REGMAP_NAME - 1] = '\0';
+      return 0;
+    }
+
+    if(cmp < 0){
+      high = mid - 1;
+    } else {
+      low = mid + 1;
+    }
+  }
+
+  return 1;
+}
+
+int resolve_regmap_katcl(struct katcl_regmap *rm, char *name, struct katcl_regmap_entry *entry)
+{
+  struct katcl_regmap_header *h;
+  uint32_t gen;
+  unsigned int i;
+  int result;
+
+  if((rm == NULL) || (name == NULL) || (entry == NULL)){
+    errno = EINVAL;
+    return -1;
+  }
+
+  h = rm->m_header;
+
+  for(i = 0; i < KATCL_REGMAP_RETRIES; i++){
+    gen = stable_regmap_katcl(h);
+    if(gen & 1){
+      break;
+    }
+
+    result = lookup_regmap_katcl(h, name, entry);
+
+    __sync_synchronize();
+    if(gen == h->h_generation){
+      if(result == 0){
+        return 0;
+      }
+      errno = ENOENT;
+      return -1;
+    }
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+static int device_regmap_katcl(struct katcl_regmap *rm, uint32_t gen)
+{
+  struct katcl_regmap_header *h;
+  char device[KATCL_REGMAP_PATH];
+  unsigned int size;
+  int fd;
+
+  h = rm->m_header;
+
+  if(rm->m_device_map && (rm->m_device_generation == gen)){
+    return 0;
+  }
+
+  release_device_regmap_katcl(rm);
+
+  size = h->h_map_size;
+  memcpy(device, h->h_device, KATCL_REGMAP_PATH);
+  device[KATCL_REGMAP_PATH - 1] = '\0';
+
+  __sync_synchronize();
+  if(gen != h->h_generation){
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if((size <= 0) || (device[0] == '\0')){
+    errno = ENODEV;
+    return -1;
+  }
+
+  fd = open(device, O_RDONLY);
+  if(fd < 0){
+    return -1;
+  }
+
+  rm->m_device_map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(rm->m_device_map == MAP_FAILED){
+    rm->m_device_map = NULL;
+    return -1;
+  }
+
+  rm->m_device_size = size;
+  rm->m_device_generation = gen;
+
+  return 0;
+}
+
+/* reads count words starting at word offset, with the same alignment handling as ?wordread */
+
+int read_regmap_katcl(struct katcl_regmap *rm, char *name, unsigned int offset, uint32_t *buffer, unsigned int count)
+{
+  struct katcl_regmap_entry entry;
+  unsigned int i, j, k, shift;
+  uint32_t gen, prev, current;
+
+  if((rm == NULL) || (name == NULL) || (buffer == NULL) || (count <= 0)){
+    errno = EINVAL;
+    return -1;
+  }
+
+  for(k = 0; k < KATCL_REGMAP_RETRIES; k++){
+
+    if(resolve_regmap_katcl(rm, name, &entry) < 0){
+      return -1;
+    }
+
+    gen = stable_regmap_katcl(rm->m_header);
+    if(gen & 1){
+      continue;
+    }
+
+    if(!(entry.e_mode & KATCL_REGMAP_READABLE)){
+      errno = EPERM;
+      return -1;
+    }
+
+    if(((offset + count) * 4) > entry.e_len_base){
+      errno = ERANGE;
+      return -1;
+    }
+
+    if(device_regmap_katcl(rm, gen) < 0){
+      if(errno == EAGAIN){
+        continue;
+      }
+      return -1;
+    }
+
+    j = entry.e_pos_base + (offset * 4);
+    shift = entry.e_pos_offset;
+
+    if((j + ((count + (shift ? 1 : 0)) * 4)) > rm->m_device_size){
+      errno = ERANGE;
+      return -1;
+    }
+
+    if(shift > 0){
+      current = *((volatile uint32_t *)(rm->m_device_map + j));
+      prev = (current << shift);
+      j += 4;
+    } else {
+      shift = 32;
+      prev = 0;
+    }
+
+    for(i = 0; i < count; i++){
+      current = *((volatile uint32_t *)(rm->m_device_map + j));
+      buffer[i] = (shift < 32) ? ((current >> (32 - shift)) | prev) : current;
+      prev = (shift < 32) ? (current << shift) : 0;
+      j += 4;
+    }
+
+    /* the fpga could have been reprogrammed while we were reading */
+    __sync_synchronize();
+    if(gen == rm->m_header->h_generation){
+      return count;
+    }
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+#ifdef UNIT_TEST_REGMAP
+
+#define TEST_DEVICE "regmap-test-device"
+#define TEST_WORDS  1024
+
+int main()
+{
+  struct katcl_regmap *server, *client;
+  struct katcl_regmap_entry entry;
+  uint32_t words[TEST_WORDS], buffer[4];
+  char name[KATCL_REGMAP_NAME];
+  unsigned int i;
+  int fd;
+
+  for(i = 0; i < TEST_WORDS; i++){
+    words[i] = i;
+  }
+
+  fd = open(TEST_DEVICE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if(fd < 0){
+    fprintf(stderr, "test: unable to create %s: %s\n", TEST_DEVICE, strerror(errno));
+    return 1;
+  }
+  if(write(fd, words, sizeof(words)) != sizeof(words)){
+    fprintf(stderr, "test: unable to fill %s\n", TEST_DEVICE);
+    return 1;
+  }
+  close(fd);
+
+  server = create_regmap_katcl("/katcp-regmap-test", 128);
+  if(server == NULL){
+    fprintf(stderr, "test: unable to create regmap\n");
+    return 1;
+  }
+
+  client = open_regmap_katcl("/katcp-regmap-test");
+  if(client == NULL){
+    fprintf(stderr, "test: unable to open regmap\n");
+    return 1;
+  }
+
+  if(read_regmap_katcl(client, "sys_scratchpad", 0, buffer, 1) >= 0){
+    fprintf(stderr, "test: read succeeded on empty directory\n");
+    abort();
+  }
+
+  begin_regmap_katcl(server);
+  for(i = 0; i < 100; i++){
+    snprintf(name, KATCL_REGMAP_NAME, "reg_%03u", 99 - i);
+    add_regmap_katcl(server, name, (99 - i) * 4, 0, 4, 0, KATCL_REGMAP_READABLE | KATCL_REGMAP_WRITABLE);
+  }
+  add_regmap_katcl(server, "sys_scratchpad", 400, 0, 16, 0, KATCL_REGMAP_READABLE);
+  add_regmap_katcl(server, "shifted", 200, 8, 8, 0, KATCL_REGMAP_READABLE);
+  commit_regmap_katcl(server, TEST_DEVICE, sizeof(words));
+
+  if(resolve_regmap_katcl(client, "reg_042", &entry) < 0){
+    fprintf(stderr, "test: unable to resolve reg_042\n");
+    abort();
+  }
+  if(entry.e_pos_base != 42 * 4){
+    fprintf(stderr, "test: reg_042 resolved to 0x%x\n", entry.e_pos_base);
+    abort();
+  }
+
+  if(read_regmap_katcl(client, "sys_scratchpad", 1, buffer, 3) != 3){
+    fprintf(stderr, "test: unable to read scratchpad: %s\n", strerror(errno));
+    abort();
+  }
+  if((buffer[0] != 101) || (buffer[2] != 103)){
+    fprintf(stderr, "test: scratchpad read gave %u %u %u\n", buffer[0], buffer[1], buffer[2]);
+    abort();
+  }
+
+  if(read_regmap_katcl(client, "sys_scratchpad", 2, buffer, 3) >= 0){
+    fprintf(stderr, "test: read beyond end of register succeeded\n");
+    abort();
+  }
+
+  if(read_regmap_katcl(client, "shifted", 0, buffer, 1) != 1){
+    fprintf(stderr, "test: unable to read shifted register\n");
+    abort();
+  }
+  if(buffer[0] != ((50 << 8) | (51 >> 24))){
+    fprintf(stderr, "test: shifted read gave 0x%x\n", buffer[0]);
+    abort();
+  }
+
+  i = generation_regmap_katcl(client);
+
+  /* simulate reprogramming */
+  begin_regmap_katcl(server);
+  add_regmap_katcl(server, "sys_board_id", 0, 0, 4, 0, KATCL_REGMAP_READABLE);
+  commit_regmap_katcl(server, TEST_DEVICE, sizeof(words));
+
+  if(generation_regmap_katcl(client) == i){
+    fprintf(stderr, "test: generation did not advance\n");
+    abort();
+  }
+
+  if(resolve_regmap_katcl(client, "reg_042", &entry) == 0){
+    fprintf(stderr, "test: stale register still resolvable\n");
+    abort();
+  }
+
+  if((read_regmap_katcl(client, "sys_board_id", 0, buffer, 1) != 1) || (buffer[0] != 0)){
+    fprintf(stderr, "test: unable to read after reprogram\n");
+    abort();
+  }
+
+  close_regmap_katcl(client);
+  destroy_regmap_katcl(server);
+  unlink(TEST_DEVICE);
+
+  printf("regmap test: ok\n");
+
+  return 0;
+}
+
+#endif
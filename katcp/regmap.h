@@ -0,0 +1,73 @@
+#ifndef REGMAP_H_
+#define REGMAP_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a register directory exported in shared memory by a server which has
+ * the fpga mapped (tcpborphserver3), so that programs on the same
+ * machine can resolve and read registers without a katcp round trip.
+ *
+ * The generation field is odd while the server rewrites the directory
+ * (seqlock style), readers retry if it changed underneath them
+ */
+
+#define KATCL_REGMAP_MAGIC      0x6b726d31
+#define KATCL_REGMAP_VERSION    1
+
+#define KATCL_REGMAP_NAME       64
+#define KATCL_REGMAP_PATH       64
+
+#define KATCL_REGMAP_READABLE   1
+#define KATCL_REGMAP_WRITABLE   2
+
+#define KATCL_REGMAP_DEFAULT    "/katcp-registers"
+#define KATCL_REGMAP_CAPACITY   4096
+
+struct katcl_regmap_entry
+{
+  char e_name[KATCL_REGMAP_NAME];
+  uint32_t e_pos_base;
+  uint32_t e_len_base;
+  uint8_t e_pos_offset;
+  uint8_t e_len_offset;
+  uint8_t e_mode;
+  uint8_t e_pad;
+};
+
+struct katcl_regmap_header
+{
+  uint32_t h_magic;
+  uint32_t h_version;
+  volatile uint32_t h_generation;
+  uint32_t h_capacity;
+  uint32_t h_count;
+  uint32_t h_map_size;
+  char h_device[KATCL_REGMAP_PATH];
+  struct katcl_regmap_entry h_entries[];
+};
+
+struct katcl_regmap;
+
+/* exporting side, used by the server */
+struct katcl_regmap *create_regmap_katcl(char *name, unsigned int capacity);
+void destroy_regmap_katcl(struct katcl_regmap *rm);
+int begin_regmap_katcl(struct katcl_regmap *rm);
+int add_regmap_katcl(struct katcl_regmap *rm, char *name, unsigned int pos_base, unsigned int pos_offset, unsigned int len_base, unsigned int len_offset, unsigned int mode);
+int commit_regmap_katcl(struct katcl_regmap *rm, char *device, unsigned int map_size);
+
+/* reading side, used by local clients */
+struct katcl_regmap *open_regmap_katcl(char *name);
+void close_regmap_katcl(struct katcl_regmap *rm);
+unsigned int generation_regmap_katcl(struct katcl_regmap *rm);
+int resolve_regmap_katcl(struct katcl_regmap *rm, char *name, struct katcl_regmap_entry *entry);
+int read_regmap_katcl(struct katcl_regmap *rm, char *name, unsigned int offset, uint32_t *buffer, unsigned int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
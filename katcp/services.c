@@ -28,7 +28,9 @@ int startup_services_katcp(struct katcp_dispatch *d)
   rtn += register_katcp(d, KATCP_GET_REQUEST, "get [key] (n) from database (n optional)", &get_dbase_cmd_katcp);
   rtn += register_katcp(d, KATCP_SET_REQUEST, "set [key] [value value ...] to database", &set_dbase_cmd_katcp);
 
-  rtn += register_katcp(d, KATCP_SEARCH_REQUEST, "search [tag1 tag2 ...]", &search_cmd_katcp);
+  rtn += register_katcp(d, KATCP_JOURNAL_REQUEST, "journal [directory [records] | snapshot] (persist the database)", &journal_cmd_katcp);
+
+  rtn += register_katcp(d, KATCP_SEARCH_REQUEST, "search tag [tag|+tag|!tag ...] (all of, or, but not)", &search_cmd_katcp);
 
   return rtn;
 }
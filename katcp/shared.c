@@ -244,6 +244,9 @@ int startup_shared_katcp(struct katcp_dispatch *d)
   s->s_type = NULL;
   s->s_type_count = 0;
 
+  s->s_index = NULL;
+  s->s_journal = NULL;
+
 #ifdef DEBUG
   if(d->d_shared){
     fprintf(stderr, "startup shared: major logic failure: instance %p already has shared data %p\n", d, d->d_shared);
@@ -338,6 +341,8 @@ void shutdown_shared_katcp(struct katcp_dispatch *d)
 
   /* TODO: what about destroying jobs, need to happen before sensors ? */
 
+  close_journal_katcp(d);
+
   destroy_notices_katcp(d);
 
   /* WARNING: s_mode_sensor used to leak, hopefully fixed now */
@@ -347,6 +352,7 @@ void shutdown_shared_katcp(struct katcp_dispatch *d)
   destroy_versions_katcp(d);
   
   destroy_type_list_katcp(d);
+  destroy_index_katcp(d);
 
   destroy_arbs_katcp(d);
 
@@ -19,10 +19,52 @@ struct katcp_stack *create_stack_katcp()
 
   s->s_objs     = NULL;
   s->s_count = 0;
+  s->s_size  = 0;
+  s->s_limit = 0;
+
+  s->s_spare       = NULL;
+  s->s_spare_count = 0;
 
   return s;
 } 
 
+/* a stack which holds at most size objects and keeps the object holders
+ * of popped entries around, so pushes and pops do not allocate */
+struct katcp_stack *create_sized_stack_katcp(int size)
+{
+  struct katcp_stack *s;
+  struct katcp_tobject *o;
+
+  if (size <= 0)
+    return NULL;
+
+  s = create_stack_katcp();
+  if (s == NULL)
+    return NULL;
+
+  s->s_objs  = malloc(sizeof(struct katcp_tobject *) * size);
+  s->s_spare = malloc(sizeof(struct katcp_tobject *) * size);
+  if (s->s_objs == NULL || s->s_spare == NULL){
+    destroy_stack_katcp(s);
+    return NULL;
+  }
+
+  s->s_size  = size;
+  s->s_limit = size;
+
+  while (s->s_spare_count < size){
+    o = malloc(sizeof(struct katcp_tobject));
+    if (o == NULL){
+      destroy_stack_katcp(s);
+      return NULL;
+    }
+    s->s_spare[s->s_spare_count] = o;
+    s->s_spare_count++;
+  }
+
+  return s;
+}
+
 struct katcp_tobject *create_tobject_katcp(void *data, struct katcp_type *type, int flagman)
 {
   struct katcp_tobject *o;
@@ -175,19 +217,40 @@ void destroy_stack_katcp(struct katcp_stack *s)
         destroy_tobject_katcp(s->s_objs[i]);
       free(s->s_objs);
     }
+    if (s->s_spare != NULL){
+      for (i=0; i<s->s_spare_count; i++)
+        free(s->s_spare[i]);
+      free(s->s_spare);
+    }
     free(s);
   }
 }
 
 int push_tobject_katcp(struct katcp_stack *s, struct katcp_tobject *o)
 {
+  struct katcp_tobject **tmp;
+  int size;
+
   if (s == NULL || o == NULL)
     return -1;
-  
-  s->s_objs = realloc(s->s_objs, sizeof(struct katcp_tobject *) * (s->s_count + 1));
-  if (s->s_objs == NULL){
-    destroy_tobject_katcp(o);
-    return -1;
+
+  if (s->s_count >= s->s_size){
+    if (s->s_limit > 0){
+#ifdef DEBUG
+      fprintf(stderr, "stack: push exceeds limit of %d\n", s->s_limit);
+#endif
+      destroy_tobject_katcp(o);
+      return -1;
+    }
+
+    size = (s->s_size > 0) ? (s->s_size * 2) : 4;
+    tmp = realloc(s->s_objs, sizeof(struct katcp_tobject *) * size);
+    if (tmp == NULL){
+      destroy_tobject_katcp(o);
+      return -1;
+    }
+    s->s_objs = tmp;
+    s->s_size = size;
   }
   
   s->s_objs[s->s_count] = o;
@@ -212,9 +275,16 @@ int push_stack_katcp(struct katcp_stack *s, void *data, struct katcp_type *type)
   if (s == NULL)
     return -1;
 
-  o = create_tobject_katcp(data, type, 0);
-  if (o == NULL)
-    return -1;
+  if (s->s_spare_count > 0 && data != NULL){
+    o = s->s_spare[--(s->s_spare_count)];
+    o->o_data = data;
+    o->o_type = type;
+    o->o_man  = 0;
+  } else {
+    o = create_tobject_katcp(data, type, 0);
+    if (o == NULL)
+      return -1;
+  }
   
   return push_tobject_katcp(s, o);
 }
@@ -247,7 +317,6 @@ struct katcp_tobject *pop_stack_katcp(struct katcp_stack *s)
   
   o = s->s_objs[s->s_count - 1];
   
-  s->s_objs = realloc(s->s_objs, sizeof(struct katcp_tobject *) * (s->s_count - 1));
   s->s_count--;
 
 #if 0
@@ -269,7 +338,18 @@ void *pop_data_stack_katcp(struct katcp_stack *s)
     
   data = o->o_data;
 
-  destroy_tobject_katcp(o);
+  if (s->s_spare != NULL && s->s_spare_count < s->s_size){
+    /*same as destroy_tobject_katcp, but keep the holder for the next push*/
+    if (o->o_man && o->o_type != NULL && o->o_type->t_free != NULL){
+      (*o->o_type->t_free)(o->o_data);
+    }
+    o->o_data = NULL;
+    o->o_type = NULL;
+    s->s_spare[s->s_spare_count] = o;
+    s->s_spare_count++;
+  } else {
+    destroy_tobject_katcp(o);
+  }
 
   return data;
 }
@@ -49,6 +49,7 @@ struct katcp_actor *create_actor_type_katcp(struct katcp_dispatch *d, char *str,
 
   a->a_tag_root = NULL;
   a->a_tag_count = 0;
+  a->a_id = (-1);
 
   return a;
 }
@@ -225,64 +226,38 @@ void walk_tag_tobjects(const void *nodep, const VISIT which, const int depth)
 #endif
 
 
-struct katcp_tobject **__tobjs;
-int __tcount;
-
-void collect_tobjects_from_tag(const void *nodep, const VISIT which, const int depth)
+/* a private copy of the members, so callers may untag while iterating */
+static struct katcp_tobject **snapshot_tag_katcp(struct katcp_dispatch *d, struct katcp_tag *t, int *count)
 {
-  struct katcp_tobject *to;
-
-  to = *(struct katcp_tobject **) nodep;
-  if (to == NULL)
-    return;
-
-  switch (which){
-    case leaf:
-    case postorder:
-      if (__tobjs == NULL)
-        return;
-      __tobjs[__tcount] = to;
-      __tcount++;
-      break;
-    case preorder:
-    case endorder:
-      break;
-  }
-}
+  struct katcp_tobject **vector;
+  int size;
 
-void destroy_tobjs_katcp(void)
-{
-  free(__tobjs);
-  __tobjs   = NULL;
-  __tcount  = 0;
-}
+  *count = 0;
 
-int populate_tobjs_katcp(struct katcp_tag *t)
-{
-  if (t == NULL)
-    return -1;
+  size = get_count_tag_katcp(t);
+  if (size <= 0)
+    return NULL;
 
-  if (__tobjs != NULL)
-    destroy_tobjs_katcp();
+  vector = malloc(sizeof(struct katcp_tobject *) * size);
+  if (vector == NULL)
+    return NULL;
 
-  __tobjs   = malloc(sizeof(struct katcp_tobject *) * t->t_tobject_count);
-  __tcount  = 0;
-  
-  if (t->t_tobject_root != NULL)
-    twalk(t->t_tobject_root, &collect_tobjects_from_tag);
-  
-  if (__tobjs == NULL)
-    return -1;
+  *count = members_tag_katcp(d, t, vector, size);
+  if (*count <= 0){
+    *count = 0;
+    free(vector);
+    return NULL;
+  }
 
-  return 0;
+  return vector;
 }
 
 int deregister_tag_katcp(struct katcp_dispatch *d, char *name)
 {
   struct katcp_tag *t;
-  struct katcp_tobject *to;
+  struct katcp_tobject *to, **vector;
   struct katcp_type *actor_type;
-  int i;
+  int i, count;
 
   if (name == NULL)
     return -1;
@@ -291,13 +266,12 @@ int deregister_tag_katcp(struct katcp_dispatch *d, char *name)
   if (t == NULL)
     return -1;
 
-  if (populate_tobjs_katcp(t) < 0)
-    return -1;
+  vector = snapshot_tag_katcp(d, t, &count);
   
   actor_type = find_name_type_katcp(d, KATCP_TYPE_ACTOR);
 
-  for (i=0; i<__tcount; i++){
-    to = __tobjs[i];
+  for (i=0; i<count; i++){
+    to = vector[i];
     if (to != NULL){
       /*TODO: a type specific detagger method*/  
       if (to->o_type == actor_type){
@@ -306,7 +280,8 @@ int deregister_tag_katcp(struct katcp_dispatch *d, char *name)
     }
   }
   
-  destroy_tobjs_katcp();
+  if (vector)
+    free(vector);
 
   return del_data_type_katcp(d, KATCP_TYPE_TAG, name);
 }
@@ -314,8 +289,8 @@ int deregister_tag_katcp(struct katcp_dispatch *d, char *name)
 void dump_tag_katcp(struct katcp_dispatch *d, char *key, void *data)
 {
   struct katcp_tag *t;
-  struct katcp_tobject *to;
-  int i;
+  struct katcp_tobject *to, **vector;
+  int i, count;
 
   t = data;
   
@@ -324,17 +299,17 @@ void dump_tag_katcp(struct katcp_dispatch *d, char *key, void *data)
 
   print_tag_katcp(d, "unnamed_tag", data);
   
-  if (populate_tobjs_katcp(t) < 0)
-    return;
+  vector = snapshot_tag_katcp(d, t, &count);
   
-  for (i=0; i<__tcount; i++){
-    to = __tobjs[i];
-    if (to != NULL || to->o_type != NULL || to->o_type->t_print != NULL) {
+  for (i=0; i<count; i++){
+    to = vector[i];
+    if (to != NULL && to->o_type != NULL && to->o_type->t_print != NULL) {
       (*(to->o_type->t_print))(d, "unnamed_tag", to->o_data);
     }
   }
 
-  destroy_tobjs_katcp();
+  if (vector)
+    free(vector);
 }
 
 int dump_tagsets_katcp(struct katcp_dispatch *d)
@@ -353,9 +328,10 @@ int dump_tagsets_katcp(struct katcp_dispatch *d)
 
 /**********************************[mixed tag & actor]***************************************/
 
-struct katcp_tag **__tags;
+static struct katcp_tag **__tags;
+static int __tcount;
 
-void collect_tags_from_actor(const void *nodep, const VISIT which, const int depth)
+static void collect_tags_from_actor(const void *nodep, const VISIT which, const int depth)
 {
   struct katcp_tag *t;
 
@@ -379,118 +355,90 @@ void collect_tags_from_actor(const void *nodep, const VISIT which, const int dep
 
 int unlink_tags_actor_katcp(struct katcp_dispatch *d, struct katcp_actor *a)
 {
-  struct katcp_tag *t;
-  int i;
+  struct katcp_tag **tags;
+  int i, count, result;
   
   if (a == NULL)
     return -1;
   
-  __tags = malloc(sizeof(struct katcp_tag *) * a->a_tag_count);
-  __tcount = 0;
-  
-  if (a->a_tag_root != NULL)
+  tags = NULL;
+  count = 0;
+
+  if (a->a_tag_root != NULL && a->a_tag_count > 0){
+    tags = malloc(sizeof(struct katcp_tag *) * a->a_tag_count);
+    if (tags == NULL)
+      return -1;
+
+    __tags   = tags;
+    __tcount = 0;
+
     twalk(a->a_tag_root, &collect_tags_from_actor);
-  
-  if (__tags == NULL)
-    return -1;
-  
-  for (i=0; i<__tcount; i++){
-    t = __tags[i];
-    if (t != NULL){
-      untag_actor_katcp(d, a, t);
+
+    count    = __tcount;
+    __tags   = NULL;
+    __tcount = 0;
+  }
+
+  result = 0;
+
+  for (i=0; i<count; i++){
+    if (untag_actor_katcp(d, a, tags[i]) < 0){
+      /* make sure the id does not linger in the bitmap, it is about to be reused */
+      untag_member_katcp(d, tags[i], a->a_id);
+      result = (-1);
     }
   }
 
-  free(__tags);
-  __tags   = NULL;
-  __tcount = 0;
+  if (tags)
+    free(tags);
+
+  if (a->a_id >= 0){
+    release_index_katcp(d, a->a_id);
+    a->a_id = (-1);
+  }
   
 #ifdef DEBUG
   fprintf(stderr, "actor: unlink tags for <%s> complete\n", a->a_key);
 #endif
 
-  return 0;
+  return result;
 }
 
 int add_tobject_tag_katcp(struct katcp_dispatch *d, struct katcp_tag *t, struct katcp_actor *a, char *type)
 {
-  struct katcp_tobject *to;
-  void *val;
-
   if (t == NULL || a == NULL || type == NULL)
     return -1;
-  
-  to = create_named_tobject_katcp(d, a, type, 0);
-  if (to == NULL)
-    return -1;
 
-  val = tfind((void *) to, &(t->t_tobject_root), &compare_tobject_katcp);
-  if (val != NULL){
-#ifdef DEBUG
-    fprintf(stderr, "tag: tag already contains tobject with corresponding data\n");
-#endif
-    destroy_tobject_katcp(to);
-    return -1;
+  if (a->a_id < 0){
+    a->a_id = acquire_index_katcp(d, a, find_name_type_katcp(d, type));
+    if (a->a_id < 0)
+      return -1;
   }
 
-  val = tsearch((void *) to, &(t->t_tobject_root), &compare_tobject_katcp);
-  if (val == NULL || ( *(struct katcp_tobject **) val != to )){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "tag: error with tsearch for actor:<%s> in tag:<%s>", a->a_key, t->t_name);
+  if (tag_member_katcp(d, t, a->a_id) < 0){
 #ifdef DEBUG
-    fprintf(stderr, "tag: error with tsearch for actor:<%s> in tag:<%s>\n", a->a_key, t->t_name);
+    fprintf(stderr, "tag: tag already contains actor <%s>\n", a->a_key);
 #endif
-    destroy_tobject_katcp(to);
     return -1;
   }
-  
-#if 0
-  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "added tobject <%s> to tag <%s>", a->a_key, t->t_name);
-#endif
-
-  t->t_tobject_count++;
 
   return 0;
 }
 
 int del_tobject_tag_katcp(struct katcp_dispatch *d, struct katcp_tag *t, struct katcp_actor *a, char *type)
 {
-  struct katcp_tobject *to;
-  void *val;
-
   if (t == NULL || a == NULL || type == NULL)
     return -1;
-  
-  to = create_named_tobject_katcp(d, a, type, 0);
-  if (to == NULL)
-    return -1;
 
-  val = tfind((void *) to, &(t->t_tobject_root), &compare_tobject_katcp);
-  if (val == NULL){
+  if (untag_member_katcp(d, t, a->a_id) < 0){
 #ifdef DEBUG
     fprintf(stderr, "tag: could not find tobject to delete\n");
 #endif
     return -1;
   }
 
-  destroy_tobject_katcp(to);
-
-  to = *(struct katcp_tobject **) val;
-  
-  val = tdelete((void *) to, &(t->t_tobject_root), &compare_tobject_katcp);
-  if (val == NULL){
-#ifdef DEBUG
-    fprintf(stderr, "tag: could not find tobject to delete\n");
-#endif
-    destroy_tobject_katcp(to);
-    return -1;
-  }
-
-  destroy_tobject_katcp(to);
-
   log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "deleted tobject <%s> from tag <%s>", a->a_key, t->t_name);
 
-  t->t_tobject_count--;
-
   return 0;
 }
 
@@ -661,7 +609,8 @@ struct kcs_sm_op *tag_actor_sm_setup_katcp(struct katcp_dispatch *d, struct kcs_
 int get_tag_set_sm_katcp(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_tobject *o)
 {
   struct katcp_tag *t;
-  int rtn, i;
+  struct katcp_tobject **vector;
+  int rtn, i, count;
 
   rtn = 0;
 
@@ -672,14 +621,14 @@ int get_tag_set_sm_katcp(struct katcp_dispatch *d, struct katcp_stack *stack, st
   if (t == NULL)
     return -1;
 
-  if (populate_tobjs_katcp(t) < 0)
-    return -1;
+  vector = snapshot_tag_katcp(d, t, &count);
   
-  for (i=0; i<__tcount; i++){
-    rtn += push_tobject_katcp(stack, copy_tobject_katcp(__tobjs[i]));
+  for (i=0; i<count; i++){
+    rtn += push_tobject_katcp(stack, copy_tobject_katcp(vector[i]));
   }
   
-  destroy_tobjs_katcp();
+  if (vector)
+    free(vector);
   
   return rtn;
 }
@@ -715,6 +664,12 @@ int relay_reply_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data
 
   } else {
     ptr = NULL;
+    /*no reply at all: make the waiting task see a failure*/
+    p = create_parse_katcl();
+    if (p){
+      add_string_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!relay");
+      add_string_parse_katcl(p, KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCP_FAIL);
+    }
   }
 
 
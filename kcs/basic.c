@@ -100,6 +100,13 @@ int script_wildcard_cmd(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
+  if(kb->b_workers){
+    i = run_script_pool_kcs(d, argc, path);
+    free(path);
+    destroy_kurl_katcp(name);
+    return i;
+  }
+
   n = find_notice_katcp(d, KCS_NOTICE_PYTHON);
   if(n != NULL){
     free(path);
@@ -186,6 +193,11 @@ void destroy_basic_kcs(struct katcp_dispatch *d, unsigned int mode)
     kb->b_parser = NULL;
   }
 
+  if (kb->b_workers != NULL){
+    stop_script_pool_kcs(d);
+    kb->b_workers = NULL;
+  }
+
   if (kb->b_pool_head != NULL){
     roachpool_destroy(d);
     kb->b_pool_head = NULL;
@@ -352,6 +364,7 @@ int setup_basic_kcs(struct katcp_dispatch *d, char *scripts, char **argv, int ar
   kb->b_scripts    = NULL;
   kb->b_parser     = NULL;
   kb->b_pool_head  = NULL;
+  kb->b_workers    = NULL;
   //kb->b_sms        = NULL;
   kb->b_argv       = argv;
   kb->b_argc       = argc;
@@ -381,7 +394,8 @@ int setup_basic_kcs(struct katcp_dispatch *d, char *scripts, char **argv, int ar
   result += register_flag_mode_katcp(d, NULL, "python script handler", &script_wildcard_cmd, KATCP_CMD_HIDDEN | KATCP_CMD_WILDCARD, KCS_MODE_BASIC);
   /*result += register_flag_mode_katcp(d, "?parser" , "ROACH Configuration file parser (?parser [load|save|get|set|list])", &parser_cmd, 0, KCS_MODE_BASIC);
   */
-  result += register_flag_mode_katcp(d, "?roach" , "Control the pool of roaches (?roach [add|del|start|stop|start-pool|stop-pool])", &roach_cmd, 0, KCS_MODE_BASIC);
+  result += register_flag_mode_katcp(d, "?roach" , "Control the pool of roaches (?roach [add|del|start|stop|start-pool|stop-pool|fanout])", &roach_cmd, 0, KCS_MODE_BASIC);
+  result += register_flag_mode_katcp(d, "?workers" , "run scripts on a pool of long-lived interpreters (?workers [count [program [arguments ...]]])", &workers_cmd, 0, KCS_MODE_BASIC);
   result += register_katcp(d, "?sm" , "Run a statemachine on a pool of roaches (?sm [[ping|connect] pool])", &statemachine_cmd);
   result += register_flag_mode_katcp(d, "?watchannounce" , "spawn the watch announce listener (?watchannounce port)", &watchannounce_cmd, 0, KCS_MODE_BASIC);
   /*result += register_flag_mode_katcp(d, "?k7-snap-shot" , "Grab a snap shot (?k7-snap-shot [antenna polarisation])", &k7_snap_shot_cmd, 0, KCS_MODE_BASIC);
@@ -0,0 +1,771 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sysexits.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <katcp.h>
+#include <katcl.h>
+#include <katpriv.h>
+
+#include "kcs.h"
+
+/*********************************[fanout]****************************************/
+
+/* every roach keeps one network job, opened on its first fan-out and
+ * reused until the connection drops. A request sent to a pool is copied to
+ * the job of each roach, the callbacks are registered on the template
+ * dispatch, so the requesting client may go away safely. The client waits
+ * on a notice of its own, woken once every roach has answered or timed out
+ */
+
+static int halt_roach_fanout_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct kcs_roach *kr;
+
+  kr = data;
+  if (kr == NULL)
+    return -1;
+
+#ifdef DEBUG
+  fprintf(stderr, "fanout: connection of roach %p ended\n", kr);
+#endif
+
+  kr->r_job  = NULL;
+  kr->r_halt = NULL;
+
+  return 0;
+}
+
+static struct katcp_job *link_roach_fanout_kcs(struct katcp_dispatch *d, struct kcs_roach *kr)
+{
+  struct katcp_notice *halt;
+  struct katcp_job *j;
+
+  if (kr->r_job)
+    return kr->r_job;
+
+  if (kr->kurl == NULL || kr->kurl->u_host == NULL)
+    return NULL;
+
+  halt = register_notice_katcp(d, NULL, 0, &halt_roach_fanout_kcs, kr);
+  if (halt == NULL)
+    return NULL;
+
+  j = network_name_connect_job_katcp(d, kr->kurl->u_host, kr->kurl->u_port, halt);
+  if (j == NULL){
+    remove_notice_katcp(d, halt, &halt_roach_fanout_kcs, kr);
+    return NULL;
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "fanout: connecting to %s:%d", kr->kurl->u_host, kr->kurl->u_port);
+
+  kr->r_job  = j;
+  kr->r_halt = halt;
+
+  return j;
+}
+
+void release_roach_links_kcs(struct katcp_dispatch *d, struct kcs_obj *o)
+{
+  struct katcp_dispatch *dl;
+  struct kcs_node *kn;
+  struct kcs_roach *kr;
+  int i;
+
+  if (o == NULL)
+    return;
+
+  dl = template_shared_katcp(d);
+
+  switch (o->tid){
+    case KCS_ID_NODE:
+      kn = o->payload;
+      if (kn == NULL)
+        return;
+      for (i=0; i<kn->childcount; i++)
+        release_roach_links_kcs(d, kn->children[i]);
+      break;
+
+    case KCS_ID_ROACH:
+      kr = o->payload;
+      if (kr == NULL)
+        return;
+      if (kr->r_halt){
+        remove_notice_katcp(dl, kr->r_halt, &halt_roach_fanout_kcs, kr);
+        kr->r_halt = NULL;
+      }
+      if (kr->r_job){
+        zap_job_katcp(dl, kr->r_job);
+        kr->r_job = NULL;
+      }
+      break;
+  }
+}
+
+static void destroy_fanout_kcs(struct kcs_fanout *f)
+{
+  unsigned int i;
+
+  if (f == NULL)
+    return;
+
+  if (f->f_slots){
+    for (i=0; i<f->f_count; i++){
+      if (f->f_slots[i].s_host)
+        free(f->f_slots[i].s_host);
+      if (f->f_slots[i].s_status)
+        free(f->f_slots[i].s_status);
+    }
+    free(f->f_slots);
+  }
+
+  free(f);
+}
+
+static int ms_fanout_kcs(char *buffer, unsigned int size, struct timeval *tv)
+{
+  return snprintf(buffer, size, "%lu.%03lu", (unsigned long)(tv->tv_sec * 1000) + (tv->tv_usec / 1000), (unsigned long)(tv->tv_usec % 1000));
+}
+
+static void complete_fanout_kcs(struct katcp_dispatch *d, struct kcs_fanout *f)
+{
+  struct kcs_fanout_slot *s;
+  struct katcl_parse *p;
+  struct timeval worst;
+  unsigned int i, ok;
+  char buffer[32];
+
+  if (f->f_done == NULL)
+    return;
+
+  ok = 0;
+  worst.tv_sec  = 0;
+  worst.tv_usec = 0;
+
+  for (i=0; i<f->f_count; i++){
+    s = &(f->f_slots[i]);
+    if (s->s_status && !strcmp(s->s_status, KATCP_OK))
+      ok++;
+    if (cmp_time_katcp(&(s->s_latency), &worst) > 0)
+      worst = s->s_latency;
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "fanout: %u of %u roaches answered ok", ok, f->f_count);
+
+  p = create_parse_katcl();
+  if (p){
+    add_string_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, KATCP_OK);
+    add_unsigned_long_parse_katcl(p, KATCP_FLAG_ULONG, ok);
+    add_unsigned_long_parse_katcl(p, KATCP_FLAG_ULONG, f->f_count);
+    ms_fanout_kcs(buffer, sizeof(buffer), &worst);
+    add_string_parse_katcl(p, KATCP_FLAG_STRING | ((f->f_count > 0) ? 0 : KATCP_FLAG_LAST), buffer);
+    for (i=0; i<f->f_count; i++){
+      s = &(f->f_slots[i]);
+      ms_fanout_kcs(buffer, sizeof(buffer), &(s->s_latency));
+      add_string_parse_katcl(p, KATCP_FLAG_STRING, s->s_host);
+      add_string_parse_katcl(p, KATCP_FLAG_STRING, s->s_status ? s->s_status : KATCP_FAIL);
+      add_string_parse_katcl(p, KATCP_FLAG_STRING | ((i + 1 < f->f_count) ? 0 : KATCP_FLAG_LAST), buffer);
+    }
+  }
+
+  wake_notice_katcp(d, f->f_done, p);
+  release_notice_katcp(d, f->f_done);
+  f->f_done = NULL;
+}
+
+static void settle_fanout_kcs(struct kcs_fanout_slot *s, char *status)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  sub_time_katcp(&(s->s_latency), &now, &(s->s_fanout->f_start));
+
+  s->s_status = strdup(status ? status : KATCP_FAIL);
+  s->s_done   = 1;
+
+  s->s_fanout->f_pending--;
+}
+
+static int reply_fanout_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct kcs_fanout_slot *s;
+  struct kcs_fanout *f;
+  struct katcl_parse *p;
+
+  s = data;
+  if (s == NULL)
+    return -1;
+
+  f = s->s_fanout;
+  f->f_refs--;
+
+  if (s->s_done == 0){
+    p = get_parse_notice_katcp(d, n);
+    settle_fanout_kcs(s, p ? get_string_parse_katcl(p, 1) : NULL);
+
+    if (f->f_pending == 0){
+      discharge_timer_katcp(d, f);
+      complete_fanout_kcs(d, f);
+    }
+  }
+
+  if ((f->f_refs == 0) && (f->f_done == NULL))
+    destroy_fanout_kcs(f);
+
+  return 0;
+}
+
+static int timeout_fanout_kcs(struct katcp_dispatch *d, void *data)
+{
+  struct kcs_fanout_slot *s;
+  struct kcs_fanout *f;
+  unsigned int i;
+
+  f = data;
+
+  for (i=0; i<f->f_count; i++){
+    s = &(f->f_slots[i]);
+    if (s->s_done == 0){
+      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "fanout: no reply from %s, dropping its connection", s->s_host);
+      settle_fanout_kcs(s, "timeout");
+      /* the reply callback of a zapped job still arrives, with a failure */
+      if (s->s_job)
+        zap_job_katcp(d, s->s_job);
+    }
+  }
+
+  complete_fanout_kcs(d, f);
+
+  if (f->f_refs == 0)
+    destroy_fanout_kcs(f);
+
+  return 0;
+}
+
+static int resume_fanout_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct katcl_parse *p;
+  unsigned int i, count;
+
+  p = get_parse_notice_katcp(d, n);
+  count = (p != NULL) ? get_count_parse_katcl(p) : 0;
+
+  if (count < 4){
+    prepend_reply_katcp(d);
+    append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, KATCP_FAIL);
+    resume_katcp(d);
+    return 0;
+  }
+
+  for (i=4; i+2<count; i+=3){
+    prepend_inform_katcp(d);
+    append_parameter_katcp(d, KATCP_FLAG_STRING, p, i);
+    append_parameter_katcp(d, KATCP_FLAG_STRING, p, i + 1);
+    append_parameter_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, p, i + 2);
+  }
+
+  prepend_reply_katcp(d);
+  for (i=0; i<4; i++){
+    append_parameter_katcp(d, (i < 3) ? KATCP_FLAG_STRING : (KATCP_FLAG_STRING | KATCP_FLAG_LAST), p, i);
+  }
+
+  resume_katcp(d);
+
+  return 0;
+}
+
+static unsigned int collect_fanout_kcs(struct kcs_obj *o, struct kcs_obj **vector, unsigned int index)
+{
+  struct kcs_node *kn;
+  int i;
+
+  switch (o->tid){
+    case KCS_ID_NODE:
+      kn = o->payload;
+      if (kn == NULL)
+        break;
+      for (i=0; i<kn->childcount; i++)
+        index = collect_fanout_kcs(kn->children[i], vector, index);
+      break;
+
+    case KCS_ID_ROACH:
+      if (vector)
+        vector[index] = o;
+      index++;
+      break;
+  }
+
+  return index;
+}
+
+static struct katcl_parse *request_fanout_kcs(struct katcp_dispatch *d, int argc)
+{
+  struct katcl_parse *px;
+  char *name, *ptr;
+  int i, last, len;
+
+  name = arg_string_katcp(d, 3);
+  if (name == NULL)
+    return NULL;
+
+  px = create_referenced_parse_katcl();
+  if (px == NULL)
+    return NULL;
+
+  last = (argc > 4) ? 0 : KATCP_FLAG_LAST;
+
+  if (name[0] == KATCP_REQUEST){
+    add_string_parse_katcl(px, KATCP_FLAG_FIRST | KATCP_FLAG_STRING | last, name);
+  } else {
+    len = strlen(name) + 2;
+    ptr = malloc(len);
+    if (ptr == NULL){
+      destroy_parse_katcl(px);
+      return NULL;
+    }
+    snprintf(ptr, len, "%c%s", KATCP_REQUEST, name);
+    add_string_parse_katcl(px, KATCP_FLAG_FIRST | KATCP_FLAG_STRING | last, ptr);
+    free(ptr);
+  }
+
+  for (i=4; i<argc; i++){
+    ptr = arg_string_katcp(d, i);
+    add_string_parse_katcl(px, KATCP_FLAG_STRING | ((i + 1 < argc) ? 0 : KATCP_FLAG_LAST), ptr ? ptr : "");
+  }
+
+  return px;
+}
+
+int roachpool_fanout(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_dispatch *dl;
+  struct kcs_fanout *f;
+  struct kcs_fanout_slot *s;
+  struct kcs_obj *ko, **vector;
+  struct kcs_roach *kr;
+  struct katcp_job *j;
+  struct katcl_parse *px;
+  struct timeval tv, delta;
+  unsigned int i, count;
+  char *target;
+
+  target = arg_string_katcp(d, 2);
+  ko = roachpool_get_obj_by_name_kcs(d, target);
+  if (ko == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fanout: no pool or roach called %s", target ? target : "<null>");
+    return KATCP_RESULT_FAIL;
+  }
+
+  count = collect_fanout_kcs(ko, NULL, 0);
+  if (count == 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fanout: %s contains no roaches", target);
+    return KATCP_RESULT_FAIL;
+  }
+
+  vector = malloc(sizeof(struct kcs_obj *) * count);
+  if (vector == NULL)
+    return KATCP_RESULT_FAIL;
+  collect_fanout_kcs(ko, vector, 0);
+
+  px = request_fanout_kcs(d, argc);
+  if (px == NULL){
+    free(vector);
+    return KATCP_RESULT_FAIL;
+  }
+
+  f = malloc(sizeof(struct kcs_fanout));
+  if (f == NULL){
+    destroy_parse_katcl(px);
+    free(vector);
+    return KATCP_RESULT_FAIL;
+  }
+
+  f->f_slots   = calloc(count, sizeof(struct kcs_fanout_slot));
+  f->f_count   = count;
+  f->f_pending = count;
+  f->f_refs    = 0;
+  f->f_done    = NULL;
+
+  if (f->f_slots == NULL){
+    destroy_fanout_kcs(f);
+    destroy_parse_katcl(px);
+    free(vector);
+    return KATCP_RESULT_FAIL;
+  }
+
+  for (i=0; i<count; i++){
+    f->f_slots[i].s_fanout = f;
+    f->f_slots[i].s_host   = strdup(vector[i]->name);
+    if (f->f_slots[i].s_host == NULL){
+      destroy_fanout_kcs(f);
+      destroy_parse_katcl(px);
+      free(vector);
+      return KATCP_RESULT_FAIL;
+    }
+  }
+
+  f->f_done = register_notice_katcp(d, NULL, 0, &resume_fanout_kcs, NULL);
+  if (f->f_done == NULL){
+    destroy_fanout_kcs(f);
+    destroy_parse_katcl(px);
+    free(vector);
+    return KATCP_RESULT_FAIL;
+  }
+  hold_notice_katcp(d, f->f_done);
+
+  dl = template_shared_katcp(d);
+
+  gettimeofday(&(f->f_start), NULL);
+
+  for (i=0; i<count; i++){
+    s  = &(f->f_slots[i]);
+    kr = vector[i]->payload;
+
+    j = (kr != NULL) ? link_roach_fanout_kcs(dl, kr) : NULL;
+    if (j == NULL){
+      settle_fanout_kcs(s, "unreachable");
+      continue;
+    }
+
+    if (submit_to_job_katcp(dl, j, copy_parse_katcl(px), NULL, &reply_fanout_kcs, s) < 0){
+      settle_fanout_kcs(s, "unreachable");
+      continue;
+    }
+
+    s->s_job = j;
+    f->f_refs++;
+  }
+
+  destroy_parse_katcl(px);
+  free(vector);
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "fanout: issued %s to %u of %u roaches in %s", arg_string_katcp(d, 3), f->f_refs, count, target);
+
+  if (f->f_pending == 0){
+    complete_fanout_kcs(dl, f);
+    if (f->f_refs == 0)
+      destroy_fanout_kcs(f);
+    return KATCP_RESULT_PAUSE;
+  }
+
+  delta.tv_sec  = KCS_FANOUT_TIMEOUT / 1000;
+  delta.tv_usec = (KCS_FANOUT_TIMEOUT % 1000) * 1000;
+  add_time_katcp(&tv, &(f->f_start), &delta);
+
+  if (register_at_tv_katcp(dl, &tv, &timeout_fanout_kcs, f) < 0){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "fanout: unable to register timeout, waiting on connections instead");
+  }
+
+  return KATCP_RESULT_PAUSE;
+}
+
+#ifdef KCS_TEST_FANOUT
+/* starts a farm of fake roaches on consecutive loopback ports, of which a
+ * few never listen and a few never answer, and a kcs instance holding them
+ * all in one pool. Then checks that a fan-out reports each host correctly,
+ * and compares it to asking the roaches one at a time:
+ * ./test-fanout [roaches [port]]
+ */
+
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <netc.h>
+
+#define FANOUT_TEST_DEAD    37      /* every nth roach does not listen */
+#define FANOUT_TEST_STALL   41      /* every nth roach never answers */
+
+static int dead_fanout_kcs(unsigned int i)
+{
+  return (i % FANOUT_TEST_DEAD) == (FANOUT_TEST_DEAD - 1);
+}
+
+static int stall_fanout_kcs(unsigned int i)
+{
+  return (!dead_fanout_kcs(i)) && ((i % FANOUT_TEST_STALL) == (FANOUT_TEST_STALL - 1));
+}
+
+static void run_farm_fanout_kcs(unsigned int count, unsigned int base, int ready)
+{
+  struct katcl_line *lines[FD_SETSIZE];
+  int owner[FD_SETSIZE];
+  int *lfd;
+  unsigned int i;
+  int fd, nfd, mfd, result;
+  fd_set fsr;
+  char *name;
+
+  lfd = malloc(sizeof(int) * count);
+  if (lfd == NULL)
+    exit(EX_OSERR);
+
+  for (fd=0; fd<FD_SETSIZE; fd++){
+    lines[fd] = NULL;
+    owner[fd] = (-1);
+  }
+
+  for (i=0; i<count; i++){
+    lfd[i] = (-1);
+    if (dead_fanout_kcs(i))
+      continue;
+    lfd[i] = net_listen("127.0.0.1", base + i, 0);
+    if (lfd[i] < 0 || lfd[i] >= FD_SETSIZE){
+      fprintf(stderr, "farm: unable to listen on port %u: %s\n", base + i, strerror(errno));
+      exit(EX_OSERR);
+    }
+  }
+
+  if (write(ready, "r", 1) != 1)
+    exit(EX_OSERR);
+  close(ready);
+
+  for (;;){
+    FD_ZERO(&fsr);
+    mfd = 0;
+    for (i=0; i<count; i++){
+      if (lfd[i] >= 0){
+        FD_SET(lfd[i], &fsr);
+        if (lfd[i] > mfd)
+          mfd = lfd[i];
+      }
+    }
+    for (fd=0; fd<FD_SETSIZE; fd++){
+      if (lines[fd]){
+        FD_SET(fd, &fsr);
+        if (fd > mfd)
+          mfd = fd;
+      }
+    }
+
+    result = select(mfd + 1, &fsr, NULL, NULL, NULL);
+    if (result < 0){
+      if (errno == EINTR)
+        continue;
+      exit(EX_OSERR);
+    }
+
+    for (i=0; i<count; i++){
+      if (lfd[i] >= 0 && FD_ISSET(lfd[i], &fsr)){
+        nfd = accept(lfd[i], NULL, NULL);
+        if (nfd >= 0 && nfd < FD_SETSIZE){
+          lines[nfd] = create_katcl(nfd);
+          owner[nfd] = i;
+        } else if (nfd >= 0){
+          close(nfd);
+        }
+      }
+    }
+
+    for (fd=0; fd<FD_SETSIZE; fd++){
+      if (lines[fd] == NULL || !FD_ISSET(fd, &fsr))
+        continue;
+
+      if (read_katcl(lines[fd]) != 0){
+        destroy_katcl(lines[fd], 1);
+        lines[fd] = NULL;
+        continue;
+      }
+
+      while (have_katcl(lines[fd]) > 0){
+        name = arg_string_katcl(lines[fd], 0);
+        if (name == NULL || name[0] != KATCP_REQUEST || stall_fanout_kcs(owner[fd]))
+          continue;
+        append_args_katcl(lines[fd], KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "%c%s", KATCP_REPLY, name + 1);
+        append_string_katcl(lines[fd], KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCP_OK);
+      }
+
+      while ((result = write_katcl(lines[fd])) == 0);
+    }
+  }
+}
+
+static double request_fanout_test_kcs(struct katcl_line *l, char *target, unsigned int *ok, unsigned int *timeout, unsigned int *failed)
+{
+  struct timeval start, stop, delta;
+  char *name, *status;
+  fd_set fsr;
+  int fd;
+
+  gettimeofday(&start, NULL);
+
+  append_string_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?roach");
+  append_string_katcl(l, KATCP_FLAG_STRING, "fanout");
+  append_string_katcl(l, KATCP_FLAG_STRING, target);
+  append_string_katcl(l, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "watchdog");
+  while (write_katcl(l) == 0);
+
+  fd = fileno_katcl(l);
+
+  for (;;){
+    while (have_katcl(l) > 0){
+      name = arg_string_katcl(l, 0);
+      if (name == NULL)
+        continue;
+      if (!strcmp(name, "#roach") && arg_count_katcl(l) == 4){
+        status = arg_string_katcl(l, 2);
+        if (!strcmp(status, KATCP_OK)){
+          (*ok)++;
+        } else if (!strcmp(status, "timeout")){
+          (*timeout)++;
+        } else {
+          (*failed)++;
+        }
+      } else if (!strcmp(name, "!roach")){
+        gettimeofday(&stop, NULL);
+        sub_time_katcp(&delta, &stop, &start);
+        status = arg_string_katcl(l, 1);
+        if (status == NULL || strcmp(status, KATCP_OK))
+          return -1.0;
+        return delta.tv_sec + (delta.tv_usec / 1000000.0);
+      }
+    }
+
+    FD_ZERO(&fsr);
+    FD_SET(fd, &fsr);
+    if (select(fd + 1, &fsr, NULL, NULL, NULL) < 0 && errno != EINTR)
+      return -1.0;
+
+    if (read_katcl(l) != 0)
+      return -1.0;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  struct katcp_dispatch *d;
+  struct katcl_line *l;
+  unsigned int count, base, i, ok, timeout, failed, dead, stalled;
+  int fds[2], sp[2], status, errors;
+  pid_t farm, server;
+  char url[64], ip[32], buffer[1];
+  double cold, warm, serial, t;
+
+  count = (argc > 1) ? strtoul(argv[1], NULL, 0) : 300;
+  base  = (argc > 2) ? strtoul(argv[2], NULL, 0) : 17500;
+
+  dead = 0;
+  stalled = 0;
+  for (i=0; i<count; i++){
+    if (dead_fanout_kcs(i))
+      dead++;
+    if (stall_fanout_kcs(i))
+      stalled++;
+  }
+
+  if (pipe(fds) < 0)
+    return 1;
+
+  fflush(stdout);
+
+  farm = fork();
+  if (farm < 0)
+    return 1;
+  if (farm == 0){
+    close(fds[0]);
+    run_farm_fanout_kcs(count, base, fds[1]);
+    exit(EX_OK);
+  }
+
+  close(fds[1]);
+  if (read(fds[0], buffer, 1) != 1){
+    fprintf(stderr, "fake roaches failed to start\n");
+    kill(farm, SIGTERM);
+    return 1;
+  }
+  close(fds[0]);
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) < 0)
+    return 1;
+
+  server = fork();
+  if (server < 0)
+    return 1;
+  if (server == 0){
+    close(sp[1]);
+
+    d = startup_katcp();
+    if (d == NULL)
+      exit(EX_OSERR);
+
+    if (setup_basic_kcs(d, ".", argv, argc) < 0 || enter_name_mode_katcp(d, KCS_MODE_BASIC_NAME, NULL) < 0)
+      exit(EX_SOFTWARE);
+
+    for (i=0; i<count; i++){
+      snprintf(url, sizeof(url), "katcp://127.0.0.1:%u/", base + i);
+      snprintf(ip, sizeof(ip), "10.0.%u.%u", i / 256, i % 256);
+      if (add_roach_to_pool_kcs(d, (dead_fanout_kcs(i) || stall_fanout_kcs(i)) ? "broken" : "farm", url, ip) != KCS_OK)
+        exit(EX_SOFTWARE);
+    }
+
+    run_pipe_server_katcp(d, NULL, sp[0]);
+    shutdown_katcp(d);
+
+    exit(EX_OK);
+  }
+
+  close(sp[0]);
+
+  l = create_katcl(sp[1]);
+  if (l == NULL)
+    return 1;
+
+  printf("%u fake roaches, %u not listening, %u not answering\n", count, dead, stalled);
+
+  errors = 0;
+
+  /* the root holds both pools, the broken one holds the roaches which fail */
+  ok = timeout = failed = 0;
+  cold = request_fanout_test_kcs(l, "root", &ok, &timeout, &failed);
+  printf("cold fan-out to all: %.3fs, ok=%u timeout=%u failed=%u\n", cold, ok, timeout, failed);
+  if (cold < 0 || ok != count - dead - stalled || timeout != stalled || failed != dead)
+    errors++;
+
+  ok = timeout = failed = 0;
+  warm = request_fanout_test_kcs(l, "farm", &ok, &timeout, &failed);
+  printf("warm fan-out to working roaches: %.3fs, ok=%u timeout=%u failed=%u\n", warm, ok, timeout, failed);
+  if (warm < 0 || ok != count - dead - stalled || timeout != 0 || failed != 0)
+    errors++;
+
+  ok = timeout = failed = 0;
+  serial = 0.0;
+  for (i=0; i<count; i++){
+    if (dead_fanout_kcs(i) || stall_fanout_kcs(i))
+      continue;
+    /* address the roach by ip, resolved through the index */
+    snprintf(ip, sizeof(ip), "10.0.%u.%u", i / 256, i % 256);
+    t = request_fanout_test_kcs(l, ip, &ok, &timeout, &failed);
+    if (t < 0){
+      errors++;
+      break;
+    }
+    serial += t;
+  }
+  printf("one at a time: %.3fs, ok=%u timeout=%u failed=%u\n", serial, ok, timeout, failed);
+  if (ok != count - dead - stalled)
+    errors++;
+
+  if (warm > 0)
+    printf("fan-out speedup over one at a time: %.1fx\n", serial / warm);
+
+  destroy_katcl(l, 1);
+
+  kill(server, SIGTERM);
+  kill(farm, SIGTERM);
+  waitpid(server, &status, 0);
+  waitpid(farm, &status, 0);
+
+  printf("%s\n", errors ? "FAILED" : "ok");
+
+  return errors ? 1 : 0;
+}
+#endif
@@ -37,6 +37,8 @@ struct kcs_basic
   struct p_parser *b_parser;
   struct kcs_obj *b_pool_head;
 
+  struct kcs_script_pool *b_workers;
+
   struct avl_tree *b_ds;
 };
 
@@ -102,6 +104,35 @@ struct e_state {
 
 void execpy_do(char *filename, char **argv);
 
+/* scripts may run on a pool of long-lived interpreters instead of a fresh
+ * process each, see kcsworker.py for the other end. A worker is retired
+ * rather than freed while requests are still outstanding on it
+ */
+
+#define KCS_WORKER_PROGRAM  "kcsworker.py"
+#define KCS_WORKER_MAX      64
+
+struct kcs_worker {
+  struct katcp_job *w_job;
+  struct katcp_notice *w_halt;
+  unsigned int w_index;
+  unsigned int w_busy;
+  unsigned long w_runs;
+  unsigned long w_spawns;
+  int w_retired;
+};
+
+struct kcs_script_pool {
+  struct kcs_worker **p_workers;
+  unsigned int p_count;
+  char **p_argv;
+};
+
+int script_wildcard_resume(struct katcp_dispatch *d, struct katcp_notice *n, void *data);
+int run_script_pool_kcs(struct katcp_dispatch *d, int argc, char *path);
+void stop_script_pool_kcs(struct katcp_dispatch *d);
+int workers_cmd(struct katcp_dispatch *d, int argc);
+
 #define KCS_ID_ROACH        2 
 #define KCS_ID_NODE         1
 #define KCS_ID_GENERIC      0
@@ -116,9 +147,35 @@ struct kcs_obj {
   void *payload;
 };
 
+/* the root node keeps chained hash indexes over the whole tree, one each
+ * for object names, roach ips and roach macs. Keys point into the objects
+ * themselves, so an object has to be unindexed before it is freed
+ */
+
+#define KCS_INDEX_NAME      0
+#define KCS_INDEX_IP        1
+#define KCS_INDEX_MAC       2
+#define KCS_INDEX_KINDS     3
+
+#define KCS_INDEX_INITIAL   64      /* buckets, a power of two */
+
+struct kcs_index_entry {
+  char *e_key;
+  struct kcs_obj *e_obj;
+  struct kcs_index_entry *e_next;
+};
+
+struct kcs_index {
+  struct kcs_index_entry **i_buckets;
+  unsigned int i_mask;
+  unsigned int i_count;
+};
+
 struct kcs_node {
   struct kcs_obj **children;
   int childcount;
+
+  struct kcs_index *n_index[KCS_INDEX_KINDS];
 };
 
 struct kcs_roach {
@@ -129,6 +186,35 @@ struct kcs_roach {
   struct timeval r_seen;
 
   struct katcp_acquire *r_acquire;
+
+  struct katcp_job *r_job;          /* persistent fan-out connection */
+  struct katcp_notice *r_halt;
+};
+
+/* one request issued to every roach below a pool object, answered as a
+ * #roach inform per host and a single reply once all have been heard from
+ */
+
+#ifndef KCS_FANOUT_TIMEOUT
+#define KCS_FANOUT_TIMEOUT  5000    /* ms before a silent roach is dropped */
+#endif
+
+struct kcs_fanout_slot {
+  struct kcs_fanout *s_fanout;
+  struct katcp_job *s_job;
+  char *s_host;
+  char *s_status;
+  struct timeval s_latency;
+  int s_done;
+};
+
+struct kcs_fanout {
+  struct kcs_fanout_slot *f_slots;
+  unsigned int f_count;
+  unsigned int f_pending;           /* slots without a status */
+  unsigned int f_refs;              /* job callbacks still outstanding */
+  struct timeval f_start;
+  struct katcp_notice *f_done;
 };
 
 int roach_cmd(struct katcp_dispatch *d, int argc);
@@ -146,6 +232,11 @@ int mod_roach_to_new_pool(struct kcs_obj *root, char *pool, char *hostname);
 int roachpool_count_kcs(struct katcp_dispatch *d);
 int update_sensor_for_roach_kcs(struct katcp_dispatch *d, struct kcs_obj *ko, int val);
 int add_sensor_to_roach_kcs(struct katcp_dispatch *d, struct kcs_obj *ko);
+struct kcs_obj *find_index_kcs(struct kcs_obj *root, int kind, char *key);
+struct kcs_obj *root_of_obj_kcs(struct kcs_obj *o);
+
+int roachpool_fanout(struct katcp_dispatch *d, int argc);
+void release_roach_links_kcs(struct katcp_dispatch *d, struct kcs_obj *o);
 
 #define STATEMACHINE_SCHEDULER_NOTICE   "<kcs_scheduler>"
 
@@ -194,6 +285,12 @@ int add_sensor_to_roach_kcs(struct katcp_dispatch *d, struct kcs_obj *ko);
 #define PROCESS_MASTER                  0x1
 #define PROCESS_SLAVE                   0x2
 
+#define KCS_SCHED_QUEUE                 64      /* initial ready queue size */
+#define KCS_SCHED_SLICE                 64      /* steps a task runs before it yields */
+#define KCS_SCHED_CHECK                 16      /* tasks run between clock checks */
+#define KCS_SCHED_BUDGET                10000   /* usec per main loop iteration */
+#define KCS_SM_STACK                    32      /* value stack size of compiled tasks */
+
 struct katcp_module {
   char *m_name;
   void *m_handle;
@@ -210,6 +307,38 @@ struct kcs_sched_task {
   struct kcs_sm_state *t_pc;
   
   int t_rtn;
+
+  int t_parked;
+  int t_resume;
+  struct katcp_notice *t_notice;
+  struct katcp_notice *t_done;
+  struct kcs_scheduler *t_sched;
+
+  struct kcs_sm_program *t_prog;
+  int t_pc_i;
+};
+
+struct kcs_scheduler {
+  struct kcs_sched_task **s_ready;
+  unsigned int s_head;
+  unsigned int s_count;
+  unsigned int s_size;
+
+  int s_running;
+  unsigned long s_budget;
+  struct katcp_notice *s_notice;
+
+  unsigned long s_tasks;
+  unsigned long s_edges;
+  unsigned long s_ops;
+  unsigned long s_runs;
+  unsigned long s_slices;
+  unsigned long s_deferred;
+
+  struct kcs_sm_program **s_programs;
+  int s_program_count;
+
+  unsigned long s_serial;
 };
 
 struct kcs_sm {
@@ -236,6 +365,41 @@ struct kcs_sm_edge {
   int (*e_call)(struct katcp_dispatch *, struct katcp_notice *, void *);
 };
 
+/* a compiled graph: states refer to each other by index, all ops and edges
+ * sit in two arrays, a null op call marks the point where the next edge is tried */
+struct kcs_sm_pop {
+  int (*p_call)(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_tobject *o);
+  struct katcp_tobject *p_tobject;
+};
+
+struct kcs_sm_pedge {
+  int (*e_call)(struct katcp_dispatch *, struct katcp_notice *, void *);
+  int e_next;
+};
+
+struct kcs_sm_pstate {
+  char *s_name;
+  int s_op;
+  int s_op_count;
+  int s_edge;
+  int s_edge_count;
+};
+
+struct kcs_sm_program {
+  char *p_name;
+  int p_refs;
+  int p_stack;
+
+  struct kcs_sm_pstate *p_states;
+  int p_state_count;
+
+  struct kcs_sm_pop *p_ops;
+  int p_op_count;
+
+  struct kcs_sm_pedge *p_edges;
+  int p_edge_count;
+};
+
 int *create_integer_type_kcs(int val);
 int init_statemachine_base_kcs(struct katcp_dispatch *d);
 
@@ -247,6 +411,11 @@ struct kcs_sm_op *create_sm_op_kcs(int (*call)(struct katcp_dispatch *d, struct
 struct kcs_sm_edge *create_sm_edge_kcs(struct kcs_sm_state *s_next, int (*call)(struct katcp_dispatch *d, struct katcp_notice *n, void *data));
 
 int start_process_kcs(struct katcp_dispatch *d, char *startnode, struct katcp_tobject *to, int flags);
+struct kcs_scheduler *get_sched_kcs(struct katcp_dispatch *d);
+int run_sched_kcs(struct katcp_dispatch *d, struct kcs_scheduler *ks);
+struct kcs_sm_program *compile_program_kcs(struct katcp_dispatch *d, char *startnode, int stack);
+void release_program_kcs(struct kcs_sm_program *p);
+int forget_programs_kcs(struct katcp_dispatch *d);
 int trigger_edge_process_kcs(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_tobject *to);
 
 int init_actor_tag_katcp(struct katcp_dispatch *d);
@@ -266,6 +435,7 @@ struct katcp_actor {
 
   void *a_tag_root;
   int a_tag_count;
+  int a_id; /* position in the katcp member index, -1 until tagged */
 };
 
 struct katcp_actor *create_actor_type_katcp(struct katcp_dispatch *d, char *str, struct katcp_job *j, struct katcp_notice *n, void *data, char *datatype);
@@ -29,13 +29,14 @@
 void usage(char *app)
 {
   printf("Usage: %s" 
-  " [-m mode] [-p network-port] [-s script-directory]\n", app);
+  " [-m mode] [-p network-port] [-s script-directory] [-j journal-directory]\n", app);
 
   printf("-m mode          mode to enter at startup\n");
   printf("-p network-port  network port to listen on\n");
   printf("-s script-dir    directory to load scripts from\n");
   printf("-i init-file     file containing commands to run at startup\n");
   printf("-l log-file      log file name\n");
+  printf("-j journal-dir   keep the database persistent in this directory\n");
   printf("-f               run in foreground (default is background)\n");
 
 }
@@ -47,7 +48,7 @@ int main(int argc, char **argv)
   struct utsname un;
   int status;
   int i, j, c, foreground, lfd;
-  char *port, *scripts, *mode, *init, *lfile;
+  char *port, *scripts, *mode, *init, *lfile, *journal;
   char uname_buffer[UNAME_BUFFER];
   time_t now;
 
@@ -56,6 +57,7 @@ int main(int argc, char **argv)
   mode = KCS_MODE_BASIC_NAME;
   init = NULL;
   lfile = KCS_LOGFILE;
+  journal = NULL;
   foreground = KCS_FOREGROUND;
 
   i = 1;
@@ -85,6 +87,7 @@ int main(int argc, char **argv)
         case 's' :
         case 'p' :
         case 'i' :
+        case 'j' :
           j++;
           if (argv[i][j] == '\0') {
             j = 0;
@@ -111,6 +114,9 @@ int main(int argc, char **argv)
             case 'l':
               lfile = argv[i] + j;  
               break;
+            case 'j' :
+              journal = argv[i] + j;
+              break;
           }
           i++;
           j = 1;
@@ -160,6 +166,13 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  if(journal){
+    if(open_journal_katcp(d, journal, 0) < 0){
+      fprintf(stderr, "%s: unable to load journal from %s\n", argv[0], journal);
+      return 1;
+    }
+  }
+
   /* mode from command line */
   if(mode){
     if(enter_name_mode_katcp(d, mode, NULL) < 0){
@@ -0,0 +1,189 @@
+#!/usr/bin/env python
+# (c) 2011 SKA SA
+# Released under the GNU GPLv3 - see COPYING
+
+# A long-lived script runner for kcs. It speaks katcp on its standard
+# input and output and accepts
+#
+#   ?run path [arguments ...]
+#
+# for which it runs the script, relays every line the script writes as a
+# #log inform (lines which already are informs are passed through), and
+# answers !run ok or !run fail. Python scripts run inside this interpreter,
+# so modules they import stay loaded between runs, anything else is started
+# as a subprocess.
+
+import os
+import sys
+import time
+import runpy
+import traceback
+import subprocess
+
+ESCAPES = {'\\': '\\\\', ' ': '\\_', '\n': '\\n', '\r': '\\r', '\t': '\\t', '\0': '\\0', '\x1b': '\\e'}
+UNESCAPES = {'\\': '\\', '_': ' ', 'n': '\n', 'r': '\r', 't': '\t', '0': '\0', 'e': '\x1b', '@': ''}
+
+def escape(s):
+  if s == '':
+    return '\\@'
+  return ''.join([ESCAPES.get(c, c) for c in s])
+
+def unescape(s):
+  out = []
+  i = 0
+  while i < len(s):
+    if s[i] == '\\' and i + 1 < len(s):
+      out.append(UNESCAPES.get(s[i + 1], s[i + 1]))
+      i += 2
+    else:
+      out.append(s[i])
+      i += 1
+  return ''.join(out)
+
+class Channel:
+  def __init__(self):
+    # keep the katcp channel to ourselves, stray writes to fd 1 go to stderr
+    self.out = os.fdopen(os.dup(1), 'w')
+    os.dup2(2, 1)
+
+  def send(self, *fields):
+    self.out.write(' '.join([fields[0]] + [escape(str(f)) for f in fields[1:]]) + '\n')
+    self.out.flush()
+
+  def log(self, level, name, text):
+    self.send('#log', level, '%.3f' % time.time(), name, text)
+
+  def relay(self, name, line):
+    line = line.rstrip('\r\n')
+    if line.startswith('#'):
+      self.out.write(line + '\n')
+      self.out.flush()
+    elif line:
+      self.log('info', name, line)
+
+class Capture:
+  def __init__(self, channel, name):
+    self.channel = channel
+    self.name = name
+    self.partial = ''
+
+  def write(self, data):
+    self.partial += data
+    while '\n' in self.partial:
+      line, self.partial = self.partial.split('\n', 1)
+      self.channel.relay(self.name, line)
+
+  def flush(self):
+    pass
+
+  def close(self):
+    if self.partial:
+      self.channel.relay(self.name, self.partial)
+      self.partial = ''
+
+def is_python(path):
+  if path.endswith('.py'):
+    return True
+  try:
+    f = open(path)
+    try:
+      first = f.readline()
+    finally:
+      f.close()
+  except (IOError, OSError, UnicodeDecodeError):
+    return False
+  return first.startswith('#!') and 'python' in first
+
+def compiles(path):
+  # scripts written for another version of the interpreter get their own process
+  try:
+    f = open(path)
+    try:
+      compile(f.read(), path, 'exec')
+    finally:
+      f.close()
+  except (SyntaxError, ValueError, TypeError, IOError, OSError, UnicodeDecodeError):
+    return False
+  return True
+
+def run_inline(channel, path, args):
+  name = os.path.basename(path)
+  capture = Capture(channel, name)
+  saved = (sys.argv, sys.stdout, list(sys.path), os.getcwd())
+  sys.argv = [path] + args
+  sys.stdout = capture
+  sys.path.insert(0, os.path.dirname(os.path.abspath(path)))
+  try:
+    try:
+      runpy.run_path(path, run_name='__main__')
+      code = 0
+    except SystemExit:
+      code = sys.exc_info()[1].code
+      if code is None:
+        code = 0
+      elif not isinstance(code, int):
+        capture.write('%s\n' % code)
+        code = 1
+    except Exception:
+      for line in traceback.format_exc().splitlines():
+        channel.log('error', name, line)
+      code = 1
+  finally:
+    capture.close()
+    sys.argv, sys.stdout, sys.path[:], cwd = saved
+    os.chdir(cwd)
+  return code
+
+def run_process(channel, path, args):
+  name = os.path.basename(path)
+  devnull = open(os.devnull, 'r')
+  try:
+    child = subprocess.Popen([path] + args, stdin=devnull, stdout=subprocess.PIPE, universal_newlines=True)
+  except OSError:
+    channel.log('error', name, 'unable to run %s: %s' % (path, sys.exc_info()[1]))
+    devnull.close()
+    return 1
+  for line in iter(child.stdout.readline, ''):
+    channel.relay(name, line)
+  child.stdout.close()
+  devnull.close()
+  return child.wait()
+
+def run(channel, fields):
+  if len(fields) < 2:
+    return 'fail', 'usage'
+  path, args = fields[1], fields[2:]
+  if not os.path.isfile(path):
+    return 'fail', 'missing'
+  if is_python(path) and compiles(path):
+    code = run_inline(channel, path, args)
+  else:
+    code = run_process(channel, path, args)
+  if code == 0:
+    return 'ok',
+  return 'fail', '%d' % code
+
+def main():
+  channel = Channel()
+  while True:
+    line = sys.stdin.readline()
+    if not line:
+      break
+    line = line.rstrip('\r\n')
+    if not line.startswith('?'):
+      continue
+    fields = [unescape(f) for f in line.split(' ') if f != '']
+    request = fields[0][1:]
+    if request == 'run':
+      result = run(channel, fields)
+    elif request == 'watchdog':
+      result = 'ok',
+    elif request == 'halt':
+      channel.send('!halt', 'ok')
+      break
+    else:
+      result = 'fail', 'unknown request'
+    channel.send('!' + request, *result)
+
+if __name__ == '__main__':
+  main()
@@ -52,6 +52,7 @@ struct kcs_obj *new_kcs_obj(struct kcs_obj *parent, char *name, int tid, void *p
 struct kcs_obj *new_kcs_node_obj(struct kcs_obj *parent, char *name){
   struct kcs_obj *ko;
   struct kcs_node *kn;
+  int i;
   ko = NULL;
   kn = NULL;
   kn = malloc(sizeof(struct kcs_node));
@@ -59,6 +60,8 @@ struct kcs_obj *new_kcs_node_obj(struct kcs_obj *parent, char *name){
     return NULL;
   kn->children   = NULL;
   kn->childcount = 0;
+  for (i=0; i<KCS_INDEX_KINDS; i++)
+    kn->n_index[i] = NULL;
   ko = new_kcs_obj(parent, name, KCS_ID_NODE, kn);
   return ko;
 }
@@ -80,6 +83,9 @@ struct kcs_obj *new_kcs_roach_obj(struct kcs_obj *parent, char *url, char *ip, c
   else
     kr->mac    = NULL;
   kr->kurl     = create_kurl_from_string_katcp(url);
+  kr->r_acquire = NULL;
+  kr->r_job     = NULL;
+  kr->r_halt    = NULL;
  /*
   kr->ksm      = NULL;
   kr->ksmcount = 0;
@@ -100,9 +106,232 @@ struct kcs_obj *new_kcs_roach_obj(struct kcs_obj *parent, char *url, char *ip, c
   kr->kurl->u_use++;
   return ko;
 }
+void destroy_tree(struct kcs_obj *o);
+
+/*Indexes******************************************************************************************/
+
+static unsigned int hash_index_kcs(char *key)
+{
+  unsigned int h;
+
+  /* fnv-1a */
+  for (h = 2166136261U; *key != '\0'; key++){
+    h ^= (unsigned char) *key;
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+static struct kcs_index *create_index_kcs()
+{
+  struct kcs_index *ki;
+
+  ki = malloc(sizeof(struct kcs_index));
+  if (ki == NULL)
+    return NULL;
+
+  ki->i_buckets = calloc(KCS_INDEX_INITIAL, sizeof(struct kcs_index_entry *));
+  if (ki->i_buckets == NULL){
+    free(ki);
+    return NULL;
+  }
+
+  ki->i_mask  = KCS_INDEX_INITIAL - 1;
+  ki->i_count = 0;
+
+  return ki;
+}
+
+static void destroy_index_kcs(struct kcs_index *ki)
+{
+  struct kcs_index_entry *e, *en;
+  unsigned int i;
+
+  if (ki == NULL)
+    return;
+
+  for (i=0; i<=ki->i_mask; i++){
+    for (e = ki->i_buckets[i]; e != NULL; e = en){
+      en = e->e_next;
+      free(e);
+    }
+  }
+
+  free(ki->i_buckets);
+  free(ki);
+}
+
+static int grow_index_kcs(struct kcs_index *ki)
+{
+  struct kcs_index_entry **vector, *e, *en, **tail;
+  unsigned int i, size, mask;
+
+  size = (ki->i_mask + 1) * 2;
+  mask = size - 1;
+
+  vector = calloc(size, sizeof(struct kcs_index_entry *));
+  if (vector == NULL)
+    return -1;
+
+  /* entries keep their relative order, so duplicate keys still resolve to the oldest */
+  for (i=0; i<=ki->i_mask; i++){
+    for (e = ki->i_buckets[i]; e != NULL; e = en){
+      en = e->e_next;
+      e->e_next = NULL;
+      for (tail = &(vector[hash_index_kcs(e->e_key) & mask]); *tail != NULL; tail = &((*tail)->e_next));
+      *tail = e;
+    }
+  }
+
+  free(ki->i_buckets);
+  ki->i_buckets = vector;
+  ki->i_mask    = mask;
+
+  return 0;
+}
+
+static int insert_index_kcs(struct kcs_index *ki, char *key, struct kcs_obj *o)
+{
+  struct kcs_index_entry *e, **tail;
+
+  if (ki == NULL || key == NULL)
+    return 0;
+
+  if (ki->i_count > ki->i_mask){
+    if (grow_index_kcs(ki) < 0)
+      return -1;
+  }
+
+  e = malloc(sizeof(struct kcs_index_entry));
+  if (e == NULL)
+    return -1;
+
+  e->e_key  = key;
+  e->e_obj  = o;
+  e->e_next = NULL;
+
+  for (tail = &(ki->i_buckets[hash_index_kcs(key) & ki->i_mask]); *tail != NULL; tail = &((*tail)->e_next));
+  *tail = e;
+
+  ki->i_count++;
+
+  return 0;
+}
+
+static void remove_index_kcs(struct kcs_index *ki, char *key, struct kcs_obj *o)
+{
+  struct kcs_index_entry *e, **prev;
+
+  if (ki == NULL || key == NULL)
+    return;
+
+  for (prev = &(ki->i_buckets[hash_index_kcs(key) & ki->i_mask]); (e = *prev) != NULL; prev = &(e->e_next)){
+    if (e->e_obj == o && strcmp(e->e_key, key) == 0){
+      *prev = e->e_next;
+      free(e);
+      ki->i_count--;
+      return;
+    }
+  }
+}
+
+static struct kcs_index *get_index_kcs(struct kcs_obj *root, int kind)
+{
+  struct kcs_node *n;
+
+  if (root == NULL || root->tid != KCS_ID_NODE || kind < 0 || kind >= KCS_INDEX_KINDS)
+    return NULL;
+
+  n = root->payload;
+  if (n == NULL)
+    return NULL;
+
+  return n->n_index[kind];
+}
+
+struct kcs_obj *root_of_obj_kcs(struct kcs_obj *o)
+{
+  if (o == NULL)
+    return NULL;
+
+  while (o->parent != NULL)
+    o = o->parent;
+
+  return o;
+}
+
+struct kcs_obj *find_index_kcs(struct kcs_obj *root, int kind, char *key)
+{
+  struct kcs_index *ki;
+  struct kcs_index_entry *e;
+
+  ki = get_index_kcs(root, kind);
+  if (ki == NULL || key == NULL)
+    return NULL;
+
+  for (e = ki->i_buckets[hash_index_kcs(key) & ki->i_mask]; e != NULL; e = e->e_next){
+    if (strcmp(e->e_key, key) == 0)
+      return e->e_obj;
+  }
+
+  return NULL;
+}
+
+static void unindex_obj_kcs(struct kcs_obj *root, struct kcs_obj *o)
+{
+  struct kcs_roach *kr;
+
+  remove_index_kcs(get_index_kcs(root, KCS_INDEX_NAME), o->name, o);
+
+  if (o->tid == KCS_ID_ROACH && (kr = o->payload) != NULL){
+    remove_index_kcs(get_index_kcs(root, KCS_INDEX_IP), kr->ip, o);
+    remove_index_kcs(get_index_kcs(root, KCS_INDEX_MAC), kr->mac, o);
+  }
+}
+
+static int index_obj_kcs(struct kcs_obj *root, struct kcs_obj *o)
+{
+  struct kcs_roach *kr;
+
+  if (insert_index_kcs(get_index_kcs(root, KCS_INDEX_NAME), o->name, o) < 0)
+    return -1;
+
+  if (o->tid == KCS_ID_ROACH && (kr = o->payload) != NULL){
+    /* all or nothing, remove the keys already added if one fails */
+    if (insert_index_kcs(get_index_kcs(root, KCS_INDEX_IP), kr->ip, o) < 0 ||
+        insert_index_kcs(get_index_kcs(root, KCS_INDEX_MAC), kr->mac, o) < 0){
+      unindex_obj_kcs(root, o);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
 struct kcs_obj *init_tree(){
   struct kcs_obj *root;
+  struct kcs_node *n;
+  int i;
+
   root = new_kcs_node_obj(NULL,"root");
+  if (root == NULL)
+    return NULL;
+
+  n = root->payload;
+  for (i=0; i<KCS_INDEX_KINDS; i++){
+    n->n_index[i] = create_index_kcs();
+    if (n->n_index[i] == NULL){
+      destroy_tree(root);
+      return NULL;
+    }
+  }
+
+  if (index_obj_kcs(root, root) < 0){
+    destroy_tree(root);
+    return NULL;
+  }
+
   return root;
 }
 
@@ -112,6 +341,9 @@ struct kcs_obj *search_tree(struct kcs_obj *o, char *str){
   struct kcs_node *n;
   int i;
 
+  if (get_index_kcs(o, KCS_INDEX_NAME) != NULL)
+    return find_index_kcs(o, KCS_INDEX_NAME, str);
+
   if (strcmp(o->name,str) == 0){
 #ifdef DEBUG
     fprintf(stderr,"roachpool: found match %s (%p) type:%d\n",o->name, o, o->tid);
@@ -172,10 +404,18 @@ int add_new_roach_to_tree(struct kcs_obj *root, char *poolname, char *url, char
     fprintf(stderr,"roachpool: parent pool doesn't exist so create\n");
 #endif
     parent = new_kcs_node_obj(root, poolname);
+    if (!parent)
+      return KCS_FAIL;
+    /* index before linking, so a failure leaves nothing in root to undo */
+    if (index_obj_kcs(root, parent) < 0){
+      destroy_tree(parent);
+      return KCS_FAIL;
+    }
     if (add_obj_to_node(root, parent) == KCS_FAIL){
 #ifdef DEBUG
       fprintf(stderr,"roachpool: could not add roach to node\n");
 #endif
+      destroy_tree(parent);
       return KCS_FAIL;
     }
   }
@@ -197,10 +437,16 @@ int add_new_roach_to_tree(struct kcs_obj *root, char *poolname, char *url, char
     return KCS_FAIL;
   }
   
+  if (index_obj_kcs(root, roach) < 0){
+    destroy_tree(roach);
+    return KCS_FAIL;
+  }
+
   if (add_obj_to_node(parent, roach) == KCS_FAIL){
 #ifdef DEBUG
     fprintf(stderr,"roachpool: could not add roach to node\n");
 #endif
+    destroy_tree(roach);
     return KCS_FAIL;
   }
 #if 0
@@ -415,6 +661,8 @@ void destroy_tree(struct kcs_obj *o)
   
   if (!o) return;
 
+  unindex_obj_kcs(root_of_obj_kcs(o), o);
+
   switch (o->tid){
     
     case KCS_ID_NODE:
@@ -425,12 +673,15 @@ void destroy_tree(struct kcs_obj *o)
       fprintf(stderr,"\troachpool: destory in kcs_node (%p) cc:%d\n", n, n->childcount);
 #endif
 
-      for (i=0;i<n->childcount;i++){
-        destroy_tree(n->children[i]);
-        /*if (n->children[i])
-          n->children[i] = NULL;*/
+      /* each child unlinks itself, moving the last one into its slot */
+      while (n->childcount > 0){
+        destroy_tree(n->children[0]);
       }
       if (n->children) { free(n->children); n->children = NULL; }
+      for (i=0; i<KCS_INDEX_KINDS; i++){
+        destroy_index_kcs(n->n_index[i]);
+        n->n_index[i] = NULL;
+      }
       if (n) { free(n); n = NULL; }
 
       break;
@@ -483,10 +734,15 @@ int mod_roach_to_new_pool(struct kcs_obj *root, char *pool, char *hostname){
     po = new_kcs_node_obj(root, pool);
     if (!po)
       return KCS_FAIL;
+    if (index_obj_kcs(root, po) < 0){
+      destroy_tree(po);
+      return KCS_FAIL;
+    }
     if (add_obj_to_node(root, po) == KCS_FAIL){
 #ifdef DEBUG
       fprintf(stderr,"roachpool: could not add new pool to node\n");
 #endif
+      destroy_tree(po);
       return KCS_FAIL;
     }
   }
@@ -645,6 +901,7 @@ int roachpool_flush(struct katcp_dispatch *d)
   if (ko == NULL)
     return KATCP_RESULT_FAIL;
   
+  release_roach_links_kcs(d, ko);
   destroy_tree(ko);
 
   ko = NULL;
@@ -671,6 +928,7 @@ int roachpool_destroy(struct katcp_dispatch *d)
   kb = get_mode_katcp(d, KCS_MODE_BASIC);
   if (!kb)
     return KATCP_RESULT_FAIL;
+  release_roach_links_kcs(d, kb->b_pool_head);
   destroy_tree(kb->b_pool_head);
   return KATCP_RESULT_OK;
 }
@@ -678,12 +936,20 @@ int roachpool_destroy(struct katcp_dispatch *d)
 struct kcs_obj *roachpool_get_obj_by_name_kcs(struct katcp_dispatch *d, char *name)
 {
   struct kcs_basic *kb;
+  struct kcs_obj *ko;
   kb = get_mode_katcp(d, KCS_MODE_BASIC);
   if (!kb)
     return NULL;
-  if (name == NULL)
+  if (name == NULL || kb->b_pool_head == NULL)
     return NULL;
-  return search_tree(kb->b_pool_head,name);
+
+  ko = search_tree(kb->b_pool_head, name);
+  if (ko == NULL)
+    ko = find_index_kcs(kb->b_pool_head, KCS_INDEX_IP, name);
+  if (ko == NULL)
+    ko = find_index_kcs(kb->b_pool_head, KCS_INDEX_MAC, name);
+
+  return ko;
 }
 
 int roachpool_count_kcs(struct katcp_dispatch *d)
@@ -733,6 +999,8 @@ int roachpool_greeting(struct katcp_dispatch *d)
   prepend_inform_katcp(d);
   append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "get-conf [config settings (servers_x / servers_f)]");
   prepend_inform_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "fanout [pool | kurl | ip | mac] [request] [arguments ...]");
+  prepend_inform_katcp(d);
   append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "list");
   return KATCP_RESULT_OK;
 }
@@ -741,6 +1009,12 @@ int roach_cmd(struct katcp_dispatch *d, int argc)
 {
   char *p_cmd;
 
+  if (argc >= 4){
+    p_cmd = arg_string_katcp(d, 1);
+    if (strcmp("fanout", p_cmd) == 0)
+      return roachpool_fanout(d, argc);
+  }
+
   switch (argc){
     case 1:
       return roachpool_greeting(d);        
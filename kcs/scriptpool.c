@@ -0,0 +1,531 @@
+/* (c) 2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sysexits.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <katcp.h>
+#include <katcl.h>
+#include <katpriv.h>
+
+#include "kcs.h"
+
+/*********************************[script pool]****************************************/
+
+/* each worker is a job running a long-lived interpreter. A script request
+ * becomes ?run path args on the least busy worker, whose #log output is
+ * relayed by the job logic, while its reply resumes the requesting client.
+ * Workers which exit are started again on their next use
+ */
+
+static int halt_worker_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct kcs_worker *w;
+
+  w = data;
+  if (w == NULL)
+    return -1;
+
+  log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "script worker %u has exited", w->w_index);
+
+  w->w_job  = NULL;
+  w->w_halt = NULL;
+
+  return 0;
+}
+
+static int spawn_worker_kcs(struct katcp_dispatch *d, struct kcs_script_pool *sp, struct kcs_worker *w)
+{
+  struct katcp_notice *halt;
+  struct katcp_job *j;
+
+  halt = register_notice_katcp(d, NULL, 0, &halt_worker_kcs, w);
+  if (halt == NULL)
+    return -1;
+
+  j = process_name_create_job_katcp(d, sp->p_argv[0], sp->p_argv, halt, NULL);
+  if (j == NULL){
+    remove_notice_katcp(d, halt, &halt_worker_kcs, w);
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to start script worker %u using %s", w->w_index, sp->p_argv[0]);
+    return -1;
+  }
+
+  w->w_job  = j;
+  w->w_halt = halt;
+  w->w_spawns++;
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "started script worker %u using %s", w->w_index, sp->p_argv[0]);
+
+  return 0;
+}
+
+static void retire_worker_kcs(struct katcp_dispatch *d, struct kcs_worker *w)
+{
+  if (w->w_halt){
+    remove_notice_katcp(d, w->w_halt, &halt_worker_kcs, w);
+    w->w_halt = NULL;
+  }
+
+  if (w->w_job){
+    zap_job_katcp(d, w->w_job);
+    w->w_job = NULL;
+  }
+
+  w->w_retired = 1;
+
+  if (w->w_busy == 0)
+    free(w);
+}
+
+static int done_worker_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct kcs_worker *w;
+
+  w = data;
+  if (w == NULL)
+    return -1;
+
+  w->w_busy--;
+  w->w_runs++;
+
+  if (w->w_retired && (w->w_busy == 0))
+    free(w);
+
+  return 0;
+}
+
+static void destroy_script_pool_kcs(struct katcp_dispatch *d, struct kcs_script_pool *sp)
+{
+  unsigned int i;
+
+  if (sp == NULL)
+    return;
+
+  if (sp->p_workers){
+    for (i=0; i<sp->p_count; i++){
+      if (sp->p_workers[i])
+        retire_worker_kcs(d, sp->p_workers[i]);
+    }
+    free(sp->p_workers);
+  }
+
+  if (sp->p_argv){
+    for (i=0; sp->p_argv[i]; i++)
+      free(sp->p_argv[i]);
+    free(sp->p_argv);
+  }
+
+  free(sp);
+}
+
+void stop_script_pool_kcs(struct katcp_dispatch *d)
+{
+  struct kcs_basic *kb;
+
+  kb = get_mode_katcp(d, KCS_MODE_BASIC);
+  if (kb == NULL || kb->b_workers == NULL)
+    return;
+
+  destroy_script_pool_kcs(template_shared_katcp(d), kb->b_workers);
+  kb->b_workers = NULL;
+}
+
+static struct kcs_script_pool *start_script_pool_kcs(struct katcp_dispatch *d, unsigned int count, char **argv, int argc)
+{
+  struct kcs_script_pool *sp;
+  struct kcs_worker *w;
+  unsigned int i, up;
+
+  sp = malloc(sizeof(struct kcs_script_pool));
+  if (sp == NULL)
+    return NULL;
+
+  sp->p_count   = 0;
+  sp->p_workers = calloc(count, sizeof(struct kcs_worker *));
+  sp->p_argv    = calloc(argc + 1, sizeof(char *));
+
+  if (sp->p_workers == NULL || sp->p_argv == NULL){
+    destroy_script_pool_kcs(d, sp);
+    return NULL;
+  }
+
+  for (i=0; i<argc; i++){
+    sp->p_argv[i] = strdup(argv[i]);
+    if (sp->p_argv[i] == NULL){
+      destroy_script_pool_kcs(d, sp);
+      return NULL;
+    }
+  }
+
+  up = 0;
+  for (i=0; i<count; i++){
+    w = malloc(sizeof(struct kcs_worker));
+    if (w == NULL){
+      destroy_script_pool_kcs(d, sp);
+      return NULL;
+    }
+
+    w->w_job     = NULL;
+    w->w_halt    = NULL;
+    w->w_index   = i;
+    w->w_busy    = 0;
+    w->w_runs    = 0;
+    w->w_spawns  = 0;
+    w->w_retired = 0;
+
+    sp->p_workers[i] = w;
+    sp->p_count++;
+
+    /* pre-spawned, so that the interpreter start up is off the request path */
+    if (spawn_worker_kcs(d, sp, w) == 0)
+      up++;
+  }
+
+  if (up == 0){
+    destroy_script_pool_kcs(d, sp);
+    return NULL;
+  }
+
+  return sp;
+}
+
+int run_script_pool_kcs(struct katcp_dispatch *d, int argc, char *path)
+{
+  struct katcp_dispatch *dl;
+  struct kcs_basic *kb;
+  struct kcs_script_pool *sp;
+  struct kcs_worker *w, *best;
+  struct katcp_notice *n;
+  struct katcl_parse *p;
+  unsigned int i;
+  char *ptr;
+
+  kb = get_mode_katcp(d, KCS_MODE_BASIC);
+  if (kb == NULL || kb->b_workers == NULL)
+    return KATCP_RESULT_FAIL;
+
+  sp = kb->b_workers;
+  dl = template_shared_katcp(d);
+
+  best = NULL;
+  for (i=0; i<sp->p_count; i++){
+    w = sp->p_workers[i];
+    if (w->w_job == NULL){
+      if (spawn_worker_kcs(dl, sp, w) < 0)
+        continue;
+    }
+    if ((best == NULL) || (w->w_busy < best->w_busy))
+      best = w;
+  }
+
+  if (best == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no script workers available to run %s", path);
+    return KATCP_RESULT_FAIL;
+  }
+
+  p = create_parse_katcl();
+  if (p == NULL)
+    return KATCP_RESULT_FAIL;
+
+  add_string_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?run");
+  add_string_parse_katcl(p, KATCP_FLAG_STRING | ((argc > 1) ? 0 : KATCP_FLAG_LAST), path);
+  for (i=1; i<argc; i++){
+    ptr = arg_string_katcp(d, i);
+    add_string_parse_katcl(p, KATCP_FLAG_STRING | ((i + 1 < argc) ? 0 : KATCP_FLAG_LAST), ptr ? ptr : "");
+  }
+
+  n = create_parse_notice_katcp(dl, NULL, 0, p);
+  if (n == NULL){
+    destroy_parse_katcl(p);
+    return KATCP_RESULT_FAIL;
+  }
+
+  /* the client sees the reply of the worker, the pool only its completion */
+  if (add_notice_katcp(d, n, &script_wildcard_resume, NULL)){
+    return KATCP_RESULT_FAIL;
+  }
+  if (add_notice_katcp(dl, n, &done_worker_kcs, best)){
+    remove_notice_katcp(d, n, &script_wildcard_resume, NULL);
+    return KATCP_RESULT_FAIL;
+  }
+
+  best->w_busy++;
+
+  if (notice_to_job_katcp(dl, best->w_job, n) < 0){
+    p = remove_parse_notice_katcp(dl, n);
+    if (p)
+      destroy_parse_katcl(p);
+    trigger_notice_katcp(dl, n);
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "running %s on script worker %u", path, best->w_index);
+
+  return KATCP_RESULT_PAUSE;
+}
+
+int workers_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct kcs_basic *kb;
+  struct kcs_script_pool *sp;
+  struct kcs_worker *w;
+  char *fallback[2], **argv;
+  unsigned long count;
+  unsigned int i;
+
+  kb = get_mode_katcp(d, KCS_MODE_BASIC);
+  if (kb == NULL)
+    return KATCP_RESULT_FAIL;
+
+  if (argc <= 1){
+    sp = kb->b_workers;
+    count = (sp != NULL) ? sp->p_count : 0;
+    for (i=0; i<count; i++){
+      w = sp->p_workers[i];
+      prepend_inform_katcp(d);
+      append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, w->w_index);
+      append_string_katcp(d, KATCP_FLAG_STRING, w->w_job ? "up" : "down");
+      append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, w->w_busy);
+      append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, w->w_runs);
+      append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, w->w_spawns);
+    }
+
+    prepend_reply_katcp(d);
+    append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, count);
+
+    return KATCP_RESULT_OWN;
+  }
+
+  count = arg_unsigned_long_katcp(d, 1);
+  if (count > KCS_WORKER_MAX){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "at most %d script workers are supported", KCS_WORKER_MAX);
+    return KATCP_RESULT_FAIL;
+  }
+
+  /* requests already on the old workers fail once those are gone */
+  stop_script_pool_kcs(d);
+
+  if (count == 0){
+    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "scripts now run as separate processes");
+    return KATCP_RESULT_OK;
+  }
+
+  if (argc > 2){
+    argv = malloc(sizeof(char *) * (argc - 1));
+    if (argv == NULL)
+      return KATCP_RESULT_FAIL;
+    for (i=2; i<argc; i++)
+      argv[i - 2] = arg_string_katcp(d, i);
+    argv[argc - 2] = NULL;
+  } else {
+    fallback[0] = KCS_WORKER_PROGRAM;
+    fallback[1] = NULL;
+    argv = fallback;
+  }
+
+  sp = start_script_pool_kcs(template_shared_katcp(d), count, argv, (argc > 2) ? (argc - 2) : 1);
+
+  if (argv != fallback)
+    free(argv);
+
+  if (sp == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to start any script workers");
+    return KATCP_RESULT_FAIL;
+  }
+
+  kb->b_workers = sp;
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "scripts now run on %u workers", sp->p_count);
+
+  return KATCP_RESULT_OK;
+}
+
+#ifdef KCS_BENCHMARK_SCRIPTPOOL
+/* times a short python script run through the per call execpy path and
+ * then on warm pool workers, sequentially, from a kcs instance on a pipe:
+ * ./bench-scriptpool [calls [interpreter [worker]]]
+ */
+
+#include <limits.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SCRIPTPOOL_BENCH_NAME "bench-hello.py"
+
+static double call_scriptpool_kcs(struct katcl_line *l, char *request, char **extra, int count)
+{
+  struct timeval start, stop, delta;
+  char *name, *status;
+  fd_set fsr;
+  int fd, i;
+
+  gettimeofday(&start, NULL);
+
+  append_string_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING | ((count > 0) ? 0 : KATCP_FLAG_LAST), request);
+  for (i=0; i<count; i++){
+    append_string_katcl(l, KATCP_FLAG_STRING | ((i + 1 < count) ? 0 : KATCP_FLAG_LAST), extra[i]);
+  }
+  while (write_katcl(l) == 0);
+
+  fd = fileno_katcl(l);
+
+  for (;;){
+    while (have_katcl(l) > 0){
+      name = arg_string_katcl(l, 0);
+      if (name && (name[0] == KATCP_REPLY) && !strcmp(name + 1, request + 1)){
+        gettimeofday(&stop, NULL);
+        sub_time_katcp(&delta, &stop, &start);
+        status = arg_string_katcl(l, 1);
+        if (status == NULL || strcmp(status, KATCP_OK))
+          return -1.0;
+        return (delta.tv_sec * 1000.0) + (delta.tv_usec / 1000.0);
+      }
+    }
+
+    FD_ZERO(&fsr);
+    FD_SET(fd, &fsr);
+    if (select(fd + 1, &fsr, NULL, NULL, NULL) < 0 && errno != EINTR)
+      return -1.0;
+
+    if (read_katcl(l) != 0)
+      return -1.0;
+  }
+}
+
+static int run_scriptpool_kcs(struct katcl_line *l, char *label, unsigned int calls)
+{
+  double t, sum, low, high;
+  unsigned int i;
+  char *extra[1];
+
+  extra[0] = "argument";
+  sum = 0.0;
+  low = 0.0;
+  high = 0.0;
+
+  for (i=0; i<calls; i++){
+    t = call_scriptpool_kcs(l, "?exec://" SCRIPTPOOL_BENCH_NAME, extra, 1);
+    if (t < 0){
+      fprintf(stderr, "%s: call %u failed\n", label, i);
+      return -1;
+    }
+    sum += t;
+    if (i == 0 || t < low)
+      low = t;
+    if (t > high)
+      high = t;
+  }
+
+  printf("%s: %u calls, mean=%.3fms min=%.3fms max=%.3fms\n", label, calls, sum / calls, low, high);
+  fflush(stdout);
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct katcp_dispatch *d;
+  struct katcl_line *l;
+  char dir[] = "/tmp/kcs-scriptpool-XXXXXX";
+  char script[PATH_MAX], worker[PATH_MAX], path[PATH_MAX * 2];
+  char *interpreter, *extra[3], *env;
+  unsigned int calls;
+  int sp[2], status;
+  pid_t server;
+  FILE *fp;
+
+  calls       = (argc > 1) ? strtoul(argv[1], NULL, 0) : 50;
+  interpreter = (argc > 2) ? argv[2] : "/usr/bin/python3";
+
+  if (realpath((argc > 3) ? argv[3] : "./" KCS_WORKER_PROGRAM, worker) == NULL){
+    fprintf(stderr, "unable to locate worker %s\n", (argc > 3) ? argv[3] : KCS_WORKER_PROGRAM);
+    return 1;
+  }
+
+  if (mkdtemp(dir) == NULL)
+    return 1;
+
+  snprintf(script, sizeof(script), "%s/%s", dir, SCRIPTPOOL_BENCH_NAME);
+  fp = fopen(script, "w");
+  if (fp == NULL)
+    return 1;
+  fprintf(fp, "#!%s\nimport sys, json\nprint(json.dumps({'argv': sys.argv[1:]}))\n", interpreter);
+  fclose(fp);
+  chmod(script, 0755);
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) < 0)
+    return 1;
+
+  fflush(stdout);
+
+  server = fork();
+  if (server < 0)
+    return 1;
+  if (server == 0){
+    close(sp[1]);
+
+    /* the per call path runs scripts by name */
+    env = getenv("PATH");
+    snprintf(path, sizeof(path), "%s:%s", dir, env ? env : "/usr/bin:/bin");
+    setenv("PATH", path, 1);
+
+    d = startup_katcp();
+    if (d == NULL)
+      exit(EX_OSERR);
+
+    if (setup_basic_kcs(d, dir, argv, argc) < 0 || enter_name_mode_katcp(d, KCS_MODE_BASIC_NAME, NULL) < 0)
+      exit(EX_SOFTWARE);
+
+    run_pipe_server_katcp(d, NULL, sp[0]);
+    shutdown_katcp(d);
+
+    exit(EX_OK);
+  }
+
+  close(sp[0]);
+
+  l = create_katcl(sp[1]);
+  if (l == NULL)
+    return 1;
+
+  status = 0;
+
+  if (run_scriptpool_kcs(l, "execpy per call", calls) < 0)
+    status = 1;
+
+  extra[0] = "2";
+  extra[1] = interpreter;
+  extra[2] = worker;
+  if (call_scriptpool_kcs(l, "?workers", extra, 3) < 0){
+    fprintf(stderr, "unable to start workers\n");
+    status = 1;
+  }
+
+  /* first run on each worker loads the modules */
+  if (run_scriptpool_kcs(l, "pool first runs", 2) < 0)
+    status = 1;
+
+  if (run_scriptpool_kcs(l, "pool warm", calls) < 0)
+    status = 1;
+
+  destroy_katcl(l, 1);
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+
+  unlink(script);
+  rmdir(dir);
+
+  return status;
+}
+#endif
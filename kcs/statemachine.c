@@ -452,6 +452,13 @@ int statemachine_loadmod_kcs(struct katcp_dispatch *d)
 }
 
 /*Task Scheduler**********************************************************************************************/
+/*
+ * Runnable tasks sit on a ready queue owned by the scheduler notice and are
+ * run back to back, each until it finishes, parks on its own notice (an edge
+ * returned EDGE_WAIT) or uses up its slice. Only parked tasks cost a trip
+ * through the notice logic, edges which succeed or fail immediately do not
+ */
+
 struct kcs_sched_task *create_sched_task_kcs(struct kcs_sm_state *s, struct katcp_tobject *to, int flags)
 {
   struct kcs_sched_task *t;
@@ -472,6 +479,14 @@ struct kcs_sched_task *create_sched_task_kcs(struct kcs_sm_state *s, struct katc
   t->t_edge_i  = 0;
   t->t_op_i    = 0;
   t->t_flags   = flags;
+
+  t->t_parked  = 0;
+  t->t_resume  = 0;
+  t->t_notice  = NULL;
+  t->t_done    = NULL;
+  t->t_sched   = NULL;
+  t->t_prog    = NULL;
+  t->t_pc_i    = 0;
   
   t->t_pc = s;
   
@@ -488,10 +503,59 @@ struct kcs_sched_task *create_sched_task_kcs(struct kcs_sm_state *s, struct katc
   return t;
 }
 
+struct kcs_sched_task *create_program_task_kcs(struct kcs_sm_program *p, int start, struct katcp_tobject *to, int flags)
+{
+  struct kcs_sched_task *t;
+
+  if (p == NULL || start < 0 || start >= p->p_state_count)
+    return NULL;
+
+  t = malloc(sizeof(struct kcs_sched_task));
+  if (t == NULL)
+    return NULL;
+
+  t->t_rtn     = 0;
+  t->t_state   = TASK_STATE_RUN_OPS; 
+  t->t_edge_i  = 0;
+  t->t_op_i    = 0;
+  t->t_flags   = flags;
+
+  t->t_parked  = 0;
+  t->t_resume  = 0;
+  t->t_notice  = NULL;
+  t->t_done    = NULL;
+  t->t_sched   = NULL;
+
+  t->t_pc      = NULL;
+  t->t_prog    = p;
+  t->t_pc_i    = start;
+
+  /*all the memory the task will use while running is set aside now*/
+  t->t_stack = create_sized_stack_katcp(p->p_stack);
+  if (t->t_stack == NULL){
+    free(t);
+    return NULL;
+  }
+
+  if (to != NULL){
+    if (push_tobject_katcp(t->t_stack, to) < 0){
+      destroy_stack_katcp(t->t_stack);
+      free(t);
+      return NULL;
+    }
+  }
+
+  p->p_refs++;
+
+  return t;
+}
+
 void destroy_sched_task_kcs(struct kcs_sched_task *t)
 {
   if (t != NULL){
     destroy_stack_katcp(t->t_stack);
+    if (t->t_prog)
+      release_program_kcs(t->t_prog);
     free(t);
   }
 }
@@ -529,7 +593,58 @@ void print_task_stack_kcs(struct katcp_dispatch *d, struct kcs_sched_task *t)
   print_stack_katcp(d, stack);
 }
 
-int statemachine_run_ops_kcs(struct katcp_dispatch *d, struct katcp_notice *n, struct kcs_sched_task *t)
+int statemachine_wake_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data);
+
+/*ready queue, a ring of task pointers which grows as needed*/
+int enqueue_sched_kcs(struct katcp_dispatch *d, struct kcs_scheduler *ks, struct kcs_sched_task *t)
+{
+  struct kcs_sched_task **tmp;
+  unsigned int i, size;
+
+  if (ks == NULL || t == NULL)
+    return -1;
+
+  if (ks->s_count >= ks->s_size){
+    size = (ks->s_size > 0) ? (ks->s_size * 2) : KCS_SCHED_QUEUE;
+    tmp = malloc(sizeof(struct kcs_sched_task *) * size);
+    if (tmp == NULL)
+      return -1;
+    for (i=0; i<ks->s_count; i++){
+      tmp[i] = ks->s_ready[(ks->s_head + i) % ks->s_size];
+    }
+    if (ks->s_ready)
+      free(ks->s_ready);
+    ks->s_ready = tmp;
+    ks->s_head  = 0;
+    ks->s_size  = size;
+  }
+
+  ks->s_ready[(ks->s_head + ks->s_count) % ks->s_size] = t;
+  ks->s_count++;
+
+  /*first runnable task after an idle period: get scheduled on the next loop iteration*/
+  if (ks->s_count == 1 && ks->s_running == 0){
+    wake_notice_katcp(d, ks->s_notice, NULL);
+  }
+
+  return 0;
+}
+
+struct kcs_sched_task *dequeue_sched_kcs(struct kcs_scheduler *ks)
+{
+  struct kcs_sched_task *t;
+
+  if (ks == NULL || ks->s_count <= 0)
+    return NULL;
+
+  t = ks->s_ready[ks->s_head];
+  ks->s_head = (ks->s_head + 1) % ks->s_size;
+  ks->s_count--;
+
+  return t;
+}
+
+int statemachine_run_ops_kcs(struct katcp_dispatch *d, struct kcs_sched_task *t)
 {
   struct kcs_sm_state *s;
   struct katcp_stack *stack;
@@ -545,12 +660,6 @@ int statemachine_run_ops_kcs(struct katcp_dispatch *d, struct katcp_notice *n, s
   if (s == NULL || stack == NULL)
     return TASK_STATE_CLEAN_UP;
 
-#if 0 
-  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "running ops in state %s", s->s_name);
-#endif
-#if 0
-  for (i=0; i<s->s_op_list_count; i++){
-#endif
   for (; t->t_op_i < s->s_op_list_count; t->t_op_i++){
     op = s->s_op_list[t->t_op_i];
     if (op != NULL){
@@ -571,15 +680,108 @@ int statemachine_run_ops_kcs(struct katcp_dispatch *d, struct katcp_notice *n, s
         log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "statemachine op [%d] error rtn: %d", t->t_op_i, rtn);
         return rtn;
       }
+
+      if (t->t_sched)
+        t->t_sched->s_ops++;
     }
   }
   
-  wake_notice_katcp(d, n, NULL);
-  
   return TASK_STATE_FOLLOW_EDGES;
 }
 
-int statemachine_follow_edges_kcs(struct katcp_dispatch *d, struct katcp_notice *n, struct kcs_sched_task *t)
+int statemachine_run_program_ops_kcs(struct katcp_dispatch *d, struct kcs_sched_task *t)
+{
+  struct kcs_sm_pstate *s;
+  struct kcs_sm_pop *op;
+  int rtn;
+
+  s = &(t->t_prog->p_states[t->t_pc_i]);
+  op = &(t->t_prog->p_ops[s->s_op]);
+
+  for (; t->t_op_i < s->s_op_count; t->t_op_i++){
+    if (op[t->t_op_i].p_call == NULL){
+      t->t_op_i++;
+      break; 
+    }
+
+    rtn = (*(op[t->t_op_i].p_call))(d, t->t_stack, op[t->t_op_i].p_tobject);
+    if (rtn < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "statemachine %s op [%d] error rtn: %d", s->s_name, t->t_op_i, rtn);
+      return rtn;
+    }
+
+    t->t_sched->s_ops++;
+  }
+
+  return TASK_STATE_FOLLOW_EDGES;
+}
+
+static int statemachine_edge_count_kcs(struct kcs_sched_task *t)
+{
+  if (t->t_prog)
+    return t->t_prog->p_states[t->t_pc_i].s_edge_count;
+
+  return t->t_pc->s_edge_list_count;
+}
+
+/*a failed edge lets the ops up to the next edge run before that edge is tried*/
+static int statemachine_next_edge_kcs(struct kcs_sched_task *t)
+{
+  if ((t->t_edge_i+1) < statemachine_edge_count_kcs(t)){
+    t->t_edge_i++;
+#ifdef DEBUG
+    fprintf(stderr, "statemachine: follow edges STILL TRYING\n");
+#endif
+    return TASK_STATE_RUN_OPS;
+  }
+
+  return TASK_STATE_CLEAN_UP;
+}
+
+static int statemachine_take_edge_kcs(struct kcs_sched_task *t)
+{
+  struct kcs_sm_program *p;
+
+  p = t->t_prog;
+  if (p){
+    t->t_pc_i = p->p_edges[p->p_states[t->t_pc_i].s_edge + t->t_edge_i].e_next;
+  } else {
+    set_task_pc_kcs(t, t->t_pc->s_edge_list[t->t_edge_i]->e_next);
+  }
+  t->t_edge_i = 0;      
+  t->t_op_i   = 0;
+
+  if (t->t_sched)
+    t->t_sched->s_edges++;
+
+  return TASK_STATE_RUN_OPS;
+}
+
+int statemachine_follow_program_edges_kcs(struct katcp_dispatch *d, struct kcs_sched_task *t)
+{
+  struct kcs_sm_pstate *s;
+  struct kcs_sm_pedge *e;
+  int rtn;
+
+  s = &(t->t_prog->p_states[t->t_pc_i]);
+  if (s->s_edge_count <= 0)
+    return TASK_STATE_CLEAN_UP;
+
+  e = &(t->t_prog->p_edges[s->s_edge + t->t_edge_i]);
+
+  rtn = (e->e_call != NULL) ? (*(e->e_call))(d, t->t_notice, t->t_stack) : EDGE_OKAY;
+
+  switch (rtn){
+    case EDGE_OKAY:
+      return statemachine_take_edge_kcs(t);
+    case EDGE_WAIT:
+      return TASK_STATE_EDGE_WAIT;
+  }
+
+  return statemachine_next_edge_kcs(t);
+}
+
+int statemachine_follow_edges_kcs(struct katcp_dispatch *d, struct kcs_sched_task *t)
 {
   struct kcs_sm_state *s;
   struct kcs_sm_edge *e;
@@ -603,195 +805,571 @@ int statemachine_follow_edges_kcs(struct katcp_dispatch *d, struct katcp_notice
 #ifdef DEBUG
     fprintf(stderr, "statemachine: no edges ending\n");
 #endif
-    wake_notice_katcp(d, n, NULL);
     return TASK_STATE_CLEAN_UP;
   }
 
-#if 0  
-  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "testing edges in state %s", s->s_name);
-#endif
-
   e = s->s_edge_list[t->t_edge_i];
+  if (e == NULL)
+    return statemachine_next_edge_kcs(t);
 
-  if (e != NULL){
-
-    if (e->e_call != NULL){
-      rtn = (*(e->e_call))(d, n, stack);
-    } else {
-      /*this is for edges with no callback (default edge) always follow*/
-      rtn = 0;
-      wake_notice_katcp(d, n, NULL);
-    }
+  if (e->e_call != NULL){
+    rtn = (*(e->e_call))(d, t->t_notice, stack);
+  } else {
+    /*this is for edges with no callback (default edge) always follow*/
+    rtn = EDGE_OKAY;
+  }
 
-    switch (rtn){
-      case EDGE_OKAY:
-        set_task_pc_kcs(t, e->e_next);
-        t->t_edge_i = 0;      
-        t->t_op_i   = 0;
+  switch (rtn){
+    case EDGE_OKAY:
 #ifdef DEBUG
-        fprintf(stderr, "statemachine: follow edges EDGE RETURNS SUCCESS\n");
+      fprintf(stderr, "statemachine: follow edges EDGE RETURNS SUCCESS\n");
 #endif
-        return TASK_STATE_RUN_OPS;
+      return statemachine_take_edge_kcs(t);
       
-      case EDGE_WAIT:
+    case EDGE_WAIT:
 #ifdef DEBUG
-        fprintf(stderr, "statemachine: follow edges WAITING\n");
+      fprintf(stderr, "statemachine: follow edges WAITING\n");
 #endif
-        return TASK_STATE_EDGE_WAIT;
-
-      case EDGE_FAIL:
-      default:
-        break;
-    }
+      return TASK_STATE_EDGE_WAIT;
 
+    case EDGE_FAIL:
+    default:
+      break;
   }
 
   if ((t->t_edge_i+1) < s->s_edge_list_count){
-    t->t_edge_i++;
-#ifdef DEBUG
-    fprintf(stderr, "statemachine: follow edges STILL TRYING\n");
-#endif
-
-    wake_notice_katcp(d, n, NULL);
-
-    //return TASK_STATE_FOLLOW_EDGES;
-    return TASK_STATE_RUN_OPS;
+    return statemachine_next_edge_kcs(t);
   }
 
 #ifdef DEBUG
   fprintf(stderr, "statemachine: follow edges FAIL cleanup state\n");
 #endif
 
-  wake_notice_katcp(d, n, NULL);
-
   return TASK_STATE_CLEAN_UP;
 }
 
-int statemachine_process_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+void statemachine_finish_kcs(struct katcp_dispatch *d, struct kcs_sched_task *t)
 {
-  struct kcs_sched_task *t;
   struct katcl_parse *p;
-  int rtn;
-  char *ptr, *name;
-  
-  rtn = 0;
-  t = data;
-  if (t == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "cannot run sched with null task");
-    return 0;
-  }
-#if 0
-  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "running sched notice with task state: %d", t->t_state);
-#endif 
+  char *name;
 
-  name = (n->n_name == NULL) ? "<anonymous>" : n->n_name;
+  name = (t->t_notice && t->t_notice->n_name) ? t->t_notice->n_name : "<anonymous>";
 
-  switch (t->t_state){
-    case TASK_STATE_RUN_OPS:
 #ifdef DEBUG
-      fprintf(stderr, "statemachine: process about to run ops\n");
+  fprintf(stderr, "statemachine: process about to cleanup %s\n", name);
 #endif
-      rtn = statemachine_run_ops_kcs(d, n, t);
-      break;
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "printing task stack and cleaning up %s", name);
+  print_task_stack_kcs(d, t);
+
+  if (t->t_flags & PROCESS_MASTER){
+    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "statemachine master process ending %s", name);
+    if (t->t_done){
+      p = create_parse_katcl();
+      if (p){
+        if (t->t_rtn < 0){
+          add_string_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, KATCP_FAIL);
+          add_string_parse_katcl(p, KATCP_FLAG_STRING, name);
+          add_signed_long_parse_katcl(p, KATCP_FLAG_SLONG | KATCP_FLAG_LAST, t->t_rtn);
+        } else {
+          add_string_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_STRING | KATCP_FLAG_LAST, KATCP_OK);
+        }
+      }
+      wake_notice_katcp(d, t->t_done, p);
+      release_notice_katcp(d, t->t_done);
+      t->t_done = NULL;
+    }
+  } else if (t->t_flags & PROCESS_SLAVE){
+    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "statemachine slave process ending %s", name);
+  }
 
-    case TASK_STATE_FOLLOW_EDGES:
-#ifdef DEBUG
-      fprintf(stderr, "statemachine: process about to follow edges\n");
-#endif
-      rtn = statemachine_follow_edges_kcs(d, n, t);
-      break;
+  if (t->t_notice){
+    remove_notice_katcp(d, t->t_notice, &statemachine_wake_kcs, t);
+    t->t_notice = NULL;
+  }
+
+  if (t->t_sched)
+    t->t_sched->s_tasks--;
+
+  destroy_sched_task_kcs(t);
 
-    case TASK_STATE_EDGE_WAIT:
-      
-      p = get_parse_notice_katcp(d, n);
-      if (p == NULL){
-        rtn = -1;
-      } else {
-        ptr = get_string_parse_katcl(p, 1);
-        if (ptr == NULL || strcmp(ptr, "ok") != 0){
 #ifdef DEBUG
-          fprintf(stderr, "statemachine: process edge wait FAIL try next OP\n");
+  fprintf(stderr, "**********[end statemachine (%s) run]**********\n", name);
 #endif
-#if 0
-          if ((t->t_edge_i+1) < (t->t_pc->s_edge_list_count)){
-            t->t_edge_i++;
+}
+
+/*run a task until it parks, finishes or has taken its share of edges*/
+int statemachine_process_kcs(struct katcp_dispatch *d, struct kcs_sched_task *t)
+{
+  unsigned int steps;
+  int rtn;
+
+  for (steps = 0; steps < KCS_SCHED_SLICE; steps++){
+
+    switch (t->t_state){
+      case TASK_STATE_RUN_OPS:
+        rtn = t->t_prog ? statemachine_run_program_ops_kcs(d, t) : statemachine_run_ops_kcs(d, t);
+        break;
+
+      case TASK_STATE_FOLLOW_EDGES:
+        rtn = t->t_prog ? statemachine_follow_program_edges_kcs(d, t) : statemachine_follow_edges_kcs(d, t);
+        if (rtn == TASK_STATE_EDGE_WAIT){
+          t->t_state  = TASK_STATE_EDGE_WAIT;
+          t->t_parked = 1;
+          return TASK_STATE_EDGE_WAIT;
+        }
+        break;
+
+      case TASK_STATE_EDGE_WAIT:
+        /*resumed by statemachine_wake_kcs, which recorded the outcome*/
+        if (t->t_resume){
 #ifdef DEBUG
-            fprintf(stderr, "statemachine: follow edges STILL TRYING\n");
+          fprintf(stderr, "statemachine: process edge wait SUCCESS follow edge\n");
 #endif
-            rtn = statemachine_follow_edges_kcs(d, n, t);
-          } else {
+          rtn = statemachine_take_edge_kcs(t);
+        } else {
 #ifdef DEBUG
-            fprintf(stderr, "statemachine: no more edges! FAIL\n");
-#endif
-            rtn = -1;
-          }
+          fprintf(stderr, "statemachine: process edge wait FAIL try next OP\n");
 #endif
-          if ((t->t_edge_i+1) < (t->t_pc->s_edge_list_count)){
+          /*retries the last edge once all have been tried, as before*/
+          if ((t->t_edge_i+1) < statemachine_edge_count_kcs(t)){
             t->t_edge_i++;
           }
           rtn = TASK_STATE_RUN_OPS;
-          wake_notice_katcp(d, n, NULL);
-        } else {
-#ifdef DEBUG
-          fprintf(stderr, "statemachine: process edge wait SUCCESS follow edge\n");
-#endif
-          /*TODO: err checking*/
-          set_task_pc_kcs(t, t->t_pc->s_edge_list[t->t_edge_i]->e_next);
-          t->t_edge_i = 0;      
-          t->t_op_i   = 0;      
-          rtn = TASK_STATE_RUN_OPS;
-          wake_notice_katcp(d, n, NULL);
         }
-      }
-      break;
+        break;
 
-    case TASK_STATE_CLEAN_UP:
+      case TASK_STATE_CLEAN_UP:
+      default:
+        statemachine_finish_kcs(d, t);
+        return TASK_STATE_CLEAN_UP;
+    }
+
+    if (rtn < 0){
 #ifdef DEBUG
-      fprintf(stderr, "statemachine: process about to cleanup %s\n", name);
+      fprintf(stderr, "statemachine: process error setting task state to CLEAN UP\n");
 #endif
-      log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "printing task stack and cleaning up %s", name);
-      print_task_stack_kcs(d, t);
-     
-      if (t->t_flags & PROCESS_MASTER){
-        log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "statemachine master process ending %s", name);
-        prepend_reply_katcp(d);
-        if (t->t_rtn < 0){
-          append_string_katcp(d, KATCP_FLAG_STRING, "fail");  
-          append_string_katcp(d, KATCP_FLAG_STRING, name);
-          append_signed_long_katcp(d, KATCP_FLAG_SLONG | KATCP_FLAG_LAST, t->t_rtn);
-        } else {
-          append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "ok");  
+      t->t_rtn = rtn;
+      rtn = TASK_STATE_CLEAN_UP;
+    }
+
+    t->t_state = rtn;
+  }
+
+  return t->t_state;
+}
+
+/*notice callback: a parked task is woken by whoever it waited on*/
+int statemachine_wake_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct kcs_sched_task *t;
+  struct katcl_parse *p;
+  char *ptr;
+
+  t = data;
+  if (t == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "cannot wake a null task");
+    return 0;
+  }
+
+  if (!t->t_parked){
+    /*task is already runnable, nothing to do*/
+    return 1;
+  }
+
+  /*a plain wakeup or an expired timer (msleep) counts as success*/
+  p = get_parse_notice_katcp(d, n);
+  if (p == NULL){
+    t->t_resume = 1;
+  } else {
+    ptr = get_string_parse_katcl(p, 0);
+    if (ptr != NULL && strcmp(ptr, KATCP_WAKE_TIMEOUT) == 0){
+      t->t_resume = 1;
+    } else {
+      ptr = get_string_parse_katcl(p, 1);
+      t->t_resume = (ptr != NULL && strcmp(ptr, KATCP_OK) == 0) ? 1 : 0;
+    }
+  }
+
+  t->t_parked = 0;
+
+  if (enqueue_sched_kcs(d, t->t_sched, t) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to requeue task %s", n->n_name ? n->n_name : "<anonymous>");
+    t->t_parked = 1;
+  }
+
+  return 1;
+}
+
+/*scheduler notice callback: run ready tasks within a time budget*/
+int statemachine_schedule_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct kcs_scheduler *ks;
+
+  ks = data;
+  if (ks == NULL)
+    return 0;
+
+  run_sched_kcs(d, ks);
+
+  return 1;
+}
+
+int run_sched_kcs(struct katcp_dispatch *d, struct kcs_scheduler *ks)
+{
+  struct kcs_sched_task *t;
+  struct timeval start, now, delta;
+  unsigned int i, count;
+  int rtn;
+
+  gettimeofday(&start, NULL);
+
+  ks->s_running = 1;
+  ks->s_runs++;
+  count = 0;
+
+  for (i=0; ks->s_count > 0; i++){
+    t = dequeue_sched_kcs(ks);
+
+    rtn = statemachine_process_kcs(d, t);
+    count++;
+
+    if (rtn != TASK_STATE_EDGE_WAIT && rtn != TASK_STATE_CLEAN_UP){
+      /*used up its slice, back of the queue*/
+      enqueue_sched_kcs(d, ks, t);
+    }
+
+    if ((i % KCS_SCHED_CHECK) == (KCS_SCHED_CHECK - 1)){
+      gettimeofday(&now, NULL);
+      sub_time_katcp(&delta, &now, &start);
+      if ((delta.tv_sec * 1000000 + delta.tv_usec) >= ks->s_budget){
+        break;
+      }
+    }
+  }
+
+  ks->s_running = 0;
+  ks->s_slices += count;
+
+  if (ks->s_count > 0){
+    /*let the rest of the server run, continue on the next iteration*/
+    ks->s_deferred++;
+    wake_notice_katcp(d, ks->s_notice, NULL);
+  }
+
+  return count;
+}
+
+struct kcs_scheduler *get_sched_kcs(struct katcp_dispatch *d)
+{
+  struct katcp_dispatch *dl;
+  struct kcs_scheduler *ks;
+  struct katcp_notice *n;
+  void *data[1];
+
+  dl = template_shared_katcp(d);
+  if (dl == NULL)
+    dl = d;
+
+  n = find_notice_katcp(dl, STATEMACHINE_SCHEDULER_NOTICE);
+  if (n != NULL){
+    if (fetch_data_notice_katcp(dl, n, data, 1) == 1){
+      return data[0];
+    }
+    return NULL;
+  }
+
+  ks = malloc(sizeof(struct kcs_scheduler));
+  if (ks == NULL)
+    return NULL;
+
+  ks->s_ready    = NULL;
+  ks->s_head     = 0;
+  ks->s_count    = 0;
+  ks->s_size     = 0;
+  ks->s_running  = 0;
+  ks->s_budget   = KCS_SCHED_BUDGET;
+  ks->s_tasks    = 0;
+  ks->s_edges    = 0;
+  ks->s_ops      = 0;
+  ks->s_runs     = 0;
+  ks->s_slices   = 0;
+  ks->s_deferred = 0;
+
+  ks->s_programs      = NULL;
+  ks->s_program_count = 0;
+  ks->s_serial        = 0;
+
+  n = register_notice_katcp(dl, STATEMACHINE_SCHEDULER_NOTICE, 0, &statemachine_schedule_kcs, ks);
+  if (n == NULL){
+    free(ks);
+    return NULL;
+  }
+
+  /*keep the scheduler around even while idle*/
+  hold_notice_katcp(dl, n);
+  ks->s_notice = n;
+
+  return ks;
+}
+
+int resume_process_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct katcl_parse *p;
+  unsigned int i, count;
+
+  p = get_parse_notice_katcp(d, n);
+  count = (p != NULL) ? get_count_parse_katcl(p) : 0;
+
+  prepend_reply_katcp(d);
+  if (count > 0){
+    for (i=0; i<count; i++){
+      append_parameter_katcp(d, (i+1 < count) ? KATCP_FLAG_STRING : (KATCP_FLAG_STRING | KATCP_FLAG_LAST), p, i);
+    }
+  } else {
+    append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, KATCP_FAIL);
+  }
+
+  resume_katcp(d);
+
+  return 0;
+}
+
+/*Compiled Programs*******************************************************************************************/
+/*
+ * A program is a snapshot of the graph reachable from a start state. It
+ * borrows the op objects of the graph, so any change to the graph drops all
+ * programs again. Tasks already running keep theirs until they finish, which
+ * is why the graph may not be flushed while any task is still around
+ */
+
+void release_program_kcs(struct kcs_sm_program *p)
+{
+  int i;
+
+  if (p == NULL)
+    return;
+
+  p->p_refs--;
+  if (p->p_refs > 0)
+    return;
+
+  if (p->p_states){
+    for (i=0; i<p->p_state_count; i++){
+      if (p->p_states[i].s_name)
+        free(p->p_states[i].s_name);
+    }
+    free(p->p_states);
+  }
+  if (p->p_ops)
+    free(p->p_ops);
+  if (p->p_edges)
+    free(p->p_edges);
+  if (p->p_name)
+    free(p->p_name);
+
+  free(p);
+}
+
+static int index_state_kcs(struct kcs_sm_state **v, int count, struct kcs_sm_state *s)
+{
+  int i;
+
+  for (i=0; i<count; i++){
+    if (v[i] == s)
+      return i;
+  }
+
+  return -1;
+}
+
+struct kcs_sm_program *compile_program_kcs(struct katcp_dispatch *d, char *startnode, int stack)
+{
+  struct kcs_sm_program *p;
+  struct kcs_sm_state **v, **tmp, *s, *next;
+  struct kcs_sm_pstate *ps;
+  int count, size, i, j, k, ops, edges;
+
+  if (startnode == NULL || stack <= 0)
+    return NULL;
+
+  s = get_key_data_type_katcp(d, KATCP_TYPE_STATEMACHINE_STATE, startnode);
+  if (s == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no state %s to compile from", startnode);
+    return NULL;
+  }
+
+  /*breadth first walk gives every reachable state its index, the start is 0*/
+  size = 16;
+  v = malloc(sizeof(struct kcs_sm_state *) * size);
+  if (v == NULL)
+    return NULL;
+
+  v[0] = s;
+  count = 1;
+  ops = 0;
+  edges = 0;
+
+  for (i=0; i<count; i++){
+    s = v[i];
+    ops   += s->s_op_list_count;
+    edges += s->s_edge_list_count;
+    for (j=0; j<s->s_edge_list_count; j++){
+      next = (s->s_edge_list[j] != NULL) ? s->s_edge_list[j]->e_next : NULL;
+      if (next == NULL || index_state_kcs(v, count, next) >= 0)
+        continue;
+      if (count >= size){
+        size *= 2;
+        tmp = realloc(v, sizeof(struct kcs_sm_state *) * size);
+        if (tmp == NULL){
+          free(v);
+          return NULL;
         }
-        resume_katcp(d);
-      } else if (t->t_flags & PROCESS_SLAVE){
-        log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "statemachine slave process ending %s", name);
+        v = tmp;
       }
+      v[count++] = next;
+    }
+  }
 
-      destroy_sched_task_kcs(t);
+  p = malloc(sizeof(struct kcs_sm_program));
+  if (p == NULL){
+    free(v);
+    return NULL;
+  }
 
-#ifdef DEBUG
-      fprintf(stderr, "**********[end statemachine (%s) run]**********\n", name);
-#endif
+  p->p_name        = strdup(startnode);
+  p->p_refs        = 1;
+  p->p_stack       = stack;
+  p->p_state_count = count;
+  p->p_op_count    = ops;
+  p->p_edge_count  = edges;
+  p->p_states      = calloc(count, sizeof(struct kcs_sm_pstate));
+  p->p_ops         = malloc(sizeof(struct kcs_sm_pop) * (ops > 0 ? ops : 1));
+  p->p_edges       = malloc(sizeof(struct kcs_sm_pedge) * (edges > 0 ? edges : 1));
+
+  if (p->p_name == NULL || p->p_states == NULL || p->p_ops == NULL || p->p_edges == NULL){
+    release_program_kcs(p);
+    free(v);
+    return NULL;
+  }
+
+  ops = 0;
+  edges = 0;
+
+  for (i=0; i<count; i++){
+    s  = v[i];
+    ps = &(p->p_states[i]);
+
+    ps->s_name = strdup(s->s_name);
+    if (ps->s_name == NULL){
+      release_program_kcs(p);
+      free(v);
+      return NULL;
+    }
+
+    ps->s_op = ops;
+    for (k=0; k<s->s_op_list_count; k++){
+      if (s->s_op_list[k] == NULL)
+        continue;
+      if (s->s_op_list[k]->o_call == &trigger_edge_process_kcs){
+        p->p_ops[ops].p_call = NULL;
+        p->p_ops[ops].p_tobject = NULL;
+      } else {
+        p->p_ops[ops].p_call = s->s_op_list[k]->o_call;
+        p->p_ops[ops].p_tobject = s->s_op_list[k]->o_tobject;
+      }
+      ops++;
+    }
+    ps->s_op_count = ops - ps->s_op;
+
+    ps->s_edge = edges;
+    for (k=0; k<s->s_edge_list_count; k++){
+      if (s->s_edge_list[k] == NULL || s->s_edge_list[k]->e_next == NULL)
+        continue;
+      p->p_edges[edges].e_call = s->s_edge_list[k]->e_call;
+      p->p_edges[edges].e_next = index_state_kcs(v, count, s->s_edge_list[k]->e_next);
+      edges++;
+    }
+    ps->s_edge_count = edges - ps->s_edge;
+  }
+
+  free(v);
+
+  return p;
+}
+
+struct kcs_sm_program *find_program_kcs(struct kcs_scheduler *ks, char *state, int *index)
+{
+  struct kcs_sm_program *p;
+  int i, j;
+
+  if (ks == NULL || state == NULL)
+    return NULL;
+
+  /*prefer a program compiled from this state, else any which contains it*/
+  for (i=0; i<ks->s_program_count; i++){
+    if (strcmp(ks->s_programs[i]->p_name, state) == 0){
+      *index = 0;
+      return ks->s_programs[i];
+    }
+  }
+
+  for (i=0; i<ks->s_program_count; i++){
+    p = ks->s_programs[i];
+    for (j=0; j<p->p_state_count; j++){
+      if (strcmp(p->p_states[j].s_name, state) == 0){
+        *index = j;
+        return p;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+int add_program_kcs(struct kcs_scheduler *ks, struct kcs_sm_program *p)
+{
+  struct kcs_sm_program **tmp;
+  int i;
+
+  for (i=0; i<ks->s_program_count; i++){
+    if (strcmp(ks->s_programs[i]->p_name, p->p_name) == 0){
+      release_program_kcs(ks->s_programs[i]);
+      ks->s_programs[i] = p;
       return 0;
+    }
   }
 
-  if (rtn < 0){
-#ifdef DEBUG
-    fprintf(stderr, "statemachine: process error setting task state to CLEAN UP\n");
-#endif
-#if 0
-    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "statemachine: going to cleanup state");
-#endif
-    t->t_rtn  = rtn;
-    rtn = TASK_STATE_CLEAN_UP;
-    wake_notice_katcp(d, n, NULL);
+  tmp = realloc(ks->s_programs, sizeof(struct kcs_sm_program *) * (ks->s_program_count + 1));
+  if (tmp == NULL)
+    return -1;
+
+  ks->s_programs = tmp;
+  ks->s_programs[ks->s_program_count] = p;
+  ks->s_program_count++;
+
+  return 0;
+}
+
+int forget_programs_kcs(struct katcp_dispatch *d)
+{
+  struct kcs_scheduler *ks;
+  int i;
+
+  ks = get_sched_kcs(d);
+  if (ks == NULL)
+    return -1;
+
+  for (i=0; i<ks->s_program_count; i++){
+    release_program_kcs(ks->s_programs[i]);
   }
 
-  t->t_state = rtn;
-  
-  //log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "process abt to rtn %d", t->t_state);
+  if (ks->s_programs)
+    free(ks->s_programs);
 
-  return t->t_state;
+  ks->s_programs = NULL;
+  ks->s_program_count = 0;
+
+  return 0;
 }
 
 /*
@@ -800,37 +1378,73 @@ this will achive task / process ||ism
 */
 int start_process_kcs(struct katcp_dispatch *d, char *startnode, struct katcp_tobject *to, int flags)
 {
+  struct katcp_dispatch *dl;
   struct katcp_notice *n;
+  struct kcs_scheduler *ks;
   struct kcs_sched_task *t;
+  struct kcs_sm_program *p;
   struct kcs_sm_state *s;
-  char *name;
+  char name[32];
+  int start;
   
 #ifdef DEBUG
   fprintf(stderr, "**********[start statemachine run]**********\n");
 #endif
 
-  s = get_key_data_type_katcp(d, KATCP_TYPE_STATEMACHINE_STATE, startnode);
-  
-  if (s == NULL)
+  dl = template_shared_katcp(d);
+  if (dl == NULL)
+    dl = d;
+
+  ks = get_sched_kcs(dl);
+  if (ks == NULL)
     return -1;
-  
-  t = create_sched_task_kcs(s, to, flags);
+
+  p = find_program_kcs(ks, startnode, &start);
+  if (p != NULL){
+    t = create_program_task_kcs(p, start, to, flags);
+  } else {
+    s = get_key_data_type_katcp(d, KATCP_TYPE_STATEMACHINE_STATE, startnode);
+    if (s == NULL)
+      return -1;
+    t = create_sched_task_kcs(s, to, flags);
+  }
+
   if (t == NULL)
     return -1;
- 
-  name = gen_id_avltree("sm");
 
-  n = register_notice_katcp(d, name, 0, &statemachine_process_kcs, t);
+  t->t_sched = ks;
+ 
+  /*time stamped ids collide when many tasks start at once, a shared notice would wake them all*/
+  snprintf(name, sizeof(name), "sm.%lu", ks->s_serial++);
 
-  if (name != NULL) 
-    free(name);
+  /*tasks run on behalf of the server, the notice is only used while parked*/
+  n = register_notice_katcp(dl, name, 0, &statemachine_wake_kcs, t);
 
   if (n == NULL){
     destroy_sched_task_kcs(t);
     return -1;
   }
-  
-  wake_notice_katcp(d, n, NULL);
+
+  t->t_notice = n;
+
+  if (flags & PROCESS_MASTER){
+    /*the requesting client waits on a separate notice, so it may go away safely*/
+    t->t_done = register_notice_katcp(d, NULL, 0, &resume_process_kcs, NULL);
+    if (t->t_done == NULL){
+      remove_notice_katcp(dl, n, &statemachine_wake_kcs, t);
+      destroy_sched_task_kcs(t);
+      return -1;
+    }
+    hold_notice_katcp(d, t->t_done);
+  }
+
+  ks->s_tasks++;
+
+  if (enqueue_sched_kcs(dl, ks, t) < 0){
+    t->t_state = TASK_STATE_CLEAN_UP;
+    statemachine_finish_kcs(dl, t);
+    return -1;
+  }
 
   return 0;
 }
@@ -893,12 +1507,15 @@ int statemachine_stopall_kcs(struct katcp_dispatch *d)
       if (fetch_data_notice_katcp(d, n, data, 1) == 1){
         t = data[0];
         if (t != NULL){
-          if (remove_notice_katcp(d, n, &statemachine_process_kcs, t) < 0){
-            log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "could not remove notice");
-          }
-
+          /*queued tasks clean up when next run, parked ones get woken now*/
           t->t_state = TASK_STATE_CLEAN_UP;
-          statemachine_process_kcs(d, n, t);  
+          if (t->t_parked){
+            t->t_parked = 0;
+            if (enqueue_sched_kcs(d, t->t_sched, t) < 0){
+              log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "could not requeue task %s", n->n_name);
+              t->t_parked = 1;
+            }
+          }
         }
       }
     }
@@ -913,6 +1530,71 @@ int statemachine_stopall_kcs(struct katcp_dispatch *d)
   return KATCP_RESULT_OK;
 }
 
+int statemachine_sched_kcs(struct katcp_dispatch *d)
+{
+  struct kcs_scheduler *ks;
+  int i;
+
+  ks = get_sched_kcs(d);
+  if (ks == NULL)
+    return KATCP_RESULT_FAIL;
+
+  prepend_inform_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, "tasks");
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, ks->s_tasks);
+  prepend_inform_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, "ready");
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, ks->s_count);
+  prepend_inform_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, "edges");
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, ks->s_edges);
+  prepend_inform_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, "ops");
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, ks->s_ops);
+  prepend_inform_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, "runs");
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, ks->s_runs);
+  prepend_inform_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, "slices");
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, ks->s_slices);
+  prepend_inform_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, "deferred");
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, ks->s_deferred);
+  prepend_inform_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, "budget");
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, ks->s_budget);
+
+  for (i=0; i<ks->s_program_count; i++){
+    prepend_inform_katcp(d);
+    append_string_katcp(d, KATCP_FLAG_STRING, "program");
+    append_string_katcp(d, KATCP_FLAG_STRING, ks->s_programs[i]->p_name);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, ks->s_programs[i]->p_state_count);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, ks->s_programs[i]->p_refs - 1);
+  }
+
+  return KATCP_RESULT_OK;
+}
+
+int statemachine_budget_kcs(struct katcp_dispatch *d)
+{
+  struct kcs_scheduler *ks;
+  unsigned long budget;
+
+  ks = get_sched_kcs(d);
+  if (ks == NULL)
+    return KATCP_RESULT_FAIL;
+
+  budget = arg_unsigned_long_katcp(d, 2);
+  if (budget == 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "scheduler budget needs to be a positive number of microseconds");
+    return KATCP_RESULT_FAIL;
+  }
+
+  ks->s_budget = budget;
+
+  return KATCP_RESULT_OK;
+}
+
 int statemachine_tagsets_kcs(struct katcp_dispatch *d)
 {
   if (dump_tagsets_katcp(d) < 0)
@@ -943,10 +1625,48 @@ int statemachine_edge_kcs(struct katcp_dispatch *d)
    
   if (create_named_edge_kcs(d, n_current, n_next, edge) < 0)
     return KATCP_RESULT_FAIL;
+
+  forget_programs_kcs(d);
   
   return KATCP_RESULT_OK;
 }
 
+int statemachine_compile_kcs(struct katcp_dispatch *d, int argc)
+{
+  struct kcs_scheduler *ks;
+  struct kcs_sm_program *p;
+  char *start;
+  int stack;
+
+  start = arg_string_katcp(d, 2);
+  stack = (argc > 3) ? arg_unsigned_long_katcp(d, 3) : KCS_SM_STACK;
+
+  ks = get_sched_kcs(d);
+  if (ks == NULL)
+    return KATCP_RESULT_FAIL;
+
+  p = compile_program_kcs(d, start, stack);
+  if (p == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to compile statemachine from %s", start ? start : "<null>");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if (add_program_kcs(ks, p) < 0){
+    release_program_kcs(p);
+    return KATCP_RESULT_FAIL;
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "compiled %s with %d states, %d ops and %d edges", p->p_name, p->p_state_count, p->p_op_count, p->p_edge_count);
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, p->p_state_count);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, p->p_op_count);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, p->p_edge_count);
+
+  return KATCP_RESULT_OWN;
+}
+
 int statemachine_op_kcs(struct katcp_dispatch *d)
 {
   char *state, *op;
@@ -967,6 +1687,8 @@ int statemachine_op_kcs(struct katcp_dispatch *d)
   if (create_named_op_kcs(d, state, op) < 0)
     return KATCP_RESULT_FAIL;
 
+  forget_programs_kcs(d);
+
   return KATCP_RESULT_OK;
 }
 
@@ -974,12 +1696,21 @@ int statemachine_flush_kcs(struct katcp_dispatch *d)
 {
   
   struct katcp_type *t;
+  struct kcs_scheduler *ks;
 
   t = find_name_type_katcp(d, KATCP_TYPE_STATEMACHINE_STATE);
 
   if (t == NULL)
     return KATCP_RESULT_FAIL;
 
+  /*running tasks point into the graph, either directly or through the ops their program borrowed*/
+  ks = get_sched_kcs(d);
+  if (ks != NULL && ks->s_tasks > 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to flush statemachines while %lu tasks are still running", ks->s_tasks);
+    return KATCP_RESULT_FAIL;
+  }
+
+  forget_programs_kcs(d);
   flush_type_katcp(t);
   
 #if 0
@@ -1055,6 +1786,8 @@ int statemachine_greeting_kcs(struct katcp_dispatch *d)
   prepend_inform_katcp(d);
   append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "run [start state]");
   prepend_inform_katcp(d);
+  append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "compile [start state] ([stack size])");
+  prepend_inform_katcp(d);
   append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "ds (print the entire datastore)");
   prepend_inform_katcp(d);
   append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "oplist (print op list)");
@@ -1063,6 +1796,10 @@ int statemachine_greeting_kcs(struct katcp_dispatch *d)
   prepend_inform_katcp(d);
   append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "stopall");
   prepend_inform_katcp(d);
+  append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "sched (scheduler statistics)");
+  prepend_inform_katcp(d);
+  append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "budget [usec] (scheduler time per loop iteration)");
+  prepend_inform_katcp(d);
   append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "flush (remove defined statemachines)");
   prepend_inform_katcp(d);
   append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "tagsets");
@@ -1091,6 +1828,8 @@ int statemachine_cmd(struct katcp_dispatch *d, int argc)
         return statemachine_stopall_kcs(d);
       if (strcmp(arg_string_katcp(d, 1), "tagsets") == 0)
         return statemachine_tagsets_kcs(d);
+      if (strcmp(arg_string_katcp(d, 1), "sched") == 0)
+        return statemachine_sched_kcs(d);
       
       break;
     case 3:
@@ -1104,9 +1843,17 @@ int statemachine_cmd(struct katcp_dispatch *d, int argc)
         return statemachine_run_kcs(d);
       if (strcmp(arg_string_katcp(d, 1), "dt") == 0)
         return statemachine_dump_type_kcs(d);
+      if (strcmp(arg_string_katcp(d, 1), "budget") == 0)
+        return statemachine_budget_kcs(d);
+      if (strcmp(arg_string_katcp(d, 1), "compile") == 0)
+        return statemachine_compile_kcs(d, argc);
       
       break;
   }
+  if (argc == 4){
+    if (strcmp(arg_string_katcp(d, 1), "compile") == 0)
+      return statemachine_compile_kcs(d, argc);
+  }
   if (argc > 3){
     if (strcmp(arg_string_katcp(d, 2), "op") == 0)
       return statemachine_op_kcs(d);
@@ -1116,3 +1863,166 @@ int statemachine_cmd(struct katcp_dispatch *d, int argc)
   return KATCP_RESULT_FAIL;
 }
 
+
+#ifdef KCS_BENCHMARK_STATEMACHINE
+/* runs a ring of states, each pushing and dropping a few values, for many
+ * tasks, first interpreted and then compiled, and reports how quickly the
+ * scheduler moves them along: ./bench-statemachine [tasks [states [seconds]]]
+ */
+
+int pushstack_statemachine_kcs(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_tobject *o);
+
+static int drop_bench_kcs(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_tobject *o)
+{
+  return (pop_data_stack_katcp(stack) != NULL) ? 0 : -1;
+}
+
+static int add_op_bench_kcs(struct kcs_sm_state *s, struct kcs_sm_op *op)
+{
+  struct kcs_sm_op **tmp;
+
+  if (op == NULL)
+    return -1;
+
+  tmp = realloc(s->s_op_list, sizeof(struct kcs_sm_op *) * (s->s_op_list_count + 1));
+  if (tmp == NULL)
+    return -1;
+
+  s->s_op_list = tmp;
+  s->s_op_list[s->s_op_list_count++] = op;
+
+  return 0;
+}
+
+static double run_bench_kcs(struct katcp_dispatch *d, unsigned long tasks, unsigned long seconds, char *label)
+{
+  struct kcs_scheduler *ks;
+  struct timeval start, now, delta;
+  unsigned long i, edges;
+  double elapsed;
+
+  ks = get_sched_kcs(d);
+  if (ks == NULL)
+    return -1.0;
+
+  for (i=0; i<tasks; i++){
+    if (start_process_kcs(d, "s0", NULL, PROCESS_SLAVE) < 0){
+      fprintf(stderr, "unable to start task %lu\n", i);
+      return -1.0;
+    }
+  }
+
+  if (statemachine_flush_kcs(d) != KATCP_RESULT_FAIL){
+    fprintf(stderr, "flush allowed while %lu tasks still run\n", ks->s_tasks);
+    return -1.0;
+  }
+
+  ks->s_edges = 0;
+  ks->s_ops   = 0;
+  ks->s_runs  = 0;
+
+  gettimeofday(&start, NULL);
+  do {
+    run_sched_kcs(d, ks);
+    gettimeofday(&now, NULL);
+    sub_time_katcp(&delta, &now, &start);
+  } while (delta.tv_sec < seconds);
+
+  elapsed = delta.tv_sec + (delta.tv_usec / 1000000.0);
+  edges = ks->s_edges;
+
+  printf("%s: tasks=%lu edges=%lu ops=%lu time=%.3fs edges/sec=%.0f\n", label, ks->s_tasks, edges, ks->s_ops, elapsed, edges / elapsed);
+
+  /*retire the tasks before the next round*/
+  statemachine_stopall_kcs(d);
+  while (ks->s_count > 0){
+    run_sched_kcs(d, ks);
+  }
+
+  return edges / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+  struct katcp_dispatch *d;
+  struct kcs_scheduler *ks;
+  struct kcs_sm_program *p;
+  struct kcs_sm_state *s;
+  struct katcp_tobject *to;
+  char name[24], next[24];
+  unsigned long tasks, states, seconds, i;
+  double interpreted, compiled;
+
+  tasks   = (argc > 1) ? strtoul(argv[1], NULL, 0) : 10000;
+  states  = (argc > 2) ? strtoul(argv[2], NULL, 0) : 8;
+  seconds = (argc > 3) ? strtoul(argv[3], NULL, 0) : 2;
+
+  if (states < 1)
+    states = 1;
+
+  d = startup_katcp();
+  if (d == NULL){
+    fprintf(stderr, "unable to create dispatch\n");
+    return 1;
+  }
+
+  if (statemachine_init_kcs(d) < 0){
+    fprintf(stderr, "unable to initialise statemachine types\n");
+    return 1;
+  }
+
+  for (i=0; i<states; i++){
+    snprintf(name, sizeof(name), "s%lu", i);
+    if (create_named_node_kcs(d, name) < 0){
+      fprintf(stderr, "unable to create state %s\n", name);
+      return 1;
+    }
+  }
+
+  for (i=0; i<states; i++){
+    snprintf(name, sizeof(name), "s%lu", i);
+    snprintf(next, sizeof(next), "s%lu", (i + 1) % states);
+
+    s = get_key_data_type_katcp(d, KATCP_TYPE_STATEMACHINE_STATE, name);
+    to = create_named_tobject_katcp(d, create_integer_type_kcs(i), KATCP_TYPE_INTEGER, 1);
+    if (s == NULL || to == NULL){
+      fprintf(stderr, "unable to set up state %s\n", name);
+      return 1;
+    }
+
+    if (add_op_bench_kcs(s, create_sm_op_kcs(&pushstack_statemachine_kcs, to)) < 0 ||
+        add_op_bench_kcs(s, create_sm_op_kcs(&pushstack_statemachine_kcs, to)) < 0 ||
+        add_op_bench_kcs(s, create_sm_op_kcs(&drop_bench_kcs, NULL)) < 0 ||
+        add_op_bench_kcs(s, create_sm_op_kcs(&drop_bench_kcs, NULL)) < 0){
+      fprintf(stderr, "unable to add ops to state %s\n", name);
+      return 1;
+    }
+
+    if (create_named_edge_kcs(d, name, next, NULL) < 0){
+      fprintf(stderr, "unable to create edge %s -> %s\n", name, next);
+      return 1;
+    }
+  }
+
+  printf("%lu states with 4 ops and 1 edge each\n", states);
+
+  interpreted = run_bench_kcs(d, tasks, seconds, "interpreted");
+  if (interpreted < 0)
+    return 1;
+
+  ks = get_sched_kcs(d);
+  p = compile_program_kcs(d, "s0", KCS_SM_STACK);
+  if (ks == NULL || p == NULL || add_program_kcs(ks, p) < 0){
+    fprintf(stderr, "unable to compile graph\n");
+    return 1;
+  }
+
+  compiled = run_bench_kcs(d, tasks, seconds, "compiled");
+  if (compiled < 0)
+    return 1;
+
+  printf("speedup=%.2f\n", compiled / interpreted);
+
+  return 0;
+}
+#endif
@@ -110,7 +110,7 @@ int pushstack_statemachine_kcs(struct katcp_dispatch *d, struct katcp_stack *sta
   return push_stack_ref_obj_katcp(stack, o);
 #endif
 #if 1
-  return push_tobject_katcp(stack, copy_tobject_katcp(o));
+  return push_stack_katcp(stack, o->o_data, o->o_type);
 #endif
 }
 
@@ -264,9 +264,11 @@ int msleep_statemachine_kcs(struct katcp_dispatch *d, struct katcp_notice *n, vo
   
   component_time_katcp(&tv, (unsigned int) (*time));
 
-  wake_notice_in_tv_katcp(d, n, &tv);
+  /*the task stays parked until the timer wakes it*/
+  if (wake_notice_in_tv_katcp(d, n, &tv) < 0)
+    return EDGE_FAIL;
 
-  return 0;
+  return EDGE_WAIT;
 }
 
 struct kcs_sm_edge *msleep_setup_statemachine_kcs(struct katcp_dispatch *d, struct kcs_sm_state *s)
@@ -297,9 +299,7 @@ int peek_stack_type_statemachine_kcs(struct katcp_dispatch *d, struct katcp_noti
   if (to == NULL && to->o_type != t)
     return -1;
 
-  wake_notice_katcp(d, n, NULL);
-  
-  return 0;
+  return EDGE_OKAY;
 }
 
 struct kcs_sm_edge *peek_stack_type_setup_statemachine_kcs(struct katcp_dispatch *d, struct kcs_sm_state *s)
@@ -332,8 +332,7 @@ int is_stack_empty_statemachine_kcs(struct katcp_dispatch *d, struct katcp_notic
     return -1;
 
   if (is_empty_stack_katcp(stack)){
-    wake_notice_katcp(d, n, NULL);
-    return 0;
+    return EDGE_OKAY;
   }
 
   return -1;
@@ -1,82 +1,1284 @@
+/* collects #log informs from one or more katcp servers. Either writes
+ * them to a single text file, as before, or to size and time rotated
+ * archives: each archive is a sequence of independently compressed gzip
+ * members (so zcat still reads it), described by a sidecar index which
+ * records offset, time range and levels of each block. The query mode
+ * (-x) uses that index to only decompress the blocks of interest
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <sysexits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
 
-#include <sys/types.h>
-#include <sys/time.h>
-#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include <zlib.h>
+
+#include <netc.h>
+#include <katcl.h>
+#include <katcp.h>
+#include <katpriv.h>
+#include <fork-parent.h>
+
+#define NAME "kcplog"
+
+#define LOG_EVENTS           64   /* events collected per epoll_wait */
+#define LOG_RETRY_MIN       250   /* ms before reconnecting to a source */
+#define LOG_RETRY_MAX     30000   /* ms cap on the reconnect backoff */
+
+#define LOG_BLOCK         65536   /* uncompressed bytes per archive block */
+#define LOG_BLOCK_AGE         2   /* seconds a partial block is held back */
+#define LOG_ROTATE_SIZE (64 * 1024 * 1024)
+#define LOG_ROTATE_TIME    3600
+#define LOG_COMPRESSION       3   /* zlib level, favours throughput */
+#define LOG_CHUNK         65536
+
+#define SOURCE_DOWN           0
+#define SOURCE_CONNECTING     1
+#define SOURCE_UP             2
+#define SOURCE_GONE           3
+
+static volatile int log_level = KATCP_LEVEL_INFO;
+static volatile int log_changed = 0;
+static volatile int log_reload = 0;
+static volatile int log_terminate = 0;
+
+struct log_source{
+  char *s_name;
+  struct katcl_line *s_line;
+  int s_state;
+  unsigned int s_events;
+
+  unsigned int s_backoff;
+  unsigned int s_failures;
+  struct timeval s_retry;
+
+  unsigned long s_received;
+  unsigned long s_messages;
+  unsigned long s_connects;
+};
+
+struct log_archive{
+  char *a_prefix;
+  char *a_name;
+  int a_fd;
+  FILE *a_index;
+  unsigned long a_size;
+  time_t a_opened;
+
+  unsigned long a_limit;
+  unsigned int a_period;
+
+  char *a_block;
+  unsigned int a_have;
+  unsigned int a_capacity;
+  unsigned int a_block_size;
+
+  unsigned int a_count;
+  unsigned int a_mask;
+  double a_first;
+  double a_last;
+  time_t a_started;
+
+  z_stream a_stream;
+  unsigned char *a_output;
+  unsigned int a_output_size;
+
+  unsigned long a_blocks;
+  unsigned long a_files;
+};
+
+struct log_state{
+  struct log_source *l_sources;
+  unsigned int l_count;
+
+  int l_efd;
+  int l_verbose;
+  int l_attempts;
+  int l_limit;
+
+  struct katcl_line *l_output;
+  struct log_archive *l_archive;
+};
+
+struct log_query{
+  int q_level;
+  double q_begin;
+  double q_end;
+
+  char *q_carry;
+  unsigned int q_have;
+  unsigned int q_size;
+
+  z_stream q_stream;
+  unsigned char q_chunk[LOG_CHUNK];
+
+  unsigned long q_matched;
+  unsigned int q_blocks;
+  unsigned int q_inflated;
+};
+
+void usage(char *app)
+{
+  printf("usage: %s [-v] [-h] [-l level] [-o logfile] [-z prefix [-R size] [-T seconds] [-B size]] [-a reconnect-attempts] [-d] [-t] [-s server:port]*\n", app);
+  printf("       %s -x [-v] [-l level] [-b start] [-e end] archive*\n", app);
+  printf("-v              be more verbose\n");
+  printf("-h              this help\n");
+  printf("-l level        select a log level (trace, debug, info, warn, ... to log at)\n");
+  printf("-o logfile      write log messages to the specified log file instead of stdout\n");
+  printf("-z prefix       write compressed archives named prefix-date-time.log.gz with a .log.idx index\n");
+  printf("-R size         start a new archive once the current one reaches this size (default %dM)\n", LOG_ROTATE_SIZE / (1024 * 1024));
+  printf("-T seconds      start a new archive after this many seconds (default %d)\n", LOG_ROTATE_TIME);
+  printf("-B size         uncompressed size of an archive block (default %dk)\n", LOG_BLOCK / 1024);
+  printf("-d              run in the background\n");
+  printf("-f              run in the foreground\n");
+  printf("-t              truncate the logfile when opening it\n");
+  printf("-s server:port  connect to the specified server rather than localhost:7147, can be repeated or a comma separated list\n");
+  printf("-a attempts     give up on a server after the given number of failed connection attempts (default never)\n");
+  printf("-x              query the given archives instead of collecting\n");
+  printf("-b start        only show messages logged at or after this unix time\n");
+  printf("-e end          only show messages logged at or before this unix time\n");
+  printf("with more than one server the module field is prefixed by the server name\n");
+  printf("signals: HUP USR1 USR2\n");
+  printf(" HUP            re-open the logfile (if -o is given) or start a new archive (if -z is given)\n");
+  printf(" USR1           change log level one level more detailed (eg from DEBUG to TRACE)\n");
+  printf(" USR2           change log level one level less detailed (eg from INFO to WARN)\n");
+}
+
+static void handle_signal(int signal)
+{
+  switch(signal){
+    case SIGUSR1 :
+      if(log_level > KATCP_LEVEL_TRACE){
+        log_level--;
+        log_changed = 1;
+      }
+      break;
+
+    case SIGUSR2 :
+      if(log_level < KATCP_LEVEL_OFF){
+        log_level++;
+        log_changed = 1;
+      }
+      break;
+
+    case SIGHUP :
+      log_reload = 1;
+      break;
+
+    case SIGTERM :
+    case SIGINT :
+      log_terminate = 1;
+      break;
+
+    default :
+      return;
+  }
+
+}
+
+unsigned long parse_size(char *text)
+{
+  unsigned long value;
+  char *end;
+
+  value = strtoul(text, &end, 0);
+  switch(end[0]){
+    case 'k' : case 'K' : return value * 1024;
+    case 'm' : case 'M' : return value * 1024 * 1024;
+    case 'g' : case 'G' : return value * 1024 * 1024 * 1024;
+  }
+
+  return value;
+}
+
+double log_time(char *when)
+{
+  double value;
+
+  if(when == NULL){
+    return 0.0;
+  }
+
+  value = strtod(when, NULL);
+
+  /* older servers report integer milliseconds */
+  if(value > 1e11){
+    value = value / 1000.0;
+  }
+
+  return value;
+}
+
+unsigned int escape_field(char *dst, char *src)
+{
+  unsigned int i, j;
+  char v;
+
+  if((src == NULL) || (src[0] == '\0')){
+    dst[0] = '\\';
+    dst[1] = '@';
+    return 2;
+  }
+
+  for(j = 0, i = 0; src[i] != '\0'; i++){
+    switch(src[i]){
+      case  27  : v = 'e';  break;
+      case '\n' : v = 'n';  break;
+      case '\r' : v = 'r';  break;
+      case '\\' : v = '\\'; break;
+      case ' '  : v = '_';  break;
+      case '\t' : v = 't';  break;
+      default   :
+        dst[j++] = src[i];
+        continue; /* WARNING: restart loop */
+    }
+    dst[j++] = '\\';
+    dst[j++] = v;
+  }
+
+  return j;
+}
+
+/* archive ****************************************************************/
+
+struct log_archive *create_archive(char *prefix, unsigned long limit, unsigned int period, unsigned int block)
+{
+  struct log_archive *a;
+
+  a = malloc(sizeof(struct log_archive));
+  if(a == NULL){
+    return NULL;
+  }
+
+  a->a_prefix = prefix;
+  a->a_name = NULL;
+  a->a_fd = (-1);
+  a->a_index = NULL;
+  a->a_size = 0;
+  a->a_opened = 0;
+
+  a->a_limit = limit;
+  a->a_period = period;
+
+  a->a_block_size = block;
+  a->a_capacity = block;
+  a->a_have = 0;
+  a->a_block = malloc(a->a_capacity);
+
+  a->a_count = 0;
+  a->a_mask = 0;
+  a->a_first = 0.0;
+  a->a_last = 0.0;
+  a->a_started = 0;
+
+  a->a_output_size = 0;
+  a->a_output = NULL;
+
+  a->a_blocks = 0;
+  a->a_files = 0;
+
+  a->a_stream.zalloc = Z_NULL;
+  a->a_stream.zfree = Z_NULL;
+  a->a_stream.opaque = Z_NULL;
+
+  /* 16 + window bits: gzip framing, so that each block is a gzip member */
+  if((a->a_block == NULL) || (deflateInit2(&(a->a_stream), LOG_COMPRESSION, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)){
+    if(a->a_block){
+      free(a->a_block);
+    }
+    free(a);
+    return NULL;
+  }
+
+  return a;
+}
+
+int open_archive(struct log_archive *a)
+{
+  char stamp[32];
+  struct tm *local;
+  unsigned int len, i;
+  time_t now;
+  char *ptr;
+
+  time(&now);
+  local = localtime(&now);
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", local);
+
+  len = strlen(a->a_prefix) + strlen(stamp) + 32;
+  ptr = realloc(a->a_name, len);
+  if(ptr == NULL){
+    return -1;
+  }
+  a->a_name = ptr;
+
+  for(i = 0; i < 1000; i++){
+    if(i == 0){
+      snprintf(a->a_name, len, "%s-%s.log.gz", a->a_prefix, stamp);
+    } else {
+      snprintf(a->a_name, len, "%s-%s-%u.log.gz", a->a_prefix, stamp, i);
+    }
+    a->a_fd = open(a->a_name, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+    if(a->a_fd >= 0){
+      break;
+    }
+    if(errno != EEXIST){
+      return -1;
+    }
+  }
+
+  if(a->a_fd < 0){
+    return -1;
+  }
+
+  /* foo.log.gz gets foo.log.idx */
+  strcpy(a->a_name + strlen(a->a_name) - 2, "idx");
+  a->a_index = fopen(a->a_name, "w");
+  if(a->a_index == NULL){
+    close(a->a_fd);
+    a->a_fd = (-1);
+    return -1;
+  }
+  fprintf(a->a_index, "# offset length size count first last levels\n");
+
+  a->a_size = 0;
+  a->a_opened = now;
+  a->a_files++;
+
+  return 0;
+}
+
+void close_archive(struct log_archive *a)
+{
+  if(a->a_fd >= 0){
+    close(a->a_fd);
+    a->a_fd = (-1);
+  }
+
+  if(a->a_index){
+    fclose(a->a_index);
+    a->a_index = NULL;
+  }
+}
+
+static void rewind_archive(struct log_archive *a)
+{
+  int error;
+
+  /* cut a torn block off again, otherwise the next one lands after it and every later index offset is wrong */
+
+  error = errno;
+
+  if((ftruncate(a->a_fd, a->a_size) < 0) || (lseek(a->a_fd, a->a_size, SEEK_SET) < 0)){
+    /* unable to restore the file, the next block starts a new archive instead */
+    close_archive(a);
+  }
+
+  errno = error;
+}
+
+int flush_archive(struct log_archive *a)
+{
+  unsigned int want;
+  int wr, result;
+
+  if(a->a_have == 0){
+    return 0;
+  }
+
+  if(a->a_fd >= 0){
+    if((a->a_size >= a->a_limit) || ((a->a_period > 0) && (time(NULL) >= (a->a_opened + a->a_period)))){
+      close_archive(a);
+    }
+  }
+
+  if(a->a_fd < 0){
+    if(open_archive(a) < 0){
+      return -1;
+    }
+  }
+
+  want = deflateBound(&(a->a_stream), a->a_have);
+  if(want > a->a_output_size){
+    free(a->a_output);
+    a->a_output = malloc(want);
+    if(a->a_output == NULL){
+      a->a_output_size = 0;
+      return -1;
+    }
+    a->a_output_size = want;
+  }
+
+  deflateReset(&(a->a_stream));
+
+  a->a_stream.next_in = (unsigned char *)a->a_block;
+  a->a_stream.avail_in = a->a_have;
+  a->a_stream.next_out = a->a_output;
+  a->a_stream.avail_out = a->a_output_size;
+
+  result = deflate(&(a->a_stream), Z_FINISH);
+  if(result != Z_STREAM_END){
+    return -1;
+  }
+
+  want = a->a_output_size - a->a_stream.avail_out;
+
+  for(wr = 0; wr < want; ){
+    result = write(a->a_fd, a->a_output + wr, want - wr);
+    if(result < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      rewind_archive(a);
+      return -1;
+    }
+    wr += result;
+  }
+
+  fprintf(a->a_index, "%lu %u %u %u %.3f %.3f %02x\n", a->a_size, want, a->a_have, a->a_count, a->a_first, a->a_last, a->a_mask);
+  fflush(a->a_index);
+
+  a->a_size += want;
+  a->a_blocks++;
+
+  a->a_have = 0;
+  a->a_count = 0;
+  a->a_mask = 0;
+
+  return 0;
+}
+
+int reserve_archive(struct log_archive *a, unsigned int need)
+{
+  char *ptr;
+
+  if((a->a_have + need) > a->a_block_size){
+    if(flush_archive(a) < 0){
+      return -1;
+    }
+  }
+
+  if(need > a->a_capacity){
+    ptr = realloc(a->a_block, need);
+    if(ptr == NULL){
+      return -1;
+    }
+    a->a_block = ptr;
+    a->a_capacity = need;
+  }
+
+  return 0;
+}
+
+int append_archive(struct log_archive *a, int level, double when, unsigned int count, char **fields, char *source)
+{
+  unsigned int need, i;
+  char *ptr;
+
+  need = 2;
+  for(i = 0; i < count; i++){
+    need += (fields[i] ? (2 * strlen(fields[i])) : 0) + 3;
+  }
+  if(source){
+    need += (2 * strlen(source)) + 1;
+  }
+
+  if(reserve_archive(a, need) < 0){
+    return -1;
+  }
+
+  ptr = a->a_block + a->a_have;
+
+  for(i = 0; i < count; i++){
+    if(i > 0){
+      *ptr++ = ' ';
+    }
+    if((i == 3) && source){
+      ptr += escape_field(ptr, source);
+      *ptr++ = '/';
+    }
+    ptr += escape_field(ptr, fields[i]);
+  }
+  *ptr++ = '\n';
+
+  if(a->a_count == 0){
+    a->a_first = when;
+    a->a_last = when;
+    a->a_started = time(NULL);
+  } else {
+    if(when < a->a_first){
+      a->a_first = when;
+    }
+    if(when > a->a_last){
+      a->a_last = when;
+    }
+  }
+
+  a->a_mask |= (1 << level);
+  a->a_count++;
+
+  a->a_have = ptr - a->a_block;
+
+  return 0;
+}
+
+/* collector **************************************************************/
+
+void note_state(struct log_state *ls, int level, char *fmt, ...)
+{
+  char buffer[1024], when[32];
+  char *fields[5];
+  struct timeval now;
+  va_list args;
+
+  va_start(args, fmt);
+
+  if(ls->l_archive){
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    gettimeofday(&now, NULL);
+    snprintf(when, sizeof(when), "%lu.%03lu", (unsigned long)now.tv_sec, (unsigned long)now.tv_usec / 1000);
+
+    fields[0] = KATCP_LOG_INFORM;
+    fields[1] = log_to_string_katcl(level);
+    fields[2] = when;
+    fields[3] = NAME;
+    fields[4] = buffer;
+
+    append_archive(ls->l_archive, level, now.tv_sec + (now.tv_usec / 1000000.0), 5, fields, NULL);
+  } else {
+    vlog_message_katcl(ls->l_output, level, NAME, fmt, args);
+  }
+
+  va_end(args);
+}
+
+int add_sources(struct log_state *ls, char *list)
+{
+  struct log_source *tmp, *s;
+  char *copy, *name;
+
+  copy = strdup(list);
+  if(copy == NULL){
+    return -1;
+  }
+
+  for(name = strtok(copy, ","); name; name = strtok(NULL, ",")){
+    tmp = realloc(ls->l_sources, sizeof(struct log_source) * (ls->l_count + 1));
+    if(tmp == NULL){
+      return -1;
+    }
+    ls->l_sources = tmp;
+
+    s = &(ls->l_sources[ls->l_count]);
+
+    s->s_name = strdup(name);
+    if(s->s_name == NULL){
+      return -1;
+    }
+    s->s_line = NULL;
+    s->s_state = SOURCE_DOWN;
+    s->s_events = 0;
+    s->s_backoff = 0;
+    s->s_failures = 0;
+    s->s_retry.tv_sec = 0;
+    s->s_retry.tv_usec = 0;
+    s->s_received = 0;
+    s->s_messages = 0;
+    s->s_connects = 0;
+
+    ls->l_count++;
+  }
+
+  /* strings are duplicated, copy is only used for tokenising */
+  free(copy);
+
+  return 0;
+}
+
+int watch_source(struct log_state *ls, struct log_source *s)
+{
+  struct epoll_event ev;
+  unsigned int events;
+  int op;
+
+  switch(s->s_state){
+    case SOURCE_CONNECTING :
+      events = EPOLLOUT;
+      break;
+    case SOURCE_UP :
+      events = EPOLLIN;
+      if(flushing_katcl(s->s_line)){
+        events |= EPOLLOUT;
+      }
+      break;
+    default :
+      return 0;
+  }
+
+  if(events == s->s_events){
+    return 0;
+  }
+
+  op = s->s_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+  ev.events = events;
+  ev.data.ptr = s;
+
+  if(epoll_ctl(ls->l_efd, op, fileno_katcl(s->s_line), &ev) < 0){
+    return -1;
+  }
+
+  s->s_events = events;
+
+  return 0;
+}
+
+void down_source(struct log_state *ls, struct log_source *s, char *reason)
+{
+  struct timeval now, delta;
+  unsigned int ms;
+
+  if(s->s_line){
+    if(s->s_events){
+      epoll_ctl(ls->l_efd, EPOLL_CTL_DEL, fileno_katcl(s->s_line), NULL);
+    }
+    destroy_katcl(s->s_line, 1);
+    s->s_line = NULL;
+  }
+  s->s_events = 0;
+
+  if(s->s_state == SOURCE_UP){
+    note_state(ls, KATCP_LEVEL_WARN, "lost connection to %s after %lu messages: %s", s->s_name, s->s_received, reason);
+  } else if(ls->l_verbose > 1){
+    fprintf(stderr, "%s: unable to connect to %s: %s\n", NAME, s->s_name, reason);
+  }
+
+  /* a connection which delivered something starts the backoff afresh */
+  if((s->s_state == SOURCE_UP) && (s->s_received > 0)){
+    s->s_backoff = LOG_RETRY_MIN;
+    s->s_failures = 0;
+  } else {
+    s->s_backoff = s->s_backoff ? (2 * s->s_backoff) : LOG_RETRY_MIN;
+    if(s->s_backoff > LOG_RETRY_MAX){
+      s->s_backoff = LOG_RETRY_MAX;
+    }
+    s->s_failures++;
+  }
+
+  if((ls->l_attempts > 0) && (s->s_failures >= ls->l_attempts)){
+    note_state(ls, KATCP_LEVEL_ERROR, "giving up on %s after %u attempts", s->s_name, s->s_failures);
+    s->s_state = SOURCE_GONE;
+    return;
+  }
+
+  /* spread out the reconnects of many sources which failed together */
+  ms = s->s_backoff + (rand() % ((s->s_backoff / 4) + 1));
+
+  gettimeofday(&now, NULL);
+  component_time_katcp(&delta, ms);
+  add_time_katcp(&(s->s_retry), &now, &delta);
+
+  s->s_state = SOURCE_DOWN;
+}
+
+void request_limit(struct log_source *s, int level)
+{
+  char *name;
+
+  name = log_to_string_katcl(level);
+  if(name == NULL){
+    return;
+  }
+
+#ifdef KATCP_STRICT_CONFORMANCE
+  append_string_katcl(s->s_line, KATCP_FLAG_STRING | KATCP_FLAG_FIRST, "?log-limit");
+#else
+  append_string_katcl(s->s_line, KATCP_FLAG_STRING | KATCP_FLAG_FIRST, "?log-level");
+#endif
+  append_string_katcl(s->s_line, KATCP_FLAG_STRING | KATCP_FLAG_LAST, name);
+}
+
+int connect_source(struct log_state *ls, struct log_source *s)
+{
+  int fd;
+
+  s->s_connects++;
+  s->s_received = 0;
+
+  fd = net_connect(s->s_name, 0, NETC_ASYNC);
+  if(fd < 0){
+    down_source(ls, s, "unable to initiate connection");
+    return -1;
+  }
+
+  s->s_line = create_katcl(fd);
+  if(s->s_line == NULL){
+    close(fd);
+    down_source(ls, s, "unable to allocate parser state");
+    return -1;
+  }
+
+  s->s_state = SOURCE_CONNECTING;
+
+  if(watch_source(ls, s) < 0){
+    down_source(ls, s, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int record_source(struct log_state *ls, struct log_source *s, struct katcl_parse *p)
+{
+  char *fields[16], module[512];
+  struct katcl_parse *px;
+  unsigned int count, i;
+  int level, flags;
+  char *source;
+
+  s->s_received++;
+  s->s_messages++;
+
+  source = (ls->l_count > 1) ? s->s_name : NULL;
+
+  fields[0] = get_string_parse_katcl(p, 0);
+  count = get_count_parse_katcl(p);
+
+  if((count < 4) || (fields[0] == NULL) || strcmp(fields[0], KATCP_LOG_INFORM)){
+    /* a plain logfile has always seen the other messages too */
+    if(ls->l_archive == NULL){
+      append_parse_katcl(ls->l_output, p);
+    }
+    return 0;
+  }
+
+  if(ls->l_archive == NULL){
+    if(source == NULL){
+      append_parse_katcl(ls->l_output, p);
+      return 0;
+    }
+
+    px = create_parse_katcl();
+    if(px == NULL){
+      return -1;
+    }
+
+    for(i = 0; i < count; i++){
+      flags = KATCP_FLAG_STRING | ((i == 0) ? KATCP_FLAG_FIRST : 0) | (((i + 1) == count) ? KATCP_FLAG_LAST : 0);
+      if(i == 3){
+        snprintf(module, sizeof(module), "%s/%s", source, get_string_parse_katcl(p, i) ? get_string_parse_katcl(p, i) : "");
+        add_string_parse_katcl(px, flags, module);
+      } else {
+        add_string_parse_katcl(px, flags, get_string_parse_katcl(p, i));
+      }
+    }
+
+    return append_parse_katcl(ls->l_output, px);
+  }
+
+  if(count > 16){
+    count = 16;
+  }
+
+  for(i = 1; i < count; i++){
+    fields[i] = get_string_parse_katcl(p, i);
+  }
+
+  level = fields[1] ? log_to_code_katcl(fields[1]) : (-1);
+  if((level < 0) || (level > KATCP_LEVEL_OFF)){
+    level = KATCP_LEVEL_INFO;
+  }
+
+  return append_archive(ls->l_archive, level, log_time(fields[2]), count, fields, source);
+}
+
+int serve_source(struct log_state *ls, struct log_source *s, unsigned int events)
+{
+  struct katcl_parse *p;
+  unsigned int len;
+  int code, result;
+
+  switch(s->s_state){
+
+    case SOURCE_CONNECTING :
+      len = sizeof(int);
+      if(getsockopt(fileno_katcl(s->s_line), SOL_SOCKET, SO_ERROR, &code, &len) < 0){
+        code = errno;
+      }
+      if(code == EINPROGRESS){
+        return 0;
+      }
+      if(code != 0){
+        down_source(ls, s, strerror(code));
+        return -1;
+      }
+
+      s->s_state = SOURCE_UP;
+      s->s_failures = 0;
+
+      if(ls->l_verbose > 0){
+        fprintf(stderr, "%s: connected to %s\n", NAME, s->s_name);
+      }
+      if(s->s_connects > 1){
+        note_state(ls, KATCP_LEVEL_INFO, "reconnected to %s", s->s_name);
+      }
+      if(ls->l_limit){
+        request_limit(s, log_level);
+      }
+      break;
+
+    case SOURCE_UP :
+      if(events & EPOLLOUT){
+        if(write_katcl(s->s_line) < 0){
+          down_source(ls, s, "write failed");
+          return -1;
+        }
+      }
+
+      if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+        result = read_katcl(s->s_line);
+
+        while(have_katcl(s->s_line) > 0){
+          p = ready_katcl(s->s_line);
+          if(p){
+            if(record_source(ls, s, p) < 0){
+              note_state(ls, KATCP_LEVEL_ERROR, "unable to record message from %s", s->s_name);
+            }
+          }
+        }
+
+        if(result){
+          down_source(ls, s, (result < 0) ? strerror(error_katcl(s->s_line)) : "connection terminated");
+          return -1;
+        }
+      }
+      break;
+
+    default :
+      return 0;
+  }
+
+  return watch_source(ls, s);
+}
+
+int collect_sources(struct log_state *ls)
+{
+  struct epoll_event events[LOG_EVENTS];
+  struct log_source *s;
+  struct log_archive *a;
+  struct timeval now, delta;
+  unsigned int i, live;
+  int result, wait, ms, n;
+
+  a = ls->l_archive;
+
+  for(;;){
+
+    if(log_terminate){
+      return 0;
+    }
+
+    if(log_reload > 0){
+      if(a){
+        if(flush_archive(a) < 0){
+          note_state(ls, KATCP_LEVEL_ERROR, "unable to write archive: %s", strerror(errno));
+        }
+        close_archive(a);
+      }
+      log_reload = 0;
+      return 1;
+    }
+
+    if(log_changed > 0){
+      for(i = 0; i < ls->l_count; i++){
+        s = &(ls->l_sources[i]);
+        if(s->s_state == SOURCE_UP){
+          request_limit(s, log_level);
+          watch_source(ls, s);
+        }
+      }
+      note_state(ls, KATCP_LEVEL_INFO, "requesting log level %s", log_to_string_katcl(log_level));
+      ls->l_limit = 1;
+      log_changed = 0;
+    }
+
+    gettimeofday(&now, NULL);
+
+    wait = 1000;
+    live = 0;
 
-#include <netc.h>
-#include <katcl.h>
-#include <katcp.h>
-#include <katpriv.h>
-#include <fork-parent.h>
+    for(i = 0; i < ls->l_count; i++){
+      s = &(ls->l_sources[i]);
 
-#define NAME "kcplog"
+      if(s->s_state == SOURCE_DOWN){
+        if(cmp_time_katcp(&(s->s_retry), &now) <= 0){
+          connect_source(ls, s);
+        }
+      }
 
-static volatile int log_level = KATCP_LEVEL_INFO;
-static volatile int log_changed = 0;
-static volatile int log_reload = 0;
+      if(s->s_state == SOURCE_DOWN){
+        sub_time_katcp(&delta, &(s->s_retry), &now);
+        ms = (delta.tv_sec * 1000) + (delta.tv_usec / 1000) + 1;
+        if((ms > 0) && (ms < wait)){
+          wait = ms;
+        }
+      }
 
-void usage(char *app)
+      if(s->s_state != SOURCE_GONE){
+        live++;
+      }
+    }
+
+    if(live == 0){
+      return -1;
+    }
+
+    if(a){
+      if(a->a_have && (now.tv_sec >= (a->a_started + LOG_BLOCK_AGE))){
+        if(flush_archive(a) < 0){
+          fprintf(stderr, "%s: unable to write archive: %s\n", NAME, strerror(errno));
+        }
+      }
+      if((a->a_fd >= 0) && (a->a_period > 0) && (now.tv_sec >= (a->a_opened + a->a_period))){
+        close_archive(a);
+      }
+    }
+
+    result = epoll_wait(ls->l_efd, events, LOG_EVENTS, wait);
+    if(result < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      fprintf(stderr, "%s: epoll wait failed: %s\n", NAME, strerror(errno));
+      return -1;
+    }
+
+    for(n = 0; n < result; n++){
+      serve_source(ls, events[n].data.ptr, events[n].events);
+    }
+
+    if(ls->l_output){
+      while(flushing_katcl(ls->l_output)){
+        if(write_katcl(ls->l_output) < 0){
+          break;
+        }
+      }
+    }
+  }
+}
+
+/* query ******************************************************************/
+
+int match_line(struct log_query *q, char *line, unsigned int len)
 {
-  printf("usage: %s [-v] [-h] [-l level] [-o logfile] [-a reconnect-attempts] [-d] [-t] [-s server:port]\n", app);
-  printf("-v              be more verbose\n");
-  printf("-h              this help\n");
-  printf("-l level        select a log level (trace, debug, info, warn, ... to log at)\n");
-  printf("-o logfile      write log messages to the specified log file instead of stdout\n");
-  printf("-d              run in the background\n");
-  printf("-f              run in the foreground\n");
-  printf("-t              truncate the logfile when opening it\n");
-  printf("-s server:port  connect to the specified server rather than localhost:7147\n");
-  printf("-a attempts     make the given number attempts to connect to the server before giving up\n");
-  printf("signals: HUP USR1 USR2\n");
-  printf(" HUP            re-open the logfile (if -o is given)\n");
-  printf(" USR1           change log level one level more detailed (eg from DEBUG to TRACE)\n");
-  printf(" USR2           change log level one level less detailed (eg from INFO to WARN)\n");
+  char *level, *when, *end;
+  int code;
+  double t;
+
+  if(strncmp(line, KATCP_LOG_INFORM " ", 5)){
+    return 0;
+  }
+
+  level = line + 5;
+  when = memchr(level, ' ', len - 5);
+  if(when == NULL){
+    return 0;
+  }
+  when++;
+
+  if(q->q_level > KATCP_LEVEL_TRACE){
+    end = when - 1;
+    *end = '\0';
+    code = log_to_code_katcl(level);
+    *end = ' ';
+    if(code < q->q_level){
+      return 0;
+    }
+  }
+
+  if((q->q_begin > 0.0) || (q->q_end > 0.0)){
+    t = log_time(when);
+    if(t < q->q_begin){
+      return 0;
+    }
+    if((q->q_end > 0.0) && (t > q->q_end)){
+      return 0;
+    }
+  }
+
+  return 1;
 }
 
-static void handle_signal(int signal)
+void emit_line(struct log_query *q, char *line, unsigned int len)
 {
-  switch(signal){
-    case SIGUSR1 : 
-      if(log_level > KATCP_LEVEL_TRACE){
-        log_level--;
-        log_changed = 1;
+  if(match_line(q, line, len)){
+    fwrite(line, 1, len, stdout);
+    fputc('\n', stdout);
+    q->q_matched++;
+  }
+}
+
+int filter_text(struct log_query *q, char *data, unsigned int len)
+{
+  char *ptr, *end, *tmp;
+  unsigned int want;
+
+  end = data + len;
+
+  if(q->q_have > 0){
+    ptr = memchr(data, '\n', len);
+    want = ptr ? (ptr - data) : len;
+
+    if((q->q_have + want + 1) > q->q_size){
+      tmp = realloc(q->q_carry, q->q_have + want + 1);
+      if(tmp == NULL){
+        return -1;
       }
-      break;
+      q->q_carry = tmp;
+      q->q_size = q->q_have + want + 1;
+    }
+    memcpy(q->q_carry + q->q_have, data, want);
+    q->q_have += want;
 
-    case SIGUSR2 : 
-      if(log_level < KATCP_LEVEL_OFF){
-        log_level++;
-        log_changed = 1;
+    if(ptr == NULL){
+      return 0;
+    }
+
+    q->q_carry[q->q_have] = '\0';
+    emit_line(q, q->q_carry, q->q_have);
+    q->q_have = 0;
+
+    data = ptr + 1;
+  }
+
+  while((data < end) && ((ptr = memchr(data, '\n', end - data)) != NULL)){
+    *ptr = '\0';
+    emit_line(q, data, ptr - data);
+    data = ptr + 1;
+  }
+
+  if(data < end){
+    want = end - data;
+    if(want + 1 > q->q_size){
+      tmp = realloc(q->q_carry, want + 1);
+      if(tmp == NULL){
+        return -1;
       }
-      break;
+      q->q_carry = tmp;
+      q->q_size = want + 1;
+    }
+    memcpy(q->q_carry, data, want);
+    q->q_have = want;
+  }
 
-    case SIGHUP : 
-      log_reload = 1;
+  return 0;
+}
+
+/* handles any number of concatenated gzip members */
+
+int inflate_data(struct log_query *q, unsigned char *data, unsigned int len)
+{
+  z_stream *z;
+  int result;
+
+  z = &(q->q_stream);
+
+  z->next_in = data;
+  z->avail_in = len;
+
+  while(z->avail_in > 0){
+    z->next_out = q->q_chunk;
+    z->avail_out = LOG_CHUNK;
+
+    result = inflate(z, Z_NO_FLUSH);
+
+    if(filter_text(q, (char *)q->q_chunk, LOG_CHUNK - z->avail_out) < 0){
+      return -1;
+    }
+
+    switch(result){
+      case Z_OK :
+        break;
+      case Z_STREAM_END :
+        inflateReset(z);
+        break;
+      case Z_BUF_ERROR :
+        if(z->avail_out == 0){
+          break;
+        }
+        return 0;
+      default :
+        return -1;
+    }
+  }
+
+  /* drain anything still buffered */
+  do{
+    z->next_out = q->q_chunk;
+    z->avail_out = LOG_CHUNK;
+    result = inflate(z, Z_NO_FLUSH);
+    if(filter_text(q, (char *)q->q_chunk, LOG_CHUNK - z->avail_out) < 0){
+      return -1;
+    }
+  } while((result == Z_OK) && (z->avail_out == 0));
+
+  return 0;
+}
+
+void finish_text(struct log_query *q)
+{
+  if(q->q_have > 0){
+    q->q_carry[q->q_have] = '\0';
+    emit_line(q, q->q_carry, q->q_have);
+    q->q_have = 0;
+  }
+}
+
+int query_archive(struct log_query *q, char *path, int verbose)
+{
+  char *index, *buffer, *tmp;
+  unsigned long offset;
+  unsigned int length, size, count, mask, have, blocks, inflated, i;
+  double first, last;
+  char line[256];
+  FILE *fp;
+  int fd, rr;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0){
+    fprintf(stderr, "%s: unable to open %s: %s\n", NAME, path, strerror(errno));
+    return -1;
+  }
+
+  index = malloc(strlen(path) + 8);
+  if(index == NULL){
+    close(fd);
+    return -1;
+  }
+  strcpy(index, path);
+  i = strlen(index);
+  if((i > 3) && !strcmp(index + i - 3, ".gz")){
+    strcpy(index + i - 2, "idx");
+  } else {
+    strcat(index, ".idx");
+  }
+
+  fp = fopen(index, "r");
+  free(index);
+
+  inflateReset(&(q->q_stream));
+
+  if(fp == NULL){
+    if(verbose > 0){
+      fflush(stdout);
+      fprintf(stderr, "%s: no index for %s, decompressing all of it\n", NAME, path);
+    }
+    buffer = malloc(LOG_CHUNK);
+    if(buffer == NULL){
+      close(fd);
+      return -1;
+    }
+    while((rr = read(fd, buffer, LOG_CHUNK)) > 0){
+      if(inflate_data(q, (unsigned char *)buffer, rr) < 0){
+        fprintf(stderr, "%s: corrupt data in %s\n", NAME, path);
+        break;
+      }
+    }
+    free(buffer);
+    finish_text(q);
+    close(fd);
+    return 0;
+  }
+
+  buffer = NULL;
+  have = 0;
+  blocks = 0;
+  inflated = 0;
+
+  while(fgets(line, sizeof(line), fp)){
+    if(line[0] == '#'){
+      continue;
+    }
+    if(sscanf(line, "%lu %u %u %u %lf %lf %x", &offset, &length, &size, &count, &first, &last, &mask) != 7){
+      continue;
+    }
+
+    blocks++;
+
+    if((mask >> q->q_level) == 0){
+      continue;
+    }
+    if(last < q->q_begin){
+      continue;
+    }
+    if((q->q_end > 0.0) && (first > q->q_end)){
+      continue;
+    }
+
+    if(length > have){
+      tmp = realloc(buffer, length);
+      if(tmp == NULL){
+        break;
+      }
+      buffer = tmp;
+      have = length;
+    }
+
+    if(pread(fd, buffer, length, offset) != length){
+      fprintf(stderr, "%s: short read of block at %lu in %s\n", NAME, offset, path);
       break;
+    }
 
-    default :
-      return;
+    inflateReset(&(q->q_stream));
+    if(inflate_data(q, (unsigned char *)buffer, length) < 0){
+      fprintf(stderr, "%s: corrupt block at %lu in %s\n", NAME, offset, path);
+    }
+    finish_text(q);
+
+    inflated++;
+  }
+
+  if(verbose > 0){
+    fflush(stdout);
+    fprintf(stderr, "%s: decompressed %u of %u blocks in %s\n", NAME, inflated, blocks, path);
+  }
+
+  q->q_blocks += blocks;
+  q->q_inflated += inflated;
+
+  if(buffer){
+    free(buffer);
   }
+  fclose(fp);
+  close(fd);
 
+  return 0;
 }
 
+/* main *******************************************************************/
+
 int main(int argc, char **argv)
 {
 #define BUFFER 64
   char buffer[BUFFER];
-  char *level, *app, *server, *output;
-  int run, fd, i, j, c, verbose, attempts, detach, result, truncate, flags;
-  struct katcl_parse *p;
-  struct katcl_line *ls, *lo;
+  char *level, *app, *server, *output, *prefix, *begin, *end;
+  int run, fd, i, j, c, verbose, attempts, detach, result, truncate, flags, query, code;
+  unsigned long rotate_size;
+  unsigned int rotate_time, block;
+  struct log_state state, *ls;
+  struct log_query *q;
   struct sigaction sa;
   time_t now;
   struct tm *local;
@@ -85,9 +1287,24 @@ int main(int argc, char **argv)
   app = argv[0];
 
   verbose = 0;
-  attempts = 2;
+  attempts = 0;
   detach = 0;
   truncate = 0;
+  query = 0;
+
+  rotate_size = LOG_ROTATE_SIZE;
+  rotate_time = LOG_ROTATE_TIME;
+  block = LOG_BLOCK;
+
+  ls = &state;
+
+  ls->l_sources = NULL;
+  ls->l_count = 0;
+  ls->l_efd = (-1);
+  ls->l_attempts = 0;
+  ls->l_limit = 0;
+  ls->l_output = NULL;
+  ls->l_archive = NULL;
 
   server = getenv("KATCP_SERVER");
   if(server == NULL){
@@ -96,6 +1313,9 @@ int main(int argc, char **argv)
 
   output = NULL;
   level = NULL;
+  prefix = NULL;
+  begin = NULL;
+  end = NULL;
 
   flags = 0; /* placate -Wall */
 
@@ -108,35 +1328,46 @@ int main(int argc, char **argv)
           usage(app);
           return EX_OK;
 
-        case 'v' : 
+        case 'v' :
           verbose++;
           j++;
           break;
 
-        case 'd' : 
+        case 'd' :
           detach = 1;
           j++;
           break;
 
-        case 'f' : 
+        case 'f' :
           detach = 0;
           j++;
           break;
 
-        case 't' : 
+        case 't' :
           truncate = 1;
           j++;
           break;
 
-        case 'q' : 
+        case 'q' :
           verbose = 0;
           j++;
           break;
 
+        case 'x' :
+          query = 1;
+          j++;
+          break;
+
         case 'l' :
         case 'o' :
         case 'a' :
         case 's' :
+        case 'z' :
+        case 'R' :
+        case 'T' :
+        case 'B' :
+        case 'b' :
+        case 'e' :
 
           j++;
           if (argv[i][j] == '\0') {
@@ -155,11 +1386,32 @@ int main(int argc, char **argv)
             case 'o' :
               output = argv[i] + j;
               break;
-            case 'a' : 
+            case 'a' :
               attempts = atoi(argv[i] + j);
               break;
-            case 's' : 
-              server = argv[i] + j;
+            case 's' :
+              if(add_sources(ls, argv[i] + j) < 0){
+                fprintf(stderr, "%s: unable to allocate server state\n", app);
+                return EX_OSERR;
+              }
+              break;
+            case 'z' :
+              prefix = argv[i] + j;
+              break;
+            case 'R' :
+              rotate_size = parse_size(argv[i] + j);
+              break;
+            case 'T' :
+              rotate_time = atoi(argv[i] + j);
+              break;
+            case 'B' :
+              block = parse_size(argv[i] + j);
+              break;
+            case 'b' :
+              begin = argv[i] + j;
+              break;
+            case 'e' :
+              end = argv[i] + j;
               break;
           }
 
@@ -179,15 +1431,86 @@ int main(int argc, char **argv)
           return EX_USAGE;
       }
     } else {
+      if(query){
+        break; /* remaining arguments are archives */
+      }
       if(output){
         fprintf(stderr, "%s: usage: unexpected extra argument %s (can only save to one file)\n", app, argv[i]);
         return EX_USAGE;
-      } 
+      }
       output = argv[i];
       i++;
     }
   }
 
+  if(level){
+    log_changed = 1;
+    log_level = log_to_code_katcl(level);
+    if(log_level < 0){
+      fprintf(stderr, "%s: usage: invalid initial log priority %s\n", app, level);
+      return EX_USAGE;
+    }
+  }
+
+  if(query){
+    if(i >= argc){
+      fprintf(stderr, "%s: usage: need archives to query\n", app);
+      return EX_USAGE;
+    }
+
+    q = malloc(sizeof(struct log_query));
+    if(q == NULL){
+      return EX_OSERR;
+    }
+
+    q->q_level = level ? log_level : KATCP_LEVEL_TRACE;
+    q->q_begin = begin ? strtod(begin, NULL) : 0.0;
+    q->q_end = end ? strtod(end, NULL) : 0.0;
+    q->q_carry = NULL;
+    q->q_have = 0;
+    q->q_size = 0;
+    q->q_matched = 0;
+    q->q_blocks = 0;
+    q->q_inflated = 0;
+
+    q->q_stream.zalloc = Z_NULL;
+    q->q_stream.zfree = Z_NULL;
+    q->q_stream.opaque = Z_NULL;
+    q->q_stream.next_in = Z_NULL;
+    q->q_stream.avail_in = 0;
+
+    if(inflateInit2(&(q->q_stream), 16 + 15) != Z_OK){
+      return EX_OSERR;
+    }
+
+    for(code = EX_OK; i < argc; i++){
+      if(query_archive(q, argv[i], verbose) < 0){
+        code = EX_NOINPUT;
+      }
+    }
+
+    fflush(stdout);
+
+    if(verbose > 0){
+      fprintf(stderr, "%s: %lu messages matched, decompressed %u of %u blocks\n", app, q->q_matched, q->q_inflated, q->q_blocks);
+    }
+
+    inflateEnd(&(q->q_stream));
+
+    return code;
+  }
+
+  if(ls->l_count == 0){
+    if(add_sources(ls, server) < 0){
+      fprintf(stderr, "%s: unable to allocate server state\n", app);
+      return EX_OSERR;
+    }
+  }
+
+  ls->l_verbose = verbose;
+  ls->l_attempts = attempts;
+  ls->l_limit = level ? 1 : 0;
+
   if(detach){
     if(fork_parent() < 0){
       fprintf(stderr, "%s: unable to detach process\n", app);
@@ -205,21 +1528,23 @@ int main(int argc, char **argv)
   sigaction(SIGHUP, &sa, NULL);
   sigaction(SIGUSR1, &sa, NULL);
   sigaction(SIGUSR2, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
 
-  if(server == NULL){
-    server = "localhost:7147";
-  }
+  signal(SIGPIPE, SIG_IGN);
 
-  if(level){
-    log_changed = 1;
-    log_level = log_to_code_katcl(level);
-    if(log_level < 0){
-      fprintf(stderr, "%s: usage: invalid initial log priority %s\n", app, level);
+  if(prefix){
+    if(output){
+      fprintf(stderr, "%s: usage: can not write both a logfile and archives\n", app);
       return EX_USAGE;
-    } 
-  }
-
-  if(output == NULL){
+    }
+    ls->l_archive = create_archive(prefix, rotate_size, rotate_time, block);
+    if(ls->l_archive == NULL){
+      fprintf(stderr, "%s: unable to allocate archive state\n", app);
+      return EX_OSERR;
+    }
+    fd = (-1);
+  } else if(output == NULL){
     if(detach == 1){
       fprintf(stderr, "%s: usage: need a filename as target\n", app);
       return EX_USAGE;
@@ -237,30 +1562,22 @@ int main(int argc, char **argv)
     }
   }
 
-  lo = create_katcl(fd);
-  if(lo == NULL){
-    fprintf(stderr, "%s: unable to allocate log state\n", app);
-    return EX_OSERR;
-  }
-
-
-  /**********************/
-
-  while((attempts-- > 0) && ((fd = net_connect(server, 0, 0)) < 0)){
-    sleep(1);
-  }
-
-  if(attempts <= 0){
-    sync_message_katcl(lo, KATCP_LEVEL_FATAL, NAME, "unable to connect to %s", server);
-    return EX_UNAVAILABLE;
+  if(fd >= 0){
+    ls->l_output = create_katcl(fd);
+    if(ls->l_output == NULL){
+      fprintf(stderr, "%s: unable to allocate log state\n", app);
+      return EX_OSERR;
+    }
   }
 
-  ls = create_katcl(fd);
-  if(ls == NULL){
-    sync_message_katcl(lo, KATCP_LEVEL_FATAL, NAME, "unable to allocate parser state");
+  ls->l_efd = epoll_create(LOG_EVENTS);
+  if(ls->l_efd < 0){
+    fprintf(stderr, "%s: unable to create epoll instance: %s\n", app, strerror(errno));
     return EX_OSERR;
   }
 
+  srand(getpid());
+
   if(detach){
     fclose(stderr);
   }
@@ -269,73 +1586,57 @@ int main(int argc, char **argv)
   local = localtime(&now);
   strftime(buffer, BUFFER - 1, "%Y-%m-%dT%H:%M:%S", local);
 
-  sync_message_katcl(lo, KATCP_LEVEL_INFO, NAME, "monitor start for %s at %s", server, buffer);
-
-  for(run = 1; run > 0;){
-
-    if(log_reload > 0){
-      if(output){
-        fd = open(output, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
-        if(fd >= 0){
-          exchange_katcl(lo, fd);
-        }
-      }
-
-      log_reload = 0;
-    }
- 
-    /* WARNING: will only run after the next message - may have to interrupt syscall to get past this */
-    if(log_changed > 0){
-
-      level = log_to_string_katcl(log_level);
-      if(level){
-
-        p = create_parse_katcl();
-        if(p){
-
-#ifdef KATCP_STRICT_CONFORMANCE
-          add_string_parse_katcl(p, KATCP_FLAG_STRING | KATCP_FLAG_FIRST, "?log-limit");
-#else 
-          add_string_parse_katcl(p, KATCP_FLAG_STRING | KATCP_FLAG_FIRST, "?log-level");
-#endif
-          add_string_parse_katcl(p, KATCP_FLAG_STRING | KATCP_FLAG_LAST, level);
+  if(ls->l_count == 1){
+    note_state(ls, KATCP_LEVEL_INFO, "monitor start for %s at %s", ls->l_sources[0].s_name, buffer);
+  } else {
+    note_state(ls, KATCP_LEVEL_INFO, "monitor start for %u servers at %s", ls->l_count, buffer);
+  }
 
-          append_parse_katcl(lo, p);
+  /* log_changed only matters for level changes made once connected */
+  log_changed = 0;
 
-          /* dodgy refcount dealings: p is created with refcount = 0, so can only do write at end, otherwise may end up being deallocated */
+  for(run = 1; run > 0;){
 
-          append_parse_katcl(ls, p);
-          write_katcl(ls);
+    result = collect_sources(ls);
 
+    switch(result){
+      case 1 : /* reload requested */
+        if(output){
+          fd = open(output, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+          if(fd >= 0){
+            exchange_katcl(ls->l_output, fd);
+          }
         }
-      } else {
-        sync_message_katcl(lo, KATCP_LEVEL_ERROR, NAME, "invalid log priority number %d", level);
-      }
-
-      log_changed = 0;
+        break;
+      case 0 :
+        run = 0;
+        break;
+      default :
+        note_state(ls, KATCP_LEVEL_FATAL, "no more servers to monitor");
+        run = (-1);
+        break;
     }
+  }
 
-    result = read_katcl(ls);
-    if(result < 0){
-      sync_message_katcl(lo, KATCP_LEVEL_FATAL, NAME, "read from network failed: %s", strerror(errno));
-      return EX_OSERR;
+  if(ls->l_archive){
+    note_state(ls, KATCP_LEVEL_INFO, "monitor stop");
+    if(flush_archive(ls->l_archive) < 0){
+      fprintf(stderr, "%s: unable to write archive: %s\n", app, strerror(errno));
     }
-
-    if(result == 1){
-      run = 0;
+    close_archive(ls->l_archive);
+    if(verbose > 0){
+      fprintf(stderr, "%s: wrote %lu blocks to %lu archives\n", app, ls->l_archive->a_blocks, ls->l_archive->a_files);
     }
+  }
 
-    while(have_katcl(ls)){
-      p = ready_katcl(ls);
-      if(p){
-        append_parse_katcl(lo, p);
+  if(ls->l_output){
+    while(flushing_katcl(ls->l_output)){
+      if(write_katcl(ls->l_output) < 0){
+        break;
       }
     }
-
-    write_katcl(lo);
   }
 
-  return EX_OK;
+  return (run < 0) ? EX_UNAVAILABLE : EX_OK;
 #undef BUFFER
 }
-
@@ -0,0 +1,430 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* runs kcplog against several local servers which send #log informs
+ * as fast as they can (one of them drops its connection half way), then
+ * reports the sustained rate and uses the query mode to check that every
+ * message made it into the archives exactly once and that the index
+ * narrows level and time queries down to a few blocks
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#define KCPLOG "./kcplog"
+
+#define SERVERS       8
+#define BASE      22000
+#define ERRORS    50000   /* one error every so many messages */
+#define CHUNK    262144
+
+static time_t origin;
+
+static char *level_of(unsigned int seq)
+{
+  if((seq % ERRORS) == (ERRORS - 1)){
+    return "error";
+  }
+  if((seq % 100) == 50){
+    return "warn";
+  }
+  return "info";
+}
+
+static int send_range(int fd, unsigned int from, unsigned int to)
+{
+  char buffer[CHUNK];
+  unsigned int seq, have;
+  int wr, done;
+
+  have = 0;
+
+  for(seq = from; seq < to; seq++){
+    have += snprintf(buffer + have, CHUNK - have, "#log %s %lu.%03u spam message\\_%u\n", level_of(seq), (unsigned long)(origin + (seq / 1000)), seq % 1000, seq);
+    if(((have + 128) >= CHUNK) || ((seq + 1) == to)){
+      for(done = 0; done < have; done += wr){
+        wr = write(fd, buffer + done, have - done);
+        if(wr <= 0){
+          return -1;
+        }
+      }
+      have = 0;
+    }
+  }
+
+  return 0;
+}
+
+static int open_listener(unsigned int port)
+{
+  struct sockaddr_in sa;
+  int fd, option;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd < 0){
+    return -1;
+  }
+
+  option = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if((bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) || (listen(fd, 4) < 0)){
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* the first server hangs up half way and expects the collector to come back */
+
+static void serve(int lfd, unsigned int index, unsigned int count)
+{
+  unsigned int half;
+  int fd;
+
+  half = (index == 0) ? (count / 2) : count;
+
+  fd = accept(lfd, NULL, NULL);
+  if((fd < 0) || (send_range(fd, 0, half) < 0)){
+    exit(1);
+  }
+  close(fd);
+
+  if(half < count){
+    fd = accept(lfd, NULL, NULL);
+    if((fd < 0) || (send_range(fd, half, count) < 0)){
+      exit(1);
+    }
+    close(fd);
+  }
+
+  close(lfd);
+  exit(0);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+static unsigned int list_archives(char *directory, char **names, unsigned int size)
+{
+  struct dirent *de;
+  unsigned int count, len;
+  DIR *dir;
+
+  dir = opendir(directory);
+  if(dir == NULL){
+    return 0;
+  }
+
+  count = 0;
+  while(((de = readdir(dir)) != NULL) && (count < size)){
+    len = strlen(de->d_name);
+    if((len > 7) && !strcmp(de->d_name + len - 7, ".log.gz")){
+      names[count] = malloc(strlen(directory) + len + 2);
+      sprintf(names[count], "%s/%s", directory, de->d_name);
+      count++;
+    }
+  }
+
+  closedir(dir);
+
+  qsort(names, count, sizeof(char *), &compare_names);
+
+  return count;
+}
+
+/* runs a query, counts spam lines per server, returns the stderr summary */
+
+struct tally{
+  unsigned int t_lines;
+  unsigned int t_duplicates;
+  unsigned int t_per[SERVERS];
+  unsigned int t_inflated;
+  unsigned int t_blocks;
+};
+
+static int run_query(char **extra, char **archives, unsigned int count, unsigned int ports, unsigned int per, unsigned char **seen, struct tally *t)
+{
+  char *argv[256], line[1024], *ptr, *module;
+  unsigned int i, j, port, seq;
+  int pfd[2], status;
+  pid_t pid;
+  FILE *fp;
+
+  j = 0;
+  argv[j++] = KCPLOG;
+  argv[j++] = "-x";
+  argv[j++] = "-v";
+  for(i = 0; extra[i]; i++){
+    argv[j++] = extra[i];
+  }
+  for(i = 0; (i < count) && (j < 255); i++){
+    argv[j++] = archives[i];
+  }
+  argv[j] = NULL;
+
+  memset(t, 0, sizeof(struct tally));
+  if(seen){
+    for(i = 0; i < SERVERS; i++){
+      memset(seen[i], 0, per);
+    }
+  }
+
+  if(pipe(pfd) < 0){
+    return -1;
+  }
+
+  fflush(stdout);
+
+  pid = fork();
+  if(pid < 0){
+    return -1;
+  }
+  if(pid == 0){
+    close(pfd[0]);
+    dup2(pfd[1], STDOUT_FILENO);
+    dup2(pfd[1], STDERR_FILENO);
+    close(pfd[1]);
+    execv(KCPLOG, argv);
+    exit(4);
+  }
+  close(pfd[1]);
+
+  fp = fdopen(pfd[0], "r");
+  while(fgets(line, sizeof(line), fp)){
+    ptr = strstr(line, "messages matched");
+    if(ptr && (sscanf(ptr, "messages matched, decompressed %u of %u blocks", &(t->t_inflated), &(t->t_blocks)) == 2)){
+      continue;
+    }
+    if(strncmp(line, "#log ", 5)){
+      continue;
+    }
+    module = strstr(line, "/spam ");
+    if(module == NULL){
+      continue; /* notes by the collector itself */
+    }
+    ptr = strrchr(line, ':');
+    if((ptr == NULL) || (ptr > module)){
+      continue;
+    }
+    port = atoi(ptr + 1) - ports;
+    ptr = strstr(module, "message\\_");
+    if((port >= SERVERS) || (ptr == NULL)){
+      continue;
+    }
+    seq = atoi(ptr + 9);
+    t->t_lines++;
+    t->t_per[port]++;
+    if(seen && (seq < per)){
+      if(seen[port][seq]){
+        t->t_duplicates++;
+      }
+      seen[port][seq] = 1;
+    }
+  }
+  fclose(fp);
+
+  if(waitpid(pid, &status, 0) != pid){
+    return -1;
+  }
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char **argv)
+{
+  char directory[64], prefix[96], sources[SERVERS * 24], from[32], until[32];
+  char *archives[1024], *extra[8];
+  unsigned char *seen[SERVERS];
+  unsigned int per, ports, i, count, failures, total;
+  int lfd[SERVERS], status, code;
+  pid_t servers[SERVERS], collector, pid;
+  struct timeval start, stop, done;
+  struct tally t;
+  struct stat st;
+  unsigned long bytes;
+  long ms;
+
+  per = 200000;
+  if(argc > 1){
+    per = atoi(argv[1]);
+  }
+  if(per < 2 * ERRORS){
+    per = 2 * ERRORS;
+  }
+
+  origin = time(NULL) - 3600;
+
+  for(ports = BASE; ports < 60000; ports += SERVERS){
+    for(i = 0; i < SERVERS; i++){
+      lfd[i] = open_listener(ports + i);
+      if(lfd[i] < 0){
+        break;
+      }
+    }
+    if(i >= SERVERS){
+      break;
+    }
+    while(i > 0){
+      close(lfd[--i]);
+    }
+  }
+  if(ports >= 60000){
+    fprintf(stderr, "test: unable to bind %u listeners\n", SERVERS);
+    return 2;
+  }
+
+  snprintf(directory, sizeof(directory), "/tmp/kcplog-test-%d", getpid());
+  if(mkdir(directory, 0700) < 0){
+    fprintf(stderr, "test: unable to create %s: %s\n", directory, strerror(errno));
+    return 2;
+  }
+  snprintf(prefix, sizeof(prefix), "%s/spam", directory);
+
+  sources[0] = '\0';
+  for(i = 0; i < SERVERS; i++){
+    sprintf(sources + strlen(sources), "%slocalhost:%u", i ? "," : "", ports + i);
+  }
+
+  fflush(stdout);
+
+  for(i = 0; i < SERVERS; i++){
+    servers[i] = fork();
+    if(servers[i] < 0){
+      return 2;
+    }
+    if(servers[i] == 0){
+      serve(lfd[i], i, per);
+    }
+  }
+  for(i = 0; i < SERVERS; i++){
+    close(lfd[i]);
+  }
+
+  gettimeofday(&start, NULL);
+
+  collector = fork();
+  if(collector < 0){
+    return 2;
+  }
+  if(collector == 0){
+    freopen("/dev/null", "w", stderr);
+    execl(KCPLOG, KCPLOG, "-q", "-a", "1", "-R", "2M", "-z", prefix, "-s", sources, NULL);
+    exit(4);
+  }
+
+  /* the servers finish once the collector has taken everything but the socket buffers */
+  for(i = 0; i < SERVERS; i++){
+    waitpid(servers[i], &status, 0);
+  }
+  gettimeofday(&done, NULL);
+
+  /* with -a 1 the collector gives up once each server refuses a reconnect */
+  code = (-1);
+  if(waitpid(collector, &status, 0) == collector){
+    code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  }
+  gettimeofday(&stop, NULL);
+
+  failures = 0;
+  total = SERVERS * per;
+
+  ms = ((done.tv_sec - start.tv_sec) * 1000) + ((done.tv_usec - start.tv_usec) / 1000);
+  printf("test: %u servers sent %u messages in %ldms, %lu messages/s\n", SERVERS, total, ms, (total * 1000UL) / (ms ? ms : 1));
+  ms = ((stop.tv_sec - start.tv_sec) * 1000) + ((stop.tv_usec - start.tv_usec) / 1000);
+  printf("test: collector exited with code %d after %ldms, including the final reconnect attempts\n", code, ms);
+
+  count = list_archives(directory, archives, 1024);
+  bytes = 0;
+  for(i = 0; i < count; i++){
+    if(stat(archives[i], &st) == 0){
+      bytes += st.st_size;
+    }
+  }
+  printf("test: %u archives holding %lu compressed bytes\n", count, bytes);
+  if(count < 2){
+    fprintf(stderr, "test: expected size rotation to produce several archives\n");
+    failures++;
+  }
+
+  for(i = 0; i < SERVERS; i++){
+    seen[i] = malloc(per);
+    if(seen[i] == NULL){
+      return 2;
+    }
+  }
+
+  /* everything, exactly once */
+  extra[0] = NULL;
+  run_query(extra, archives, count, ports, per, seen, &t);
+  printf("test: full query returned %u messages, %u duplicates, decompressed %u of %u blocks\n", t.t_lines, t.t_duplicates, t.t_inflated, t.t_blocks);
+  if((t.t_lines != total) || t.t_duplicates){
+    fprintf(stderr, "test: expected %u distinct messages\n", total);
+    for(i = 0; i < SERVERS * per; i++){
+      if(seen[i / per][i % per] == 0){
+        fprintf(stderr, "test: missing message %u from server %u\n", i % per, i / per);
+      }
+    }
+    failures++;
+  }
+
+  /* errors only, the index should skip most blocks */
+  extra[0] = "-l";
+  extra[1] = "error";
+  extra[2] = NULL;
+  run_query(extra, archives, count, ports, per, NULL, &t);
+  printf("test: error query returned %u messages, decompressed %u of %u blocks\n", t.t_lines, t.t_inflated, t.t_blocks);
+  if((t.t_lines != SERVERS * (per / ERRORS)) || (t.t_inflated * 4 > t.t_blocks)){
+    fprintf(stderr, "test: expected %u errors from a fraction of the blocks\n", SERVERS * (per / ERRORS));
+    failures++;
+  }
+
+  /* one second of messages from each server */
+  snprintf(from, sizeof(from), "%lu", (unsigned long)(origin + 1));
+  snprintf(until, sizeof(until), "%lu.999", (unsigned long)(origin + 1));
+  extra[0] = "-b";
+  extra[1] = from;
+  extra[2] = "-e";
+  extra[3] = until;
+  extra[4] = NULL;
+  run_query(extra, archives, count, ports, per, NULL, &t);
+  printf("test: time query returned %u messages, decompressed %u of %u blocks\n", t.t_lines, t.t_inflated, t.t_blocks);
+  if((t.t_lines != SERVERS * 1000) || (t.t_inflated * 4 > t.t_blocks)){
+    fprintf(stderr, "test: expected %u messages from a fraction of the blocks\n", SERVERS * 1000);
+    failures++;
+  }
+
+  for(i = 0; i < count; i++){
+    unlink(archives[i]);
+    strcpy(archives[i] + strlen(archives[i]) - 2, "idx");
+    unlink(archives[i]);
+    free(archives[i]);
+  }
+  rmdir(directory);
+
+  while((pid = waitpid(-1, NULL, WNOHANG)) > 0);
+
+  printf("test: %s\n", failures ? "FAILED" : "ok");
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,190 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* times many kcpcmd invocations against a local katcp server, first
+ * connecting directly and then attached through kcpmux, and checks
+ * that the output a script would see is the same either way
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <netc.h>
+#include <katcp.h>
+#include <fixture.h>
+
+#define KCPCMD "../cmd/kcpcmd"
+#define KCPMUX "./kcpmux"
+
+static int run_cmd(char *server, char **output)
+{
+  char *argv[] = { KCPCMD, "-s", server, "watchdog", NULL };
+
+  return run_fixture(argv, NULL, output);
+}
+
+static pid_t start_server(char *bind, char *server)
+{
+  struct katcp_dispatch *d;
+  unsigned int i;
+  pid_t pid;
+  int fd;
+
+  fflush(stdout);
+
+  pid = fork();
+  if(pid < 0){
+    return -1;
+  }
+
+  if(pid == 0){
+    freopen("/dev/null", "w", stderr); /* the library may be built with debug output */
+    d = startup_katcp();
+    if(d == NULL){
+      exit(2);
+    }
+    add_version_katcp(d, "bench", 0, "0.1", "now");
+    run_multi_server_katcp(d, 64, bind, 0);
+    shutdown_katcp(d);
+    exit(0);
+  }
+
+  for(i = 0; i < 50; i++){
+    fd = net_connect(server, 0, 0);
+    if(fd >= 0){
+      close(fd);
+      return pid;
+    }
+    usleep(100000);
+  }
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+
+  return -1;
+}
+
+static long stop_server(pid_t pid)
+{
+  struct rusage ru;
+  int status;
+
+  kill(pid, SIGKILL);
+  if(wait4(pid, &status, 0, &ru) != pid){
+    return 0;
+  }
+
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static long run_many(char *server, unsigned int count, unsigned int *failures)
+{
+  struct timeval start, stop;
+  unsigned int i;
+
+  *failures = 0;
+
+  gettimeofday(&start, NULL);
+  for(i = 0; i < count; i++){
+    if(run_cmd(server, NULL) != 0){
+      (*failures)++;
+    }
+  }
+  gettimeofday(&stop, NULL);
+
+  return ((stop.tv_sec - start.tv_sec) * 1000000L) + (stop.tv_usec - start.tv_usec);
+}
+
+int main(int argc, char **argv)
+{
+  char server[64], bind[64], directory[64], path[128];
+  char *direct, *muxed;
+  unsigned int count, failures, i;
+  long plain, shared;
+  pid_t sp, mp;
+  int port;
+
+  count = 10000;
+  if(argc > 1){
+    count = atoi(argv[1]);
+  }
+
+  port = 20000 + (getpid() % 20000);
+  snprintf(bind, sizeof(bind), "127.0.0.1:%d", port);
+  snprintf(server, sizeof(server), "localhost:%d", port);
+
+  sp = start_server(bind, server);
+  if(sp < 0){
+    return 2;
+  }
+
+  unsetenv(NETC_MUX_VARIABLE);
+
+  if(run_cmd(server, &direct) != 0){
+    fprintf(stderr, "bench: unable to reach test server on %s\n", server);
+    stop_server(sp);
+    return 2;
+  }
+
+  plain = run_many(server, count, &failures);
+  printf("bench: %u direct calls in %ldms, %ldus per call, %u failures, server busy for %ldms\n", count, plain / 1000, plain / count, failures, stop_server(sp) / 1000);
+
+  /* a fresh server, so that its cpu time only covers the multiplexed calls */
+  sp = start_server(bind, server);
+  if(sp < 0){
+    return 2;
+  }
+
+  snprintf(directory, sizeof(directory), "/tmp/kcpmux-bench-%d", getpid());
+
+  fflush(stdout);
+
+  mp = fork();
+  if(mp < 0){
+    return 2;
+  }
+  if(mp == 0){
+    freopen("/dev/null", "w", stderr);
+    execl(KCPMUX, KCPMUX, "-q", "-d", directory, server, NULL);
+    exit(4);
+  }
+
+  net_mux_path(path, sizeof(path), directory, server, 0);
+  for(i = 0; (i < 50) && (access(path, F_OK) != 0); i++){
+    usleep(100000);
+  }
+
+  setenv(NETC_MUX_VARIABLE, directory, 1);
+
+  /* the first attach waits for the upstream connection, after that the greeting is cached */
+  run_cmd(server, NULL);
+
+  if(run_cmd(server, &muxed) != 0){
+    fprintf(stderr, "bench: request through %s failed\n", KCPMUX);
+  }
+
+  shared = run_many(server, count, &failures);
+  printf("bench: %u multiplexed calls in %ldms, %ldus per call, %u failures, server busy for %ldms\n", count, shared / 1000, shared / count, failures, stop_server(sp) / 1000);
+
+  kill(mp, SIGTERM);
+  waitpid(mp, NULL, 0);
+  rmdir(directory);
+
+  if((muxed == NULL) || strcmp(direct, muxed)){
+    fprintf(stderr, "bench: output differs\ndirect:\n%smultiplexed:\n%s", direct, muxed ? muxed : "");
+    return 1;
+  }
+
+  printf("bench: identical output, multiplexed calls take %ld%% of the direct time\n", (shared * 100) / (plain ? plain : 1));
+
+  return failures ? 1 : 0;
+}
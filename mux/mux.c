@@ -0,0 +1,1007 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* A local daemon which keeps persistent katcp connections to a set of
+ * servers and offers each of them as a unix domain socket, so that
+ * short lived tools (kcpcmd) no longer set up a tcp connection and sit
+ * through the greeting for every request. Requests from all attached
+ * clients are queued and issued one at a time on the single upstream
+ * connection. Replies and informs named after the request go back to
+ * the client which asked, other informs go to every attached client,
+ * and the greeting informs are replayed to new clients. Requests which
+ * set per connection state (sensor sampling, log level, client options)
+ * would leak between clients, so they are refused, and kcpsq keeps its
+ * own connection
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netc.h>
+#include <katcl.h>
+#include <katcp.h>
+#include <katpriv.h>
+#include <fork-parent.h>
+
+#define KCPMUX_NAME "kcpmux"
+
+#define MUX_TIMEOUT     30   /* seconds an upstream may take to answer */
+#define MUX_RETRY        1   /* seconds between reconnection attempts */
+#define MUX_GREETING    16   /* greeting informs kept for replay */
+#define MUX_BACKLOG     64
+
+#define MUX_DOWN         0
+#define MUX_CONNECTING   1
+#define MUX_UP           2
+
+/* requests which change the state of the connection they arrive on */
+static char *mux_stateful[] = { "sensor-sampling", "log-level", "client-config", NULL };
+
+struct mux_request{
+  struct mux_client *q_client;
+  struct katcl_parse *q_parse;
+  struct mux_request *q_next;
+};
+
+struct mux_server{
+  char *s_name;
+  char *s_path;
+  int s_listen;
+
+  struct katcl_line *s_line;
+  int s_state;
+  time_t s_retry;
+
+  struct katcl_parse *s_greeting[MUX_GREETING];
+  unsigned int s_greet;
+
+  struct mux_request *s_head;
+  struct mux_request *s_tail;
+
+  struct mux_request *s_current;
+  char *s_match;
+  time_t s_sent;
+
+  unsigned long s_requests;
+  unsigned long s_attached;
+  unsigned long s_connects;
+};
+
+struct mux_client{
+  struct katcl_line *c_line;
+  struct mux_server *c_server;
+};
+
+struct mux_state{
+  struct mux_server **m_servers;
+  unsigned int m_count;
+
+  struct mux_client **m_clients;
+  unsigned int m_size;
+
+  int m_verbose;
+  int m_timeout;
+};
+
+static volatile int mux_run = 1;
+static volatile int mux_dump = 0;
+
+void handle_signal(int signal)
+{
+  switch(signal){
+    case SIGHUP :
+    case SIGINT :
+    case SIGTERM :
+      mux_run = 0;
+      break;
+    case SIGUSR1 :
+      mux_dump = 1;
+      break;
+  }
+}
+
+/* upstream servers *************************************************/
+
+void clear_greeting_mux(struct mux_server *s)
+{
+  unsigned int i;
+
+  for(i = 0; i < s->s_greet; i++){
+    destroy_parse_katcl(s->s_greeting[i]);
+    s->s_greeting[i] = NULL;
+  }
+
+  s->s_greet = 0;
+}
+
+void destroy_request_mux(struct mux_request *q)
+{
+  if(q == NULL){
+    return;
+  }
+
+  if(q->q_parse){
+    destroy_parse_katcl(q->q_parse);
+    q->q_parse = NULL;
+  }
+
+  q->q_client = NULL;
+  q->q_next = NULL;
+
+  free(q);
+}
+
+void destroy_server_mux(struct mux_server *s)
+{
+  struct mux_request *q;
+
+  if(s == NULL){
+    return;
+  }
+
+  if(s->s_listen >= 0){
+    close(s->s_listen);
+    s->s_listen = (-1);
+  }
+
+  if(s->s_path){
+    unlink(s->s_path);
+    free(s->s_path);
+    s->s_path = NULL;
+  }
+
+  if(s->s_name){
+    free(s->s_name);
+    s->s_name = NULL;
+  }
+
+  if(s->s_line){
+    destroy_katcl(s->s_line, 1);
+    s->s_line = NULL;
+  }
+
+  clear_greeting_mux(s);
+
+  while(s->s_head){
+    q = s->s_head;
+    s->s_head = q->q_next;
+    destroy_request_mux(q);
+  }
+  s->s_tail = NULL;
+
+  if(s->s_current){
+    destroy_request_mux(s->s_current);
+    s->s_current = NULL;
+  }
+
+  free(s);
+}
+
+struct mux_server *create_server_mux(char *directory, char *name)
+{
+  struct mux_server *s;
+  struct sockaddr_un su;
+  int fd;
+
+  s = malloc(sizeof(struct mux_server));
+  if(s == NULL){
+    return NULL;
+  }
+
+  s->s_name = NULL;
+  s->s_path = NULL;
+  s->s_listen = (-1);
+
+  s->s_line = NULL;
+  s->s_state = MUX_DOWN;
+  s->s_retry = 0;
+
+  s->s_greet = 0;
+
+  s->s_head = NULL;
+  s->s_tail = NULL;
+
+  s->s_current = NULL;
+  s->s_match = NULL;
+  s->s_sent = 0;
+
+  s->s_requests = 0;
+  s->s_attached = 0;
+  s->s_connects = 0;
+
+  s->s_name = strdup(name);
+  if(s->s_name == NULL){
+    destroy_server_mux(s);
+    return NULL;
+  }
+
+  if(net_mux_path(su.sun_path, sizeof(su.sun_path), directory, name, 0) < 0){
+    fprintf(stderr, "%s: unable to derive a socket name for %s in %s\n", KCPMUX_NAME, name, directory);
+    destroy_server_mux(s);
+    return NULL;
+  }
+  su.sun_family = AF_UNIX;
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0){
+    destroy_server_mux(s);
+    return NULL;
+  }
+
+  unlink(su.sun_path); /* left over from an earlier instance */
+
+  if(bind(fd, (struct sockaddr *)&su, sizeof(struct sockaddr_un)) < 0){
+    fprintf(stderr, "%s: unable to bind %s: %s\n", KCPMUX_NAME, su.sun_path, strerror(errno));
+    close(fd);
+    destroy_server_mux(s);
+    return NULL;
+  }
+
+  s->s_listen = fd;
+
+  s->s_path = strdup(su.sun_path);
+  if(s->s_path == NULL){
+    unlink(su.sun_path);
+    destroy_server_mux(s);
+    return NULL;
+  }
+
+  if(listen(fd, MUX_BACKLOG) < 0){
+    destroy_server_mux(s);
+    return NULL;
+  }
+
+  return s;
+}
+
+void detach_clients_mux(struct mux_state *m, struct mux_server *s);
+
+void down_server_mux(struct mux_state *m, struct mux_server *s, char *reason)
+{
+  struct mux_request *q;
+
+  if(m->m_verbose > 0){
+    fprintf(stderr, "%s: connection to %s lost: %s\n", KCPMUX_NAME, s->s_name, reason);
+  }
+
+  if(s->s_line){
+    destroy_katcl(s->s_line, 1);
+    s->s_line = NULL;
+  }
+
+  s->s_state = MUX_DOWN;
+  s->s_retry = time(NULL) + MUX_RETRY;
+
+  clear_greeting_mux(s);
+
+  while(s->s_head){
+    q = s->s_head;
+    s->s_head = q->q_next;
+    destroy_request_mux(q);
+  }
+  s->s_tail = NULL;
+
+  if(s->s_current){
+    destroy_request_mux(s->s_current);
+    s->s_current = NULL;
+  }
+  s->s_match = NULL;
+
+  /* a direct connection would have gone away too, so do the same to the clients */
+  detach_clients_mux(m, s);
+}
+
+int connect_server_mux(struct mux_state *m, struct mux_server *s)
+{
+  int fd;
+
+  if(s->s_state != MUX_DOWN){
+    return 0;
+  }
+
+  s->s_retry = time(NULL) + MUX_RETRY;
+
+  fd = net_connect(s->s_name, 0, NETC_ASYNC);
+  if(fd < 0){
+    if(m->m_verbose > 1){
+      fprintf(stderr, "%s: unable to initiate connection to %s\n", KCPMUX_NAME, s->s_name);
+    }
+    return -1;
+  }
+
+  s->s_line = create_katcl(fd);
+  if(s->s_line == NULL){
+    close(fd);
+    return -1;
+  }
+
+  s->s_state = MUX_CONNECTING;
+  s->s_connects++;
+
+  return 0;
+}
+
+void pump_server_mux(struct mux_server *s)
+{
+  struct mux_request *q;
+  char *ptr;
+
+  while((s->s_current == NULL) && (s->s_state == MUX_UP) && s->s_head){
+    q = s->s_head;
+    s->s_head = q->q_next;
+    if(s->s_head == NULL){
+      s->s_tail = NULL;
+    }
+    q->q_next = NULL;
+
+    if(q->q_client == NULL){ /* asker has gone away meanwhile */
+      destroy_request_mux(q);
+      continue;
+    }
+
+    ptr = get_string_parse_katcl(q->q_parse, 0);
+    if((ptr == NULL) || (append_parse_katcl(s->s_line, q->q_parse) < 0)){
+      destroy_request_mux(q);
+      continue;
+    }
+
+    s->s_current = q;
+    s->s_match = ptr + 1;
+    s->s_sent = time(NULL);
+    s->s_requests++;
+  }
+}
+
+int queue_server_mux(struct mux_server *s, struct mux_client *c, struct katcl_parse *p)
+{
+  struct mux_request *q;
+
+  q = malloc(sizeof(struct mux_request));
+  if(q == NULL){
+    return -1;
+  }
+
+  q->q_client = c;
+  q->q_next = NULL;
+  q->q_parse = copy_parse_katcl(p);
+  if(q->q_parse == NULL){
+    free(q);
+    return -1;
+  }
+
+  if(s->s_tail){
+    s->s_tail->q_next = q;
+  } else {
+    s->s_head = q;
+  }
+  s->s_tail = q;
+
+  pump_server_mux(s);
+
+  return 0;
+}
+
+/* local clients ****************************************************/
+
+void destroy_client_mux(struct mux_client *c)
+{
+  if(c == NULL){
+    return;
+  }
+
+  if(c->c_line){
+    destroy_katcl(c->c_line, 1);
+    c->c_line = NULL;
+  }
+
+  c->c_server = NULL;
+
+  free(c);
+}
+
+void forget_client_mux(struct mux_server *s, struct mux_client *c)
+{
+  struct mux_request *q;
+
+  for(q = s->s_head; q; q = q->q_next){
+    if(q->q_client == c){
+      q->q_client = NULL;
+    }
+  }
+
+  if(s->s_current && (s->s_current->q_client == c)){
+    s->s_current->q_client = NULL; /* reply will be discarded */
+  }
+}
+
+void remove_client_mux(struct mux_state *m, unsigned int index)
+{
+  struct mux_client *c;
+
+  c = m->m_clients[index];
+  if(c == NULL){
+    return;
+  }
+
+  forget_client_mux(c->c_server, c);
+  destroy_client_mux(c);
+
+  m->m_clients[index] = NULL;
+}
+
+void detach_clients_mux(struct mux_state *m, struct mux_server *s)
+{
+  unsigned int i;
+
+  for(i = 0; i < m->m_size; i++){
+    if(m->m_clients[i] && (m->m_clients[i]->c_server == s)){
+      remove_client_mux(m, i);
+    }
+  }
+}
+
+int accept_client_mux(struct mux_state *m, struct mux_server *s)
+{
+  struct mux_client *c;
+  unsigned int i, j;
+  int fd;
+
+  fd = accept(s->s_listen, NULL, NULL);
+  if(fd < 0){
+    return -1;
+  }
+
+  if(s->s_state == MUX_DOWN){
+    if(connect_server_mux(m, s) < 0){
+      close(fd); /* as if the connect had failed */
+      return -1;
+    }
+  }
+
+  for(i = 0; (i < m->m_size) && m->m_clients[i]; i++);
+  if(i >= m->m_size){
+    close(fd);
+    return -1;
+  }
+
+  c = malloc(sizeof(struct mux_client));
+  if(c == NULL){
+    close(fd);
+    return -1;
+  }
+
+  c->c_server = s;
+  c->c_line = create_katcl(fd);
+  if(c->c_line == NULL){
+    free(c);
+    close(fd);
+    return -1;
+  }
+
+  for(j = 0; j < s->s_greet; j++){
+    append_parse_katcl(c->c_line, s->s_greeting[j]);
+  }
+
+  m->m_clients[i] = c;
+  s->s_attached++;
+
+  return 0;
+}
+
+void broadcast_mux(struct mux_state *m, struct mux_server *s, struct katcl_parse *p)
+{
+  unsigned int i;
+  struct mux_client *c;
+
+  for(i = 0; i < m->m_size; i++){
+    c = m->m_clients[i];
+    if(c && (c->c_server == s)){
+      append_parse_katcl(c->c_line, p);
+    }
+  }
+}
+
+/* traffic **********************************************************/
+
+int stateful_mux(char *name)
+{
+  unsigned int i;
+
+  for(i = 0; mux_stateful[i]; i++){
+    if(!strcmp(mux_stateful[i], name)){
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void upstream_mux(struct mux_state *m, struct mux_server *s)
+{
+  struct katcl_parse *p;
+  struct mux_request *q;
+  char *cmd;
+
+  while((s->s_state == MUX_UP) && (have_katcl(s->s_line) > 0)){
+    cmd = arg_string_katcl(s->s_line, 0);
+    p = ready_katcl(s->s_line);
+    if((cmd == NULL) || (p == NULL)){
+      continue;
+    }
+
+    switch(cmd[0]){
+      case KATCP_REPLY :
+        q = s->s_current;
+        if((q == NULL) || strcmp(cmd + 1, s->s_match)){
+          if(m->m_verbose > 1){
+            fprintf(stderr, "%s: discarding unexpected reply %s from %s\n", KCPMUX_NAME, cmd, s->s_name);
+          }
+          break;
+        }
+        if(q->q_client){
+          append_parse_katcl(q->q_client->c_line, p);
+        }
+        s->s_current = NULL;
+        s->s_match = NULL;
+        destroy_request_mux(q);
+        pump_server_mux(s);
+        break;
+
+      case KATCP_INFORM :
+        q = s->s_current;
+        if(q && !strcmp(cmd + 1, s->s_match)){
+          if(q->q_client){
+            append_parse_katcl(q->q_client->c_line, p);
+          }
+          break;
+        }
+        if(!strcmp(cmd, KATCP_VERSION_CONNECT_INFORM) || !strcmp(cmd, KATCP_VERSION_INFORM) || !strcmp(cmd, KATCP_BUILD_STATE_INFORM)){
+          if(s->s_greet < MUX_GREETING){
+            s->s_greeting[s->s_greet] = copy_parse_katcl(p);
+            if(s->s_greeting[s->s_greet]){
+              s->s_greet++;
+            }
+          }
+        }
+        broadcast_mux(m, s, p);
+        break;
+
+      default :
+        if(m->m_verbose > 1){
+          fprintf(stderr, "%s: ignoring message %s from %s\n", KCPMUX_NAME, cmd, s->s_name);
+        }
+        break;
+    }
+  }
+}
+
+void downstream_mux(struct mux_state *m, unsigned int index)
+{
+  struct mux_client *c;
+  struct mux_server *s;
+  struct katcl_parse *p;
+  char *cmd;
+
+  c = m->m_clients[index];
+  s = c->c_server;
+
+  while(have_katcl(c->c_line) > 0){
+    cmd = arg_string_katcl(c->c_line, 0);
+    p = ready_katcl(c->c_line);
+    if((cmd == NULL) || (p == NULL)){
+      continue;
+    }
+
+    switch(cmd[0]){
+      case KATCP_REQUEST :
+        if(stateful_mux(cmd + 1)){
+          /* the upstream connection is shared, its state is not ours to change */
+          append_args_katcl(c->c_line, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "%c%s", KATCP_REPLY, cmd + 1);
+          append_string_katcl(c->c_line, KATCP_FLAG_STRING, KATCP_FAIL);
+          append_string_katcl(c->c_line, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "connection state is shared by kcpmux clients");
+          break;
+        }
+        if(queue_server_mux(s, c, p) < 0){
+          remove_client_mux(m, index);
+          return;
+        }
+        break;
+      default :
+        /* informs and replies need no answer, pass them straight on */
+        if(s->s_state == MUX_UP){
+          append_parse_katcl(s->s_line, p);
+        }
+        break;
+    }
+  }
+}
+
+void dump_mux(struct mux_state *m)
+{
+  struct mux_server *s;
+  struct mux_request *q;
+  unsigned int i, pending;
+
+  for(i = 0; i < m->m_count; i++){
+    s = m->m_servers[i];
+    pending = 0;
+    for(q = s->s_head; q; q = q->q_next){
+      pending++;
+    }
+    fprintf(stderr, "%s: %s via %s %s, %lu connects, %lu attaches, %lu requests, %u queued%s\n", KCPMUX_NAME, s->s_name, s->s_path, (s->s_state == MUX_UP) ? "up" : ((s->s_state == MUX_CONNECTING) ? "connecting" : "down"), s->s_connects, s->s_attached, s->s_requests, pending, s->s_current ? ", one in progress" : "");
+  }
+}
+
+int run_mux(struct mux_state *m)
+{
+  struct mux_server *s;
+  struct mux_client *c;
+  fd_set fsr, fsw;
+  struct timeval tv;
+  unsigned int i, len;
+  int fd, mfd, result, code;
+  time_t now;
+
+  while(mux_run){
+
+    if(mux_dump){
+      dump_mux(m);
+      mux_dump = 0;
+    }
+
+    FD_ZERO(&fsr);
+    FD_ZERO(&fsw);
+    mfd = 0;
+
+    now = time(NULL);
+
+    for(i = 0; i < m->m_count; i++){
+      s = m->m_servers[i];
+
+      if(s->s_current && ((s->s_sent + m->m_timeout) < now)){
+        down_server_mux(m, s, "request timed out");
+      }
+
+      if((s->s_state == MUX_DOWN) && (s->s_retry <= now)){
+        connect_server_mux(m, s);
+      }
+
+      FD_SET(s->s_listen, &fsr);
+      if(s->s_listen > mfd){
+        mfd = s->s_listen;
+      }
+
+      switch(s->s_state){
+        case MUX_CONNECTING :
+          fd = fileno_katcl(s->s_line);
+          FD_SET(fd, &fsw);
+          break;
+        case MUX_UP :
+          fd = fileno_katcl(s->s_line);
+          FD_SET(fd, &fsr);
+          if(flushing_katcl(s->s_line)){
+            FD_SET(fd, &fsw);
+          }
+          break;
+        default :
+          fd = (-1);
+          break;
+      }
+      if(fd > mfd){
+        mfd = fd;
+      }
+    }
+
+    for(i = 0; i < m->m_size; i++){
+      c = m->m_clients[i];
+      if(c == NULL){
+        continue;
+      }
+      fd = fileno_katcl(c->c_line);
+      FD_SET(fd, &fsr);
+      if(flushing_katcl(c->c_line)){
+        FD_SET(fd, &fsw);
+      }
+      if(fd > mfd){
+        mfd = fd;
+      }
+    }
+
+    tv.tv_sec = MUX_RETRY;
+    tv.tv_usec = 0;
+
+    result = select(mfd + 1, &fsr, &fsw, NULL, &tv);
+    if(result < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          continue;
+        default :
+          fprintf(stderr, "%s: select failed: %s\n", KCPMUX_NAME, strerror(errno));
+          return -1;
+      }
+    }
+
+    for(i = 0; i < m->m_count; i++){
+      s = m->m_servers[i];
+
+      switch(s->s_state){
+        case MUX_CONNECTING :
+          fd = fileno_katcl(s->s_line);
+          if(FD_ISSET(fd, &fsw)){
+            len = sizeof(int);
+            if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &code, &len) < 0){
+              code = errno;
+            }
+            if(code == 0){
+              if(m->m_verbose > 0){
+                fprintf(stderr, "%s: connected to %s\n", KCPMUX_NAME, s->s_name);
+              }
+              s->s_state = MUX_UP;
+              pump_server_mux(s);
+            } else if(code != EINPROGRESS){
+              down_server_mux(m, s, strerror(code));
+            }
+          }
+          break;
+
+        case MUX_UP :
+          fd = fileno_katcl(s->s_line);
+          if(FD_ISSET(fd, &fsw)){
+            if(write_katcl(s->s_line) < 0){
+              down_server_mux(m, s, strerror(error_katcl(s->s_line)));
+              break;
+            }
+          }
+          if(FD_ISSET(fd, &fsr)){
+            result = read_katcl(s->s_line);
+            upstream_mux(m, s);
+            if(result){
+              down_server_mux(m, s, (result < 0) ? strerror(error_katcl(s->s_line)) : "connection closed");
+            }
+          }
+          break;
+      }
+    }
+
+    for(i = 0; i < m->m_size; i++){
+      c = m->m_clients[i];
+      if(c == NULL){
+        continue;
+      }
+      fd = fileno_katcl(c->c_line);
+      if(FD_ISSET(fd, &fsw)){
+        if(write_katcl(c->c_line) < 0){
+          remove_client_mux(m, i);
+          continue;
+        }
+      }
+      if(FD_ISSET(fd, &fsr)){
+        result = read_katcl(c->c_line);
+        downstream_mux(m, i);
+        if(result && m->m_clients[i]){
+          /* a client may close right after sending its request, its reply is then dropped */
+          remove_client_mux(m, i);
+        }
+      }
+    }
+
+    /* new clients last, so that their descriptors were not in this round's sets */
+    for(i = 0; i < m->m_count; i++){
+      s = m->m_servers[i];
+      if(FD_ISSET(s->s_listen, &fsr)){
+        accept_client_mux(m, s);
+      }
+    }
+  }
+
+  return 0;
+}
+
+void usage(char *app)
+{
+  printf("usage: %s [options] server[:port] ...\n", app);
+  printf("-h                 this help\n");
+  printf("-b                 run in the background\n");
+  printf("-d directory       directory for the unix domain sockets (default $%s)\n", NETC_MUX_VARIABLE);
+  printf("-t seconds         time an upstream server may take to answer a request (default %d)\n", MUX_TIMEOUT);
+  printf("-v                 increase verbosity\n");
+  printf("-q                 run quietly\n");
+
+  printf("environment variables:\n");
+  printf("  %s        socket directory, also used by kcpcmd to find this daemon\n", NETC_MUX_VARIABLE);
+
+  printf("notes:\n");
+  printf("  each server gets a socket named host:port in the directory\n");
+  printf("  requests which change connection state (client-config, sensor-sampling,\n");
+  printf("  log-level) are refused, as all clients share the upstream connection\n");
+  printf("  SIGUSR1 reports connection statistics on standard error\n");
+}
+
+int main(int argc, char **argv)
+{
+  struct mux_state state, *m;
+  struct mux_server *s, **tmp;
+  struct sigaction sa;
+  char *app, *directory;
+  int i, j, c, detach, result;
+  unsigned int k;
+
+  app = argv[0];
+  m = &state;
+
+  m->m_servers = NULL;
+  m->m_count = 0;
+  m->m_clients = NULL;
+  m->m_size = 0;
+  m->m_verbose = 1;
+  m->m_timeout = MUX_TIMEOUT;
+
+  directory = getenv(NETC_MUX_VARIABLE);
+  detach = 0;
+
+  i = j = 1;
+
+  /* options first, servers afterwards, as sockets need the directory */
+  while((i < argc) && (argv[i][0] == '-')){
+    c = argv[i][j];
+    switch (c) {
+
+      case 'h' :
+        usage(app);
+        return EX_OK;
+
+      case 'b' :
+        detach = 1;
+        j++;
+        break;
+
+      case 'v' :
+        m->m_verbose++;
+        j++;
+        break;
+
+      case 'q' :
+        m->m_verbose = 0;
+        j++;
+        break;
+
+      case 'd' :
+      case 't' :
+
+        j++;
+        if (argv[i][j] == '\0') {
+          j = 0;
+          i++;
+        }
+        if (i >= argc) {
+          fprintf(stderr, "%s: usage: argument needs a parameter\n", app);
+          return EX_USAGE;
+        }
+
+        switch(c){
+          case 'd' :
+            directory = argv[i] + j;
+            break;
+          case 't' :
+            m->m_timeout = atoi(argv[i] + j);
+            if(m->m_timeout <= 0){
+              fprintf(stderr, "%s: usage: timeout needs to be positive\n", app);
+              return EX_USAGE;
+            }
+            break;
+        }
+
+        i++;
+        j = 1;
+        break;
+
+      case '-' :
+        j++;
+        break;
+      case '\0':
+        j = 1;
+        i++;
+        break;
+      default:
+        fprintf(stderr, "%s: usage: unknown option -%c\n", app, argv[i][j]);
+        return EX_USAGE;
+    }
+  }
+
+  if((directory == NULL) || (directory[0] == '\0')){
+    fprintf(stderr, "%s: usage: need a socket directory, either with -d or in %s\n", app, NETC_MUX_VARIABLE);
+    return EX_USAGE;
+  }
+
+  if(i >= argc){
+    fprintf(stderr, "%s: usage: need at least one server\n", app);
+    return EX_USAGE;
+  }
+
+  if((mkdir(directory, 0700) < 0) && (errno != EEXIST)){
+    fprintf(stderr, "%s: unable to create %s: %s\n", app, directory, strerror(errno));
+    return EX_CANTCREAT;
+  }
+
+  for(; i < argc; i++){
+    s = create_server_mux(directory, argv[i]);
+    if(s == NULL){
+      fprintf(stderr, "%s: unable to set up server %s\n", app, argv[i]);
+      return EX_CANTCREAT;
+    }
+
+    tmp = realloc(m->m_servers, sizeof(struct mux_server *) * (m->m_count + 1));
+    if(tmp == NULL){
+      destroy_server_mux(s);
+      return EX_OSERR;
+    }
+    m->m_servers = tmp;
+    m->m_servers[m->m_count++] = s;
+  }
+
+  /* select limits us, leave room for the listeners and upstream connections */
+  if(FD_SETSIZE <= (2 * m->m_count) + 16){
+    fprintf(stderr, "%s: too many servers\n", app);
+    return EX_USAGE;
+  }
+  m->m_size = FD_SETSIZE - (2 * m->m_count) - 16;
+
+  m->m_clients = malloc(sizeof(struct mux_client *) * m->m_size);
+  if(m->m_clients == NULL){
+    return EX_OSERR;
+  }
+  for(k = 0; k < m->m_size; k++){
+    m->m_clients[k] = NULL;
+  }
+
+  if(detach){
+    if(fork_parent() < 0){
+      fprintf(stderr, "%s: unable to detach process\n", app);
+      return EX_OSERR;
+    }
+  }
+
+  sa.sa_handler = handle_signal;
+  sa.sa_flags = 0;
+  sigemptyset(&(sa.sa_mask));
+
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+
+  result = run_mux(m);
+
+  if(m->m_verbose > 1){
+    dump_mux(m);
+  }
+
+  for(k = 0; k < m->m_size; k++){
+    destroy_client_mux(m->m_clients[k]);
+  }
+  free(m->m_clients);
+
+  for(k = 0; k < m->m_count; k++){
+    destroy_server_mux(m->m_servers[k]);
+  }
+  free(m->m_servers);
+
+  return (result < 0) ? EX_SOFTWARE : EX_OK;
+}
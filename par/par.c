@@ -7,10 +7,11 @@
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdarg.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
 
 #include "netc.h"
@@ -23,31 +24,85 @@
 #define BUFFER 1024
 #define TIMEOUT   4
 
-#define RX_SETUP 1 
-#define RX_UP    2 
+#define KCPPAR_LIMIT     256   /* default number of connections in progress */
+#define KCPPAR_EVENTS     64   /* events collected per epoll_wait */
+#define KCPPAR_HASH     4096   /* buckets in the name table, power of two */
+#define KCPPAR_REASON    128   /* length of a recorded failure */
+
+/* latency histogram: 8 linear buckets per power of two, in microseconds */
+#define KCPPAR_STEPS       8
+#define KCPPAR_BUCKETS   512
+
+#define RX_IDLE  3
+#define RX_SETUP 1
+#define RX_UP    2
 #define RX_OK    0
 #define RX_FAIL  (-1)
 #define RX_BAD   (-2)
+#define RX_LATE  (-3)
 
 struct remote{
   char *r_name;
   struct katcl_line *r_line;
 
   int r_state;
+  unsigned int r_events;
 
   unsigned int r_index;
   unsigned int r_count;
 
   struct katcl_parse **r_vector;
   char *r_match;
+
+  struct timeval r_sent;
+
+  struct remote *r_next;
+};
+
+struct code{
+  char *c_name;
+  unsigned long c_count;
 };
 
 struct set{
   struct remote **s_vector;
   unsigned int s_count;
+  unsigned int s_size;
+
+  struct remote **s_table;
 
   int s_status;
   unsigned int s_finished;
+
+  int s_efd;
+  unsigned int s_started;
+  unsigned int s_active;
+  unsigned int s_limit;
+
+  struct katcl_line *s_line;
+  char *s_label;
+  int s_verbose;
+  int s_info;
+  int s_show;
+  int s_munge;
+  int s_once;
+
+  unsigned int s_ok;
+  unsigned int s_failed;
+  unsigned int s_broken;
+  unsigned int s_timeouts;
+  unsigned int s_operations;
+
+  struct code *s_codes;
+  unsigned int s_kinds;
+
+  unsigned long s_histogram[KCPPAR_BUCKETS];
+  unsigned long s_replies;
+  unsigned long s_min;
+  unsigned long s_max;
+
+  char *s_first;
+  char *s_last;
 };
 
 void destroy_remote(struct remote *rx)
@@ -85,6 +140,8 @@ void destroy_remote(struct remote *rx)
   }
   rx->r_count = 0;
 
+  rx->r_next = NULL;
+
   free(rx);
 }
 
@@ -101,12 +158,18 @@ struct remote *create_remote(char *name)
   rs->r_line = NULL;
 
   rs->r_index = 0;
-  rs->r_state = RX_BAD;
+  rs->r_state = RX_IDLE;
+  rs->r_events = 0;
 
   rs->r_count = 0;
   rs->r_vector = NULL;
   rs->r_match = NULL;
 
+  rs->r_sent.tv_sec = 0;
+  rs->r_sent.tv_usec = 0;
+
+  rs->r_next = NULL;
+
   rs->r_name = strdup(name);
   if(rs->r_name == NULL){
     destroy_remote(rs);
@@ -130,7 +193,7 @@ int queue_remote(struct remote *rs, struct katcl_parse *px)
   rs->r_vector[rs->r_count] = copy_parse_katcl(px);
 
   rs->r_count++;
-  
+
   return 0;
 }
 
@@ -139,18 +202,62 @@ int queue_remote(struct remote *rs, struct katcl_parse *px)
 struct set *create_set()
 {
   struct set *ss;
+  unsigned int i;
 
   ss = malloc(sizeof(struct set));
   if(ss == NULL){
     return NULL;
   }
 
-  ss->s_count = 0; 
+  ss->s_count = 0;
+  ss->s_size = 0;
   ss->s_vector = NULL;
 
   ss->s_status = 0;
   ss->s_finished = 0;
 
+  ss->s_efd = (-1);
+  ss->s_started = 0;
+  ss->s_active = 0;
+  ss->s_limit = KCPPAR_LIMIT;
+
+  ss->s_line = NULL;
+  ss->s_label = KCPPAR_NAME;
+  ss->s_verbose = 1;
+  ss->s_info = 1;
+  ss->s_show = 1;
+  ss->s_munge = 0;
+  ss->s_once = 1;
+
+  ss->s_ok = 0;
+  ss->s_failed = 0;
+  ss->s_broken = 0;
+  ss->s_timeouts = 0;
+  ss->s_operations = 0;
+
+  ss->s_codes = NULL;
+  ss->s_kinds = 0;
+
+  for(i = 0; i < KCPPAR_BUCKETS; i++){
+    ss->s_histogram[i] = 0;
+  }
+  ss->s_replies = 0;
+  ss->s_min = 0;
+  ss->s_max = 0;
+
+  ss->s_first = NULL;
+  ss->s_last = NULL;
+
+  ss->s_table = malloc(sizeof(struct remote *) * KCPPAR_HASH);
+  if(ss->s_table == NULL){
+    free(ss);
+    return NULL;
+  }
+
+  for(i = 0; i < KCPPAR_HASH; i++){
+    ss->s_table[i] = NULL;
+  }
+
   return ss;
 }
 
@@ -171,19 +278,62 @@ void destroy_set(struct set *ss)
     free(ss->s_vector);
     ss->s_vector = NULL;
   }
-  
+  ss->s_size = 0;
+
+  if(ss->s_table){
+    free(ss->s_table);
+    ss->s_table = NULL;
+  }
+
+  if(ss->s_efd >= 0){
+    close(ss->s_efd);
+    ss->s_efd = (-1);
+  }
+
+  if(ss->s_codes){
+    for(i = 0; i < ss->s_kinds; i++){
+      free(ss->s_codes[i].c_name);
+    }
+    free(ss->s_codes);
+    ss->s_codes = NULL;
+  }
+  ss->s_kinds = 0;
+
+  if(ss->s_first){
+    free(ss->s_first);
+    ss->s_first = NULL;
+  }
+
+  if(ss->s_last){
+    free(ss->s_last);
+    ss->s_last = NULL;
+  }
+
   ss->s_status = (-1);
 
   free(ss);
 }
 
+static unsigned int hash_name(char *name)
+{
+  unsigned int h;
+  unsigned char *ptr;
+
+  /* fnv-1a */
+  h = 2166136261U;
+  for(ptr = (unsigned char *)name; *ptr != '\0'; ptr++){
+    h ^= *ptr;
+    h *= 16777619U;
+  }
+
+  return h & (KCPPAR_HASH - 1);
+}
+
 struct remote *find_remote(struct set *ss, char *name)
 {
-  unsigned int i;
   struct remote *rs;
 
-  for(i = 0; i < ss->s_count; i++){
-    rs = ss->s_vector[i];
+  for(rs = ss->s_table[hash_name(name)]; rs; rs = rs->r_next){
     if(!strcmp(rs->r_name, name)){
       return rs;
     }
@@ -196,23 +346,32 @@ struct remote *add_remote(struct set *ss, char *name)
 {
   struct remote *rs;
   struct remote **tmp;
+  unsigned int size, h;
 
   rs = create_remote(name);
   if(rs == NULL){
     return NULL;
   }
 
-  tmp = realloc(ss->s_vector, sizeof(struct remote *) * (ss->s_count + 1));
-  if(tmp == NULL){
-    destroy_remote(rs);
-    return NULL;
-  }
+  if(ss->s_count >= ss->s_size){
+    size = (ss->s_size > 0) ? (ss->s_size * 2) : 16;
+    tmp = realloc(ss->s_vector, sizeof(struct remote *) * size);
+    if(tmp == NULL){
+      destroy_remote(rs);
+      return NULL;
+    }
 
-  ss->s_vector = tmp;
+    ss->s_vector = tmp;
+    ss->s_size = size;
+  }
 
   ss->s_vector[ss->s_count] = rs;
   ss->s_count++;
 
+  h = hash_name(name);
+  rs->r_next = ss->s_table[h];
+  ss->s_table[h] = rs;
+
   return rs;
 }
 
@@ -313,55 +472,372 @@ int load_parse_set(struct set *ss, char *list, struct katcl_parse *px)
   return result;
 }
 
-int activate_remotes(struct set *ss, struct katcl_line *k)
+/********************************************************************/
+
+/* results are aggregated as they arrive, so memory does not grow with the reply volume */
+
+static unsigned int bucket_latency(unsigned long us)
+{
+  unsigned int msb;
+
+  if(us < KCPPAR_STEPS){
+    return us;
+  }
+
+  for(msb = 3; (msb < 63) && ((us >> (msb + 1)) > 0); msb++);
+
+  return ((msb - 2) * KCPPAR_STEPS) + ((us >> (msb - 3)) & (KCPPAR_STEPS - 1));
+}
+
+static unsigned long bound_latency(unsigned int bucket)
+{
+  unsigned int msb, sub;
+
+  if(bucket < KCPPAR_STEPS){
+    return bucket;
+  }
+
+  msb = (bucket / KCPPAR_STEPS) + 2;
+  sub = bucket % KCPPAR_STEPS;
+
+  return ((unsigned long)(KCPPAR_STEPS + sub + 1) << (msb - 3)) - 1;
+}
+
+void record_latency(struct set *ss, struct remote *rx)
+{
+  struct timeval now, delta;
+  unsigned long us;
+
+  gettimeofday(&now, NULL);
+  sub_time_katcp(&delta, &now, &(rx->r_sent));
+
+  us = (delta.tv_sec * 1000000UL) + delta.tv_usec;
+
+  if((ss->s_replies == 0) || (us < ss->s_min)){
+    ss->s_min = us;
+  }
+  if(us > ss->s_max){
+    ss->s_max = us;
+  }
+
+  ss->s_histogram[bucket_latency(us)]++;
+  ss->s_replies++;
+}
+
+unsigned long percentile_latency(struct set *ss, unsigned int percent)
 {
+  unsigned long rank, total;
   unsigned int i;
-  struct remote *rx;
-  int fd;
 
-#ifdef DEBUG
-  fprintf(stderr, "launching %u clients\n", ss->s_count);
-#endif
+  if(ss->s_replies == 0){
+    return 0;
+  }
 
-  for(i = 0; i < ss->s_count; i++){
-    rx = ss->s_vector[i];
-#ifdef DEBUG
-    fprintf(stderr, "attempting to start connect to %s (%u requests)\n", rx->r_name, rx->r_count);
-#endif
-    fd = net_connect(rx->r_name, 0, NETC_ASYNC);
-    if(fd < 0){
-      if(k){
-        /* TODO */
+  rank = ((ss->s_replies * percent) + 99) / 100;
+  if(rank == 0){
+    rank = 1;
+  }
+
+  total = 0;
+  for(i = 0; i < KCPPAR_BUCKETS; i++){
+    total += ss->s_histogram[i];
+    if(total >= rank){
+      /* bucket bounds overshoot the extremes, clamp them */
+      if(bound_latency(i) > ss->s_max){
+        return ss->s_max;
       }
-      return -1;
+      return bound_latency(i);
+    }
+  }
+
+  return ss->s_max;
+}
+
+int record_code(struct set *ss, char *name)
+{
+  struct code *tmp;
+  unsigned int i;
+
+  for(i = 0; i < ss->s_kinds; i++){
+    if(!strcmp(ss->s_codes[i].c_name, name)){
+      ss->s_codes[i].c_count++;
+      return 0;
+    }
+  }
+
+  tmp = realloc(ss->s_codes, sizeof(struct code) * (ss->s_kinds + 1));
+  if(tmp == NULL){
+    return -1;
+  }
+  ss->s_codes = tmp;
+
+  tmp[ss->s_kinds].c_name = strdup(name);
+  if(tmp[ss->s_kinds].c_name == NULL){
+    return -1;
+  }
+  tmp[ss->s_kinds].c_count = 1;
+
+  ss->s_kinds++;
+
+  return 0;
+}
+
+void record_failure(struct set *ss, struct remote *rx, char *fmt, ...)
+{
+  char buffer[KCPPAR_REASON];
+  va_list args;
+  int len;
+  char *copy;
+
+  len = snprintf(buffer, KCPPAR_REASON, "%s ", rx->r_name);
+  if((len < 0) || (len >= KCPPAR_REASON)){
+    len = 0;
+  }
+
+  va_start(args, fmt);
+  vsnprintf(buffer + len, KCPPAR_REASON - len, fmt, args);
+  va_end(args);
+
+  copy = strdup(buffer);
+  if(copy == NULL){
+    return;
+  }
+
+  if(ss->s_first == NULL){
+    ss->s_first = copy;
+    return;
+  }
+
+  if(ss->s_last){
+    free(ss->s_last);
+  }
+  ss->s_last = copy;
+}
+
+void report_set(struct set *ss, struct timeval *start)
+{
+  struct timeval now, delta;
+  char buffer[BUFFER];
+  unsigned int i;
+  int len, result;
+  struct katcl_line *k;
+  char *label;
+
+  k = ss->s_line;
+  label = ss->s_label;
+
+  gettimeofday(&now, NULL);
+  sub_time_katcp(&delta, &now, start);
+
+  log_message_katcl(k, KATCP_LEVEL_INFO, label, "summary remotes=%u ok=%u failed=%u broken=%u timedout=%u elapsed=%lu.%03lus", ss->s_count, ss->s_ok, ss->s_failed, ss->s_broken, ss->s_timeouts, (unsigned long)delta.tv_sec, (unsigned long)delta.tv_usec / 1000);
+
+  if(ss->s_kinds > 0){
+    len = 0;
+    for(i = 0; i < ss->s_kinds; i++){
+      result = snprintf(buffer + len, BUFFER - len, "%s%s=%lu", (i > 0) ? " " : "", ss->s_codes[i].c_name, ss->s_codes[i].c_count);
+      if((result < 0) || (result >= (BUFFER - len))){
+        break;
+      }
+      len += result;
     }
+    log_message_katcl(k, KATCP_LEVEL_INFO, label, "replies %s", buffer);
+  }
+
+  if(ss->s_replies > 0){
+    log_message_katcl(k, KATCP_LEVEL_INFO, label, "latency replies=%lu min=%lu.%03lums p50=%lu.%03lums p90=%lu.%03lums p99=%lu.%03lums max=%lu.%03lums", ss->s_replies,
+      ss->s_min / 1000, ss->s_min % 1000,
+      percentile_latency(ss, 50) / 1000, percentile_latency(ss, 50) % 1000,
+      percentile_latency(ss, 90) / 1000, percentile_latency(ss, 90) % 1000,
+      percentile_latency(ss, 99) / 1000, percentile_latency(ss, 99) % 1000,
+      ss->s_max / 1000, ss->s_max % 1000);
+  }
+
+  if(ss->s_first){
+    log_message_katcl(k, KATCP_LEVEL_WARN, label, "first failure %s", ss->s_first);
+  }
+  if(ss->s_last){
+    log_message_katcl(k, KATCP_LEVEL_WARN, label, "last failure %s", ss->s_last);
+  }
+}
+
+/********************************************************************/
+
+int watch_remote(struct set *ss, struct remote *rx, unsigned int events)
+{
+  struct epoll_event ev;
+  int op;
 
-    if(rx->r_line){
+  if(rx->r_events == events){
+    return 0;
+  }
+
+  op = (rx->r_events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+  ev.events = events;
+  ev.data.ptr = rx;
+
+  if(epoll_ctl(ss->s_efd, op, fileno_katcl(rx->r_line), &ev) < 0){
+    return -1;
+  }
+
+  rx->r_events = events;
+
+  return 0;
+}
+
+void update_state(struct set *ss, struct remote *rx, int state)
+{
+  unsigned int i;
+
+  if(rx->r_state == state){
+    return;
+  }
+
+  rx->r_state = state;
+
+  switch(state){
+    case RX_BAD :
+      ss->s_status = 2;
+      ss->s_finished++;
+      ss->s_broken++;
+      break;
+
+    case RX_LATE :
+      ss->s_status = 2;
+      ss->s_finished++;
+      ss->s_timeouts++;
+      break;
+
+    case RX_FAIL :
+      if(ss->s_status < 1){
+        ss->s_status = 1;
+      }
+      ss->s_finished++;
+      ss->s_failed++;
+      break;
+
+    case RX_OK :
+      ss->s_finished++;
+      ss->s_ok++;
+      break;
+
+    default :
 #ifdef DEBUG
-      fprintf(stderr, "logic failure: line already initialised\n");
+      fprintf(stderr, "updated state=%d, status=%d\n", rx->r_state, ss->s_status);
 #endif
-      return -1;
+      return;
+  }
+
+  /* finished: give back the descriptor and buffers straight away */
+
+  if(rx->r_line){
+    if(rx->r_events){
+      epoll_ctl(ss->s_efd, EPOLL_CTL_DEL, fileno_katcl(rx->r_line), NULL);
+      rx->r_events = 0;
     }
+    destroy_katcl(rx->r_line, 1);
+    rx->r_line = NULL;
+    if(ss->s_active > 0){
+      ss->s_active--;
+    }
+  }
 
-    rx->r_line = create_katcl(fd);
-    if(rx->r_line == NULL){
-      if(k){
-        /* TODO */
+  if(rx->r_vector){
+    for(i = 0; i < rx->r_count; i++){
+      if(rx->r_vector[i]){
+        destroy_parse_katcl(rx->r_vector[i]);
+        rx->r_vector[i] = NULL;
       }
+    }
+  }
+  rx->r_match = NULL;
+
+#ifdef DEBUG
+  fprintf(stderr, "updated state=%d, status=%d\n", rx->r_state, ss->s_status);
+#endif
+}
+
+int start_remote(struct set *ss, struct remote *rx)
+{
+  int fd;
+
+#ifdef DEBUG
+  fprintf(stderr, "attempting to start connect to %s (%u requests)\n", rx->r_name, rx->r_count);
+#endif
+
+  if(rx->r_line){
 #ifdef DEBUG
-      fprintf(stderr, "setup failure: unable to create line for %s\n", rx->r_name);
+    fprintf(stderr, "logic failure: line already initialised\n");
 #endif
-      close(fd);
+    return -1;
+  }
+
+  fd = net_connect(rx->r_name, 0, NETC_ASYNC);
+  if(fd < 0){
+    log_message_katcl(ss->s_line, KATCP_LEVEL_ERROR, ss->s_label, "unable to initiate connection to %s", rx->r_name);
+    record_failure(ss, rx, "unable to initiate connection");
+    update_state(ss, rx, RX_BAD);
+    return 0;
+  }
+
+  rx->r_line = create_katcl(fd);
+  if(rx->r_line == NULL){
+#ifdef DEBUG
+    fprintf(stderr, "setup failure: unable to create line for %s\n", rx->r_name);
+#endif
+    close(fd);
+    return -1;
+  }
+
+  ss->s_active++;
+
+  rx->r_state = RX_SETUP;
+  rx->r_index = 0;
+
+  if(watch_remote(ss, rx, EPOLLOUT) < 0){
+    log_message_katcl(ss->s_line, KATCP_LEVEL_ERROR, ss->s_label, "unable to monitor connection to %s: %s", rx->r_name, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int activate_remotes(struct set *ss)
+{
+  struct remote *rx;
+
+  /* only a bounded number of connections are ever in progress */
+
+  while((ss->s_active < ss->s_limit) && (ss->s_started < ss->s_count)){
+    rx = ss->s_vector[ss->s_started];
+    ss->s_started++;
+
+    if(start_remote(ss, rx) < 0){
       return -1;
     }
-
-    rx->r_state = RX_SETUP;
-    rx->r_index = 0;
   }
 
   return 0;
 }
 
+void expire_remotes(struct set *ss)
+{
+  unsigned int i;
+  struct remote *rx;
+
+  for(i = 0; i < ss->s_count; i++){
+    rx = ss->s_vector[i];
+    switch(rx->r_state){
+      case RX_IDLE  :
+      case RX_SETUP :
+      case RX_UP    :
+        record_failure(ss, rx, "timed out");
+        update_state(ss, rx, RX_LATE);
+        break;
+    }
+  }
+}
+
 int next_request(struct remote *rx)
 {
   char *ptr;
@@ -384,44 +860,229 @@ int next_request(struct remote *rx)
     return -1;
   }
 
+  gettimeofday(&(rx->r_sent), NULL);
+
   rx->r_match = ptr + 1;
   rx->r_index++;
 
   return 0;
 }
 
-void update_state(struct set *ss, struct remote *rx, int state)
+void process_reply(struct set *ss, struct remote *rx, char *cmd)
 {
-  if(rx->r_state == state){
+  struct katcl_line *k;
+  char *label, *ptr, *parm, *extra;
+  int result;
+
+  k = ss->s_line;
+  label = ss->s_label;
+
+  switch(cmd[1]){
+    case ' '  :
+    case '\n' :
+    case '\r' :
+    case '\t' :
+    case '\\' :
+    case '\0' :
+      log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unreasonable response message from %s", rx->r_name);
+      record_failure(ss, rx, "unreasonable response");
+      update_state(ss, rx, RX_BAD);
+      return;
+  }
+
+  ptr = cmd + 1;
+  if((rx->r_match == NULL) || strcmp(ptr, rx->r_match)){
+    log_message_katcl(k, KATCP_LEVEL_ERROR, label, "downstream %s returned response %s which was never requested", rx->r_name, ptr);
+    record_failure(ss, rx, "unrequested response %s", ptr);
+    update_state(ss, rx, RX_BAD);
     return;
   }
 
-  rx->r_state = state;
+  record_latency(ss, rx);
 
-  switch(state){
-    case RX_BAD : 
-      ss->s_status = 2;
-      ss->s_finished++;
-      break;
+  parm = arg_string_katcl(rx->r_line, 1);
+  if(parm == NULL){
+    log_message_katcl(k, KATCP_LEVEL_ERROR, label, "response %s without status from %s", cmd, rx->r_name);
+    record_code(ss, "none");
+    record_failure(ss, rx, "response %s without status", ptr);
+    update_state(ss, rx, RX_FAIL);
+    return;
+  }
 
-    case RX_FAIL : 
-      ss->s_status = 1;
-      ss->s_finished++;
-      break;
+  record_code(ss, parm);
 
-    case RX_OK : 
-      ss->s_finished++;
-      break;
+  if(strcmp(parm, KATCP_OK) == 0){
+    ss->s_operations++;
+    if(ss->s_munge){
+      log_message_katcl(k, KATCP_LEVEL_INFO, label, "%s %s ok", rx->r_name, ptr);
+    }
+    if(ss->s_verbose > 1){
+      log_message_katcl(k, KATCP_LEVEL_TRACE, label, "request %s to %s returned ok", ptr, rx->r_name);
+    }
+    result = next_request(rx);
+    if(result){
+      if(result < 0){
+        sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to queue request %s to %s", ptr, rx->r_name);
+        record_failure(ss, rx, "unable to queue request after %s", ptr);
+        update_state(ss, rx, RX_BAD);
+      } else {
+        update_state(ss, rx, RX_OK);
+      }
+    }
+    return;
+  }
+
+  extra = arg_string_katcl(rx->r_line, 2);
+  if(ss->s_munge){
+    log_message_katcl(k, KATCP_LEVEL_ERROR, label, "%s %s %s (%s)", rx->r_name, ptr, parm, extra ? extra : "no extra information");
   }
+  if(ss->s_verbose > 0){
+    log_message_katcl(k, KATCP_LEVEL_ERROR, label, "downstream %s unable to process %s with status %s (%s)", rx->r_name, cmd, parm, extra ? extra : "no extra information");
+  }
+  record_failure(ss, rx, "%s %s (%s)", ptr, parm, extra ? extra : "no extra information");
+  update_state(ss, rx, RX_FAIL);
+}
+
+void run_remote(struct set *ss, struct remote *rx, unsigned int events)
+{
+  struct katcl_line *k;
+  char *label, *cmd;
+  int result, code, gone;
+  unsigned int len;
+
+  k = ss->s_line;
+  label = ss->s_label;
+
+  switch(rx->r_state){
+    case RX_SETUP :
+      len = sizeof(int);
+      result = getsockopt(fileno_katcl(rx->r_line), SOL_SOCKET, SO_ERROR, &code, &len);
+      if(result < 0){
+        code = errno;
+      }
+      switch(code){
+        case 0 :
+          if(ss->s_verbose > 1){
+            log_message_katcl(k, KATCP_LEVEL_DEBUG, label, "async connect to %s succeeded", rx->r_name);
+          }
+          if(next_request(rx) < 0){
+            log_message_katcl(k, KATCP_LEVEL_ERROR, label, "failed to load request for destination %s", rx->r_name);
+            record_failure(ss, rx, "unable to load request");
+            update_state(ss, rx, RX_BAD);
+          } else {
+            update_state(ss, rx, RX_UP);
+          }
+          break;
+        case EINPROGRESS :
+          log_message_katcl(k, KATCP_LEVEL_WARN, label, "saw an in progress despite write set being ready on job %s", rx->r_name);
+          break;
+        default :
+          log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to connect to %s: %s", rx->r_name, strerror(code));
+          record_failure(ss, rx, "unable to connect: %s", strerror(code));
+          update_state(ss, rx, RX_BAD);
+          break;
+      }
+      break;
+
+    case RX_UP :
+
+      if(events & EPOLLOUT){ /* flushing things */
+        result = write_katcl(rx->r_line);
+        if(result < 0){
+          log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to write to %s: %s", rx->r_name, strerror(error_katcl(rx->r_line)));
+          record_failure(ss, rx, "write failed: %s", strerror(error_katcl(rx->r_line)));
+          update_state(ss, rx, RX_BAD);
+          return;
+        }
+      }
 
+      gone = 0;
+
+      if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)){ /* get things */
+        result = read_katcl(rx->r_line);
+        if(result){
+          if(result < 0){
+            log_message_katcl(k, KATCP_LEVEL_ERROR, label, "read from %s failed: %s", rx->r_name, strerror(error_katcl(rx->r_line)));
+          } else {
+            log_message_katcl(k, KATCP_LEVEL_WARN, label, "%s disconnected", rx->r_name);
+          }
+          gone = 1;
+        }
+      }
+
+      while((rx->r_state == RX_UP) && (have_katcl(rx->r_line) > 0)){ /* compute */
+
+        cmd = arg_string_katcl(rx->r_line, 0);
+        if(cmd == NULL){
+          continue;
+        }
 #ifdef DEBUG
-  fprintf(stderr, "updated state=%d, status=%d\n", rx->r_state, ss->s_status);
+        fprintf(stderr, "reading message <%s ...>\n", cmd);
 #endif
+        switch(cmd[0]){
+          case KATCP_INFORM :
+            if(ss->s_info){
+              if(ss->s_show == 0){
+                if(!strcmp(KATCP_VERSION_CONNECT_INFORM, cmd)){
+                  break;
+                }
+                if(!strcmp(KATCP_VERSION_INFORM, cmd)){
+                  break;
+                }
+                if(!strcmp(KATCP_BUILD_STATE_INFORM, cmd)){
+                  break;
+                }
+              }
+              relay_katcl(rx->r_line, k);
+            }
+            break;
+          case KATCP_REPLY :
+            process_reply(ss, rx, cmd);
+            break;
+          case KATCP_REQUEST :
+            log_message_katcl(k, KATCP_LEVEL_WARN, label, "encountered unanswerable request %s", cmd);
+            record_failure(ss, rx, "sent request %s", cmd);
+            update_state(ss, rx, RX_BAD);
+            break;
+          default :
+            if(ss->s_once){
+              log_message_katcl(k, KATCP_LEVEL_WARN, label, "read malformed message %s from %s", cmd, rx->r_name);
+              ss->s_once = 0;
+            }
+            break;
+        }
+      }
+
+      if(rx->r_state != RX_UP){
+        return;
+      }
+
+      if(gone){
+        record_failure(ss, rx, "disconnected");
+        update_state(ss, rx, RX_BAD);
+        return;
+      }
+
+      if(watch_remote(ss, rx, EPOLLIN | (flushing_katcl(rx->r_line) ? EPOLLOUT : 0)) < 0){
+        log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to monitor %s: %s", rx->r_name, strerror(errno));
+        record_failure(ss, rx, "unable to monitor");
+        update_state(ss, rx, RX_BAD);
+      }
+      break;
+
+      /* case RX_OK : */
+      /* case RX_FAIL : */
+      /* case RX_BAD  : */
+      /* case RX_LATE : */
+    default :
+      break;
+  }
 }
 
 void usage(char *app)
 {
   printf("usage: %s [flags] [-s server[,server]* -x command args*]*\n", app);
+  printf("-c count           limit connections in progress (default %d)\n", KCPPAR_LIMIT);
   printf("-h                 this help\n");
   printf("-i                 inhibit relaying of downstream inform messages\n");
   printf("-l label           assign log messages a given label\n");
@@ -444,6 +1105,7 @@ void usage(char *app)
 
   printf("notes:\n");
   printf("  command and parameters have to be given as separate arguments\n");
+  printf("  a summary of reply codes, latencies and failures is logged at the end\n");
 }
 
 int main(int argc, char **argv)
@@ -452,33 +1114,29 @@ int main(int argc, char **argv)
   struct remote *rx;
   struct katcl_parse *px;
   struct katcl_line *k;
-  struct timeval delta, start, stop;
-  fd_set fsr, fsw;
+  struct timeval delta, start, stop, now;
+  struct epoll_event events[KCPPAR_EVENTS];
+
+  char *app, *copy, *ptr, *servers, *label;
+  int i, j, c, wait, limit;
+  int verbose, result, status, info, timeout, flags, show, munge;
+  int xmit;
 
-  char *app, *parm, *cmd, *copy, *ptr, *servers, *extra, *label;
-  int i, j, c, fd, mfd, count;
-  int verbose, result, status, info, timeout, flags, show, munge, once;
-  int xmit, code;
-  unsigned int len;
-  
   servers = getenv("KATCP_SERVER");
   if(servers == NULL){
     servers = "localhost:7147";
   }
-  
-  once = 1;
+
   munge = 0;
   info = 1;
   verbose = 1;
   i = j = 1;
   app = argv[0];
   timeout = 0;
+  limit = KCPPAR_LIMIT;
   k = NULL;
   show = 1;
-  parm = NULL;
-  extra = NULL;
   label = KCPPAR_NAME;
-  count = 0;
   px = NULL;
 
   k = create_katcl(STDOUT_FILENO);
@@ -503,32 +1161,33 @@ int main(int argc, char **argv)
         case 'h' :
           usage(app);
           return 0;
-        case 'i' : 
+        case 'i' :
           info = 1 - info;
           j++;
           break;
 
-        case 'm' : 
+        case 'm' :
           munge = 1;
           j++;
           break;
 
-        case 'n' : 
+        case 'n' :
           show = 0;
           j++;
           break;
 
 
-        case 'q' : 
+        case 'q' :
           verbose = 0;
           j++;
           break;
 
-        case 'x' : 
+        case 'x' :
           xmit = 0;
           j++;
           break;
 
+        case 'c' :
         case 'l' :
         case 's' :
         case 't' :
@@ -544,6 +1203,13 @@ int main(int argc, char **argv)
           }
 
           switch(c){
+            case 'c' :
+              limit = atoi(argv[i] + j);
+              if(limit <= 0){
+                sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "connection limit needs to be positive");
+                return 2;
+              }
+              break;
             case 'l' :
               label = argv[i] + j;
               break;
@@ -559,7 +1225,7 @@ int main(int argc, char **argv)
           j = 1;
           break;
 
-        case 'v' : 
+        case 'v' :
           verbose++;
           j++;
           break;
@@ -592,7 +1258,7 @@ int main(int argc, char **argv)
         }
 
         switch(argv[i][0]){
-          case KATCP_REQUEST : 
+          case KATCP_REQUEST :
           case KATCP_REPLY   :
           case KATCP_INFORM  :
             ptr = argv[i];
@@ -646,6 +1312,14 @@ int main(int argc, char **argv)
     }
   }
 
+  ss->s_line = k;
+  ss->s_label = label;
+  ss->s_verbose = verbose;
+  ss->s_info = info;
+  ss->s_show = show;
+  ss->s_munge = munge;
+  ss->s_limit = limit;
+
   if(timeout == 0){
     timeout = 5000 * ss->s_count;
   }
@@ -657,260 +1331,77 @@ int main(int argc, char **argv)
 
   add_time_katcp(&stop, &start, &delta);
 
-  if(activate_remotes(ss, k) < 0){
-    sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to initiate connections to remote servers");
-    return 3;
+  ss->s_efd = epoll_create(KCPPAR_EVENTS);
+  if(ss->s_efd < 0){
+    sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to create epoll instance: %s", strerror(errno));
+    return 4;
   }
 
-  for(ss->s_finished = 0; ss->s_finished < ss->s_count;){
+  status = 0;
 
-    mfd = 0;
-    FD_ZERO(&fsr);
-    FD_ZERO(&fsw);
+  for(ss->s_finished = 0; ss->s_finished < ss->s_count;){
 
-    if(k){
-      if(flushing_katcl(k)){
-        mfd = fileno_katcl(k);
-        FD_SET(mfd, &fsw);
-      }
+    if(activate_remotes(ss) < 0){
+      sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to initiate connections to remote servers");
+      return 3;
     }
 
-    for(i = 0; i < ss->s_count; i++){
-      rx = ss->s_vector[i];
-      if(rx->r_line){
-        fd = fileno_katcl(rx->r_line);
-        if(fd > mfd){
-          mfd = fd;
-        }
-      } else {
-        fd = (-1); /* WARNING: live dangerously */
-      }
-
-      switch(rx->r_state){
-        case RX_SETUP :
-          FD_SET(fd, &fsw);
-          break;
-        case RX_UP :
-          if(flushing_katcl(rx->r_line)){ /* only write data if we have some */
-            FD_SET(fd, &fsw);
-          }
-          FD_SET(fd, &fsr);
-          break;
-          /* case RX_OK : */
-          /* case RX_FAIL : */
-          /* case RX_BAD  : */
-        default :
-          break;
-      }
+    if(flushing_katcl(k)){
+      write_katcl(k); /* WARNING: ignores write failures - unable to do much about it */
     }
 
-    gettimeofday(&start, NULL);
-    sub_time_katcp(&delta, &stop, &start);
-
-    result = select(mfd + 1, &fsr, &fsw, NULL, &delta);
-    switch(result){
-      case -1 :
-        switch(errno){
-          case EAGAIN :
-          case EINTR  :
-            continue; /* WARNING */
-          default  :
-            sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "select failed: %s", strerror(errno));
-            return 4;
-        }
-        break;
-      case  0 :
-        sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "requests timed out after %dms", timeout);
-        /* could terminate cleanly here, but ... */
-        return 3;
+    if(ss->s_finished >= ss->s_count){
+      break;
     }
 
-    if(k){
-      fd = fileno_katcl(k);
-      if(FD_ISSET(fd, &fsw)){
-        write_katcl(k); /* WARNING: ignores write failures - unable to do much about it */
-      }
+    gettimeofday(&now, NULL);
+    if(cmp_time_katcp(&stop, &now) <= 0){
+      log_message_katcl(k, KATCP_LEVEL_ERROR, label, "requests timed out after %dms", timeout);
+      expire_remotes(ss);
+      status = 3;
+      break;
     }
 
-    for(i = 0; i < ss->s_count; i++){
-      rx = ss->s_vector[i];
-      if(rx->r_line){
-        fd = fileno_katcl(rx->r_line);
-      } else {
-        fd = (-1); /* WARNING: live dangerously, will cause select to core dump if logic is incorrect */
+    sub_time_katcp(&delta, &stop, &now);
+    wait = (delta.tv_sec * 1000) + ((delta.tv_usec + 999) / 1000);
+
+    result = epoll_wait(ss->s_efd, events, KCPPAR_EVENTS, wait);
+    if(result < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          continue; /* WARNING */
+        default  :
+          sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "epoll wait failed: %s", strerror(errno));
+          return 4;
       }
+    }
 
-      switch(rx->r_state){
-        case RX_SETUP :
-          if(FD_ISSET(fd, &fsw)){
-            len = sizeof(int);
-            result = getsockopt(fd, SOL_SOCKET, SO_ERROR, &code, &len);
-            if(result == 0){
-              switch(code){
-                case 0 :
-                  if(verbose){
-                    log_message_katcl(k, KATCP_LEVEL_DEBUG, label, "async connect to %s succeeded", rx->r_name);
-                  }
-                  if(next_request(rx) < 0){
-                    log_message_katcl(k, KATCP_LEVEL_ERROR, label, "failed to load request for destination %s", rx->r_name);
-                    update_state(ss, rx, RX_BAD);
-                  } else {
-                    update_state(ss, rx, RX_UP);
-                  }
-                  break;
-                case EINPROGRESS :
-                  log_message_katcl(k, KATCP_LEVEL_WARN, label, "saw an in progress despite write set being ready on job %s", rx->r_name);
-                  break;
-                default :
-                  log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to connect to %s: %s", rx->r_name, strerror(code));
-                  update_state(ss, rx, RX_BAD);
-                  break;
-              }
-            }
-          }
-          break;
-        case RX_UP :
-
-          if(FD_ISSET(fd, &fsw)){ /* flushing things */
-            result = write_katcl(rx->r_line);
-            if(result < 0){
-              log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to write to %s: %s", rx->r_name, strerror(error_katcl(rx->r_line)));
-              update_state(ss, rx, RX_BAD);
-            }
-          }
-
-          if(FD_ISSET(fd, &fsr)){ /* get things */
-            result = read_katcl(rx->r_line);
-            if(result){
-              if(result < 0){
-                log_message_katcl(k, KATCP_LEVEL_ERROR, label, "read from %s failed: %s", rx->r_name, strerror(error_katcl(rx->r_line)));
-              } else {
-                log_message_katcl(k, KATCP_LEVEL_WARN, label, "%s disconnected", rx->r_name);
-              }
-            }
-          }
-
-          while(have_katcl(rx->r_line) > 0){ /* compute */
-
-
-            cmd = arg_string_katcl(rx->r_line, 0);
-            if(cmd){
-#ifdef DEBUG
-              fprintf(stderr, "reading message <%s ...>\n", cmd);
-#endif
-              switch(cmd[0]){
-                case KATCP_INFORM : 
-                  if(info){
-                    if(show == 0){
-                      if(!strcmp(KATCP_VERSION_CONNECT_INFORM, cmd)){
-                        break;
-                      }
-                      if(!strcmp(KATCP_VERSION_INFORM, cmd)){
-                        break;
-                      }
-                      if(!strcmp(KATCP_BUILD_STATE_INFORM, cmd)){
-                        break;
-                      }
-                    }
-                    relay_katcl(rx->r_line, k);
-                  }
-                  break;
-                case KATCP_REPLY : 
-
-                  switch(cmd[1]){
-                    case ' '  :
-                    case '\n' : 
-                    case '\r' :
-                    case '\t' :
-                    case '\\' :
-                    case '\0' :
-                      log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unreasonable response message from %s", rx->r_name);
-                      update_state(ss, rx, RX_BAD);
-                      break;
-                    default : 
-                      ptr = cmd + 1;
-                      if(strcmp(ptr, rx->r_match)){
-                        log_message_katcl(k, KATCP_LEVEL_ERROR, label, "downstream %s returned response %s which was never requested", rx->r_name, ptr);
-                        update_state(ss, rx, RX_BAD);
-                      } else {
-                        parm = arg_string_katcl(rx->r_line, 1);
-                        if(parm){
-                          if(strcmp(parm, KATCP_OK) == 0){
-                            count++;
-                            if(munge){
-                              log_message_katcl(k, KATCP_LEVEL_INFO, label, "%s %s ok", rx->r_name, ptr);
-                            } 
-                            if(verbose > 1){
-                              log_message_katcl(k, KATCP_LEVEL_TRACE, label, "request %s to %s returned ok", ptr, rx->r_name);
-                            }
-                            result = next_request(rx);
-                            if(result){
-                              if(result < 0){
-                                sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to queue request %s to %s", ptr, rx->r_name);
-                                update_state(ss, rx, RX_BAD);
-                              } else {
-                                update_state(ss, rx, RX_OK);
-                              } 
-                            }
-                          } else {
-                            if(munge){
-                              extra = arg_string_katcl(rx->r_line, 2);
-                              log_message_katcl(k, KATCP_LEVEL_ERROR, label, "%s %s %s (%s)", rx->r_name, ptr, parm, extra ? extra : "no extra information");
-                            } 
-                            if(verbose > 0){
-                              log_message_katcl(k, KATCP_LEVEL_ERROR, label, "downstream %s unable to process %s with status %s (%s)", rx->r_name, cmd, parm, extra ? extra : "no extra information");
-                            }
-                            update_state(ss, rx, RX_FAIL);
-                          }
-                        } else {
-                          log_message_katcl(k, KATCP_LEVEL_ERROR, label, "response %s without status from %s", cmd, rx->r_name);
-                          update_state(ss, rx, RX_FAIL);
-                        }
-                      }
-                      break;
-                  }
-                  break;
-                case KATCP_REQUEST : 
-                  log_message_katcl(k, KATCP_LEVEL_WARN, label, "encountered unanswerable request %s", cmd);
-                  update_state(ss, rx, RX_BAD);
-                  break;
-                default :
-                  if(once){
-                    log_message_katcl(k, KATCP_LEVEL_WARN, label, "read malformed message %s from %s", cmd, rx->r_name);
-                    once = 1;
-                  }
-                  break;
-              }
-
-            }
-          }
-          break;
-
-        /* case RX_OK : */
-        /* case RX_FAIL : */
-        /* case RX_BAD : */
-        default :
-          break;
-      }
+    for(c = 0; c < result; c++){
+      rx = events[c].data.ptr;
+      run_remote(ss, rx, events[c].events);
     }
   }
 
-  status = ss->s_status;
-
-  destroy_set(ss);
+  if(status == 0){
+    status = ss->s_status;
+  }
 
   if(verbose){
-    if(status > 0){
-      log_message_katcl(k, KATCP_LEVEL_WARN, label, "command sequence failed after operation %d", count);
+    report_set(ss, &start);
+    if(ss->s_status > 0){
+      log_message_katcl(k, KATCP_LEVEL_WARN, label, "command sequence failed after operation %u", ss->s_operations);
     } else {
-      if(count > 0){
-        log_message_katcl(k, KATCP_LEVEL_INFO, label, "%d operations ok", count);
+      if(ss->s_operations > 0){
+        log_message_katcl(k, KATCP_LEVEL_INFO, label, "%u operations ok", ss->s_operations);
       } else {
         log_message_katcl(k, KATCP_LEVEL_INFO, label, "did nothing successfully");
       }
     }
   }
 
+  destroy_set(ss);
+
   /* flush, allows us to get away with deferring writes to stdout */
   while(write_katcl(k) == 0);
   destroy_katcl(k, 0);
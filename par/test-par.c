@@ -0,0 +1,240 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* runs kcppar against a crowd of loopback listeners: each of the
+ * PORTS ports is reached through many 127.0.0.x addresses, the last
+ * four ports fail requests, stall, close the connection, and refuse
+ * connections, and the summary kcppar logs is checked against that
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include <netc.h>
+#include <katcp.h>
+#include <katpriv.h>
+#include <katcl.h>
+#include <fixture.h>
+
+#define PORTS        100
+#define BASE       21000
+#define GROUP       1000
+#define LINE         256
+
+#define ROLE_OK        0
+#define ROLE_FAIL      1
+#define ROLE_STALL     2
+#define ROLE_CLOSE     3
+#define ROLE_REFUSE    4
+
+/* the last four ports misbehave, each in its own way */
+static int roles[PORTS] = { [PORTS - 4] = ROLE_FAIL, [PORTS - 3] = ROLE_STALL, [PORTS - 2] = ROLE_CLOSE, [PORTS - 1] = ROLE_REFUSE };
+
+static int serve_request(struct katcl_line *l, unsigned int index, void *data)
+{
+  char *name;
+
+  name = arg_string_katcl(l, 0);
+  if((name == NULL) || (name[0] != KATCP_REQUEST)){
+    return 0;
+  }
+
+  switch(roles[index]){
+    case ROLE_OK :
+      log_message_katcl(l, KATCP_LEVEL_INFO, "test", "serving %s", name + 1);
+      append_args_katcl(l, KATCP_FLAG_FIRST, "%c%s", KATCP_REPLY, name + 1);
+      append_string_katcl(l, KATCP_FLAG_LAST, KATCP_OK);
+      break;
+    case ROLE_FAIL :
+      append_args_katcl(l, KATCP_FLAG_FIRST, "%c%s", KATCP_REPLY, name + 1);
+      append_string_katcl(l, 0, KATCP_FAIL);
+      append_string_katcl(l, KATCP_FLAG_LAST, "deliberately");
+      break;
+    case ROLE_CLOSE :
+      return -1;
+  }
+
+  return 0;
+}
+
+static void unescape(char *s)
+{
+  char *in, *out;
+
+  for(in = out = s; *in; in++, out++){
+    if((in[0] == '\\') && (in[1] == '_')){
+      *out = ' ';
+      in++;
+    } else {
+      *out = *in;
+    }
+  }
+  *out = '\0';
+}
+
+int main(int argc, char **argv)
+{
+  int fds[PORTS];
+  unsigned int base, remotes, hosts, h, p, i, groups, arg;
+  char **args, *list, *output, *line, *ptr, expect[LINE];
+  int failures, len, code;
+  unsigned int have;
+  pid_t server;
+  struct rlimit rl;
+  struct timeval start, stop, delta;
+
+  remotes = 10000;
+  if(argc > 1){
+    remotes = atoi(argv[1]);
+  }
+
+  hosts = (remotes + PORTS - 1) / PORTS;
+  if((hosts == 0) || (hosts > 250)){
+    fprintf(stderr, "test: need between 1 and %u remotes\n", 250 * PORTS);
+    return 2;
+  }
+  remotes = hosts * PORTS;
+
+  if(getrlimit(RLIMIT_NOFILE, &rl) == 0){
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  base = BASE + ((getpid() % 80) * PORTS);
+
+  for(p = 0; p < PORTS; p++){
+    fds[p] = (-1);
+    if(roles[p] == ROLE_REFUSE){
+      continue;
+    }
+    /* any address, so that every 127.0.0.x reaches us */
+    fds[p] = net_listen(NULL, base + p, 0);
+    if(fds[p] < 0){
+      fprintf(stderr, "test: unable to listen on port %u: %s\n", base + p, strerror(errno));
+      return 2;
+    }
+    /* the whole crowd connects at once, net_listen keeps only a short backlog */
+    listen(fds[p], SOMAXCONN);
+  }
+
+  server = fork();
+  if(server < 0){
+    return 2;
+  }
+  if(server == 0){
+    freopen("/dev/null", "w", stderr);
+    serve_fixture(fds, PORTS, &serve_request, NULL);
+    exit(1);
+  }
+
+  for(p = 0; p < PORTS; p++){
+    if(fds[p] >= 0){
+      close(fds[p]);
+    }
+  }
+
+  /* one -s list per group keeps each argument well below the kernel limit */
+
+  groups = (remotes + GROUP - 1) / GROUP;
+  args = malloc(sizeof(char *) * (groups * 4 + 8));
+  list = malloc(groups * GROUP * 24);
+  if((args == NULL) || (list == NULL)){
+    return 2;
+  }
+
+  arg = 0;
+  args[arg++] = "./kcppar";
+  args[arg++] = "-i";
+  args[arg++] = "-t";
+  args[arg++] = "3000";
+
+  ptr = list;
+  for(i = 0; i < remotes; i++){
+    h = i / PORTS;
+    p = i % PORTS;
+    if((i % GROUP) == 0){
+      if(i > 0){
+        args[arg++] = "-x";
+        args[arg++] = "watchdog";
+        ptr++;
+      }
+      args[arg++] = "-s";
+      args[arg++] = ptr;
+      ptr[0] = '\0';
+    }
+    len = sprintf(ptr, "%s127.0.0.%u:%u", ((i % GROUP) == 0) ? "" : ",", h + 1, base + p);
+    ptr += len;
+  }
+  args[arg++] = "-x";
+  args[arg++] = "watchdog";
+  args[arg] = NULL;
+
+  gettimeofday(&start, NULL);
+
+  code = run_fixture(args, NULL, &output);
+  if(output == NULL){
+    fprintf(stderr, "test: unable to run %s\n", args[0]);
+    return 2;
+  }
+  have = strlen(output);
+
+  gettimeofday(&stop, NULL);
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+
+  failures = 0;
+
+  for(line = strtok(output, "\n"); line; line = strtok(NULL, "\n")){
+    unescape(line);
+    if(strstr(line, "kcppar summary") || strstr(line, "kcppar replies") || strstr(line, "kcppar latency") || strstr(line, "failure ")){
+      printf("%s\n", line);
+    }
+  }
+
+  /* strtok has split the buffer, look at the lines again */
+  for(ptr = output; ptr < output + have; ptr += strlen(ptr) + 1){
+    if(strstr(ptr, "summary ")){
+      break;
+    }
+  }
+
+  snprintf(expect, LINE, "summary remotes=%u ok=%u failed=%u broken=%u timedout=%u ", remotes, hosts * (PORTS - 4), hosts, hosts * 2, hosts);
+  if((ptr >= output + have) || (strstr(ptr, expect) == NULL)){
+    fprintf(stderr, "test: expected <%s>\n", expect);
+    failures++;
+  }
+
+  for(ptr = output; ptr < output + have; ptr += strlen(ptr) + 1){
+    if(strstr(ptr, "replies ok=")){
+      break;
+    }
+  }
+  snprintf(expect, LINE, "replies ok=%u fail=%u", hosts * (PORTS - 4), hosts);
+  if((ptr >= output + have) || (strstr(ptr, expect) == NULL)){
+    fprintf(stderr, "test: expected <%s>\n", expect);
+    failures++;
+  }
+
+  if(code != 3){
+    fprintf(stderr, "test: expected kcppar to report the stalled remotes with code 3\n");
+    failures++;
+  }
+
+  sub_time_katcp(&delta, &stop, &start);
+
+  printf("test: %u remotes in %lu.%06lus: %s\n", remotes, (unsigned long)delta.tv_sec, (unsigned long)delta.tv_usec, failures ? "FAILED" : "ok");
+
+  return failures ? 1 : 0;
+}
@@ -15,12 +15,25 @@
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include "netc.h"
 #include "katcp.h"
 #include "katcl.h"
 #include "katpriv.h"
 
+#define FRAME_KATCP       0   /* serial side speaks katcp itself */
+#define FRAME_LINE        1   /* newline terminated */
+#define FRAME_LENGTH      2   /* two byte big endian length, then payload */
+#define FRAME_IDLE        3   /* ends once the line has been quiet for a while */
+
+#define RING_SIZE     65536   /* power of two */
+#define FRAME_MAX      8192
+#define IDLE_GAP         20   /* ms */
+
+#define SERIAL_FRAME_INFORM  "#serial-frame"
+#define SERIAL_WRITE_REQUEST "?serial-write"
+
 struct speed_item{
   int x_speed;
   int x_code;
@@ -37,7 +50,427 @@ static struct speed_item speed_table[] = {
   { 0,       B0 } 
 };
 
-static int start_serial(char *device, int speed)
+static char *frame_names[] = { "katcp", "line", "length", "idle", NULL };
+
+struct serial_ring{
+  unsigned char *r_buffer;
+  unsigned int r_size;
+  unsigned int r_head;
+  unsigned int r_count;
+};
+
+struct serial_frame{
+  int f_mode;
+  int f_fd;
+
+  struct serial_ring *f_rx;
+  struct serial_ring *f_tx;
+
+  unsigned int f_scan;
+  unsigned int f_max;
+  unsigned char *f_frame;
+
+  struct timeval f_gap;
+  struct timeval f_first;
+  struct timeval f_last;
+
+  unsigned long f_dropped;
+};
+
+/* ring buffer ******************************************************/
+
+static void destroy_ring(struct serial_ring *r)
+{
+  if(r == NULL){
+    return;
+  }
+
+  if(r->r_buffer){
+    free(r->r_buffer);
+    r->r_buffer = NULL;
+  }
+
+  free(r);
+}
+
+static struct serial_ring *create_ring(unsigned int size)
+{
+  struct serial_ring *r;
+
+  if((size == 0) || (size & (size - 1))){
+    return NULL;
+  }
+
+  r = malloc(sizeof(struct serial_ring));
+  if(r == NULL){
+    return NULL;
+  }
+
+  r->r_size = size;
+  r->r_head = 0;
+  r->r_count = 0;
+
+  r->r_buffer = malloc(size);
+  if(r->r_buffer == NULL){
+    destroy_ring(r);
+    return NULL;
+  }
+
+  return r;
+}
+
+static unsigned int space_ring(struct serial_ring *r)
+{
+  return r->r_size - r->r_count;
+}
+
+static unsigned int peek_ring(struct serial_ring *r, unsigned int offset)
+{
+  return r->r_buffer[(r->r_head + offset) & (r->r_size - 1)];
+}
+
+static void copy_ring(struct serial_ring *r, unsigned char *buffer, unsigned int len)
+{
+  unsigned int first;
+
+  first = r->r_size - r->r_head;
+  if(first >= len){
+    memcpy(buffer, r->r_buffer + r->r_head, len);
+  } else {
+    memcpy(buffer, r->r_buffer + r->r_head, first);
+    memcpy(buffer + first, r->r_buffer, len - first);
+  }
+}
+
+static void consume_ring(struct serial_ring *r, unsigned int len)
+{
+  r->r_head = (r->r_head + len) & (r->r_size - 1);
+  r->r_count -= len;
+
+  if(r->r_count == 0){
+    r->r_head = 0;
+  }
+}
+
+static int put_ring(struct serial_ring *r, unsigned char *buffer, unsigned int len)
+{
+  unsigned int tail, first;
+
+  if(space_ring(r) < len){
+    return -1;
+  }
+
+  tail = (r->r_head + r->r_count) & (r->r_size - 1);
+  first = r->r_size - tail;
+
+  if(first >= len){
+    memcpy(r->r_buffer + tail, buffer, len);
+  } else {
+    memcpy(r->r_buffer + tail, buffer, first);
+    memcpy(r->r_buffer, buffer + first, len - first);
+  }
+
+  r->r_count += len;
+
+  return 0;
+}
+
+/* fills the free space (up to two pieces) in one call, returns bytes read, 0 on nothing, -1 on error or hangup */
+
+static int fill_ring(struct serial_ring *r, int fd)
+{
+  struct iovec iov[2];
+  unsigned int tail, space, count;
+  int rr;
+
+  space = space_ring(r);
+  if(space == 0){
+    return 0;
+  }
+
+  tail = (r->r_head + r->r_count) & (r->r_size - 1);
+
+  iov[0].iov_base = r->r_buffer + tail;
+  if(tail + space > r->r_size){
+    iov[0].iov_len = r->r_size - tail;
+    iov[1].iov_base = r->r_buffer;
+    iov[1].iov_len = space - iov[0].iov_len;
+    count = 2;
+  } else {
+    iov[0].iov_len = space;
+    count = 1;
+  }
+
+  rr = readv(fd, iov, count);
+  if(rr < 0){
+    switch(errno){
+      case EAGAIN :
+      case EINTR  :
+        return 0;
+      default :
+        return -1;
+    }
+  }
+
+  if(rr == 0){
+    return -1;
+  }
+
+  r->r_count += rr;
+
+  return rr;
+}
+
+static int drain_ring(struct serial_ring *r, int fd)
+{
+  struct iovec iov[2];
+  unsigned int count;
+  int wr;
+
+  if(r->r_count == 0){
+    return 0;
+  }
+
+  iov[0].iov_base = r->r_buffer + r->r_head;
+  if(r->r_head + r->r_count > r->r_size){
+    iov[0].iov_len = r->r_size - r->r_head;
+    iov[1].iov_base = r->r_buffer;
+    iov[1].iov_len = r->r_count - iov[0].iov_len;
+    count = 2;
+  } else {
+    iov[0].iov_len = r->r_count;
+    count = 1;
+  }
+
+  wr = writev(fd, iov, count);
+  if(wr < 0){
+    switch(errno){
+      case EAGAIN :
+      case EINTR  :
+        return 0;
+      default :
+        return -1;
+    }
+  }
+
+  consume_ring(r, wr);
+
+  return wr;
+}
+
+/* framing **********************************************************/
+
+static void destroy_frame(struct serial_frame *sf)
+{
+  if(sf == NULL){
+    return;
+  }
+
+  destroy_ring(sf->f_rx);
+  destroy_ring(sf->f_tx);
+
+  if(sf->f_frame){
+    free(sf->f_frame);
+  }
+
+  if(sf->f_fd >= 0){
+    close(sf->f_fd);
+  }
+
+  free(sf);
+}
+
+static struct serial_frame *create_frame(int fd, int mode, unsigned int max, unsigned int gap)
+{
+  struct serial_frame *sf;
+
+  sf = malloc(sizeof(struct serial_frame));
+  if(sf == NULL){
+    return NULL;
+  }
+
+  sf->f_mode = mode;
+  sf->f_fd = fd;
+
+  sf->f_rx = NULL;
+  sf->f_tx = NULL;
+
+  sf->f_scan = 0;
+  sf->f_max = max;
+  sf->f_frame = NULL;
+
+  sf->f_gap.tv_sec = gap / 1000;
+  sf->f_gap.tv_usec = (gap % 1000) * 1000;
+
+  sf->f_dropped = 0;
+
+  sf->f_rx = create_ring(RING_SIZE);
+  sf->f_tx = create_ring(RING_SIZE);
+  sf->f_frame = malloc(max);
+
+  if((sf->f_rx == NULL) || (sf->f_tx == NULL) || (sf->f_frame == NULL) || (max + 2 > RING_SIZE)){
+    sf->f_fd = (-1); /* caller still owns it */
+    destroy_frame(sf);
+    return NULL;
+  }
+
+  return sf;
+}
+
+/* reads whatever the serial port has, noting when it arrived */
+
+static int read_frame(struct serial_frame *sf, struct timeval *now)
+{
+  unsigned int before;
+  int result;
+
+  before = sf->f_rx->r_count;
+
+  result = fill_ring(sf->f_rx, sf->f_fd);
+  if(result <= 0){
+    return result;
+  }
+
+  if(before == 0){
+    sf->f_first.tv_sec = now->tv_sec;
+    sf->f_first.tv_usec = now->tv_usec;
+  }
+
+  sf->f_last.tv_sec = now->tv_sec;
+  sf->f_last.tv_usec = now->tv_usec;
+
+  return result;
+}
+
+/* returns the length of the next complete frame (copied to f_frame, time of receipt in stamp), or -1 if there is none yet */
+
+static int next_frame(struct serial_frame *sf, struct timeval *now, struct timeval *stamp)
+{
+  struct serial_ring *r;
+  struct timeval quiet;
+  unsigned int i, len, skip, limit;
+
+  r = sf->f_rx;
+  skip = 0;
+
+  switch(sf->f_mode){
+    case FRAME_LINE :
+      limit = (r->r_count < sf->f_max) ? r->r_count : sf->f_max;
+      for(i = sf->f_scan; (i < limit) && (peek_ring(r, i) != '\n'); i++);
+      if(i < limit){
+        len = i;
+        skip = 1;
+      } else if(i >= sf->f_max){ /* overlong line, hand it on in pieces */
+        len = sf->f_max;
+      } else {
+        sf->f_scan = i;
+        return -1;
+      }
+      break;
+
+    case FRAME_LENGTH :
+      while(r->r_count >= 2){
+        len = (peek_ring(r, 0) << 8) | peek_ring(r, 1);
+        if(len <= sf->f_max){
+          break;
+        }
+        /* not something we can ever deliver, resynchronise a byte later */
+        consume_ring(r, 1);
+        sf->f_dropped++;
+      }
+      if((r->r_count < 2) || (r->r_count < (2 + len))){
+        return -1;
+      }
+      consume_ring(r, 2);
+      break;
+
+    case FRAME_IDLE :
+      if(r->r_count == 0){
+        return -1;
+      }
+      if(r->r_count < sf->f_max){
+        add_time_katcp(&quiet, &(sf->f_last), &(sf->f_gap));
+        if(cmp_time_katcp(now, &quiet) < 0){
+          return -1;
+        }
+        len = r->r_count;
+      } else {
+        len = sf->f_max;
+      }
+      break;
+
+    default :
+      return -1;
+  }
+
+  copy_ring(r, sf->f_frame, len);
+  consume_ring(r, len + skip);
+
+  stamp->tv_sec = sf->f_first.tv_sec;
+  stamp->tv_usec = sf->f_first.tv_usec;
+
+  if(r->r_count > 0){ /* the rest came in with the most recent read */
+    sf->f_first.tv_sec = sf->f_last.tv_sec;
+    sf->f_first.tv_usec = sf->f_last.tv_usec;
+  }
+
+  if((sf->f_mode == FRAME_LINE) && (len > 0) && (sf->f_frame[len - 1] == '\r')){
+    len--;
+  }
+
+  sf->f_scan = 0;
+
+  return len;
+}
+
+/* how long until the idle framer has to look at the line again */
+
+static int wait_frame(struct serial_frame *sf, struct timeval *now, struct timeval *delta)
+{
+  struct timeval quiet;
+
+  if((sf->f_mode != FRAME_IDLE) || (sf->f_rx->r_count == 0)){
+    return 0;
+  }
+
+  add_time_katcp(&quiet, &(sf->f_last), &(sf->f_gap));
+  if(sub_time_katcp(delta, &quiet, now) < 0){
+    delta->tv_sec = 0;
+    delta->tv_usec = 0;
+  }
+
+  return 1;
+}
+
+static int queue_frame(struct serial_frame *sf, unsigned char *buffer, unsigned int len)
+{
+  unsigned char prefix[2];
+
+  switch(sf->f_mode){
+    case FRAME_LINE :
+      if(space_ring(sf->f_tx) < (len + 1)){
+        return -1;
+      }
+      put_ring(sf->f_tx, buffer, len);
+      put_ring(sf->f_tx, (unsigned char *)"\n", 1);
+      return 0;
+
+    case FRAME_LENGTH :
+      if((len > 0xffff) || (space_ring(sf->f_tx) < (len + 2))){
+        return -1;
+      }
+      prefix[0] = (len >> 8) & 0xff;
+      prefix[1] = len & 0xff;
+      put_ring(sf->f_tx, prefix, 2);
+      put_ring(sf->f_tx, buffer, len);
+      return 0;
+
+    default :
+      return put_ring(sf->f_tx, buffer, len);
+  }
+}
+
+static int start_serial(char *device, int speed, int raw)
 {
   struct termios tio;
   int i, code;
@@ -57,7 +490,11 @@ static int start_serial(char *device, int speed)
   tio.c_cc[VTIME] = 0;
 
   tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IXOFF | IXON);
-  tio.c_iflag |= (IGNCR | ICRNL);
+  if(raw){ /* framing sees every byte */
+    tio.c_iflag &= ~(IGNCR | ICRNL);
+  } else {
+    tio.c_iflag |= (IGNCR | ICRNL);
+  }
 
 #if 0
   tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR);
@@ -101,15 +538,58 @@ static int start_serial(char *device, int speed)
 
 void usage(char *label, struct katcl_line *k)
 {
-  sync_message_katcl(k, KATCP_LEVEL_INFO, label, "serial-device [port [serial-speed]]");
+  sync_message_katcl(k, KATCP_LEVEL_INFO, label, "[-f katcp|line|length|idle] [-g idle-ms] [-m max-frame] serial-device [port [serial-speed]]");
+}
+
+static void emit_frame(struct katcl_line *nk, struct serial_frame *sf, unsigned int len, struct timeval *stamp)
+{
+  append_string_katcl(nk, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, SERIAL_FRAME_INFORM);
+  append_args_katcl(nk, KATCP_FLAG_STRING, "%lu.%03lu", (unsigned long)stamp->tv_sec, (unsigned long)(stamp->tv_usec / 1000));
+  append_buffer_katcl(nk, KATCP_FLAG_LAST | KATCP_FLAG_BUFFER, sf->f_frame, len);
+}
+
+static void handle_request(struct katcl_line *nk, struct serial_frame *sf)
+{
+  char *name;
+  int len;
+
+  name = arg_string_katcl(nk, 0);
+  if((name == NULL) || (name[0] != KATCP_REQUEST)){
+    return;
+  }
+
+  if(strcmp(name, SERIAL_WRITE_REQUEST)){
+    extra_response_katcl(nk, KATCP_RESULT_FAIL, "only %s supported in %s framing", SERIAL_WRITE_REQUEST, frame_names[sf->f_mode]);
+    return;
+  }
+
+  if(arg_count_katcl(nk) < 2){
+    extra_response_katcl(nk, KATCP_RESULT_INVALID, "need a payload");
+    return;
+  }
+
+  len = arg_buffer_katcl(nk, 1, sf->f_frame, sf->f_max);
+  if((len < 0) || (len > sf->f_max)){
+    extra_response_katcl(nk, KATCP_RESULT_FAIL, "need a payload of at most %u bytes", sf->f_max);
+    return;
+  }
+
+  if(queue_frame(sf, sf->f_frame, len) < 0){
+    extra_response_katcl(nk, KATCP_RESULT_FAIL, "serial output backed up");
+    return;
+  }
+
+  extra_response_katcl(nk, KATCP_RESULT_OK, NULL);
 }
 
 int main(int argc, char **argv)
 {
   char *net, *serial, *label;
-  int i, j, c, lfd, run, fd, mfd, result, count, speed;
+  int i, j, c, lfd, run, fd, mfd, result, count, speed, mode, gap, max, len;
   struct katcl_line *sk, *nk, *k;
+  struct serial_frame *sf;
   struct katcl_parse *p;
+  struct timeval now, delta, stamp;
   fd_set fsr, fsw;
   
   label = "katcp-serial-gateway";
@@ -121,12 +601,17 @@ int main(int argc, char **argv)
   }
   sk = NULL;
   nk = NULL;
+  sf = NULL;
 
   speed = 0;
   serial = NULL;
   net = NULL;
   count = 0;
 
+  mode = FRAME_KATCP;
+  gap = IDLE_GAP;
+  max = FRAME_MAX;
+
   i = j = 1;
   while (i < argc) {
     if (argv[i][0] == '-') {
@@ -138,6 +623,10 @@ int main(int argc, char **argv)
           return 0;
 
         case 'b' :
+        case 'f' :
+        case 'g' :
+        case 'm' :
+        case 'p' :
         case 's' :
 
           j++;
@@ -164,8 +653,33 @@ int main(int argc, char **argv)
             case 's' :
               serial = argv[i] + j;
               break;
+            case 'f' :
+              for(mode = 0; frame_names[mode] && strcmp(frame_names[mode], argv[i] + j); mode++);
+              if(frame_names[mode] == NULL){
+                sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unknown framing %s", argv[i] + j);
+                return 2;
+              }
+              break;
+            case 'g' :
+              gap = atoi(argv[i] + j);
+              if(gap <= 0){
+                sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "idle gap %s unreasonable", argv[i] + j);
+                return 2;
+              }
+              break;
+            case 'm' :
+              max = atoi(argv[i] + j);
+              if((max <= 0) || (max > 0xffff)){
+                sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "frame size %s unreasonable", argv[i] + j);
+                return 2;
+              }
+              break;
           }
 
+          i++;
+          j = 1;
+          break;
+
         case '-' :
           j++;
           break;
@@ -206,20 +720,29 @@ int main(int argc, char **argv)
 #if 0
   fd = open(serial, O_RDWR | O_NOCTTY);
 #endif
-  fd = start_serial(serial, speed);
+  fd = start_serial(serial, speed, mode != FRAME_KATCP);
   if(fd < 0){
     sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to open serial device %s: %s", serial, strerror(errno));
     return 3;
   }
-  sk = create_katcl(fd);
-  if(sk == NULL){
-    sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to run katcp wrapper on serial file descriptor");
-    return 4;
+
+  if(mode == FRAME_KATCP){
+    sk = create_katcl(fd);
+    if(sk == NULL){
+      sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to run katcp wrapper on serial file descriptor");
+      return 4;
+    }
+  } else {
+    sf = create_frame(fd, mode, max, gap);
+    if(sf == NULL){
+      sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to set up %s framing on serial file descriptor", frame_names[mode]);
+      return 4;
+    }
   }
 
   lfd = net_listen(net, 0, 0);
   if(lfd < 0){
-    sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unknown option -%c", argv[i][j]);
+    sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to listen on %s", net ? net : "default port");
     return 3;
   }
 
@@ -263,7 +786,21 @@ int main(int argc, char **argv)
       }
     }
 
-    result = select(mfd + 1, &fsr, &fsw, NULL, NULL);
+    if(sf){
+      fd = sf->f_fd;
+      if(sf->f_tx->r_count > 0){
+        FD_SET(fd, &fsw);
+      }
+      if(space_ring(sf->f_rx) > 0){
+        FD_SET(fd, &fsr);
+      }
+      if(mfd < fd){
+        mfd = fd;
+      }
+      gettimeofday(&now, NULL);
+    }
+
+    result = select(mfd + 1, &fsr, &fsw, NULL, (sf && wait_frame(sf, &now, &delta)) ? &delta : NULL);
     switch(result){
       case -1 :
         switch(errno){
@@ -290,6 +827,37 @@ int main(int argc, char **argv)
       }
     }
 
+    if(sf){ /* serial side first, so that frames carry the time closest to their arrival */
+      gettimeofday(&now, NULL);
+
+      if(FD_ISSET(sf->f_fd, &fsr)){
+        if(read_frame(sf, &now) < 0){
+          log_message_katcl(k, KATCP_LEVEL_WARN, label, "serial port %s hung up or failed", serial);
+          run = 0;
+        }
+      }
+
+      while((len = next_frame(sf, &now, &stamp)) >= 0){
+        if(nk){
+          emit_frame(nk, sf, len, &stamp);
+        } else {
+          count++;
+        }
+      }
+
+      if(sf->f_dropped > 0){
+        log_message_katcl(nk ? nk : k, KATCP_LEVEL_WARN, label, "discarded %lu bytes with unreasonable frame lengths", sf->f_dropped);
+        sf->f_dropped = 0;
+      }
+
+      if(FD_ISSET(sf->f_fd, &fsw)){
+        if(drain_ring(sf->f_tx, sf->f_fd) < 0){
+          log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to write to serial port %s: %s", serial, strerror(errno));
+          run = 0;
+        }
+      }
+    }
+
     if(nk){
       fd = fileno_katcl(nk);
 
@@ -317,28 +885,34 @@ int main(int argc, char **argv)
         }
 
         while(have_katcl(nk) > 0){
-          p = ready_katcl(nk);
-          if(p){
-            append_parse_katcl(sk, p);
+          if(sf){
+            handle_request(nk, sf);
+          } else {
+            p = ready_katcl(nk);
+            if(p){
+              append_parse_katcl(sk, p);
+            }
           }
         }
       }
-    } else {
+    } else if(FD_ISSET(lfd, &fsr)){
       /* TODO: should report an address */
       fd = accept(lfd, NULL, NULL);
       if(fd < 0){
-        log_message_katcl(k, KATCP_LEVEL_ERROR, label, "network accept failed: %s", strerror(error_katcl(nk)));
+        log_message_katcl(k, KATCP_LEVEL_ERROR, label, "network accept failed: %s", strerror(errno));
+        continue;
       }
       nk = create_katcl(fd);
       if(nk == NULL){
         log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to encapsulate network file descriptor");
         close(fd);
+        continue;
       }
       if(count > 0){
         log_message_katcl(nk, KATCP_LEVEL_WARN, label, "discarded %u messages while no client was connected", count);
         count = 0;
       }
-      log_message_katcl(nk, KATCP_LEVEL_DEBUG, label, "connected to %s at speed %d", serial, speed);
+      log_message_katcl(nk, KATCP_LEVEL_DEBUG, label, "connected to %s at speed %d using %s framing", serial, speed, frame_names[mode]);
     }
 
     if(sk){
@@ -368,7 +942,7 @@ int main(int argc, char **argv)
           sk = NULL;
           run = 0;
         }
-        while(have_katcl(sk) > 0){
+        while(sk && (have_katcl(sk) > 0)){
           p = ready_katcl(sk);
           if(p){
             if(nk){
@@ -385,6 +959,7 @@ int main(int argc, char **argv)
   }
 
   if(nk){
+    while(write_katcl(nk) == 0);
     destroy_katcl(nk, 1);
     nk = NULL;
   }
@@ -394,6 +969,11 @@ int main(int argc, char **argv)
     sk = NULL;
   }
 
+  if(sf){
+    destroy_frame(sf);
+    sf = NULL;
+  }
+
   if(lfd >= 0){
     close(lfd);
   }
@@ -0,0 +1,454 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* runs kcpsgw on the slave side of a pseudo terminal and plays the
+ * serial device on the master side. For each framing mode it sends
+ * bursts, split frames and pauses, checking that every frame arrives
+ * whole in a single inform, with timestamps which reflect the pauses,
+ * and that ?serial-write reaches the device framed the same way
+ */
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <termios.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#include <netc.h>
+#include <katcp.h>
+#include <katpriv.h>
+#include <katcl.h>
+
+#define FRAMES     4096
+#define LINE      65536
+#define BURST      2000
+#define BINARY     5000
+
+struct frame{
+  double f_stamp;
+  unsigned int f_len;
+  unsigned char *f_data;
+};
+
+struct gateway{
+  pid_t g_pid;
+  int g_master;
+  struct katcl_line *g_line;
+};
+
+static void stop_gateway(struct gateway *g)
+{
+  if(g->g_line){
+    destroy_katcl(g->g_line, 1);
+  }
+  kill(g->g_pid, SIGTERM);
+  waitpid(g->g_pid, NULL, 0);
+  close(g->g_master);
+}
+
+static int start_gateway(struct gateway *g, char *mode, char *gap)
+{
+  char port[16], *slave, *text;
+  int i, fd, devnull;
+
+  g->g_line = NULL;
+
+  g->g_master = posix_openpt(O_RDWR | O_NOCTTY);
+  if((g->g_master < 0) || grantpt(g->g_master) || unlockpt(g->g_master)){
+    return -1;
+  }
+
+  slave = ptsname(g->g_master);
+  if(slave == NULL){
+    return -1;
+  }
+
+  snprintf(port, sizeof(port), "%d", 20000 + (getpid() % 20000));
+
+  g->g_pid = fork();
+  if(g->g_pid < 0){
+    return -1;
+  }
+  if(g->g_pid == 0){
+    devnull = open("/dev/null", O_RDWR);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    close(g->g_master);
+    if(gap){
+      execl("./kcpsgw", "./kcpsgw", "-f", mode, "-g", gap, "-p", port, slave, NULL);
+    } else {
+      execl("./kcpsgw", "./kcpsgw", "-f", mode, "-p", port, slave, NULL);
+    }
+    exit(4);
+  }
+
+  fd = (-1);
+  for(i = 0; (i < 50) && (fd < 0); i++){
+    usleep(50000);
+    fd = net_connect("localhost", atoi(port), 0);
+  }
+  if(fd < 0){
+    return -1;
+  }
+
+  g->g_line = create_katcl(fd);
+  if(g->g_line == NULL){
+    close(fd);
+    return -1;
+  }
+
+  /* serial data only gets relayed once the client has been accepted */
+  while(read_katcl(g->g_line) == 0){
+    while(have_katcl(g->g_line) > 0){
+      text = arg_string_katcl(g->g_line, 4);
+      if(text && !strncmp(text, "connected", 9)){
+        return 0;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/* collects #serial-frame informs and the reply code, until count frames or the timeout */
+
+static unsigned int collect(struct gateway *g, struct frame *frames, unsigned int count, unsigned int ms, char *reply, unsigned int size)
+{
+  struct timeval tv, now, stop;
+  struct katcl_line *l;
+  unsigned int got;
+  char *name, *code;
+  fd_set fsr;
+  int fd;
+
+  l = g->g_line;
+  fd = fileno_katcl(l);
+  got = 0;
+
+  gettimeofday(&now, NULL);
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  add_time_katcp(&stop, &now, &tv);
+
+  for(;;){
+    while(have_katcl(l) > 0){
+      name = arg_string_katcl(l, 0);
+      if(name == NULL){
+        continue;
+      }
+      if(!strcmp(name, "#serial-frame") && (got < count)){
+        frames[got].f_stamp = arg_double_katcl(l, 1);
+        frames[got].f_data = malloc(LINE);
+        frames[got].f_len = arg_buffer_katcl(l, 2, frames[got].f_data, LINE);
+        got++;
+      } else if((name[0] == KATCP_REPLY) && reply){
+        code = arg_string_katcl(l, 1);
+        snprintf(reply, size, "%s %s", name, code ? code : "");
+      }
+    }
+
+    if((got >= count) && ((reply == NULL) || reply[0])){
+      return got;
+    }
+
+    gettimeofday(&now, NULL);
+    if(sub_time_katcp(&tv, &stop, &now) < 0){
+      return got;
+    }
+
+    FD_ZERO(&fsr);
+    FD_SET(fd, &fsr);
+
+    if(select(fd + 1, &fsr, NULL, NULL, &tv) <= 0){
+      continue;
+    }
+
+    if(read_katcl(l)){
+      return got;
+    }
+  }
+}
+
+static void release(struct frame *frames, unsigned int count)
+{
+  unsigned int i;
+
+  for(i = 0; i < count; i++){
+    free(frames[i].f_data);
+  }
+}
+
+static int device_read(struct gateway *g, unsigned char *buffer, unsigned int want)
+{
+  struct timeval tv;
+  unsigned int have;
+  fd_set fsr;
+  int rr;
+
+  for(have = 0; have < want; have += rr){
+    FD_ZERO(&fsr);
+    FD_SET(g->g_master, &fsr);
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    if(select(g->g_master + 1, &fsr, NULL, NULL, &tv) <= 0){
+      break;
+    }
+    rr = read(g->g_master, buffer + have, want - have);
+    if(rr <= 0){
+      break;
+    }
+  }
+
+  return have;
+}
+
+static int device_write(struct gateway *g, void *buffer, unsigned int len)
+{
+  return (write(g->g_master, buffer, len) == len) ? 0 : -1;
+}
+
+static int serial_write(struct gateway *g, char *text)
+{
+  send_katcl(g->g_line, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?serial-write", KATCP_FLAG_LAST | KATCP_FLAG_STRING, text, NULL);
+
+  return (write_katcl(g->g_line) > 0) ? 0 : -1;
+}
+
+static int test_line(struct frame *frames)
+{
+  struct gateway g;
+  char *burst, reply[256], expect[32];
+  unsigned char device[64];
+  unsigned int i, got, len, ordered;
+  int failures;
+
+  failures = 0;
+
+  if(start_gateway(&g, "line", NULL) < 0){
+    fprintf(stderr, "test: unable to start line gateway\n");
+    return 1;
+  }
+
+  burst = malloc(BURST * 16 + 32);
+  len = sprintf(burst, "alpha\r\nbeta\n");
+  for(i = 0; i < BURST; i++){
+    len += sprintf(burst + len, "line %04u\n", i);
+  }
+
+  device_write(&g, burst, len);
+  got = collect(&g, frames, BURST + 2, 3000, NULL, 0);
+
+  printf("test: line burst of %u bytes gave %u frames\n", len, got);
+
+  if(got != BURST + 2){
+    fprintf(stderr, "test: expected one frame per line in a burst\n");
+    failures++;
+  }
+  if((got < 2) || (frames[0].f_len != 5) || memcmp(frames[0].f_data, "alpha", 5) || (frames[1].f_len != 4) || memcmp(frames[1].f_data, "beta", 4)){
+    fprintf(stderr, "test: first lines not whole or carriage return kept\n");
+    failures++;
+  }
+
+  ordered = 1;
+  for(i = 0; (i < BURST) && (i + 2 < got); i++){
+    snprintf(expect, sizeof(expect), "line %04u", i);
+    if((frames[i + 2].f_len != strlen(expect)) || memcmp(frames[i + 2].f_data, expect, frames[i + 2].f_len)){
+      ordered = 0;
+    }
+  }
+  if(ordered == 0){
+    fprintf(stderr, "test: burst lines damaged or out of order\n");
+    failures++;
+  }
+  release(frames, got);
+
+  device_write(&g, "gam", 3);
+  usleep(100000);
+  device_write(&g, "ma\n", 3);
+  usleep(200000);
+  device_write(&g, "delta\n", 6);
+
+  got = collect(&g, frames, 2, 2000, NULL, 0);
+  if((got != 2) || (frames[0].f_len != 5) || memcmp(frames[0].f_data, "gamma", 5)){
+    fprintf(stderr, "test: split line did not arrive as one frame\n");
+    failures++;
+  } else {
+    printf("test: frames stamped %.3fs apart after a 0.3s pause\n", frames[1].f_stamp - frames[0].f_stamp);
+    if((frames[1].f_stamp - frames[0].f_stamp) < 0.25){
+      fprintf(stderr, "test: timestamp not taken at the first byte of a frame\n");
+      failures++;
+    }
+  }
+  release(frames, got);
+
+  reply[0] = '\0';
+  serial_write(&g, "hello there");
+  collect(&g, frames, 0, 1000, reply, sizeof(reply));
+  if(strcmp(reply, "!serial-write ok")){
+    fprintf(stderr, "test: serial write answered with <%s>\n", reply);
+    failures++;
+  }
+  if((device_read(&g, device, 12) != 12) || memcmp(device, "hello there\n", 12)){
+    fprintf(stderr, "test: serial write not terminated by a newline\n");
+    failures++;
+  }
+
+  reply[0] = '\0';
+  send_katcl(g.g_line, KATCP_FLAG_FIRST | KATCP_FLAG_LAST | KATCP_FLAG_STRING, "?watchdog", NULL);
+  write_katcl(g.g_line);
+  collect(&g, frames, 0, 1000, reply, sizeof(reply));
+  if(strcmp(reply, "!watchdog fail")){
+    fprintf(stderr, "test: other requests answered with <%s>\n", reply);
+    failures++;
+  }
+
+  stop_gateway(&g);
+  free(burst);
+
+  return failures;
+}
+
+static int test_length(struct frame *frames)
+{
+  struct gateway g;
+  unsigned char *binary, device[16], pair[12];
+  char reply[256];
+  unsigned int i, got;
+  int failures;
+
+  failures = 0;
+
+  if(start_gateway(&g, "length", NULL) < 0){
+    fprintf(stderr, "test: unable to start length gateway\n");
+    return 1;
+  }
+
+  binary = malloc(BINARY + 2);
+  binary[0] = (BINARY >> 8) & 0xff;
+  binary[1] = BINARY & 0xff;
+  for(i = 0; i < BINARY; i++){
+    binary[i + 2] = (i * 7) & 0xff;
+  }
+
+  device_write(&g, binary, 1000);
+  usleep(30000);
+  device_write(&g, binary + 1000, 3000);
+  usleep(30000);
+  device_write(&g, binary + 4000, BINARY + 2 - 4000);
+
+  got = collect(&g, frames, 1, 2000, NULL, 0);
+  printf("test: %u byte binary frame in three pieces gave %u frames\n", BINARY, got);
+  if((got != 1) || (frames[0].f_len != BINARY) || memcmp(frames[0].f_data, binary + 2, BINARY)){
+    fprintf(stderr, "test: binary frame not whole and exact\n");
+    failures++;
+  }
+  release(frames, got);
+
+  memcpy(pair, "\x00\x03one\x00\x05three", 12);
+  device_write(&g, pair, 12);
+  got = collect(&g, frames, 2, 2000, NULL, 0);
+  if((got != 2) || (frames[0].f_len != 3) || (frames[1].f_len != 5) || memcmp(frames[1].f_data, "three", 5)){
+    fprintf(stderr, "test: back to back frames not separated\n");
+    failures++;
+  }
+  release(frames, got);
+
+  reply[0] = '\0';
+  serial_write(&g, "a b");
+  collect(&g, frames, 0, 1000, reply, sizeof(reply));
+  if(strcmp(reply, "!serial-write ok")){
+    fprintf(stderr, "test: serial write answered with <%s>\n", reply);
+    failures++;
+  }
+  if((device_read(&g, device, 5) != 5) || memcmp(device, "\x00\x03" "a b", 5)){
+    fprintf(stderr, "test: serial write not length prefixed\n");
+    failures++;
+  }
+
+  stop_gateway(&g);
+  free(binary);
+
+  return failures;
+}
+
+static int test_idle(struct frame *frames)
+{
+  struct gateway g;
+  unsigned int got;
+  int failures;
+
+  failures = 0;
+
+  if(start_gateway(&g, "idle", "50") < 0){
+    fprintf(stderr, "test: unable to start idle gateway\n");
+    return 1;
+  }
+
+  device_write(&g, "abc", 3);
+  usleep(10000);
+  device_write(&g, "def", 3);
+  usleep(200000);
+  device_write(&g, "ghi", 3);
+
+  got = collect(&g, frames, 2, 2000, NULL, 0);
+  if((got != 2) || (frames[0].f_len != 6) || memcmp(frames[0].f_data, "abcdef", 6)){
+    fprintf(stderr, "test: short pause ended a frame\n");
+    failures++;
+  }
+  if((got != 2) || (frames[1].f_len != 3) || memcmp(frames[1].f_data, "ghi", 3)){
+    fprintf(stderr, "test: long pause did not end a frame\n");
+    failures++;
+  }
+  if(got == 2){
+    printf("test: idle frames stamped %.3fs apart\n", frames[1].f_stamp - frames[0].f_stamp);
+    if((frames[1].f_stamp - frames[0].f_stamp) < 0.15){
+      fprintf(stderr, "test: idle frame timestamps do not reflect the pause\n");
+      failures++;
+    }
+  }
+  release(frames, got);
+
+  stop_gateway(&g);
+
+  return failures;
+}
+
+int main(int argc, char **argv)
+{
+  struct frame *frames;
+  int failures;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  frames = malloc(sizeof(struct frame) * FRAMES);
+  if(frames == NULL){
+    return 2;
+  }
+
+  failures = 0;
+
+  failures += test_line(frames);
+  failures += test_length(frames);
+  failures += test_idle(frames);
+
+  free(frames);
+
+  if(failures){
+    printf("test: %d failures\n", failures);
+    return 1;
+  }
+
+  printf("test: ok\n");
+
+  return 0;
+}
@@ -78,21 +78,360 @@ struct katcl_line *initiate_connection(char *server, int verbose)
   return l;
 }
 
-int issue_request(struct katcl_line *l, char *sensor, int verbose)
+/* conditions ***********************************************************/
+
+#define TERM_STATUS    0
+#define TERM_LESS      1
+#define TERM_MOST      2
+#define TERM_MORE      3
+#define TERM_LEAST     4
+#define TERM_EQUAL     5
+#define TERM_DIFFER    6
+
+struct sq_sensor{
+  char *s_name;
+  int s_status;
+  char *s_value;
+};
+
+struct sq_term{
+  char *t_text;
+  unsigned int t_sensor;
+  int t_kind;
+  int t_default;
+  unsigned short t_success[KATCP_STATA_COUNT];
+  char *t_operand;
+  unsigned int t_clause;
+};
+
+struct sq_condition{
+  struct sq_sensor *c_sensors;
+  unsigned int c_count;
+
+  struct sq_term *c_terms;
+  unsigned int c_size;
+
+  unsigned int c_clauses;
+  int c_join;
+};
+
+int add_sensor_condition(struct sq_condition *c, char *name, unsigned int len)
 {
-  /* TODO: could check returns */
-  append_string_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?sensor-sampling");
-  append_string_katcl(l, KATCP_FLAG_STRING, sensor);
-  append_string_katcl(l, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "event");
+  struct sq_sensor *tmp;
+  unsigned int i;
+
+  for(i = 0; i < c->c_count; i++){
+    if((strlen(c->c_sensors[i].s_name) == len) && !strncmp(c->c_sensors[i].s_name, name, len)){
+      return i;
+    }
+  }
+
+  tmp = realloc(c->c_sensors, sizeof(struct sq_sensor) * (c->c_count + 1));
+  if(tmp == NULL){
+    return -1;
+  }
+  c->c_sensors = tmp;
+
+  tmp[c->c_count].s_name = malloc(len + 1);
+  if(tmp[c->c_count].s_name == NULL){
+    return -1;
+  }
+  memcpy(tmp[c->c_count].s_name, name, len);
+  tmp[c->c_count].s_name[len] = '\0';
+
+  tmp[c->c_count].s_status = (-1);
+  tmp[c->c_count].s_value = NULL;
+
+  return c->c_count++;
+}
+
+int status_code(char *name, unsigned int len)
+{
+  int i;
+
+  for(i = 0; i < KATCP_STATA_COUNT; i++){
+    if((strlen(sensor_status_names[i]) == len) && !strncmp(sensor_status_names[i], name, len)){
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* terms are "sensor", "sensor=status[,status]*", or a comparison of
+ * the sensor value with "<", "<=", ">", ">=", "==" or "!=" */
+
+int add_term_condition(struct sq_condition *c, char *text)
+{
+  struct sq_term *tmp, *t;
+  unsigned int len, i, j;
+  int sensor, code;
+  char *end;
+
+  len = strcspn(text, "<>=!");
+  if(len == 0){
+    fprintf(stderr, "%s: term %s needs a sensor name\n", NAME, text);
+    return -1;
+  }
+
+  sensor = add_sensor_condition(c, text, len);
+  if(sensor < 0){
+    return -1;
+  }
+
+  tmp = realloc(c->c_terms, sizeof(struct sq_term) * (c->c_size + 1));
+  if(tmp == NULL){
+    return -1;
+  }
+  c->c_terms = tmp;
+
+  t = &(c->c_terms[c->c_size]);
+
+  t->t_text = text;
+  t->t_sensor = sensor;
+  t->t_kind = TERM_STATUS;
+  t->t_default = 0;
+  t->t_operand = NULL;
+  t->t_clause = c->c_clauses - 1;
+  for(i = 0; i < KATCP_STATA_COUNT; i++){
+    t->t_success[i] = 0;
+  }
+
+  end = text + len;
+
+  if(end[0] == '\0'){
+    t->t_default = 1;
+  } else if(!strncmp(end, "<=", 2)){
+    t->t_kind = TERM_MOST;
+    t->t_operand = end + 2;
+  } else if(!strncmp(end, ">=", 2)){
+    t->t_kind = TERM_LEAST;
+    t->t_operand = end + 2;
+  } else if(!strncmp(end, "==", 2)){
+    t->t_kind = TERM_EQUAL;
+    t->t_operand = end + 2;
+  } else if(!strncmp(end, "!=", 2)){
+    t->t_kind = TERM_DIFFER;
+    t->t_operand = end + 2;
+  } else if(end[0] == '<'){
+    t->t_kind = TERM_LESS;
+    t->t_operand = end + 1;
+  } else if(end[0] == '>'){
+    t->t_kind = TERM_MORE;
+    t->t_operand = end + 1;
+  } else if(end[0] == '='){
+    for(i = 1; end[i - 1] != '\0'; i += j + 1){
+      j = strcspn(end + i, ",");
+      code = status_code(end + i, j);
+      if(code < 0){
+        fprintf(stderr, "%s: unknown status %.*s in term %s\n", NAME, j, end + i, text);
+        return -1;
+      }
+      t->t_success[code] = 1;
+      if(end[i + j] == '\0'){
+        break;
+      }
+    }
+  } else {
+    fprintf(stderr, "%s: unable to parse term %s\n", NAME, text);
+    return -1;
+  }
+
+  switch(t->t_kind){
+    case TERM_LESS :
+    case TERM_MOST :
+    case TERM_MORE :
+    case TERM_LEAST :
+      strtod(t->t_operand, &end);
+      if((t->t_operand[0] == '\0') || (end[0] != '\0')){
+        fprintf(stderr, "%s: threshold in term %s is not a number\n", NAME, text);
+        return -1;
+      }
+      break;
+  }
+
+  c->c_size++;
+
+  return 0;
+}
+
+int check_term(struct sq_condition *c, struct sq_term *t)
+{
+  struct sq_sensor *s;
+  double have, want;
+  char *end;
+  int numeric;
+
+  s = &(c->c_sensors[t->t_sensor]);
+  if(s->s_status < 0){
+    return 0;
+  }
+
+  if(t->t_kind == TERM_STATUS){
+    return t->t_success[s->s_status] ? 1 : 0;
+  }
+
+  if(s->s_value == NULL){
+    return 0;
+  }
+
+  have = strtod(s->s_value, &end);
+  numeric = ((s->s_value[0] != '\0') && (end[0] == '\0')) ? 1 : 0;
+  if(numeric && t->t_operand[0]){
+    want = strtod(t->t_operand, &end);
+    if(end[0] != '\0'){
+      numeric = 0;
+    }
+  } else {
+    numeric = 0;
+    want = 0.0;
+  }
+
+  switch(t->t_kind){
+    case TERM_LESS  : return (numeric && (have <  want)) ? 1 : 0;
+    case TERM_MOST  : return (numeric && (have <= want)) ? 1 : 0;
+    case TERM_MORE  : return (numeric && (have >  want)) ? 1 : 0;
+    case TERM_LEAST : return (numeric && (have >= want)) ? 1 : 0;
+    case TERM_EQUAL :
+      return (numeric ? (have == want) : !strcmp(s->s_value, t->t_operand)) ? 1 : 0;
+    case TERM_DIFFER :
+      return (numeric ? (have != want) : strcmp(s->s_value, t->t_operand)) ? 1 : 0;
+  }
+
+  return 0;
+}
+
+/* and binds tighter than or, returns the clause which holds or -1 */
+
+int check_condition(struct sq_condition *c)
+{
+  unsigned int i, clause;
+  int holds;
+
+  for(clause = 0; clause < c->c_clauses; clause++){
+    holds = 1;
+    for(i = 0; (i < c->c_size) && holds; i++){
+      if(c->c_terms[i].t_clause == clause){
+        holds = check_term(c, &(c->c_terms[i]));
+      }
+    }
+    if(holds){
+      return clause;
+    }
+  }
+
+  return -1;
+}
+
+void report_condition(struct sq_condition *c, int clause, int verbose, int report)
+{
+  struct sq_term *t;
+  struct sq_sensor *s;
+  unsigned int i;
+
+  for(i = 0; i < c->c_size; i++){
+    t = &(c->c_terms[i]);
+    if(t->t_clause != clause){
+      continue;
+    }
+    s = &(c->c_sensors[t->t_sensor]);
+    if(verbose){
+      fprintf(stderr, "%s: term %s satisfied, sensor %s is %s with value %s\n", NAME, t->t_text, s->s_name, sensor_status_names[s->s_status], s->s_value ? s->s_value : "unknown");
+    }
+    if(report){
+      printf("%s %s %s\n", t->t_text, sensor_status_names[s->s_status], s->s_value ? s->s_value : "");
+    }
+  }
+}
+
+void forget_condition(struct sq_condition *c)
+{
+  unsigned int i;
+
+  for(i = 0; i < c->c_count; i++){
+    c->c_sensors[i].s_status = (-1);
+    if(c->c_sensors[i].s_value){
+      free(c->c_sensors[i].s_value);
+      c->c_sensors[i].s_value = NULL;
+    }
+  }
+}
+
+int update_condition(struct sq_condition *c, struct katcl_line *l, int verbose)
+{
+  char *name, *status, *value;
+  unsigned int i;
+  int code;
+
+  /* #sensor-status and #sensor-value share the layout: time count name status value */
+
+  if(arg_count_katcl(l) < 5){
+    return 0;
+  }
+
+  name = arg_string_katcl(l, 3);
+  status = arg_string_katcl(l, 4);
+  value = arg_string_katcl(l, 5);
+  if((name == NULL) || (status == NULL)){
+    return 0;
+  }
+
+  for(i = 0; (i < c->c_count) && strcmp(c->c_sensors[i].s_name, name); i++);
+  if(i >= c->c_count){
+    return 0;
+  }
+
+  code = status_code(status, strlen(status));
+  if(code < 0){
+    if(verbose){
+      fprintf(stderr, "%s: sensor %s reports unknown status %s\n", NAME, name, status);
+    }
+    return 0;
+  }
+
+  if(verbose > 1){
+    fprintf(stderr, "%s: sensor status is %s for %s\n", NAME, status, name);
+  }
+
+  c->c_sensors[i].s_status = code;
+
+  if(c->c_sensors[i].s_value){
+    free(c->c_sensors[i].s_value);
+  }
+  c->c_sensors[i].s_value = value ? strdup(value) : NULL;
+
+  return 1;
+}
+
+/* protocol *************************************************************/
+
+int issue_requests(struct katcl_line *l, struct sq_condition *c, int verbose)
+{
+  unsigned int i;
+
+  /* all subscriptions go out back to back, the replies are checked as they arrive */
+  for(i = 0; i < c->c_count; i++){
+    if(append_string_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?sensor-sampling") < 0){
+      return -1;
+    }
+    append_string_katcl(l, KATCP_FLAG_STRING, c->c_sensors[i].s_name);
+    append_string_katcl(l, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "event");
+  }
+
+  /* and ask for the current state, in case a server does not report it on subscription */
+  for(i = 0; i < c->c_count; i++){
+    append_string_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?sensor-value");
+    append_string_katcl(l, KATCP_FLAG_STRING | KATCP_FLAG_LAST, c->c_sensors[i].s_name);
+  }
 
   return 0;
 }
 
-int await_result(struct katcl_line *l, char *sensor, unsigned short *success, int verbose)
+int await_result(struct katcl_line *l, struct sq_condition *c, int verbose)
 {
-  char *status, *match, *ptr;
+  char *ptr;
   fd_set fsr, fsw;
-  int i, fd, count, result;
+  int fd, result, changed, clause;
 
   fd = fileno_katcl(l);
 
@@ -111,13 +450,13 @@ int await_result(struct katcl_line *l, char *sensor, unsigned short *success, in
       switch(errno){
         case EAGAIN :
         case EINTR  :
-          return 0;
+          return -2;
         default  :
           return -1;
       }
       break;
     case 0 :
-      return 0;
+      return -2;
   }
 
   if(FD_ISSET(fd, &fsw)){
@@ -136,46 +475,32 @@ int await_result(struct katcl_line *l, char *sensor, unsigned short *success, in
     }
   }
 
+  changed = 0;
+
   while(have_katcl(l) > 0){
     ptr = arg_string_katcl(l, 0);
     if(ptr){
       switch(ptr[0]){
-        case KATCP_INFORM : 
-          if(!strcmp(ptr, "#sensor-status")){
-            count = arg_count_katcl(l);
-            if(count >= 5){
-              match = arg_string_katcl(l, 3);
-              status = arg_string_katcl(l, 4);
-              if(match && status){
-                if(verbose){
-                  fprintf(stderr, "%s: sensor status is %s for %s\n", NAME, status, match);
-                }
-                for(i = 0; i < SENSOR_NAMES_COUNT; i++){
-                  if(success[i] && !strcmp(sensor_status_names[i], status)){
-                    if(verbose){
-                      fprintf(stderr, "%s: sensor %s matches desired status %s\n", NAME, match, sensor_status_names[i]);
-                    }
-                    return 1;
-                  }
-                }
-              }
-            }
+        case KATCP_INFORM :
+          if(!strcmp(ptr, KATCP_SENSOR_STATUS_INFORM) || !strcmp(ptr, KATCP_SENSOR_VALUE_INFORM)){
+            changed += update_condition(c, l, verbose);
           }
           break;
-        case KATCP_REPLY : 
-          if(!strcmp(ptr, "!sensor-sampling")){
+        case KATCP_REPLY :
+          if(!strcmp(ptr, "!sensor-sampling") || !strcmp(ptr, "!sensor-value")){
             ptr = arg_string_katcl(l, 1);
             if((ptr == NULL) || strcmp(ptr, KATCP_OK)){
-              fprintf(stderr, "%s: unable to monitor sensor %s\n", NAME, sensor);
+              ptr = arg_string_katcl(l, 2);
+              fprintf(stderr, "%s: unable to monitor sensor (%s)\n", NAME, ptr ? ptr : "no reason given");
               return -1;
             }
           } else {
             if(verbose){
-              fprintf(stderr, "%s: response %s is unexpected", NAME, ptr);
+              fprintf(stderr, "%s: response %s is unexpected\n", NAME, ptr);
             }
           }
           break;
-        case KATCP_REQUEST : 
+        case KATCP_REQUEST :
           if(verbose > 0){
             fprintf(stderr, "%s: warning, encountered an unanswerable request <%s>\n", NAME, ptr);
           }
@@ -187,17 +512,27 @@ int await_result(struct katcl_line *l, char *sensor, unsigned short *success, in
     }
   }
 
-  return 0;
+  if(changed == 0){
+    return -2;
+  }
+
+  clause = check_condition(c);
+  if(clause < 0){
+    return -2;
+  }
+
+  return clause;
 }
 
 void usage(char *app){
   int i;
 
-  printf("%s: sensor query - wait for a sensor to acquire a given status\n", NAME);
-  printf("usage: %s [-h] [-v] [-q] [-s server:port] [-t timeout] [-w status] sensor-name\n", app);
+  printf("%s: sensor query - wait for sensors to acquire a given status or value\n", NAME);
+  printf("usage: %s [-h] [-v] [-q] [-r] [-s server:port] [-t timeout] [-w status] term [[and|or] term]*\n", app);
   printf("-h              this help\n");
   printf("-v              increase verbosity\n");
   printf("-q              quiet\n");
+  printf("-r              report the terms which satisfied the condition on standard output\n");
   printf("-s server:port  connect to the server address on the given port\n");
   printf("-w status       set the sensor status to wait for. This option can be given\n");
   printf("                multiple times. Status values are:\n");
@@ -211,25 +546,41 @@ void usage(char *app){
 
   printf("-t timeout      timeout in seconds (wait indefinitely by default)\n");
 
+  printf("terms:\n");
+  printf("  sensor                     sensor has a status given by -w\n");
+  printf("  sensor=status[,status]*    sensor has one of the given statuses\n");
+  printf("  sensor<number              also <=, > and >=, compares the sensor value\n");
+  printf("  sensor==value              also !=, numerically if both are numbers\n");
+  printf("  adjacent terms have to hold together, and binds tighter than or\n");
+  printf("  example: %s 'a.lock=nominal' 'b.lock=nominal' or 'c.temp>80'\n", app);
 }
 
 int main(int argc, char **argv)
 {
-  char *server, *sensor;
+  char *server;
   int i, j, k, c;
-  int verbose, result, timeout, code;
+  int verbose, result, timeout, code, report, defaults;
   struct katcl_line *l;
   unsigned short success[SENSOR_NAMES_COUNT];
   struct sigaction san, sao;
+  struct sq_condition condition, *cn;
 
   server = getenv("KATCP_SERVER");
   if(server == NULL){
     server = "localhost";
   }
-  
+
   verbose = 1;
   timeout = 0;
-  sensor = NULL;
+  report = 0;
+
+  cn = &condition;
+  cn->c_sensors = NULL;
+  cn->c_count = 0;
+  cn->c_terms = NULL;
+  cn->c_size = 0;
+  cn->c_clauses = 1;
+  cn->c_join = 0;
 
   for(i = 0; i < SENSOR_NAMES_COUNT; i++){
     success[i] = 0;
@@ -245,14 +596,18 @@ int main(int argc, char **argv)
           usage(argv[0]);
           return 0;
 
-        case 'v' : 
+        case 'v' :
           verbose++;
           j++;
           break;
-        case 'q' : 
+        case 'q' :
           verbose = 0;
           j++;
           break;
+        case 'r' :
+          report = 1;
+          j++;
+          break;
 
         case 's' :
         case 't' :
@@ -275,7 +630,7 @@ int main(int argc, char **argv)
             case 't' :
               timeout = atoi(argv[i] + j);
               break;
-            case 'w' : 
+            case 'w' :
               for(k = 0; k < SENSOR_NAMES_COUNT; k++){
                 if(!strcmp(sensor_status_names[k], argv[i] + j)){
                   success[k] = 1;
@@ -300,43 +655,65 @@ int main(int argc, char **argv)
           return 2;
       }
     } else {
-      if(sensor){
-        fprintf(stderr, "%s: extra parameter %s\n", NAME, argv[i]);
-        return 2;
+      if(!strcmp(argv[i], "and") || !strcmp(argv[i], "or")){
+        if((cn->c_size == 0) || cn->c_join){
+          fprintf(stderr, "%s: %s needs a term on either side\n", NAME, argv[i]);
+          return 2;
+        }
+        if(argv[i][0] == 'o'){
+          cn->c_clauses++;
+        }
+        cn->c_join = 1;
+      } else {
+        if(add_term_condition(cn, argv[i]) < 0){
+          return 2;
+        }
+        cn->c_join = 0;
       }
-      sensor = argv[i];
       i++;
     }
   }
 
-  if(sensor == NULL){
+  if(cn->c_size == 0){
     fprintf(stderr, "%s: need a sensor to monitor\n", NAME);
     return 2;
   }
 
-  if(verbose){
-    fprintf(stderr, "%s: waiting for sensor %s to acquire status", NAME, sensor);
+  if(cn->c_join){
+    fprintf(stderr, "%s: condition ends in an operator\n", NAME);
+    return 2;
   }
 
-  i = j = 0;
-  while(i < SENSOR_NAMES_COUNT){
+  defaults = 0;
+  for(i = 0; i < SENSOR_NAMES_COUNT; i++){
     if(success[i]){
-      if(verbose){
-        fprintf(stderr, "%s%s", (j > 0) ? " or " : " ", sensor_status_names[i]);
-      }
-      j++;
+      defaults++;
     }
-    i++;
   }
-  
-  if(j == 0){
+  if(defaults == 0){
     success[SENSOR_NAME_NOMINAL] = 1;
-    if(verbose){
-      fprintf(stderr, " %s\n", sensor_status_names[SENSOR_NAME_NOMINAL]);
+  }
+
+  for(k = 0; k < cn->c_size; k++){
+    if(cn->c_terms[k].t_default){
+      for(i = 0; i < SENSOR_NAMES_COUNT; i++){
+        cn->c_terms[k].t_success[i] = success[i];
+      }
     }
-  } else {
-    if(verbose){
+  }
+
+  if(verbose){
+    if((cn->c_size == 1) && cn->c_terms[0].t_default){
+      fprintf(stderr, "%s: waiting for sensor %s to acquire status", NAME, cn->c_sensors[0].s_name);
+      for(i = 0, j = 0; i < SENSOR_NAMES_COUNT; i++){
+        if(success[i]){
+          fprintf(stderr, "%s%s", (j > 0) ? " or " : " ", sensor_status_names[i]);
+          j++;
+        }
+      }
       fprintf(stderr, "\n");
+    } else {
+      fprintf(stderr, "%s: waiting on %u terms over %u sensors\n", NAME, cn->c_size, cn->c_count);
     }
   }
 
@@ -361,19 +738,22 @@ int main(int argc, char **argv)
       destroy_katcl(l, 1);
     }
 
+    forget_condition(cn);
+
     l = initiate_connection(server, verbose);
     if(l == NULL){
       sleep(1);
       continue;
     }
 
-    if(issue_request(l, sensor, verbose) < 0){
+    if(issue_requests(l, cn, verbose) < 0){
       continue;
     }
 
-    while((result = await_result(l, sensor, success, verbose)) == 0);
+    while(((result = await_result(l, cn, verbose)) == -2) && (up_running > 0));
 
-    if(result > 0){
+    if(result >= 0){
+      report_condition(cn, result, verbose, report);
       up_running = 0;
       code = 0;
     }
@@ -387,6 +767,6 @@ int main(int argc, char **argv)
   alarm(0);
   sigaction(SIGALRM, &sao, NULL);
 #endif
-      
+
   return code;
 }
@@ -0,0 +1,229 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* runs kcpsq against a local katcp server whose sensors change on a
+ * schedule, and checks that each condition is met (or not) when
+ * expected and that the reported terms are the right ones
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <netc.h>
+#include <katcp.h>
+#include <fixture.h>
+
+#define KCPSQ "./kcpsq"
+
+#define SLACK   400
+
+static struct timeval origin;
+
+struct check{
+  char *c_args[8];
+  int c_code;
+  char *c_output;
+  long c_after;
+};
+
+/* test.a turns nominal after 600ms, test.b after 1200ms, test.c
+ * ramps up by one every 100ms (nominal up to 10, warn thereafter)
+ * and test.d stays in warn
+ */
+
+static struct check checks[] = {
+  { { "test.a", NULL }, 0, "test.a nominal 5\n", 600 },
+  { { "test.a", "test.b", NULL }, 0, "test.a nominal 5\ntest.b nominal 5\n", 1200 },
+  { { "test.a", "and", "test.b", "or", "test.d", NULL }, 0, "test.a nominal 5\ntest.b nominal 5\n", 1200 },
+  { { "test.d=nominal", "or", "test.a", NULL }, 0, "test.a nominal 5\n", 600 },
+  { { "test.d=warn,error", "or", "test.a", NULL }, 0, "test.d=warn,error warn 50\n", 0 },
+  { { "test.c=warn", NULL }, 0, "test.c=warn warn 11\n", 1100 },
+  { { "test.c>=15", "test.b", NULL }, 0, "test.c>=15 warn 15\ntest.b nominal 5\n", 1500 },
+  { { "test.c==21", NULL }, 0, "test.c==21 warn 21\n", 2100 },
+  { { "test.a!=50", NULL }, 0, "test.a!=50 nominal 5\n", 600 },
+  { { "-t", "1", "test.d", NULL }, 1, "", 1000 },
+  { { "test.a=unknown,bogus", NULL }, 2, "", 0 },
+  { { "test.a", "or", NULL }, 2, "", 0 },
+  { { "test.a<x", NULL }, 2, "", 0 },
+  { { NULL }, 0, NULL, 0 }
+};
+
+static long elapsed_ms(void)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+
+  return ((now.tv_sec - origin.tv_sec) * 1000L) + ((now.tv_usec - origin.tv_usec) / 1000L);
+}
+
+static int value_of(char *name)
+{
+  long ms;
+
+  ms = elapsed_ms();
+
+  switch(name[5]){
+    case 'a' : return (ms >= 600) ? 5 : 50;
+    case 'b' : return (ms >= 1200) ? 5 : 50;
+    case 'c' : return ms / 100;
+    default  : return 50;
+  }
+}
+
+static int get_test_sensor(struct katcp_dispatch *d, struct katcp_acquire *a)
+{
+  return value_of(get_local_acquire_katcp(d, a));
+}
+
+static int tick_test_sensors(struct katcp_dispatch *d, void *data)
+{
+  char *names[] = { "test.a", "test.b", "test.c", "test.d", NULL };
+  struct katcp_sensor *sn;
+  struct katcp_acquire *a;
+  int i;
+
+  for(i = 0; names[i]; i++){
+    sn = find_sensor_katcp(d, names[i]);
+    if(sn == NULL){
+      continue;
+    }
+    a = acquire_from_sensor_katcp(d, sn);
+    if(a){
+      set_integer_acquire_katcp(d, a, value_of(names[i]));
+    }
+  }
+
+  return 0;
+}
+
+static pid_t start_server(char *bind, char *server)
+{
+  char *names[] = { "test.a", "test.b", "test.c", "test.d", NULL };
+  struct katcp_dispatch *d;
+  unsigned int i;
+  pid_t pid;
+  int fd;
+
+  fflush(stdout);
+
+  pid = fork();
+  if(pid < 0){
+    return -1;
+  }
+
+  if(pid == 0){
+    freopen("/dev/null", "w", stderr); /* the library may be built with debug output */
+    gettimeofday(&origin, NULL);
+    d = startup_katcp();
+    if(d == NULL){
+      exit(2);
+    }
+    add_version_katcp(d, "test", 0, "0.1", "now");
+    for(i = 0; names[i]; i++){
+      if(declare_integer_sensor_katcp(d, 0, names[i], "scheduled test sensor", "none", &get_test_sensor, names[i], NULL, 0, 10, 0, 20, NULL)){
+        exit(2);
+      }
+    }
+    if(register_every_ms_katcp(d, 20, &tick_test_sensors, NULL) < 0){
+      exit(2);
+    }
+    run_multi_server_katcp(d, 16, bind, 0);
+    shutdown_katcp(d);
+    exit(0);
+  }
+
+  gettimeofday(&origin, NULL);
+
+  for(i = 0; i < 50; i++){
+    fd = net_connect(server, 0, 0);
+    if(fd >= 0){
+      close(fd);
+      return pid;
+    }
+    usleep(20000);
+  }
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+
+  return -1;
+}
+
+static int run_sq(char *server, char **args, char **output)
+{
+  char *argv[16];
+  int i, j;
+
+  j = 0;
+  argv[j++] = KCPSQ;
+  argv[j++] = "-q";
+  argv[j++] = "-r";
+  argv[j++] = "-s";
+  argv[j++] = server;
+  for(i = 0; args[i]; i++){
+    argv[j++] = args[i];
+  }
+  argv[j] = NULL;
+
+  return run_fixture(argv, NULL, output);
+}
+
+int main(int argc, char **argv)
+{
+  char server[64], bind[64], *output;
+  struct check *c;
+  int port, code, failures, i;
+  long took;
+  pid_t sp;
+
+  port = 20000 + (getpid() % 20000);
+  snprintf(bind, sizeof(bind), "127.0.0.1:%d", port);
+  snprintf(server, sizeof(server), "localhost:%d", port);
+
+  unsetenv(NETC_MUX_VARIABLE);
+
+  failures = 0;
+
+  for(c = checks; c->c_output; c++){
+    sp = start_server(bind, server);
+    if(sp < 0){
+      fprintf(stderr, "test: unable to start server on %s\n", bind);
+      return 2;
+    }
+
+    code = run_sq(server, c->c_args, &output);
+    took = elapsed_ms();
+
+    kill(sp, SIGKILL);
+    waitpid(sp, NULL, 0);
+
+    printf("test:");
+    for(i = 0; c->c_args[i]; i++){
+      printf(" %s", c->c_args[i]);
+    }
+    printf(" -> code %d after %ldms", code, took);
+
+    if((output == NULL) || (code != c->c_code) || strcmp(output, c->c_output) || (took + SLACK < c->c_after) || (took > c->c_after + SLACK + 1000)){
+      printf(" FAILED, expected code %d after %ldms\n", c->c_code, c->c_after);
+      printf("test: reported <%s>, expected <%s>\n", output ? output : "", c->c_output);
+      failures++;
+    } else {
+      printf(" ok\n");
+    }
+
+    free(output);
+  }
+
+  printf("test: %s\n", failures ? "FAILED" : "all conditions behave");
+
+  return failures ? 1 : 0;
+}
@@ -9,6 +9,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include <katcp.h>
 #include <katcl.h>
@@ -56,6 +57,10 @@ struct tbs_hwsensor *alloc_hwsensor_tbs()
   }
 
   hs->h_adc_fd = -1;
+  hs->h_value = 0;
+  hs->h_status = KATCP_STATUS_UNKNOWN;
+  hs->h_changed = 0;
+  hs->h_acquire = NULL;
   hs->h_min = 0;
   hs->h_max = INT_MAX;
   hs->h_mult = 1;
@@ -69,50 +74,78 @@ struct tbs_hwsensor *alloc_hwsensor_tbs()
   return hs;
 }
 
-int read_fd_hwsensor_tbs(int fd)
+/* sysfs attributes are short decimal integers, spare us the atoi/strtol generality */
+
+static int parse_hwsensor_tbs(char *buffer, int len, int *value)
 {
-  char buf[10];
-  int size;
+  int i, result, sign, digits;
 
-  if (fd < 0){
-    return -1;
+  i = 0;
+  sign = 1;
+
+  while((i < len) && ((buffer[i] == ' ') || (buffer[i] == '\t'))){
+    i++;
   }
 
-  if (lseek(fd, 0, SEEK_SET) < 0){
-#ifdef KATCP_STDERR_ERRORS
-    fprintf(stderr, "hwmon: cannot lseek fd: %d\n", fd);
-#endif
+  if((i < len) && (buffer[i] == '-')){
+    sign = (-1);
+    i++;
+  }
+
+  result = 0;
+  digits = 0;
+
+  while((i < len) && (buffer[i] >= '0') && (buffer[i] <= '9')){
+    result = (result * 10) + (buffer[i] - '0');
+    digits++;
+    i++;
+  }
+
+  if(digits <= 0){
     return -1;
   }
 
-  size = read(fd, &buf, sizeof(buf));
-  if (size <= 0){
+  if((i < len) && (buffer[i] != '\n') && (buffer[i] != '\0')){
     return -1;
   }
 
-  return atoi(buf);
+  *value = sign * result;
+
+  return 0;
 }
 
-int read_hwsensor_tbs(struct katcp_dispatch *d, struct katcp_acquire *a)
+int read_fd_hwsensor_tbs(int fd)
 {
-  struct tbs_hwsensor *hs;
-  int value;
+  char buf[16];
+  int size, value;
 
-  if (a == NULL){
+  if (fd < 0){
     return -1;
   }
 
-  hs = a->a_local;
-  if (hs == NULL){
+  /* pread saves us an lseek per attribute, sysfs regenerates content at offset zero */
+  size = pread(fd, buf, sizeof(buf), 0);
+  if (size <= 0){
+#ifdef KATCP_STDERR_ERRORS
+    fprintf(stderr, "hwmon: unable to read fd %d: %s\n", fd, (size < 0) ? strerror(errno) : "empty");
+#endif
     return -1;
   }
 
-  value = read_fd_hwsensor_tbs(hs->h_adc_fd);
-  if(value == (-1)){
+  if (parse_hwsensor_tbs(buf, size, &value) < 0){
     return -1;
   }
 
-  return (hs->h_mult * value) / hs->h_div;
+  return value;
+}
+
+static int status_hwsensor_tbs(struct tbs_hwsensor *hs, int value)
+{
+  if((value < hs->h_min) || (value > hs->h_max)){
+    return KATCP_STATUS_ERROR;
+  } 
+
+  return KATCP_STATUS_NOMINAL;
 }
 
 int extract_hwsensor_tbs(struct katcp_dispatch *d, struct katcp_sensor *sn)
@@ -124,23 +157,24 @@ int extract_hwsensor_tbs(struct katcp_dispatch *d, struct katcp_sensor *sn)
 
   a = sn->s_acquire;
 
-  hs = a->a_local;
-  if (hs == NULL){
-    return -1;
-  }
-  
   if ((a == NULL) || (a->a_type != KATCP_SENSOR_INTEGER) || (sn->s_type != KATCP_SENSOR_INTEGER)){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "type mismatch for putative integer sensor %s", sn->s_name);
     return -1;
   }
+
+  hs = a->a_local;
+  if (hs == NULL){
+    return -1;
+  }
   
   is = sn->s_more;
   ia = a->a_more;
 
-  if((ia->ia_current < hs->h_min) || (ia->ia_current > hs->h_max)){
-    set_status_sensor_katcp(sn, KATCP_STATUS_ERROR);
+  /* sweep has already decided on status, only limits may have moved since */
+  if((hs->h_status == KATCP_STATUS_FAILURE) || (hs->h_status == KATCP_STATUS_UNKNOWN)){
+    set_status_sensor_katcp(sn, hs->h_status);
   } else {
-    set_status_sensor_katcp(sn, KATCP_STATUS_NOMINAL);
+    set_status_sensor_katcp(sn, status_hwsensor_tbs(hs, ia->ia_current));
   }
 
   is->is_current = ia->ia_current;
@@ -148,6 +182,183 @@ int extract_hwsensor_tbs(struct katcp_dispatch *d, struct katcp_sensor *sn)
   return 0;
 }
 
+/* sweep logic: one timer reads all attributes *****************************/
+
+int sweep_hwmon_tbs(struct katcp_dispatch *d, void *data)
+{
+  struct tbs_hwsweep *hw;
+  struct tbs_hwsensor *hs;
+  struct timeval then, now, delta;
+  unsigned int i, changed;
+  int raw, value, status;
+
+  hw = data;
+  if(hw == NULL){
+    return -1;
+  }
+
+  gettimeofday(&then, NULL);
+
+  /* first gather everything, so that values are as close to a snapshot as we can get */
+  for(i = 0; i < hw->w_count; i++){
+    hs = hw->w_vector[i];
+
+    raw = read_fd_hwsensor_tbs(hs->h_adc_fd);
+    if(raw == (-1)){
+      status = KATCP_STATUS_FAILURE;
+      value = hs->h_value;
+    } else {
+      value = (hs->h_mult * raw) / hs->h_div;
+      status = status_hwsensor_tbs(hs, value);
+    }
+
+    if((value == hs->h_value) && (status == hs->h_status)){
+      continue; /* unchanged, nothing to tell anybody */
+    }
+
+    hs->h_value = value;
+    hs->h_status = status;
+    hs->h_changed = 1;
+  }
+
+  gettimeofday(&now, NULL);
+  sub_time_katcp(&delta, &now, &then);
+
+  /* then tell subscribers about the ones which moved */
+  changed = 0;
+  for(i = 0; i < hw->w_count; i++){
+    hs = hw->w_vector[i];
+    if(hs->h_changed){
+      hs->h_changed = 0;
+      if(hs->h_acquire){
+        set_integer_acquire_katcp(d, hs->h_acquire, hs->h_value);
+      }
+      changed++;
+    }
+  }
+
+  hw->w_changes += changed;
+
+  if(hw->w_timing){
+    set_integer_acquire_katcp(d, hw->w_timing, (delta.tv_sec * 1000000) + delta.tv_usec);
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "hwmon: swept %u sensors in %lu.%06lus, %u changed\n", hw->w_count, delta.tv_sec, delta.tv_usec, changed);
+#endif
+
+  return 0;
+}
+
+static int add_hwsweep_tbs(struct tbs_hwsweep *hw, struct tbs_hwsensor *hs)
+{
+  struct tbs_hwsensor **tmp;
+
+  tmp = realloc(hw->w_vector, sizeof(struct tbs_hwsensor *) * (hw->w_count + 1));
+  if(tmp == NULL){
+    return -1;
+  }
+
+  hw->w_vector = tmp;
+  hw->w_vector[hw->w_count] = hs;
+  hw->w_count++;
+
+  return 0;
+}
+
+static void remove_hwsweep_tbs(struct tbs_hwsweep *hw, struct tbs_hwsensor *hs)
+{
+  unsigned int i;
+
+  for(i = 0; i < hw->w_count; i++){
+    if(hw->w_vector[i] == hs){
+      hw->w_count--;
+      hw->w_vector[i] = hw->w_vector[hw->w_count];
+      return;
+    }
+  }
+}
+
+void destroy_hwsweep_tbs(struct katcp_dispatch *d, struct tbs_hwsweep *hw)
+{
+  if(hw == NULL){
+    return;
+  }
+
+  discharge_timer_katcp(d, hw);
+
+  /* sensors themselves are owned by the r_hwmon tree */
+  if(hw->w_vector){
+    free(hw->w_vector);
+    hw->w_vector = NULL;
+  }
+
+  hw->w_count = 0;
+  hw->w_timing = NULL;
+
+  free(hw);
+}
+
+static struct tbs_hwsweep *create_hwsweep_tbs(struct katcp_dispatch *d)
+{
+  struct tbs_hwsweep *hw;
+
+  hw = malloc(sizeof(struct tbs_hwsweep));
+  if(hw == NULL){
+    return NULL;
+  }
+
+  hw->w_vector = NULL;
+  hw->w_count = 0;
+  hw->w_interval = TBS_HWMON_INTERVAL;
+  hw->w_changes = 0;
+  hw->w_timing = NULL;
+
+  return hw;
+}
+
+int hwmon_interval_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct tbs_raw *tr;
+  struct tbs_hwsweep *hw;
+  unsigned int interval;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to acquire raw mode state");
+    return KATCP_RESULT_FAIL;
+  }
+
+  hw = tr->r_sweep;
+  if(hw == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no hardware monitoring sweep configured");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc > 1){
+    interval = arg_unsigned_long_katcp(d, 1);
+    if(interval == 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "require a nonzero sweep interval in milliseconds");
+      return KATCP_RESULT_INVALID;
+    }
+
+    if(register_every_ms_katcp(d, interval, &sweep_hwmon_tbs, hw) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to reschedule hardware sweep to %ums", interval);
+      return KATCP_RESULT_FAIL;
+    }
+
+    hw->w_interval = interval;
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "sweeping %u hardware sensors every %ums with %lu changes seen", hw->w_count, hw->w_interval, hw->w_changes);
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, hw->w_interval);
+
+  return KATCP_RESULT_OWN;
+}
+
 int write_path_hwsensor_tbs(struct katcp_dispatch *d, char *path, char *value)
 {
   int fd, bytes;
@@ -353,8 +564,8 @@ int register_hwmon_tbs(struct katcp_dispatch *d, char *label, char *desc, char *
     return -1;
   }
 
-  /*NULL release since avltree will manage the data*/
-  a = setup_integer_acquire_katcp(d, &read_hwsensor_tbs, hs, NULL);
+  /* NULL release since avltree will manage the data, NULL get since the sweep pushes values */
+  a = setup_integer_acquire_katcp(d, NULL, hs, NULL);
   if (a == NULL){
 #ifdef DEBUG
     fprintf(stderr, "hwmon: unable to setup integer acquire for %s\n", label);
@@ -365,6 +576,25 @@ int register_hwmon_tbs(struct katcp_dispatch *d, char *label, char *desc, char *
   } 
   
 
+  /* everything which can be undone goes first, once registered a sensor can not be taken back out */
+  if ((tr->r_sweep == NULL) || (add_hwsweep_tbs(tr->r_sweep, hs) < 0)){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to schedule hw sensor %s for sweeps", label);
+    destroy_hwsensor_tbs(hs);
+    destroy_acquire_katcp(d, a);
+    return -1;
+  }
+
+  if (store_named_node_avltree(tr->r_hwmon, label, hs) < 0){
+#ifdef DEBUG
+    fprintf(stderr, "hwmon: unable to store sensor %s\n", label);
+#endif
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to store definition of hw sensor %s", label);
+    remove_hwsweep_tbs(tr->r_sweep, hs);
+    destroy_hwsensor_tbs(hs);
+    destroy_acquire_katcp(d, a);
+    return -1;
+  }
+
 #if 0
   if (register_integer_sensor_katcp(d, TBS_MODE_RAW, label, desc, unit, &read_hwsensor_tbs, hs, NULL, hs->h_min, hs->h_max, &flush_hwsensor_tbs) < 0) {
 #endif
@@ -377,20 +607,15 @@ int register_hwmon_tbs(struct katcp_dispatch *d, char *label, char *desc, char *
     fprintf(stderr, "hwmon: unable to register sensor %s\n", label);
 #endif
     log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to register integer sensor %s", label);
+    /* NULL free, the tree must not release hs as well */
+    del_name_node_avltree(tr->r_hwmon, label, NULL);
+    remove_hwsweep_tbs(tr->r_sweep, hs);
     destroy_hwsensor_tbs(hs);
     destroy_acquire_katcp(d, a);
     return -1;
   }
-  
-  if (store_named_node_avltree(tr->r_hwmon, label, hs) < 0){
-#ifdef DEBUG
-    fprintf(stderr, "hwmon: unable to store sensor %s\n", label);
-#endif
-    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to store definition of hw sensor %s", label);
-    destroy_hwsensor_tbs(hs);
-    destroy_acquire_katcp(d, a);
-    return -1;
-  }
+
+  hs->h_acquire = a;
 
 #ifdef DEBUG
   fprintf(stderr, "hwmon: registered new sensor %s\n", label);
@@ -400,10 +625,48 @@ int register_hwmon_tbs(struct katcp_dispatch *d, char *label, char *desc, char *
 }
 
 
+static int start_hwsweep_tbs(struct katcp_dispatch *d, struct tbs_raw *tr)
+{
+  struct tbs_hwsweep *hw;
+
+  if(tr->r_sweep){
+    return 0;
+  }
+
+  hw = create_hwsweep_tbs(d);
+  if(hw == NULL){
+    return -1;
+  }
+
+  hw->w_timing = setup_integer_acquire_katcp(d, NULL, NULL, NULL);
+  if(hw->w_timing){
+    if(register_multi_integer_sensor_katcp(d, TBS_MODE_RAW, TBS_HWMON_SWEEP_SENSOR, "time taken to read all hardware sensors", "microseconds", 0, INT_MAX, hw->w_timing, NULL, NULL) < 0){
+      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to register sweep timing sensor");
+      destroy_acquire_katcp(d, hw->w_timing);
+      hw->w_timing = NULL;
+    }
+  }
+
+  tr->r_sweep = hw;
+
+  return 0;
+}
+
 int setup_hwmon_tbs(struct katcp_dispatch *d)
 {
+  struct tbs_raw *tr;
   int rtn;
   
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if (tr == NULL){
+    return -1;
+  }
+
+  if(start_hwsweep_tbs(d, tr) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to set up hardware sensor sweep");
+    return -1;
+  }
+
   rtn = 0;
 
 #if 0
@@ -624,6 +887,14 @@ int setup_hwmon_tbs(struct katcp_dispatch *d)
                                NULL, 
                                1, 1);
 
+  /* get initial values in place before anybody asks, then keep at it */
+  sweep_hwmon_tbs(d, tr->r_sweep);
+
+  if(register_every_ms_katcp(d, tr->r_sweep->w_interval, &sweep_hwmon_tbs, tr->r_sweep) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to schedule hardware sensor sweep");
+    rtn--;
+  }
+
   return rtn;
 }
 
@@ -29,15 +29,17 @@
 void usage(char *app)
 {
   printf("Usage: %s" 
-  " [-b bof-dir] [-f] [-h] [-i init-script] [-l log-file] [-m mode] [-p network-port]\n", app);
+  " [-b bof-dir] [-e shared-memory] [-f] [-h] [-i init-script] [-l log-file] [-m mode] [-p network-port] [-u udp-port]\n", app);
 
   printf("-b dir           directory containing bof files\n");
+  printf("-e name          export register directory to named shared memory for local readers\n");
   printf("-f               run in foreground (default is background)\n");
   printf("-h               this help\n");
   printf("-i file          run the specified startup script\n");
   printf("-l file          log file name\n");
   printf("-m mode          mode to enter at startup\n");
   printf("-p port          network port to listen on\n");
+  printf("-u port          serve register reads and writes on this udp port\n");
 
 }
 
@@ -46,7 +48,7 @@ int main(int argc, char **argv)
   struct katcp_dispatch *d;
   int status;
   int i, j, c, foreground, lfd;
-  char *port, *mode, *init, *lfile, *bofdir;
+  char *port, *mode, *init, *lfile, *bofdir, *mirror, *udp;
   time_t now;
 
   port = "7147";
@@ -55,6 +57,8 @@ int main(int argc, char **argv)
   lfile = TBS_LOGFILE;
   foreground = 0;
   bofdir = NULL;
+  mirror = NULL;
+  udp = NULL;
 
   i = 1;
   j = 1;
@@ -79,10 +83,12 @@ int main(int argc, char **argv)
           break;
 
         case 'b' :
+        case 'e' :
         case 'i' :
         case 'l' :
         case 'm' :
         case 'p' :
+        case 'u' :
           j++;
           if (argv[i][j] == '\0') {
             j = 0;
@@ -95,6 +101,9 @@ int main(int argc, char **argv)
             case 'b' :
               bofdir = argv[i] + j;
               break;
+            case 'e' :
+              mirror = argv[i] + j;
+              break;
             case 'i' :
               init = argv[i] + j;
               break;
@@ -107,6 +116,9 @@ int main(int argc, char **argv)
             case 'p' :
               port = argv[i] + j;
               break;
+            case 'u' :
+              udp = argv[i] + j;
+              break;
           }
           i++;
           j = 1;
@@ -142,6 +154,20 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  if(mirror){
+    if(start_mirror_tbs(d, mirror) < 0){
+      fprintf(stderr, "%s: unable to export registers to %s\n", argv[0], mirror);
+      return 1;
+    }
+  }
+
+  if(udp){
+    if(start_udp_tbs(d, udp) < 0){
+      fprintf(stderr, "%s: unable to serve register access on udp port %s\n", argv[0], udp);
+      return 1;
+    }
+  }
+
   /* mode from command line */
   if(mode){
     if(enter_name_mode_katcp(d, mode, NULL) < 0){
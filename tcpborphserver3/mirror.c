@@ -0,0 +1,103 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* optionally publish the register directory in shared memory, so that
+ * programs running on the roach itself can read registers without
+ * going through a katcp connection. See katcp/regmap.h for the layout
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <katcp.h>
+#include <katpriv.h>
+#include <avltree.h>
+#include <regmap.h>
+
+#include "tcpborphserver3.h"
+
+static int walk_mirror_tbs(struct katcl_regmap *rm, struct avl_node *n)
+{
+  struct tbs_entry *te;
+  int result;
+
+  if(n == NULL){
+    return 0;
+  }
+
+  result = walk_mirror_tbs(rm, n->n_left);
+
+  te = n->n_data;
+  if(te){
+    if(add_regmap_katcl(rm, n->n_key, te->e_pos_base, te->e_pos_offset, te->e_len_base, te->e_len_offset, te->e_mode) < 0){
+      result--;
+    }
+  }
+
+  return result + walk_mirror_tbs(rm, n->n_right);
+}
+
+int update_mirror_tbs(struct katcp_dispatch *d)
+{
+  struct tbs_raw *tr;
+  int result;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return -1;
+  }
+
+  if(tr->r_mirror == NULL){
+    return 0;
+  }
+
+  if(begin_regmap_katcl(tr->r_mirror) < 0){
+    return -1;
+  }
+
+  if((tr->r_fpga != TBS_FPGA_MAPPED) || (tr->r_registers == NULL)){
+    return commit_regmap_katcl(tr->r_mirror, NULL, 0);
+  }
+
+  result = walk_mirror_tbs(tr->r_mirror, tr->r_registers->t_root);
+  if(result < 0){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to export %d registers to shared memory", -result);
+  }
+
+  return commit_regmap_katcl(tr->r_mirror, TBS_FPGA_MEM, tr->r_map_size);
+}
+
+int start_mirror_tbs(struct katcp_dispatch *d, char *name)
+{
+  struct tbs_raw *tr;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return -1;
+  }
+
+  if(tr->r_mirror){
+    destroy_regmap_katcl(tr->r_mirror);
+    tr->r_mirror = NULL;
+  }
+
+  tr->r_mirror = create_regmap_katcl(name, TBS_MIRROR_CAPACITY);
+  if(tr->r_mirror == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to export registers to shared memory %s: %s", name, strerror(errno));
+    return -1;
+  }
+
+  return update_mirror_tbs(d);
+}
+
+void stop_mirror_tbs(struct katcp_dispatch *d, struct tbs_raw *tr)
+{
+  if(tr->r_mirror == NULL){
+    return;
+  }
+
+  destroy_regmap_katcl(tr->r_mirror);
+  tr->r_mirror = NULL;
+}
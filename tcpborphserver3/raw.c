@@ -1561,6 +1561,9 @@ int register_cmd(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
+  tr->r_layout++;
+  update_mirror_tbs(d);
+
   return KATCP_RESULT_OK;
 }
 
@@ -1619,6 +1622,9 @@ int unmap_raw_tbs(struct katcp_dispatch *d)
   tr->r_map_size = 0;
   tr->r_map = NULL;
 
+  tr->r_layout++;
+  update_mirror_tbs(d);
+
   return 0;
 }
 
@@ -1669,6 +1675,9 @@ int map_raw_tbs(struct katcp_dispatch *d)
   close(fd); /* TODO: maybe retain file descriptor ? */
   status_fpga_tbs(d, TBS_FPGA_MAPPED);
 
+  tr->r_layout++;
+  update_mirror_tbs(d);
+
   return 0;
 }
 
@@ -1787,6 +1796,23 @@ void destroy_raw_tbs(struct katcp_dispatch *d, struct tbs_raw *tr)
 
   /**********************/
 
+  stop_mirror_tbs(d, tr);
+
+  if(tr->r_watches){
+    destroy_watchlist_tbs(d, tr->r_watches);
+    tr->r_watches = NULL;
+  }
+
+  if(tr->r_udp){
+    destroy_udp_tbs(d, tr->r_udp);
+    tr->r_udp = NULL;
+  }
+
+  if (tr->r_sweep){
+    destroy_hwsweep_tbs(d, tr->r_sweep);
+    tr->r_sweep = NULL;
+  }
+
   if (tr->r_hwmon){
     destroy_avltree(tr->r_hwmon, &destroy_hwsensor_tbs);
     tr->r_hwmon = NULL;
@@ -1889,9 +1915,16 @@ int setup_raw_tbs(struct katcp_dispatch *d, char *bofdir, int argc, char **argv)
 
   tr->r_chassis = NULL;
 
+  tr->r_sweep = NULL;
+  tr->r_mirror = NULL;
+  tr->r_watches = NULL;
+
   tr->r_taps = NULL;
   tr->r_instances = 0;
 
+  tr->r_udp = NULL;
+  tr->r_layout = 0;
+
   /* clear out further structure elements */
 
   /* allocate structure elements */
@@ -1945,6 +1978,13 @@ int setup_raw_tbs(struct katcp_dispatch *d, char *bofdir, int argc, char **argv)
   result += register_flag_mode_katcp(d, "?wordwrite",    "write hex words to a named register (?wordwrite name index value+)", &word_write_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?wordread",     "read hex words from a named register (?wordread name word-offset:bit-offset word-count)", &word_read_cmd, 0, TBS_MODE_RAW);
 
+  result += register_flag_mode_katcp(d, "?snap-capture", "arm a snapshot block and return its contents (?snap-capture bram control status [mask[:value] [arm-value [timeout-ms [length [chunk]]]]])", &snap_capture_cmd, 0, TBS_MODE_RAW);
+
+  result += register_flag_mode_katcp(d, "?register-watch",   "report changes of a register, optionally as a sensor (?register-watch [name [mask [period-ms [sensor-name]]]])", &register_watch_cmd, 0, TBS_MODE_RAW);
+  result += register_flag_mode_katcp(d, "?register-unwatch", "stop reporting changes of a register (?register-unwatch name)", &register_unwatch_cmd, 0, TBS_MODE_RAW);
+
+  result += register_flag_mode_katcp(d, "?udp-info",     "display udp register access statistics: datagrams, records, rejected records, indexed ranges (?udp-info)", &udp_info_cmd, 0, TBS_MODE_RAW);
+
   result += register_flag_mode_katcp(d, "?progdev",      "program the fpga (?progdev [filename])", &progdev_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?fpgastatus",   "display if the fpga is programmed (?fpgastatus)", &fpgastatus_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?status",       "compatebility alias for fpgastatus, use fpgastatus in new code (?status)", &fpgastatus_cmd, 0, TBS_MODE_RAW);
@@ -1960,6 +2000,8 @@ int setup_raw_tbs(struct katcp_dispatch *d, char *bofdir, int argc, char **argv)
   result += register_flag_mode_katcp(d, "?tap-multicast-add", "join a multicast group (?tap-multicast-add tap-name [recv|send] multicast-address+hosts", &tap_multicast_add_group_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?tap-multicast-remove", "remove a multicast group (?tap-multicast-remove tap-name multicast-address", &tap_multicast_remove_group_cmd, 0, TBS_MODE_RAW);
 
+  result += register_flag_mode_katcp(d, "?hwmon-interval", "query or set the hardware sensor sweep interval (?hwmon-interval [milliseconds])", &hwmon_interval_cmd, 0, TBS_MODE_RAW);
+
   result += register_flag_mode_katcp(d, "?chassis-start",  "initialise chassis interface", &start_chassis_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?chassis-led",    "set a chassis led (?chassis-led led state)", &led_chassis_cmd, 0, TBS_MODE_RAW);
 
@@ -0,0 +1,505 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* server side snapshot capture: arm a snap block, poll its status
+ * register from a fast timer on the main loop and return the captured
+ * bram as a sequence of informs, instead of having a client do all
+ * of this with dozens of ?write and ?read requests
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include <katcp.h>
+#include <katpriv.h>
+#include <katcl.h>
+#include <avltree.h>
+
+#include "tcpborphserver3.h"
+
+#define TBS_SNAP_NOTICE       "snap-capture-"
+#define TBS_SNAP_POLL_US      1000
+#define TBS_SNAP_TIMEOUT_MS   1000
+#define TBS_SNAP_CHUNK        4096
+
+struct tbs_snap
+{
+  char *s_bram;
+  char *s_control;
+  char *s_status;
+
+  uint32_t s_mask;
+  uint32_t s_match;
+  uint32_t s_arm;
+
+  unsigned int s_length;
+
+  struct timeval s_deadline;
+  struct timeval s_start;
+  unsigned long s_polls;
+
+  struct katcp_notice *s_notice;
+};
+
+static void destroy_snap_tbs(struct katcp_dispatch *d, struct tbs_snap *ts)
+{
+  if(ts == NULL){
+    return;
+  }
+
+  if(ts->s_notice){
+    release_notice_katcp(d, ts->s_notice);
+    ts->s_notice = NULL;
+  }
+
+  if(ts->s_bram){
+    free(ts->s_bram);
+    ts->s_bram = NULL;
+  }
+
+  if(ts->s_control){
+    free(ts->s_control);
+    ts->s_control = NULL;
+  }
+
+  if(ts->s_status){
+    free(ts->s_status);
+    ts->s_status = NULL;
+  }
+
+  free(ts);
+}
+
+static struct tbs_snap *create_snap_tbs(char *bram, char *control, char *status)
+{
+  struct tbs_snap *ts;
+
+  ts = malloc(sizeof(struct tbs_snap));
+  if(ts == NULL){
+    return NULL;
+  }
+
+  ts->s_bram = strdup(bram);
+  ts->s_control = strdup(control);
+  ts->s_status = strdup(status);
+
+  ts->s_mask = 0xffffffff;
+  ts->s_match = 0xffffffff;
+  ts->s_arm = 1;
+
+  ts->s_length = 0;
+  ts->s_polls = 0;
+
+  ts->s_notice = NULL;
+
+  if((ts->s_bram == NULL) || (ts->s_control == NULL) || (ts->s_status == NULL)){
+    destroy_snap_tbs(NULL, ts);
+    return NULL;
+  }
+
+  return ts;
+}
+
+/* the register may have vanished if somebody reprogrammed the fpga, so look it up every time */
+static struct tbs_entry *lookup_snap_tbs(struct katcp_dispatch *d, struct tbs_raw *tr, char *name)
+{
+  struct tbs_entry *te;
+
+  if((tr->r_fpga != TBS_FPGA_MAPPED) || (tr->r_registers == NULL)){
+    return NULL;
+  }
+
+  te = find_data_avltree(tr->r_registers, name);
+  if(te == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s not defined", name);
+    return NULL;
+  }
+
+  return te;
+}
+
+static int read_word_snap_tbs(struct katcp_dispatch *d, struct tbs_raw *tr, char *name, uint32_t *value)
+{
+  struct katcl_byte_bit start, amount;
+  struct tbs_entry *te;
+
+  te = lookup_snap_tbs(d, tr, name);
+  if(te == NULL){
+    return -1;
+  }
+
+  make_bb_katcl(&start, 0, 0);
+  make_bb_katcl(&amount, 4, 0);
+
+  if(read_register(d, te, &start, &amount, value, sizeof(uint32_t)) != sizeof(uint32_t)){
+    return -1;
+  }
+
+  return 0;
+}
+
+static int write_word_snap_tbs(struct katcp_dispatch *d, struct tbs_raw *tr, char *name, uint32_t value)
+{
+  struct tbs_entry *te;
+
+  te = lookup_snap_tbs(d, tr, name);
+  if(te == NULL){
+    return -1;
+  }
+
+  if(!(te->e_mode & TBS_WRITABLE)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s is not marked writeable", name);
+    return -1;
+  }
+
+  if((te->e_pos_offset != 0) || (te->e_len_base < 4)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "control register %s needs to be word aligned", name);
+    return -1;
+  }
+
+  if((te->e_pos_base + 4) > tr->r_map_size){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s is outside mapped range", name);
+    return -1;
+  }
+
+  *((uint32_t *)(tr->r_map + te->e_pos_base)) = value;
+  msync(tr->r_map, tr->r_map_size, MS_SYNC);
+
+  return 0;
+}
+
+static void finish_snap_tbs(struct katcp_dispatch *d, struct tbs_snap *ts, char *code, void *buffer, unsigned int length, uint32_t status)
+{
+  struct katcl_parse *p;
+
+  p = create_parse_katcl();
+  if(p){
+    add_plain_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, KATCP_RETURN_JOB);
+    add_plain_parse_katcl(p, KATCP_FLAG_STRING, code);
+    add_unsigned_long_parse_katcl(p, KATCP_FLAG_ULONG, ts->s_polls);
+    add_hex_long_parse_katcl(p, KATCP_FLAG_XLONG, status);
+    add_buffer_parse_katcl(p, KATCP_FLAG_LAST | KATCP_FLAG_BUFFER, buffer, buffer ? length : 0);
+  }
+
+  wake_notice_katcp(d, ts->s_notice, p);
+}
+
+int poll_snap_tbs(struct katcp_dispatch *d, void *data)
+{
+  struct katcl_byte_bit start, amount;
+  struct tbs_snap *ts;
+  struct tbs_raw *tr;
+  struct tbs_entry *te;
+  struct timeval now;
+  uint32_t status;
+  void *buffer;
+  int result;
+
+  ts = data;
+  if(ts == NULL){
+    return -1;
+  }
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    finish_snap_tbs(d, ts, KATCP_FAIL, NULL, 0, 0);
+    destroy_snap_tbs(d, ts);
+    return -1;
+  }
+
+  ts->s_polls++;
+
+  if(read_word_snap_tbs(d, tr, ts->s_status, &status) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to poll snapshot status register %s", ts->s_status);
+    finish_snap_tbs(d, ts, KATCP_FAIL, NULL, 0, 0);
+    destroy_snap_tbs(d, ts);
+    return -1;
+  }
+
+  if((status & ts->s_mask) != ts->s_match){
+    gettimeofday(&now, NULL);
+    if(cmp_time_katcp(&now, &(ts->s_deadline)) < 0){
+      return 0; /* not yet, try again next tick */
+    }
+
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "snapshot %s did not trigger after %lu polls, status 0x%08x", ts->s_bram, ts->s_polls, status);
+    finish_snap_tbs(d, ts, KATCP_FAIL, NULL, 0, status);
+    destroy_snap_tbs(d, ts);
+    return -1;
+  }
+
+  te = lookup_snap_tbs(d, tr, ts->s_bram);
+  if(te == NULL){
+    finish_snap_tbs(d, ts, KATCP_FAIL, NULL, 0, status);
+    destroy_snap_tbs(d, ts);
+    return -1;
+  }
+
+  buffer = malloc(ts->s_length);
+  if(buffer == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %u bytes for snapshot %s", ts->s_length, ts->s_bram);
+    finish_snap_tbs(d, ts, KATCP_FAIL, NULL, 0, status);
+    destroy_snap_tbs(d, ts);
+    return -1;
+  }
+
+  make_bb_katcl(&start, 0, 0);
+  make_bb_katcl(&amount, ts->s_length, 0);
+
+  result = read_register(d, te, &start, &amount, buffer, ts->s_length);
+  if(result != ts->s_length){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to read %u bytes from snapshot %s", ts->s_length, ts->s_bram);
+    finish_snap_tbs(d, ts, KATCP_FAIL, NULL, 0, status);
+  } else {
+    finish_snap_tbs(d, ts, KATCP_OK, buffer, ts->s_length, status);
+  }
+
+  free(buffer);
+  destroy_snap_tbs(d, ts);
+
+  /* returning failure makes the timer go away */
+  return -1;
+}
+
+int snap_resume_tbs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct katcl_parse *p;
+  char *code, *ptr;
+  unsigned int length, offset, chunk, polls, status;
+
+  chunk = (unsigned long)data;
+  if(chunk <= 0){
+    chunk = TBS_SNAP_CHUNK;
+  }
+
+  code = NULL;
+  ptr = NULL;
+  length = 0;
+  polls = 0;
+  status = 0;
+
+  p = get_parse_notice_katcp(d, n);
+  if(p){
+    code = get_string_parse_katcl(p, 1);
+    polls = get_unsigned_long_parse_katcl(p, 2);
+    status = get_unsigned_long_parse_katcl(p, 3);
+    length = get_buffer_parse_katcl(p, 4, NULL, 0);
+  } else {
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "no message available on wakeup");
+  }
+
+  if((code == NULL) || strcmp(code, KATCP_OK)){
+    prepend_reply_katcp(d);
+    append_string_katcp(d, KATCP_FLAG_STRING, KATCP_FAIL);
+    append_hex_long_katcp(d, KATCP_FLAG_XLONG | KATCP_FLAG_LAST, status);
+    resume_katcp(d);
+    return 0;
+  }
+
+  if(length > 0){
+    ptr = malloc(length);
+    if((ptr == NULL) || (get_buffer_parse_katcl(p, 4, ptr, length) != length)){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to retrieve %u bytes of captured data", length);
+      if(ptr){
+        free(ptr);
+      }
+      extra_response_katcp(d, KATCP_RESULT_FAIL, "allocation");
+      resume_katcp(d);
+      return 0;
+    }
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "snapshot of %u bytes triggered after %u polls", length, polls);
+
+  for(offset = 0; offset < length; offset += chunk){
+    prepend_inform_katcp(d);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, offset);
+    append_buffer_katcp(d, KATCP_FLAG_BUFFER | KATCP_FLAG_LAST, ptr + offset, ((length - offset) > chunk) ? chunk : (length - offset));
+  }
+
+  if(ptr){
+    free(ptr);
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_hex_long_katcp(d, KATCP_FLAG_XLONG, status);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, length);
+
+  resume_katcp(d);
+
+  return 0;
+}
+
+int snap_capture_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_dispatch *dl;
+  struct katcp_notice *nx;
+  struct tbs_snap *ts;
+  struct tbs_raw *tr;
+  struct tbs_entry *te;
+  struct timeval delta;
+  char *bram, *control, *status, *trigger, *end, *buffer;
+  unsigned int timeout, chunk, len;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to acquire raw mode state");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(tr->r_fpga != TBS_FPGA_MAPPED){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fpga not programmed");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc < 4){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a bram, control and status register");
+    return KATCP_RESULT_INVALID;
+  }
+
+  dl = template_shared_katcp(d);
+  if(dl == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to load template");
+    return KATCP_RESULT_FAIL;
+  }
+
+  bram = arg_string_katcp(d, 1);
+  control = arg_string_katcp(d, 2);
+  status = arg_string_katcp(d, 3);
+
+  if((bram == NULL) || (control == NULL) || (status == NULL)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register names inaccessible");
+    return KATCP_RESULT_FAIL;
+  }
+
+  te = lookup_snap_tbs(d, tr, bram);
+  if(te == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(!(te->e_mode & TBS_READABLE)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s is not marked readable", bram);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if((lookup_snap_tbs(d, tr, control) == NULL) || (lookup_snap_tbs(d, tr, status) == NULL)){
+    return KATCP_RESULT_FAIL;
+  }
+
+  ts = create_snap_tbs(bram, control, status);
+  if(ts == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate snapshot state");
+    return KATCP_RESULT_FAIL;
+  }
+
+  /* trigger is mask[:value], satisfied when status & mask == value, value defaults to mask */
+  if(argc > 4){
+    trigger = arg_string_katcp(d, 4);
+    if(trigger){
+      ts->s_mask = strtoul(trigger, &end, 0);
+      if(*end == ':'){
+        ts->s_match = strtoul(end + 1, NULL, 0) & ts->s_mask;
+      } else {
+        ts->s_match = ts->s_mask;
+      }
+    }
+  }
+
+  if(argc > 5){
+    ts->s_arm = arg_unsigned_long_katcp(d, 5);
+  }
+
+  timeout = TBS_SNAP_TIMEOUT_MS;
+  if(argc > 6){
+    timeout = arg_unsigned_long_katcp(d, 6);
+  }
+
+  ts->s_length = te->e_len_base;
+  if(argc > 7){
+    len = arg_unsigned_long_katcp(d, 7);
+    if((len <= 0) || (len > te->e_len_base)){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "capture length %u not within register %s of size %u", len, bram, te->e_len_base);
+      destroy_snap_tbs(d, ts);
+      return KATCP_RESULT_FAIL;
+    }
+    ts->s_length = len;
+  }
+
+  if(ts->s_length <= 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s has no whole bytes to capture", bram);
+    destroy_snap_tbs(d, ts);
+    return KATCP_RESULT_FAIL;
+  }
+
+  chunk = TBS_SNAP_CHUNK;
+  if(argc > 8){
+    chunk = arg_unsigned_long_katcp(d, 8);
+  }
+
+  len = strlen(TBS_SNAP_NOTICE) + strlen(bram) + 1;
+  buffer = malloc(len);
+  if(buffer == NULL){
+    destroy_snap_tbs(d, ts);
+    return KATCP_RESULT_FAIL;
+  }
+  snprintf(buffer, len, "%s%s", TBS_SNAP_NOTICE, bram);
+
+  nx = find_notice_katcp(d, buffer);
+  if(nx){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "a capture of %s is already in progress", bram);
+    free(buffer);
+    destroy_snap_tbs(d, ts);
+    return KATCP_RESULT_FAIL;
+  }
+
+  nx = create_notice_katcp(d, buffer, 0);
+  free(buffer);
+  if(nx == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create notification logic for snapshot");
+    destroy_snap_tbs(d, ts);
+    return KATCP_RESULT_FAIL;
+  }
+
+  /* keep notice alive even if the client goes away before the capture completes */
+  hold_notice_katcp(dl, nx);
+  ts->s_notice = nx;
+
+  if(add_notice_katcp(d, nx, &snap_resume_tbs, (void *)(unsigned long)chunk) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to register callback to resume command");
+    destroy_snap_tbs(dl, ts);
+    return KATCP_RESULT_FAIL;
+  }
+
+  /* arm: a rising edge on the control register starts the capture */
+  if((write_word_snap_tbs(d, tr, control, 0) < 0) || (write_word_snap_tbs(d, tr, control, ts->s_arm) < 0)){
+    remove_notice_katcp(d, nx, &snap_resume_tbs, (void *)(unsigned long)chunk);
+    destroy_snap_tbs(dl, ts);
+    return KATCP_RESULT_FAIL;
+  }
+
+  gettimeofday(&(ts->s_start), NULL);
+  delta.tv_sec = timeout / 1000;
+  delta.tv_usec = (timeout % 1000) * 1000;
+  add_time_katcp(&(ts->s_deadline), &(ts->s_start), &delta);
+
+  delta.tv_sec = 0;
+  delta.tv_usec = TBS_SNAP_POLL_US;
+
+  if(register_every_tv_katcp(dl, &delta, &poll_snap_tbs, ts) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to schedule status polling");
+    remove_notice_katcp(d, nx, &snap_resume_tbs, (void *)(unsigned long)chunk);
+    destroy_snap_tbs(dl, ts);
+    return KATCP_RESULT_FAIL;
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "armed snapshot %s via %s, waiting for 0x%08x under mask 0x%08x in %s", bram, control, ts->s_match, ts->s_mask, status);
+
+  return KATCP_RESULT_PAUSE;
+}
@@ -3,8 +3,12 @@
 
 #include <stdint.h>
 
+#include <sys/time.h>
+
 #include <katcp.h>
+#include <katcl.h>
 #include <avltree.h>
+#include <regmap.h>
 
 #define TBS_MAX_CLIENTS    32
 
@@ -29,6 +33,8 @@
 
 #define TBS_ROACH_CHASSIS  "roach2chassis"
 
+#define TBS_MIRROR_CAPACITY 4096
+
 int setup_raw_tbs(struct katcp_dispatch *d, char *bofdir, int argc, char **argv);
 
 #include "loadbof.h"
@@ -118,6 +124,15 @@ struct tbs_raw
 
   struct katcp_arb *r_chassis;
 
+  struct tbs_hwsweep *r_sweep;
+
+  struct katcl_regmap *r_mirror;
+
+  struct tbs_watchlist *r_watches;
+
+  struct tbs_udp *r_udp;
+  unsigned int r_layout;
+
   struct getap_state **r_taps;
   unsigned int r_instances;
 };
@@ -139,6 +154,10 @@ struct tbs_entry
 struct tbs_hwsensor 
 {
   int h_adc_fd;
+  int h_value;
+  int h_status;
+  int h_changed;
+  struct katcp_acquire *h_acquire;
   int h_min;
   int h_max;
   int h_mult;
@@ -150,8 +169,119 @@ struct tbs_hwsensor
   char *h_unit;
 };
 
+/* all hwmon sensors are read in one sweep, only changes get propagated */
+
+#define TBS_HWMON_INTERVAL       1000
+#define TBS_HWMON_SWEEP_SENSOR   "raw.hwmon.sweep"
+
+struct tbs_hwsweep
+{
+  struct tbs_hwsensor **w_vector;
+  unsigned int w_count;
+  unsigned int w_interval;
+  unsigned long w_changes;
+  struct katcp_acquire *w_timing;
+};
+
 int setup_hwmon_tbs(struct katcp_dispatch *d);
 void destroy_hwsensor_tbs(void *data);
+void destroy_hwsweep_tbs(struct katcp_dispatch *d, struct tbs_hwsweep *hw);
+int hwmon_interval_cmd(struct katcp_dispatch *d, int argc);
+
+/* register watches: one timer samples all watched registers, changes are reported */
+
+#define TBS_WATCH_PERIOD         100
+#define TBS_WATCH_NOTICE         "register-watch-"
+#define TBS_WATCH_INFORM         "#register-change"
+
+struct tbs_watch
+{
+  char *w_name;
+  uint32_t w_mask;
+  uint32_t w_value;
+  int w_valid;
+  unsigned int w_period;
+  struct timeval w_due;
+  struct katcp_notice *w_notice;
+  struct katcp_acquire *w_acquire;
+};
+
+struct tbs_watchlist
+{
+  struct tbs_watch **l_vector;
+  unsigned int l_count;
+  unsigned int l_tick;
+  unsigned long l_changes;
+};
+
+void destroy_watchlist_tbs(struct katcp_dispatch *d, struct tbs_watchlist *tl);
+int register_watch_cmd(struct katcp_dispatch *d, int argc);
+int register_unwatch_cmd(struct katcp_dispatch *d, int argc);
+
+/* udp register access, wire compatible with dmon */
+
+#define TBS_UDP_MAX_PACKET       9728
+#define TBS_UDP_RECORD           10
+
+#define TBS_UDP_READ             0x80000000
+#define TBS_UDP_ADDRESS          0x7fffffff
+
+#define TBS_UDP_OK               0
+#define TBS_UDP_ERR_ADDRESS      1
+#define TBS_UDP_ERR_ACCESS       2
+#define TBS_UDP_ERR_LENGTH       3
+#define TBS_UDP_ERR_DOWN         4
+
+struct tbs_udp_message
+{
+  uint16_t u_sequence;
+  uint32_t u_addr_errcode;
+  uint32_t u_data_length;
+} __attribute__ ((packed));
+
+struct tbs_range
+{
+  unsigned int g_start;
+  unsigned int g_end;
+  unsigned int g_mode;
+};
+
+struct tbs_udp
+{
+  int u_fd;
+  struct katcp_arb *u_arb;
+
+  struct tbs_range *u_ranges;
+  unsigned int u_count;
+  unsigned int u_size;
+  unsigned int u_layout;
+  int u_stale;
+
+  unsigned long u_datagrams;
+  unsigned long u_records;
+  unsigned long u_rejected;
+
+  struct tbs_udp_message u_rx[TBS_UDP_MAX_PACKET / TBS_UDP_RECORD];
+  struct tbs_udp_message u_tx[TBS_UDP_MAX_PACKET / TBS_UDP_RECORD];
+};
+
+int start_udp_tbs(struct katcp_dispatch *d, char *port);
+void destroy_udp_tbs(struct katcp_dispatch *d, struct tbs_udp *tu);
+int udp_info_cmd(struct katcp_dispatch *d, int argc);
+
+/* shared memory export of register directory */
+
+int start_mirror_tbs(struct katcp_dispatch *d, char *name);
+int update_mirror_tbs(struct katcp_dispatch *d);
+void stop_mirror_tbs(struct katcp_dispatch *d, struct tbs_raw *tr);
+
+/* register access shared with other modules */
+
+int read_register(struct katcp_dispatch *d, struct tbs_entry *te, struct katcl_byte_bit *start, struct katcl_byte_bit *amount, void *buffer, unsigned int size);
+
+/* server side snapshot capture */
+
+int snap_capture_cmd(struct katcp_dispatch *d, int argc);
 
 struct tbs_port_data {
   int t_port;
@@ -0,0 +1,396 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* register access over udp, using the compact request format of dmon:
+ * a datagram holds one or more records of sequence, address with the
+ * read bit in the top position and length (or data for writes). Each
+ * record is answered in the same order with the sequence echoed, an
+ * error code in the top byte of the address field and the data word.
+ * Only word aligned addresses inside registered ranges are served
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <katcp.h>
+#include <katpriv.h>
+#include <avltree.h>
+
+#include "tcpborphserver3.h"
+
+#define TBS_UDP_BURST   64
+
+void destroy_udp_tbs(struct katcp_dispatch *d, struct tbs_udp *tu)
+{
+  if(tu == NULL){
+    return;
+  }
+
+  if(tu->u_arb){
+    /* arb owns the file descriptor and closes it */
+    unlink_arb_katcp(d, tu->u_arb);
+    tu->u_arb = NULL;
+    tu->u_fd = (-1);
+  }
+
+  if(tu->u_fd >= 0){
+    close(tu->u_fd);
+    tu->u_fd = (-1);
+  }
+
+  if(tu->u_ranges){
+    free(tu->u_ranges);
+    tu->u_ranges = NULL;
+  }
+
+  tu->u_count = 0;
+  tu->u_size = 0;
+
+  free(tu);
+}
+
+/* range index: rebuilt whenever the register layout changes ******/
+
+static int append_range_tbs(struct tbs_udp *tu, struct tbs_entry *te)
+{
+  struct tbs_range *tmp;
+  unsigned int end;
+
+  if(tu->u_count >= tu->u_size){
+    tmp = realloc(tu->u_ranges, sizeof(struct tbs_range) * (tu->u_size + 64));
+    if(tmp == NULL){
+      return -1;
+    }
+    tu->u_ranges = tmp;
+    tu->u_size += 64;
+  }
+
+  /* registers with a bit offset are not word aligned, leave them to tcp */
+  if(te->e_pos_offset){
+    return 0;
+  }
+
+  end = te->e_pos_base + te->e_len_base + (te->e_len_offset ? 1 : 0);
+
+  tu->u_ranges[tu->u_count].g_start = te->e_pos_base;
+  tu->u_ranges[tu->u_count].g_end = (end + 3) & ~0x3;
+  tu->u_ranges[tu->u_count].g_mode = te->e_mode;
+
+  tu->u_count++;
+
+  return 0;
+}
+
+static int walk_ranges_tbs(struct tbs_udp *tu, struct avl_node *n)
+{
+  int result;
+
+  if(n == NULL){
+    return 0;
+  }
+
+  result = walk_ranges_tbs(tu, n->n_left);
+
+  if(n->n_data){
+    if(append_range_tbs(tu, n->n_data) < 0){
+      result--;
+    }
+  }
+
+  return result + walk_ranges_tbs(tu, n->n_right);
+}
+
+static int compare_range_tbs(const void *a, const void *b)
+{
+  const struct tbs_range *x, *y;
+
+  x = a;
+  y = b;
+
+  if(x->g_start < y->g_start){
+    return -1;
+  }
+  if(x->g_start > y->g_start){
+    return 1;
+  }
+
+  return 0;
+}
+
+static int index_ranges_tbs(struct katcp_dispatch *d, struct tbs_raw *tr, struct tbs_udp *tu)
+{
+  tu->u_count = 0;
+  tu->u_layout = tr->r_layout;
+  tu->u_stale = 0;
+
+  if((tr->r_fpga != TBS_FPGA_MAPPED) || (tr->r_registers == NULL)){
+    return 0;
+  }
+
+  if(walk_ranges_tbs(tu, tr->r_registers->t_root) < 0){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to index all registers for udp access");
+    tu->u_stale = 1;
+  }
+
+  qsort(tu->u_ranges, tu->u_count, sizeof(struct tbs_range), &compare_range_tbs);
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "indexed %u register ranges for udp access", tu->u_count);
+
+  return 0;
+}
+
+/* ranges may overlap, so check every candidate starting at or before address */
+static int check_range_tbs(struct tbs_udp *tu, unsigned int address, unsigned int mode)
+{
+  int low, high, mid, result;
+
+  low = 0;
+  high = (int)(tu->u_count) - 1;
+
+  while(low <= high){
+    mid = (low + high) / 2;
+    if(tu->u_ranges[mid].g_start <= address){
+      low = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+
+  result = TBS_UDP_ERR_ADDRESS;
+
+  for(mid = high; mid >= 0; mid--){
+    if((address + 4) <= tu->u_ranges[mid].g_end){
+      if(tu->u_ranges[mid].g_mode & mode){
+        return TBS_UDP_OK;
+      }
+      result = TBS_UDP_ERR_ACCESS;
+    }
+  }
+
+  return result;
+}
+
+/* request processing *********************************************/
+
+static int serve_record_udp_tbs(struct tbs_raw *tr, struct tbs_udp *tu, struct tbs_udp_message *rx, struct tbs_udp_message *tx)
+{
+  uint32_t word, address, data;
+  int read, code;
+
+  word = ntohl(rx->u_addr_errcode);
+  data = ntohl(rx->u_data_length);
+
+  read = (word & TBS_UDP_READ) ? 1 : 0;
+  address = word & TBS_UDP_ADDRESS;
+
+  tx->u_sequence = rx->u_sequence;
+
+  if(tr->r_fpga != TBS_FPGA_MAPPED){
+    code = TBS_UDP_ERR_DOWN;
+  } else if(address & 0x3){
+    code = TBS_UDP_ERR_ADDRESS;
+  } else if(read && (data > 4)){
+    code = TBS_UDP_ERR_LENGTH;
+  } else if((address + 4) > tr->r_map_size){
+    code = TBS_UDP_ERR_ADDRESS;
+  } else {
+    code = check_range_tbs(tu, address, read ? TBS_READABLE : TBS_WRITABLE);
+  }
+
+  if(code == TBS_UDP_OK){
+    if(read){
+      data = *((uint32_t *)(tr->r_map + address));
+    } else {
+      *((uint32_t *)(tr->r_map + address)) = data;
+    }
+  } else {
+    tu->u_rejected++;
+    data = 0;
+  }
+
+  tx->u_addr_errcode = htonl((code << 24) | (address & 0x00ffffff));
+  tx->u_data_length = htonl(data);
+
+  return code;
+}
+
+int run_udp_tbs(struct katcp_dispatch *d, struct katcp_arb *a, unsigned int mode)
+{
+  struct tbs_udp *tu;
+  struct tbs_raw *tr;
+  struct sockaddr_in sa;
+  socklen_t len;
+  int rr, wr, i, count, burst;
+
+  tu = data_arb_katcp(d, a);
+  if(tu == NULL){
+    return -1;
+  }
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return -1;
+  }
+
+  if(!(mode & KATCP_ARB_READ)){
+    return 0;
+  }
+
+  if(tu->u_stale || (tu->u_layout != tr->r_layout)){
+    index_ranges_tbs(d, tr, tu);
+  }
+
+  for(burst = 0; burst < TBS_UDP_BURST; burst++){
+    len = sizeof(struct sockaddr_in);
+    rr = recvfrom(tu->u_fd, tu->u_rx, sizeof(tu->u_rx), 0, (struct sockaddr *)&sa, &len);
+    if(rr < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          return 0;
+        default :
+          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "udp receive failed: %s", strerror(errno));
+          return 0;
+      }
+    }
+
+    tu->u_datagrams++;
+
+    if((rr <= 0) || (rr % TBS_UDP_RECORD)){
+      log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "discarding malformed udp request of %d bytes from %s", rr, inet_ntoa(sa.sin_addr));
+      tu->u_rejected++;
+      continue;
+    }
+
+    count = rr / TBS_UDP_RECORD;
+    for(i = 0; i < count; i++){
+      serve_record_udp_tbs(tr, tu, &(tu->u_rx[i]), &(tu->u_tx[i]));
+    }
+    tu->u_records += count;
+
+    wr = sendto(tu->u_fd, tu->u_tx, count * TBS_UDP_RECORD, 0, (struct sockaddr *)&sa, len);
+    if(wr < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          break;
+        default :
+          log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to send udp reply to %s: %s", inet_ntoa(sa.sin_addr), strerror(errno));
+          break;
+      }
+    }
+  }
+
+  return 0;
+}
+
+int start_udp_tbs(struct katcp_dispatch *d, char *port)
+{
+  struct tbs_raw *tr;
+  struct tbs_udp *tu;
+  struct sockaddr_in sa;
+  int flags;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return -1;
+  }
+
+  if(tr->r_udp){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "udp register access already enabled");
+    return 0;
+  }
+
+  tu = malloc(sizeof(struct tbs_udp));
+  if(tu == NULL){
+    return -1;
+  }
+
+  tu->u_fd = (-1);
+  tu->u_arb = NULL;
+  tu->u_ranges = NULL;
+  tu->u_count = 0;
+  tu->u_size = 0;
+  tu->u_layout = tr->r_layout - 1; /* force an index on first request */
+  tu->u_stale = 1;
+  tu->u_datagrams = 0;
+  tu->u_records = 0;
+  tu->u_rejected = 0;
+
+  memset(&sa, 0, sizeof(struct sockaddr_in));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_ANY);
+  sa.sin_port = htons(atoi(port));
+
+  tu->u_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if(tu->u_fd < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create udp socket: %s", strerror(errno));
+    destroy_udp_tbs(d, tu);
+    return -1;
+  }
+
+  if(bind(tu->u_fd, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to bind udp port %s: %s", port, strerror(errno));
+    destroy_udp_tbs(d, tu);
+    return -1;
+  }
+
+  flags = fcntl(tu->u_fd, F_GETFL, 0);
+  if((flags < 0) || (fcntl(tu->u_fd, F_SETFL, flags | O_NONBLOCK) < 0)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to make udp socket nonblocking: %s", strerror(errno));
+    destroy_udp_tbs(d, tu);
+    return -1;
+  }
+
+  fcntl(tu->u_fd, F_SETFD, FD_CLOEXEC);
+
+  tu->u_arb = create_arb_katcp(d, "udp-register-access", tu->u_fd, KATCP_ARB_READ, &run_udp_tbs, tu);
+  if(tu->u_arb == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to register udp handler");
+    destroy_udp_tbs(d, tu);
+    return -1;
+  }
+
+  tr->r_udp = tu;
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "serving register access on udp port %s", port);
+
+  return 0;
+}
+
+int udp_info_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct tbs_raw *tr;
+  struct tbs_udp *tu;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to acquire raw mode state");
+    return KATCP_RESULT_FAIL;
+  }
+
+  tu = tr->r_udp;
+  if(tu == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "udp register access not enabled");
+    return KATCP_RESULT_FAIL;
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, tu->u_datagrams);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, tu->u_records);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, tu->u_rejected);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, tu->u_count);
+
+  return KATCP_RESULT_OWN;
+}
@@ -0,0 +1,619 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* register watches: instead of many clients each polling status
+ * registers with ?wordread, the server samples all watched registers
+ * from a single timer and only reports those which changed, either as
+ * #register-change informs to subscribed clients, or as sensor
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include <sys/time.h>
+
+#include <katcp.h>
+#include <katpriv.h>
+#include <katcl.h>
+#include <avltree.h>
+
+#include "tcpborphserver3.h"
+
+/* single watch ****************************************************/
+
+static void destroy_watch_tbs(struct katcp_dispatch *d, struct tbs_watch *tw)
+{
+  if(tw == NULL){
+    return;
+  }
+
+  if(tw->w_notice){
+    release_notice_katcp(d, tw->w_notice);
+    tw->w_notice = NULL;
+  }
+
+  /* acquire is only set for sensors, and those are never removed */
+  tw->w_acquire = NULL;
+
+  if(tw->w_name){
+    free(tw->w_name);
+    tw->w_name = NULL;
+  }
+
+  free(tw);
+}
+
+static struct tbs_watch *create_watch_tbs(struct katcp_dispatch *d, char *name)
+{
+  struct tbs_watch *tw;
+  struct katcp_notice *n;
+  char *buffer;
+  int len;
+
+  tw = malloc(sizeof(struct tbs_watch));
+  if(tw == NULL){
+    return NULL;
+  }
+
+  tw->w_name = NULL;
+  tw->w_mask = 0xffffffff;
+  tw->w_value = 0;
+  tw->w_valid = 0;
+  tw->w_period = TBS_WATCH_PERIOD;
+  tw->w_due.tv_sec = 0;
+  tw->w_due.tv_usec = 0;
+  tw->w_notice = NULL;
+  tw->w_acquire = NULL;
+
+  tw->w_name = strdup(name);
+  if(tw->w_name == NULL){
+    destroy_watch_tbs(d, tw);
+    return NULL;
+  }
+
+  len = strlen(TBS_WATCH_NOTICE) + strlen(name) + 1;
+  buffer = malloc(len);
+  if(buffer == NULL){
+    destroy_watch_tbs(d, tw);
+    return NULL;
+  }
+
+  snprintf(buffer, len, "%s%s", TBS_WATCH_NOTICE, name);
+
+  n = find_notice_katcp(d, buffer);
+  if(n == NULL){
+    n = create_notice_katcp(d, buffer, 0);
+  }
+
+  free(buffer);
+
+  if(n == NULL){
+    destroy_watch_tbs(d, tw);
+    return NULL;
+  }
+
+  hold_notice_katcp(d, n);
+  tw->w_notice = n;
+
+  return tw;
+}
+
+/* collection of watches, one timer ********************************/
+
+void destroy_watchlist_tbs(struct katcp_dispatch *d, struct tbs_watchlist *tl)
+{
+  unsigned int i;
+
+  if(tl == NULL){
+    return;
+  }
+
+  discharge_timer_katcp(d, tl);
+
+  if(tl->l_vector){
+    for(i = 0; i < tl->l_count; i++){
+      /* notices are reclaimed by the library on shutdown, don't touch them here */
+      tl->l_vector[i]->w_notice = NULL;
+      destroy_watch_tbs(d, tl->l_vector[i]);
+    }
+    free(tl->l_vector);
+    tl->l_vector = NULL;
+  }
+
+  tl->l_count = 0;
+
+  free(tl);
+}
+
+static struct tbs_watchlist *create_watchlist_tbs(struct katcp_dispatch *d)
+{
+  struct tbs_watchlist *tl;
+
+  tl = malloc(sizeof(struct tbs_watchlist));
+  if(tl == NULL){
+    return NULL;
+  }
+
+  tl->l_vector = NULL;
+  tl->l_count = 0;
+  tl->l_tick = 0;
+  tl->l_changes = 0;
+
+  return tl;
+}
+
+static struct tbs_watch *find_watch_tbs(struct tbs_watchlist *tl, char *name)
+{
+  unsigned int i;
+
+  if(tl == NULL){
+    return NULL;
+  }
+
+  for(i = 0; i < tl->l_count; i++){
+    if(!strcmp(tl->l_vector[i]->w_name, name)){
+      return tl->l_vector[i];
+    }
+  }
+
+  return NULL;
+}
+
+static int add_watchlist_tbs(struct tbs_watchlist *tl, struct tbs_watch *tw)
+{
+  struct tbs_watch **tmp;
+
+  tmp = realloc(tl->l_vector, sizeof(struct tbs_watch *) * (tl->l_count + 1));
+  if(tmp == NULL){
+    return -1;
+  }
+
+  tl->l_vector = tmp;
+  tl->l_vector[tl->l_count] = tw;
+  tl->l_count++;
+
+  return 0;
+}
+
+static void remove_watchlist_tbs(struct katcp_dispatch *d, struct tbs_watchlist *tl, unsigned int index)
+{
+  destroy_watch_tbs(d, tl->l_vector[index]);
+
+  tl->l_count--;
+  if(index < tl->l_count){
+    tl->l_vector[index] = tl->l_vector[tl->l_count];
+  }
+}
+
+/* sampling logic **************************************************/
+
+static int sample_watch_tbs(struct katcp_dispatch *d, struct tbs_raw *tr, struct tbs_watch *tw, uint32_t *value)
+{
+  struct katcl_byte_bit start, amount;
+  struct tbs_entry *te;
+  uint32_t word;
+
+  if((tr->r_fpga != TBS_FPGA_MAPPED) || (tr->r_registers == NULL)){
+    return -1;
+  }
+
+  te = find_data_avltree(tr->r_registers, tw->w_name);
+  if((te == NULL) || !(te->e_mode & TBS_READABLE)){
+    return -1;
+  }
+
+  make_bb_katcl(&start, 0, 0);
+  if(te->e_len_base >= 4){
+    make_bb_katcl(&amount, 4, 0);
+  } else {
+    make_bb_katcl(&amount, te->e_len_base, te->e_len_offset);
+  }
+
+  word = 0;
+  if(read_register(d, te, &start, &amount, &word, sizeof(uint32_t)) <= 0){
+    return -1;
+  }
+
+  *value = word & tw->w_mask;
+
+  return 0;
+}
+
+static void report_watch_tbs(struct katcp_dispatch *d, struct tbs_watch *tw)
+{
+  struct katcl_parse *p;
+
+  if(tw->w_acquire){
+    set_integer_acquire_katcp(d, tw->w_acquire, tw->w_value);
+  }
+
+  p = create_parse_katcl();
+  if(p == NULL){
+    return;
+  }
+
+  add_plain_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, TBS_WATCH_INFORM);
+  add_string_parse_katcl(p, KATCP_FLAG_STRING, tw->w_name);
+  if(tw->w_valid){
+    add_hex_long_parse_katcl(p, KATCP_FLAG_XLONG | KATCP_FLAG_LAST, tw->w_value);
+  } else {
+    add_plain_parse_katcl(p, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "unavailable");
+  }
+
+  wake_notice_katcp(d, tw->w_notice, p);
+}
+
+static int schedule_watchlist_tbs(struct katcp_dispatch *d, struct tbs_watchlist *tl);
+
+int sample_watchlist_tbs(struct katcp_dispatch *d, void *data)
+{
+  struct tbs_watchlist *tl;
+  struct tbs_watch *tw;
+  struct tbs_raw *tr;
+  struct timeval now, delta;
+  unsigned int i;
+  uint32_t value;
+  int valid, reschedule;
+
+  tl = data;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return -1;
+  }
+
+  gettimeofday(&now, NULL);
+
+  reschedule = 0;
+  i = 0;
+
+  while(i < tl->l_count){
+    tw = tl->l_vector[i];
+
+    /* nobody is interested anymore, plain watches go away once their last subscriber has */
+    if((tw->w_acquire == NULL) && (tw->w_notice->n_count <= 0)){
+      log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "retiring unsubscribed watch on %s", tw->w_name);
+      remove_watchlist_tbs(d, tl, i);
+      reschedule = 1;
+      continue;
+    }
+
+    i++;
+
+    if(cmp_time_katcp(&now, &(tw->w_due)) < 0){
+      continue;
+    }
+
+    delta.tv_sec = tw->w_period / 1000;
+    delta.tv_usec = (tw->w_period % 1000) * 1000;
+    add_time_katcp(&(tw->w_due), &now, &delta);
+
+    valid = (sample_watch_tbs(d, tr, tw, &value) < 0) ? 0 : 1;
+
+    if(valid == tw->w_valid){
+      if((valid == 0) || (value == tw->w_value)){
+        continue;
+      }
+    }
+
+    tw->w_valid = valid;
+    if(valid){
+      tw->w_value = value;
+    }
+
+    tl->l_changes++;
+
+    report_watch_tbs(d, tw);
+  }
+
+  if(tl->l_count <= 0){
+    /* returning failure makes the timer go away, a new watch will set it up again */
+    tl->l_tick = 0;
+    return -1;
+  }
+
+  if(reschedule){
+    schedule_watchlist_tbs(d, tl);
+  }
+
+  return 0;
+}
+
+/* the tick is the shortest period requested, each watch keeps its own due time */
+
+static int schedule_watchlist_tbs(struct katcp_dispatch *d, struct tbs_watchlist *tl)
+{
+  unsigned int i, tick;
+
+  if(tl->l_count <= 0){
+    discharge_timer_katcp(d, tl);
+    tl->l_tick = 0;
+    return 0;
+  }
+
+  tick = UINT_MAX;
+  for(i = 0; i < tl->l_count; i++){
+    if(tl->l_vector[i]->w_period < tick){
+      tick = tl->l_vector[i]->w_period;
+    }
+  }
+
+  if(tick == tl->l_tick){
+    return 0;
+  }
+
+  if(register_every_ms_katcp(d, tick, &sample_watchlist_tbs, tl) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to schedule register watch timer");
+    return -1;
+  }
+
+  tl->l_tick = tick;
+
+  return 0;
+}
+
+/* sensor export ***************************************************/
+
+int extract_watch_tbs(struct katcp_dispatch *d, struct katcp_sensor *sn)
+{
+  struct katcp_integer_acquire *ia;
+  struct katcp_integer_sensor *is;
+  struct katcp_acquire *a;
+  struct tbs_watch *tw;
+
+  a = sn->s_acquire;
+
+  if((a == NULL) || (a->a_type != KATCP_SENSOR_INTEGER) || (sn->s_type != KATCP_SENSOR_INTEGER)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "type mismatch for putative integer sensor %s", sn->s_name);
+    return -1;
+  }
+
+  tw = a->a_local;
+  if(tw == NULL){
+    return -1;
+  }
+
+  is = sn->s_more;
+  ia = a->a_more;
+
+  set_status_sensor_katcp(sn, tw->w_valid ? KATCP_STATUS_NOMINAL : KATCP_STATUS_UNKNOWN);
+
+  is->is_current = ia->ia_current;
+
+  return 0;
+}
+
+static int export_watch_tbs(struct katcp_dispatch *d, struct tbs_watch *tw, char *sensor)
+{
+  struct katcp_acquire *a;
+  char *buffer;
+  int len;
+
+  if(tw->w_acquire){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "watch on %s already exported as a sensor", tw->w_name);
+    return -1;
+  }
+
+  a = setup_integer_acquire_katcp(d, NULL, tw, NULL);
+  if(a == NULL){
+    return -1;
+  }
+
+  len = strlen(tw->w_name) + 32;
+  buffer = malloc(len);
+  if(buffer == NULL){
+    destroy_acquire_katcp(d, a);
+    return -1;
+  }
+  snprintf(buffer, len, "register %s under mask 0x%08x", tw->w_name, tw->w_mask);
+
+  if(register_multi_integer_sensor_katcp(d, TBS_MODE_RAW, sensor, buffer, "none", INT_MIN, INT_MAX, a, &extract_watch_tbs, NULL) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to register sensor %s for register %s", sensor, tw->w_name);
+    free(buffer);
+    destroy_acquire_katcp(d, a);
+    return -1;
+  }
+
+  free(buffer);
+
+  tw->w_acquire = a;
+
+  if(tw->w_valid){
+    set_integer_acquire_katcp(d, a, tw->w_value);
+  }
+
+  return 0;
+}
+
+/* commands ********************************************************/
+
+int watch_inform_tbs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct katcl_parse *p;
+
+  p = get_parse_notice_katcp(d, n);
+  if(p){
+    append_parse_katcp(d, p);
+  }
+
+  /* stay subscribed until told otherwise or the client goes away */
+  return 1;
+}
+
+static int list_watches_tbs(struct katcp_dispatch *d, struct tbs_watchlist *tl)
+{
+  struct tbs_watch *tw;
+  unsigned int i, count;
+
+  count = 0;
+
+  if(tl){
+    for(i = 0; i < tl->l_count; i++){
+      tw = tl->l_vector[i];
+
+      prepend_inform_katcp(d);
+      append_string_katcp(d, KATCP_FLAG_STRING, tw->w_name);
+      append_hex_long_katcp(d, KATCP_FLAG_XLONG, tw->w_mask);
+      append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, tw->w_period);
+      if(tw->w_valid){
+        append_hex_long_katcp(d, KATCP_FLAG_XLONG | KATCP_FLAG_LAST, tw->w_value);
+      } else {
+        append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "unavailable");
+      }
+
+      count++;
+    }
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, count);
+
+  return KATCP_RESULT_OWN;
+}
+
+int register_watch_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_dispatch *dl;
+  struct tbs_raw *tr;
+  struct tbs_watch *tw;
+  char *name, *sensor;
+  unsigned int period;
+  int fresh;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to acquire raw mode state");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc <= 1){
+    return list_watches_tbs(d, tr->r_watches);
+  }
+
+  dl = template_shared_katcp(d);
+  if(dl == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to load template");
+    return KATCP_RESULT_FAIL;
+  }
+
+  name = arg_string_katcp(d, 1);
+  if(name == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to acquire register name");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(tr->r_watches == NULL){
+    tr->r_watches = create_watchlist_tbs(dl);
+    if(tr->r_watches == NULL){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate watch list");
+      return KATCP_RESULT_FAIL;
+    }
+  }
+
+  fresh = 0;
+
+  tw = find_watch_tbs(tr->r_watches, name);
+  if(tw == NULL){
+    tw = create_watch_tbs(dl, name);
+    if(tw == NULL){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate watch for %s", name);
+      return KATCP_RESULT_FAIL;
+    }
+    if(add_watchlist_tbs(tr->r_watches, tw) < 0){
+      destroy_watch_tbs(dl, tw);
+      return KATCP_RESULT_FAIL;
+    }
+    fresh = 1;
+  }
+
+  /* watches are shared, a later request may change mask and period for everybody */
+  if(argc > 2){
+    tw->w_mask = arg_unsigned_long_katcp(d, 2);
+    tw->w_valid = 0; /* force a report with the new mask */
+  }
+
+  if(argc > 3){
+    period = arg_unsigned_long_katcp(d, 3);
+    if(period <= 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "watch period needs to be at least 1ms");
+      return KATCP_RESULT_FAIL;
+    }
+    tw->w_period = period;
+    tw->w_due.tv_sec = 0;
+    tw->w_due.tv_usec = 0;
+  }
+
+  if(argc > 4){
+    sensor = arg_string_katcp(d, 4);
+    if((sensor == NULL) || (export_watch_tbs(dl, tw, sensor) < 0)){
+      return KATCP_RESULT_FAIL;
+    }
+  }
+
+  /* subscriptions are keyed by client, the library matches on data only */
+  if(!has_notice_katcp(d, tw->w_notice, &watch_inform_tbs, d)){
+    if(add_notice_katcp(d, tw->w_notice, &watch_inform_tbs, d) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to subscribe to changes of %s", name);
+      return KATCP_RESULT_FAIL;
+    }
+  }
+
+  if(schedule_watchlist_tbs(dl, tr->r_watches) < 0){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(fresh){
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "watching register %s every %ums under mask 0x%08x", name, tw->w_period, tw->w_mask);
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  if(tw->w_valid){
+    append_hex_long_katcp(d, KATCP_FLAG_XLONG | KATCP_FLAG_LAST, tw->w_value);
+  } else {
+    append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "unavailable");
+  }
+
+  return KATCP_RESULT_OWN;
+}
+
+int register_unwatch_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct tbs_raw *tr;
+  struct tbs_watch *tw;
+  char *name;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to acquire raw mode state");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc <= 1){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a register name");
+    return KATCP_RESULT_INVALID;
+  }
+
+  name = arg_string_katcp(d, 1);
+  if(name == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  tw = find_watch_tbs(tr->r_watches, name);
+  if(tw == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no watch on register %s", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  /* the watch itself is retired by the timer once nobody subscribes */
+  if(remove_notice_katcp(d, tw->w_notice, &watch_inform_tbs, d) < 0){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "not subscribed to changes of %s", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  return KATCP_RESULT_OK;
+}
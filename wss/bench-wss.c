@@ -0,0 +1,561 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* connects many websocket clients to a local wss over loopback,
+ * feeds sensor updates into its standard input and times how long
+ * it takes until every client has received every update. Then sends
+ * masked frames of awkward lengths and checks that wss unmasks them
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define WSS "./wss"
+
+#define BUFFER  8192
+#define BATCH   256
+#define EVENTS  256
+#define TIMEOUT 60000
+
+/* example key and answer from rfc 6455 */
+#define KEY     "dGhlIHNhbXBsZSBub25jZQ=="
+#define ACCEPT  "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo="
+
+struct bench_client {
+  int b_fd;
+  unsigned int b_count;
+  unsigned int b_have;
+  unsigned char b_buf[BUFFER];
+};
+
+static unsigned int echo_lengths[] = { 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 125, 126, 127, 300, 4099, 70000 };
+
+static long elapsed(struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+
+  return ((now.tv_sec - start->tv_sec) * 1000000L) + (now.tv_usec - start->tv_usec);
+}
+
+static int write_all(int fd, void *buffer, unsigned int size)
+{
+  struct pollfd pfd;
+  unsigned int done;
+  int wr;
+
+  done = 0;
+  while(done < size){
+    wr = write(fd, (char *)buffer + done, size - done);
+    if(wr < 0){
+      if((errno != EAGAIN) && (errno != EINTR)){
+        return -1;
+      }
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      if(poll(&pfd, 1, TIMEOUT) <= 0){
+        return -1;
+      }
+    } else {
+      done += wr;
+    }
+  }
+
+  return 0;
+}
+
+static pid_t start_wss(char *port, int *input, int *output)
+{
+  int ip[2], op[2];
+  pid_t pid;
+
+  if(pipe(ip) < 0){
+    return -1;
+  }
+  if(pipe(op) < 0){
+    return -1;
+  }
+
+  fflush(stdout);
+
+  pid = fork();
+  if(pid < 0){
+    return -1;
+  }
+
+  if(pid == 0){
+    dup2(ip[0], STDIN_FILENO);
+    dup2(op[1], STDOUT_FILENO);
+    close(ip[0]);
+    close(ip[1]);
+    close(op[0]);
+    close(op[1]);
+    freopen("/dev/null", "w", stderr); /* wss may be built with debug output */
+    execl(WSS, WSS, "-n", "-p", port, NULL);
+    exit(4);
+  }
+
+  close(ip[0]);
+  close(op[1]);
+
+  *input = ip[1];
+  *output = op[0];
+
+  return pid;
+}
+
+static int connect_client(struct sockaddr_in *sa)
+{
+  int fd, flag;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd < 0){
+    return -1;
+  }
+
+  if(connect(fd, (struct sockaddr *)sa, sizeof(struct sockaddr_in)) < 0){
+    close(fd);
+    return -1;
+  }
+
+  flag = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+  return fd;
+}
+
+static int upgrade_client(struct bench_client *b)
+{
+  char buffer[BUFFER];
+  unsigned int have;
+  int rr;
+
+  have = 0;
+  buffer[0] = '\0';
+
+  while(strstr(buffer, "\r\n\r\n") == NULL){
+    if(have + 1 >= BUFFER){
+      return -1;
+    }
+    rr = read(b->b_fd, buffer + have, BUFFER - have - 1);
+    if(rr <= 0){
+      return -1;
+    }
+    have += rr;
+    buffer[have] = '\0';
+  }
+
+  if(strncmp(buffer, "HTTP/1.1 101", 12) || (strstr(buffer, ACCEPT) == NULL)){
+    fprintf(stderr, "bench: unexpected handshake response\n%s", buffer);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int connect_all(struct bench_client *set, unsigned int count, struct sockaddr_in *sa, int efd)
+{
+  struct epoll_event e;
+  unsigned int i, j, limit;
+  char request[512];
+  int len;
+
+  len = snprintf(request, sizeof(request), "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: %s\r\nSec-WebSocket-Protocol: katcp\r\nSec-WebSocket-Version: 13\r\n\r\n", KEY);
+
+  for(i = 0; i < count; i += BATCH){
+    limit = ((i + BATCH) < count) ? (i + BATCH) : count;
+
+    for(j = i; j < limit; j++){
+      set[j].b_fd = connect_client(sa);
+      if(set[j].b_fd < 0){
+        fprintf(stderr, "bench: unable to connect client %u: %s\n", j, strerror(errno));
+        return -1;
+      }
+      if(write_all(set[j].b_fd, request, len) < 0){
+        return -1;
+      }
+    }
+
+    for(j = i; j < limit; j++){
+      if(upgrade_client(&(set[j])) < 0){
+        fprintf(stderr, "bench: client %u not upgraded\n", j);
+        return -1;
+      }
+
+      fcntl(set[j].b_fd, F_SETFL, O_NONBLOCK);
+
+      e.events = EPOLLIN;
+      e.data.ptr = &(set[j]);
+      if(epoll_ctl(efd, EPOLL_CTL_ADD, set[j].b_fd, &e) < 0){
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static char **make_updates(unsigned int count, char **input, unsigned int *size)
+{
+  char **lines;
+  unsigned int i, total;
+  int len;
+
+  lines = malloc(sizeof(char *) * count);
+  if(lines == NULL){
+    return NULL;
+  }
+
+  total = 0;
+  for(i = 0; i < count; i++){
+    if(i % 50){
+      len = asprintf(&(lines[i]), "#sensor-status %u.%03u 1 rack%02u.board%02u.temperature nominal %u.%u", 1330000000 + i, i % 1000, i % 7, i % 13, 30 + (i % 20), i % 10);
+    } else {
+      /* now and then something long enough to need a 16 bit length */
+      len = asprintf(&(lines[i]), "#sensor-list rack%02u.board.status a\\_somewhat\\_longer\\_description\\_of\\_a\\_sensor\\_which\\_pushes\\_the\\_frame\\_past\\_the\\_short\\_length\\_encoding none discrete nominal warn error failure unknown", i % 7);
+    }
+    if(len < 0){
+      return NULL;
+    }
+    total += len + 1;
+  }
+
+  *input = malloc(total);
+  if(*input == NULL){
+    return NULL;
+  }
+
+  *size = 0;
+  for(i = 0; i < count; i++){
+    len = strlen(lines[i]);
+    memcpy(*input + *size, lines[i], len);
+    (*input)[*size + len] = '\n';
+    *size += len + 1;
+  }
+
+  return lines;
+}
+
+/* returns the number of complete clients, -1 on a bad frame */
+static int receive_client(struct bench_client *b, char **lines, unsigned int updates)
+{
+  unsigned int offset, need, payload;
+  unsigned char *data;
+  int rr;
+
+  for(;;){
+    rr = read(b->b_fd, b->b_buf + b->b_have, BUFFER - b->b_have);
+    if(rr < 0){
+      if((errno == EAGAIN) || (errno == EINTR)){
+        return 0;
+      }
+      return -1;
+    }
+    if(rr == 0){
+      fprintf(stderr, "bench: client on fd %d disconnected after %u updates\n", b->b_fd, b->b_count);
+      return -1;
+    }
+
+    b->b_have += rr;
+
+    offset = 0;
+    for(;;){
+      if((b->b_have - offset) < 2){
+        break;
+      }
+      data = b->b_buf + offset;
+      if((data[0] != 0x81) || (data[1] & 0x80)){
+        fprintf(stderr, "bench: bad frame header 0x%02x 0x%02x\n", data[0], data[1]);
+        return -1;
+      }
+      payload = data[1] & 0x7f;
+      need = 2;
+      if(payload == 126){
+        if((b->b_have - offset) < 4){
+          break;
+        }
+        payload = (data[2] << 8) | data[3];
+        need = 4;
+      } else if(payload == 127){
+        fprintf(stderr, "bench: unexpectedly large frame\n");
+        return -1;
+      }
+      if((b->b_have - offset) < (need + payload)){
+        break;
+      }
+
+      if((b->b_count >= updates) || (strlen(lines[b->b_count]) != payload) || memcmp(lines[b->b_count], data + need, payload)){
+        fprintf(stderr, "bench: update %u garbled\n", b->b_count);
+        return -1;
+      }
+
+      b->b_count++;
+      offset += need + payload;
+    }
+
+    if(offset > 0){
+      b->b_have -= offset;
+      memmove(b->b_buf, b->b_buf + offset, b->b_have);
+    }
+  }
+}
+
+static int check_unmask(struct bench_client *b, int output)
+{
+  unsigned char header[14], mask[4];
+  unsigned int i, j, len, hlen, total, have;
+  char *payload, *expect, *got;
+  struct pollfd pfd;
+  int rr, result;
+
+  total = 0;
+  for(i = 0; i < sizeof(echo_lengths) / sizeof(unsigned int); i++){
+    total += echo_lengths[i] + 1;
+  }
+
+  expect = malloc(total);
+  got = malloc(total);
+  payload = malloc(total);
+  if((expect == NULL) || (got == NULL) || (payload == NULL)){
+    return -1;
+  }
+
+  have = 0;
+  for(i = 0; i < sizeof(echo_lengths) / sizeof(unsigned int); i++){
+    len = echo_lengths[i];
+
+    for(j = 0; j < len; j++){
+      expect[have + j] = 'a' + ((i + j) % 26);
+    }
+    expect[have + len] = '\n';
+
+    for(j = 0; j < 4; j++){
+      mask[j] = random() & 0xff;
+    }
+
+    header[0] = 0x81;
+    if(len < 126){
+      header[1] = 0x80 | len;
+      hlen = 2;
+    } else if(len <= 0xffff){
+      header[1] = 0x80 | 126;
+      header[2] = (len >> 8) & 0xff;
+      header[3] = len & 0xff;
+      hlen = 4;
+    } else {
+      header[1] = 0x80 | 127;
+      for(j = 0; j < 8; j++){
+        header[2 + j] = ((unsigned long long)len >> (56 - (j * 8))) & 0xff;
+      }
+      hlen = 10;
+    }
+    memcpy(header + hlen, mask, 4);
+    hlen += 4;
+
+    for(j = 0; j < len; j++){
+      payload[j] = expect[have + j] ^ mask[j % 4];
+    }
+
+    if(write_all(b->b_fd, header, hlen) < 0){
+      return -1;
+    }
+    if(write_all(b->b_fd, payload, len) < 0){
+      return -1;
+    }
+
+    have += len + 1;
+  }
+
+  have = 0;
+  while(have < total){
+    pfd.fd = output;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, TIMEOUT) <= 0){
+      fprintf(stderr, "bench: only %u of %u unmasked bytes arrived\n", have, total);
+      return -1;
+    }
+    rr = read(output, got + have, total - have);
+    if(rr <= 0){
+      return -1;
+    }
+    have += rr;
+  }
+
+  result = memcmp(expect, got, total) ? -1 : 0;
+
+  free(expect);
+  free(got);
+  free(payload);
+
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  struct bench_client *set, *b;
+  struct epoll_event events[EVENTS], e;
+  struct sockaddr_in sa;
+  struct timeval start;
+  struct rlimit rl;
+  struct rusage ru;
+  unsigned int clients, updates, i, size, sent, done;
+  char port[16], **lines, *input;
+  int efd, fd, wfd, rfd, count, rr, status, failed;
+  long took;
+  pid_t pid;
+
+  clients = 5000;
+  updates = 1000;
+
+  if(argc > 1){
+    clients = atoi(argv[1]);
+  }
+  if(argc > 2){
+    updates = atoi(argv[2]);
+  }
+
+  if((clients <= 0) || (updates <= 0)){
+    fprintf(stderr, "usage: %s [clients [updates]]\n", argv[0]);
+    return 2;
+  }
+
+  if(getrlimit(RLIMIT_NOFILE, &rl) == 0){
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if(rl.rlim_cur < clients + 64){
+      fprintf(stderr, "bench: file descriptor limit of %lu too low for %u clients\n", (unsigned long)rl.rlim_cur, clients);
+      return 2;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  lines = make_updates(updates, &input, &size);
+  set = calloc(clients, sizeof(struct bench_client));
+  if((lines == NULL) || (set == NULL)){
+    return 2;
+  }
+
+  snprintf(port, sizeof(port), "%d", 20000 + (getpid() % 20000));
+
+  memset(&sa, 0, sizeof(struct sockaddr_in));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(atoi(port));
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  pid = start_wss(port, &wfd, &rfd);
+  if(pid < 0){
+    return 2;
+  }
+
+  for(i = 0; i < 50; i++){
+    fd = connect_client(&sa);
+    if(fd >= 0){
+      close(fd);
+      break;
+    }
+    usleep(100000);
+  }
+
+  efd = epoll_create(EVENTS);
+  if(efd < 0){
+    return 2;
+  }
+
+  gettimeofday(&start, NULL);
+
+  failed = 0;
+
+  if(connect_all(set, clients, &sa, efd) < 0){
+    failed = 1;
+  } else {
+    took = elapsed(&start);
+    printf("bench: %u clients connected and upgraded in %ldms\n", clients, took / 1000);
+
+    fcntl(wfd, F_SETFL, O_NONBLOCK);
+
+    e.events = EPOLLOUT;
+    e.data.ptr = NULL;
+    epoll_ctl(efd, EPOLL_CTL_ADD, wfd, &e);
+
+    sent = 0;
+    done = 0;
+
+    gettimeofday(&start, NULL);
+
+    while((done < clients) && !failed){
+      count = epoll_wait(efd, events, EVENTS, TIMEOUT);
+      if(count <= 0){
+        fprintf(stderr, "bench: stalled with %u of %u clients complete\n", done, clients);
+        failed = 1;
+        break;
+      }
+
+      for(i = 0; i < count; i++){
+        b = events[i].data.ptr;
+        if(b == NULL){
+          rr = write(wfd, input + sent, size - sent);
+          if(rr > 0){
+            sent += rr;
+          }
+          if(sent >= size){
+            epoll_ctl(efd, EPOLL_CTL_DEL, wfd, NULL);
+          }
+        } else if(b->b_count < updates){
+          if(receive_client(b, lines, updates) < 0){
+            failed = 1;
+            break;
+          }
+          if(b->b_count >= updates){
+            done++;
+          }
+        }
+      }
+    }
+
+    took = elapsed(&start);
+
+    if(!failed){
+      printf("bench: %u clients received %u updates each in %ldms, %.0f frames per second\n", clients, updates, took / 1000, ((double)clients * updates * 1000000.0) / (took ? took : 1));
+
+      if(check_unmask(&(set[0]), rfd) < 0){
+        fprintf(stderr, "bench: masked frames not decoded correctly\n");
+        failed = 1;
+      } else {
+        printf("bench: %u masked frames of up to %u bytes decoded correctly\n", (unsigned int)(sizeof(echo_lengths) / sizeof(unsigned int)), echo_lengths[sizeof(echo_lengths) / sizeof(unsigned int) - 1]);
+      }
+    }
+  }
+
+  kill(pid, SIGTERM);
+  if(wait4(pid, &status, 0, &ru) == pid){
+    printf("bench: server busy for %ldms\n", ((ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000L) + ((ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000));
+  }
+
+  for(i = 0; i < clients; i++){
+    if(set[i].b_fd > 0){
+      close(set[i].b_fd);
+    }
+  }
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,1436 @@
+/* katcp bridge for wss: browsers send katcp requests as text frames,
+ * these share a single upstream connection. Sensor subscriptions of
+ * all sessions are merged into one ?sensor-sampling per sensor with
+ * the fastest strategy anybody needs, and each session is then fed
+ * from that according to its own strategy and a rate limit
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include <katcp.h>
+#include <katcl.h>
+#include <katpriv.h>
+#include <netc.h>
+#include <avltree.h>
+
+#include "server.h"
+#include "bridge.h"
+
+#define BRIDGE_RETRY        1000   /* ms between attempts to reach upstream */
+#define BRIDGE_VECTOR         16   /* most arguments taken from a browser request */
+
+#define BRIDGE_DOWN            0
+#define BRIDGE_CONNECTING      1
+#define BRIDGE_UP              2
+
+#define STRATEGY_NONE          0
+#define STRATEGY_AUTO          1
+#define STRATEGY_EVENT         2
+#define STRATEGY_PERIOD        3
+#define STRATEGY_DIFF          4
+#define STRATEGY_RATE          5
+
+static char *strategy_names_ws[] = { "none", "auto", "event", "period", "differential", "event-rate", NULL };
+static unsigned int strategy_params_ws[] = { 0, 0, 0, 1, 1, 2 };
+
+struct bridge_subscription_ws;
+
+struct bridge_sensor_ws {
+  char *n_name;
+
+  int n_strategy;                /* as last requested upstream */
+  struct timeval n_period;
+  double n_delta;
+  unsigned int n_outstanding;
+  int n_confirmed;
+
+  struct ws_message *n_last;     /* latest status, framed once */
+  int n_code;
+  double n_value;
+
+  struct bridge_subscription_ws **n_subs;
+  unsigned int n_count;
+};
+
+struct bridge_session_ws {
+  struct ws_client *e_client;
+
+  struct bridge_subscription_ws **e_subs;
+  unsigned int e_count;
+};
+
+struct bridge_subscription_ws {
+  struct bridge_sensor_ws *u_sensor;
+  struct bridge_session_ws *u_session;
+
+  int u_strategy;
+  struct timeval u_short;        /* least spacing between updates */
+  struct timeval u_long;         /* period, or most spacing for event-rate */
+  double u_delta;
+
+  char *u_args[2];
+  char *u_request;               /* reply owed to the browser, NULL once sent */
+
+  int u_pending;
+  int u_code;
+  double u_value;
+  struct timeval u_sent;
+  struct timeval u_due;
+};
+
+struct bridge_request_ws {
+  char *r_name;
+  struct bridge_session_ws *r_session;
+  struct bridge_sensor_ws *r_sensor;
+  struct bridge_request_ws *r_next;
+};
+
+struct ws_bridge {
+  struct ws_server *b_server;
+  char *b_upstream;
+
+  struct katcl_line *b_line;
+  int b_state;
+  struct timeval b_retry;
+
+  struct timeval b_rate;
+
+  struct avl_tree *b_tree;
+  struct bridge_sensor_ws **b_sensors;
+  unsigned int b_count;
+
+  struct bridge_request_ws *b_head;
+  struct bridge_request_ws *b_tail;
+
+  int b_wake_set;
+  struct timeval b_wake;
+
+  char *b_buffer;
+  unsigned int b_size;
+};
+
+/* text helpers *****************************************************/
+
+static int grow_bridge_ws(struct ws_bridge *b, unsigned int need)
+{
+  char *ptr;
+  unsigned int size;
+
+  if (need <= b->b_size)
+    return 0;
+
+  size = b->b_size ? b->b_size : 256;
+  while (size < need)
+    size *= 2;
+
+  ptr = realloc(b->b_buffer, size);
+  if (ptr == NULL)
+    return -1;
+
+  b->b_buffer = ptr;
+  b->b_size   = size;
+
+  return 0;
+}
+
+static int escape_bridge_ws(struct ws_bridge *b, unsigned int *used, char *string)
+{
+  unsigned int i, len;
+  char *out;
+
+  len = strlen(string);
+
+  /* worst case every character doubles, plus separator and terminator */
+  if (grow_bridge_ws(b, *used + (len * 2) + 4) < 0)
+    return -1;
+
+  out = b->b_buffer + *used;
+
+  if (*used > 0)
+    *out++ = ' ';
+
+  if (len == 0){
+    *out++ = '\\';
+    *out++ = '@';
+  }
+
+  for (i=0; i<len; i++){
+    switch (string[i]){
+      case '\\' : *out++ = '\\'; *out++ = '\\'; break;
+      case ' '  : *out++ = '\\'; *out++ = '_';  break;
+      case '\n' : *out++ = '\\'; *out++ = 'n';  break;
+      case '\r' : *out++ = '\\'; *out++ = 'r';  break;
+      case '\t' : *out++ = '\\'; *out++ = 't';  break;
+      case 27   : *out++ = '\\'; *out++ = 'e';  break;
+      default   : *out++ = string[i];           break;
+    }
+  }
+
+  *out = '\0';
+  *used = out - b->b_buffer;
+
+  return 0;
+}
+
+static int render_vector_bridge_ws(struct ws_bridge *b, char **vector, unsigned int count)
+{
+  unsigned int i, used;
+
+  used = 0;
+  for (i=0; i<count; i++){
+    if (escape_bridge_ws(b, &used, vector[i]) < 0)
+      return -1;
+  }
+
+  return used;
+}
+
+static int render_line_bridge_ws(struct ws_bridge *b, struct katcl_line *l)
+{
+  unsigned int i, count, used;
+  char *ptr;
+
+  count = arg_count_katcl(l);
+  used  = 0;
+
+  for (i=0; i<count; i++){
+    ptr = arg_string_katcl(l, i);
+    if (escape_bridge_ws(b, &used, ptr ? ptr : "") < 0)
+      return -1;
+  }
+
+  return used;
+}
+
+static unsigned int split_bridge_ws(char *line, char **vector, unsigned int size)
+{
+  unsigned int count;
+  char *in, *out;
+
+  count = 0;
+  in = line;
+
+  for (;;){
+    while ((*in == ' ') || (*in == '\t'))
+      in++;
+
+    if ((*in == '\0') || (count >= size))
+      return count;
+
+    vector[count++] = in;
+    out = in;
+
+    while ((*in != '\0') && (*in != ' ') && (*in != '\t')){
+      if ((in[0] == '\\') && (in[1] != '\0')){
+        in++;
+        switch (*in){
+          case '_' : *out++ = ' ';  break;
+          case 'n' : *out++ = '\n'; break;
+          case 'r' : *out++ = '\r'; break;
+          case 't' : *out++ = '\t'; break;
+          case 'e' : *out++ = 27;   break;
+          case '@' :                break;
+          default  : *out++ = *in;  break;
+        }
+        in++;
+      } else {
+        *out++ = *in++;
+      }
+    }
+
+    if (*in != '\0')
+      in++;
+
+    *out = '\0';
+  }
+}
+
+static int tell_session_bridge_ws(struct ws_bridge *b, struct bridge_session_ws *e, char **vector, unsigned int count)
+{
+  int len;
+
+  if (e == NULL)
+    return 0;
+
+  len = render_vector_bridge_ws(b, vector, count);
+  if (len < 0)
+    return -1;
+
+  return deliver_text_ws(e->e_client, b->b_buffer, len);
+}
+
+static int parse_time_bridge_ws(struct timeval *tv, char *string)
+{
+  double value;
+  char *end;
+
+  value = strtod(string, &end);
+  if ((end == string) || (*end != '\0') || (value < 0.0))
+    return -1;
+
+#if KATCP_PROTOCOL_MAJOR_VERSION < 5
+  value /= 1000.0;
+#endif
+
+  tv->tv_sec  = value;
+  tv->tv_usec = (value - tv->tv_sec) * 1000000.0;
+
+  return 0;
+}
+
+/* time keeping *****************************************************/
+
+static void wake_bridge_ws(struct ws_bridge *b, struct timeval *when)
+{
+  if (!b->b_wake_set || (cmp_time_katcp(when, &(b->b_wake)) < 0)){
+    b->b_wake.tv_sec  = when->tv_sec;
+    b->b_wake.tv_usec = when->tv_usec;
+    b->b_wake_set = 1;
+  }
+}
+
+static int ms_until_bridge_ws(struct timeval *now, struct timeval *when)
+{
+  struct timeval delta;
+
+  if (cmp_time_katcp(when, now) <= 0)
+    return 0;
+
+  sub_time_katcp(&delta, when, now);
+
+  return (delta.tv_sec * 1000) + ((delta.tv_usec + 999) / 1000);
+}
+
+/* upstream connection **********************************************/
+
+static int flush_upstream_bridge_ws(struct ws_bridge *b);
+static void down_upstream_bridge_ws(struct ws_bridge *b, char *reason);
+
+static int push_request_bridge_ws(struct ws_bridge *b, char *name, struct bridge_session_ws *e, struct bridge_sensor_ws *n)
+{
+  struct bridge_request_ws *r;
+
+  r = malloc(sizeof(struct bridge_request_ws));
+  if (r == NULL)
+    return -1;
+
+  r->r_name = strdup(name);
+  if (r->r_name == NULL){
+    free(r);
+    return -1;
+  }
+
+  r->r_session = e;
+  r->r_sensor  = n;
+  r->r_next    = NULL;
+
+  if (b->b_tail){
+    b->b_tail->r_next = r;
+  } else {
+    b->b_head = r;
+  }
+  b->b_tail = r;
+
+  return 0;
+}
+
+static struct bridge_request_ws *find_request_bridge_ws(struct ws_bridge *b, char *name, int unlink)
+{
+  struct bridge_request_ws *r, *prev;
+
+  prev = NULL;
+  for (r = b->b_head; r; r = r->r_next){
+    if (!strcmp(r->r_name, name))
+      break;
+    prev = r;
+  }
+
+  if ((r == NULL) || !unlink)
+    return r;
+
+  if (prev){
+    prev->r_next = r->r_next;
+  } else {
+    b->b_head = r->r_next;
+  }
+  if (b->b_tail == r)
+    b->b_tail = prev;
+
+  r->r_next = NULL;
+
+  return r;
+}
+
+static void destroy_request_bridge_ws(struct bridge_request_ws *r)
+{
+  if (r){
+    if (r->r_name)
+      free(r->r_name);
+    free(r);
+  }
+}
+
+static int send_upstream_bridge_ws(struct ws_bridge *b, char **vector, unsigned int count)
+{
+  unsigned int i;
+  int flags;
+
+  if (b->b_state != BRIDGE_UP)
+    return -1;
+
+  for (i=0; i<count; i++){
+    flags = KATCP_FLAG_BUFFER;
+    if (i == 0)
+      flags |= KATCP_FLAG_FIRST;
+    if ((i + 1) == count)
+      flags |= KATCP_FLAG_LAST;
+
+    if (append_buffer_katcl(b->b_line, flags, vector[i], strlen(vector[i])) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* merge all subscriptions to a sensor and ask upstream if that changed */
+static int sample_sensor_bridge_ws(struct ws_bridge *b, struct bridge_sensor_ws *n)
+{
+  struct bridge_subscription_ws *u;
+  struct timeval period;
+  double delta;
+  unsigned int i, periods, diffs;
+  int strategy;
+  char param[32], *vector[4];
+
+  periods  = 0;
+  diffs    = 0;
+  strategy = STRATEGY_NONE;
+  delta    = 0.0;
+  period.tv_sec  = 0;
+  period.tv_usec = 0;
+
+  for (i=0; i<n->n_count; i++){
+    u = n->n_subs[i];
+    switch (u->u_strategy){
+      case STRATEGY_PERIOD :
+        if ((periods == 0) || (cmp_time_katcp(&(u->u_long), &period) < 0)){
+          period.tv_sec  = u->u_long.tv_sec;
+          period.tv_usec = u->u_long.tv_usec;
+        }
+        periods++;
+        break;
+      case STRATEGY_DIFF :
+        if ((diffs == 0) || (u->u_delta < delta)){
+          delta = u->u_delta;
+        }
+        diffs++;
+        break;
+      default :
+        strategy = STRATEGY_EVENT;
+        break;
+    }
+  }
+
+  /* periodic sessions are served from the cached value, so every change is enough for them too */
+  if (strategy == STRATEGY_NONE){
+    if (periods && diffs){
+      strategy = STRATEGY_EVENT;
+    } else if (diffs){
+      strategy = STRATEGY_DIFF;
+    } else if (periods){
+      strategy = STRATEGY_PERIOD;
+    }
+  }
+
+  if ((strategy == n->n_strategy) &&
+      ((strategy != STRATEGY_PERIOD) || !cmp_time_katcp(&period, &(n->n_period))) &&
+      ((strategy != STRATEGY_DIFF) || (delta == n->n_delta)) &&
+      ((strategy == STRATEGY_NONE) || n->n_confirmed || n->n_outstanding)){
+    return 0;
+  }
+
+  n->n_strategy       = strategy;
+  n->n_period.tv_sec  = period.tv_sec;
+  n->n_period.tv_usec = period.tv_usec;
+  n->n_delta          = delta;
+  n->n_confirmed      = 0;
+
+  if (b->b_state != BRIDGE_UP)
+    return 0;
+
+  vector[0] = "?sensor-sampling";
+  vector[1] = n->n_name;
+  vector[2] = strategy_names_ws[strategy];
+
+  switch (strategy){
+    case STRATEGY_PERIOD :
+#if KATCP_PROTOCOL_MAJOR_VERSION >= 5
+      snprintf(param, sizeof(param), "%lu.%06lu", (unsigned long) period.tv_sec, (unsigned long) period.tv_usec);
+#else
+      snprintf(param, sizeof(param), "%lu", (unsigned long)((period.tv_sec * 1000) + (period.tv_usec / 1000)));
+#endif
+      vector[3] = param;
+      break;
+    case STRATEGY_DIFF :
+      snprintf(param, sizeof(param), "%g", delta);
+      vector[3] = param;
+      break;
+    default :
+      vector[3] = NULL;
+      break;
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "bridge: sampling %s upstream with %s %s\n", n->n_name, vector[2], vector[3] ? vector[3] : "");
+#endif
+
+  if (send_upstream_bridge_ws(b, vector, vector[3] ? 4 : 3) < 0)
+    return -1;
+
+  if (push_request_bridge_ws(b, vector[0] + 1, NULL, n) < 0)
+    return -1;
+
+  n->n_outstanding++;
+
+  return 0;
+}
+
+static int connect_upstream_bridge_ws(struct ws_bridge *b)
+{
+  struct timeval now, delta;
+  int fd;
+
+  gettimeofday(&now, NULL);
+  component_time_katcp(&delta, BRIDGE_RETRY);
+  add_time_katcp(&(b->b_retry), &now, &delta);
+
+  fd = net_connect(b->b_upstream, 0, NETC_ASYNC);
+  if (fd < 0){
+#ifdef DEBUG
+    fprintf(stderr, "bridge: unable to initiate connection to %s\n", b->b_upstream);
+#endif
+    return -1;
+  }
+
+  b->b_line = create_katcl(fd);
+  if (b->b_line == NULL){
+    close(fd);
+    return -1;
+  }
+
+  if (watch_extra_ws(b->b_server, fd, EPOLLOUT) < 0){
+    destroy_katcl(b->b_line, 1);
+    b->b_line = NULL;
+    return -1;
+  }
+
+  b->b_state = BRIDGE_CONNECTING;
+
+  return 0;
+}
+
+static void up_upstream_bridge_ws(struct ws_bridge *b)
+{
+  unsigned int i;
+
+#ifdef DEBUG
+  fprintf(stderr, "bridge: connected to %s\n", b->b_upstream);
+#endif
+
+  b->b_state = BRIDGE_UP;
+
+  for (i=0; i<b->b_count; i++){
+    b->b_sensors[i]->n_confirmed   = 0;
+    b->b_sensors[i]->n_outstanding = 0;
+    sample_sensor_bridge_ws(b, b->b_sensors[i]);
+  }
+
+  flush_upstream_bridge_ws(b);
+}
+
+static void down_upstream_bridge_ws(struct ws_bridge *b, char *reason)
+{
+  struct bridge_request_ws *r;
+  unsigned int i;
+  char name[128], *vector[3];
+
+#ifdef DEBUG
+  fprintf(stderr, "bridge: lost %s: %s\n", b->b_upstream, reason);
+#endif
+
+  watch_extra_ws(b->b_server, -1, 0);
+
+  if (b->b_line){
+    destroy_katcl(b->b_line, 1);
+    b->b_line = NULL;
+  }
+
+  b->b_state = BRIDGE_DOWN;
+
+  /* requests in flight will not be answered now */
+  while ((r = b->b_head) != NULL){
+    b->b_head = r->r_next;
+    if (r->r_session){
+      snprintf(name, sizeof(name), "!%s", r->r_name);
+      vector[0] = name;
+      vector[1] = KATCP_FAIL;
+      vector[2] = reason;
+      tell_session_bridge_ws(b, r->r_session, vector, 3);
+    }
+    destroy_request_bridge_ws(r);
+  }
+  b->b_tail = NULL;
+
+  for (i=0; i<b->b_count; i++){
+    b->b_sensors[i]->n_confirmed   = 0;
+    b->b_sensors[i]->n_outstanding = 0;
+  }
+}
+
+static int flush_upstream_bridge_ws(struct ws_bridge *b)
+{
+  uint32_t events;
+
+  if (b->b_state != BRIDGE_UP)
+    return 0;
+
+  if (write_katcl(b->b_line) < 0){
+    down_upstream_bridge_ws(b, strerror(error_katcl(b->b_line)));
+    return -1;
+  }
+
+  events = EPOLLIN;
+  if (flushing_katcl(b->b_line))
+    events |= EPOLLOUT;
+
+  return watch_extra_ws(b->b_server, fileno_katcl(b->b_line), events);
+}
+
+/* subscriptions ****************************************************/
+
+static struct bridge_sensor_ws *find_sensor_bridge_ws(struct ws_bridge *b, char *name, int create)
+{
+  struct bridge_sensor_ws *n, **tmp;
+
+  n = find_data_avltree(b->b_tree, name);
+  if (n || !create)
+    return n;
+
+  tmp = realloc(b->b_sensors, sizeof(struct bridge_sensor_ws *) * (b->b_count + 1));
+  if (tmp == NULL)
+    return NULL;
+  b->b_sensors = tmp;
+
+  n = malloc(sizeof(struct bridge_sensor_ws));
+  if (n == NULL)
+    return NULL;
+
+  n->n_name = strdup(name);
+  if (n->n_name == NULL){
+    free(n);
+    return NULL;
+  }
+
+  n->n_strategy       = STRATEGY_NONE;
+  n->n_period.tv_sec  = 0;
+  n->n_period.tv_usec = 0;
+  n->n_delta          = 0.0;
+  n->n_outstanding    = 0;
+  n->n_confirmed      = 0;
+  n->n_last           = NULL;
+  n->n_code           = KATCP_STATUS_UNKNOWN;
+  n->n_value          = 0.0;
+  n->n_subs           = NULL;
+  n->n_count          = 0;
+
+  if (store_named_node_avltree(b->b_tree, n->n_name, n) < 0){
+    free(n->n_name);
+    free(n);
+    return NULL;
+  }
+
+  b->b_sensors[b->b_count++] = n;
+
+  return n;
+}
+
+static void send_subscription_bridge_ws(struct ws_bridge *b, struct bridge_subscription_ws *u, struct timeval *now)
+{
+  struct bridge_sensor_ws *n;
+
+  n = u->u_sensor;
+
+  u->u_pending = 0;
+  u->u_sent.tv_sec  = now->tv_sec;
+  u->u_sent.tv_usec = now->tv_usec;
+
+  if (u->u_strategy == STRATEGY_RATE){
+    add_time_katcp(&(u->u_due), now, &(u->u_long));
+    wake_bridge_ws(b, &(u->u_due));
+  }
+
+  if (n->n_last == NULL)
+    return;
+
+  u->u_code  = n->n_code;
+  u->u_value = n->n_value;
+
+  deliver_message_ws(u->u_session->e_client, n->n_last);
+}
+
+static void confirm_subscription_bridge_ws(struct ws_bridge *b, struct bridge_subscription_ws *u)
+{
+  struct timeval now;
+  char *vector[5];
+  unsigned int count;
+
+  if (u->u_request == NULL)
+    return;
+
+  vector[0] = u->u_request;
+  vector[1] = KATCP_OK;
+  vector[2] = u->u_sensor->n_name;
+  vector[3] = strategy_names_ws[u->u_strategy];
+  count = 4;
+  if (u->u_args[0]){
+    vector[count++] = u->u_args[0];
+  }
+  if (u->u_args[1]){
+    vector[count++] = u->u_args[1];
+  }
+
+  tell_session_bridge_ws(b, u->u_session, vector, count);
+
+  free(u->u_request);
+  u->u_request = NULL;
+
+  /* like a katcp server, follow the reply with the current value */
+  gettimeofday(&now, NULL);
+  send_subscription_bridge_ws(b, u, &now);
+
+  if (u->u_strategy == STRATEGY_PERIOD){
+    add_time_katcp(&(u->u_due), &now, &(u->u_long));
+    wake_bridge_ws(b, &(u->u_due));
+  }
+}
+
+static void destroy_subscription_bridge_ws(struct bridge_subscription_ws *u)
+{
+  if (u){
+    if (u->u_args[0])
+      free(u->u_args[0]);
+    if (u->u_args[1])
+      free(u->u_args[1]);
+    if (u->u_request)
+      free(u->u_request);
+    free(u);
+  }
+}
+
+static void unlink_subscription_bridge_ws(struct bridge_subscription_ws *u)
+{
+  struct bridge_sensor_ws *n;
+  struct bridge_session_ws *e;
+  unsigned int i;
+
+  n = u->u_sensor;
+  for (i=0; i<n->n_count; i++){
+    if (n->n_subs[i] == u){
+      n->n_subs[i] = n->n_subs[--(n->n_count)];
+      break;
+    }
+  }
+
+  e = u->u_session;
+  for (i=0; i<e->e_count; i++){
+    if (e->e_subs[i] == u){
+      e->e_subs[i] = e->e_subs[--(e->e_count)];
+      break;
+    }
+  }
+}
+
+static struct bridge_subscription_ws *find_subscription_bridge_ws(struct bridge_session_ws *e, char *name)
+{
+  unsigned int i;
+
+  for (i=0; i<e->e_count; i++){
+    if (!strcmp(e->e_subs[i]->u_sensor->n_name, name))
+      return e->e_subs[i];
+  }
+
+  return NULL;
+}
+
+static struct bridge_subscription_ws *create_subscription_bridge_ws(struct bridge_session_ws *e, struct bridge_sensor_ws *n)
+{
+  struct bridge_subscription_ws *u, **tmp;
+
+  tmp = realloc(n->n_subs, sizeof(struct bridge_subscription_ws *) * (n->n_count + 1));
+  if (tmp == NULL)
+    return NULL;
+  n->n_subs = tmp;
+
+  tmp = realloc(e->e_subs, sizeof(struct bridge_subscription_ws *) * (e->e_count + 1));
+  if (tmp == NULL)
+    return NULL;
+  e->e_subs = tmp;
+
+  u = malloc(sizeof(struct bridge_subscription_ws));
+  if (u == NULL)
+    return NULL;
+
+  memset(u, 0, sizeof(struct bridge_subscription_ws));
+
+  u->u_sensor  = n;
+  u->u_session = e;
+  u->u_code    = (-1);
+
+  n->n_subs[n->n_count++] = u;
+  e->e_subs[e->e_count++] = u;
+
+  return u;
+}
+
+static int sampling_session_bridge_ws(struct ws_bridge *b, struct bridge_session_ws *e, char **vector, unsigned int count)
+{
+  struct bridge_subscription_ws *u;
+  struct bridge_sensor_ws *n;
+  struct timeval first, second;
+  double delta;
+  char *reply[6], *end;
+  int strategy;
+
+  reply[0] = vector[0];
+  reply[0][0] = KATCP_REPLY;
+  reply[1] = KATCP_FAIL;
+
+  if (count < 2){
+    reply[2] = "usage sensor-sampling name [strategy [parameters]]";
+    return tell_session_bridge_ws(b, e, reply, 3);
+  }
+
+  u = find_subscription_bridge_ws(e, vector[1]);
+
+  if (count == 2){
+    reply[1] = KATCP_OK;
+    reply[2] = vector[1];
+    reply[3] = u ? strategy_names_ws[u->u_strategy] : strategy_names_ws[STRATEGY_NONE];
+    reply[4] = u ? u->u_args[0] : NULL;
+    reply[5] = u ? u->u_args[1] : NULL;
+    return tell_session_bridge_ws(b, e, reply, reply[4] ? (reply[5] ? 6 : 5) : 4);
+  }
+
+  for (strategy = 0; strategy_names_ws[strategy]; strategy++){
+    if (!strcmp(strategy_names_ws[strategy], vector[2]))
+      break;
+  }
+
+  if (strategy_names_ws[strategy] == NULL){
+    reply[2] = "unknown strategy";
+    return tell_session_bridge_ws(b, e, reply, 3);
+  }
+
+  if (count < (3 + strategy_params_ws[strategy])){
+    reply[2] = "strategy needs more parameters";
+    return tell_session_bridge_ws(b, e, reply, 3);
+  }
+
+  first.tv_sec   = 0;
+  first.tv_usec  = 0;
+  second.tv_sec  = 0;
+  second.tv_usec = 0;
+  delta = 0.0;
+
+  switch (strategy){
+    case STRATEGY_PERIOD :
+      if ((parse_time_bridge_ws(&second, vector[3]) < 0) || ((second.tv_sec == 0) && (second.tv_usec == 0))){
+        reply[2] = "invalid period";
+        return tell_session_bridge_ws(b, e, reply, 3);
+      }
+      break;
+    case STRATEGY_DIFF :
+      delta = strtod(vector[3], &end);
+      if ((end == vector[3]) || (*end != '\0') || (delta < 0.0)){
+        reply[2] = "invalid difference";
+        return tell_session_bridge_ws(b, e, reply, 3);
+      }
+      break;
+    case STRATEGY_RATE :
+      if ((parse_time_bridge_ws(&first, vector[3]) < 0) || (parse_time_bridge_ws(&second, vector[4]) < 0) || (cmp_time_katcp(&first, &second) > 0)){
+        reply[2] = "invalid rates";
+        return tell_session_bridge_ws(b, e, reply, 3);
+      }
+      break;
+  }
+
+  if (strategy == STRATEGY_NONE){
+    if (u){
+      n = u->u_sensor;
+      unlink_subscription_bridge_ws(u);
+      destroy_subscription_bridge_ws(u);
+      sample_sensor_bridge_ws(b, n);
+      flush_upstream_bridge_ws(b);
+    }
+    reply[1] = KATCP_OK;
+    reply[2] = vector[1];
+    reply[3] = strategy_names_ws[STRATEGY_NONE];
+    return tell_session_bridge_ws(b, e, reply, 4);
+  }
+
+  if (u == NULL){
+    n = find_sensor_bridge_ws(b, vector[1], 1);
+    if (n == NULL)
+      return -1;
+    u = create_subscription_bridge_ws(e, n);
+    if (u == NULL)
+      return -1;
+  }
+
+  n = u->u_sensor;
+
+  if (u->u_args[0]){
+    free(u->u_args[0]);
+    u->u_args[0] = NULL;
+  }
+  if (u->u_args[1]){
+    free(u->u_args[1]);
+    u->u_args[1] = NULL;
+  }
+  if (u->u_request){
+    free(u->u_request);
+  }
+
+  u->u_request  = strdup(reply[0]);
+  u->u_strategy = strategy;
+  u->u_delta    = delta;
+  u->u_pending  = 0;
+
+  if (strategy_params_ws[strategy] > 0)
+    u->u_args[0] = strdup(vector[3]);
+  if (strategy_params_ws[strategy] > 1)
+    u->u_args[1] = strdup(vector[4]);
+
+  /* the rate limit applies to everything except explicit periods */
+  if ((strategy != STRATEGY_PERIOD) && (cmp_time_katcp(&first, &(b->b_rate)) < 0)){
+    first.tv_sec  = b->b_rate.tv_sec;
+    first.tv_usec = b->b_rate.tv_usec;
+  }
+
+  u->u_short.tv_sec  = first.tv_sec;
+  u->u_short.tv_usec = first.tv_usec;
+  u->u_long.tv_sec   = second.tv_sec;
+  u->u_long.tv_usec  = second.tv_usec;
+
+  if (u->u_request == NULL)
+    return -1;
+
+  if (sample_sensor_bridge_ws(b, n) < 0){
+    down_upstream_bridge_ws(b, "unable to queue request");
+  }
+
+  if (n->n_confirmed && (n->n_outstanding == 0)){
+    confirm_subscription_bridge_ws(b, u);
+  } else if (b->b_state == BRIDGE_UP){
+    flush_upstream_bridge_ws(b);
+  }
+
+  /* otherwise the reply is owed until upstream has answered */
+
+  return 0;
+}
+
+/* upstream messages ************************************************/
+
+static int sampled_upstream_bridge_ws(struct ws_bridge *b, struct bridge_sensor_ws *n, struct katcl_line *l)
+{
+  struct bridge_subscription_ws *u;
+  unsigned int i;
+  char *code, *vector[3];
+
+  if (n->n_outstanding > 0)
+    n->n_outstanding--;
+
+  if (n->n_outstanding > 0)
+    return 0;
+
+  code = arg_string_katcl(l, 1);
+
+  if (code && !strcmp(code, KATCP_OK)){
+    n->n_confirmed = 1;
+    for (i=0; i<n->n_count; i++){
+      confirm_subscription_bridge_ws(b, n->n_subs[i]);
+    }
+    return 0;
+  }
+
+  /* refused, so fail everybody still waiting on this sensor */
+  vector[1] = KATCP_FAIL;
+  vector[2] = arg_string_katcl(l, 2);
+  if (vector[2] == NULL)
+    vector[2] = "refused upstream";
+
+  i = 0;
+  while (i < n->n_count){
+    u = n->n_subs[i];
+    if (u->u_request == NULL){
+      i++;
+      continue;
+    }
+
+    vector[0] = u->u_request;
+    tell_session_bridge_ws(b, u->u_session, vector, 3);
+
+    unlink_subscription_bridge_ws(u);
+    destroy_subscription_bridge_ws(u);
+  }
+
+  n->n_strategy = STRATEGY_NONE;
+
+  return sample_sensor_bridge_ws(b, n);
+}
+
+static void status_upstream_bridge_ws(struct ws_bridge *b, struct katcl_line *l)
+{
+  struct bridge_subscription_ws *u;
+  struct bridge_sensor_ws *n;
+  struct timeval now, when;
+  unsigned int i, j, count;
+  char *vector[6], *end;
+  int len;
+
+  count = arg_unsigned_long_katcl(l, 2);
+
+  gettimeofday(&now, NULL);
+
+  for (i=0; i<count; i++){
+    vector[3] = arg_string_katcl(l, 3 + (i * 3));
+    if (vector[3] == NULL)
+      return;
+
+    n = find_sensor_bridge_ws(b, vector[3], 0);
+    if ((n == NULL) || (n->n_count == 0))
+      continue;
+
+    vector[0] = "#sensor-status";
+    vector[1] = arg_string_katcl(l, 1);
+    vector[2] = "1";
+    vector[4] = arg_string_katcl(l, 4 + (i * 3));
+    vector[5] = arg_string_katcl(l, 5 + (i * 3));
+
+    if ((vector[1] == NULL) || (vector[4] == NULL) || (vector[5] == NULL))
+      return;
+
+    /* split multi sensor updates, then frame once for all subscribers */
+    len = render_vector_bridge_ws(b, vector, 6);
+    if (len < 0)
+      return;
+
+    if (n->n_last)
+      release_message_ws(n->n_last);
+
+    n->n_last = create_message_ws(b->b_buffer, len);
+    n->n_code = status_code_sensor_katcl(vector[4]);
+    n->n_value = strtod(vector[5], &end);
+
+    for (j=0; j<n->n_count; j++){
+      u = n->n_subs[j];
+      if (u->u_request)
+        continue;
+
+      switch (u->u_strategy){
+        case STRATEGY_PERIOD :
+          continue;
+        case STRATEGY_DIFF :
+          if ((u->u_code == n->n_code) && (n->n_value - u->u_value < u->u_delta) && (u->u_value - n->n_value < u->u_delta))
+            continue;
+          break;
+      }
+
+      add_time_katcp(&when, &(u->u_sent), &(u->u_short));
+      if (cmp_time_katcp(&when, &now) <= 0){
+        send_subscription_bridge_ws(b, u, &now);
+      } else if (!u->u_pending){
+        u->u_pending = 1;
+        wake_bridge_ws(b, &when);
+      }
+    }
+  }
+}
+
+static void upstream_bridge_ws(struct ws_bridge *b)
+{
+  struct bridge_request_ws *r;
+  struct ws_message *m;
+  struct katcl_line *l;
+  char *name;
+  int len;
+
+  l = b->b_line;
+
+  while ((b->b_state == BRIDGE_UP) && (have_katcl(l) > 0)){
+    name = arg_string_katcl(l, 0);
+    if ((name == NULL) || (name[0] == '\0'))
+      continue;
+
+    switch (name[0]){
+      case KATCP_REPLY :
+        r = find_request_bridge_ws(b, name + 1, 1);
+        if (r == NULL){
+#ifdef DEBUG
+          fprintf(stderr, "bridge: unexpected reply %s\n", name);
+#endif
+          break;
+        }
+        if (r->r_sensor){
+          sampled_upstream_bridge_ws(b, r->r_sensor, l);
+        } else if (r->r_session){
+          len = render_line_bridge_ws(b, l);
+          if (len > 0)
+            deliver_text_ws(r->r_session->e_client, b->b_buffer, len);
+        }
+        destroy_request_bridge_ws(r);
+        break;
+
+      case KATCP_INFORM :
+        if (!strcmp(name + 1, "sensor-status")){
+          status_upstream_bridge_ws(b, l);
+          break;
+        }
+
+        len = render_line_bridge_ws(b, l);
+        if (len <= 0)
+          break;
+
+        r = find_request_bridge_ws(b, name + 1, 0);
+        if (r){
+          /* part of an answer, only the session which asked wants it */
+          if (r->r_session)
+            deliver_text_ws(r->r_session->e_client, b->b_buffer, len);
+        } else {
+          m = create_message_ws(b->b_buffer, len);
+          if (m){
+            broadcast_message_ws(b->b_server, m);
+            release_message_ws(m);
+          }
+        }
+        break;
+    }
+  }
+
+  flush_upstream_bridge_ws(b);
+}
+
+/* server hooks *****************************************************/
+
+static int extra_bridge_ws(struct ws_server *s, uint32_t events)
+{
+  struct ws_bridge *b;
+  socklen_t len;
+  int code, result;
+
+  b = s->s_data;
+
+  switch (b->b_state){
+    case BRIDGE_CONNECTING :
+      len = sizeof(int);
+      if (getsockopt(fileno_katcl(b->b_line), SOL_SOCKET, SO_ERROR, &code, &len) < 0){
+        code = errno;
+      }
+      if (code == 0){
+        up_upstream_bridge_ws(b);
+      } else if (code != EINPROGRESS){
+        down_upstream_bridge_ws(b, strerror(code));
+      }
+      break;
+
+    case BRIDGE_UP :
+      if (events & EPOLLOUT){
+        if (flush_upstream_bridge_ws(b) < 0)
+          return -1;
+      }
+      if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)){
+        result = read_katcl(b->b_line);
+        upstream_bridge_ws(b);
+        if (result && (b->b_state == BRIDGE_UP)){
+          down_upstream_bridge_ws(b, (result < 0) ? strerror(error_katcl(b->b_line)) : "connection closed");
+        }
+      }
+      break;
+
+    default :
+      watch_extra_ws(s, -1, 0);
+      break;
+  }
+
+  return 0;
+}
+
+static int timer_bridge_ws(struct ws_server *s)
+{
+  struct bridge_subscription_ws *u;
+  struct bridge_sensor_ws *n;
+  struct ws_bridge *b;
+  struct timeval now, when;
+  unsigned int i, j;
+  int wait, retry;
+
+  b = s->s_data;
+
+  gettimeofday(&now, NULL);
+
+  if ((b->b_state == BRIDGE_DOWN) && (cmp_time_katcp(&(b->b_retry), &now) <= 0)){
+    connect_upstream_bridge_ws(b);
+  }
+
+  if (b->b_wake_set && (cmp_time_katcp(&(b->b_wake), &now) <= 0)){
+    b->b_wake_set = 0;
+
+    for (i=0; i<b->b_count; i++){
+      n = b->b_sensors[i];
+      for (j=0; j<n->n_count; j++){
+        u = n->n_subs[j];
+        if (u->u_request)
+          continue;
+
+        if (u->u_pending){
+          add_time_katcp(&when, &(u->u_sent), &(u->u_short));
+          if (cmp_time_katcp(&when, &now) <= 0){
+            send_subscription_bridge_ws(b, u, &now);
+          } else {
+            wake_bridge_ws(b, &when);
+          }
+        }
+
+        switch (u->u_strategy){
+          case STRATEGY_PERIOD :
+            if (cmp_time_katcp(&(u->u_due), &now) <= 0){
+              send_subscription_bridge_ws(b, u, &now);
+              add_time_katcp(&(u->u_due), &(u->u_due), &(u->u_long));
+              if (cmp_time_katcp(&(u->u_due), &now) <= 0){
+                add_time_katcp(&(u->u_due), &now, &(u->u_long));
+              }
+            }
+            wake_bridge_ws(b, &(u->u_due));
+            break;
+          case STRATEGY_RATE :
+            if (cmp_time_katcp(&(u->u_due), &now) <= 0){
+              send_subscription_bridge_ws(b, u, &now);
+            }
+            wake_bridge_ws(b, &(u->u_due));
+            break;
+        }
+      }
+    }
+  }
+
+  wait = b->b_wake_set ? ms_until_bridge_ws(&now, &(b->b_wake)) : (-1);
+
+  if (b->b_state == BRIDGE_DOWN){
+    retry = ms_until_bridge_ws(&now, &(b->b_retry));
+    if ((wait < 0) || (retry < wait))
+      wait = retry;
+  }
+
+  return wait;
+}
+
+static int frame_bridge_ws(struct ws_client *c, uint8_t *data, unsigned int len)
+{
+  struct bridge_session_ws *e;
+  struct ws_bridge *b;
+  unsigned int count;
+  char *text, *line, *next, *vector[BRIDGE_VECTOR + 1], *reply[3];
+
+  b = c->c_server->s_data;
+  e = c->c_data;
+
+  if (e == NULL){
+    e = malloc(sizeof(struct bridge_session_ws));
+    if (e == NULL)
+      return -1;
+
+    e->e_client = c;
+    e->e_subs   = NULL;
+    e->e_count  = 0;
+
+    c->c_data = e;
+  }
+
+  text = malloc(len + 1);
+  if (text == NULL)
+    return -1;
+
+  memcpy(text, data, len);
+  text[len] = '\0';
+
+  for (line = text; line; line = next){
+    next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+
+    count = split_bridge_ws(line, vector, BRIDGE_VECTOR);
+    if ((count == 0) || (vector[0][0] != KATCP_REQUEST) || (vector[0][1] == '\0'))
+      continue;
+
+    if (!strcmp(vector[0] + 1, "sensor-sampling")){
+      sampling_session_bridge_ws(b, e, vector, count);
+      continue;
+    }
+
+    if ((send_upstream_bridge_ws(b, vector, count) < 0) || (push_request_bridge_ws(b, vector[0] + 1, e, NULL) < 0)){
+      vector[0][0] = KATCP_REPLY;
+      reply[0] = vector[0];
+      reply[1] = KATCP_FAIL;
+      reply[2] = "upstream unavailable";
+      tell_session_bridge_ws(b, e, reply, 3);
+      continue;
+    }
+
+    flush_upstream_bridge_ws(b);
+  }
+
+  free(text);
+
+  return 0;
+}
+
+static void leave_bridge_ws(struct ws_server *s, struct ws_client *c)
+{
+  struct bridge_subscription_ws *u;
+  struct bridge_session_ws *e;
+  struct bridge_request_ws *r;
+  struct bridge_sensor_ws *n;
+  struct ws_bridge *b;
+
+  b = s->s_data;
+  e = c->c_data;
+
+  if ((b == NULL) || (e == NULL))
+    return;
+
+  for (r = b->b_head; r; r = r->r_next){
+    if (r->r_session == e)
+      r->r_session = NULL;
+  }
+
+  while (e->e_count > 0){
+    u = e->e_subs[0];
+    n = u->u_sensor;
+    unlink_subscription_bridge_ws(u);
+    destroy_subscription_bridge_ws(u);
+    sample_sensor_bridge_ws(b, n);
+  }
+
+  flush_upstream_bridge_ws(b);
+
+  if (e->e_subs)
+    free(e->e_subs);
+  free(e);
+
+  c->c_data = NULL;
+}
+
+/* setup ************************************************************/
+
+static void destroy_sensor_bridge_ws(void *datum)
+{
+  struct bridge_sensor_ws *n;
+
+  n = datum;
+  if (n){
+    if (n->n_last)
+      release_message_ws(n->n_last);
+    if (n->n_subs)
+      free(n->n_subs);
+    if (n->n_name)
+      free(n->n_name);
+    free(n);
+  }
+}
+
+void destroy_bridge_ws(struct ws_bridge *b)
+{
+  struct bridge_request_ws *r;
+
+  if (b == NULL)
+    return;
+
+  while ((r = b->b_head) != NULL){
+    b->b_head = r->r_next;
+    destroy_request_bridge_ws(r);
+  }
+
+  if (b->b_line){
+    destroy_katcl(b->b_line, 1);
+    b->b_line = NULL;
+  }
+
+  if (b->b_tree){
+    destroy_avltree(b->b_tree, &destroy_sensor_bridge_ws);
+    b->b_tree = NULL;
+  }
+
+  if (b->b_sensors)
+    free(b->b_sensors);
+  if (b->b_buffer)
+    free(b->b_buffer);
+  if (b->b_upstream)
+    free(b->b_upstream);
+
+  free(b);
+}
+
+struct ws_bridge *create_bridge_ws(struct ws_server *s, char *upstream, unsigned int rate)
+{
+  struct ws_bridge *b;
+
+  if (s == NULL || upstream == NULL)
+    return NULL;
+
+  b = malloc(sizeof(struct ws_bridge));
+  if (b == NULL)
+    return NULL;
+
+  b->b_server   = s;
+  b->b_upstream = strdup(upstream);
+  b->b_line     = NULL;
+  b->b_state    = BRIDGE_DOWN;
+  b->b_tree     = create_avltree();
+  b->b_sensors  = NULL;
+  b->b_count    = 0;
+  b->b_head     = NULL;
+  b->b_tail     = NULL;
+  b->b_wake_set = 0;
+  b->b_buffer   = NULL;
+  b->b_size     = 0;
+
+  component_time_katcp(&(b->b_rate), rate);
+
+  b->b_retry.tv_sec  = 0;
+  b->b_retry.tv_usec = 0;
+
+  if ((b->b_upstream == NULL) || (b->b_tree == NULL) || (grow_bridge_ws(b, 256) < 0)){
+    destroy_bridge_ws(b);
+    return NULL;
+  }
+
+  s->s_data = b;
+  s->s_xfn  = &extra_bridge_ws;
+  s->s_ffn  = &frame_bridge_ws;
+  s->s_tfn  = &timer_bridge_ws;
+  s->s_lfn  = &leave_bridge_ws;
+
+  connect_upstream_bridge_ws(b);
+
+  return b;
+}
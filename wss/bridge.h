@@ -0,0 +1,13 @@
+#ifndef _BRIDGE_H
+#define _BRIDGE_H
+
+#include "server.h"
+
+#define BRIDGE_RATE   50    /* default ms between updates of one sensor to one browser */
+
+struct ws_bridge;
+
+struct ws_bridge *create_bridge_ws(struct ws_server *s, char *upstream, unsigned int rate);
+void destroy_bridge_ws(struct ws_bridge *b);
+
+#endif
@@ -11,6 +11,10 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sysexits.h>
+#include <fcntl.h>
+
+#include <sys/uio.h>
+#include <sys/epoll.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -48,16 +52,28 @@ struct ws_server *create_server_ws(int (*cdfn)(struct ws_client *c))
     return NULL;
   
   s->s_fd = 0;
+  s->s_efd     = (-1);
+  s->s_ifd     = (-1);
+
+  s->s_ib      = NULL;
+  s->s_ib_len  = 0;
 
-  FD_ZERO(&s->s_in);
-  FD_ZERO(&s->s_out);
+  memset(s->s_events, 0, sizeof(struct epoll_event) * WS_EVENTS);
 
-  s->s_hi      = 0;
   s->s_c       = NULL;
   s->s_c_count = 0;
   s->s_br_count= 0;
   s->s_cdfn    = cdfn;
   s->s_tlsctx  = NULL;
+  s->s_flags   = 0;
+  s->s_dirty   = 0;
+
+  s->s_data    = NULL;
+  s->s_xfd     = (-1);
+  s->s_xfn     = NULL;
+  s->s_ffn     = NULL;
+  s->s_tfn     = NULL;
+  s->s_lfn     = NULL;
 #if 0
   s->s_up_count= 0;
   s->s_sb      = NULL;
@@ -75,6 +91,9 @@ struct ws_client *create_client_ws(int fd, SSL *ssl)
     return NULL;
   
   c->c_fd       = fd;
+  c->c_index    = (-1);
+  c->c_events   = 0;
+  c->c_accepted = (ssl == NULL) ? 1 : 0;
   c->c_rb       = NULL;
   c->c_rb_len   = 0;
   c->c_rb_last  = NULL;
@@ -82,14 +101,192 @@ struct ws_client *create_client_ws(int fd, SSL *ssl)
   c->c_state    = C_STATE_NEW;
   c->c_sb       = NULL;
   c->c_sb_len   = 0;
+  c->c_mq       = NULL;
+  c->c_mq_size  = 0;
+  c->c_mq_head  = 0;
+  c->c_mq_count = 0;
+  c->c_mq_offset= 0;
   c->c_frame    = NULL;
+  c->c_server   = NULL;
+  c->c_data     = NULL;
 
   return c;
 }
 
+struct ws_message *create_message_ws(void *buf, unsigned int n)
+{
+  struct ws_message *m;
+  unsigned int hlen;
+  uint64_t len;
+  int i;
+
+  if (n < WSF_PAYLOAD_16){
+    hlen = 2;
+  } else if (n <= 0xffff){
+    hlen = 4;
+  } else {
+    hlen = 10;
+  }
+
+  m = malloc(sizeof(struct ws_message) + hlen + n);
+  if (m == NULL)
+    return NULL;
+
+  m->m_refs = 1;
+  m->m_len  = hlen + n;
+  m->m_data = (uint8_t *)(m + 1);
+
+  m->m_data[0] = WSF_FIN | WSF_OP_TEXT;
+
+  switch (hlen){
+    case 2 :
+      m->m_data[1] = n;
+      break;
+    case 4 :
+      m->m_data[1] = WSF_PAYLOAD_16;
+      m->m_data[2] = (n >> 8) & 0xff;
+      m->m_data[3] = n & 0xff;
+      break;
+    default :
+      m->m_data[1] = WSF_PAYLOAD_64;
+      len = n;
+      for (i = 9; i >= 2; i--){
+        m->m_data[i] = len & 0xff;
+        len >>= 8;
+      }
+      break;
+  }
+
+  memcpy(m->m_data + hlen, buf, n);
+
+  return m;
+}
+
+void release_message_ws(struct ws_message *m)
+{
+  if (m == NULL)
+    return;
+
+  if (m->m_refs > 1){
+    m->m_refs--;
+    return;
+  }
+
+  free(m);
+}
+
+int queue_message_ws(struct ws_client *c, struct ws_message *m)
+{
+  struct ws_message **mq;
+  unsigned int size, i;
+
+  if (c == NULL || m == NULL)
+    return -1;
+
+  if (c->c_mq_count >= c->c_mq_size){
+    if (c->c_mq_size >= WS_QUEUE_LIMIT){
+#ifdef DEBUG
+      fprintf(stderr, "wss: client [%d] has fallen %u messages behind\n", c->c_fd, c->c_mq_count);
+#endif
+      return -1;
+    }
+
+    size = (c->c_mq_size > 0) ? (c->c_mq_size * 2) : WS_QUEUE_START;
+
+    mq = malloc(sizeof(struct ws_message *) * size);
+    if (mq == NULL)
+      return -1;
+
+    for (i=0; i<c->c_mq_count; i++){
+      mq[i] = c->c_mq[(c->c_mq_head + i) & (c->c_mq_size - 1)];
+    }
+
+    if (c->c_mq)
+      free(c->c_mq);
+
+    c->c_mq      = mq;
+    c->c_mq_size = size;
+    c->c_mq_head = 0;
+  }
+
+  c->c_mq[(c->c_mq_head + c->c_mq_count) & (c->c_mq_size - 1)] = m;
+  c->c_mq_count++;
+
+  m->m_refs++;
+
+  return 0;
+}
+
+int deliver_message_ws(struct ws_client *c, struct ws_message *m)
+{
+  if (c == NULL || m == NULL)
+    return -1;
+
+  if (c->c_state == C_STATE_CLOSING)
+    return -1;
+
+  /* the disconnect happens on the next flush, callers may be walking lists which include this client */
+  if (queue_message_ws(c, m) < 0){
+    c->c_state = C_STATE_CLOSING;
+  }
+
+  if (c->c_server)
+    c->c_server->s_dirty = 1;
+
+  return (c->c_state == C_STATE_CLOSING) ? -1 : 0;
+}
+
+int deliver_text_ws(struct ws_client *c, void *buf, unsigned int n)
+{
+  struct ws_message *m;
+  int result;
+
+  m = create_message_ws(buf, n);
+  if (m == NULL)
+    return -1;
+
+  result = deliver_message_ws(c, m);
+
+  release_message_ws(m);
+
+  return result;
+}
+
+static void consume_queue_ws(struct ws_client *c, unsigned int n)
+{
+  struct ws_message *m;
+  unsigned int left;
+
+  while (n > 0 && c->c_mq_count > 0){
+    m = c->c_mq[c->c_mq_head];
+    left = m->m_len - c->c_mq_offset;
+
+    if (n < left){
+      c->c_mq_offset += n;
+      return;
+    }
+
+    n -= left;
+
+    c->c_mq_offset = 0;
+    c->c_mq_head   = (c->c_mq_head + 1) & (c->c_mq_size - 1);
+    c->c_mq_count--;
+
+    release_message_ws(m);
+  }
+}
+
 void destroy_client_ws(struct ws_client *c)
 {
   if (c){
+    while (c->c_mq_count > 0){
+      release_message_ws(c->c_mq[c->c_mq_head]);
+      c->c_mq_head = (c->c_mq_head + 1) & (c->c_mq_size - 1);
+      c->c_mq_count--;
+    }
+    if (c->c_mq)
+      free(c->c_mq);
+
 #if 1
     if (c->c_rb)
       free(c->c_rb);
@@ -130,6 +327,8 @@ void destroy_server_ws(struct ws_server *s)
     if (s->s_sb)
       free(s->s_sb);
 #endif
+    if (s->s_ib)
+      free(s->s_ib);
     free(s);
   }
 }
@@ -144,6 +343,7 @@ int add_new_client_ws(struct ws_server *s, struct ws_client *c)
     return -1;
 
   s->s_c[s->s_c_count] = c;
+  c->c_index = s->s_c_count;
   s->s_c_count++;
 
   return 0;
@@ -156,12 +356,13 @@ int del_client_ws(struct ws_server *s, struct ws_client *c)
   if (s == NULL || c == NULL)
     return -1;
   
-  for (i=0; i<s->s_c_count; i++){
-    if (s->s_c[i] == c)
-      break;
-  }
+  i = c->c_index;
+  if (i < 0 || i >= s->s_c_count || s->s_c[i] != c)
+    return -1;
 
   s->s_c[i] = s->s_c[s->s_c_count - 1];
+  s->s_c[i]->c_index = i;
+  c->c_index = (-1);
 
   s->s_c = realloc(s->s_c, sizeof(struct ws_client*) * (s->s_c_count - 1));
   s->s_c_count--;
@@ -199,6 +400,59 @@ int register_signals_ws()
 }
 
 
+int watch_fd_ws(struct ws_server *s, int fd, void *ptr, int op, uint32_t events)
+{
+  struct epoll_event e;
+
+  memset(&e, 0, sizeof(struct epoll_event));
+
+  e.events   = events;
+  e.data.ptr = ptr;
+
+  if (epoll_ctl(s->s_efd, op, fd, &e) < 0){
+#ifdef DEBUG
+    fprintf(stderr, "wss: error epoll ctl %d on fd %d: %s\n", op, fd, strerror(errno));
+#endif
+    return -1;
+  }
+
+  return 0;
+}
+
+int events_client_ws(struct ws_server *s, struct ws_client *c, uint32_t events)
+{
+  if (c->c_events == events)
+    return 0;
+
+  if (watch_fd_ws(s, c->c_fd, c, EPOLL_CTL_MOD, events) < 0)
+    return -1;
+
+  c->c_events = events;
+
+  return 0;
+}
+
+int watch_extra_ws(struct ws_server *s, int fd, uint32_t events)
+{
+  if (s->s_xfd >= 0){
+    if (fd == s->s_xfd){
+      return watch_fd_ws(s, fd, &(s->s_xfd), EPOLL_CTL_MOD, events);
+    }
+    watch_fd_ws(s, s->s_xfd, NULL, EPOLL_CTL_DEL, 0);
+    s->s_xfd = (-1);
+  }
+
+  if (fd < 0)
+    return 0;
+
+  if (watch_fd_ws(s, fd, &(s->s_xfd), EPOLL_CTL_ADD, events) < 0)
+    return -1;
+
+  s->s_xfd = fd;
+
+  return 0;
+}
+
 int startup_server(struct ws_server *s, char *port)
 {
   struct addrinfo hints;
@@ -250,7 +504,7 @@ int startup_server(struct ws_server *s, char *port)
 
   freeaddrinfo(res);
 
-  backlog      = 10;
+  backlog      = SOMAXCONN;
 #if 0
   memset(&sa, 0, sizeof(struct sockaddr_in));
   sa.sin_family       = AF_INET;
@@ -265,7 +519,33 @@ int startup_server(struct ws_server *s, char *port)
     return -1;
   }
 
-  s->s_hi = s->s_fd;
+  if (fcntl(s->s_fd, F_SETFL, O_NONBLOCK) < 0){
+#ifdef DEBUG
+    fprintf(stderr,"wss: error unable to make listener nonblocking: %s\n", strerror(errno));
+#endif
+    return -1;
+  }
+
+  s->s_efd = epoll_create(WS_EVENTS);
+  if (s->s_efd < 0){
+#ifdef DEBUG
+    fprintf(stderr,"wss: error epoll create: %s\n", strerror(errno));
+#endif
+    return -1;
+  }
+
+  fcntl(s->s_efd, F_SETFD, FD_CLOEXEC);
+
+  if (watch_fd_ws(s, s->s_fd, &(s->s_fd), EPOLL_CTL_ADD, EPOLLIN) < 0){
+    return -1;
+  }
+
+  if (s->s_ifd >= 0){
+    /* epoll refuses regular files, in which case there is nothing to broadcast */
+    if (watch_fd_ws(s, s->s_ifd, &(s->s_ifd), EPOLL_CTL_ADD, EPOLLIN) < 0){
+      s->s_ifd = (-1);
+    }
+  }
 
 #ifdef DEBUG
   fprintf(stderr,"wss: server pid: %d running on port: %s\n", getpid(), port);
@@ -276,7 +556,7 @@ int startup_server(struct ws_server *s, char *port)
 
 int handle_new_client_ws(struct ws_server *s)
 {
-  struct sockaddr_in ca;
+  struct sockaddr_storage ca;
   socklen_t len;
   struct ws_client *c;
   int cfd;
@@ -285,46 +565,108 @@ int handle_new_client_ws(struct ws_server *s)
   if (s == NULL)
     return -1;
 
-  len = sizeof(struct sockaddr_in);
-
-  cfd = accept(s->s_fd, (struct sockaddr *) &ca, &len);
-  if (cfd < 0) { 
+  /* the listener is nonblocking, take everything the backlog holds */
+  for (;;){
+    len = sizeof(struct sockaddr_storage);
+
+    cfd = accept4(s->s_fd, (struct sockaddr *) &ca, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (cfd < 0) { 
+      switch (errno){
+        case EAGAIN :
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK :
+#endif
+          return 0;
+        case EINTR :
+        case ECONNABORTED :
+          continue;
+      }
 #ifdef DEBUG
-    fprintf(stderr,"wss: error in accept new client: %s\n", strerror(errno)); 
+      fprintf(stderr,"wss: error in accept new client: %s\n", strerror(errno)); 
 #endif
-    return -1; 
-  }
-  
-  ssl = SSL_new(s->s_tlsctx);
-  if (ssl == NULL){ 
+      return -1; 
+    }
+
+    ssl = NULL;
+
+    if (!(s->s_flags & WS_FLAG_PLAIN)){
+      ssl = SSL_new(s->s_tlsctx);
+      if (ssl == NULL){ 
 #ifdef DEBUG
-    fprintf(stderr, "wss: SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+        fprintf(stderr, "wss: SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
 #endif
-    return -1;
-  }
+        close(cfd);
+        return -1;
+      }
+
+      SSL_set_fd(ssl, cfd);
+      SSL_set_accept_state(ssl);
+    }
 
 #ifdef DEBUG
-  fprintf(stderr, "wss: client fd: %d ssl (%p)\n",cfd ,ssl); 
+    fprintf(stderr, "wss: client fd: %d ssl (%p)\n",cfd ,ssl); 
 #endif
 
-  SSL_set_fd(ssl, cfd);
+    c = create_client_ws(cfd, ssl);
+    if (c == NULL){
+      if (ssl)
+        SSL_free(ssl);
+      close(cfd);
+      return -1;
+    }
 
-  SSL_accept(ssl);
+    c->c_server = s;
 
-  c = create_client_ws(cfd, ssl);
-  if (c == NULL)
-    return -1;
+    if (add_new_client_ws(s, c) < 0){
+      close(cfd);
+      destroy_client_ws(c);
+      return -1;
+    }
 
-  if (add_new_client_ws(s, c) < 0){
-    destroy_client_ws(c);
-    return -1;
+    if (watch_fd_ws(s, cfd, c, EPOLL_CTL_ADD, EPOLLIN) < 0){
+      del_client_ws(s, c);
+      close(cfd);
+      destroy_client_ws(c);
+      return -1;
+    }
+
+    c->c_events = EPOLLIN;
   }
 
   return 0;  
 }
 
+int handshake_client_ws(struct ws_server *s, struct ws_client *c)
+{
+  int rtn;
+
+  rtn = SSL_accept(c->c_ssl);
+  if (rtn == 1){
+#ifdef DEBUG
+    fprintf(stderr, "wss: client [%d] tls handshake complete\n", c->c_fd);
+#endif
+    c->c_accepted = 1;
+    return events_client_ws(s, c, EPOLLIN);
+  }
+
+  switch (SSL_get_error(c->c_ssl, rtn)){
+    case SSL_ERROR_WANT_READ :
+      return events_client_ws(s, c, EPOLLIN);
+    case SSL_ERROR_WANT_WRITE :
+      return events_client_ws(s, c, EPOLLIN | EPOLLOUT);
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "wss: tls handshake SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+#endif
+
+  return -1;
+}
+
 int disconnect_client_ws(struct ws_server *s, struct ws_client *c)
 {
+  int i;
+
   if (s == NULL || c == NULL){
 #ifdef DEBUG
     fprintf(stderr, "wss: error disconnect client s:(%p) c:(%p)\n", s, c);
@@ -346,6 +688,10 @@ int disconnect_client_ws(struct ws_server *s, struct ws_client *c)
       break; 
   }
 
+  if (s->s_lfn){
+    (*(s->s_lfn))(s, c);
+  }
+
   if (del_client_ws(s, c) < 0){
 #ifdef DEBUG
     fprintf(stderr, "wss: error del_client_ws\n");
@@ -353,8 +699,13 @@ int disconnect_client_ws(struct ws_server *s, struct ws_client *c)
     //return -1;
   }
 
+  /* later events in the current batch may still refer to this client */
+  for (i=0; i<WS_EVENTS; i++){
+    if (s->s_events[i].data.ptr == c)
+      s->s_events[i].data.ptr = NULL;
+  }
 
-  if (!SSL_shutdown(c->c_ssl)){
+  if (c->c_ssl && c->c_accepted && !SSL_shutdown(c->c_ssl)){
 #ifdef DEBUG
     //fprintf(stderr, "wss: SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
     fprintf(stderr, "wss: sll not shutdown do again\n");
@@ -418,6 +769,10 @@ void shutdown_server_ws(struct ws_server *s)
       SSL_CTX_free(s->s_tlsctx);
     }
 
+    if (s->s_efd >= 0){
+      close(s->s_efd);
+    }
+
     if (shutdown(s->s_fd, SHUT_RDWR) < 0){
 #ifdef DEBUG
       fprintf(stderr, "wss: error server shutdown: %s\n", strerror(errno));
@@ -592,6 +947,20 @@ int readdata_client_ws(struct ws_client *c, void *dest, unsigned int n)
   return n;
 }
 
+void discard_client_ws(struct ws_client *c, unsigned int n)
+{
+  if (c == NULL || c->c_rb == NULL)
+    return;
+
+  if (n >= c->c_rb_len){
+    c->c_rb_len = 0;
+    return;
+  }
+
+  c->c_rb_len -= n;
+  memmove(c->c_rb, c->c_rb + n, c->c_rb_len);
+}
+
 void dropdata_client_ws(struct ws_client *c)
 {
   if (c == NULL)
@@ -609,39 +978,64 @@ void dropdata_client_ws(struct ws_client *c)
   }
 }
 
+int send_client_data_ws(struct ws_server *s, struct ws_client *c);
+
 int get_client_data_ws(struct ws_server *s, struct ws_client *c)
 {
   unsigned char readbuffer[READBUFFERSIZE];
-  int recv_bytes, rtn;
+  int recv_bytes, total, rtn;
 
   if (s == NULL || c == NULL)
     return -1;
 
-  memset(readbuffer, 0, READBUFFERSIZE);
-#if 0
-  recv_bytes = read(c->c_fd, readbuffer, READBUFFERSIZE);
-#endif
+  if (!c->c_accepted)
+    return handshake_client_ws(s, c);
 
-  recv_bytes = SSL_read(c->c_ssl, readbuffer, READBUFFERSIZE);
+  total = 0;
 
-  s->s_br_count += recv_bytes;
-  
-  if (recv_bytes < 0){
-#if 0
-    def DEBUG
-    fprintf(stderr, "wss: read error %s\n", strerror(errno)); 
+  do {
+    if (c->c_ssl == NULL){
+      recv_bytes = read(c->c_fd, readbuffer, READBUFFERSIZE);
+      if (recv_bytes < 0){
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+          break;
+#ifdef DEBUG
+        fprintf(stderr, "wss: read error %s\n", strerror(errno)); 
 #endif
+        return -1;
+      }
+    } else {
+      recv_bytes = SSL_read(c->c_ssl, readbuffer, READBUFFERSIZE);
+      if (recv_bytes <= 0){
+        switch (SSL_get_error(c->c_ssl, recv_bytes)){
+          case SSL_ERROR_WANT_READ :
+            recv_bytes = (-1);
+            break;
+          case SSL_ERROR_WANT_WRITE :
+            if (events_client_ws(s, c, c->c_events | EPOLLOUT) < 0)
+              return -1;
+            recv_bytes = (-1);
+            break;
+          default :
 #ifdef DEBUG
-    fprintf(stderr, "wss: read_error SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+            fprintf(stderr, "wss: read_error SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
 #endif
+            return -1;
+        }
+        if (recv_bytes < 0)
+          break;
+      }
+    }
 
-    return disconnect_client_ws(s, c);
-  } else if (recv_bytes == 0){
+    if (recv_bytes == 0){
 #ifdef DEBUG
-    fprintf(stderr,"wss: client is leaving\n");
+      fprintf(stderr,"wss: client is leaving\n");
 #endif
-    return disconnect_client_ws(s, c);
-  } else {
+      return -1;
+    }
+
+    s->s_br_count += recv_bytes;
+    total += recv_bytes;
     
     if (populate_client_data_ws(c, readbuffer, recv_bytes) < 0){
 #ifdef DEBUG
@@ -650,14 +1044,86 @@ int get_client_data_ws(struct ws_server *s, struct ws_client *c)
       return -1;
     }
 
-    rtn = (*(s->s_cdfn))(c);
-    
-    if (rtn < 0)
+    /* tls may hold decrypted data which epoll will not report */
+  } while (c->c_ssl != NULL && SSL_pending(c->c_ssl) > 0);
+
+  if (total <= 0)
+    return 0;
+
+  rtn = (*(s->s_cdfn))(c);
+  if (rtn < 0)
+    return -1;
+
+  return send_client_data_ws(s, c);
+}
+
+static int transmit_client_ws(struct ws_client *c, void *buf, int n)
+{
+  int b_wrote;
+
+  if (c->c_ssl == NULL){
+    b_wrote = write(c->c_fd, buf, n);
+    if (b_wrote < 0){
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return 0;
+#ifdef DEBUG
+      fprintf(stderr, "wss: write error %s\n", strerror(errno)); 
+#endif
       return -1;
+    }
+    return b_wrote;
+  }
+
+  b_wrote = SSL_write(c->c_ssl, buf, n);
+  if (b_wrote > 0)
+    return b_wrote;
 
+  switch (SSL_get_error(c->c_ssl, b_wrote)){
+    case SSL_ERROR_WANT_READ :
+    case SSL_ERROR_WANT_WRITE :
+      return 0;
   }
 
-  return 0;
+#ifdef DEBUG
+  fprintf(stderr, "wss: error ssl_write SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+#endif
+
+  return -1;
+}
+
+static int transmit_queue_ws(struct ws_client *c)
+{
+  struct iovec iov[WS_IOV_LIMIT];
+  struct ws_message *m;
+  unsigned int i, index, offset;
+  int b_wrote;
+
+  if (c->c_ssl != NULL){
+    m = c->c_mq[c->c_mq_head];
+    return transmit_client_ws(c, m->m_data + c->c_mq_offset, m->m_len - c->c_mq_offset);
+  }
+
+  /* plain sockets can send a run of shared frames in one call */
+  offset = c->c_mq_offset;
+  for (i=0; (i<c->c_mq_count) && (i<WS_IOV_LIMIT); i++){
+    index = (c->c_mq_head + i) & (c->c_mq_size - 1);
+    m = c->c_mq[index];
+    iov[i].iov_base = m->m_data + offset;
+    iov[i].iov_len  = m->m_len - offset;
+    offset = 0;
+  }
+
+  b_wrote = writev(c->c_fd, iov, i);
+  if (b_wrote < 0){
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return 0;
+#ifdef DEBUG
+    fprintf(stderr, "wss: writev error %s\n", strerror(errno)); 
+#endif
+    return -1;
+  }
+
+  return b_wrote;
 }
 
 int send_client_data_ws(struct ws_server *s, struct ws_client *c)
@@ -666,153 +1132,237 @@ int send_client_data_ws(struct ws_server *s, struct ws_client *c)
 
   if (s == NULL || c == NULL)
     return -1;
-  
-  b_wrote = SSL_write(c->c_ssl, c->c_sb, c->c_sb_len);
 
-#ifdef DEBUG
-  fprintf(stderr, "wss: [%d] b_wrote:%d c_sb_len:%d\n", c->c_fd, b_wrote, c->c_sb_len);
-#endif
+  if (!c->c_accepted)
+    return handshake_client_ws(s, c);
+  
+  while (c->c_sb_len > 0){
+    b_wrote = transmit_client_ws(c, c->c_sb, c->c_sb_len);
 
-  if (b_wrote <= 0){
 #ifdef DEBUG
-    fprintf(stderr, "wss: error ssl_write < 0\n");
+    fprintf(stderr, "wss: [%d] b_wrote:%d c_sb_len:%d\n", c->c_fd, b_wrote, c->c_sb_len);
 #endif
-    return -1;
-  } else if (b_wrote == c->c_sb_len){
 
-    c->c_sb_len = 0;
+    if (b_wrote < 0){
+      return -1;
+    } else if (b_wrote == 0){
+      return events_client_ws(s, c, EPOLLIN | EPOLLOUT);
+    }
 
-  } else if (b_wrote < c->c_sb_len) {
     c->c_sb_len -= b_wrote;
-    
-    memmove(c->c_sb, c->c_sb + b_wrote, c->c_sb_len);
+    if (c->c_sb_len > 0){
+      memmove(c->c_sb, c->c_sb + b_wrote, c->c_sb_len);
+    }
+  }
 
-    c->c_sb = realloc(c->c_sb, c->c_sb_len);
-    if (c->c_sb == NULL)
+  while (c->c_mq_count > 0){
+    b_wrote = transmit_queue_ws(c);
+    if (b_wrote < 0){
       return -1;
+    } else if (b_wrote == 0){
+      return events_client_ws(s, c, EPOLLIN | EPOLLOUT);
+    }
+
+    consume_queue_ws(c, b_wrote);
   }
   
-  return 0;
+  return events_client_ws(s, c, EPOLLIN);
 }
 
-
-int socks_io_ws(struct ws_server *s) 
+int broadcast_message_ws(struct ws_server *s, struct ws_message *m)
 {
   struct ws_client *c;
   int i;
-  
-  if (s == NULL)
-    return -1;
 
-  /*check the server listen fd for a new connection*/
-  if (FD_ISSET(s->s_fd, &s->s_in)) {
-#ifdef DEBUG
-    fprintf(stderr,"wss: new incomming connection\n");
-#endif
-    if (handle_new_client_ws(s) < 0){
-#ifdef DEBUG
-      fprintf(stderr,"wss: error handle new clientn\n");
-#endif
-    }
-  }
+  if (s == NULL || m == NULL)
+    return -1;
 
   for (i=0; i<s->s_c_count; i++){
     c = s->s_c[i];
-    if (c != NULL){
+    if (c->c_state != C_STATE_UPGRADED)
+      continue;
 
-      if (FD_ISSET(c->c_fd, &s->s_out)){
-        if (send_client_data_ws(s, c) < 0){
-#ifdef DEBUG
-          fprintf(stderr, "wss: send client data error\n");
-#endif
-        }
-      }
-
-      if (FD_ISSET(c->c_fd, &s->s_in)) {
-        if (get_client_data_ws(s, c) < 0){
-#ifdef DEBUG
-          fprintf(stderr, "wss: get client data error\n");
-#endif
-        }
-      } 
-        
-    }
+    deliver_message_ws(c, m);
   }
 
   return 0;
 }
 
-void build_socket_set_ws(struct ws_server *s)
+void flush_clients_ws(struct ws_server *s)
 {
   struct ws_client *c;
-  int i, fd;
+  int i;
 
-  if (s == NULL)
+  if (!s->s_dirty)
     return;
 
-  FD_ZERO(&s->s_in);
-  FD_ZERO(&s->s_out);
-  FD_SET(s->s_fd, &s->s_in);
-  
-  //FD_SET(STDIN_FILENO, &s->insocks);
-  for (i=0; i<s->s_c_count; i++){
-    
+  s->s_dirty = 0;
+
+  /* walk backwards, a disconnect moves the last client into the gap */
+  for (i=s->s_c_count-1; i>=0; i--){
+    if (i >= s->s_c_count)
+      continue;
+
     c = s->s_c[i];
+    if (c->c_state == C_STATE_CLOSING){
+      disconnect_client_ws(s, c);
+    } else if ((c->c_mq_count > 0) && !(c->c_events & EPOLLOUT)){
+      if (send_client_data_ws(s, c) < 0){
+        disconnect_client_ws(s, c);
+      }
+    }
+  }
+}
 
-    if (c != NULL){
-      
-      fd = c->c_fd;
-      
-      if (fd > 0) {
-        FD_SET(fd, &s->s_in);
+int handle_input_ws(struct ws_server *s)
+{
+  struct ws_message *m;
+  int rr, i, start, len;
+  char *ptr;
 
-        if (fd > s->s_hi)
-          s->s_hi = fd;
-        
-        if (c->c_sb_len > 0){
+  ptr = realloc(s->s_ib, s->s_ib_len + READBUFFERSIZE);
+  if (ptr == NULL)
+    return -1;
+
+  s->s_ib = ptr;
+
+  rr = read(s->s_ifd, s->s_ib + s->s_ib_len, READBUFFERSIZE);
+  if (rr < 0){
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return 0;
 #ifdef DEBUG
-          fprintf(stderr, "wss: must send to [%d] %dbytes\n", c->c_fd, c->c_sb_len);
+    fprintf(stderr, "wss: input read error %s\n", strerror(errno)); 
 #endif
-          FD_SET(fd, &s->s_out);
-        }
+  }
 
-      }
+  if (rr <= 0){
+#ifdef DEBUG
+    fprintf(stderr, "wss: end of broadcast input\n");
+#endif
+    watch_fd_ws(s, s->s_ifd, NULL, EPOLL_CTL_DEL, 0);
+    s->s_ifd = (-1);
+    return 0;
+  }
+
+  start = 0;
+  len = s->s_ib_len + rr;
+
+  /* frame each line once, clients only hold references to it */
+  for (i=s->s_ib_len; i<len; i++){
+    if (s->s_ib[i] != '\n')
+      continue;
+
+    rr = i - start;
+    if ((rr > 0) && (s->s_ib[i - 1] == '\r'))
+      rr--;
+
+    if (rr > 0){
+      m = create_message_ws(s->s_ib + start, rr);
+      if (m == NULL)
+        return -1;
+
+      broadcast_message_ws(s, m);
+      release_message_ws(m);
     }
+
+    start = i + 1;
+  }
+
+  s->s_ib_len = len - start;
+  if ((start > 0) && (s->s_ib_len > 0)){
+    memmove(s->s_ib, s->s_ib + start, s->s_ib_len);
   }
+
+  return 0;
+}
+
+int socks_io_ws(struct ws_server *s, struct ws_client *c, uint32_t events) 
+{
+  if (s == NULL || c == NULL)
+    return -1;
+
+  if (events & EPOLLOUT){
+    if (send_client_data_ws(s, c) < 0){
+#ifdef DEBUG
+      fprintf(stderr, "wss: send client data error\n");
+#endif
+      return -1;
+    }
+  }
+
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)){
+    if (get_client_data_ws(s, c) < 0){
+#ifdef DEBUG
+      fprintf(stderr, "wss: get client data error\n");
+#endif
+      return -1;
+    }
+  } 
+
+  return 0;
 }
 
 int run_loop_ws(struct ws_server *s)
 {
   sigset_t empty_mask;
+  struct ws_client *c;
+  void *ptr;
+  int count, i, timeout;
 
   sigemptyset(&empty_mask);
 
   while (run) {
 
-    build_socket_set_ws(s);  
+    timeout = s->s_tfn ? (*(s->s_tfn))(s) : (-1);
+
+    flush_clients_ws(s);
 
-    if (pselect(s->s_hi + 1, &s->s_in, &s->s_out, (fd_set *) NULL, NULL, &empty_mask) < 0) { 
+    count = epoll_pwait(s->s_efd, s->s_events, WS_EVENTS, timeout, &empty_mask);
+    if (count < 0) { 
       switch(errno){
-        case EPIPE:
-#ifdef DEBUG
-          fprintf(stderr, "wss: EPIPE: %s\n", strerror(errno));
-#endif
         case EINTR:
         case EAGAIN:
           break;
         default:
 #ifdef DEBUG
-          fprintf(stderr,"wss: select encountered an error: %s\n", strerror(errno)); 
+          fprintf(stderr,"wss: epoll encountered an error: %s\n", strerror(errno)); 
 #endif
           return -1;
       }
+      continue;
     }
-    else {
-      if (socks_io_ws(s) < 0) {
-        //return -1; 
+
+    for (i=0; i<count; i++){
+      ptr = s->s_events[i].data.ptr;
+
+      if (ptr == NULL){
+        continue;
+      } else if (ptr == &(s->s_fd)){
+#ifdef DEBUG
+        fprintf(stderr,"wss: new incomming connection\n");
+#endif
+        if (handle_new_client_ws(s) < 0){
+#ifdef DEBUG
+          fprintf(stderr,"wss: error handle new client\n");
+#endif
+        }
+      } else if (ptr == &(s->s_ifd)){
+        if (handle_input_ws(s) < 0){
 #ifdef DEBUG
-        fprintf(stderr, "wss: error in read_socks_ws\n");
+          fprintf(stderr,"wss: error handling broadcast input\n");
 #endif
+        }
+      } else if (ptr == &(s->s_xfd)){
+        if (s->s_xfn && ((*(s->s_xfn))(s, s->s_events[i].events) < 0)){
+#ifdef DEBUG
+          fprintf(stderr,"wss: error handling extra descriptor\n");
+#endif
+        }
+      } else {
+        c = ptr;
+        if (socks_io_ws(s, c, s->s_events[i].events) < 0){
+          disconnect_client_ws(s, c);
+        }
       }
     }
 
@@ -839,7 +1389,7 @@ int setup_tls_ws(struct ws_server *s)
   }
 */
 
-  tlsctx = SSL_CTX_new(TLSv1_server_method());
+  tlsctx = SSL_CTX_new(SSLv23_server_method());
   if (tlsctx == NULL){
 #ifdef DEBUG
     fprintf(stderr, "wss: SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
@@ -851,7 +1401,8 @@ int setup_tls_ws(struct ws_server *s)
   fprintf(stderr, "wss: tlsctx (%p)\n", tlsctx);
 #endif
 
-  SSL_CTX_set_options(tlsctx, SSL_OP_SINGLE_DH_USE);
+  SSL_CTX_set_options(tlsctx, SSL_OP_SINGLE_DH_USE | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+  SSL_CTX_set_mode(tlsctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 /*  if (ERR_peek_error() != 0){
 #ifdef DEBUG
     fprintf(stderr, "wss: SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
@@ -882,7 +1433,7 @@ int setup_tls_ws(struct ws_server *s)
   return 0;
 }
 
-int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), char *port)
+struct ws_server *prepare_server_ws(int (*client_data_fn)(struct ws_client *c), char *port, int flags)
 {
   struct ws_server *s;
   
@@ -890,7 +1441,7 @@ int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), c
 #ifdef DEBUG
     fprintf(stderr, "wss: error register signals\n");
 #endif
-    return -1;
+    return NULL;
   }
 
   s = create_server_ws(client_data_fn);
@@ -898,15 +1449,18 @@ int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), c
 #ifdef DEBUG
     fprintf(stderr, "wss: error could not create server\n");
 #endif
-    return -1;
+    return NULL;
   }
 
-  if (setup_tls_ws(s) < 0){
+  s->s_flags = flags;
+  s->s_ifd   = (flags & WS_FLAG_NOINPUT) ? (-1) : STDIN_FILENO;
+
+  if (!(flags & WS_FLAG_PLAIN) && (setup_tls_ws(s) < 0)){
 #ifdef DEBUG
     fprintf(stderr,"wss: error in tls setup\n");
 #endif
     shutdown_server_ws(s);
-    return -1;
+    return NULL;
   }
 
   if (startup_server(s, port) < 0){
@@ -914,9 +1468,17 @@ int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), c
     fprintf(stderr,"wss: error in startup\n");
 #endif
     shutdown_server_ws(s);
-    return -1;
+    return NULL;
   }
 
+  return s;
+}
+
+int serve_server_ws(struct ws_server *s)
+{
+  if (s == NULL)
+    return -1;
+
   if (run_loop_ws(s) < 0){ 
 #ifdef DEBUG
     fprintf(stderr,"wss: error during run\n");
@@ -934,6 +1496,17 @@ int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), c
   return 0;
 }
 
+int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), char *port, int flags)
+{
+  struct ws_server *s;
+
+  s = prepare_server_ws(client_data_fn, port, flags);
+  if (s == NULL)
+    return -1;
+
+  return serve_server_ws(s);
+}
+
 int write_to_client_ws(struct ws_client *c, void *buf, int n)
 {
   if (c == NULL || buf == NULL)
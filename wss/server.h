@@ -1,7 +1,8 @@
 #ifndef _SERVER_H
-#define _SERVER_h
+#define _SERVER_H
 
 #include <stdint.h>
+#include <sys/epoll.h>
 #include <openssl/ssl.h>
 
 #define TLS_CERT  "./certs/server.crt"
@@ -9,6 +10,7 @@
 
 #define C_STATE_NEW       0
 #define C_STATE_UPGRADED  1
+#define C_STATE_CLOSING   2
 
 #define WSF_FIN         0x80
 #define WSF_OPCODE      0x0f
@@ -17,14 +19,39 @@
 #define WSF_PAYLOAD_16  0x7e
 #define WSF_PAYLOAD_64  0x7f
 
+#define WSF_OP_CONTINUE 0x00
+#define WSF_OP_TEXT     0x01
+#define WSF_OP_BINARY   0x02
+#define WSF_OP_CLOSE    0x08
+
+#define WS_EVENTS       256
+#define WS_QUEUE_START  16
+#define WS_QUEUE_LIMIT  8192
+#define WS_IOV_LIMIT    64
+
+#define WS_FLAG_PLAIN   0x01
+#define WS_FLAG_NOINPUT 0x02
+
 struct ws_frame {
   uint8_t hdr[2];
   uint8_t msk[4];
   uint64_t payload;
 };
 
+/* a frame encoded once and shared by every client it is queued on */
+struct ws_message {
+  unsigned int m_refs;
+  unsigned int m_len;
+  uint8_t *m_data;
+};
+
+struct ws_server;
+
 struct ws_client {
   int c_fd;
+  int c_index;
+  int c_events;
+  int c_accepted;
 
 #if 0
   unsigned char *c_rb;
@@ -39,16 +66,27 @@ struct ws_client {
   void *c_sb;
   int c_sb_len;
 
+  struct ws_message **c_mq;
+  unsigned int c_mq_size;
+  unsigned int c_mq_head;
+  unsigned int c_mq_count;
+  unsigned int c_mq_offset;
+
   struct ws_frame *c_frame;
+
+  struct ws_server *c_server;
+  void *c_data;
 };
 
 struct ws_server {
   int s_fd; 
-  
-  fd_set s_in;
-  fd_set s_out;
-  
-  int s_hi;
+  int s_efd;
+  int s_ifd;
+
+  struct epoll_event s_events[WS_EVENTS];
+
+  char *s_ib;
+  int s_ib_len;
   
   struct ws_client **s_c;
   int s_c_count;
@@ -58,6 +96,16 @@ struct ws_server {
   int (*s_cdfn)(struct ws_client *c);
   
   SSL_CTX *s_tlsctx;
+  int s_flags;
+  int s_dirty;
+
+  /* optional hooks for modes which do more than relay standard input */
+  void *s_data;
+  int s_xfd;
+  int (*s_xfn)(struct ws_server *s, uint32_t events);
+  int (*s_ffn)(struct ws_client *c, uint8_t *data, unsigned int len);
+  int (*s_tfn)(struct ws_server *s);
+  void (*s_lfn)(struct ws_server *s, struct ws_client *c);
 
 #if 0
   int s_up_count;
@@ -68,11 +116,25 @@ struct ws_server {
 };
 
 
-int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), char *port);
+int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), char *port, int flags);
+
+struct ws_server *prepare_server_ws(int (*client_data_fn)(struct ws_client *c), char *port, int flags);
+int serve_server_ws(struct ws_server *s);
+
+int watch_fd_ws(struct ws_server *s, int fd, void *ptr, int op, uint32_t events);
+int watch_extra_ws(struct ws_server *s, int fd, uint32_t events);
+
+struct ws_message *create_message_ws(void *buf, unsigned int n);
+void release_message_ws(struct ws_message *m);
+int deliver_message_ws(struct ws_client *c, struct ws_message *m);
+int deliver_text_ws(struct ws_client *c, void *buf, unsigned int n);
+int broadcast_message_ws(struct ws_server *s, struct ws_message *m);
+void flush_clients_ws(struct ws_server *s);
 
 unsigned char *readline_client_ws(struct ws_client *c);
 int readdata_client_ws(struct ws_client *c, void *dest, unsigned int n);
 void dropdata_client_ws(struct ws_client *c);
+void discard_client_ws(struct ws_client *c, unsigned int n);
 
 int write_to_client_ws(struct ws_client *c, void *buf, int n);
 
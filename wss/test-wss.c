@@ -0,0 +1,563 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* runs wss as a bridge to a scripted katcp server and drives it with
+ * a few websocket sessions, checking that subscriptions are merged
+ * into one upstream sampling strategy per sensor, that each session
+ * only sees its own sensors at its own rate and that replies and
+ * their informs go back to the session which asked
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <netc.h>
+#include <katcp.h>
+#include <katpriv.h>
+#include <katcl.h>
+
+#define WSS "./wss"
+
+#define BUFFER   8192
+#define REPLIES    32
+#define TICK       10    /* ms between upstream sensor changes */
+#define RATE      100    /* ms rate limit given to wss */
+#define SESSIONS    3
+
+#define KEY     "dGhlIHNhbXBsZSBub25jZQ=="
+
+struct session{
+  int s_fd;
+  unsigned int s_have;
+  unsigned char s_buf[BUFFER];
+
+  unsigned int s_x;
+  unsigned int s_y;
+  unsigned int s_last_x;
+  int s_ordered;
+  unsigned int s_help;
+  unsigned int s_log;
+
+  char *s_replies[REPLIES];
+  unsigned int s_count;
+};
+
+/* fake upstream ****************************************************/
+
+static void serve_upstream(int lfd, int report)
+{
+  struct katcl_line *l;
+  struct pollfd pfd[2];
+  struct timeval now, next, tick;
+  unsigned int counter;
+  int fd, x, y, result;
+  char *name, *sensor, *strategy, *param, line[256];
+
+  l = NULL;
+  x = 0;
+  y = 0;
+  counter = 0;
+
+  tick.tv_sec = 0;
+  tick.tv_usec = TICK * 1000;
+  gettimeofday(&next, NULL);
+
+  for(;;){
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = l ? fileno_katcl(l) : (-1);
+    pfd[1].events = POLLIN | ((l && flushing_katcl(l)) ? POLLOUT : 0);
+
+    poll(pfd, 2, TICK);
+
+    if(pfd[0].revents & POLLIN){
+      fd = accept(lfd, NULL, NULL);
+      if(fd >= 0){
+        if(l){
+          destroy_katcl(l, 1);
+        }
+        l = create_katcl(fd);
+        x = 0;
+        y = 0;
+      }
+      continue;
+    }
+
+    if(l == NULL){
+      continue;
+    }
+
+    if(pfd[1].revents & POLLIN){
+      result = read_katcl(l);
+      while(have_katcl(l) > 0){
+        name = arg_string_katcl(l, 0);
+        if(name == NULL){
+          continue;
+        }
+        if(!strcmp(name, "?sensor-sampling")){
+          sensor = arg_string_katcl(l, 1);
+          strategy = arg_string_katcl(l, 2);
+          param = arg_string_katcl(l, 3);
+          if(sensor && strategy && (!strcmp(sensor, "test.x") || !strcmp(sensor, "test.y"))){
+            snprintf(line, sizeof(line), "%s %s%s%s\n", sensor, strategy, param ? " " : "", param ? param : "");
+            write(report, line, strlen(line));
+            if(!strcmp(sensor, "test.x")){
+              x = strcmp(strategy, "none");
+            } else {
+              y = strcmp(strategy, "none");
+            }
+            append_string_katcl(l, KATCP_FLAG_FIRST, "!sensor-sampling");
+            append_string_katcl(l, 0, KATCP_OK);
+            append_string_katcl(l, 0, sensor);
+            append_string_katcl(l, param ? 0 : KATCP_FLAG_LAST, strategy);
+            if(param){
+              append_string_katcl(l, KATCP_FLAG_LAST, param);
+            }
+          } else {
+            send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!sensor-sampling", KATCP_FLAG_STRING, KATCP_FAIL, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "unknown sensor", NULL);
+          }
+        } else if(!strcmp(name, "?help")){
+          send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#help", KATCP_FLAG_STRING, "watchdog", KATCP_FLAG_LAST | KATCP_FLAG_STRING, "pings the server", NULL);
+          send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#help", KATCP_FLAG_STRING, "help", KATCP_FLAG_LAST | KATCP_FLAG_STRING, "lists requests", NULL);
+          send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!help", KATCP_FLAG_STRING, KATCP_OK, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "2", NULL);
+        } else if(name[0] == KATCP_REQUEST){
+          snprintf(line, sizeof(line), "!%s", name + 1);
+          send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, line, KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCP_OK, NULL);
+        }
+      }
+      if(result){
+        destroy_katcl(l, 1);
+        l = NULL;
+        continue;
+      }
+    }
+
+    gettimeofday(&now, NULL);
+    if(cmp_time_katcp(&now, &next) >= 0){
+      counter++;
+      add_time_katcp(&next, &next, &tick);
+
+      if(x){
+        append_string_katcl(l, KATCP_FLAG_FIRST, "#sensor-status");
+        append_args_katcl(l, 0, "%lu.000", (unsigned long)time(NULL));
+        append_string_katcl(l, 0, "1");
+        append_string_katcl(l, 0, "test.x");
+        append_string_katcl(l, 0, "nominal");
+        append_unsigned_long_katcl(l, KATCP_FLAG_LAST, counter);
+      }
+      if(y){
+        append_string_katcl(l, KATCP_FLAG_FIRST, "#sensor-status");
+        append_args_katcl(l, 0, "%lu.000", (unsigned long)time(NULL));
+        append_string_katcl(l, 0, "1");
+        append_string_katcl(l, 0, "test.y");
+        append_string_katcl(l, 0, "warn");
+        append_string_katcl(l, KATCP_FLAG_LAST, "a value with spaces");
+      }
+      if((counter % 50) == 0){
+        log_message_katcl(l, KATCP_LEVEL_INFO, "test", "tick %u", counter);
+      }
+    }
+
+    write_katcl(l);
+  }
+}
+
+/* websocket sessions ***********************************************/
+
+static int open_session(struct session *s, int port)
+{
+  struct sockaddr_in sa;
+  char buffer[BUFFER];
+  unsigned int have;
+  int len, rr;
+
+  memset(s, 0, sizeof(struct session));
+  s->s_ordered = 1;
+
+  memset(&sa, 0, sizeof(struct sockaddr_in));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  s->s_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(s->s_fd < 0){
+    return -1;
+  }
+
+  if(connect(s->s_fd, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) < 0){
+    close(s->s_fd);
+    return -1;
+  }
+
+  len = snprintf(buffer, sizeof(buffer), "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: %s\r\nSec-WebSocket-Protocol: katcp\r\nSec-WebSocket-Version: 13\r\n\r\n", KEY);
+  if(write(s->s_fd, buffer, len) != len){
+    return -1;
+  }
+
+  have = 0;
+  buffer[0] = '\0';
+  while(strstr(buffer, "\r\n\r\n") == NULL){
+    rr = read(s->s_fd, buffer + have, sizeof(buffer) - have - 1);
+    if(rr <= 0){
+      return -1;
+    }
+    have += rr;
+    buffer[have] = '\0';
+  }
+
+  return strncmp(buffer, "HTTP/1.1 101", 12) ? -1 : 0;
+}
+
+static int send_session(struct session *s, char *text)
+{
+  unsigned char frame[BUFFER];
+  unsigned int i, len;
+
+  len = strlen(text);
+  if(len >= 126){
+    return -1;
+  }
+
+  frame[0] = 0x81;
+  frame[1] = 0x80 | len;
+  for(i = 0; i < 4; i++){
+    frame[2 + i] = random() & 0xff;
+  }
+  for(i = 0; i < len; i++){
+    frame[6 + i] = text[i] ^ frame[2 + (i % 4)];
+  }
+
+  return (write(s->s_fd, frame, len + 6) == (len + 6)) ? 0 : -1;
+}
+
+static void record_session(struct session *s, char *line)
+{
+  unsigned int value;
+  char *ptr;
+
+  if(!strncmp(line, "#sensor-status ", 15)){
+    if(strstr(line, " test.x ")){
+      s->s_x++;
+      ptr = strrchr(line, ' ');
+      value = atoi(ptr + 1);
+      if(value < s->s_last_x){
+        s->s_ordered = 0;
+      }
+      s->s_last_x = value;
+    } else if(strstr(line, " test.y warn a\\_value\\_with\\_spaces")){
+      s->s_y++;
+    }
+  } else if(!strncmp(line, "#help ", 6)){
+    s->s_help++;
+  } else if(!strncmp(line, "#log ", 5)){
+    s->s_log++;
+  } else if((line[0] == '!') && (s->s_count < REPLIES)){
+    s->s_replies[s->s_count++] = strdup(line);
+  }
+}
+
+static int read_session(struct session *s)
+{
+  unsigned int offset, payload;
+  unsigned char *data;
+  char line[BUFFER];
+  int rr;
+
+  rr = read(s->s_fd, s->s_buf + s->s_have, BUFFER - s->s_have);
+  if(rr <= 0){
+    return -1;
+  }
+  s->s_have += rr;
+
+  offset = 0;
+  while((s->s_have - offset) >= 2){
+    data = s->s_buf + offset;
+    payload = data[1] & 0x7f;
+    if(payload >= 126){
+      if(payload == 127){
+        return -1;
+      }
+      if((s->s_have - offset) < 4){
+        break;
+      }
+      payload = (data[2] << 8) | data[3];
+      data += 2;
+      offset += 2;
+    }
+    if((s->s_have - offset) < (2 + payload)){
+      if(data != s->s_buf + offset){
+        offset -= 2;
+      }
+      break;
+    }
+    memcpy(line, data + 2, payload);
+    line[payload] = '\0';
+    record_session(s, line);
+    offset += 2 + payload;
+  }
+
+  s->s_have -= offset;
+  memmove(s->s_buf, s->s_buf + offset, s->s_have);
+
+  return 0;
+}
+
+static void collect(struct session *set, unsigned int count, unsigned int ms)
+{
+  struct pollfd pfd[SESSIONS];
+  struct timeval now, stop, delta;
+  unsigned int i;
+  long left;
+  int result;
+
+  gettimeofday(&now, NULL);
+  delta.tv_sec = ms / 1000;
+  delta.tv_usec = (ms % 1000) * 1000;
+  add_time_katcp(&stop, &now, &delta);
+
+  while(sub_time_katcp(&delta, &stop, &now) >= 0){
+    left = (delta.tv_sec * 1000) + (delta.tv_usec / 1000);
+    for(i = 0; i < count; i++){
+      pfd[i].fd = set[i].s_fd;
+      pfd[i].events = (set[i].s_fd >= 0) ? POLLIN : 0;
+    }
+    result = poll(pfd, count, left);
+    gettimeofday(&now, NULL);
+    if(result <= 0){
+      continue;
+    }
+    for(i = 0; i < count; i++){
+      if(pfd[i].revents & POLLIN){
+        if(read_session(&(set[i])) < 0){
+          close(set[i].s_fd);
+          set[i].s_fd = (-1);
+        }
+      }
+    }
+  }
+}
+
+static int replied(struct session *s, char *prefix)
+{
+  unsigned int i;
+
+  for(i = 0; i < s->s_count; i++){
+    if(!strncmp(s->s_replies[i], prefix, strlen(prefix))){
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int await_reply(struct session *set, unsigned int count, unsigned int which, char *prefix)
+{
+  unsigned int i;
+
+  for(i = 0; i < 100; i++){
+    if(replied(&(set[which]), prefix)){
+      return 0;
+    }
+    collect(set, count, 20);
+  }
+
+  fprintf(stderr, "test: session %u never saw %s\n", which, prefix);
+
+  return -1;
+}
+
+int main(int argc, char **argv)
+{
+  struct session set[SESSIONS];
+  char bind[64], server[64], port[16], rate[16], upstream[4096], *ptr;
+  int lfd, rfd[2], wsport, failures, status, have, rr;
+  pid_t up, ws;
+  unsigned int i;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  wsport = 20000 + (getpid() % 20000);
+  snprintf(bind, sizeof(bind), "127.0.0.1:%d", wsport + 1);
+  snprintf(server, sizeof(server), "127.0.0.1:%d", wsport + 1);
+  snprintf(port, sizeof(port), "%d", wsport);
+  snprintf(rate, sizeof(rate), "%d", RATE);
+
+  lfd = net_listen(bind, 0, 0);
+  if(lfd < 0){
+    fprintf(stderr, "test: unable to listen on %s\n", bind);
+    return 2;
+  }
+
+  if(pipe(rfd) < 0){
+    return 2;
+  }
+
+  fflush(stdout);
+
+  up = fork();
+  if(up < 0){
+    return 2;
+  }
+  if(up == 0){
+    close(rfd[0]);
+    freopen("/dev/null", "w", stderr);
+    serve_upstream(lfd, rfd[1]);
+    exit(0);
+  }
+
+  close(rfd[1]);
+  close(lfd);
+
+  ws = fork();
+  if(ws < 0){
+    return 2;
+  }
+  if(ws == 0){
+    freopen("/dev/null", "w", stderr);
+    execl(WSS, WSS, "-n", "-p", port, "-s", server, "-r", rate, NULL);
+    exit(4);
+  }
+
+  for(i = 0; i < 50; i++){
+    usleep(100000);
+    if(open_session(&(set[0]), wsport) == 0){
+      break;
+    }
+  }
+
+  failures = 0;
+
+  for(i = 1; i < SESSIONS; i++){
+    if(open_session(&(set[i]), wsport) < 0){
+      fprintf(stderr, "test: unable to open session %u\n", i);
+      failures++;
+    }
+  }
+
+  /* B wants a slow period first, A then needs every change, C another sensor */
+  send_session(&(set[1]), "?sensor-sampling test.x period 0.5");
+  failures -= await_reply(set, SESSIONS, 1, "!sensor-sampling ok test.x period 0.5");
+
+  send_session(&(set[0]), "?sensor-sampling test.x event");
+  failures -= await_reply(set, SESSIONS, 0, "!sensor-sampling ok test.x event");
+
+  send_session(&(set[2]), "?sensor-sampling test.y auto");
+  send_session(&(set[2]), "?sensor-sampling test.z event");
+  failures -= await_reply(set, SESSIONS, 2, "!sensor-sampling ok test.y auto");
+  failures -= await_reply(set, SESSIONS, 2, "!sensor-sampling fail");
+
+  send_session(&(set[0]), "?help");
+  failures -= await_reply(set, SESSIONS, 0, "!help ok 2");
+
+  send_session(&(set[1]), "?sensor-sampling test.x");
+  failures -= await_reply(set, SESSIONS, 1, "!sensor-sampling ok test.x period 0.5");
+
+  for(i = 0; i < SESSIONS; i++){
+    set[i].s_x = 0;
+    set[i].s_y = 0;
+    set[i].s_log = 0;
+  }
+
+  collect(set, SESSIONS, 2000);
+
+  printf("test: in 2s event session got %u, period session %u, other session %u updates\n", set[0].s_x, set[1].s_x, set[2].s_y);
+
+  if((set[0].s_x < 10) || (set[0].s_x > 22)){
+    fprintf(stderr, "test: event session not limited to the rate\n");
+    failures++;
+  }
+  if(set[0].s_ordered == 0){
+    fprintf(stderr, "test: updates arrived out of order\n");
+    failures++;
+  }
+  if((set[1].s_x < 3) || (set[1].s_x > 6)){
+    fprintf(stderr, "test: period session did not see its period\n");
+    failures++;
+  }
+  if((set[2].s_y < 10) || (set[2].s_y > 22)){
+    fprintf(stderr, "test: escaped values not relayed\n");
+    failures++;
+  }
+  if(set[0].s_y || set[1].s_y || set[2].s_x){
+    fprintf(stderr, "test: sensor updates sent to sessions which did not subscribe\n");
+    failures++;
+  }
+  if((set[0].s_help != 2) || set[1].s_help || set[2].s_help){
+    fprintf(stderr, "test: help informs went to %u, %u and %u, expected only the requester\n", set[0].s_help, set[1].s_help, set[2].s_help);
+    failures++;
+  }
+  if((set[0].s_log == 0) || (set[1].s_log == 0) || (set[2].s_log == 0)){
+    fprintf(stderr, "test: unsolicited informs not sent to all sessions\n");
+    failures++;
+  }
+
+  /* the event session leaves, upstream drops back to the period */
+  close(set[0].s_fd);
+  set[0].s_fd = (-1);
+  collect(set, SESSIONS, 300);
+
+  send_session(&(set[1]), "?sensor-sampling test.x none");
+  failures -= await_reply(set, SESSIONS, 1, "!sensor-sampling ok test.x none");
+  collect(set, SESSIONS, 300);
+
+  kill(ws, SIGTERM);
+  waitpid(ws, &status, 0);
+  kill(up, SIGTERM);
+  waitpid(up, NULL, 0);
+
+  have = 0;
+  while((have < (sizeof(upstream) - 1)) && ((rr = read(rfd[0], upstream + have, sizeof(upstream) - 1 - have)) > 0)){
+    have += rr;
+  }
+  upstream[have] = '\0';
+
+  printf("test: upstream sampling requests\n%s", upstream);
+
+  if(strstr(upstream, "test.x period 0.500000\ntest.x event\n") == NULL){
+    fprintf(stderr, "test: event not merged over the period\n");
+    failures++;
+  }
+  ptr = strstr(upstream, "test.x event\n");
+  if((ptr == NULL) || (strstr(ptr, "test.x period 0.500000\ntest.x none\n") == NULL)){
+    fprintf(stderr, "test: upstream not back to the period, then off\n");
+    failures++;
+  }
+  if(strstr(upstream, "test.y event\n") == NULL){
+    fprintf(stderr, "test: auto not asked for as event\n");
+    failures++;
+  }
+  if(strstr(upstream, "test.z")){
+    fprintf(stderr, "test: requested a sensor which does not exist upstream\n");
+    failures++;
+  }
+
+  for(i = 0; i < SESSIONS; i++){
+    if(set[i].s_fd >= 0){
+      close(set[i].s_fd);
+    }
+  }
+
+  if(failures){
+    printf("test: %d failures\n", failures);
+    return 1;
+  }
+
+  printf("test: ok\n");
+
+  return 0;
+}
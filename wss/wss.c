@@ -13,9 +13,12 @@
 #include <openssl/ssl.h>
 
 #include "server.h"
+#include "bridge.h"
 
 #define PORT          "6969"
 
+#define READBUFFERLIMIT (1024 * 1024)
+
 #define WSSECKEY      "Sec-WebSocket-Key: "
 #define WSSECPROTO    "Sec-WebSocket-Protocol: "
 #define WSPROTO       "katcp"
@@ -26,7 +29,7 @@ int generate_upgrade_response_ws(struct ws_client *c, char *key)
 {
   unsigned char   md_value[EVP_MAX_MD_SIZE];
   unsigned int    md_len;
-  EVP_MD_CTX      mdctx;
+  EVP_MD_CTX      *mdctx;
   BIO             *bmem, *b64;
   BUF_MEM         *bptr;
   char            skey[512], temp[100];
@@ -43,10 +46,14 @@ int generate_upgrade_response_ws(struct ws_client *c, char *key)
 
   bzero(temp, 100);
 
-  EVP_DigestInit(&mdctx, EVP_sha1());
-  EVP_DigestUpdate(&mdctx, skey, len);
-  EVP_DigestFinal_ex(&mdctx, md_value, &md_len);
-  EVP_MD_CTX_cleanup(&mdctx);
+  mdctx = EVP_MD_CTX_create();
+  if (mdctx == NULL)
+    return -1;
+
+  EVP_DigestInit(mdctx, EVP_sha1());
+  EVP_DigestUpdate(mdctx, skey, len);
+  EVP_DigestFinal_ex(mdctx, md_value, &md_len);
+  EVP_MD_CTX_destroy(mdctx);
   
   b64  = BIO_new(BIO_f_base64());
   if (b64 == NULL){
@@ -114,6 +121,10 @@ int parse_http_proto_ws(struct ws_client *c)
   key   = NULL;
   proto = NULL;
 
+  /* nonblocking reads may deliver the request in pieces */
+  if (c->c_rb == NULL || memmem(c->c_rb, c->c_rb_len, "\r\n\r\n", 4) == NULL)
+    return 0;
+
   while ((line = (char*)readline_client_ws(c)) != NULL){
 #ifdef DEBUG
     fprintf(stderr, "wss: line [%s]\n", line);
@@ -188,115 +199,116 @@ int parse_http_proto_ws(struct ws_client *c)
   return 0;
 }
 
+void unmask_payload_ws(uint8_t *data, uint64_t len, uint8_t msk[4])
+{
+  uint64_t i, word, wide;
+  uint32_t narrow;
+
+  /* the key repeats every four bytes, so two copies cover a word in memory order */
+  memcpy(&narrow, msk, sizeof(uint32_t));
+  wide = ((uint64_t) narrow << 32) | narrow;
+
+  for (i = 0; (i + sizeof(uint64_t)) <= len; i += sizeof(uint64_t)){
+    memcpy(&word, data + i, sizeof(uint64_t));
+    word ^= wide;
+    memcpy(data + i, &word, sizeof(uint64_t));
+  }
+
+  for (; i < len; i++){
+    data[i] ^= msk[i & 0x3];
+  }
+}
+
 int parse_websocket_proto_ws(struct ws_client *c)
 {
-  int i, len, opcode, shift;
-  uint8_t hdr[2];
-  uint8_t msk[4];
+  int opcode;
+  unsigned int need;
   uint64_t payload;
-  unsigned char *data;
+  uint8_t *data, *msk;
 
-  if (c == NULL || c->c_rb == NULL)
-    return -1;
-  
-  shift = 0;
-  len = sizeof(hdr);
-  //hdr = *((uint8_t *) readdata_client_ws(c, len));
-  if (readdata_client_ws(c, &hdr, len) < 0){
-#ifdef DEBUG
-    fprintf(stderr, "wss: error readdata\n");
-#endif
+  if (c == NULL)
     return -1;
-  }
 
-#ifdef DEBUG
-  fprintf(stderr, "wss: HDR: 0x%x\n", (uint16_t)*hdr);
-#endif
+  /* a read may end part way into a frame or hold several */
+  while (c->c_rb != NULL && c->c_rb_len >= 2){
+
+    data = (uint8_t *) c->c_rb;
+
+    opcode  = data[0] & WSF_OPCODE;
+    payload = data[1] & WSF_PAYLOAD;
+    need    = 2;
+
+    switch (payload){
+      case WSF_PAYLOAD_16:
+        if (c->c_rb_len < 4)
+          return 0;
+        payload = ((uint64_t) data[2] << 8) | data[3];
+        need = 4;
+        break;
+
+      case WSF_PAYLOAD_64:
+        if (c->c_rb_len < 10)
+          return 0;
+        memcpy(&payload, data + 2, sizeof(uint64_t));
+        payload = be64toh(payload);
+        need = 10;
+        break;
+    }
 
-  if (hdr[0] & WSF_FIN){
+    if (!(data[1] & WSF_MASK)){
 #ifdef DEBUG
-    fprintf(stderr, "wss: FIN SET\n");
-#endif
-  }
-  
-  opcode = hdr[0] & WSF_OPCODE;
-
-#if 0 
-def DEBUG
-  fprintf(stderr, "wss: HDR: 0x%0x\n", hdr[1]);
+      fprintf(stderr, "wss: client frame not masked\n");
 #endif
+      return -1;
+    }
 
-  if (hdr[1] & WSF_MASK){
+    if (payload > READBUFFERLIMIT){
 #ifdef DEBUG
-    fprintf(stderr, "wss: MASK SET\n");
+      fprintf(stderr, "wss: client frame of %llu bytes too large\n", (unsigned long long) payload);
 #endif
-  }
+      return -1;
+    }
 
-  payload = hdr[1] & WSF_PAYLOAD;
-   
-#if 1
-  switch (payload){
-    case WSF_PAYLOAD_16:
-#ifdef DEBUG
-      fprintf(stderr, "wss: Extended Payload is 16bits\n");
-#endif
-      //payload = ntohs(*((uint16_t *) readdata_client_ws(c, sizeof(uint16_t))));    
-      if (readdata_client_ws(c, &payload, sizeof(uint16_t)) < 0){
-#ifdef DEBUG
-        fprintf(stderr, "wss: error readdata\n");
-#endif
-        return -1;
-      }
-      payload = ntohs(payload);
-      break;
+    msk = data + need;
+    need += sizeof(uint32_t);
+
+    if ((uint64_t) c->c_rb_len < need + payload)
+      return 0;
 
-    case WSF_PAYLOAD_64:
-#ifdef DEBUG
-      fprintf(stderr, "wss: Extended Payload is 64bits\n");
-#endif
-      //payload = be64toh(*((uint64_t *) readdata_client_ws(c, sizeof(uint64_t))));    
-      if (readdata_client_ws(c, &payload, sizeof(uint64_t)) < 0){
 #ifdef DEBUG
-        fprintf(stderr, "wss: error readdata\n");
+    fprintf(stderr, "wss: OPCODE 0x%x PAYLOAD: %llu\n", opcode, (unsigned long long) payload);
 #endif
-        return -1;
-      }
-      payload = be64toh(payload);
-      break;
-  }
-#endif 
 
-#if 0
-  len = sizeof(uint8_t);
-  msk[0] = *((uint8_t *) readdata_client_ws(c, len));
-  msk[1] = *((uint8_t *) readdata_client_ws(c, len));
-  msk[2] = *((uint8_t *) readdata_client_ws(c, len));
-  msk[3] = *((uint8_t *) readdata_client_ws(c, len));
-#endif
+    unmask_payload_ws(data + need, payload, msk);
 
-  if (readdata_client_ws(c, msk, sizeof(msk)) < 0){
-#ifdef DEBUG
-    fprintf(stderr, "wss: error readdata\n");
-#endif
-    return -1;
-  }
+    switch (opcode){
+      case WSF_OP_CONTINUE :
+      case WSF_OP_TEXT :
+      case WSF_OP_BINARY :
+        if (c->c_server && c->c_server->s_ffn){
+          if ((*(c->c_server->s_ffn))(c, data + need, payload) < 0)
+            return -1;
+        } else {
+          fwrite(data + need, 1, payload, stdout);
+          fputc('\n', stdout);
+        }
+        break;
 
+      case WSF_OP_CLOSE :
 #ifdef DEBUG
-  fprintf(stderr, "wss: OPCODE 0x%x PAYLOAD: 0x%x MASKKEY: 0x%x\n", opcode, payload, msk);
+        fprintf(stderr, "wss: client sent close frame\n");
 #endif
+        fflush(stdout);
+        return -1;
 
-  data = (unsigned char *) c->c_rb;
-  for(i=0; i<c->c_rb_len; i++)
-    data[i] ^= msk[i % 4];
-    
-#ifdef DEBUG
-  for(i=0; i<c->c_rb_len; i++)
-    fprintf(stderr,"byte %d 0x%0x %c\n", i, data[i], data[i]);
-#endif
+      default :
+        break;
+    }
 
-  fprintf(stdout, "%s\n", readline_client_ws(c));
+    discard_client_ws(c, need + payload);
+  }
 
-  dropdata_client_ws(c);
+  fflush(stdout);
 
   return 0;
 }
@@ -322,9 +334,108 @@ int capture_client_data_ws(struct ws_client *c)
 }
 
 
+void usage_ws(char *app)
+{
+  printf("usage: %s [flags]\n", app);
+  printf("-h                 this help\n");
+  printf("-p port            listen on the given port (default %s)\n", PORT);
+  printf("-n                 plain websockets, without tls\n");
+  printf("-s server[:port]   bridge browser sessions to the given katcp server\n");
+  printf("-r ms              least interval between updates of a sensor to one session in bridge mode (default %d)\n", BRIDGE_RATE);
+  printf("\n");
+  printf("lines on standard input are broadcast as text frames to all upgraded clients\n");
+  printf("frames from clients are written to standard output\n");
+  printf("in bridge mode frames are katcp requests relayed over a single upstream connection\n");
+}
+
 int main(int argc, char *argv[]) 
 {
-  return register_client_handler_server(&capture_client_data_ws, PORT);
+  struct ws_server *s;
+  struct ws_bridge *b;
+  char *port, *upstream;
+  unsigned int rate;
+  int i, j, c, flags, result;
+
+  port     = PORT;
+  upstream = NULL;
+  rate     = BRIDGE_RATE;
+  flags    = 0;
+
+  i = 1;
+  j = 1;
+  while (i < argc) {
+    if (argv[i][0] == '-') {
+      c = argv[i][j];
+      switch (c) {
+        case 'h' :
+          usage_ws(argv[0]);
+          return 0;
+        case 'n' :
+          flags |= WS_FLAG_PLAIN;
+          j++;
+          break;
+        case 'p' :
+        case 's' :
+        case 'r' :
+          j++;
+          if (argv[i][j] == '\0') {
+            j = 0;
+            i++;
+          }
+          if (i >= argc) {
+            fprintf(stderr, "%s: option -%c requires a parameter\n", argv[0], c);
+            return 2;
+          }
+          switch (c){
+            case 'p' :
+              port = argv[i] + j;
+              break;
+            case 's' :
+              upstream = argv[i] + j;
+              break;
+            case 'r' :
+              rate = atoi(argv[i] + j);
+              break;
+          }
+          i++;
+          j = 1;
+          break;
+        case '-' :
+          j++;
+          break;
+        case '\0':
+          j = 1;
+          i++;
+          break;
+        default:
+          fprintf(stderr, "%s: unknown option -%c\n", argv[0], c);
+          return 2;
+      }
+    } else {
+      fprintf(stderr, "%s: unexpected argument %s\n", argv[0], argv[i]);
+      return 2;
+    }
+  }
+
+  if (upstream == NULL){
+    return register_client_handler_server(&capture_client_data_ws, port, flags) < 0 ? 1 : 0;
+  }
+
+  s = prepare_server_ws(&capture_client_data_ws, port, flags | WS_FLAG_NOINPUT);
+  if (s == NULL)
+    return 1;
+
+  b = create_bridge_ws(s, upstream, rate);
+  if (b == NULL){
+    fprintf(stderr, "%s: unable to set up bridge to %s\n", argv[0], upstream);
+    return 1;
+  }
+
+  result = serve_server_ws(s);
+
+  destroy_bridge_ws(b);
+
+  return (result < 0) ? 1 : 0;
 }
  
 
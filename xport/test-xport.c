@@ -0,0 +1,504 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* runs kcpxport against a set of fake xports served from one
+ * process on loopback. Powers a fleet up with a stagger and checks
+ * that the power up writes are spaced out, then powers a fleet down
+ * where one xport ignores its first connection and another never
+ * answers, checking that the first recovers on a retry, the second
+ * fails on its own and the progress sensor tracks both
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <netc.h>
+#include <katcp.h>
+#include <katpriv.h>
+#include <fixture.h>
+
+#define UNITS          4
+#define BASE       24000
+#define LINE        1024
+#define CONNS         32
+
+#define STAGGER      300   /* ms */
+#define SLACK         50   /* ms */
+
+#define ROLE_NORMAL    0
+#define ROLE_FLAKY     1   /* ignores its first connection */
+#define ROLE_SILENT    2   /* accepts, never answers */
+
+#define REGISTER_POWERSTATE  0x280
+#define REGISTER_POWERUP     0x281
+#define REGISTER_POWERDOWN   0x282
+
+struct unit{
+  int u_role;
+  int u_on;
+  unsigned int u_accepts;
+};
+
+struct conn{
+  int c_fd;
+  int c_mute;
+  struct unit *c_unit;
+  unsigned int c_have;
+  unsigned char c_buffer[LINE];
+};
+
+/* speaks the binary xport protocol: ping 0x08, read 0x01 addr, write 0x02 addr value */
+
+static int serve_conn(struct conn *c, int report, unsigned int index, struct timeval *start)
+{
+  unsigned char reply[3];
+  unsigned int address, used, len;
+  struct timeval now, delta;
+  char line[LINE];
+  long when;
+
+  gettimeofday(&now, NULL);
+  sub_time_katcp(&delta, &now, start);
+  when = (delta.tv_sec * 1000) + (delta.tv_usec / 1000);
+
+  used = 0;
+
+  while(used < c->c_have){
+    len = 0;
+    switch(c->c_buffer[used]){
+      case 0x08 :
+        reply[len++] = 0x08;
+        used += 1;
+        break;
+      case 0x01 :
+        if(c->c_have - used < 3){
+          return 0;
+        }
+        address = c->c_buffer[used + 1] + (c->c_buffer[used + 2] * 256);
+        reply[len++] = 0x01;
+        if(address == REGISTER_POWERSTATE){
+          reply[len++] = c->c_unit->u_on ? 0x03 : 0x04;
+        } else {
+          reply[len++] = 0;
+        }
+        reply[len++] = 0;
+        used += 3;
+        break;
+      case 0x02 :
+        if(c->c_have - used < 5){
+          return 0;
+        }
+        address = c->c_buffer[used + 1] + (c->c_buffer[used + 2] * 256);
+        if(address == REGISTER_POWERUP){
+          c->c_unit->u_on = 1;
+          snprintf(line, LINE, "up %u %ld\n", index, when);
+          write(report, line, strlen(line));
+        } else if(address == REGISTER_POWERDOWN){
+          c->c_unit->u_on = 0;
+          snprintf(line, LINE, "down %u %ld\n", index, when);
+          write(report, line, strlen(line));
+        }
+        reply[len++] = 0x01;
+        used += 5;
+        break;
+      default :
+        used++;
+        break;
+    }
+
+    if(len > 0){
+      if(write(c->c_fd, reply, len) != len){
+        return -1;
+      }
+    }
+
+    memmove(c->c_buffer, c->c_buffer + used, c->c_have - used);
+    c->c_have -= used;
+    used = 0;
+  }
+
+  return 0;
+}
+
+static void serve(int *fds, struct unit *units, unsigned int count, int report)
+{
+  struct conn conns[CONNS];
+  struct timeval start;
+  unsigned int i, j;
+  fd_set fsr;
+  int max, fd, rr;
+
+  gettimeofday(&start, NULL);
+
+  for(j = 0; j < CONNS; j++){
+    conns[j].c_fd = (-1);
+  }
+
+  for(;;){
+    FD_ZERO(&fsr);
+    max = (-1);
+
+    for(i = 0; i < count; i++){
+      FD_SET(fds[i], &fsr);
+      if(fds[i] > max){
+        max = fds[i];
+      }
+    }
+    for(j = 0; j < CONNS; j++){
+      if(conns[j].c_fd >= 0){
+        FD_SET(conns[j].c_fd, &fsr);
+        if(conns[j].c_fd > max){
+          max = conns[j].c_fd;
+        }
+      }
+    }
+
+    if(select(max + 1, &fsr, NULL, NULL, NULL) <= 0){
+      continue;
+    }
+
+    for(i = 0; i < count; i++){
+      if(!FD_ISSET(fds[i], &fsr)){
+        continue;
+      }
+      fd = accept(fds[i], NULL, NULL);
+      if(fd < 0){
+        continue;
+      }
+      for(j = 0; (j < CONNS) && (conns[j].c_fd >= 0); j++);
+      if(j >= CONNS){
+        close(fd);
+        continue;
+      }
+      units[i].u_accepts++;
+      conns[j].c_fd = fd;
+      conns[j].c_unit = &(units[i]);
+      conns[j].c_have = 0;
+      conns[j].c_mute = (units[i].u_role == ROLE_SILENT) || ((units[i].u_role == ROLE_FLAKY) && (units[i].u_accepts == 1));
+    }
+
+    for(j = 0; j < CONNS; j++){
+      if((conns[j].c_fd < 0) || !FD_ISSET(conns[j].c_fd, &fsr)){
+        continue;
+      }
+      rr = read(conns[j].c_fd, conns[j].c_buffer + conns[j].c_have, LINE - conns[j].c_have);
+      if(rr <= 0){
+        close(conns[j].c_fd);
+        conns[j].c_fd = (-1);
+        continue;
+      }
+      if(conns[j].c_mute){
+        continue;
+      }
+      conns[j].c_have += rr;
+      if(serve_conn(&(conns[j]), report, conns[j].c_unit - units, &start) < 0){
+        close(conns[j].c_fd);
+        conns[j].c_fd = (-1);
+      }
+    }
+  }
+}
+
+/* runs kcpxport with the given options, collecting its output; returns its exit code */
+
+static int run_xport(char **options, unsigned int base, unsigned int count, char **output)
+{
+  char *args[32], list[UNITS][32];
+  unsigned int i, arg;
+
+  arg = 0;
+  args[arg++] = "./kcpxport";
+  for(i = 0; options[i]; i++){
+    args[arg++] = options[i];
+  }
+  for(i = 0; i < count; i++){
+    snprintf(list[i], sizeof(list[i]), "127.0.0.1:%u", base + i);
+    args[arg++] = list[i];
+  }
+  args[arg] = NULL;
+
+  /* xport reads requests from its stdout, which the fixture makes a socket */
+  return run_fixture(args, NULL, output);
+}
+
+static int last_progress(char *output, char *state, unsigned int size)
+{
+  char *ptr, *next;
+  int value;
+
+  value = (-1);
+
+  for(ptr = strstr(output, "#sensor-status "); ptr; ptr = next){
+    next = strstr(ptr + 1, "#sensor-status ");
+    if(sscanf(ptr, "#sensor-status %*s 1 xport.progress %15s %d", state, &value) != 2){
+      value = (-1);
+    }
+  }
+
+  state[size - 1] = '\0';
+
+  return value;
+}
+
+int main(int argc, char **argv)
+{
+  struct unit units[UNITS];
+  int fds[UNITS], report[2];
+  unsigned int base, i, have;
+  long times[UNITS], when;
+  char *output, events[LINE * 4], state[16], what[32], *ptr;
+  int failures, code, value, index, rr, downs[UNITS];
+  pid_t server;
+  char *up[] = { "-U", "-s", "300", "-w", "0", "-t", "20", NULL };
+  char *down[] = { "-D", "-t", "2", "-r", "1", NULL };
+  char *query[] = { "-Q", "-t", "2", NULL };
+
+  signal(SIGPIPE, SIG_IGN);
+
+  base = BASE + ((getpid() % 1000) * UNITS);
+
+  for(i = 0; i < UNITS; i++){
+    fds[i] = net_listen("127.0.0.1", base + i, 0);
+    if(fds[i] < 0){
+      fprintf(stderr, "test: unable to listen on port %u: %s\n", base + i, strerror(errno));
+      return 2;
+    }
+  }
+
+  if(pipe(report) < 0){
+    return 2;
+  }
+
+  for(i = 0; i < UNITS; i++){
+    units[i].u_role = ROLE_NORMAL;
+    units[i].u_on = 0;
+    units[i].u_accepts = 0;
+  }
+  units[1].u_role = ROLE_FLAKY;
+  units[2].u_role = ROLE_SILENT;
+
+  /* first round: every xport answers */
+  server = fork();
+  if(server < 0){
+    return 2;
+  }
+  if(server == 0){
+    for(i = 0; i < UNITS; i++){
+      units[i].u_role = ROLE_NORMAL;
+    }
+    close(report[0]);
+    serve(fds, units, UNITS, report[1]);
+    exit(1);
+  }
+
+  failures = 0;
+
+  code = run_xport(up, base, UNITS, &output);
+  if(output == NULL){
+    fprintf(stderr, "test: unable to run kcpxport\n");
+    return 2;
+  }
+  value = last_progress(output, state, sizeof(state));
+
+  printf("test: power up exited with %d, progress %d %s\n", code, value, state);
+
+  if(code != 0){
+    fprintf(stderr, "test: power up of all xports failed\n");
+    failures++;
+  }
+  if(strstr(output, "#sensor-list xport.progress") == NULL){
+    fprintf(stderr, "test: progress sensor not declared\n");
+    failures++;
+  }
+  if((value != UNITS) || strcmp(state, "nominal")){
+    fprintf(stderr, "test: progress did not reach all xports\n");
+    failures++;
+  }
+
+  free(output);
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+
+  /* the simulator child exited, so the events pipe can be drained without blocking */
+  close(report[1]);
+  have = 0;
+  while((have < sizeof(events) - 1) && ((rr = read(report[0], events + have, sizeof(events) - 1 - have)) > 0)){
+    have += rr;
+  }
+  events[have] = '\0';
+  close(report[0]);
+
+  for(i = 0; i < UNITS; i++){
+    times[i] = (-1);
+  }
+  for(ptr = events; ptr && *ptr; ptr = strchr(ptr, '\n') ? strchr(ptr, '\n') + 1 : NULL){
+    if(sscanf(ptr, "%31s %d %ld", what, &index, &when) == 3){
+      if(!strcmp(what, "up") && (index >= 0) && (index < UNITS) && (times[index] < 0)){
+        times[index] = when;
+      }
+    }
+  }
+
+  /* order the power up times, then check their spacing */
+  for(i = 0; i < UNITS; i++){
+    if(times[i] < 0){
+      fprintf(stderr, "test: xport %u not powered up\n", i);
+      failures++;
+    }
+  }
+  for(i = 1; i < UNITS; i++){
+    for(index = i; (index > 0) && (times[index - 1] > times[index]); index--){
+      when = times[index];
+      times[index] = times[index - 1];
+      times[index - 1] = when;
+    }
+  }
+  for(i = 1; i < UNITS; i++){
+    printf("test: power up %u came %ldms after the previous one\n", i, times[i] - times[i - 1]);
+    if((times[i] - times[i - 1]) < (STAGGER - SLACK)){
+      fprintf(stderr, "test: power ups not staggered by %ums\n", STAGGER);
+      failures++;
+    }
+  }
+
+  /* second round: all on, one flaky, one silent */
+  if(pipe(report) < 0){
+    return 2;
+  }
+
+  for(i = 0; i < UNITS; i++){
+    units[i].u_on = 1;
+  }
+
+  server = fork();
+  if(server < 0){
+    return 2;
+  }
+  if(server == 0){
+    close(report[0]);
+    serve(fds, units, UNITS, report[1]);
+    exit(1);
+  }
+
+  code = run_xport(down, base, UNITS, &output);
+  if(output == NULL){
+    fprintf(stderr, "test: unable to run kcpxport\n");
+    return 2;
+  }
+  value = last_progress(output, state, sizeof(state));
+
+  printf("test: power down exited with %d, progress %d %s\n", code, value, state);
+
+  if(code != 1){
+    fprintf(stderr, "test: power down did not report the silent xport\n");
+    failures++;
+  }
+  if((value != UNITS) || strcmp(state, "warn")){
+    fprintf(stderr, "test: progress did not count the failure and warn\n");
+    failures++;
+  }
+  if(strstr(output, "starting\\_attempt\\_2\\_of\\_2") == NULL){
+    fprintf(stderr, "test: timed out xports not retried\n");
+    failures++;
+  }
+
+  free(output);
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+
+  close(report[1]);
+  have = 0;
+  while((have < sizeof(events) - 1) && ((rr = read(report[0], events + have, sizeof(events) - 1 - have)) > 0)){
+    have += rr;
+  }
+  events[have] = '\0';
+  close(report[0]);
+
+  for(i = 0; i < UNITS; i++){
+    downs[i] = 0;
+  }
+  for(ptr = events; ptr && *ptr; ptr = strchr(ptr, '\n') ? strchr(ptr, '\n') + 1 : NULL){
+    if((sscanf(ptr, "%31s %d %ld", what, &index, &when) == 3) && !strcmp(what, "down") && (index >= 0) && (index < UNITS)){
+      downs[index]++;
+    }
+  }
+
+  if((downs[0] != 1) || (downs[3] != 1)){
+    fprintf(stderr, "test: healthy xports not powered down once\n");
+    failures++;
+  }
+  if(downs[1] != 1){
+    fprintf(stderr, "test: flaky xport not powered down on retry\n");
+    failures++;
+  }
+  if(downs[2] != 0){
+    fprintf(stderr, "test: silent xport powered down\n");
+    failures++;
+  }
+
+  /* a single xport behaves as before: no sensor, result in the exit code */
+  if(pipe(report) < 0){
+    return 2;
+  }
+  units[0].u_role = ROLE_NORMAL;
+
+  server = fork();
+  if(server < 0){
+    return 2;
+  }
+  if(server == 0){
+    close(report[0]);
+    serve(fds, units, UNITS, report[1]);
+    exit(1);
+  }
+  close(report[1]);
+
+  code = run_xport(query, base, 1, &output);
+  if(output == NULL){
+    fprintf(stderr, "test: unable to run kcpxport\n");
+    return 2;
+  }
+
+  printf("test: single query exited with %d\n", code);
+
+  if(code != 0){
+    fprintf(stderr, "test: single query failed\n");
+    failures++;
+  }
+  if(strstr(output, "#sensor-list")){
+    fprintf(stderr, "test: sensor declared for a single xport\n");
+    failures++;
+  }
+
+  free(output);
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  close(report[0]);
+
+  for(i = 0; i < UNITS; i++){
+    close(fds[i]);
+  }
+
+  if(failures){
+    printf("test: %d failures\n", failures);
+    return 1;
+  }
+
+  printf("test: ok\n");
+
+  return 0;
+}
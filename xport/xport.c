@@ -52,9 +52,31 @@
 
 #define BUFFER 64
 
+#define PROGRESS_SENSOR_NAME         "xport.progress"
+#define PROGRESS_SENSOR_DESCRIPTION  "number of xports done with their power operation"
+
 struct item;
+struct state;
+
+struct fleet{
+  struct katcl_line *f_up;
+
+  struct state **f_vector;
+  unsigned int f_count;
+
+  unsigned int f_done;
+  unsigned int f_failed;
+
+  struct timeval f_stagger;
+  struct timeval f_slot;
+
+  unsigned int f_retries;
+  int f_verbose;
+};
 
 struct state{
+  struct fleet *s_fleet;
+
   char *s_name;
   struct sockaddr_in s_sa;
 
@@ -79,6 +101,10 @@ struct state{
 
   unsigned int s_transition;
   unsigned int s_limit;
+  unsigned int s_attempt;
+
+  int s_code;
+  int s_running;
 
   struct timeval s_single;
   struct timeval s_total;
@@ -117,15 +143,13 @@ void destroy_state(struct state *ss)
     close(ss->s_fd);
   }
 
-  if(ss->s_up){
-    destroy_katcl(ss->s_up, 0);
-    ss->s_up = NULL;
-  }
+  /* upstream line belongs to the fleet */
+  ss->s_up = NULL;
 
   free(ss);
 }
 
-struct state *create_state(int fd)
+struct state *create_state(struct fleet *f)
 {
   struct state *ss;
 
@@ -134,6 +158,8 @@ struct state *create_state(int fd)
     return NULL;
   }
 
+  ss->s_fleet = f;
+
   ss->s_name = NULL;
   /* s_sa, fd sets */
 
@@ -149,26 +175,102 @@ struct state *create_state(int fd)
 
   ss->s_fd = (-1);
 
-  ss->s_up = NULL;
+  ss->s_up = f->f_up;
 
   ss->s_table = NULL;
   ss->s_size = 0;
   ss->s_index = 0;
 
   ss->s_transition = ITEM_STAY;
+  ss->s_limit = 0;
+  ss->s_attempt = 0;
+
+  ss->s_code = ITEM_OK;
+  ss->s_running = 0;
+
+  return ss;
+}
 
-  ss->s_up = create_katcl(fd);
-  if(ss->s_up == NULL){
-    destroy_state(ss);
+void destroy_fleet(struct fleet *f)
+{
+  unsigned int i;
+
+  if(f == NULL){
+    return;
+  }
+
+  if(f->f_vector){
+    for(i = 0; i < f->f_count; i++){
+      destroy_state(f->f_vector[i]);
+    }
+    free(f->f_vector);
+    f->f_vector = NULL;
+  }
+  f->f_count = 0;
+
+  if(f->f_up){
+    destroy_katcl(f->f_up, 0);
+    f->f_up = NULL;
+  }
+
+  free(f);
+}
+
+struct fleet *create_fleet(int fd)
+{
+  struct fleet *f;
+
+  f = malloc(sizeof(struct fleet));
+  if(f == NULL){
     return NULL;
   }
 
-  return ss;
+  f->f_up = NULL;
+
+  f->f_vector = NULL;
+  f->f_count = 0;
+
+  f->f_done = 0;
+  f->f_failed = 0;
+
+  f->f_stagger.tv_sec = 0;
+  f->f_stagger.tv_usec = 0;
+
+  f->f_slot.tv_sec = 0;
+  f->f_slot.tv_usec = 0;
+
+  f->f_retries = 0;
+  f->f_verbose = 1;
+
+  f->f_up = create_katcl(fd);
+  if(f->f_up == NULL){
+    destroy_fleet(f);
+    return NULL;
+  }
+
+  return f;
 }
 
-int add_roach(struct state *ss, char *name)
+int add_roach(struct fleet *f, char *name)
 {
+  struct state *ss, **tmp;
   struct hostent *he;
+  char *ptr;
+  int port;
+
+  tmp = realloc(f->f_vector, sizeof(struct state *) * (f->f_count + 1));
+  if(tmp == NULL){
+    sync_message_katcl(f->f_up, KATCP_LEVEL_ERROR, NAME, "unable to allocate space for roach %s", name);
+    return -1;
+  }
+  f->f_vector = tmp;
+
+  ss = create_state(f);
+  if(ss == NULL){
+    sync_message_katcl(f->f_up, KATCP_LEVEL_ERROR, NAME, "unable to allocate state for roach %s", name);
+    return -1;
+  }
+  f->f_vector[f->f_count++] = ss;
 
   ss->s_power = POWER_NA;
   ss->s_name = strdup(name);
@@ -178,8 +280,20 @@ int add_roach(struct state *ss, char *name)
     return -1;
   }
 
-  if(inet_aton(name, &(ss->s_sa.sin_addr)) == 0){
-    he = gethostbyname(name);
+  port = DEFAULT_PORT;
+
+  ptr = strchr(ss->s_name, ':');
+  if(ptr){
+    *ptr = '\0';
+    port = atoi(ptr + 1);
+    if((port <= 0) || (port > 0xffff)){
+      sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "invalid port in %s", name);
+      return -1;
+    }
+  }
+
+  if(inet_aton(ss->s_name, &(ss->s_sa.sin_addr)) == 0){
+    he = gethostbyname(ss->s_name);
     if((he == NULL) || (he->h_addrtype != AF_INET)){
       sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "unable to resolve roach name %s", name);
       return -1;
@@ -188,7 +302,7 @@ int add_roach(struct state *ss, char *name)
     }
   }
 
-  ss->s_sa.sin_port = htons(DEFAULT_PORT);
+  ss->s_sa.sin_port = htons(port);
   ss->s_sa.sin_family = AF_INET;
 
   return 0;
@@ -811,6 +925,46 @@ int complete_write_item(struct state *ss, int tag)
   return ITEM_OK;
 }
 
+int stagger_item(struct state *ss, int tag)
+{
+  struct fleet *f;
+  struct timeval now, delta;
+
+  if(ss->s_power == POWER_ON){
+    return ITEM_ALT;
+  }
+
+  if(ss->s_transition != ITEM_STAY){ /* already holding a slot, waiting for it to come round */
+    return ITEM_STAY;
+  }
+
+  f = ss->s_fleet;
+
+  if((f->f_stagger.tv_sec == 0) && (f->f_stagger.tv_usec == 0)){
+    return ITEM_OK;
+  }
+
+  gettimeofday(&now, NULL);
+
+  if(cmp_time_katcp(&(f->f_slot), &now) <= 0){
+    add_time_katcp(&(f->f_slot), &now, &(f->f_stagger));
+    return ITEM_OK;
+  }
+
+  /* reserve the next free slot, so that power ups are spaced out to limit inrush */
+  sub_time_katcp(&delta, &(f->f_slot), &now);
+  add_time_katcp(&(f->f_slot), &(f->f_slot), &(f->f_stagger));
+
+  /* time spent queueing is not held against the unit */
+  add_time_katcp(&(ss->s_total), &(ss->s_total), &delta);
+
+  log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "roach %s will be powered up in %lu.%03lus", ss->s_name, delta.tv_sec, delta.tv_usec / 1000);
+
+  set_timeout(ss, delta.tv_sec, delta.tv_usec, ITEM_OK);
+
+  return ITEM_STAY;
+}
+
 int sleep_item(struct state *ss, int tag)
 {
   if(tag > 0){
@@ -832,9 +986,12 @@ int sleep_item(struct state *ss, int tag)
 
 void usage(char *app)
 {
-  printf("usage: %s [flags] xport\n", app);
+  printf("usage: %s [flags] xport [xport ...]\n", app);
   printf("-h                 this help\n");
-  printf("-t seconds         length of time to retry executing command in case of failure");
+  printf("-t seconds         length of time to retry executing command in case of failure, per xport\n");
+  printf("-r count           number of times to start over on an xport which timed out\n");
+  printf("-s milliseconds    minimum interval between powering up xports, to limit inrush\n");
+  printf("-w seconds         time to allow a roach to boot after power up\n");
 
 #if 0
   printf("-v                 increase verbosity\n");
@@ -845,15 +1002,20 @@ void usage(char *app)
   printf("-Q                 query power status\n");
   printf("-D                 power down\n");
 
+  printf("xports may be given as host:port, the default port is %d\n", DEFAULT_PORT);
+  printf("with more than one xport a %s sensor reports progress\n", PROGRESS_SENSOR_NAME);
+
   printf("return codes:\n");
-  printf("0     command completed successfully\n");
-  printf("1     command failed\n");
+  printf("0     command completed successfully (on all xports)\n");
+  printf("1     command failed (on at least one xport)\n");
   printf("2     usage problems\n");
   printf("3     network problems\n");
   printf("4     internal errors\n");
 }
 
-struct item poweron_table[11] = {
+#define POWERON_BOOT 11
+
+struct item poweron_table[12] = {
   { setup_network_item,       2,  0,  0,  0 },   /* 0 */
   { reset_item,               0,  0,  0,  0 },   /* 1 */  
   { complete_network_item,    3,  1,  0,  0 },   /* 2 */ 
@@ -861,10 +1023,11 @@ struct item poweron_table[11] = {
   { decode_ping_item,         5,  1,  0,  0 },   /* 4 */
   { request_read_item,        6,  1,  0,  REGISTER_POWERSTATE }, /* 5 */
   { decode_powerstatus_item,  7,  1,  0,  0 },   /* 6 */
-  { turn_on_item,             8,  1, 10,  0 },   /* 7 */
-  { complete_write_item,      9,  1,  0,  0 },   /* 8 */
-  { sleep_item,               5,  1,  0,  5 },   /* 9 - poll pause, wait, then retry */
-  { sleep_item,              -1,  1,  0, 45 }   /* 10 - final pause, bit of time to boot up */
+  { stagger_item,             8,  1, 11,  0 },   /* 7 - wait for a free power up slot */
+  { turn_on_item,             9,  1, 11,  0 },   /* 8 */
+  { complete_write_item,     10,  1,  0,  0 },   /* 9 */
+  { sleep_item,               5,  1,  0,  5 },   /* 10 - poll pause, wait, then retry */
+  { sleep_item,              -1,  1,  0, 45 }    /* 11 - final pause, bit of time to boot up */
 };
 
 struct item powerdown_table[9] = {
@@ -889,44 +1052,230 @@ struct item powerquery_table[7] = {
   { decode_powerstatus_item, -1,  0,  0,  0 },   /* 6 */
 };
 
+/*********************************************************************/
+
+static void report_progress(struct fleet *f, int list)
+{
+  struct timeval now;
+
+  if(f->f_count <= 1){ /* a single xport reports through its exit code, as before */
+    return;
+  }
+
+  if(list){
+    append_string_katcl(f->f_up, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, KATCP_SENSOR_LIST_INFORM);
+    append_string_katcl(f->f_up,                    KATCP_FLAG_STRING, PROGRESS_SENSOR_NAME);
+    append_string_katcl(f->f_up,                    KATCP_FLAG_STRING, PROGRESS_SENSOR_DESCRIPTION);
+    append_string_katcl(f->f_up,                    KATCP_FLAG_STRING, "none");
+    append_string_katcl(f->f_up,                    KATCP_FLAG_STRING, "integer");
+    append_unsigned_long_katcl(f->f_up,             KATCP_FLAG_ULONG, 0);
+    append_unsigned_long_katcl(f->f_up, KATCP_FLAG_LAST | KATCP_FLAG_ULONG, f->f_count);
+  }
+
+  gettimeofday(&now, NULL);
+
+  append_string_katcl(f->f_up, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, KATCP_SENSOR_STATUS_INFORM);
+  append_args_katcl  (f->f_up,                    KATCP_FLAG_STRING, "%ld%03u", now.tv_sec, (unsigned int)(now.tv_usec / 1000));
+  append_string_katcl(f->f_up,                    KATCP_FLAG_STRING, "1");
+  append_string_katcl(f->f_up,                    KATCP_FLAG_STRING, PROGRESS_SENSOR_NAME);
+  append_string_katcl(f->f_up,                    KATCP_FLAG_STRING, f->f_failed ? "warn" : "nominal");
+  append_unsigned_long_katcl(f->f_up, KATCP_FLAG_LAST | KATCP_FLAG_ULONG, f->f_done);
+}
+
+static void finish_state(struct fleet *f, struct state *ss)
+{
+  ss->s_running = 0;
+
+  if(ss->s_fd >= 0){
+    close(ss->s_fd);
+    ss->s_fd = (-1);
+  }
+
+  f->f_done++;
+  if(ss->s_code == ITEM_FAIL){
+    f->f_failed++;
+  }
+
+  if(f->f_count > 1){
+    if(ss->s_code == ITEM_FAIL){
+      log_message_katcl(f->f_up, KATCP_LEVEL_WARN, NAME, "power operation on roach %s failed", ss->s_name);
+    } else {
+      log_message_katcl(f->f_up, KATCP_LEVEL_INFO, NAME, "power operation on roach %s completed", ss->s_name);
+    }
+    report_progress(f, 0);
+  }
+}
+
+/* advance the logic of one xport, returns 0 if still busy, 1 once in a terminal state */
+
+static int run_state(struct state *ss, struct timeval *target, int *valid)
+{
+  struct timeval now, delta;
+  struct item *ix;
+  int code;
+
+  if(ss->s_index >= ss->s_size){
+    return 1;
+  }
+
+  ix = &(ss->s_table[ss->s_index]);
+  code = (*(ix->i_call))(ss, ix->i_tag);
+
+#ifdef DEBUG 
+  fprintf(stderr, "run[%s]: state=%u, code=%d\n", ss->s_name, ss->s_index, code);
+#endif
+  if(ss->s_fleet->f_verbose > 1){
+    log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "roach=%s, state=%u, code=%d", ss->s_name, ss->s_index, code);
+  }
+
+  switch(code){
+    case ITEM_STAY : 
+      /* do nothing */
+      break;
+    case ITEM_OK : 
+      ss->s_transition = ITEM_STAY;
+      ss->s_index = ix->i_ok;
+      ss->s_code = code;
+      break;
+    case ITEM_FAIL :
+      ss->s_transition = ITEM_STAY;
+      ss->s_index = ix->i_fail;
+      ss->s_code = code;
+      break;
+    case ITEM_ALT : 
+      ss->s_transition = ITEM_STAY;
+      ss->s_index = ix->i_alt;
+      ss->s_code = code;
+      break;
+    default :
+      sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "bad state return code %d", code);
+      return -1;
+  }
+
+  if(ss->s_index >= ss->s_size){
+    log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "roach %s entered terminal state with code %d", ss->s_name, code);
+    return 1;
+  }
+
+  gettimeofday(&now, NULL);
+
+  if(ss->s_transition != ITEM_STAY){ /* check if there is a per node timeout */
+    if(ss->s_max < 0){
+      init_fd(ss);
+    }
+
+    if(cmp_time_katcp(&now, &(ss->s_single)) >= 0){
+      code = ss->s_transition;
+
+      ss->s_transition = ITEM_STAY;
+      ss->s_max = (-1);
+      switch(code){
+        case ITEM_OK : 
+          ss->s_index = ix->i_ok;
+          break;
+        case ITEM_FAIL : 
+          ss->s_index = ix->i_fail;
+          break;
+        case ITEM_ALT : 
+          ss->s_index = ix->i_alt;
+          break;
+        default :
+          sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "logic failure, unreasonable return code %d", code);
+          break;
+      }
+      ss->s_code = code;
+
+      log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "timeout occurred, transition to %s state %d", item_names[code], ss->s_index);
+
+    } else {
+      if((*valid == 0) || (cmp_time_katcp(&(ss->s_single), target) < 0)){
+        target->tv_sec = ss->s_single.tv_sec;
+        target->tv_usec = ss->s_single.tv_usec;
+        *valid = 1;
+      }
+    }
+  } 
+
+  if(ss->s_limit > 0){ /* check if overall timeout has been reached */
+    if(cmp_time_katcp(&now, &(ss->s_total)) >= 0){
+      if(ss->s_attempt < ss->s_fleet->f_retries){
+        ss->s_attempt++;
+        log_message_katcl(ss->s_up, KATCP_LEVEL_WARN, NAME, "operations on roach %s timed out after %u seconds, starting attempt %u of %u", ss->s_name, ss->s_limit, ss->s_attempt + 1, ss->s_fleet->f_retries + 1);
+
+        reset_item(ss, 0);
+        ss->s_index = 0;
+        ss->s_transition = ITEM_STAY;
+        ss->s_max = (-1);
+
+        delta.tv_sec = ss->s_limit;
+        delta.tv_usec = 0;
+        add_time_katcp(&(ss->s_total), &now, &delta);
+
+        return 0;
+      }
+
+      log_message_katcl(ss->s_up, KATCP_LEVEL_WARN, NAME, "operations on roach %s timed out after %u seconds", ss->s_name, ss->s_limit);
+      ss->s_code = ITEM_FAIL;
+      return 1;
+    } else {
+      if((*valid == 0) || (cmp_time_katcp(&(ss->s_total), target) < 0)){
+        target->tv_sec = ss->s_total.tv_sec;
+        target->tv_usec = ss->s_total.tv_usec;
+        *valid = 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* hand the results of the shared select back to an xport, as if it had done its own */
+
+static void split_fd(struct state *ss, fd_set *fsr, fd_set *fsw)
+{
+  int fd, r, w;
+
+  fd = ss->s_fd;
+  r = 0;
+  w = 0;
+
+  if(fd >= 0){
+    r = FD_ISSET(fd, &(ss->s_fsr)) && FD_ISSET(fd, fsr);
+    w = FD_ISSET(fd, &(ss->s_fsw)) && FD_ISSET(fd, fsw);
+  }
+
+  FD_ZERO(&(ss->s_fsr));
+  FD_ZERO(&(ss->s_fsw));
+
+  if(r){
+    FD_SET(fd, &(ss->s_fsr));
+  }
+  if(w){
+    FD_SET(fd, &(ss->s_fsw));
+  }
+
+  ss->s_max = (-1);
+}
+
 int main(int argc, char **argv)
 {
+  struct fleet *f;
   struct state *ss;
-  int i, j, c, fd, verbose, result, run, power, code, valid, timeout;
-#if 0
-  unsigned int value, address;
-#endif
+  int i, j, c, fd, result, run, power, timeout, stagger, boot, valid, busy, max, stopped;
+  unsigned int k;
   struct timeval now, target, delta;
-  int *(call)(struct state *s, int tag);
-  struct item *ix;
+  fd_set fsr, fsw;
 
-  ss = create_state(STDOUT_FILENO);
-  if(ss == NULL){
+  f = create_fleet(STDOUT_FILENO);
+  if(f == NULL){
     return 4;
   }
 
   timeout = DEFAULT_TOTAL;
   power = POWER_ON;
+  stagger = 0;
+  boot = (-1);
 
-#if 0
-  char *app, *parm, *cmd, *copy, *ptr, *servers;
-  int verbose, result, status, base, info, reply, timeout, pos, flags, show;
-  int xmit, code;
-  unsigned int len;
-  
-  info = 1;
-  reply = 1;
-  i = j = 1;
-  app = argv[0];
-  base = (-1);
-  timeout = 5;
-  pos = (-1);
-  k = NULL;
-  show = 1;
-  parm = NULL;
-#endif
-
-  verbose = 1;
   i = j = 1;
 
   while (i < argc) {
@@ -953,21 +1302,33 @@ int main(int argc, char **argv)
           j++;
           break;
 
+        case 'r' :
+        case 's' :
         case 't' :
+        case 'w' :
           j++;
           if (argv[i][j] == '\0') {
             j = 0;
             i++;
           }
           if (i >= argc) {
-            sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "timeout needs a parameter");
+            sync_message_katcl(f->f_up, KATCP_LEVEL_ERROR, NAME, "option -%c needs a parameter", c);
             return 2;
           }
 
           switch(c){
+            case 'r' :
+              f->f_retries = atoi(argv[i] + j);
+              break;
+            case 's' :
+              stagger = atoi(argv[i] + j);
+              break;
             case 't' :
               timeout = atoi(argv[i] + j);
               break;
+            case 'w' :
+              boot = atoi(argv[i] + j);
+              break;
           }
 
           i++;
@@ -975,11 +1336,11 @@ int main(int argc, char **argv)
           break;
           
         case 'v' : 
-          verbose++;
+          f->f_verbose++;
           j++;
           break;
         case 'q' : 
-          verbose = 0;
+          f->f_verbose = 0;
           j++;
           break;
 
@@ -992,214 +1353,173 @@ int main(int argc, char **argv)
           break;
 
         default:
-          sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "unknown option -%c", argv[i][j]);
+          sync_message_katcl(f->f_up, KATCP_LEVEL_ERROR, NAME, "unknown option -%c", argv[i][j]);
           return 2;
       }
     } else {
 
-      if(add_roach(ss, argv[i]) < 0){
-        sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "unable to add roach %s", argv[i]);
+      if(add_roach(f, argv[i]) < 0){
+        sync_message_katcl(f->f_up, KATCP_LEVEL_ERROR, NAME, "unable to add roach %s", argv[i]);
         return 4;
       }
       i++;
     }
   }
 
-  ss->s_limit = timeout;
-
-  switch(power){
-    case POWER_ON :
-      load_table(ss, poweron_table, 11);
-      break;
-    case POWER_OFF :
-      load_table(ss, powerdown_table, 9);
-      break;
-    case POWER_NA : /* overloading of a macro */
-      load_table(ss, powerquery_table, 7);
-      break;
-    default :
-      sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "logic problem - bad power request type");
-      return 4;
-  }
-
-  if(ss->s_name == NULL){
-    sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "need a roach xport to talk to");
+  if(f->f_count == 0){
+    sync_message_katcl(f->f_up, KATCP_LEVEL_ERROR, NAME, "need a roach xport to talk to");
     return 2;
   }
 
-
-  if(ss->s_table == NULL){
-    sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "need a table to be loaded");
-    return 2;
+  if(stagger > 0){
+    f->f_stagger.tv_sec = stagger / 1000;
+    f->f_stagger.tv_usec = (stagger % 1000) * 1000;
   }
 
-  gettimeofday(&now, NULL);
-
-  if(ss->s_limit > 0){
-    delta.tv_sec = ss->s_limit;
-    delta.tv_usec = 0;
+  if(boot >= 0){
+    poweron_table[POWERON_BOOT].i_tag = boot;
   }
 
-  add_time_katcp(&(ss->s_total), &now, &delta);
-
-  run = 1;
-  code = ITEM_OK;
+  gettimeofday(&now, NULL);
 
-  for(run = 1; run > 0; ){
+  delta.tv_sec = (timeout > 0) ? timeout : 0;
+  delta.tv_usec = 0;
 
-    if(ss->s_index >= ss->s_size){
-      run = 0;
-      continue;
-    }
+  for(k = 0; k < f->f_count; k++){
+    ss = f->f_vector[k];
 
-    ix = &(ss->s_table[ss->s_index]);
-    code = (*(ix->i_call))(ss, ix->i_tag);
+    ss->s_limit = (timeout > 0) ? timeout : 0;
 
-#ifdef DEBUG 
-    fprintf(stderr, "run: state=%u, code=%d\n", ss->s_index, code);
-#endif
-    if(verbose > 1){
-      log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "state=%u, code=%d", ss->s_index, code);
-    }
-
-    switch(code){
-      case ITEM_STAY : 
-        /* do nothing */
-        break;
-      case ITEM_OK : 
-        ss->s_transition = ITEM_STAY;
-        ss->s_index = ix->i_ok;
+    switch(power){
+      case POWER_ON :
+        load_table(ss, poweron_table, 12);
         break;
-      case ITEM_FAIL :
-        ss->s_transition = ITEM_STAY;
-        ss->s_index = ix->i_fail;
+      case POWER_OFF :
+        load_table(ss, powerdown_table, 9);
         break;
-      case ITEM_ALT : 
-        ss->s_transition = ITEM_STAY;
-        ss->s_index = ix->i_alt;
+      case POWER_NA : /* overloading of a macro */
+        load_table(ss, powerquery_table, 7);
         break;
       default :
-        sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "bad state return code %d", code);
+        sync_message_katcl(f->f_up, KATCP_LEVEL_ERROR, NAME, "logic problem - bad power request type");
         return 4;
     }
 
-    if(ss->s_index >= ss->s_size){
-      log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "entered terminal state with code %d", code);
-      run = 0;
-      continue; /* break out of while loop */
-    }
+    add_time_katcp(&(ss->s_total), &now, &delta);
+    ss->s_running = 1;
+  }
 
-#if 0
-    sleep(1);
-#endif
+  report_progress(f, 1);
+
+  stopped = 0;
+
+  for(run = 1; run > 0; ){
 
-    gettimeofday(&now, NULL);
     valid = 0;
+    busy = 0;
+
+    fd = fileno_katcl(f->f_up);
+
+    FD_ZERO(&fsr);
+    FD_ZERO(&fsw);
+
+    FD_SET(fd, &fsr);
+    max = fd;
 
-    if(ss->s_transition != ITEM_STAY){ /* check if there is a per node timeout */
-      if(ss->s_max < 0){
-        init_fd(ss);
+    for(k = 0; k < f->f_count; k++){
+      ss = f->f_vector[k];
+      if(ss->s_running == 0){
+        continue;
       }
 
-      if(cmp_time_katcp(&now, &(ss->s_single)) >= 0){
-        code = ss->s_transition;
+      result = run_state(ss, &target, &valid);
+      if(result < 0){
+        return 4;
+      }
+      if(result > 0){
+        finish_state(f, ss);
+        continue;
+      }
 
-        ss->s_transition = ITEM_STAY;
-        ss->s_max = (-1);
-        switch(code){
-          case ITEM_OK : 
-            ss->s_index = ix->i_ok;
-            break;
-          case ITEM_FAIL : 
-            ss->s_index = ix->i_fail;
-            break;
-          case ITEM_ALT : 
-            ss->s_index = ix->i_alt;
-            break;
-          default :
-            sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "logic failure, unreasonable return code %d", code);
-            break;
-        }
-
-        log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "timeout occurred, transition to %s state %d", item_names[code], ss->s_index);
+      if(ss->s_max < 0){ /* made progress without needing io, come back immediately */
+        busy = 1;
+        continue;
+      }
 
-      } else {
-        target.tv_sec = ss->s_single.tv_sec;
-        target.tv_usec = ss->s_single.tv_usec;
-        valid = 1;
+      if((ss->s_fd >= 0) && FD_ISSET(ss->s_fd, &(ss->s_fsr))){
+        FD_SET(ss->s_fd, &fsr);
       }
-    } 
-
-    if(ss->s_limit > 0){ /* check if overall timeout has been reached */
-      if(cmp_time_katcp(&now, &(ss->s_total)) >= 0){
-        log_message_katcl(ss->s_up, KATCP_LEVEL_WARN, NAME, "operations timed out after %u seconds", ss->s_limit);
-        code = ITEM_FAIL;
-        run = 0;
-        continue; /* break out of while loop */
-      } else {
-        if((valid == 0) || (cmp_time_katcp(&(ss->s_total), &target) < 0)){
-          target.tv_sec = ss->s_total.tv_sec;
-          target.tv_usec = ss->s_total.tv_usec;
-          valid = 1;
-        }
+      if((ss->s_fd >= 0) && FD_ISSET(ss->s_fd, &(ss->s_fsw))){
+        FD_SET(ss->s_fd, &fsw);
+      }
+      if(ss->s_max > max){
+        max = ss->s_max;
       }
     }
 
-    if(valid){
+    if(f->f_done >= f->f_count){
+      run = 0;
+      continue;
+    }
+
+    if(flushing_katcl(f->f_up)){
+      FD_SET(fd, &fsw);
+    }
+
+    if(busy){
+      delta.tv_sec = 0;
+      delta.tv_usec = 0;
+      valid = 1;
+    } else if(valid){
+      gettimeofday(&now, NULL);
       sub_time_katcp(&delta, &target, &now);
     }
 
-    if(ss->s_max >= 0){ /* are we waiting for io (optionally with timeout) ? */
-      result = select(ss->s_max + 1, &(ss->s_fsr), &(ss->s_fsw), NULL, valid ? &delta : NULL);
-      switch(result){
-        case -1 :
-          switch(errno){
-            case EAGAIN :
-            case EINTR  :
-              continue; /* WARNING */
-            default  :
-              sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "select failed: %s", strerror(errno));
-              return 4;
-          }
-          break;
-#if 0
-        case  0 :
-          sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "requests timed out despite having no timeout");
-          /* could terminate cleanly here, but ... */
+    result = select(max + 1, &fsr, &fsw, NULL, valid ? &delta : NULL);
+    if(result < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          continue; /* WARNING */
+        default  :
+          sync_message_katcl(f->f_up, KATCP_LEVEL_ERROR, NAME, "select failed: %s", strerror(errno));
           return 4;
-#endif
       }
+    }
 
-      /* this falls into the housekeeping category */
-      fd = fileno_katcl(ss->s_up);
-      if(FD_ISSET(fd, &(ss->s_fsr))){
-        result = read_katcl(ss->s_up);
-        if(result > 0){
-          code = ITEM_OK;
-          run = 0; /* end loop, but not immediately */
-        }
-
-        /* discard all upstream requests */
-        while(have_katcl(ss->s_up) > 0);
+    for(k = 0; k < f->f_count; k++){
+      ss = f->f_vector[k];
+      if(ss->s_running && (ss->s_max >= 0)){
+        split_fd(ss, &fsr, &fsw);
       }
+    }
 
-      if(FD_ISSET(fd, &(ss->s_fsw))){
-        result = write_katcl(ss->s_up);
+    /* this falls into the housekeeping category */
+    if(FD_ISSET(fd, &fsr)){
+      result = read_katcl(f->f_up);
+      if(result > 0){
+        stopped = 1;
+        run = 0; /* end loop, but not immediately */
       }
 
-      ss->s_max = (-1);
+      /* discard all upstream requests */
+      while(have_katcl(f->f_up) > 0);
     }
 
+    if(FD_ISSET(fd, &fsw)){
+      result = write_katcl(f->f_up);
+    }
+  }
+
+  if(stopped){
+    log_message_katcl(f->f_up, KATCP_LEVEL_INFO, NAME, "upstream went away, abandoning %u of %u xports", f->f_count - f->f_done, f->f_count);
   }
 
+  result = f->f_failed ? 1 : 0;
+
   /* force drain */
-  while(write_katcl(ss->s_up) == 0);
-  destroy_state(ss);
+  while(write_katcl(f->f_up) == 0);
+  destroy_fleet(f);
 
-  if(code != ITEM_FAIL){
-    return 0;
-  } else {
-    return 1;
-  }
+  return result;
 }
-